@@ -29,6 +29,8 @@
 ConVar rr_debugresponses( "rr_debugresponses", "0", FCVAR_NONE, "Show verbose matching output (1 for simple, 2 for rule scoring). If set to 3, it will only show response success/failure for npc_selected NPCs." );
 ConVar rr_debugrule( "rr_debugrule", "", FCVAR_NONE, "If set to the name of the rule, that rule's score will be shown whenever a concept is passed into the response rules system.");
 ConVar rr_dumpresponses( "rr_dumpresponses", "0", FCVAR_NONE, "Dump all response_rules.txt and rules (requires restart)" );
+ConVar rr_ruleindex( "rr_ruleindex", "1", FCVAR_NONE, "Use the concept index to narrow down the rules scored for each query." );
+ConVar rr_ruleindex_crosscheck( "rr_ruleindex_crosscheck", "0", FCVAR_NONE, "Verify every indexed rule query against a full scan of the rules and warn on mismatches." );
 
 static CUtlSymbolTable g_RS;
 
@@ -683,6 +685,12 @@ public:
 	float		LookupEnumeration( const char *name, bool& found );
 
 	int			FindBestMatchingRule( const AI_CriteriaSet& set, bool verbose );
+	float		CollectBestMatchingRules( const AI_CriteriaSet& set, const CUtlVector< unsigned short > *pCandidates, CUtlVector< int >& bestrules, bool verbose );
+
+	void		InvalidateRuleIndex() { m_bRuleIndexDirty = true; }
+	void		BuildRuleIndex();
+	const char	*GetRuleIndexKey( int irule );
+	const CUtlVector< unsigned short > *GetIndexedCandidateRules( const AI_CriteriaSet& set );
 
 	float		ScoreCriteriaAgainstRule( const AI_CriteriaSet& set, int irule, bool verbose = false );
 	float		RecursiveScoreSubcriteriaAgainstRule( const AI_CriteriaSet& set, Criteria *parent, bool& exclude, bool verbose /*=false*/ );
@@ -710,6 +718,15 @@ public:
 	CUtlDict< Rule, short >	m_Rules;
 	CUtlDict< Enumeration, short > m_Enumerations;
 
+	// Rules bucketed by the value their required "concept" criterion must
+	// equal. Each bucket also holds every rule that can't be bucketed, in
+	// rule order, so a query only has to score a single list.
+	CUtlDict< int, short >	m_RuleIndexBuckets;
+	CUtlVector< CUtlVector< unsigned short > > m_RuleIndexBucketRules;
+	CUtlVector< unsigned short >	m_UnindexedRules;
+	int			m_nRuleIndexRuleCount;
+	bool		m_bRuleIndexDirty;
+
 	char		token[ 1204 ];
 
 	bool		m_bUnget;
@@ -762,6 +779,8 @@ CResponseSystem::CResponseSystem()
 	m_bUnget = false;
 	m_bPrecache = true;
 	m_bCustomManagable = false;
+	m_nRuleIndexRuleCount = 0;
+	m_bRuleIndexDirty = true;
 }
 
 //-----------------------------------------------------------------------------
@@ -817,6 +836,7 @@ void CResponseSystem::Clear()
 	m_Criteria.RemoveAll();
 	m_Rules.RemoveAll();
 	m_Enumerations.RemoveAll();
+	InvalidateRuleIndex();
 }
 
 //-----------------------------------------------------------------------------
@@ -1685,27 +1705,40 @@ bool CResponseSystem::GetBestResponse( ResponseSearchResult& searchResult, Rule
 int CResponseSystem::FindBestMatchingRule( const AI_CriteriaSet& set, bool verbose )
 {
 	CUtlVector< int >	bestrules;
-	float bestscore = 0.001f;
 
-	int c = m_Rules.Count();
-	int i;
-	for ( i = 0; i < c; i++ )
+	// Debugging output wants to see every rule scored, so skip the index then.
+	const char *pszDebugRule = rr_debugrule.GetString();
+	bool bUseIndex = rr_ruleindex.GetBool() && !verbose && !( pszDebugRule && pszDebugRule[0] );
+
+	if ( bUseIndex )
 	{
-		float score = ScoreCriteriaAgainstRule( set, i, verbose );
-		// Check equals so that we keep track of all matching rules
-		if ( score >= bestscore )
+		float bestscore = CollectBestMatchingRules( set, GetIndexedCandidateRules( set ), bestrules, verbose );
+
+		if ( rr_ruleindex_crosscheck.GetBool() )
 		{
-			// Reset bucket
-			if( score != bestscore )
+			CUtlVector< int > checkrules;
+			float checkscore = CollectBestMatchingRules( set, NULL, checkrules, verbose );
+
+			bool bMatch = ( checkscore == bestscore ) && ( checkrules.Count() == bestrules.Count() );
+			for ( int i = 0; bMatch && i < checkrules.Count(); i++ )
 			{
-				bestscore = score;
-				bestrules.RemoveAll();
+				bMatch = ( checkrules[ i ] == bestrules[ i ] );
 			}
 
-			// Add to bucket
-			bestrules.AddToTail( i );
+			if ( !bMatch )
+			{
+				int iConcept = set.FindCriterionIndex( "concept" );
+				Warning( "CResponseSystem:  rule index mismatch for concept '%s' (%i indexed vs. %i scanned matches)\n",
+					( iConcept != -1 ) ? set.GetValue( iConcept ) : "", bestrules.Count(), checkrules.Count() );
+				bestrules.RemoveAll();
+				bestrules.AddVectorToTail( checkrules );
+			}
 		}
 	}
+	else
+	{
+		CollectBestMatchingRules( set, NULL, bestrules, verbose );
+	}
 
 	int bestCount = bestrules.Count();
 	if ( bestCount <= 0 )
@@ -1723,6 +1756,132 @@ int CResponseSystem::FindBestMatchingRule( const AI_CriteriaSet& set, bool verbo
 	return bestrules[ idx ];
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Scores the candidate rules (or all rules if pCandidates is NULL)
+//			and fills in the highest scoring ones, in rule order
+// Output : float - the best score
+//-----------------------------------------------------------------------------
+float CResponseSystem::CollectBestMatchingRules( const AI_CriteriaSet& set, const CUtlVector< unsigned short > *pCandidates, CUtlVector< int >& bestrules, bool verbose )
+{
+	float bestscore = 0.001f;
+
+	int c = pCandidates ? pCandidates->Count() : m_Rules.Count();
+	int i;
+	for ( i = 0; i < c; i++ )
+	{
+		int irule = pCandidates ? (*pCandidates)[ i ] : i;
+
+		float score = ScoreCriteriaAgainstRule( set, irule, verbose );
+		// Check equals so that we keep track of all matching rules
+		if ( score >= bestscore )
+		{
+			// Reset bucket
+			if( score != bestscore )
+			{
+				bestscore = score;
+				bestrules.RemoveAll();
+			}
+
+			// Add to bucket
+			bestrules.AddToTail( irule );
+		}
+	}
+
+	return bestscore;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the value a rule's "concept" must equal for the rule to
+//			score at all, or NULL if the rule can match any concept
+//-----------------------------------------------------------------------------
+const char *CResponseSystem::GetRuleIndexKey( int irule )
+{
+	Rule *rule = &m_Rules[ irule ];
+
+	int count = rule->m_Criteria.Count();
+	for ( int i = 0; i < count; i++ )
+	{
+		Criteria *c = &m_Criteria[ rule->m_Criteria[ i ] ];
+		if ( c->IsSubCriteriaType() || !c->required || !c->name || Q_stricmp( c->name, "concept" ) )
+			continue;
+
+		// Only plain string equality can be bucketed, anything else is scored normally
+		Matcher &m = c->matcher;
+		if ( !m.valid || m.isnumeric || m.notequal || m.usemin || m.usemax )
+			continue;
+
+		return m.GetToken();
+	}
+
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Buckets the rules by concept. A required criterion that fails
+//			zeroes the rule's score, so a rule can only win a query whose
+//			concept matches its bucket.
+//-----------------------------------------------------------------------------
+void CResponseSystem::BuildRuleIndex()
+{
+	m_RuleIndexBuckets.RemoveAll();
+	m_RuleIndexBucketRules.Purge();
+	m_UnindexedRules.RemoveAll();
+
+	int c = m_Rules.Count();
+	for ( int i = 0; i < c; i++ )
+	{
+		const char *pszKey = GetRuleIndexKey( i );
+		if ( !pszKey )
+		{
+			// Goes in every bucket
+			m_UnindexedRules.AddToTail( i );
+			for ( int b = 0; b < m_RuleIndexBucketRules.Count(); b++ )
+			{
+				m_RuleIndexBucketRules[ b ].AddToTail( i );
+			}
+			continue;
+		}
+
+		int idx = m_RuleIndexBuckets.Find( pszKey );
+		if ( idx == m_RuleIndexBuckets.InvalidIndex() )
+		{
+			// New bucket starts out with the unindexed rules seen so far, which all precede this one
+			int b = m_RuleIndexBucketRules.AddToTail();
+			m_RuleIndexBucketRules[ b ].AddVectorToTail( m_UnindexedRules );
+			idx = m_RuleIndexBuckets.Insert( pszKey, b );
+		}
+
+		m_RuleIndexBucketRules[ m_RuleIndexBuckets[ idx ] ].AddToTail( i );
+	}
+
+	m_nRuleIndexRuleCount = c;
+	m_bRuleIndexDirty = false;
+
+	DevMsg( 2, "CResponseSystem:  indexed %i rules into %i concepts (%i unindexed)\n",
+		c, m_RuleIndexBucketRules.Count(), m_UnindexedRules.Count() );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the rules that could possibly match this criteria set
+//-----------------------------------------------------------------------------
+const CUtlVector< unsigned short > *CResponseSystem::GetIndexedCandidateRules( const AI_CriteriaSet& set )
+{
+	if ( m_bRuleIndexDirty || m_nRuleIndexRuleCount != m_Rules.Count() )
+	{
+		BuildRuleIndex();
+	}
+
+	int iConcept = set.FindCriterionIndex( "concept" );
+	if ( iConcept != -1 && set.GetValue( iConcept ) )
+	{
+		int idx = m_RuleIndexBuckets.Find( set.GetValue( iConcept ) );
+		if ( idx != m_RuleIndexBuckets.InvalidIndex() )
+			return &m_RuleIndexBucketRules[ m_RuleIndexBuckets[ idx ] ];
+	}
+
+	return &m_UnindexedRules;
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: 
 // Input  : set - 
@@ -2003,6 +2162,8 @@ void CResponseSystem::LoadRuleSet( const char *basescript )
 
 	UTIL_FreeFile( buffer );
 
+	InvalidateRuleIndex();
+
 	Assert( m_ScriptStack.Count() == 0 );
 }
 
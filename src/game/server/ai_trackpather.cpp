@@ -1316,7 +1316,7 @@ void CAI_TrackPather::UpdateTrackNavigation( void )
 	if ( ( CPathTrack::ValidPath( m_pDestPathTarget ) == NULL ) && ( m_target != NULL_STRING ) )
 	{
 		FlyToPathTrack( m_target );
-		m_target = NULL_STRING;
+		SetTargetEntityName( NULL_STRING );
 	}
 
 	if ( !IsLeading() )
@@ -20,6 +20,7 @@
 #include "isaverestore.h"
 #include "KeyValues.h"
 #include "tier0/vprof.h"
+#include "vstdlib/jobthread.h"
 #include "EntityFlame.h"
 #include "EntityDissolve.h"
 #include "ai_basenpc.h"
@@ -2582,6 +2583,25 @@ void CBaseAnimating::UnlockStudioHdr()
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: the bones GetBoneCache keeps
+//-----------------------------------------------------------------------------
+static int GetBoneCacheMask()
+{
+	int boneMask = BONE_USED_BY_HITBOX | BONE_USED_BY_ATTACHMENT;
+
+	// TF queries these bones to position weapons when players are killed
+#if defined( TF_DLL ) || defined( TF_MOD )
+	boneMask |= BONE_USED_BY_BONE_MERGE;
+#endif
+	return boneMask;
+}
+
+static bool IsBoneCacheCurrent( CBoneCache *pcache, int boneMask )
+{
+	return pcache->IsValid( gpGlobals->curtime ) && (pcache->m_boneMask & boneMask) == boneMask && pcache->m_timeValid <= gpGlobals->curtime;
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: return the index to the shared bone cache
 // Output :
@@ -2592,15 +2612,11 @@ CBoneCache *CBaseAnimating::GetBoneCache( void )
 	Assert(pStudioHdr);
 
 	CBoneCache *pcache = Studio_GetBoneCache( m_boneCacheHandle );
-	int boneMask = BONE_USED_BY_HITBOX | BONE_USED_BY_ATTACHMENT;
+	int boneMask = GetBoneCacheMask();
 
-	// TF queries these bones to position weapons when players are killed
-#if defined( TF_DLL ) || defined( TF_MOD )
-	boneMask |= BONE_USED_BY_BONE_MERGE;
-#endif
 	if ( pcache )
 	{
-		if ( pcache->IsValid( gpGlobals->curtime ) && (pcache->m_boneMask & boneMask) == boneMask && pcache->m_timeValid <= gpGlobals->curtime)
+		if ( IsBoneCacheCurrent( pcache, boneMask ) )
 		{
 			// Msg("%s:%s:%s (%x:%x:%8.4f) cache\n", GetClassname(), GetDebugName(), STRING(GetModelName()), boneMask, pcache->m_boneMask, pcache->m_timeValid );
 			// in memory and still valid, use it!
@@ -2639,6 +2655,132 @@ CBoneCache *CBaseAnimating::GetBoneCache( void )
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Checks the SIMD bone blends against the scalar ones
+//-----------------------------------------------------------------------------
+CON_COMMAND_F( anim_simd_blend_test, "Compares the four-wide SlerpBones/BlendBones quaternion math with the scalar versions on random input. Args: [iterations] [seed]", FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	int nIterations = ( args.ArgC() > 1 ) ? MAX( 1, atoi( args[1] ) ) : 100000;
+	int nSeed = ( args.ArgC() > 2 ) ? atoi( args[2] ) : 0;
+
+	// The lanes follow the scalar code operation for operation, so anything
+	// beyond rounding is a bug
+	const float flTolerance = 1e-5f;
+	float flMaxDiff = Studio_CompareSIMDBoneBlends( nIterations, nSeed );
+	Msg( "anim_simd_blend_test: %d groups of 4, seed %d, max difference %g: %s\n", nIterations, nSeed, flMaxDiff, ( flMaxDiff <= flTolerance ) ? "PASS" : "FAIL" );
+}
+
+struct BoneCacheJob_t
+{
+	CBaseAnimating	*m_pEntity;
+	matrix3x4_t		*m_pBoneToWorld;
+	int				m_nBones;
+};
+
+// The jobs only set up bones. The bone caches live in the shared LRU
+// g_StudioBoneCache, where creating one can evict another, so they are
+// only created and updated on the main thread.
+static void SetupBoneCacheJob( BoneCacheJob_t &job )
+{
+	job.m_pEntity->SetupBones( job.m_pBoneToWorld, GetBoneCacheMask() );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Does what calling GetBoneCache on each entity would, but sets the
+//			bones up in parallel. Entities whose setup reaches outside
+//			themselves (IK traces, bone merging with a parent) are done
+//			serially first.
+//-----------------------------------------------------------------------------
+void CBaseAnimating::SetupBoneCaches( CBaseAnimating **ppEntities, int nCount )
+{
+	VPROF_BUDGET( "CBaseAnimating::SetupBoneCaches", VPROF_BUDGETGROUP_SERVER_ANIM );
+
+	int boneMask = GetBoneCacheMask();
+	bool bParallel = g_pThreadPool && g_pThreadPool->NumThreads() > 0 && !ai_setupbones_debug.GetBool();
+
+	BoneCacheJob_t *pJobs = (BoneCacheJob_t *)stackalloc( nCount * sizeof(BoneCacheJob_t) );
+	int nJobs = 0;
+	int nTotalBones = 0;
+	for ( int i = 0; i < nCount; i++ )
+	{
+		CBaseAnimating *pEntity = ppEntities[i];
+		if ( !pEntity || !pEntity->GetModelPtr() )
+			continue;
+
+		CBoneCache *pcache = Studio_GetBoneCache( pEntity->m_boneCacheHandle );
+		if ( pcache && IsBoneCacheCurrent( pcache, boneMask ) )
+			continue;
+
+		if ( !bParallel || pEntity->m_pIk || dynamic_cast< CBaseAnimating* >( pEntity->GetMoveParent() ) )
+		{
+			pEntity->GetBoneCache();
+			continue;
+		}
+
+		// Settle the lazily computed absolute transform here so the jobs only read it
+		pEntity->GetAbsOrigin();
+		pEntity->GetAbsAngles();
+
+		BoneCacheJob_t &job = pJobs[nJobs++];
+		job.m_pEntity = pEntity;
+		job.m_pBoneToWorld = NULL;
+		job.m_nBones = pEntity->GetModelPtr()->numbones();
+		nTotalBones += job.m_nBones;
+	}
+
+	if ( nJobs == 1 )
+	{
+		pJobs[0].m_pEntity->GetBoneCache();
+		return;
+	}
+
+	if ( !nJobs )
+		return;
+
+	CUtlVector< matrix3x4_t > boneToWorld;
+	boneToWorld.SetCount( nTotalBones );
+	int iFirstBone = 0;
+	for ( int i = 0; i < nJobs; i++ )
+	{
+		pJobs[i].m_pBoneToWorld = boneToWorld.Base() + iFirstBone;
+		iFirstBone += pJobs[i].m_nBones;
+	}
+
+	ParallelProcess( "CBaseAnimating::SetupBoneCaches", pJobs, nJobs, &SetupBoneCacheJob );
+
+	// Store the results the way GetBoneCache does
+	for ( int i = 0; i < nJobs; i++ )
+	{
+		CBaseAnimating *pEntity = pJobs[i].m_pEntity;
+		CBoneCache *pcache = Studio_GetBoneCache( pEntity->m_boneCacheHandle );
+		if ( pcache && (pcache->m_boneMask & boneMask) != boneMask )
+		{
+			Studio_DestroyBoneCache( pEntity->m_boneCacheHandle );
+			pEntity->m_boneCacheHandle = 0;
+			pcache = NULL;
+		}
+
+		if ( pcache )
+		{
+			pcache->UpdateBones( pJobs[i].m_pBoneToWorld, pJobs[i].m_nBones, gpGlobals->curtime );
+		}
+		else
+		{
+			bonecacheparams_t params;
+			params.pStudioHdr = pEntity->GetModelPtr();
+			params.pBoneToWorld = pJobs[i].m_pBoneToWorld;
+			params.curtime = gpGlobals->curtime;
+			params.boneMask = boneMask;
+
+			pEntity->m_boneCacheHandle = Studio_CreateBoneCache( params );
+		}
+	}
+}
+
+
 void CBaseAnimating::InvalidateBoneCache( void )
 {
 	Studio_InvalidateBoneCache( m_boneCacheHandle );
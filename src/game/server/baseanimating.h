@@ -258,6 +258,10 @@ public:
 	virtual bool TestHitboxes( const Ray_t &ray, unsigned int fContentsMask, trace_t& tr );
 	class CBoneCache *GetBoneCache( void );
 	void InvalidateBoneCache();
+
+	// Brings the bone caches of a set of entities up to date together, on the
+	// thread pool where it's safe to
+	static void SetupBoneCaches( CBaseAnimating **ppEntities, int nCount );
 	void InvalidateBoneCacheIfOlderThan( float deltaTime );
 	virtual int DrawDebugTextOverlays( void );
 	
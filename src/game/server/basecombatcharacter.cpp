@@ -3446,8 +3446,10 @@ void CBaseCombatCharacter::UpdateLastKnownArea( void )
 		}
 	}
 
-	// find the area we are directly standing in
-	CNavArea *area = TheNavMesh->GetNearestNavArea( this, GETNAVAREA_CHECK_GROUND | GETNAVAREA_CHECK_LOS, 50.0f );
+	// find the area we are directly standing in, through the batched query so the per-entity area cache is used
+	CBaseEntity *pThis = this;
+	CNavArea *area;
+	TheNavMesh->GetNearestNavAreas( &pThis, &area, 1, GETNAVAREA_CHECK_GROUND | GETNAVAREA_CHECK_LOS, 50.0f );
 	if ( !area )
 		return;
 
@@ -616,6 +616,7 @@ CBaseEntity *CBaseEntity::GetFollowedEntity()
 void CBaseEntity::SetClassname( const char *className )
 {
 	m_iClassname = AllocPooledString( className );
+	gEntList.NotifyClassnameChanged( this );
 }
 
 void CBaseEntity::SetModelIndex( int index )
@@ -3011,6 +3012,24 @@ FORCEINLINE bool NamesMatch( const char *pszQuery, string_t nameToMatch )
 	return false;
 }
 
+void CBaseEntity::SetName( string_t newName )
+{
+	if ( m_iName == newName )
+		return;
+
+	m_iName = newName;
+	gEntList.NotifyNameChanged( this );
+}
+
+void CBaseEntity::SetTargetEntityName( string_t newTarget )
+{
+	if ( m_target == newTarget )
+		return;
+
+	m_target = newTarget;
+	gEntList.NotifyTargetChanged( this );
+}
+
 bool CBaseEntity::NameMatchesComplex( const char *pszNameOrWildcard )
 {
 	if ( !Q_stricmp( "!player", pszNameOrWildcard) )
@@ -3185,6 +3204,11 @@ int CBaseEntity::Restore( IRestore &restore )
 	// loops through the data description list, restoring each data desc block in order
 	int status = RestoreDataDescBlock( restore, GetDataDescMap() );
 
+	// m_iName, m_iClassname and m_target were written directly
+	gEntList.NotifyNameChanged( this );
+	gEntList.NotifyClassnameChanged( this );
+	gEntList.NotifyTargetChanged( this );
+
 	// ---------------------------------------------------------------
 	// HACKHACK: We don't know the space of these vectors until now
 	// if they are worldspace, fix them up.
@@ -23,6 +23,7 @@
 
 class CDamageModifier;
 class CDmgAccumulator;
+class CParallelThinkEffects;
 
 struct CSoundParameters;
 
@@ -577,6 +578,7 @@ public:
 	CBaseEntity *NextMovePeer( void );
 
 	void		SetName( string_t newTarget );
+	void		SetTargetEntityName( string_t newTarget );	// sets m_target; always use this so gEntList's target index stays current
 	void		SetParent( string_t newParent, CBaseEntity *pActivator, int iAttachment = -1 );
 	
 	// Set the movement parent. Your local origin and angles will become relative to this parent.
@@ -752,6 +754,10 @@ public:
 	void (CBaseEntity::*m_pfnThink)(void);
 	virtual void Think( void ) { if (m_pfnThink) (this->*m_pfnThink)();};
 
+	// Runs the base think on a worker thread when sv_parallel_think is on.
+	// Return false to think normally; see parallel_think.h for the rules.
+	virtual bool ThinkParallel( CParallelThinkEffects &effects ) { return false; }
+
 	// Think functions with contexts
 	int		RegisterThinkContext( const char *szContext );
 	BASEPTR	ThinkSet( BASEPTR func, float flNextThinkTime = 0, const char *szContext = NULL );
@@ -1144,7 +1150,7 @@ private:
 
 public:
 	// variables promoted from edict_t
-	string_t	m_target;
+	string_t	m_target;		// set through SetTargetEntityName()
 	CNetworkVarForDerived( int, m_iMaxHealth ); // CBaseEntity doesn't care about changes to this variable, but there are derived classes that do.
 	CNetworkVarForDerived( int, m_iHealth );
 
@@ -1930,11 +1936,6 @@ inline string_t CBaseEntity::GetEntityName()
 	return m_iName; 
 }
 
-inline void CBaseEntity::SetName( string_t newName )
-{
-	m_iName = newName;
-}
-
 
 inline bool CBaseEntity::NameMatches( const char *pszNameOrWildcard )
 {
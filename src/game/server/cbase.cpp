@@ -644,8 +644,13 @@ CEventQueue g_EventQueue;
 
 CEventQueue::CEventQueue()
 {
-	m_Events.m_flFireTime = -FLT_MAX;
-	m_Events.m_pNext = NULL;
+	memset( m_pCallerLists, 0, sizeof( m_pCallerLists ) );
+	memset( m_pTargetLists, 0, sizeof( m_pTargetLists ) );
+	m_nNextSequence = 0;
+	m_pFiringEvent = NULL;
+
+	m_NamedTargets.SetLessFunc( DefLessFunc( string_t ) );
+	m_iNamedTargetsGeneration = 0;
 
 	Init();
 }
@@ -759,21 +764,37 @@ void CEventQueue::Init( void )
 void CEventQueue::Clear( void )
 {
 	// delete all the events in the queue
-	EventQueuePrioritizedEvent_t *pe = m_Events.m_pNext;
-	
-	while ( pe != NULL )
+	for ( int i = 0; i < m_Heap.Count(); i++ )
 	{
-		EventQueuePrioritizedEvent_t *next = pe->m_pNext;
-		delete pe;
-		pe = next;
+		delete m_Heap[i];
 	}
 
-	m_Events.m_pNext = NULL;
+	m_Heap.Purge();
+	memset( m_pCallerLists, 0, sizeof( m_pCallerLists ) );
+	memset( m_pTargetLists, 0, sizeof( m_pTargetLists ) );
+
+	m_NamedTargets.RemoveAll();
+	m_NamedTargetEntities.Purge();
+}
+
+static int __cdecl EventQueueSortFunc( EventQueuePrioritizedEvent_t * const *a, EventQueuePrioritizedEvent_t * const *b )
+{
+	if ( (*a)->m_flFireTime != (*b)->m_flFireTime )
+		return ( (*a)->m_flFireTime < (*b)->m_flFireTime ) ? -1 : 1;
+
+	return (int)( (*a)->m_nSequence - (*b)->m_nSequence );
+}
+
+void CEventQueue::GetSortedEvents( CUtlVector< EventQueuePrioritizedEvent_t * > &events )
+{
+	events.CopyArray( m_Heap.Base(), m_Heap.Count() );
+	events.Sort( EventQueueSortFunc );
 }
 
 void CEventQueue::Dump( void )
 {
-	EventQueuePrioritizedEvent_t *pe = m_Events.m_pNext;
+	CUtlVector< EventQueuePrioritizedEvent_t * > events;
+	GetSortedEvents( events );
 
 	Msg("Dumping event queue. Current time is: %.2f\n",
 #if defined( TF_DLL ) || defined(TF_MOD)
@@ -783,9 +804,9 @@ void CEventQueue::Dump( void )
 #endif
 		);
 
-	while ( pe != NULL )
+	for ( int i = 0; i < events.Count(); i++ )
 	{
-		EventQueuePrioritizedEvent_t *next = pe->m_pNext;
+		EventQueuePrioritizedEvent_t *pe = events[i];
 
 		Msg("   (%.2f) Target: '%s', Input: '%s', Parameter '%s'. Activator: '%s', Caller '%s'.  \n", 
 			pe->m_flFireTime, 
@@ -794,8 +815,6 @@ void CEventQueue::Dump( void )
 			pe->m_VariantValue.String(),
 			pe->m_pActivator ? pe->m_pActivator->GetDebugName() : "None", 
 			pe->m_pCaller ? pe->m_pCaller->GetDebugName() : "None"  );
-
-		pe = next;
 	}
 
 	Msg("Finished dump.\n");
@@ -857,43 +876,250 @@ void CEventQueue::AddEvent( CBaseEntity *target, const char *action, float fireD
 
 
 //-----------------------------------------------------------------------------
-// Purpose: private function, adds an event into the list
+// Purpose: private functions, maintain the binary heap of events
+//-----------------------------------------------------------------------------
+bool CEventQueue::IsEarlier( const EventQueuePrioritizedEvent_t *a, const EventQueuePrioritizedEvent_t *b ) const
+{
+	if ( a->m_flFireTime != b->m_flFireTime )
+		return a->m_flFireTime < b->m_flFireTime;
+
+	// events with the same fire time go in the order they were added
+	return (int)( a->m_nSequence - b->m_nSequence ) < 0;
+}
+
+void CEventQueue::HeapSet( int i, EventQueuePrioritizedEvent_t *pe )
+{
+	m_Heap[i] = pe;
+	pe->m_iHeapIndex = i;
+}
+
+void CEventQueue::HeapSiftUp( int i )
+{
+	EventQueuePrioritizedEvent_t *pe = m_Heap[i];
+	while ( i > 0 )
+	{
+		int parent = ( i - 1 ) / 2;
+		if ( !IsEarlier( pe, m_Heap[parent] ) )
+			break;
+
+		HeapSet( i, m_Heap[parent] );
+		i = parent;
+	}
+	HeapSet( i, pe );
+}
+
+void CEventQueue::HeapSiftDown( int i )
+{
+	EventQueuePrioritizedEvent_t *pe = m_Heap[i];
+	int count = m_Heap.Count();
+	while ( 1 )
+	{
+		int child = i * 2 + 1;
+		if ( child >= count )
+			break;
+
+		if ( child + 1 < count && IsEarlier( m_Heap[child + 1], m_Heap[child] ) )
+		{
+			child++;
+		}
+
+		if ( !IsEarlier( m_Heap[child], pe ) )
+			break;
+
+		HeapSet( i, m_Heap[child] );
+		i = child;
+	}
+	HeapSet( i, pe );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: private function, adds an event into the queue
 // Input  : *newEvent - the (already built) event to add
 //-----------------------------------------------------------------------------
 void CEventQueue::AddEvent( EventQueuePrioritizedEvent_t *newEvent )
 {
-	// loop through the actions looking for a place to insert
-	EventQueuePrioritizedEvent_t *pe;
-	for ( pe = &m_Events; pe->m_pNext != NULL; pe = pe->m_pNext )
+	newEvent->m_nSequence = m_nNextSequence++;
+	HeapSet( m_Heap.AddToTail(), newEvent );
+	HeapSiftUp( newEvent->m_iHeapIndex );
+
+	newEvent->m_pPrevByCaller = NULL;
+	newEvent->m_pNextByCaller = NULL;
+	if ( newEvent->m_pCaller.IsValid() )
 	{
-		if ( pe->m_pNext->m_flFireTime > newEvent->m_flFireTime )
+		EventQueuePrioritizedEvent_t *&pHead = m_pCallerLists[newEvent->m_pCaller.GetEntryIndex()];
+		newEvent->m_pNextByCaller = pHead;
+		if ( pHead )
 		{
-			break;
+			pHead->m_pPrevByCaller = newEvent;
 		}
+		pHead = newEvent;
 	}
 
-	Assert( pe );
-
-	// insert
-	newEvent->m_pNext = pe->m_pNext;
-	newEvent->m_pPrev = pe;
-	pe->m_pNext = newEvent;
-	if ( newEvent->m_pNext )
+	newEvent->m_pPrevByTarget = NULL;
+	newEvent->m_pNextByTarget = NULL;
+	if ( newEvent->m_pEntTarget.IsValid() )
 	{
-		newEvent->m_pNext->m_pPrev = newEvent;
+		EventQueuePrioritizedEvent_t *&pHead = m_pTargetLists[newEvent->m_pEntTarget.GetEntryIndex()];
+		newEvent->m_pNextByTarget = pHead;
+		if ( pHead )
+		{
+			pHead->m_pPrevByTarget = newEvent;
+		}
+		pHead = newEvent;
 	}
 }
 
 void CEventQueue::RemoveEvent( EventQueuePrioritizedEvent_t *pe )
 {
-	Assert( pe->m_pPrev );
-	pe->m_pPrev->m_pNext = pe->m_pNext;
-	if ( pe->m_pNext )
+	int i = pe->m_iHeapIndex;
+	Assert( m_Heap[i] == pe );
+
+	int last = m_Heap.Count() - 1;
+	if ( i != last )
+	{
+		HeapSet( i, m_Heap[last] );
+	}
+	m_Heap.Remove( last );
+
+	if ( i != last )
+	{
+		if ( i > 0 && IsEarlier( m_Heap[i], m_Heap[( i - 1 ) / 2] ) )
+		{
+			HeapSiftUp( i );
+		}
+		else
+		{
+			HeapSiftDown( i );
+		}
+	}
+	pe->m_iHeapIndex = -1;
+
+	if ( pe->m_pCaller.IsValid() )
+	{
+		if ( pe->m_pPrevByCaller )
+		{
+			pe->m_pPrevByCaller->m_pNextByCaller = pe->m_pNextByCaller;
+		}
+		else
+		{
+			Assert( m_pCallerLists[pe->m_pCaller.GetEntryIndex()] == pe );
+			m_pCallerLists[pe->m_pCaller.GetEntryIndex()] = pe->m_pNextByCaller;
+		}
+
+		if ( pe->m_pNextByCaller )
+		{
+			pe->m_pNextByCaller->m_pPrevByCaller = pe->m_pPrevByCaller;
+		}
+	}
+
+	if ( pe->m_pEntTarget.IsValid() )
+	{
+		if ( pe->m_pPrevByTarget )
+		{
+			pe->m_pPrevByTarget->m_pNextByTarget = pe->m_pNextByTarget;
+		}
+		else
+		{
+			Assert( m_pTargetLists[pe->m_pEntTarget.GetEntryIndex()] == pe );
+			m_pTargetLists[pe->m_pEntTarget.GetEntryIndex()] = pe->m_pNextByTarget;
+		}
+
+		if ( pe->m_pNextByTarget )
+		{
+			pe->m_pNextByTarget->m_pPrevByTarget = pe->m_pPrevByTarget;
+		}
+	}
+}
+
+void CEventQueue::DeleteEvent( EventQueuePrioritizedEvent_t *pe )
+{
+	RemoveEvent( pe );
+	delete pe;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: returns the index in m_NamedTargets of the entities the event's
+//			target name matches, searching the entity list if it hasn't been
+//			searched for since the last time a name changed.
+//-----------------------------------------------------------------------------
+int CEventQueue::FindNamedTargets( const EventQueuePrioritizedEvent_t *pe )
+{
+	if ( m_iNamedTargetsGeneration != gEntList.GetNameGeneration() )
 	{
-		pe->m_pNext->m_pPrev = pe->m_pPrev;
+		m_NamedTargets.RemoveAll();
+		m_NamedTargetEntities.RemoveAll();
+		m_iNamedTargetsGeneration = gEntList.GetNameGeneration();
 	}
+
+	int i = m_NamedTargets.Find( pe->m_iTarget );
+	if ( i != m_NamedTargets.InvalidIndex() )
+		return i;
+
+	NamedTargets_t targets;
+	targets.m_iFirst = m_NamedTargetEntities.Count();
+
+	CBaseEntity *target = NULL;
+	while ( ( target = gEntList.FindEntityByName( target, pe->m_iTarget ) ) != NULL )
+	{
+		m_NamedTargetEntities.AddToTail( target );
+	}
+
+	targets.m_nCount = m_NamedTargetEntities.Count() - targets.m_iFirst;
+	return m_NamedTargets.Insert( pe->m_iTarget, targets );
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: pumps the event into every entity matching its target name
+//-----------------------------------------------------------------------------
+void CEventQueue::FireNamedEvent( EventQueuePrioritizedEvent_t *pe, bool &targetFound )
+{
+	// In the context the event, the searching entity is also the caller
+	CBaseEntity *pSearchingEntity = pe->m_pCaller;
+	CBaseEntity *target = NULL;
+
+	// Procedural names depend on who fired the event, so always search
+	if ( STRING(pe->m_iTarget)[0] != '!' )
+	{
+		int iNamed = FindNamedTargets( pe );
+		int iFirst = m_NamedTargets[iNamed].m_iFirst;
+		int nCount = m_NamedTargets[iNamed].m_nCount;
+		int iGeneration = m_iNamedTargetsGeneration;
+
+		int i;
+		for ( i = 0; i < nCount; i++ )
+		{
+			// An input renamed something. Pick up the search from here,
+			// exactly as if we'd been searching all along.
+			if ( gEntList.GetNameGeneration() != iGeneration )
+				break;
+
+			// entities removed since the search are skipped
+			CBaseEntity *pEntity = m_NamedTargetEntities[iFirst + i];
+			if ( !pEntity )
+				continue;
+
+			// pump the action into the target
+			target = pEntity;
+			target->AcceptInput( STRING(pe->m_iTargetInput), pe->m_pActivator, pe->m_pCaller, pe->m_VariantValue, pe->m_iOutputID );
+			targetFound = true;
+		}
+
+		if ( i == nCount && gEntList.GetNameGeneration() == iGeneration )
+			return;
+	}
+
+	while ( 1 )
+	{
+		target = gEntList.FindEntityByName( target, pe->m_iTarget, pSearchingEntity, pe->m_pActivator, pe->m_pCaller );
+		if ( !target )
+			break;
+
+		// pump the action into the target
+		target->AcceptInput( STRING(pe->m_iTargetInput), pe->m_pActivator, pe->m_pCaller, pe->m_VariantValue, pe->m_iOutputID );
+		targetFound = true;
+	}
+}
 
 //-----------------------------------------------------------------------------
 // Purpose: fires off any events in the queue who's fire time is (or before) the present time
@@ -905,34 +1131,25 @@ void CEventQueue::ServiceEvents( void )
 		return;
 	}
 
-	EventQueuePrioritizedEvent_t *pe = m_Events.m_pNext;
-
 #if defined( TF_DLL ) || defined(TF_MOD)
-	while ( pe != NULL && pe->m_flFireTime <= engine->GetServerTime() )
+	while ( m_Heap.Count() && m_Heap[0]->m_flFireTime <= engine->GetServerTime() )
 #else
-	while ( pe != NULL && pe->m_flFireTime <= gpGlobals->curtime )
+	while ( m_Heap.Count() && m_Heap[0]->m_flFireTime <= gpGlobals->curtime )
 #endif
 	{
 		MDLCACHE_CRITICAL_SECTION();
 
+		// the head of the heap is always the next event, including any that
+		// were added by the last one
+		EventQueuePrioritizedEvent_t *pe = m_Heap[0];
+		m_pFiringEvent = pe;
+
 		bool targetFound = false;
 
 		// find the targets
 		if ( pe->m_iTarget != NULL_STRING )
 		{
-			// In the context the event, the searching entity is also the caller
-			CBaseEntity *pSearchingEntity = pe->m_pCaller;
-			CBaseEntity *target = NULL;
-			while ( 1 )
-			{
-				target = gEntList.FindEntityByName( target, pe->m_iTarget, pSearchingEntity, pe->m_pActivator, pe->m_pCaller );
-				if ( !target )
-					break;
-
-				// pump the action into the target
-				target->AcceptInput( STRING(pe->m_iTargetInput), pe->m_pActivator, pe->m_pCaller, pe->m_VariantValue, pe->m_iOutputID );
-				targetFound = true;
-			}
+			FireNamedEvent( pe, targetFound );
 		}
 
 		// direct pointer
@@ -978,9 +1195,9 @@ void CEventQueue::ServiceEvents( void )
 			ADD_DEBUG_HISTORY( HISTORY_ENTITY_IO, szBuffer );
 		}
 
-		// remove the event from the list (remembering that the queue may have been added to)
-		RemoveEvent( pe );
-		delete pe;
+		// remove the event from the queue (remembering that the queue may have been added to)
+		m_pFiringEvent = NULL;
+		DeleteEvent( pe );
 
 		//
 		// If we are in debug mode, exit the loop if we have fired the correct number of events.
@@ -992,9 +1209,6 @@ void CEventQueue::ServiceEvents( void )
 				break;
 			}
 		}
-
-		// restart the list (to catch any new items have probably been added to the queue)
-		pe = m_Events.m_pNext;	
 	}
 }
 
@@ -1022,12 +1236,13 @@ void CEventQueue::CancelEvents( CBaseEntity *pCaller )
 	if (!pCaller)
 		return;
 
-	EventQueuePrioritizedEvent_t *pCur = m_Events.m_pNext;
+	// only events in this entity's slot can have it as their caller
+	EventQueuePrioritizedEvent_t *pCur = m_pCallerLists[pCaller->GetRefEHandle().GetEntryIndex()];
 
 	while (pCur != NULL)
 	{
 		bool bDelete = false;
-		if (pCur->m_pCaller == pCaller)
+		if (pCur->m_pCaller == pCaller && pCur != m_pFiringEvent)
 		{
 			// Pointers match; make sure everything else matches.
 			if (!stricmp(STRING(pCur->m_pCaller->GetEntityName()), STRING(pCaller->GetEntityName())) &&
@@ -1039,12 +1254,11 @@ void CEventQueue::CancelEvents( CBaseEntity *pCaller )
 		}
 
 		EventQueuePrioritizedEvent_t *pCurSave = pCur;
-		pCur = pCur->m_pNext;
+		pCur = pCur->m_pNextByCaller;
 
 		if (bDelete)
 		{
-			RemoveEvent( pCurSave );
-			delete pCurSave;
+			DeleteEvent( pCurSave );
 		}
 	}
 }
@@ -1060,12 +1274,12 @@ void CEventQueue::CancelEventOn( CBaseEntity *pTarget, const char *sInputName )
 	if (!pTarget)
 		return;
 
-	EventQueuePrioritizedEvent_t *pCur = m_Events.m_pNext;
+	EventQueuePrioritizedEvent_t *pCur = m_pTargetLists[pTarget->GetRefEHandle().GetEntryIndex()];
 
 	while (pCur != NULL)
 	{
 		bool bDelete = false;
-		if (pCur->m_pEntTarget == pTarget)
+		if (pCur->m_pEntTarget == pTarget && pCur != m_pFiringEvent)
 		{
 			if ( !Q_strncmp( STRING(pCur->m_iTargetInput), sInputName, strlen(sInputName) ) )
 			{
@@ -1075,12 +1289,11 @@ void CEventQueue::CancelEventOn( CBaseEntity *pTarget, const char *sInputName )
 		}
 
 		EventQueuePrioritizedEvent_t *pCurSave = pCur;
-		pCur = pCur->m_pNext;
+		pCur = pCur->m_pNextByTarget;
 
 		if (bDelete)
 		{
-			RemoveEvent( pCurSave );
-			delete pCurSave;
+			DeleteEvent( pCurSave );
 		}
 	}
 }
@@ -1095,7 +1308,7 @@ bool CEventQueue::HasEventPending( CBaseEntity *pTarget, const char *sInputName
 	if (!pTarget)
 		return false;
 
-	EventQueuePrioritizedEvent_t *pCur = m_Events.m_pNext;
+	EventQueuePrioritizedEvent_t *pCur = m_pTargetLists[pTarget->GetRefEHandle().GetEntryIndex()];
 
 	while (pCur != NULL)
 	{
@@ -1108,7 +1321,7 @@ bool CEventQueue::HasEventPending( CBaseEntity *pTarget, const char *sInputName
 				return true;
 		}
 
-		pCur = pCur->m_pNext;
+		pCur = pCur->m_pNextByTarget;
 	}
 
 	return false;
@@ -1126,7 +1339,7 @@ void ServiceEventQueue( void )
 // save data description for the event queue
 BEGIN_SIMPLE_DATADESC( CEventQueue )
 	// These are saved explicitly in CEventQueue::Save below
-	// DEFINE_FIELD( m_Events, EventQueuePrioritizedEvent_t ),
+	// DEFINE_FIELD( m_Heap, EventQueuePrioritizedEvent_t ),
 
 	DEFINE_FIELD( m_iListCount, FIELD_INTEGER ),	// this value is only used during save/restore
 END_DATADESC()
@@ -1143,29 +1356,34 @@ BEGIN_SIMPLE_DATADESC( EventQueuePrioritizedEvent_t )
 	DEFINE_FIELD( m_iOutputID, FIELD_INTEGER ),
 	DEFINE_CUSTOM_FIELD( m_VariantValue, variantFuncs ),
 
-//	DEFINE_FIELD( m_pNext, FIELD_??? ),
-//	DEFINE_FIELD( m_pPrev, FIELD_??? ),
+	// The queue's bookkeeping is rebuilt as the events are added back on restore
+//	DEFINE_FIELD( m_iHeapIndex, FIELD_INTEGER ),
+//	DEFINE_FIELD( m_nSequence, FIELD_INTEGER ),
+//	DEFINE_FIELD( m_pNextByCaller, FIELD_??? ),
+//	DEFINE_FIELD( m_pPrevByCaller, FIELD_??? ),
+//	DEFINE_FIELD( m_pNextByTarget, FIELD_??? ),
+//	DEFINE_FIELD( m_pPrevByTarget, FIELD_??? ),
 END_DATADESC()
 
 
 int CEventQueue::Save( ISave &save )
 {
-	// count the number of items in the queue
-	EventQueuePrioritizedEvent_t *pe;
+	// save in firing order, so events with the same fire time are restored in
+	// the order they were added
+	CUtlVector< EventQueuePrioritizedEvent_t * > events;
+	GetSortedEvents( events );
 
-	m_iListCount = 0;
-	for ( pe = m_Events.m_pNext; pe != NULL; pe = pe->m_pNext )
-	{
-		m_iListCount++;
-	}
+	// count the number of items in the queue
+	m_iListCount = events.Count();
 
 	// save that value out to disk, so we know how many to restore
 	if ( !save.WriteFields( "EventQueue", this, NULL, m_DataMap.dataDesc, m_DataMap.dataNumFields ) )
 		return 0;
 	
 	// cycle through all the events, saving them all
-	for ( pe = m_Events.m_pNext; pe != NULL; pe = pe->m_pNext )
+	for ( int i = 0; i < events.Count(); i++ )
 	{
+		EventQueuePrioritizedEvent_t *pe = events[i];
 		if ( !save.WriteFields( "PEvent", pe, NULL, pe->m_DataMap.dataDesc, pe->m_DataMap.dataNumFields ) )
 			return 0;
 	}
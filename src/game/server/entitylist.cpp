@@ -17,6 +17,7 @@
 #include "ai_initutils.h"
 #include "globalstate.h"
 #include "datacache/imdlcache.h"
+#include "entityspatialhash.h"
 
 #ifdef HL2_DLL
 #include "npc_playercompanion.h"
@@ -290,10 +291,214 @@ CBaseEntityClassList::~CBaseEntityClassList()
 {
 }
 
+//-----------------------------------------------------------------------------
+// CEntityNameIndex
+//-----------------------------------------------------------------------------
+
+// NamesMatch treats any two characters up to 'z' that are 32 apart as the same
+// letter, not just upper and lower case, so fold every character that it could
+// match to the same value. Matches are always confirmed with NamesMatch.
+static inline int NameIndexFoldCase( unsigned char c )
+{
+	return ( c && c <= 'z' ) ? 256 + ( c & 31 ) : c;
+}
+
+static int NameIndexCompare( const char *pszA, const char *pszB, int nMaxLength = INT_MAX )
+{
+	for ( int i = 0; i < nMaxLength; i++ )
+	{
+		int a = NameIndexFoldCase( pszA[i] );
+		int b = NameIndexFoldCase( pszB[i] );
+		if ( a != b )
+			return a < b ? -1 : 1;
+		if ( !a )
+			break;
+	}
+	return 0;
+}
+
+CEntityNameIndex::CEntityNameIndex() : m_Buckets( 0, 0, BucketLessFunc )
+{
+	m_pSequences = NULL;
+	for ( int i = 0; i < NUM_ENT_ENTRIES; i++ )
+	{
+		m_Links[i].m_iBucket = -1;
+	}
+}
+
+bool CEntityNameIndex::BucketLessFunc( const Bucket_t &lhs, const Bucket_t &rhs )
+{
+	return NameIndexCompare( lhs.m_pszName, rhs.m_pszName ) < 0;
+}
+
+void CEntityNameIndex::Update( int iSlot, string_t name )
+{
+	Link_t &link = m_Links[iSlot];
+	if ( link.m_iBucket != -1 )
+	{
+		if ( name != NULL_STRING && !NameIndexCompare( m_Buckets[link.m_iBucket].m_pszName, STRING(name) ) )
+			return;
+
+		Remove( iSlot );
+	}
+
+	if ( name == NULL_STRING )
+		return;
+
+	Bucket_t search;
+	search.m_pszName = STRING(name);
+	int iBucket = m_Buckets.Find( search );
+	if ( iBucket == m_Buckets.InvalidIndex() )
+	{
+		search.m_iHead = search.m_iTail = -1;
+		iBucket = m_Buckets.Insert( search );
+	}
+
+	// Entities are nearly always named as they're added, so this is almost
+	// always the tail
+	Bucket_t &bucket = m_Buckets[iBucket];
+	int iPrev = bucket.m_iTail;
+	while ( iPrev != -1 && IsBefore( iSlot, iPrev ) )
+	{
+		iPrev = m_Links[iPrev].m_iPrev;
+	}
+
+	int iNext = ( iPrev != -1 ) ? m_Links[iPrev].m_iNext : bucket.m_iHead;
+	link.m_iBucket = iBucket;
+	link.m_iPrev = iPrev;
+	link.m_iNext = iNext;
+
+	if ( iPrev != -1 )
+	{
+		m_Links[iPrev].m_iNext = iSlot;
+	}
+	else
+	{
+		bucket.m_iHead = iSlot;
+	}
+
+	if ( iNext != -1 )
+	{
+		m_Links[iNext].m_iPrev = iSlot;
+	}
+	else
+	{
+		bucket.m_iTail = iSlot;
+	}
+}
+
+void CEntityNameIndex::Remove( int iSlot )
+{
+	Link_t &link = m_Links[iSlot];
+	if ( link.m_iBucket == -1 )
+		return;
+
+	Bucket_t &bucket = m_Buckets[link.m_iBucket];
+	if ( link.m_iPrev != -1 )
+	{
+		m_Links[link.m_iPrev].m_iNext = link.m_iNext;
+	}
+	else
+	{
+		bucket.m_iHead = link.m_iNext;
+	}
+
+	if ( link.m_iNext != -1 )
+	{
+		m_Links[link.m_iNext].m_iPrev = link.m_iPrev;
+	}
+	else
+	{
+		bucket.m_iTail = link.m_iPrev;
+	}
+
+	// The bucket's name belongs to an entity, so don't keep it past the last one
+	if ( bucket.m_iHead == -1 )
+	{
+		m_Buckets.RemoveAt( link.m_iBucket );
+	}
+
+	link.m_iBucket = -1;
+}
+
+void CEntityNameIndex::Purge()
+{
+	m_Buckets.Purge();
+	for ( int i = 0; i < NUM_ENT_ENTRIES; i++ )
+	{
+		m_Links[i].m_iBucket = -1;
+	}
+}
+
+int CEntityNameIndex::FindBucket( const char *pszName ) const
+{
+	Bucket_t search;
+	search.m_pszName = pszName;
+	int iBucket = m_Buckets.Find( search );
+	return ( iBucket != m_Buckets.InvalidIndex() ) ? iBucket : -1;
+}
+
+int CEntityNameIndex::FirstPrefixBucket( const char *pszPrefix, int nPrefixLength ) const
+{
+	// find the first bucket not less than the prefix
+	int iFirst = m_Buckets.InvalidIndex();
+	int i = m_Buckets.Root();
+	while ( i != m_Buckets.InvalidIndex() )
+	{
+		if ( NameIndexCompare( m_Buckets[i].m_pszName, pszPrefix, nPrefixLength ) < 0 )
+		{
+			i = m_Buckets.RightChild( i );
+		}
+		else
+		{
+			iFirst = i;
+			i = m_Buckets.LeftChild( i );
+		}
+	}
+
+	if ( iFirst == m_Buckets.InvalidIndex() || NameIndexCompare( m_Buckets[iFirst].m_pszName, pszPrefix, nPrefixLength ) != 0 )
+		return -1;
+
+	return iFirst;
+}
+
+int CEntityNameIndex::NextPrefixBucket( int iBucket, const char *pszPrefix, int nPrefixLength ) const
+{
+	iBucket = m_Buckets.NextInorder( iBucket );
+	if ( iBucket == m_Buckets.InvalidIndex() || NameIndexCompare( m_Buckets[iBucket].m_pszName, pszPrefix, nPrefixLength ) != 0 )
+		return -1;
+
+	return iBucket;
+}
+
+int CEntityNameIndex::NextInBucket( int iBucket, int iStartSlot ) const
+{
+	if ( iStartSlot != -1 && m_Links[iStartSlot].m_iBucket == iBucket )
+		return m_Links[iStartSlot].m_iNext;
+
+	int iSlot = m_Buckets[iBucket].m_iHead;
+	if ( iStartSlot != -1 )
+	{
+		while ( iSlot != -1 && !IsBefore( iStartSlot, iSlot ) )
+		{
+			iSlot = m_Links[iSlot].m_iNext;
+		}
+	}
+	return iSlot;
+}
+
+
 CGlobalEntityList::CGlobalEntityList()
 {
 	m_iHighestEnt = m_iNumEnts = m_iNumEdicts = 0;
 	m_bClearingEntities = false;
+	m_iNameGeneration = 0;
+
+	memset( m_nAddSequences, 0, sizeof( m_nAddSequences ) );
+	m_nNextAddSequence = 0;
+	m_ClassnameIndex.SetSequences( m_nAddSequences );
+	m_NameIndex.SetSequences( m_nAddSequences );
+	m_TargetIndex.SetSequences( m_nAddSequences );
 }
 
 
@@ -381,6 +586,12 @@ void CGlobalEntityList::Clear( void )
 	CBaseEntity::m_bInDebugSelect = false; 
 	m_iHighestEnt = 0;
 	m_iNumEnts = 0;
+	m_iNameGeneration++;
+
+	m_ClassnameIndex.Purge();
+	m_NameIndex.Purge();
+	m_TargetIndex.Purge();
+	g_EntitySpatialHash.Purge();
 
 	m_bClearingEntities = false;
 }
@@ -480,6 +691,14 @@ bool CGlobalEntityList::IsEntityPtr( void *pTest )
 //			szName - Classname to search for.
 //-----------------------------------------------------------------------------
 CBaseEntity *CGlobalEntityList::FindEntityByClassname( CBaseEntity *pStartEntity, const char *szName )
+{
+	if ( CEntityNameIndex::CanSearch( szName ) )
+		return FindEntityInIndex( m_ClassnameIndex, pStartEntity, szName, true, NULL );
+
+	return FindEntityByClassnameUnindexed( pStartEntity, szName );
+}
+
+CBaseEntity *CGlobalEntityList::FindEntityByClassnameUnindexed( CBaseEntity *pStartEntity, const char *szName )
 {
 	const CEntInfo *pInfo = pStartEntity ? GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : FirstEntInfo();
 
@@ -590,7 +809,18 @@ CBaseEntity *CGlobalEntityList::FindEntityByName( CBaseEntity *pStartEntity, con
 
 		return NULL;
 	}
-	
+
+	if ( CEntityNameIndex::CanSearch( szName ) )
+		return FindEntityInIndex( m_NameIndex, pStartEntity, szName, false, pFilter );
+
+	return FindEntityByNameUnindexed( pStartEntity, szName, pFilter );
+}
+
+CBaseEntity *CGlobalEntityList::FindEntityByNameUnindexed( CBaseEntity *pStartEntity, const char *szName, IEntityFindFilter *pFilter )
+{
+	if ( !szName || szName[0] == 0 )
+		return NULL;
+
 	const CEntInfo *pInfo = pStartEntity ? GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : FirstEntInfo();
 
 	for ( ;pInfo; pInfo = pInfo->m_pNext )
@@ -617,6 +847,44 @@ CBaseEntity *CGlobalEntityList::FindEntityByName( CBaseEntity *pStartEntity, con
 	return NULL;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Iterates the entities matching a name or classname using an index.
+//			Returns the same entity as walking the list from pStartEntity would.
+//-----------------------------------------------------------------------------
+CBaseEntity *CGlobalEntityList::FindEntityInIndex( const CEntityNameIndex &index, CBaseEntity *pStartEntity, const char *szName, bool bClassname, IEntityFindFilter *pFilter )
+{
+	int iStartSlot = pStartEntity ? pStartEntity->GetRefEHandle().GetEntryIndex() : -1;
+
+	// Everything before a wildcard has to match, so only look in the buckets
+	// with that prefix
+	const char *pszWildcard = strchr( szName, '*' );
+	int nPrefixLength = pszWildcard ? pszWildcard - szName : 0;
+	int iBucket = pszWildcard ? index.FirstPrefixBucket( szName, nPrefixLength ) : index.FindBucket( szName );
+
+	// Take the earliest match from any of the buckets
+	int iBest = -1;
+	for ( ; iBucket != -1; iBucket = pszWildcard ? index.NextPrefixBucket( iBucket, szName, nPrefixLength ) : -1 )
+	{
+		for ( int iSlot = index.NextInBucket( iBucket, iStartSlot ); iSlot != -1; iSlot = index.NextSlot( iSlot ) )
+		{
+			if ( iBest != -1 && (int)( m_nAddSequences[iSlot] - m_nAddSequences[iBest] ) > 0 )
+				break;
+
+			CBaseEntity *pEntity = (CBaseEntity *)GetEntInfoPtrByIndex( iSlot )->m_pEntity;
+			if ( bClassname ? !pEntity->ClassMatches( szName ) : !pEntity->NameMatches( szName ) )
+				continue;
+
+			if ( pFilter && !pFilter->ShouldFindEntity( pEntity ) )
+				continue;
+
+			iBest = iSlot;
+			break;
+		}
+	}
+
+	return ( iBest != -1 ) ? (CBaseEntity *)GetEntInfoPtrByIndex( iBest )->m_pEntity : NULL;
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: 
 // Input  : pStartEntity - 
@@ -653,6 +921,27 @@ CBaseEntity *CGlobalEntityList::FindEntityByModel( CBaseEntity *pStartEntity, co
 //-----------------------------------------------------------------------------
 // FIXME: obsolete, remove
 CBaseEntity	*CGlobalEntityList::FindEntityByTarget( CBaseEntity *pStartEntity, const char *szName )
+{
+	if ( !CEntityNameIndex::CanSearch( szName ) )
+		return FindEntityByTargetUnindexed( pStartEntity, szName );
+
+	// Targets are matched exactly, so there's only the one bucket to look in
+	int iBucket = m_TargetIndex.FindBucket( szName );
+	if ( iBucket == -1 )
+		return NULL;
+
+	int iStartSlot = pStartEntity ? pStartEntity->GetRefEHandle().GetEntryIndex() : -1;
+	for ( int iSlot = m_TargetIndex.NextInBucket( iBucket, iStartSlot ); iSlot != -1; iSlot = m_TargetIndex.NextSlot( iSlot ) )
+	{
+		CBaseEntity *ent = (CBaseEntity *)GetEntInfoPtrByIndex( iSlot )->m_pEntity;
+		if ( FStrEq( STRING(ent->m_target), szName ) )
+			return ent;
+	}
+
+	return NULL;
+}
+
+CBaseEntity	*CGlobalEntityList::FindEntityByTargetUnindexed( CBaseEntity *pStartEntity, const char *szName )
 {
 	const CEntInfo *pInfo = pStartEntity ? GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : FirstEntInfo();
 
@@ -683,6 +972,43 @@ CBaseEntity	*CGlobalEntityList::FindEntityByTarget( CBaseEntity *pStartEntity, c
 //			flRadius - 
 //-----------------------------------------------------------------------------
 CBaseEntity *CGlobalEntityList::FindEntityInSphere( CBaseEntity *pStartEntity, const Vector &vecCenter, float flRadius )
+{
+	if ( !g_EntitySpatialHash.IsFindEnabled() )
+		return FindEntityInSphereUnindexed( pStartEntity, vecCenter, flRadius );
+
+	CEntitySpatialHash::SlotList_t candidates;
+	Vector vecExtents( flRadius, flRadius, flRadius );
+	if ( !g_EntitySpatialHash.GetCollisionCandidates( vecCenter - vecExtents, vecCenter + vecExtents, candidates ) )
+		return FindEntityInSphereUnindexed( pStartEntity, vecCenter, flRadius );
+
+	// Take the earliest match after pStartEntity in the list, as walking it would
+	int iStartSlot = pStartEntity ? pStartEntity->GetRefEHandle().GetEntryIndex() : -1;
+	int iBest = -1;
+	for ( int i = 0; i < candidates.Count(); i++ )
+	{
+		int iSlot = candidates[i];
+		if ( iStartSlot != -1 && (int)( m_nAddSequences[iSlot] - m_nAddSequences[iStartSlot] ) <= 0 )
+			continue;
+
+		if ( iBest != -1 && (int)( m_nAddSequences[iSlot] - m_nAddSequences[iBest] ) > 0 )
+			continue;
+
+		CBaseEntity *ent = (CBaseEntity *)GetEntInfoPtrByIndex( iSlot )->m_pEntity;
+		if ( !ent || !ent->edict() )
+			continue;
+
+		Vector vecRelativeCenter;
+		ent->CollisionProp()->WorldToCollisionSpace( vecCenter, &vecRelativeCenter );
+		if ( !IsBoxIntersectingSphere( ent->CollisionProp()->OBBMins(),	ent->CollisionProp()->OBBMaxs(), vecRelativeCenter, flRadius ) )
+			continue;
+
+		iBest = iSlot;
+	}
+
+	return ( iBest != -1 ) ? (CBaseEntity *)GetEntInfoPtrByIndex( iBest )->m_pEntity : NULL;
+}
+
+CBaseEntity *CGlobalEntityList::FindEntityInSphereUnindexed( CBaseEntity *pStartEntity, const Vector &vecCenter, float flRadius )
 {
 	const CEntInfo *pInfo = pStartEntity ? GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : FirstEntInfo();
 
@@ -1079,6 +1405,13 @@ CBaseEntity *CGlobalEntityList::FindEntityNearestFacing( const Vector &origin, c
 }
 
 
+// A few entities point m_target at a string that isn't pooled, but the index
+// keeps a pointer to the first name filed in each bucket
+static string_t GetPooledTarget( CBaseEntity *pEnt )
+{
+	return ( pEnt->m_target != NULL_STRING ) ? AllocPooledString( STRING(pEnt->m_target) ) : NULL_STRING;
+}
+
 void CGlobalEntityList::OnAddEntity( IHandleEntity *pEnt, CBaseHandle handle )
 {
 	int i = handle.GetEntryIndex();
@@ -1092,6 +1425,17 @@ void CGlobalEntityList::OnAddEntity( IHandleEntity *pEnt, CBaseHandle handle )
 	CBaseEntity *pBaseEnt = static_cast<IServerUnknown*>(pEnt)->GetBaseEntity();
 	if ( pBaseEnt->edict() )
 		m_iNumEdicts++;
+
+	// Entities are normally named after they're added, but not always
+	if ( pBaseEnt->GetEntityName() != NULL_STRING )
+		m_iNameGeneration++;
+
+	int iSlot = handle.GetEntryIndex();
+	m_nAddSequences[iSlot] = m_nNextAddSequence++;
+	m_ClassnameIndex.Update( iSlot, pBaseEnt->m_iClassname );
+	m_NameIndex.Update( iSlot, pBaseEnt->GetEntityName() );
+	m_TargetIndex.Update( iSlot, GetPooledTarget( pBaseEnt ) );
+	g_EntitySpatialHash.AddEntity( pBaseEnt, iSlot );
 	
 	// NOTE: Must be a CBaseEntity on server
 	Assert( pBaseEnt );
@@ -1126,6 +1470,38 @@ void CGlobalEntityList::OnRemoveEntity( IHandleEntity *pEnt, CBaseHandle handle
 		m_iNumEdicts--;
 
 	m_iNumEnts--;
+
+	m_ClassnameIndex.Remove( handle.GetEntryIndex() );
+	m_NameIndex.Remove( handle.GetEntryIndex() );
+	m_TargetIndex.Remove( handle.GetEntryIndex() );
+	g_EntitySpatialHash.RemoveEntity( handle.GetEntryIndex() );
+}
+
+void CGlobalEntityList::NotifyNameChanged( CBaseEntity *pEnt )
+{
+	m_iNameGeneration++;
+
+	// Not in the list yet; it'll be indexed when it's added
+	if ( !pEnt->GetRefEHandle().IsValid() || GetEntInfoPtr( pEnt->GetRefEHandle() )->m_pEntity != pEnt )
+		return;
+
+	m_NameIndex.Update( pEnt->GetRefEHandle().GetEntryIndex(), pEnt->GetEntityName() );
+}
+
+void CGlobalEntityList::NotifyClassnameChanged( CBaseEntity *pEnt )
+{
+	if ( !pEnt->GetRefEHandle().IsValid() || GetEntInfoPtr( pEnt->GetRefEHandle() )->m_pEntity != pEnt )
+		return;
+
+	m_ClassnameIndex.Update( pEnt->GetRefEHandle().GetEntryIndex(), pEnt->m_iClassname );
+}
+
+void CGlobalEntityList::NotifyTargetChanged( CBaseEntity *pEnt )
+{
+	if ( !pEnt->GetRefEHandle().IsValid() || GetEntInfoPtr( pEnt->GetRefEHandle() )->m_pEntity != pEnt )
+		return;
+
+	m_TargetIndex.Update( pEnt->GetRefEHandle().GetEntryIndex(), GetPooledTarget( pEnt ) );
 }
 
 void CGlobalEntityList::NotifyCreateEntity( CBaseEntity *pEnt )
@@ -1583,6 +1959,148 @@ CON_COMMAND(report_entities, "Lists all entities")
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Times classname, targetname and target searches with and without the
+//			name indices, and checks that both find the same entities in the same
+//			order. Pads the map out with server-only entities first.
+//-----------------------------------------------------------------------------
+enum EntFindBenchmarkSearch_t
+{
+	ENTFIND_CLASSNAME,
+	ENTFIND_NAME,
+	ENTFIND_TARGET,
+};
+
+static int EntFindBenchmark_Run( const char *pszQuery, EntFindBenchmarkSearch_t search, bool bIndexed, CUtlVector< CBaseEntity * > *pFound )
+{
+	int nFound = 0;
+	CBaseEntity *pEntity = NULL;
+	while ( 1 )
+	{
+		switch ( search )
+		{
+		case ENTFIND_CLASSNAME:
+			pEntity = bIndexed ? gEntList.FindEntityByClassname( pEntity, pszQuery ) : gEntList.FindEntityByClassnameUnindexed( pEntity, pszQuery );
+			break;
+		case ENTFIND_NAME:
+			pEntity = bIndexed ? gEntList.FindEntityByName( pEntity, pszQuery ) : gEntList.FindEntityByNameUnindexed( pEntity, pszQuery );
+			break;
+		case ENTFIND_TARGET:
+			pEntity = bIndexed ? gEntList.FindEntityByTarget( pEntity, pszQuery ) : gEntList.FindEntityByTargetUnindexed( pEntity, pszQuery );
+			break;
+		}
+
+		if ( !pEntity )
+			break;
+
+		if ( pFound )
+		{
+			pFound->AddToTail( pEntity );
+		}
+		nFound++;
+	}
+	return nFound;
+}
+
+CON_COMMAND_F( ent_find_benchmark, "Times entity searches with and without the classname, targetname and target indices. Usage: ent_find_benchmark [entity count, default 2000]", FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	int nEntities = ( args.ArgC() > 1 ) ? atoi( args[1] ) : 2000;
+
+	static const char *s_pszClassnames[] = { "bench_trigger", "bench_prop", "bench_relay", "bench_spawn", "bench_sound" };
+
+	CUtlVector< CBaseEntity * > added;
+	while ( gEntList.NumberOfEntities() < nEntities )
+	{
+		CBaseEntity *pEntity = CreateEntityByName( "logic_relay" );
+		if ( !pEntity )
+			break;
+
+		int i = added.Count();
+		pEntity->SetClassname( s_pszClassnames[i % ARRAYSIZE( s_pszClassnames )] );
+		if ( i % 3 )
+		{
+			pEntity->SetName( AllocPooledString( UTIL_VarArgs( "Bench_%d", i % 300 ) ) );
+		}
+		if ( !( i % 4 ) )
+		{
+			pEntity->SetTargetEntityName( AllocPooledString( UTIL_VarArgs( "Bench_%d", i % 50 ) ) );
+		}
+		added.AddToTail( pEntity );
+	}
+
+	struct Query_t
+	{
+		const char *m_pszQuery;
+		EntFindBenchmarkSearch_t m_Search;
+	};
+	static const Query_t s_Queries[] =
+	{
+		{ "worldspawn", ENTFIND_CLASSNAME },
+		{ "info_player_teamspawn", ENTFIND_CLASSNAME },
+		{ "team_control_point", ENTFIND_CLASSNAME },
+		{ "player", ENTFIND_CLASSNAME },
+		{ "bench_prop", ENTFIND_CLASSNAME },
+		{ "BENCH_RELAY", ENTFIND_CLASSNAME },
+		{ "bench_*", ENTFIND_CLASSNAME },
+		{ "func_*", ENTFIND_CLASSNAME },
+		{ "bench_17", ENTFIND_NAME },
+		{ "bench_299", ENTFIND_NAME },
+		{ "no_such_name", ENTFIND_NAME },
+		{ "bench_1*", ENTFIND_NAME },
+		{ "bench_12", ENTFIND_TARGET },
+		{ "no_such_name", ENTFIND_TARGET },
+	};
+
+	const int nRepeats = 100;
+	bool bMismatch = false;
+
+	Msg( "%d entities (%d added)\n", gEntList.NumberOfEntities(), added.Count() );
+	Msg( "%-24s %6s %12s %12s\n", "query", "found", "list (us)", "index (us)" );
+	for ( int i = 0; i < ARRAYSIZE( s_Queries ); i++ )
+	{
+		const Query_t &query = s_Queries[i];
+
+		CUtlVector< CBaseEntity * > unindexed, indexed;
+		EntFindBenchmark_Run( query.m_pszQuery, query.m_Search, false, &unindexed );
+		EntFindBenchmark_Run( query.m_pszQuery, query.m_Search, true, &indexed );
+		if ( unindexed.Count() != indexed.Count() || ( indexed.Count() && memcmp( unindexed.Base(), indexed.Base(), indexed.Count() * sizeof( CBaseEntity * ) ) ) )
+		{
+			Warning( "  %s: the index found different entities than the list!\n", query.m_pszQuery );
+			bMismatch = true;
+		}
+
+		double flStart = Plat_FloatTime();
+		for ( int j = 0; j < nRepeats; j++ )
+		{
+			EntFindBenchmark_Run( query.m_pszQuery, query.m_Search, false, NULL );
+		}
+		double flUnindexed = ( Plat_FloatTime() - flStart ) / nRepeats;
+
+		flStart = Plat_FloatTime();
+		for ( int j = 0; j < nRepeats; j++ )
+		{
+			EntFindBenchmark_Run( query.m_pszQuery, query.m_Search, true, NULL );
+		}
+		double flIndexed = ( Plat_FloatTime() - flStart ) / nRepeats;
+
+		Msg( "%-24s %6d %12.2f %12.2f\n", query.m_pszQuery, indexed.Count(), flUnindexed * 1e6, flIndexed * 1e6 );
+	}
+
+	if ( !bMismatch )
+	{
+		Msg( "All searches matched.\n" );
+	}
+
+	for ( int i = 0; i < added.Count(); i++ )
+	{
+		UTIL_RemoveImmediate( added[i] );
+	}
+}
+
+
 CON_COMMAND(report_touchlinks, "Lists all touchlinks")
 {
 	if ( !UTIL_IsCommandIssuedByServerAdmin() )
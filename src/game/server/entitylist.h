@@ -14,6 +14,7 @@
 #endif
 
 #include "baseentity.h"
+#include "utlrbtree.h"
 
 class IEntityListener;
 
@@ -66,6 +67,66 @@ public:
 	virtual CBaseEntity *GetFilterResult( void ) = 0;
 };
 
+//-----------------------------------------------------------------------------
+// Purpose: Index of the entities in the global list by classname, targetname or target,
+//			so searches only visit the entities that can match. Names match case
+//			insensitively, as in CBaseEntity::NameMatches, and each bucket is kept
+//			in entity list order so searches return entities in the same order
+//			as walking the list.
+//-----------------------------------------------------------------------------
+class CEntityNameIndex
+{
+public:
+	CEntityNameIndex();
+
+	// the entity list's order, by slot
+	void SetSequences( const unsigned int *pSequences ) { m_pSequences = pSequences; }
+
+	// (re)files the entity in the given slot under a name, or removes it if NULL_STRING
+	void Update( int iSlot, string_t name );
+	void Remove( int iSlot );
+	void Purge();
+
+	// Names that can't be looked up: empty, or starting with a wildcard
+	static bool CanSearch( const char *pszName ) { return pszName && pszName[0] && pszName[0] != '*'; }
+
+	// Returns the bucket for an exact name, or -1. Buckets can also hold names
+	// that NamesMatch doesn't consider equal, so check each entity in them.
+	int FindBucket( const char *pszName ) const;
+
+	// Iterates the buckets whose names start with the first nPrefixLength characters
+	// of pszPrefix. Both return -1 when there are no more.
+	int FirstPrefixBucket( const char *pszPrefix, int nPrefixLength ) const;
+	int NextPrefixBucket( int iBucket, const char *pszPrefix, int nPrefixLength ) const;
+
+	// Returns the first slot in the bucket that comes after iStartSlot in the entity list,
+	// or -1. iStartSlot may be -1 to start at the beginning.
+	int NextInBucket( int iBucket, int iStartSlot ) const;
+	int NextSlot( int iSlot ) const { return m_Links[iSlot].m_iNext; }
+
+private:
+	struct Bucket_t
+	{
+		const char *m_pszName;	// pooled, the name of the first entity added
+		int m_iHead;
+		int m_iTail;
+	};
+
+	struct Link_t
+	{
+		int m_iBucket;
+		int m_iPrev;
+		int m_iNext;
+	};
+
+	static bool BucketLessFunc( const Bucket_t &lhs, const Bucket_t &rhs );
+	bool IsBefore( int iSlotA, int iSlotB ) const { return (int)( m_pSequences[iSlotA] - m_pSequences[iSlotB] ) < 0; }
+
+	CUtlRBTree< Bucket_t, int > m_Buckets;
+	Link_t m_Links[NUM_ENT_ENTRIES];
+	const unsigned int *m_pSequences;
+};
+
 //-----------------------------------------------------------------------------
 // Purpose: a global list of all the entities in the game.  All iteration through
 //			entities is done through this object.
@@ -81,6 +142,18 @@ private:
 	bool m_bClearingEntities;
 	CUtlVector<IEntityListener *>	m_entityListeners;
 
+	int m_iNameGeneration;
+
+	// order each slot's entity was added in, which is the order of the list
+	unsigned int m_nAddSequences[NUM_ENT_ENTRIES];
+	unsigned int m_nNextAddSequence;
+
+	CEntityNameIndex m_ClassnameIndex;
+	CEntityNameIndex m_NameIndex;
+	CEntityNameIndex m_TargetIndex;
+
+	CBaseEntity *FindEntityInIndex( const CEntityNameIndex &index, CBaseEntity *pStartEntity, const char *szName, bool bClassname, IEntityFindFilter *pFilter );
+
 public:
 	IServerNetworkable* GetServerNetworkable( CBaseHandle hEnt ) const;
 	CBaseNetworkable* GetBaseNetworkable( CBaseHandle hEnt ) const;
@@ -112,6 +185,13 @@ public:
 	void NotifyCreateEntity( CBaseEntity *pEnt );
 	void NotifySpawn( CBaseEntity *pEnt );
 	void NotifyRemoveEntity( CBaseHandle hEnt );
+
+	// an entity's targetname changed. Anything caching the results of name
+	// searches checks the generation to know when to throw them away.
+	void NotifyNameChanged( CBaseEntity *pEnt );
+	int GetNameGeneration() const { return m_iNameGeneration; }
+	void NotifyClassnameChanged( CBaseEntity *pEnt );
+	void NotifyTargetChanged( CBaseEntity *pEnt );
 	// iteration functions
 
 	// returns the next entity after pCurrentEnt;  if pCurrentEnt is NULL, return the first entity
@@ -157,6 +237,12 @@ public:
 	CBaseEntity *FindEntityClassNearestFacing( const Vector &origin, const Vector &facing, float threshold, char *classname);
 
 	CBaseEntity *FindEntityProcedural( const char *szName, CBaseEntity *pSearchingEntity = NULL, CBaseEntity *pActivator = NULL, CBaseEntity *pCaller = NULL );
+
+	// the searches above without the name indices or the spatial hash, for checking them
+	CBaseEntity *FindEntityByClassnameUnindexed( CBaseEntity *pStartEntity, const char *szName );
+	CBaseEntity *FindEntityByNameUnindexed( CBaseEntity *pStartEntity, const char *szName, IEntityFindFilter *pFilter = NULL );
+	CBaseEntity *FindEntityByTargetUnindexed( CBaseEntity *pStartEntity, const char *szName );
+	CBaseEntity *FindEntityInSphereUnindexed( CBaseEntity *pStartEntity, const Vector &vecCenter, float flRadius );
 	
 	CGlobalEntityList();
 
@@ -0,0 +1,721 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Uniform grid of entity bounds for box and sphere queries.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "cbase.h"
+#include "entityspatialhash.h"
+#include "collisionutils.h"
+#include "tier0/vprof.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+ConVar sv_entity_spatial_hash( "sv_entity_spatial_hash", "0", FCVAR_NONE, "Answer UTIL_EntitiesInBox/InSphere from the game's entity grid instead of the engine partition. Same entities, but in entity index order rather than the partition's." );
+ConVar sv_entity_spatial_hash_find( "sv_entity_spatial_hash_find", "1", FCVAR_NONE, "Answer FindEntityInSphere from the game's entity grid instead of walking the entity list. The results and their order are the same." );
+
+#define SPATIAL_HASH_CELL_SIZE		256.0f
+#define SPATIAL_HASH_MAX_CELL		4096
+
+CEntitySpatialHash g_EntitySpatialHash;
+
+CEntitySpatialHash::CEntitySpatialHash()
+{
+	m_nQueryMark = 0;
+	for ( int i = 0; i < NUM_ENT_ENTRIES; i++ )
+	{
+		Entry_t &entry = m_Entries[i];
+		entry.m_pEntity = NULL;
+		entry.m_bInPartition = false;
+		entry.m_bHasPartitionBounds = false;
+		entry.m_bHasCollisionBounds = false;
+		entry.m_bInCells = false;
+		entry.m_iLarge = -1;
+		entry.m_iLoose = -1;
+		entry.m_nQueryMark = 0;
+	}
+}
+
+bool CEntitySpatialHash::IsEnabled() const
+{
+	return sv_entity_spatial_hash.GetBool();
+}
+
+bool CEntitySpatialHash::IsFindEnabled() const
+{
+	return sv_entity_spatial_hash_find.GetBool();
+}
+
+//-----------------------------------------------------------------------------
+// Entity list hooks
+//-----------------------------------------------------------------------------
+void CEntitySpatialHash::AddEntity( CBaseEntity *pEntity, int iSlot )
+{
+	AUTO_LOCK( m_Mutex );
+
+	RemoveEntity( iSlot );
+
+	// Loose until its first partition update places it
+	m_Entries[iSlot].m_pEntity = pEntity;
+	SetLoose( iSlot, true );
+}
+
+void CEntitySpatialHash::RemoveEntity( int iSlot )
+{
+	AUTO_LOCK( m_Mutex );
+
+	Entry_t &entry = m_Entries[iSlot];
+	SetLoose( iSlot, false );
+	entry.m_bInPartition = false;
+	entry.m_bHasPartitionBounds = false;
+	entry.m_bHasCollisionBounds = false;
+	UpdateGrid( iSlot );
+	entry.m_pEntity = NULL;
+}
+
+void CEntitySpatialHash::Purge()
+{
+	AUTO_LOCK( m_Mutex );
+
+	for ( int i = 0; i < NUM_ENT_ENTRIES; i++ )
+	{
+		if ( m_Entries[i].m_pEntity )
+		{
+			RemoveEntity( i );
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Is this the entity the list has in its slot? Collision properties
+//			can still change while their entity is being destroyed.
+//-----------------------------------------------------------------------------
+bool CEntitySpatialHash::IsTracked( CBaseEntity *pEntity, int &iSlot ) const
+{
+	const CBaseHandle &handle = pEntity->GetRefEHandle();
+	if ( !handle.IsValid() )
+		return false;
+
+	iSlot = handle.GetEntryIndex();
+	return m_Entries[iSlot].m_pEntity == pEntity;
+}
+
+void CEntitySpatialHash::SetLoose( int iSlot, bool bLoose )
+{
+	Entry_t &entry = m_Entries[iSlot];
+	if ( bLoose == ( entry.m_iLoose != -1 ) )
+		return;
+
+	if ( bLoose )
+	{
+		entry.m_iLoose = m_Loose.AddToTail( iSlot );
+	}
+	else
+	{
+		int iLast = m_Loose.Tail();
+		m_Entries[ m_Loose[iLast] ].m_iLoose = entry.m_iLoose;
+		m_Loose.FastRemove( entry.m_iLoose );
+		entry.m_iLoose = -1;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// CCollisionProperty hooks
+//-----------------------------------------------------------------------------
+void CEntitySpatialHash::MarkDirty( CBaseEntity *pEntity )
+{
+	AUTO_LOCK( m_Mutex );
+
+	int iSlot;
+	if ( IsTracked( pEntity, iSlot ) )
+	{
+		// Its collision bounds are out of date until UpdateEntity. The partition
+		// keeps the old bounds until then, and so does the grid.
+		SetLoose( iSlot, true );
+	}
+}
+
+void CEntitySpatialHash::SetInPartition( CBaseEntity *pEntity, bool bInPartition )
+{
+	AUTO_LOCK( m_Mutex );
+
+	int iSlot;
+	if ( IsTracked( pEntity, iSlot ) )
+	{
+		m_Entries[iSlot].m_bInPartition = bInPartition;
+	}
+}
+
+void CEntitySpatialHash::SetPartitionBounds( CBaseEntity *pEntity, const Vector &vecMins, const Vector &vecMaxs )
+{
+	AUTO_LOCK( m_Mutex );
+
+	int iSlot;
+	if ( !IsTracked( pEntity, iSlot ) )
+		return;
+
+	Entry_t &entry = m_Entries[iSlot];
+	entry.m_vecPartitionMins = vecMins;
+	entry.m_vecPartitionMaxs = vecMaxs;
+	entry.m_bHasPartitionBounds = true;
+	UpdateGrid( iSlot );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Called once UpdatePartition has dealt with the entity
+//-----------------------------------------------------------------------------
+void CEntitySpatialHash::UpdateEntity( CBaseEntity *pEntity )
+{
+	AUTO_LOCK( m_Mutex );
+
+	int iSlot;
+	if ( !IsTracked( pEntity, iSlot ) )
+		return;
+
+	Entry_t &entry = m_Entries[iSlot];
+	SetLoose( iSlot, false );
+
+	// FindEntityInSphere skips entities without an edict
+	entry.m_bHasCollisionBounds = ( pEntity->edict() != NULL );
+	if ( entry.m_bHasCollisionBounds )
+	{
+		CCollisionProperty *pCollision = pEntity->CollisionProp();
+		const Vector &vecOrigin = pCollision->GetCollisionOrigin();
+		const Vector &vecOBBMins = pCollision->OBBMins();
+		const Vector &vecOBBMaxs = pCollision->OBBMaxs();
+		if ( pCollision->IsBoundsDefinedInEntitySpace() )
+		{
+			// Rotating doesn't always mark the entity dirty, so take a box
+			// that holds the OBB at any angle
+			Vector vecFarthest;
+			for ( int i = 0; i < 3; i++ )
+			{
+				vecFarthest[i] = MAX( fabs( vecOBBMins[i] ), fabs( vecOBBMaxs[i] ) );
+			}
+			float flRadius = vecFarthest.Length();
+			entry.m_vecCollisionMins = vecOrigin - Vector( flRadius, flRadius, flRadius );
+			entry.m_vecCollisionMaxs = vecOrigin + Vector( flRadius, flRadius, flRadius );
+		}
+		else
+		{
+			entry.m_vecCollisionMins = vecOrigin + vecOBBMins;
+			entry.m_vecCollisionMaxs = vecOrigin + vecOBBMaxs;
+		}
+	}
+
+	UpdateGrid( iSlot );
+}
+
+//-----------------------------------------------------------------------------
+// Grid maintenance
+//-----------------------------------------------------------------------------
+void CEntitySpatialHash::GetCellRange( const Vector &vecMins, const Vector &vecMaxs, int nCellMins[3], int nCellMaxs[3] )
+{
+	for ( int i = 0; i < 3; i++ )
+	{
+		nCellMins[i] = clamp( (int)floor( vecMins[i] * ( 1.0f / SPATIAL_HASH_CELL_SIZE ) ), -SPATIAL_HASH_MAX_CELL, SPATIAL_HASH_MAX_CELL );
+		nCellMaxs[i] = clamp( (int)floor( vecMaxs[i] * ( 1.0f / SPATIAL_HASH_CELL_SIZE ) ), -SPATIAL_HASH_MAX_CELL, SPATIAL_HASH_MAX_CELL );
+	}
+}
+
+int CEntitySpatialHash::GetBucket( int x, int y, int z )
+{
+	unsigned int nHash = ( (unsigned int)x * 73856093u ) ^ ( (unsigned int)y * 19349663u ) ^ ( (unsigned int)z * 83492791u );
+	return nHash & ( NUM_BUCKETS - 1 );
+}
+
+void CEntitySpatialHash::AddToCells( int iSlot )
+{
+	Entry_t &entry = m_Entries[iSlot];
+	for ( int x = entry.m_nCellMins[0]; x <= entry.m_nCellMaxs[0]; x++ )
+	{
+		for ( int y = entry.m_nCellMins[1]; y <= entry.m_nCellMaxs[1]; y++ )
+		{
+			for ( int z = entry.m_nCellMins[2]; z <= entry.m_nCellMaxs[2]; z++ )
+			{
+				m_Buckets[ GetBucket( x, y, z ) ].AddToTail( iSlot );
+			}
+		}
+	}
+	entry.m_bInCells = true;
+}
+
+void CEntitySpatialHash::RemoveFromCells( int iSlot )
+{
+	Entry_t &entry = m_Entries[iSlot];
+	if ( !entry.m_bInCells )
+		return;
+
+	for ( int x = entry.m_nCellMins[0]; x <= entry.m_nCellMaxs[0]; x++ )
+	{
+		for ( int y = entry.m_nCellMins[1]; y <= entry.m_nCellMaxs[1]; y++ )
+		{
+			for ( int z = entry.m_nCellMins[2]; z <= entry.m_nCellMaxs[2]; z++ )
+			{
+				m_Buckets[ GetBucket( x, y, z ) ].FindAndFastRemove( iSlot );
+			}
+		}
+	}
+	entry.m_bInCells = false;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Files the entity under the cells covering both of its boxes
+//-----------------------------------------------------------------------------
+void CEntitySpatialHash::UpdateGrid( int iSlot )
+{
+	Entry_t &entry = m_Entries[iSlot];
+
+	bool bPartition = entry.m_bHasPartitionBounds;
+	bool bCollision = entry.m_bHasCollisionBounds;
+	if ( !bPartition && !bCollision )
+	{
+		RemoveFromCells( iSlot );
+		if ( entry.m_iLarge != -1 )
+		{
+			int iLast = m_Large.Tail();
+			m_Entries[ m_Large[iLast] ].m_iLarge = entry.m_iLarge;
+			m_Large.FastRemove( entry.m_iLarge );
+			entry.m_iLarge = -1;
+		}
+		return;
+	}
+
+	Vector vecMins = bPartition ? entry.m_vecPartitionMins : entry.m_vecCollisionMins;
+	Vector vecMaxs = bPartition ? entry.m_vecPartitionMaxs : entry.m_vecCollisionMaxs;
+	if ( bPartition && bCollision )
+	{
+		VectorMin( vecMins, entry.m_vecCollisionMins, vecMins );
+		VectorMax( vecMaxs, entry.m_vecCollisionMaxs, vecMaxs );
+	}
+
+	int nCellMins[3], nCellMaxs[3];
+	GetCellRange( vecMins, vecMaxs, nCellMins, nCellMaxs );
+
+	int nCells = ( nCellMaxs[0] - nCellMins[0] + 1 ) * ( nCellMaxs[1] - nCellMins[1] + 1 ) * ( nCellMaxs[2] - nCellMins[2] + 1 );
+	if ( nCells > MAX_ENTITY_CELLS )
+	{
+		RemoveFromCells( iSlot );
+		if ( entry.m_iLarge == -1 )
+		{
+			entry.m_iLarge = m_Large.AddToTail( iSlot );
+		}
+		return;
+	}
+
+	if ( entry.m_iLarge != -1 )
+	{
+		int iLast = m_Large.Tail();
+		m_Entries[ m_Large[iLast] ].m_iLarge = entry.m_iLarge;
+		m_Large.FastRemove( entry.m_iLarge );
+		entry.m_iLarge = -1;
+	}
+
+	// Most moves stay within the same cells
+	if ( entry.m_bInCells && !memcmp( nCellMins, entry.m_nCellMins, sizeof( nCellMins ) ) && !memcmp( nCellMaxs, entry.m_nCellMaxs, sizeof( nCellMaxs ) ) )
+		return;
+
+	RemoveFromCells( iSlot );
+	memcpy( entry.m_nCellMins, nCellMins, sizeof( nCellMins ) );
+	memcpy( entry.m_nCellMaxs, nCellMaxs, sizeof( nCellMaxs ) );
+	AddToCells( iSlot );
+}
+
+//-----------------------------------------------------------------------------
+// Queries
+//-----------------------------------------------------------------------------
+void CEntitySpatialHash::AddCandidate( int iSlot )
+{
+	Entry_t &entry = m_Entries[iSlot];
+	if ( entry.m_nQueryMark != m_nQueryMark )
+	{
+		entry.m_nQueryMark = m_nQueryMark;
+		m_Candidates.AddToTail( iSlot );
+	}
+}
+
+static int SlotSortFunc( const int *pLeft, const int *pRight )
+{
+	return *pLeft - *pRight;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Every entity filed in a cell the box touches, plus the large and
+//			loose ones, each once, in slot order
+//-----------------------------------------------------------------------------
+bool CEntitySpatialHash::GatherCandidates( const Vector &vecMins, const Vector &vecMaxs )
+{
+	int nCellMins[3], nCellMaxs[3];
+	GetCellRange( vecMins, vecMaxs, nCellMins, nCellMaxs );
+
+	int nCells = ( nCellMaxs[0] - nCellMins[0] + 1 ) * ( nCellMaxs[1] - nCellMins[1] + 1 ) * ( nCellMaxs[2] - nCellMins[2] + 1 );
+	if ( nCells > MAX_QUERY_CELLS )
+		return false;
+
+	m_Candidates.RemoveAll();
+	if ( ++m_nQueryMark == 0 )
+	{
+		for ( int i = 0; i < NUM_ENT_ENTRIES; i++ )
+		{
+			m_Entries[i].m_nQueryMark = 0;
+		}
+		m_nQueryMark = 1;
+	}
+
+	for ( int x = nCellMins[0]; x <= nCellMaxs[0]; x++ )
+	{
+		for ( int y = nCellMins[1]; y <= nCellMaxs[1]; y++ )
+		{
+			for ( int z = nCellMins[2]; z <= nCellMaxs[2]; z++ )
+			{
+				const CUtlVector< int > &bucket = m_Buckets[ GetBucket( x, y, z ) ];
+				for ( int i = 0; i < bucket.Count(); i++ )
+				{
+					AddCandidate( bucket[i] );
+				}
+			}
+		}
+	}
+
+	for ( int i = 0; i < m_Large.Count(); i++ )
+	{
+		AddCandidate( m_Large[i] );
+	}
+
+	for ( int i = 0; i < m_Loose.Count(); i++ )
+	{
+		AddCandidate( m_Loose[i] );
+	}
+
+	m_Candidates.Sort( SlotSortFunc );
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: The partition's test of an entity against a box or sphere
+//-----------------------------------------------------------------------------
+bool CEntitySpatialHash::IsPartitionHit( int iSlot, const Vector &vecMins, const Vector &vecMaxs, const Vector *pCenter, float flRadius ) const
+{
+	const Entry_t &entry = m_Entries[iSlot];
+	if ( !entry.m_bInPartition || !entry.m_bHasPartitionBounds )
+		return false;
+
+	return pCenter ?
+		IsBoxIntersectingSphere( entry.m_vecPartitionMins, entry.m_vecPartitionMaxs, *pCenter, flRadius ) :
+		IsBoxIntersectingBox( entry.m_vecPartitionMins, entry.m_vecPartitionMaxs, vecMins, vecMaxs );
+}
+
+void CEntitySpatialHash::AddSphereHits( const Vector &vecCenter, float flRadius, CUtlVector< CBaseEntity * > &hits ) const
+{
+	for ( int i = 0; i < m_Candidates.Count(); i++ )
+	{
+		if ( IsPartitionHit( m_Candidates[i], vec3_origin, vec3_origin, &vecCenter, flRadius ) )
+		{
+			hits.AddToTail( m_Entries[ m_Candidates[i] ].m_pEntity );
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Tests the candidates against their partition bounds the way the
+//			partition does, then hands the hits to the enumerator outside the
+//			lock, so it's free to move entities or query again.
+//-----------------------------------------------------------------------------
+bool CEntitySpatialHash::EnumerateCandidates( IPartitionEnumerator *pEnum, const Vector &vecMins, const Vector &vecMaxs, const Vector *pCenter, float flRadius )
+{
+	CUtlVectorFixedGrowable< CBaseEntity *, 128 > hits;
+
+	{
+		AUTO_LOCK( m_Mutex );
+		if ( !GatherCandidates( vecMins, vecMaxs ) )
+			return false;
+
+		for ( int i = 0; i < m_Candidates.Count(); i++ )
+		{
+			if ( IsPartitionHit( m_Candidates[i], vecMins, vecMaxs, pCenter, flRadius ) )
+			{
+				hits.AddToTail( m_Entries[ m_Candidates[i] ].m_pEntity );
+			}
+		}
+	}
+
+	for ( int i = 0; i < hits.Count(); i++ )
+	{
+		if ( pEnum->EnumElement( hits[i] ) == ITERATION_STOP )
+			break;
+	}
+	return true;
+}
+
+bool CEntitySpatialHash::EnumerateElementsInBox( const Vector &vecMins, const Vector &vecMaxs, IPartitionEnumerator *pEnum )
+{
+	VPROF( "CEntitySpatialHash::EnumerateElementsInBox" );
+
+	// The partition brings dirty entities up to date before each query
+	UpdateDirtySpatialPartitionEntities();
+	return EnumerateCandidates( pEnum, vecMins, vecMaxs, NULL, 0.0f );
+}
+
+bool CEntitySpatialHash::EnumerateElementsInSphere( const Vector &vecCenter, float flRadius, IPartitionEnumerator *pEnum )
+{
+	VPROF( "CEntitySpatialHash::EnumerateElementsInSphere" );
+
+	UpdateDirtySpatialPartitionEntities();
+	Vector vecExtents( flRadius, flRadius, flRadius );
+	return EnumerateCandidates( pEnum, vecCenter - vecExtents, vecCenter + vecExtents, &vecCenter, flRadius );
+}
+
+bool CEntitySpatialHash::GetElementsInSpheres( const Vector *pCenters, const float *pRadii, int nSpheres, CUtlVector< CBaseEntity * > &hits, int *pFirst, int *pCount )
+{
+	VPROF( "CEntitySpatialHash::GetElementsInSpheres" );
+
+	hits.RemoveAll();
+	if ( nSpheres <= 0 )
+		return true;
+
+	UpdateDirtySpatialPartitionEntities();
+
+	Vector vecUnionMins( FLT_MAX, FLT_MAX, FLT_MAX );
+	Vector vecUnionMaxs( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+	for ( int i = 0; i < nSpheres; i++ )
+	{
+		Vector vecExtents( pRadii[i], pRadii[i], pRadii[i] );
+		VectorMin( vecUnionMins, pCenters[i] - vecExtents, vecUnionMins );
+		VectorMax( vecUnionMaxs, pCenters[i] + vecExtents, vecUnionMaxs );
+	}
+
+	AUTO_LOCK( m_Mutex );
+
+	// Close together: one walk over the cells they share
+	if ( GatherCandidates( vecUnionMins, vecUnionMaxs ) )
+	{
+		for ( int i = 0; i < nSpheres; i++ )
+		{
+			pFirst[i] = hits.Count();
+			AddSphereHits( pCenters[i], pRadii[i], hits );
+			pCount[i] = hits.Count() - pFirst[i];
+		}
+		return true;
+	}
+
+	// Spread out: a walk per sphere, still under one lock and one partition update
+	for ( int i = 0; i < nSpheres; i++ )
+	{
+		Vector vecExtents( pRadii[i], pRadii[i], pRadii[i] );
+		if ( !GatherCandidates( pCenters[i] - vecExtents, pCenters[i] + vecExtents ) )
+		{
+			hits.RemoveAll();
+			return false;
+		}
+
+		pFirst[i] = hits.Count();
+		AddSphereHits( pCenters[i], pRadii[i], hits );
+		pCount[i] = hits.Count() - pFirst[i];
+	}
+	return true;
+}
+
+bool CEntitySpatialHash::GetCollisionCandidates( const Vector &vecMins, const Vector &vecMaxs, SlotList_t &slots )
+{
+	UpdateDirtySpatialPartitionEntities();
+
+	AUTO_LOCK( m_Mutex );
+	if ( !GatherCandidates( vecMins, vecMaxs ) )
+		return false;
+
+	slots.RemoveAll();
+	for ( int i = 0; i < m_Candidates.Count(); i++ )
+	{
+		int iSlot = m_Candidates[i];
+		const Entry_t &entry = m_Entries[iSlot];
+
+		// Loose entities get tested whatever their last bounds were
+		if ( entry.m_iLoose == -1 )
+		{
+			if ( !entry.m_bHasCollisionBounds || !IsBoxIntersectingBox( entry.m_vecCollisionMins, entry.m_vecCollisionMaxs, vecMins, vecMaxs ) )
+				continue;
+		}
+
+		slots.AddToTail( iSlot );
+	}
+	return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Cross-check against the engine partition and the entity list
+//-----------------------------------------------------------------------------
+static int SpatialHashCheck_SortFunc( CBaseEntity * const *ppLeft, CBaseEntity * const *ppRight )
+{
+	if ( *ppLeft == *ppRight )
+		return 0;
+	return ( *ppLeft < *ppRight ) ? -1 : 1;
+}
+
+static bool SpatialHashCheck_SameEntities( CBaseEntity **pA, int nA, CBaseEntity **pB, int nB )
+{
+	if ( nA != nB )
+		return false;
+
+	CUtlVector< CBaseEntity * > a, b;
+	a.CopyArray( pA, nA );
+	b.CopyArray( pB, nB );
+	a.Sort( SpatialHashCheck_SortFunc );
+	b.Sort( SpatialHashCheck_SortFunc );
+	return !nA || !memcmp( a.Base(), b.Base(), nA * sizeof( CBaseEntity * ) );
+}
+
+static void SpatialHashCheck_Shuffle( CBaseEntity *pEntity, float flWorldSize )
+{
+	static const SolidType_t s_SolidTypes[] = { SOLID_NONE, SOLID_BBOX, SOLID_OBB };
+	pEntity->SetSolid( s_SolidTypes[ RandomInt( 0, ARRAYSIZE( s_SolidTypes ) - 1 ) ] );
+	pEntity->SetSolidFlags( RandomInt( 0, 3 ) ? 0 : FSOLID_TRIGGER );
+	pEntity->CollisionProp()->SetSurroundingBoundsType( RandomInt( 0, 1 ) ? USE_OBB_COLLISION_BOUNDS : USE_ROTATION_EXPANDED_BOUNDS );
+	UTIL_SetSize( pEntity, -RandomVector( 0.0f, 64.0f ), RandomVector( 0.0f, 64.0f ) );
+	pEntity->SetAbsOrigin( RandomVector( -flWorldSize, flWorldSize ) );
+	pEntity->SetAbsAngles( QAngle( RandomFloat( -90.0f, 90.0f ), RandomFloat( 0.0f, 360.0f ), 0.0f ) );
+}
+
+CON_COMMAND_F( ent_spatialhash_check, "Compares the entity grid with the engine partition and the entity list on random box and sphere queries, moving test entities around between rounds. Usage: ent_spatialhash_check [rounds, default 100] [test entities, default 500]", FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	int nRounds = ( args.ArgC() > 1 ) ? atoi( args[1] ) : 100;
+	int nEntities = ( args.ArgC() > 2 ) ? atoi( args[2] ) : 500;
+
+	const float flWorldSize = 4096.0f;
+	const int nQueriesPerRound = 32;
+	const int nMaxResults = 4096;
+
+	CUtlVector< CBaseEntity * > added;
+	for ( int i = 0; i < nEntities; i++ )
+	{
+		CBaseEntity *pEntity = CreateEntityByName( "info_teleport_destination" );
+		if ( !pEntity )
+			break;
+
+		DispatchSpawn( pEntity );
+		SpatialHashCheck_Shuffle( pEntity, flWorldSize );
+		added.AddToTail( pEntity );
+	}
+
+	CUtlVector< CBaseEntity * > partitionList, hashList, batchList;
+	partitionList.SetCount( nMaxResults );
+	hashList.SetCount( nMaxResults );
+	batchList.SetCount( nMaxResults * nQueriesPerRound );
+
+	Vector vecCenters[ nQueriesPerRound ];
+	float flRadii[ nQueriesPerRound ];
+	int nFirst[ nQueriesPerRound ], nCount[ nQueriesPerRound ];
+
+	int nQueries = 0;
+	int nFound = 0;
+	int nMismatches = 0;
+	double flPartitionTime = 0.0, flHashTime = 0.0, flListTime = 0.0, flListHashTime = 0.0;
+	for ( int iRound = 0; iRound < nRounds; iRound++ )
+	{
+		// Move some of them, leave the rest where they are
+		for ( int i = 0; i < added.Count(); i++ )
+		{
+			if ( RandomInt( 0, 3 ) == 0 )
+			{
+				SpatialHashCheck_Shuffle( added[i], flWorldSize );
+			}
+		}
+
+		for ( int iQuery = 0; iQuery < nQueriesPerRound; iQuery++ )
+		{
+			bool bSphere = ( iQuery & 1 ) != 0;
+			Vector vecCenter = RandomVector( -flWorldSize, flWorldSize );
+			float flRadius = RandomFloat( 0.0f, 1024.0f );
+			Vector vecMins = vecCenter - RandomVector( 0.0f, 1024.0f );
+			Vector vecMaxs = vecCenter + RandomVector( 0.0f, 1024.0f );
+			vecCenters[iQuery] = vecCenter;
+			flRadii[iQuery] = flRadius;
+
+			CFlaggedEntitiesEnum partitionEnum( partitionList.Base(), nMaxResults, 0 );
+			CFlaggedEntitiesEnum hashEnum( hashList.Base(), nMaxResults, 0 );
+
+			double flStart = Plat_FloatTime();
+			if ( bSphere )
+			{
+				partition->EnumerateElementsInSphere( PARTITION_ENGINE_NON_STATIC_EDICTS, vecCenter, flRadius, false, &partitionEnum );
+			}
+			else
+			{
+				partition->EnumerateElementsInBox( PARTITION_ENGINE_NON_STATIC_EDICTS, vecMins, vecMaxs, false, &partitionEnum );
+			}
+			double flMid = Plat_FloatTime();
+			bool bHandled = bSphere ?
+				g_EntitySpatialHash.EnumerateElementsInSphere( vecCenter, flRadius, &hashEnum ) :
+				g_EntitySpatialHash.EnumerateElementsInBox( vecMins, vecMaxs, &hashEnum );
+			flPartitionTime += flMid - flStart;
+			flHashTime += Plat_FloatTime() - flMid;
+
+			nQueries++;
+			nFound += partitionEnum.GetCount();
+			if ( !bHandled || !SpatialHashCheck_SameEntities( partitionList.Base(), partitionEnum.GetCount(), hashList.Base(), hashEnum.GetCount() ) )
+			{
+				Warning( "  %s at (%.0f %.0f %.0f): partition found %d, grid found %d\n", bSphere ? "sphere" : "box", vecCenter.x, vecCenter.y, vecCenter.z, partitionEnum.GetCount(), bHandled ? hashEnum.GetCount() : -1 );
+				nMismatches++;
+			}
+
+			if ( !bSphere )
+				continue;
+
+			// FindEntityInSphere has to come back in list order too
+			int nList = 0, nListHash = 0;
+			flStart = Plat_FloatTime();
+			for ( CBaseEntity *pEntity = gEntList.FindEntityInSphereUnindexed( NULL, vecCenter, flRadius ); pEntity && nList < nMaxResults; pEntity = gEntList.FindEntityInSphereUnindexed( pEntity, vecCenter, flRadius ) )
+			{
+				partitionList[ nList++ ] = pEntity;
+			}
+			flMid = Plat_FloatTime();
+			for ( CBaseEntity *pEntity = gEntList.FindEntityInSphere( NULL, vecCenter, flRadius ); pEntity && nListHash < nMaxResults; pEntity = gEntList.FindEntityInSphere( pEntity, vecCenter, flRadius ) )
+			{
+				hashList[ nListHash++ ] = pEntity;
+			}
+			flListTime += flMid - flStart;
+			flListHashTime += Plat_FloatTime() - flMid;
+
+			if ( nList != nListHash || ( nList && memcmp( partitionList.Base(), hashList.Base(), nList * sizeof( CBaseEntity * ) ) ) )
+			{
+				Warning( "  FindEntityInSphere at (%.0f %.0f %.0f) r %.0f: list found %d, grid found %d\n", vecCenter.x, vecCenter.y, vecCenter.z, flRadius, nList, nListHash );
+				nMismatches++;
+			}
+		}
+
+		// The batched version against single partition queries
+		UTIL_EntitiesInSpheres( batchList.Base(), batchList.Count(), nFirst, nCount, vecCenters, flRadii, nQueriesPerRound, 0 );
+		for ( int iQuery = 0; iQuery < nQueriesPerRound; iQuery++ )
+		{
+			CFlaggedEntitiesEnum partitionEnum( partitionList.Base(), nMaxResults, 0 );
+			partition->EnumerateElementsInSphere( PARTITION_ENGINE_NON_STATIC_EDICTS, vecCenters[iQuery], flRadii[iQuery], false, &partitionEnum );
+			if ( !SpatialHashCheck_SameEntities( partitionList.Base(), partitionEnum.GetCount(), batchList.Base() + nFirst[iQuery], nCount[iQuery] ) )
+			{
+				Warning( "  UTIL_EntitiesInSpheres sphere %d: partition found %d, batch found %d\n", iQuery, partitionEnum.GetCount(), nCount[iQuery] );
+				nMismatches++;
+			}
+		}
+	}
+
+	for ( int i = 0; i < added.Count(); i++ )
+	{
+		UTIL_RemoveImmediate( added[i] );
+	}
+
+	Msg( "%d entities (%d added), %d queries, %d partition hits\n", gEntList.NumberOfEntities() + added.Count(), added.Count(), nQueries, nFound );
+	Msg( "  partition %8.2f us/query   grid %8.2f us/query\n", flPartitionTime * 1e6 / MAX( nQueries, 1 ), flHashTime * 1e6 / MAX( nQueries, 1 ) );
+	Msg( "  FindEntityInSphere: list %8.2f us/sphere   grid %8.2f us/sphere\n", flListTime * 2e6 / MAX( nQueries, 1 ), flListHashTime * 2e6 / MAX( nQueries, 1 ) );
+	if ( nMismatches )
+	{
+		Warning( "%d mismatches!\n", nMismatches );
+	}
+	else
+	{
+		Msg( "All queries matched.\n" );
+	}
+}
@@ -0,0 +1,133 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Uniform grid of entity bounds for the box and sphere queries the
+//			game makes every tick (UTIL_EntitiesInBox, UTIL_EntitiesInSphere,
+//			CGlobalEntityList::FindEntityInSphere).
+//
+//			Every entity is filed under the grid cells its bounds touch. Those
+//			bounds cover both the box the entity has in the engine's spatial
+//			partition, so UTIL_EntitiesIn* can give the same answers as the
+//			partition, and the world box of its collision OBB, for
+//			FindEntityInSphere. The grid is updated from the same places as the
+//			partition: CCollisionProperty::UpdatePartition, which runs for
+//			entities marked dirty by SetAbsOrigin and the like, and
+//			UpdateServerPartitionMask. Entities that are marked dirty but not
+//			updated yet, or have never been placed, stay on a loose list that
+//			every query checks.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef ENTITYSPATIALHASH_H
+#define ENTITYSPATIALHASH_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "utlvector.h"
+#include "ispatialpartition.h"
+
+class CBaseEntity;
+
+
+class CEntitySpatialHash
+{
+public:
+	typedef CUtlVectorFixedGrowable< int, 64 > SlotList_t;
+
+	CEntitySpatialHash();
+
+	// UTIL_EntitiesInBox/InSphere hand back their entities in a different order
+	// from the partition, so they only use the grid when asked to.
+	// FindEntityInSphere comes back in list order either way.
+	bool	IsEnabled() const;
+	bool	IsFindEnabled() const;
+
+	// CGlobalEntityList hooks
+	void	AddEntity( CBaseEntity *pEntity, int iSlot );
+	void	RemoveEntity( int iSlot );
+	void	Purge();
+
+	// CCollisionProperty hooks. The partition calls are mirrored exactly;
+	// UpdateEntity follows UpdatePartition and refreshes the collision bounds.
+	void	MarkDirty( CBaseEntity *pEntity );
+	void	SetInPartition( CBaseEntity *pEntity, bool bInPartition );
+	void	SetPartitionBounds( CBaseEntity *pEntity, const Vector &vecMins, const Vector &vecMaxs );
+	void	UpdateEntity( CBaseEntity *pEntity );
+
+	// Same results as the partition enumerating PARTITION_ENGINE_NON_STATIC_EDICTS
+	// without a coarse test, in entity index order. Returns false without calling
+	// pEnum if the query is too big for the grid to help; use the partition then.
+	bool	EnumerateElementsInBox( const Vector &vecMins, const Vector &vecMaxs, IPartitionEnumerator *pEnum );
+	bool	EnumerateElementsInSphere( const Vector &vecCenter, float flRadius, IPartitionEnumerator *pEnum );
+
+	// EnumerateElementsInSphere for nSpheres spheres at once. The cells under all
+	// of them are walked once when they're close together, and every candidate is
+	// tested against each sphere. Sphere i's entities are hits[pFirst[i]] to
+	// hits[pFirst[i] + pCount[i] - 1]. Returns false if any sphere is too big.
+	bool	GetElementsInSpheres( const Vector *pCenters, const float *pRadii, int nSpheres, CUtlVector< CBaseEntity * > &hits, int *pFirst, int *pCount );
+
+	// Slots of every entity with an edict whose collision OBB may touch the box,
+	// for searches that test the OBB themselves. Returns false if the box is too big.
+	bool	GetCollisionCandidates( const Vector &vecMins, const Vector &vecMaxs, SlotList_t &slots );
+
+private:
+	enum
+	{
+		NUM_BUCKETS = 4096,
+		MAX_ENTITY_CELLS = 64,		// entities bigger than this go on m_Large
+		MAX_QUERY_CELLS = 2048,
+	};
+
+	struct Entry_t
+	{
+		CBaseEntity *m_pEntity;
+
+		// what the partition has
+		Vector	m_vecPartitionMins;
+		Vector	m_vecPartitionMaxs;
+		bool	m_bInPartition;
+		bool	m_bHasPartitionBounds;
+
+		// contains the collision OBB, however the entity is rotated
+		Vector	m_vecCollisionMins;
+		Vector	m_vecCollisionMaxs;
+		bool	m_bHasCollisionBounds;
+
+		// where it is in the grid
+		bool	m_bInCells;
+		int		m_nCellMins[3];
+		int		m_nCellMaxs[3];
+		int		m_iLarge;
+		int		m_iLoose;
+
+		unsigned int m_nQueryMark;
+	};
+
+	bool	IsTracked( CBaseEntity *pEntity, int &iSlot ) const;
+	void	SetLoose( int iSlot, bool bLoose );
+	void	UpdateGrid( int iSlot );
+	void	AddToCells( int iSlot );
+	void	RemoveFromCells( int iSlot );
+	static void	GetCellRange( const Vector &vecMins, const Vector &vecMaxs, int nCellMins[3], int nCellMaxs[3] );
+	static int	GetBucket( int x, int y, int z );
+
+	// Fills m_Candidates, under the lock
+	bool	GatherCandidates( const Vector &vecMins, const Vector &vecMaxs );
+	void	AddCandidate( int iSlot );
+	bool	IsPartitionHit( int iSlot, const Vector &vecMins, const Vector &vecMaxs, const Vector *pCenter, float flRadius ) const;
+	void	AddSphereHits( const Vector &vecCenter, float flRadius, CUtlVector< CBaseEntity * > &hits ) const;
+	bool	EnumerateCandidates( IPartitionEnumerator *pEnum, const Vector &vecMins, const Vector &vecMaxs, const Vector *pCenter, float flRadius );
+
+	Entry_t			m_Entries[NUM_ENT_ENTRIES];
+	CUtlVector< int >	m_Buckets[NUM_BUCKETS];
+	CUtlVector< int >	m_Large;
+	CUtlVector< int >	m_Loose;
+	CUtlVector< int >	m_Candidates;
+	unsigned int	m_nQueryMark;
+	CThreadFastMutex	m_Mutex;
+};
+
+extern CEntitySpatialHash g_EntitySpatialHash;
+
+#endif // ENTITYSPATIALHASH_H
@@ -15,6 +15,7 @@
 #endif
 
 #include "mempool.h"
+#include "utlmap.h"
 
 struct EventQueuePrioritizedEvent_t
 {
@@ -28,8 +29,17 @@ struct EventQueuePrioritizedEvent_t
 
 	variant_t m_VariantValue;	// variable-type parameter
 
-	EventQueuePrioritizedEvent_t *m_pNext;
-	EventQueuePrioritizedEvent_t *m_pPrev;
+	// position in the heap, and the order the event was added in, which breaks
+	// ties between events with the same fire time
+	int m_iHeapIndex;
+	unsigned int m_nSequence;
+
+	// events are also linked into a list per caller and per target entity slot,
+	// so cancelling only has to look at the events that could match
+	EventQueuePrioritizedEvent_t *m_pNextByCaller;
+	EventQueuePrioritizedEvent_t *m_pPrevByCaller;
+	EventQueuePrioritizedEvent_t *m_pNextByTarget;
+	EventQueuePrioritizedEvent_t *m_pPrevByTarget;
 
 	DECLARE_SIMPLE_DATADESC();
 
@@ -70,10 +80,40 @@ private:
 
 	void AddEvent( EventQueuePrioritizedEvent_t *event );
 	void RemoveEvent( EventQueuePrioritizedEvent_t *pe );
+	void DeleteEvent( EventQueuePrioritizedEvent_t *pe );
+
+	// binary heap ordered by fire time, then sequence
+	bool IsEarlier( const EventQueuePrioritizedEvent_t *a, const EventQueuePrioritizedEvent_t *b ) const;
+	void HeapSiftUp( int i );
+	void HeapSiftDown( int i );
+	void HeapSet( int i, EventQueuePrioritizedEvent_t *pe );
+
+	// copies out the events in firing order
+	void GetSortedEvents( CUtlVector< EventQueuePrioritizedEvent_t * > &events );
+
+	// finds the entities an event's target name refers to
+	int FindNamedTargets( const EventQueuePrioritizedEvent_t *pe );
+	void FireNamedEvent( EventQueuePrioritizedEvent_t *pe, bool &targetFound );
 
 	DECLARE_SIMPLE_DATADESC();
-	EventQueuePrioritizedEvent_t m_Events;
+	CUtlVector< EventQueuePrioritizedEvent_t * > m_Heap;
+	EventQueuePrioritizedEvent_t *m_pCallerLists[NUM_ENT_ENTRIES];
+	EventQueuePrioritizedEvent_t *m_pTargetLists[NUM_ENT_ENTRIES];
+	unsigned int m_nNextSequence;
+	EventQueuePrioritizedEvent_t *m_pFiringEvent;	// can't be deleted until it's done firing
 	int m_iListCount;
+
+	// entities found for each target name, valid while the entity list's name
+	// generation hasn't changed. Names starting with '!' depend on who fired the
+	// event, so they're never cached.
+	struct NamedTargets_t
+	{
+		int m_iFirst;
+		int m_nCount;
+	};
+	CUtlMap< string_t, NamedTargets_t > m_NamedTargets;
+	CUtlVector< EHANDLE > m_NamedTargetEntities;
+	int m_iNamedTargetsGeneration;
 };
 
 extern CEventQueue g_EventQueue;
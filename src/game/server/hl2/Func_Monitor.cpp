@@ -75,7 +75,7 @@ void CFuncMonitor::ReleaseCameraLink()
 		m_hInfoCameraLink = NULL;
 
 		// Keep the target up-to-date for save/load
-		m_target = NULL_STRING;
+		SetTargetEntityName( NULL_STRING );
 	}
 }
 
@@ -93,7 +93,7 @@ void CFuncMonitor::SetCameraByName(const char *szName)
 		if( pCamera )
 		{
 			// Keep the target up-to-date for save/load
-			m_target = MAKE_STRING( szName );
+			SetTargetEntityName( MAKE_STRING( szName ) );
 			m_hInfoCameraLink = CreateInfoCameraLink( this, pCamera ); 
 		}
 	}
@@ -76,7 +76,7 @@ void CWorldItem::Spawn( void )
 	}
 	else
 	{
-		pEntity->m_target = m_target;
+		pEntity->SetTargetEntityName( m_target );
 		pEntity->SetName( GetEntityName() );
 		pEntity->ClearSpawnFlags();
 		pEntity->AddSpawnFlags( m_spawnflags );
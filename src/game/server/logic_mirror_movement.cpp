@@ -133,7 +133,7 @@ void CLogicMirrorMovement::InputSetMirrorTarget( inputdata_t &inputdata )
 
 void CLogicMirrorMovement::InputSetTarget( inputdata_t &inputdata )
 {
-	m_target = AllocPooledString( inputdata.value.String() );
+	SetTargetEntityName( AllocPooledString( inputdata.value.String() ) );
 	SetTarget( inputdata.value.String() );
 }
 
@@ -926,6 +926,8 @@ void CNavArea::FinishMerge( CNavArea *adjArea )
 	m_neZ = m_node[ NORTH_EAST ]->GetPosition()->z;
 	m_swZ = m_node[ SOUTH_WEST ]->GetPosition()->z;
 
+	TheNavMesh->InvalidateGridExtents();
+
 	if ( ( m_seCorner.x - m_nwCorner.x ) > 0.0f && ( m_seCorner.y - m_nwCorner.y ) > 0.0f )
 	{
 		m_invDxCorners = 1.0f / ( m_seCorner.x - m_nwCorner.x );
@@ -3602,6 +3604,8 @@ void CNavArea::SetCorner( NavCornerType corner, const Vector& newPosition )
 		m_invDxCorners = m_invDyCorners = 0;
 	}
 
+	TheNavMesh->InvalidateGridExtents();
+
 	CalcDebugID();
 }
 
@@ -4768,6 +4772,11 @@ void CNavArea::UpdateBlockedFromNavBlockers( void )
 			TheNavMesh->OnAreaUnblocked( this );
 		}
 	}
+	else if ( V_memcmp( oldBlocked, m_isBlocked, sizeof( m_isBlocked ) ) )
+	{
+		// blocked for a different set of teams
+		TheNavAreaHierarchy.OnAreaChanged( this );
+	}
 }
 
 
@@ -4848,6 +4857,8 @@ void CNavArea::UpdateBlocked( bool force, int teamID )
 	bounds.hi.Init( sizeX, sizeY, VEC_DUCK_HULL_MAX.z - HalfHumanHeight );
 
 	bool wasBlocked = IsBlocked( TEAM_ANY );
+	bool oldBlocked[ MAX_NAV_TEAMS ];
+	V_memcpy( oldBlocked, m_isBlocked, sizeof( m_isBlocked ) );
 
 	// See if spot is valid
 #ifdef TERROR
@@ -4929,6 +4940,11 @@ void CNavArea::UpdateBlocked( bool force, int teamID )
 			TheNavMesh->OnAreaUnblocked( this );
 		}
 	}
+	else if ( V_memcmp( oldBlocked, m_isBlocked, sizeof( m_isBlocked ) ) )
+	{
+		// blocked for a different set of teams
+		TheNavAreaHierarchy.OnAreaChanged( this );
+	}
 
 	if ( TheNavMesh->GetMarkedArea() == this )
 	{
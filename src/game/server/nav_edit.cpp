@@ -12,6 +12,7 @@
 #include "cbase.h"
 #include "nav_mesh.h"
 #include "nav_pathfind.h"
+#include "nav_hierarchy.h"
 #include "nav_node.h"
 #include "nav_colors.h"
 #include "Color.h"
@@ -3198,6 +3199,7 @@ void CNavMesh::CommandNavSplice( void )
 void CNavMesh::DoToggleAttribute( CNavArea *area, NavAttributeType attribute )
 {
 	area->SetAttributes( area->GetAttributes() ^ attribute );
+	TheNavAreaHierarchy.OnAreaChanged( area );
 
 	// keep a list of all "transient" nav areas
 	if ( attribute == NAV_MESH_TRANSIENT )
@@ -3916,6 +3918,9 @@ bool CNavMesh::IsInSelectedSet( const CNavArea *area ) const
  */
 void CNavMesh::OnEditCreateNotify( CNavArea *newArea )
 {
+	InvalidateGridExtents();
+	TheNavAreaHierarchy.Reset();
+
 	FOR_EACH_VEC( TheNavAreas, it )
 	{
 		TheNavAreas[ it ]->OnEditCreateNotify( newArea );
@@ -3940,6 +3945,9 @@ void CNavMesh::OnEditDestroyNotify( CNavArea *deadArea )
 	m_avoidanceObstacleAreas.FindAndRemove( deadArea );
 	m_blockedAreas.FindAndRemove( deadArea );
 
+	InvalidateGridExtents();
+	TheNavAreaHierarchy.Reset();
+
 	FOR_EACH_VEC( TheNavAreas, it )
 	{
 		TheNavAreas[ it ]->OnEditDestroyNotify( deadArea );
@@ -3957,6 +3965,7 @@ void CNavMesh::OnEditDestroyNotify( CNavArea *deadArea )
  */
 void CNavMesh::OnEditDestroyNotify( CNavLadder *deadLadder )
 {
+	TheNavAreaHierarchy.Reset();
 }
 
 
@@ -11,6 +11,7 @@
 
 #include "cbase.h"
 #include "nav_mesh.h"
+#include "nav_hierarchy.h"
 #include "gamerules.h"
 #include "datacache/imdlcache.h"
 
@@ -1571,6 +1572,11 @@ NavErrorType CNavMesh::Load( void )
 	//
 	NavErrorType loadResult = PostLoad( version );
 
+	if ( loadResult == NAV_OK )
+	{
+		TheNavAreaHierarchy.Build();
+	}
+
 	WarnIfMeshNeedsAnalysis( version );
 
 	return loadResult;
@@ -0,0 +1,1058 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose:
+//
+// $NoKeywords: $
+//
+//=============================================================================//
+// nav_hierarchy.cpp
+// Clustered abstraction of the Navigation Mesh for fast shortest path queries
+
+#include "cbase.h"
+#include "nav_mesh.h"
+#include "nav_pathfind.h"
+#include "nav_hierarchy.h"
+#include "tier0/fasttimer.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+ConVar nav_hierarchy_cluster_size( "nav_hierarchy_cluster_size", "1024", FCVAR_GAMEDLL | FCVAR_CHEAT, "Size of the square clusters used for hierarchical path finding. Takes effect when the mesh is next loaded." );
+ConVar nav_hierarchical_pathfind( "nav_hierarchical_pathfind", "1", FCVAR_GAMEDLL | FCVAR_CHEAT, "If nonzero, NavAreaBuildPath() finds shortest paths to a goal area through the nav cluster hierarchy." );
+
+CNavAreaHierarchy TheNavAreaHierarchy;
+
+// Penalties must match ShortestPathCost
+static const float crouchPenalty = 20.0f;
+static const float jumpPenalty = 5.0f;
+
+static const float NoPath = -1.0f;
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavAreaHierarchy::SearchState::Init( int areaCount )
+{
+	m_cost.SetCount( areaCount );
+	m_parent.SetCount( areaCount );
+	m_parentEdge.SetCount( areaCount );
+	m_marker.SetCount( areaCount );
+	FOR_EACH_VEC( m_marker, it )
+	{
+		m_marker[ it ] = 0;
+	}
+	m_pass = 0;
+	m_openList.Purge();
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavAreaHierarchy::SearchState::Begin( void )
+{
+	if ( ++m_pass == 0 )
+	{
+		FOR_EACH_VEC( m_marker, it )
+		{
+			m_marker[ it ] = 0;
+		}
+		m_pass = 1;
+	}
+
+	m_openList.RemoveAll();
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavAreaHierarchy::SearchState::Reach( int index, float cost, int parent, int parentEdge )
+{
+	m_cost[ index ] = cost;
+	m_parent[ index ] = parent;
+	m_parentEdge[ index ] = parentEdge;
+	m_marker[ index ] = m_pass;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+CNavAreaHierarchy::CNavAreaHierarchy( void )
+{
+	m_isBuilt = false;
+	m_clusterSize = 1024.0f;
+	m_estimateScale = 1.0f;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavAreaHierarchy::Reset( void )
+{
+	m_isBuilt = false;
+	m_areas.Purge();
+	m_edges.Purge();
+	m_reverseEdges.Purge();
+	m_areaIndex.RemoveAll();
+	m_clusters.Purge();
+	m_areaSearch.Init( 0 );
+	m_portalSearch.Init( 0 );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Collect the areas reachable from 'area' in a single step, the same way NavAreaBuildPath() does
+ */
+void CNavAreaHierarchy::AddEdges( CNavArea *area, CUtlVector< Edge > &edges )
+{
+	Edge edge;
+
+	for( int dir=0; dir<NUM_DIRECTIONS; ++dir )
+	{
+		const NavConnectVector *floorList = area->GetAdjacentAreas( (NavDirType)dir );
+		FOR_EACH_VEC( (*floorList), it )
+		{
+			const NavConnect &connect = floorList->Element( it );
+			if ( connect.area == area )
+				continue;
+
+			edge.m_to = GetAreaIndex( connect.area );
+			edge.m_length = ( connect.length > 0.0f ) ? connect.length : ( connect.area->GetCenter() - area->GetCenter() ).Length();
+			edge.m_how = (NavTraverseType)dir;
+			edges.AddToTail( edge );
+		}
+	}
+
+	// do not use BEHIND connection, as its very hard to get to when going up a ladder
+	const NavLadderConnectVector *ladderList = area->GetLadders( CNavLadder::LADDER_UP );
+	FOR_EACH_VEC( (*ladderList), it )
+	{
+		const CNavLadder *ladder = ladderList->Element( it ).ladder;
+		CNavArea *topAreas[] = { ladder->m_topForwardArea, ladder->m_topLeftArea, ladder->m_topRightArea };
+		for( int i=0; i<ARRAYSIZE( topAreas ); ++i )
+		{
+			if ( topAreas[i] == NULL || topAreas[i] == area )
+				continue;
+
+			edge.m_to = GetAreaIndex( topAreas[i] );
+			edge.m_length = ladder->m_length;
+			edge.m_how = GO_LADDER_UP;
+			edges.AddToTail( edge );
+		}
+	}
+
+	ladderList = area->GetLadders( CNavLadder::LADDER_DOWN );
+	FOR_EACH_VEC( (*ladderList), it )
+	{
+		const CNavLadder *ladder = ladderList->Element( it ).ladder;
+		if ( ladder->m_bottomArea == NULL || ladder->m_bottomArea == area )
+			continue;
+
+		edge.m_to = GetAreaIndex( ladder->m_bottomArea );
+		edge.m_length = ladder->m_length;
+		edge.m_how = GO_LADDER_DOWN;
+		edges.AddToTail( edge );
+	}
+
+	if ( area->GetElevator() )
+	{
+		const NavConnectVector &elevatorAreas = area->GetElevatorAreas();
+		FOR_EACH_VEC( elevatorAreas, it )
+		{
+			CNavArea *elevatorArea = elevatorAreas[ it ].area;
+			if ( elevatorArea == area )
+				continue;
+
+			edge.m_to = GetAreaIndex( elevatorArea );
+			edge.m_length = ( elevatorArea->GetCenter() - area->GetCenter() ).Length();
+			edge.m_how = ( elevatorArea->GetCenter().z > area->GetCenter().z ) ? GO_ELEVATOR_UP : GO_ELEVATOR_DOWN;
+			edges.AddToTail( edge );
+		}
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Cluster the current mesh and find the portal areas. Cluster costs are computed on demand.
+ */
+void CNavAreaHierarchy::Build( void )
+{
+	VPROF_BUDGET( "CNavAreaHierarchy::Build", "NextBot" );
+
+	Reset();
+
+	m_clusterSize = MAX( nav_hierarchy_cluster_size.GetFloat(), 64.0f );
+
+	int areaCount = TheNavAreas.Count();
+	if ( areaCount == 0 )
+		return;
+
+	m_areas.SetCount( areaCount );
+
+	Extent extent;
+	extent.lo = extent.hi = TheNavAreas[0]->GetCenter();
+
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		CNavArea *area = TheNavAreas[ it ];
+		m_areaIndex.Insert( area, it );
+
+		const Vector &center = area->GetCenter();
+		extent.lo.x = MIN( extent.lo.x, center.x );
+		extent.lo.y = MIN( extent.lo.y, center.y );
+		extent.hi.x = MAX( extent.hi.x, center.x );
+		extent.hi.y = MAX( extent.hi.y, center.y );
+	}
+
+	// assign each area to the cluster its center falls in, numbering only the cells that are used
+	int gridSizeX = (int)( ( extent.hi.x - extent.lo.x ) / m_clusterSize ) + 1;
+	int gridSizeY = (int)( ( extent.hi.y - extent.lo.y ) / m_clusterSize ) + 1;
+
+	CUtlVector< int > cellCluster;
+	cellCluster.SetCount( gridSizeX * gridSizeY );
+	FOR_EACH_VEC( cellCluster, it )
+	{
+		cellCluster[ it ] = -1;
+	}
+
+	CUtlVector< Edge > edges;
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		CNavArea *area = TheNavAreas[ it ];
+		AreaInfo &info = m_areas[ it ];
+
+		int x = (int)( ( area->GetCenter().x - extent.lo.x ) / m_clusterSize );
+		int y = (int)( ( area->GetCenter().y - extent.lo.y ) / m_clusterSize );
+		int cell = y * gridSizeX + x;
+		if ( cellCluster[ cell ] < 0 )
+		{
+			cellCluster[ cell ] = m_clusters.AddToTail();
+		}
+
+		info.m_area = area;
+		info.m_cluster = cellCluster[ cell ];
+		info.m_portal = -1;
+		info.m_isExit = false;
+		info.m_firstEdge = m_edges.Count();
+
+		edges.RemoveAll();
+		AddEdges( area, edges );
+		m_edges.AddVectorToTail( edges );
+
+		info.m_edgeCount = edges.Count();
+		info.m_reverseEdgeCount = 0;
+	}
+
+	// build the reverse adjacency, used to search backwards from a goal
+	FOR_EACH_VEC( m_edges, it )
+	{
+		++m_areas[ m_edges[ it ].m_to ].m_reverseEdgeCount;
+	}
+
+	int firstReverseEdge = 0;
+	FOR_EACH_VEC( m_areas, it )
+	{
+		m_areas[ it ].m_firstReverseEdge = firstReverseEdge;
+		firstReverseEdge += m_areas[ it ].m_reverseEdgeCount;
+		m_areas[ it ].m_reverseEdgeCount = 0;
+	}
+
+	m_reverseEdges.SetCount( m_edges.Count() );
+	m_estimateScale = 1.0f;
+	FOR_EACH_VEC( m_areas, from )
+	{
+		const AreaInfo &info = m_areas[ from ];
+		for( int e=0; e<info.m_edgeCount; ++e )
+		{
+			const Edge &edge = m_edges[ info.m_firstEdge + e ];
+			AreaInfo &toInfo = m_areas[ edge.m_to ];
+
+			Edge &reverseEdge = m_reverseEdges[ toInfo.m_firstReverseEdge + toInfo.m_reverseEdgeCount++ ];
+			reverseEdge.m_to = from;
+			reverseEdge.m_length = edge.m_length;
+			reverseEdge.m_how = edge.m_how;
+
+			// no step covers less than m_estimateScale times the distance between the area centers
+			float distance = ( toInfo.m_area->GetCenter() - info.m_area->GetCenter() ).Length();
+			if ( distance > 0.0f )
+			{
+				m_estimateScale = MIN( m_estimateScale, edge.m_length / distance );
+			}
+
+			// any area with a connection crossing a cluster boundary is a portal
+			if ( toInfo.m_cluster != info.m_cluster )
+			{
+				m_areas[ from ].m_isExit = true;
+
+				if ( m_areas[ from ].m_portal < 0 )
+				{
+					m_areas[ from ].m_portal = m_clusters[ info.m_cluster ].m_portals.AddToTail( from );
+				}
+				if ( toInfo.m_portal < 0 )
+				{
+					toInfo.m_portal = m_clusters[ toInfo.m_cluster ].m_portals.AddToTail( edge.m_to );
+				}
+			}
+		}
+	}
+
+	FOR_EACH_VEC( m_clusters, it )
+	{
+		for( int slot=0; slot<NUM_TEAM_SLOTS; ++slot )
+		{
+			m_clusters[ it ].m_isDirty[ slot ] = true;
+		}
+	}
+
+	m_areaSearch.Init( areaCount );
+	m_portalSearch.Init( areaCount );
+
+	m_estimateScale = MAX( m_estimateScale, 0.0f );
+	m_isBuilt = true;
+
+	DevMsg( "Nav hierarchy: %d areas in %d clusters, %d portals\n", areaCount, m_clusters.Count(), GetPortalCount() );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+int CNavAreaHierarchy::GetPortalCount( void ) const
+{
+	int count = 0;
+	FOR_EACH_VEC( m_clusters, it )
+	{
+		count += m_clusters[ it ].m_portals.Count();
+	}
+	return count;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+int CNavAreaHierarchy::GetAreaIndex( CNavArea *area ) const
+{
+	UtlHashHandle_t h = m_areaIndex.Find( area );
+	return ( h == m_areaIndex.InvalidHandle() ) ? -1 : m_areaIndex.Element( h );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+int CNavAreaHierarchy::GetTeamSlot( int teamID ) const
+{
+	return ( teamID == TEAM_ANY ) ? MAX_NAV_TEAMS : ( teamID % MAX_NAV_TEAMS );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+bool CNavAreaHierarchy::IsBlocked( int index, int teamID ) const
+{
+	return m_areas[ index ].m_area->IsBlocked( teamID );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * A lower bound on the cost of getting from one area to another. Area penalties only add to the length
+ * of a step, and no step is shorter than m_estimateScale times the distance it covers, so straight line
+ * distance scaled down by that never overestimates.
+ */
+float CNavAreaHierarchy::CostEstimate( int from, int to ) const
+{
+	return m_estimateScale * ( m_areas[ to ].m_area->GetCenter() - m_areas[ from ].m_area->GetCenter() ).Length();
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Cost of taking 'edge' into area 'to', as ShortestPathCost would add it
+ */
+float CNavAreaHierarchy::EdgeCost( const Edge &edge, int to ) const
+{
+	float cost = edge.m_length;
+
+	int attributes = m_areas[ to ].m_area->GetAttributes();
+	if ( attributes & NAV_MESH_CROUCH )
+	{
+		cost += crouchPenalty * edge.m_length;
+	}
+	if ( attributes & NAV_MESH_JUMP )
+	{
+		cost += jumpPenalty * edge.m_length;
+	}
+
+	return cost;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+bool CNavAreaHierarchy::SearchNodeLessFunc( const SearchNode &lhs, const SearchNode &rhs )
+{
+	// "less" sorts towards the tail, so the cheapest node ends up at the head
+	return lhs.m_priority > rhs.m_priority;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavAreaHierarchy::Search( int index, int teamID, int confineCluster, bool reverse, int stopAt )
+{
+	SearchState &state = m_areaSearch;
+	state.Begin();
+
+	CUtlPriorityQueue< SearchNode > &openList = state.m_openList;
+
+	SearchNode node;
+	node.m_index = index;
+	node.m_cost = 0.0f;
+	node.m_priority = 0.0f;
+	state.Reach( index, 0.0f, -1, -1 );
+	openList.Insert( node );
+
+	while( openList.Count() )
+	{
+		node = openList.ElementAtHead();
+		openList.RemoveAtHead();
+
+		// skip stale entries for areas that were reached more cheaply since
+		if ( node.m_cost > state.m_cost[ node.m_index ] )
+			continue;
+
+		if ( node.m_index == stopAt )
+			break;
+
+		const AreaInfo &info = m_areas[ node.m_index ];
+		int firstEdge = reverse ? info.m_firstReverseEdge : info.m_firstEdge;
+		int edgeCount = reverse ? info.m_reverseEdgeCount : info.m_edgeCount;
+		const CUtlVector< Edge > &edges = reverse ? m_reverseEdges : m_edges;
+
+		for( int e=firstEdge; e<firstEdge + edgeCount; ++e )
+		{
+			const Edge &edge = edges[ e ];
+			int to = edge.m_to;
+
+			if ( confineCluster >= 0 && m_areas[ to ].m_cluster != confineCluster )
+				continue;
+
+			if ( IsBlocked( to, teamID ) )
+				continue;
+
+			// the penalty belongs to the area the edge leads into in the forward direction
+			float newCost = node.m_cost + EdgeCost( edge, reverse ? node.m_index : to );
+
+			if ( state.WasReached( to ) && state.m_cost[ to ] <= newCost )
+				continue;
+
+			state.Reach( to, newCost, node.m_index, reverse ? -1 : e );
+
+			SearchNode next;
+			next.m_index = to;
+			next.m_cost = newCost;
+			next.m_priority = newCost;
+			openList.Insert( next );
+		}
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Recompute the cheapest portal-to-portal costs inside a cluster, if they are out of date for this team
+ */
+void CNavAreaHierarchy::UpdateClusterCosts( int cluster, int teamID )
+{
+	int slot = GetTeamSlot( teamID );
+	Cluster &c = m_clusters[ cluster ];
+	if ( !c.m_isDirty[ slot ] )
+		return;
+
+	int portalCount = c.m_portals.Count();
+	CUtlVector< float > &portalCost = c.m_portalCost[ slot ];
+	portalCost.SetCount( portalCount * portalCount );
+
+	for( int from=0; from<portalCount; ++from )
+	{
+		float *row = &portalCost[ from * portalCount ];
+
+		if ( IsBlocked( c.m_portals[ from ], teamID ) )
+		{
+			for( int to=0; to<portalCount; ++to )
+			{
+				row[ to ] = NoPath;
+			}
+			continue;
+		}
+
+		Search( c.m_portals[ from ], teamID, cluster, false );
+
+		for( int to=0; to<portalCount; ++to )
+		{
+			int toIndex = c.m_portals[ to ];
+			row[ to ] = m_areaSearch.WasReached( toIndex ) ? m_areaSearch.m_cost[ toIndex ] : NoPath;
+		}
+	}
+
+	c.m_isDirty[ slot ] = false;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Editing can change connections without telling anyone, so the hierarchy sits out while the mesh
+ * is being edited or generated, and is rebuilt afterwards.
+ */
+bool CNavAreaHierarchy::IsEnabled( void )
+{
+	if ( !nav_hierarchical_pathfind.GetBool() )
+		return false;
+
+	if ( nav_edit.GetBool() || TheNavMesh->IsGenerating() )
+	{
+		Reset();
+		return false;
+	}
+
+	return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavAreaHierarchy::OnAreaChanged( CNavArea *area )
+{
+	if ( !m_isBuilt )
+		return;
+
+	int index = GetAreaIndex( area );
+	if ( index < 0 )
+		return;
+
+	Cluster &c = m_clusters[ m_areas[ index ].m_cluster ];
+	for( int slot=0; slot<NUM_TEAM_SLOTS; ++slot )
+	{
+		c.m_isDirty[ slot ] = true;
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+float CNavAreaHierarchy::FindPath( int startIndex, int goalIndex, int teamID, int *lastPortal )
+{
+	*lastPortal = -1;
+
+	int startCluster = m_areas[ startIndex ].m_cluster;
+	int goalCluster = m_areas[ goalIndex ].m_cluster;
+	const Cluster &start = m_clusters[ startCluster ];
+	const Cluster &goal = m_clusters[ goalCluster ];
+
+	// everything reachable from the start without leaving its cluster
+	float bestCost = FLT_MAX;
+	CUtlVector< float > startPortalCost;
+	startPortalCost.SetCount( start.m_portals.Count() );
+
+	Search( startIndex, teamID, startCluster, false );
+	FOR_EACH_VEC( start.m_portals, it )
+	{
+		int index = start.m_portals[ it ];
+		startPortalCost[ it ] = m_areaSearch.WasReached( index ) ? m_areaSearch.m_cost[ index ] : NoPath;
+	}
+	if ( startCluster == goalCluster && m_areaSearch.WasReached( goalIndex ) )
+	{
+		bestCost = m_areaSearch.m_cost[ goalIndex ];
+	}
+
+	// everything that reaches the goal without leaving its cluster
+	CUtlVector< float > goalPortalCost;
+	goalPortalCost.SetCount( goal.m_portals.Count() );
+
+	Search( goalIndex, teamID, goalCluster, true );
+	FOR_EACH_VEC( goal.m_portals, it )
+	{
+		int index = goal.m_portals[ it ];
+		goalPortalCost[ it ] = ( m_areaSearch.WasReached( index ) && !IsBlocked( index, teamID ) ) ? m_areaSearch.m_cost[ index ] : NoPath;
+	}
+
+	// now A* over the portals only, hopping across clusters with the cached costs. UpdateClusterCosts() reuses
+	// m_areaSearch along the way, which is why the portals keep their own state.
+	SearchState &state = m_portalSearch;
+	state.Begin();
+
+	CUtlPriorityQueue< SearchNode > &openList = state.m_openList;
+	SearchNode node;
+
+	FOR_EACH_VEC( start.m_portals, it )
+	{
+		if ( startPortalCost[ it ] < 0.0f )
+			continue;
+
+		node.m_index = start.m_portals[ it ];
+		node.m_cost = startPortalCost[ it ];
+		node.m_priority = node.m_cost + CostEstimate( node.m_index, goalIndex );
+		state.Reach( node.m_index, node.m_cost, -1, -1 );
+		openList.Insert( node );
+	}
+
+	while( openList.Count() )
+	{
+		node = openList.ElementAtHead();
+		openList.RemoveAtHead();
+
+		if ( node.m_cost > state.m_cost[ node.m_index ] )
+			continue;
+
+		// nothing left in the open list can beat what we have
+		if ( node.m_priority >= bestCost )
+			break;
+
+		const AreaInfo &info = m_areas[ node.m_index ];
+
+		if ( info.m_cluster == goalCluster )
+		{
+			float toGoal = goalPortalCost[ info.m_portal ];
+			if ( toGoal >= 0.0f && node.m_cost + toGoal < bestCost )
+			{
+				bestCost = node.m_cost + toGoal;
+				*lastPortal = node.m_index;
+			}
+		}
+
+		// hop to the other portals of this cluster. A portal that was itself reached by a hop has nothing to add
+		// here, since hopping straight from where that hop started is never more expensive.
+		bool reachedByHop = ( state.m_parent[ node.m_index ] >= 0 && state.m_parentEdge[ node.m_index ] < 0 );
+		if ( !reachedByHop )
+		{
+			UpdateClusterCosts( info.m_cluster, teamID );
+
+			const Cluster &c = m_clusters[ info.m_cluster ];
+			int portalCount = c.m_portals.Count();
+			const float *row = &c.m_portalCost[ GetTeamSlot( teamID ) ][ info.m_portal * portalCount ];
+
+			for( int to=0; to<portalCount; ++to )
+			{
+				if ( row[ to ] < 0.0f )
+					continue;
+
+				// and the portal has to lead somewhere
+				int toIndex = c.m_portals[ to ];
+				if ( !m_areas[ toIndex ].m_isExit && info.m_cluster != goalCluster )
+					continue;
+
+				float newCost = node.m_cost + row[ to ];
+				if ( state.WasReached( toIndex ) && state.m_cost[ toIndex ] <= newCost )
+					continue;
+
+				state.Reach( toIndex, newCost, node.m_index, -1 );
+
+				SearchNode next;
+				next.m_index = toIndex;
+				next.m_cost = newCost;
+				next.m_priority = newCost + CostEstimate( toIndex, goalIndex );
+				openList.Insert( next );
+			}
+		}
+
+		// and across the boundary into neighboring clusters
+		for( int e=info.m_firstEdge; e<info.m_firstEdge + info.m_edgeCount; ++e )
+		{
+			const Edge &edge = m_edges[ e ];
+			int toIndex = edge.m_to;
+
+			if ( m_areas[ toIndex ].m_cluster == info.m_cluster )
+				continue;
+
+			if ( IsBlocked( toIndex, teamID ) )
+				continue;
+
+			float newCost = node.m_cost + EdgeCost( edge, toIndex );
+			if ( state.WasReached( toIndex ) && state.m_cost[ toIndex ] <= newCost )
+				continue;
+
+			state.Reach( toIndex, newCost, node.m_index, e );
+
+			SearchNode next;
+			next.m_index = toIndex;
+			next.m_cost = newCost;
+			next.m_priority = newCost + CostEstimate( toIndex, goalIndex );
+			openList.Insert( next );
+		}
+	}
+
+	return ( bestCost == FLT_MAX ) ? NoPath : bestCost;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+float CNavAreaHierarchy::TravelCost( CNavArea *startArea, CNavArea *goalArea, int teamID )
+{
+	VPROF_BUDGET( "CNavAreaHierarchy::TravelCost", "NextBot" );
+
+	if ( !m_isBuilt )
+	{
+		Build();
+	}
+
+	int startIndex = startArea ? GetAreaIndex( startArea ) : -1;
+	int goalIndex = goalArea ? GetAreaIndex( goalArea ) : -1;
+	if ( startIndex < 0 || goalIndex < 0 )
+		return NoPath;
+
+	if ( IsBlocked( goalIndex, teamID ) )
+		return NoPath;
+
+	if ( startIndex == goalIndex )
+		return 0.0f;
+
+	if ( IsBlocked( startIndex, teamID ) )
+		return NoPath;
+
+	int lastPortal;
+	return FindPath( startIndex, goalIndex, teamID, &lastPortal );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+float CNavAreaHierarchy::TravelCostFlat( CNavArea *startArea, CNavArea *goalArea, int teamID )
+{
+	if ( !m_isBuilt )
+	{
+		Build();
+	}
+
+	int startIndex = startArea ? GetAreaIndex( startArea ) : -1;
+	int goalIndex = goalArea ? GetAreaIndex( goalArea ) : -1;
+	if ( startIndex < 0 || goalIndex < 0 )
+		return NoPath;
+
+	if ( IsBlocked( goalIndex, teamID ) )
+		return NoPath;
+
+	if ( startIndex == goalIndex )
+		return 0.0f;
+
+	if ( IsBlocked( startIndex, teamID ) )
+		return NoPath;
+
+	Search( startIndex, teamID, -1, false, goalIndex );
+
+	return m_areaSearch.WasReached( goalIndex ) ? m_areaSearch.m_cost[ goalIndex ] : NoPath;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavAreaHierarchy::AppendClusterPath( int from, int to, int cluster, int teamID, CUtlVector< int > &path )
+{
+	if ( from == to )
+		return;
+
+	Search( from, teamID, cluster, false, to );
+
+	Assert( m_areaSearch.WasReached( to ) );
+	if ( !m_areaSearch.WasReached( to ) )
+		return;
+
+	int first = path.Count();
+	for( int index = to; index != from; index = m_areaSearch.m_parent[ index ] )
+	{
+		path.AddToTail( m_areaSearch.m_parentEdge[ index ] );
+	}
+
+	// the steps were collected goal first
+	for( int i = first, j = path.Count()-1; i < j; ++i, --j )
+	{
+		V_swap( path[i], path[j] );
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+bool CNavAreaHierarchy::BuildPath( CNavArea *startArea, CNavArea *goalArea, int teamID )
+{
+	VPROF_BUDGET( "CNavAreaHierarchy::BuildPath", "NextBotSpiky" );
+
+	if ( !m_isBuilt )
+	{
+		Build();
+	}
+
+	int startIndex = startArea ? GetAreaIndex( startArea ) : -1;
+	int goalIndex = goalArea ? GetAreaIndex( goalArea ) : -1;
+	if ( startIndex < 0 || goalIndex < 0 )
+		return false;
+
+	if ( IsBlocked( goalIndex, teamID ) || IsBlocked( startIndex, teamID ) )
+		return false;
+
+	CNavArea::ClearSearchLists();
+	startArea->SetParent( NULL );
+	startArea->SetCostSoFar( 0.0f );
+
+	if ( startIndex == goalIndex )
+		return true;
+
+	int lastPortal;
+	if ( FindPath( startIndex, goalIndex, teamID, &lastPortal ) < 0.0f )
+		return false;
+
+	// walk the portal search back to the start cluster to get the portals in order
+	CUtlVector< int > portals;
+	for( int index = lastPortal; index >= 0; index = m_portalSearch.m_parent[ index ] )
+	{
+		portals.AddToHead( index );
+	}
+
+	// expand every hop into the steps between areas. AppendClusterPath() runs area searches of its own,
+	// so everything needed from the portal search was copied into 'portals' and is read from there.
+	CUtlVector< int > crossings;
+	FOR_EACH_VEC( portals, it )
+	{
+		crossings.AddToTail( m_portalSearch.m_parentEdge[ portals[ it ] ] );
+	}
+
+	CUtlVector< int > path;
+	if ( portals.Count() == 0 )
+	{
+		AppendClusterPath( startIndex, goalIndex, m_areas[ startIndex ].m_cluster, teamID, path );
+	}
+	else
+	{
+		AppendClusterPath( startIndex, portals[0], m_areas[ startIndex ].m_cluster, teamID, path );
+
+		for( int i=1; i<portals.Count(); ++i )
+		{
+			if ( crossings[i] >= 0 )
+			{
+				path.AddToTail( crossings[i] );
+			}
+			else
+			{
+				AppendClusterPath( portals[i-1], portals[i], m_areas[ portals[i] ].m_cluster, teamID, path );
+			}
+		}
+
+		AppendClusterPath( portals.Tail(), goalIndex, m_areas[ goalIndex ].m_cluster, teamID, path );
+	}
+
+	// hand the path over the way NavAreaBuildPath() leaves it
+	int index = startIndex;
+	float costSoFar = 0.0f;
+	FOR_EACH_VEC( path, it )
+	{
+		const Edge &edge = m_edges[ path[ it ] ];
+		CNavArea *area = m_areas[ edge.m_to ].m_area;
+
+		costSoFar += EdgeCost( edge, edge.m_to );
+		area->SetParent( m_areas[ index ].m_area, edge.m_how );
+		area->SetCostSoFar( costSoFar );
+		area->SetTotalCost( costSoFar );
+
+		index = edge.m_to;
+	}
+
+	Assert( index == goalIndex );
+	return index == goalIndex;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Follow the parent pointers NavAreaBuildPath() left from goalArea back to startArea, checking each step is a
+ * real connection, and return the ShortestPathCost of the path, or -1 if it is broken
+ */
+static float NavAreaPathCost( CNavArea *startArea, CNavArea *goalArea )
+{
+	float cost = 0.0f;
+	int steps = 0;
+
+	for( CNavArea *area = goalArea; area != startArea; area = area->GetParent() )
+	{
+		CNavArea *parent = area->GetParent();
+		if ( parent == NULL || ++steps > TheNavAreas.Count() )
+			return NoPath;
+
+		float length;
+		NavTraverseType how = area->GetParentHow();
+		if ( how < NUM_DIRECTIONS )
+		{
+			if ( !parent->IsConnected( area, (NavDirType)how ) )
+				return NoPath;
+
+			length = -1.0f;
+			const NavConnectVector *floorList = parent->GetAdjacentAreas( (NavDirType)how );
+			FOR_EACH_VEC( (*floorList), it )
+			{
+				if ( floorList->Element( it ).area == area )
+				{
+					length = floorList->Element( it ).length;
+					break;
+				}
+			}
+			if ( length <= 0.0f )
+			{
+				length = ( area->GetCenter() - parent->GetCenter() ).Length();
+			}
+		}
+		else if ( how == GO_LADDER_UP || how == GO_LADDER_DOWN )
+		{
+			length = -1.0f;
+			const NavLadderConnectVector *ladderList = parent->GetLadders( ( how == GO_LADDER_UP ) ? CNavLadder::LADDER_UP : CNavLadder::LADDER_DOWN );
+			FOR_EACH_VEC( (*ladderList), it )
+			{
+				const CNavLadder *ladder = ladderList->Element( it ).ladder;
+				bool leadsHere = ( how == GO_LADDER_UP ) ?
+					( ladder->m_topForwardArea == area || ladder->m_topLeftArea == area || ladder->m_topRightArea == area ) :
+					( ladder->m_bottomArea == area );
+				if ( leadsHere )
+				{
+					length = ladder->m_length;
+					break;
+				}
+			}
+			if ( length < 0.0f )
+				return NoPath;
+		}
+		else
+		{
+			length = ( area->GetCenter() - parent->GetCenter() ).Length();
+		}
+
+		float stepCost = length;
+		if ( area->GetAttributes() & NAV_MESH_CROUCH )
+		{
+			stepCost += crouchPenalty * length;
+		}
+		if ( area->GetAttributes() & NAV_MESH_JUMP )
+		{
+			stepCost += jumpPenalty * length;
+		}
+		cost += stepCost;
+	}
+
+	return cost;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+static bool NavCostsMatch( float a, float b )
+{
+	if ( ( a < 0.0f ) != ( b < 0.0f ) )
+		return false;
+
+	return fabs( a - b ) <= 0.001f * MAX( 1.0f, b );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Fire random path queries at the loaded mesh, comparing the clustered search to the flat ones
+ */
+CON_COMMAND_F( nav_hierarchy_benchmark, "Times <count> random path queries using the nav cluster hierarchy, a flat search and NavAreaBuildPath, and checks the paths agree.", FCVAR_GAMEDLL | FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	if ( TheNavAreas.Count() < 2 )
+	{
+		Msg( "No navigation mesh loaded.\n" );
+		return;
+	}
+
+	int count = ( args.ArgC() > 1 ) ? MAX( atoi( args[1] ), 1 ) : 1000;
+
+	CFastTimer buildTimer;
+	buildTimer.Start();
+	TheNavAreaHierarchy.Build();
+	buildTimer.End();
+
+	CUtlVector< CNavArea * > starts, goals;
+	for( int i=0; i<count; ++i )
+	{
+		starts.AddToTail( TheNavAreas[ RandomInt( 0, TheNavAreas.Count()-1 ) ] );
+		goals.AddToTail( TheNavAreas[ RandomInt( 0, TheNavAreas.Count()-1 ) ] );
+	}
+
+	CUtlVector< float > coldCost, warmCost, flatCost, pathCost, astarCost;
+	coldCost.SetCount( count );
+	warmCost.SetCount( count );
+	flatCost.SetCount( count );
+	pathCost.SetCount( count );
+	astarCost.SetCount( count );
+
+	// the first pass over each cluster fills in its portal costs, time that separately
+	CFastTimer coldTimer;
+	coldTimer.Start();
+	for( int i=0; i<count; ++i )
+	{
+		coldCost[i] = TheNavAreaHierarchy.TravelCost( starts[i], goals[i] );
+	}
+	coldTimer.End();
+
+	CFastTimer warmTimer;
+	warmTimer.Start();
+	for( int i=0; i<count; ++i )
+	{
+		warmCost[i] = TheNavAreaHierarchy.TravelCost( starts[i], goals[i] );
+	}
+	warmTimer.End();
+
+	CFastTimer flatTimer;
+	flatTimer.Start();
+	for( int i=0; i<count; ++i )
+	{
+		flatCost[i] = TheNavAreaHierarchy.TravelCostFlat( starts[i], goals[i] );
+	}
+	flatTimer.End();
+
+	// NavAreaBuildPath() through the hierarchy, checking the path it leaves behind after each query
+	bool wasHierarchical = nav_hierarchical_pathfind.GetBool();
+	nav_hierarchical_pathfind.SetValue( 1 );
+
+	float pathTime = 0.0f;
+	for( int i=0; i<count; ++i )
+	{
+		ShortestPathCost cost;
+		CFastTimer timer;
+		timer.Start();
+		bool found = NavAreaBuildPath( starts[i], goals[i], NULL, cost );
+		timer.End();
+		pathTime += timer.GetDuration().GetMillisecondsF();
+
+		pathCost[i] = found ? NavAreaPathCost( starts[i], goals[i] ) : NoPath;
+	}
+
+	// and the original A* over every area
+	nav_hierarchical_pathfind.SetValue( 0 );
+
+	float astarTime = 0.0f;
+	for( int i=0; i<count; ++i )
+	{
+		ShortestPathCost cost;
+		CFastTimer timer;
+		timer.Start();
+		bool found = NavAreaBuildPath( starts[i], goals[i], NULL, cost );
+		timer.End();
+		astarTime += timer.GetDuration().GetMillisecondsF();
+
+		astarCost[i] = found ? NavAreaPathCost( starts[i], goals[i] ) : NoPath;
+	}
+
+	nav_hierarchical_pathfind.SetValue( wasHierarchical );
+
+	int mismatches = 0;
+	int astarDifferences = 0;
+	for( int i=0; i<count; ++i )
+	{
+		if ( !NavCostsMatch( coldCost[i], flatCost[i] ) || !NavCostsMatch( warmCost[i], flatCost[i] ) || !NavCostsMatch( pathCost[i], flatCost[i] ) )
+		{
+			if ( mismatches++ < 10 )
+			{
+				Msg( "  mismatch: area #%d to #%d, hierarchy %.2f (cold %.2f), path %.2f, flat %.2f\n", starts[i]->GetID(), goals[i]->GetID(), warmCost[i], coldCost[i], pathCost[i], flatCost[i] );
+			}
+		}
+
+		// A* stops at the first path to the goal, which can cost a little more than the cheapest one
+		if ( !NavCostsMatch( astarCost[i], flatCost[i] ) )
+		{
+			++astarDifferences;
+		}
+	}
+
+	Msg( "Nav hierarchy: %d clusters, %d portals, built in %.2f ms\n", TheNavAreaHierarchy.GetClusterCount(), TheNavAreaHierarchy.GetPortalCount(), buildTimer.GetDuration().GetMillisecondsF() );
+	Msg( "%d queries:\n", count );
+	Msg( "  hierarchy cost (cold)      %.2f ms\n", coldTimer.GetDuration().GetMillisecondsF() );
+	Msg( "  hierarchy cost             %.2f ms\n", warmTimer.GetDuration().GetMillisecondsF() );
+	Msg( "  flat cost                  %.2f ms\n", flatTimer.GetDuration().GetMillisecondsF() );
+	Msg( "  NavAreaBuildPath, clusters %.2f ms\n", pathTime );
+	Msg( "  NavAreaBuildPath, flat A*  %.2f ms (%d paths differ from the cheapest)\n", astarTime, astarDifferences );
+	Msg( "  %d mismatches\n", mismatches );
+}
@@ -0,0 +1,154 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose:
+//
+// $NoKeywords: $
+//
+//=============================================================================//
+// nav_hierarchy.h
+// Clustered abstraction of the Navigation Mesh for fast shortest path queries
+
+#ifndef _NAV_HIERARCHY_H_
+#define _NAV_HIERARCHY_H_
+
+#include "utlvector.h"
+#include "utlhashtable.h"
+#include "utlpriorityqueue.h"
+#include "nav_area.h"
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Groups nav areas into square clusters. Areas with a connection to or from another cluster are "portals".
+ * For each cluster the cheapest portal-to-portal costs inside the cluster are cached, so a query only has
+ * to search the start and goal clusters area by area and can hop between portals everywhere else.
+ *
+ * Costs are those of ShortestPathCost. Cached cluster costs are recomputed lazily when an area in the
+ * cluster is blocked, unblocked or has its attributes changed. Since every path splits into pieces that
+ * each stay inside one cluster and run between portals, the result is exactly the cost of the cheapest
+ * path over all areas.
+ */
+class CNavAreaHierarchy
+{
+public:
+	CNavAreaHierarchy( void );
+
+	void Build( void );											// cluster the current mesh
+	void Reset( void );											// throw everything away, rebuilt on the next query
+	bool IsBuilt( void ) const		{ return m_isBuilt; }
+	bool IsEnabled( void );										// true if NavAreaBuildPath() should use the hierarchy
+
+	void OnAreaChanged( CNavArea *area );						// invalidate the cached costs of the area's cluster
+
+	/**
+	 * Return the ShortestPathCost cost of the cheapest path from startArea to goalArea for the given team,
+	 * or -1 if there is no path.
+	 */
+	float TravelCost( CNavArea *startArea, CNavArea *goalArea, int teamID = TEAM_ANY );
+
+	/**
+	 * Same as TravelCost(), but searches every area. Used to verify the clustered search.
+	 */
+	float TravelCostFlat( CNavArea *startArea, CNavArea *goalArea, int teamID = TEAM_ANY );
+
+	/**
+	 * Find the cheapest path from startArea to goalArea and leave it in the areas' parent pointers and
+	 * costs so far, the way NavAreaBuildPath() does with a ShortestPathCost. Returns false if there is no path.
+	 */
+	bool BuildPath( CNavArea *startArea, CNavArea *goalArea, int teamID = TEAM_ANY );
+
+	int GetClusterCount( void ) const	{ return m_clusters.Count(); }
+	int GetPortalCount( void ) const;
+
+private:
+	enum { NUM_TEAM_SLOTS = MAX_NAV_TEAMS + 1 };				// one per team, plus TEAM_ANY
+
+	struct Edge
+	{
+		int m_to;												// index into m_areas
+		float m_length;											// travel distance, before area penalties
+		NavTraverseType m_how;									// how NavAreaBuildPath() would record this step
+	};
+
+	struct AreaInfo
+	{
+		CNavArea *m_area;
+		int m_cluster;
+		int m_firstEdge, m_edgeCount;							// outgoing edges in m_edges
+		int m_firstReverseEdge, m_reverseEdgeCount;				// incoming edges in m_reverseEdges
+		int m_portal;											// index into the cluster's portals, or -1
+		bool m_isExit;											// true if a connection leaves the cluster from here
+	};
+
+	struct Cluster
+	{
+		CUtlVector< int > m_portals;							// area indices
+		CUtlVector< float > m_portalCost[ NUM_TEAM_SLOTS ];		// m_portals.Count() squared, from row to column
+		bool m_isDirty[ NUM_TEAM_SLOTS ];
+	};
+
+	struct SearchNode
+	{
+		int m_index;
+		float m_cost;
+		float m_priority;										// cost plus the estimate of what is left
+	};
+	static bool SearchNodeLessFunc( const SearchNode &lhs, const SearchNode &rhs );
+
+	/**
+	 * Per-area results of one search. The area level and portal level searches each have their own,
+	 * since filling in a cluster's portal costs runs area searches while a portal search is under way.
+	 */
+	struct SearchState
+	{
+		CUtlVector< float > m_cost;
+		CUtlVector< int > m_parent;								// area index we came from, or -1
+		CUtlVector< int > m_parentEdge;							// index into m_edges of the step taken, or -1 for a portal hop
+		CUtlVector< unsigned int > m_marker;
+		unsigned int m_pass;
+		CUtlPriorityQueue< SearchNode > m_openList;
+
+		SearchState( void ) : m_pass( 0 ), m_openList( 0, 0, SearchNodeLessFunc ) { }
+		void Init( int areaCount );
+		void Begin( void );										// forget the previous search
+		bool WasReached( int index ) const	{ return m_marker[ index ] == m_pass; }
+		void Reach( int index, float cost, int parent, int parentEdge );
+	};
+
+	int GetAreaIndex( CNavArea *area ) const;
+	int GetTeamSlot( int teamID ) const;
+	bool IsBlocked( int index, int teamID ) const;
+	float EdgeCost( const Edge &edge, int to ) const;
+	float CostEstimate( int from, int to ) const;
+
+	void AddEdges( CNavArea *area, CUtlVector< Edge > &edges );
+	void UpdateClusterCosts( int cluster, int teamID );
+
+	// Dijkstra over m_areaSearch from 'index', optionally confined to one cluster and/or following edges backwards
+	void Search( int index, int teamID, int confineCluster, bool reverse, int stopAt = -1 );
+
+	// Portal level search. Returns the path cost or -1, and the last portal on the way to the goal in
+	// 'lastPortal', or -1 if the cheapest path never leaves the start cluster.
+	float FindPath( int startIndex, int goalIndex, int teamID, int *lastPortal );
+
+	// Append the cheapest steps from 'from' to 'to' that stay inside 'cluster' to 'path', as forward edge indices
+	void AppendClusterPath( int from, int to, int cluster, int teamID, CUtlVector< int > &path );
+
+	bool m_isBuilt;
+	float m_clusterSize;
+	float m_estimateScale;										// shortest step length relative to the distance covered
+
+	CUtlVector< AreaInfo > m_areas;
+	CUtlVector< Edge > m_edges;
+	CUtlVector< Edge > m_reverseEdges;
+	CUtlHashtable< CNavArea *, int > m_areaIndex;
+	CUtlVector< Cluster > m_clusters;
+
+	SearchState m_areaSearch;
+	SearchState m_portalSearch;
+};
+
+extern CNavAreaHierarchy TheNavAreaHierarchy;
+
+
+#endif // _NAV_HIERARCHY_H_
@@ -13,9 +13,11 @@
 #include "filesystem.h"
 #include "nav_mesh.h"
 #include "nav_node.h"
+#include "nav_hierarchy.h"
 #include "fmtstr.h"
 #include "utlbuffer.h"
 #include "tier0/vprof.h"
+#include "tier0/fasttimer.h"
 #ifdef TERROR
 #include "func_simpleladder.h"
 #endif
@@ -67,6 +69,7 @@ CNavMesh::CNavMesh( void )
 	m_hostThreadModeRestoreValue = 0;
 	m_placeCount = 0;
 	m_placeName = NULL;
+	m_isGridExtentsDirty = true;
 
 	LoadPlaceDatabase();
 
@@ -158,6 +161,9 @@ CNavArea *CNavMesh::GetMarkedArea( void ) const
  */
 void CNavMesh::DestroyNavigationMesh( bool incremental )
 {
+	InvalidateGridExtents();
+	TheNavAreaHierarchy.Reset();
+
 	m_blockedAreas.RemoveAll();
 	m_avoidanceObstacleAreas.RemoveAll();
 	m_transientAreas.RemoveAll();
@@ -268,6 +274,9 @@ void CNavMesh::Update( void )
 	UpdateBlockedAreas();
 	UpdateAvoidanceObstacleAreas();
 
+	// rebuild now, so queries made later in the frame never have to
+	UpdateGridExtents();
+
 	if (nav_edit.GetBool())
 	{
 		if (m_isEditing == false)
@@ -458,6 +467,8 @@ void CNavMesh::AllocateGrid( float minX, float maxX, float minY, float maxY )
 	m_gridSizeY = (int)((maxY - minY) / m_gridCellSize) + 1;
 
 	m_grid.SetCount( m_gridSizeX * m_gridSizeY );
+
+	InvalidateGridExtents();
 }
 
 //--------------------------------------------------------------------------------------------------------------
@@ -486,6 +497,8 @@ void CNavMesh::AddNavArea( CNavArea *area )
 		}
 	}
 
+	InvalidateGridExtents();
+
 	// add to hash table
 	int key = ComputeHashKey( area->GetID() );
 
@@ -533,6 +546,8 @@ void CNavMesh::RemoveNavArea( CNavArea *area )
 		}
 	}
 
+	InvalidateGridExtents();
+
 	// remove from hash table
 	int key = ComputeHashKey( area->GetID() );
 
@@ -694,44 +709,11 @@ CNavArea *CNavMesh::GetNavArea( const Vector &pos, float beneathLimit ) const
 	if ( !m_grid.Count() )
 		return NULL;
 
-	// get list in cell that contains position
-	int x = WorldToGridX( pos.x );
-	int y = WorldToGridY( pos.y );
-	NavAreaVector *areaVector = &m_grid[ x + y*m_gridSizeX ];
+	UpdateGridExtents();
 
 	// search cell list to find correct area
-	CNavArea *use = NULL;
-	float useZ = -99999999.9f;
 	Vector testPos = pos + Vector( 0, 0, 5 );
-
-	FOR_EACH_VEC( (*areaVector), it )
-	{
-		CNavArea *area = (*areaVector)[ it ];
-
-		// check if position is within 2D boundaries of this area
-		if (area->IsOverlapping( testPos ))
-		{
-			// project position onto area to get Z
-			float z = area->GetZ( testPos );
-
-			// if area is above us, skip it
-			if (z > testPos.z)
-				continue;
-
-			// if area is too far below us, skip it
-			if (z < pos.z - beneathLimit)
-				continue;
-
-			// if area is higher than the one we have, use this instead
-			if (z > useZ)
-			{
-				use = area;
-				useZ = z;
-			}
-		}
-	}
-
-	return use;
+	return GetNavAreaPacked( testPos, testPos.z, pos.z - beneathLimit, false, TEAM_ANY );
 }
 
 
@@ -762,49 +744,27 @@ CNavArea *CNavMesh::GetNavArea( CBaseEntity *pEntity, int nFlags, float flBeneat
 		flStepHeight = StepHeight;
 	}
 
-	// get list in cell that contains position
-	int x = WorldToGridX( testPos.x );
-	int y = WorldToGridY( testPos.y );
-	NavAreaVector *areaVector = &m_grid[ x + y*m_gridSizeX ];
+	UpdateGridExtents();
 
 	// search cell list to find correct area
-	CNavArea *use = NULL;
-	float useZ = -99999999.9f;
-
 	bool bSkipBlockedAreas = ( ( nFlags & GETNAVAREA_ALLOW_BLOCKED_AREAS ) == 0 );
-	FOR_EACH_VEC( (*areaVector), it )
-	{
-		CNavArea *pArea = (*areaVector)[ it ];
-
-		// check if position is within 2D boundaries of this area
-		if ( !pArea->IsOverlapping( testPos ) )
-			continue;
-
-		// don't consider blocked areas
-		if ( bSkipBlockedAreas && pArea->IsBlocked( pEntity->GetTeamNumber() ) )
-			continue;
-
-		// project position onto area to get Z
-		float z = pArea->GetZ( testPos );
+	CNavArea *use = GetNavAreaPacked( testPos, testPos.z + flStepHeight, testPos.z - flBeneathLimit, bSkipBlockedAreas, pEntity->GetTeamNumber() );
 
-		// if area is above us, skip it
-		if ( z > testPos.z + flStepHeight )
-			continue;
-
-		// if area is too far below us, skip it
-		if ( z < testPos.z - flBeneathLimit )
-			continue;
+	// Check LOS if necessary
+	return CheckNavAreaLOS( use, testPos, nFlags, flStepHeight );
+}
 
-		// if area is lower than the one we have, skip it
-		if ( z <= useZ )
-			continue;
 
-		use = pArea;
-		useZ = z;
-	}
+//----------------------------------------------------------------------------
+// If requested, make sure the area found for an entity is directly below it and unobstructed
+//----------------------------------------------------------------------------
+CNavArea *CNavMesh::CheckNavAreaLOS( CNavArea *use, const Vector &testPos, int nFlags, float flStepHeight ) const
+{
+	if ( !use )
+		return NULL;
 
-	// Check LOS if necessary
-	if ( use && ( nFlags && GETNAVAREA_CHECK_LOS ) && ( useZ < testPos.z - flStepHeight ) )
+	float useZ = use->GetZ( testPos );
+	if ( ( nFlags && GETNAVAREA_CHECK_LOS ) && ( useZ < testPos.z - flStepHeight ) )
 	{
 		// trace directly down to see if it's below us and unobstructed
 		trace_t result;
@@ -1017,6 +977,542 @@ CNavArea *CNavMesh::GetNearestNavArea( CBaseEntity *pEntity, int nFlags, float m
 }
 
 
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Discard the packed grid extents and the per-entity area cache.
+ * Must be invoked whenever an area is added, removed, or has its 2D extents changed.
+ * Changing the mesh is main thread only, so this never runs while another thread is querying it.
+ */
+void CNavMesh::InvalidateGridExtents( void )
+{
+	m_isGridExtentsDirty = true;
+	m_entityAreaCache.Purge();
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Copy the 2D extents of the areas in each grid cell into groups of four, so they can be tested together.
+ * Update() rebuilds once per frame on the main thread, but queries can still find the extents dirty
+ * (during loading and generation, or from a worker thread), so the rebuild is done under a lock and
+ * the flag is cleared only once the new extents are visible to other threads.
+ */
+void CNavMesh::UpdateGridExtents( void ) const
+{
+	if ( !m_isGridExtentsDirty )
+		return;
+
+	AUTO_LOCK( m_gridExtentsMutex );
+
+	// another thread may have rebuilt them while we waited
+	if ( !m_isGridExtentsDirty )
+		return;
+
+	m_gridExtentsStart.SetCount( m_grid.Count() + 1 );
+
+	int groupCount = 0;
+	FOR_EACH_VEC( m_grid, it )
+	{
+		m_gridExtentsStart[ it ] = groupCount;
+		groupCount += ( m_grid[ it ].Count() + 3 ) / 4;
+	}
+	m_gridExtentsStart[ m_grid.Count() ] = groupCount;
+
+	m_gridExtents.SetCount( 4 * groupCount );
+
+	FOR_EACH_VEC( m_grid, it )
+	{
+		const NavAreaVector &areaVector = m_grid[ it ];
+		fltx4 *group = m_gridExtents.Base() + 4 * m_gridExtentsStart[ it ];
+
+		for( int i=0; i<areaVector.Count(); i += 4, group += 4 )
+		{
+			for( int lane=0; lane<4; ++lane )
+			{
+				if ( i + lane < areaVector.Count() )
+				{
+					const CNavArea *area = areaVector[ i + lane ];
+					SubFloat( group[0], lane ) = area->m_nwCorner.x;
+					SubFloat( group[1], lane ) = area->m_nwCorner.y;
+					SubFloat( group[2], lane ) = area->m_seCorner.x;
+					SubFloat( group[3], lane ) = area->m_seCorner.y;
+				}
+				else
+				{
+					// empty extent, never overlaps anything
+					SubFloat( group[0], lane ) = FLT_MAX;
+					SubFloat( group[1], lane ) = FLT_MAX;
+					SubFloat( group[2], lane ) = -FLT_MAX;
+					SubFloat( group[3], lane ) = -FLT_MAX;
+				}
+			}
+		}
+	}
+
+	ThreadMemoryBarrier();
+	m_isGridExtentsDirty = false;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Return the highest area in the grid cell of 'testPos' that IsOverlapping it, whose Z at
+ * 'testPos' is no higher than zAbove and no lower than zBelow.
+ * Areas are tested four at a time, in grid cell order, so ties go to the first area as before.
+ */
+CNavArea *CNavMesh::GetNavAreaPacked( const Vector &testPos, float zAbove, float zBelow, bool skipBlockedAreas, int team ) const
+{
+	int iGrid = WorldToGridX( testPos.x ) + WorldToGridY( testPos.y ) * m_gridSizeX;
+	const NavAreaVector &areaVector = m_grid[ iGrid ];
+	const fltx4 *group = m_gridExtents.Base() + 4 * m_gridExtentsStart[ iGrid ];
+	int groupCount = m_gridExtentsStart[ iGrid+1 ] - m_gridExtentsStart[ iGrid ];
+
+	fltx4 x = ReplicateX4( testPos.x );
+	fltx4 y = ReplicateX4( testPos.y );
+
+	CNavArea *use = NULL;
+	float useZ = -99999999.9f;
+
+	for( int g=0; g<groupCount; ++g, group += 4 )
+	{
+		// check if position is within 2D boundaries of each area
+		fltx4 isOverlapping = AndSIMD( AndSIMD( CmpGeSIMD( x, group[0] ), CmpGeSIMD( y, group[1] ) ),
+									   AndSIMD( CmpLeSIMD( x, group[2] ), CmpLeSIMD( y, group[3] ) ) );
+
+		int mask = TestSignSIMD( isOverlapping );
+		if ( !mask )
+			continue;
+
+		for( int lane=0; lane<4; ++lane )
+		{
+			if ( !( mask & ( 1 << lane ) ) )
+				continue;
+
+			CNavArea *area = areaVector[ g*4 + lane ];
+
+			// don't consider blocked areas
+			if ( skipBlockedAreas && area->IsBlocked( team ) )
+				continue;
+
+			// project position onto area to get Z
+			float z = area->GetZ( testPos );
+
+			// if area is above us, skip it
+			if ( z > zAbove )
+				continue;
+
+			// if area is too far below us, skip it
+			if ( z < zBelow )
+				continue;
+
+			// if area is lower than the one we have, skip it
+			if ( z <= useZ )
+				continue;
+
+			use = area;
+			useZ = z;
+		}
+	}
+
+	return use;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Return true if no other area overlaps the interior of the given area, meaning any position strictly
+ * inside its 2D extents can only be over this area.
+ */
+bool CNavMesh::IsAreaExclusive( const CNavArea *area ) const
+{
+	int loX = WorldToGridX( area->m_nwCorner.x );
+	int loY = WorldToGridY( area->m_nwCorner.y );
+	int hiX = WorldToGridX( area->m_seCorner.x );
+	int hiY = WorldToGridY( area->m_seCorner.y );
+
+	for( int y = loY; y <= hiY; ++y )
+	{
+		for( int x = loX; x <= hiX; ++x )
+		{
+			const NavAreaVector &areaVector = m_grid[ x + y*m_gridSizeX ];
+			FOR_EACH_VEC( areaVector, it )
+			{
+				const CNavArea *other = areaVector[ it ];
+				if ( other == area )
+					continue;
+
+				if ( other->m_nwCorner.x < area->m_seCorner.x && other->m_seCorner.x > area->m_nwCorner.x &&
+					 other->m_nwCorner.y < area->m_seCorner.y && other->m_seCorner.y > area->m_nwCorner.y )
+					return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Batched GetNavArea( const Vector & ). areas[i] receives the result for pos[i].
+ */
+void CNavMesh::GetNavAreas( const Vector *pos, CNavArea **areas, int count, float beneathLimit ) const
+{
+	VPROF_BUDGET( "CNavMesh::GetNavAreas", "NextBot" );
+
+	if ( !m_grid.Count() )
+	{
+		for( int i=0; i<count; ++i )
+		{
+			areas[i] = NULL;
+		}
+		return;
+	}
+
+	UpdateGridExtents();
+
+	for( int i=0; i<count; ++i )
+	{
+		Vector testPos = pos[i] + Vector( 0, 0, 5 );
+		areas[i] = GetNavAreaPacked( testPos, testPos.z, pos[i].z - beneathLimit, false, TEAM_ANY );
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Batched GetNavArea( CBaseEntity * ). areas[i] receives the result for entities[i].
+ * Each entity remembers the area it was last found in. While it stays strictly inside that area,
+ * and no other area overlaps it, the area is the only candidate and the grid cell is not searched.
+ */
+void CNavMesh::GetNavAreas( CBaseEntity **entities, CNavArea **areas, int count, int nFlags, float flBeneathLimit ) const
+{
+	VPROF_BUDGET( "CNavMesh::GetNavAreas [ent]", "NextBot" );
+
+	// the per-entity cache is not guarded
+	Assert( ThreadInMainThread() );
+
+	if ( !m_grid.Count() )
+	{
+		for( int i=0; i<count; ++i )
+		{
+			areas[i] = NULL;
+		}
+		return;
+	}
+
+	UpdateGridExtents();
+
+	if ( !m_entityAreaCache.Count() )
+	{
+		m_entityAreaCache.SetCount( NUM_ENT_ENTRIES );
+		FOR_EACH_VEC( m_entityAreaCache, it )
+		{
+			m_entityAreaCache[ it ].m_area = NULL;
+			m_entityAreaCache[ it ].m_isExclusive = false;
+		}
+	}
+
+	bool bSkipBlockedAreas = ( ( nFlags & GETNAVAREA_ALLOW_BLOCKED_AREAS ) == 0 );
+
+	for( int i=0; i<count; ++i )
+	{
+		CBaseEntity *pEntity = entities[i];
+		Vector testPos = pEntity->GetAbsOrigin();
+
+		float flStepHeight = 1e-3;
+		CBaseCombatCharacter *pBCC = pEntity->MyCombatCharacterPointer();
+		if ( pBCC )
+		{
+			// Check if we're still in the last area
+			CNavArea *pLastNavArea = pBCC->GetLastKnownArea();
+			if ( pLastNavArea && pLastNavArea->IsOverlapping( testPos ) )
+			{
+				float flZ = pLastNavArea->GetZ( testPos );
+				if ( ( flZ <= testPos.z + StepHeight ) && ( flZ >= testPos.z - StepHeight ) )
+				{
+					areas[i] = pLastNavArea;
+					continue;
+				}
+			}
+			flStepHeight = StepHeight;
+		}
+
+		int team = pEntity->GetTeamNumber();
+		float zAbove = testPos.z + flStepHeight;
+		float zBelow = testPos.z - flBeneathLimit;
+
+		EntityAreaCache &cache = m_entityAreaCache[ pEntity->GetRefEHandle().GetEntryIndex() ];
+		CNavArea *cached = cache.m_area;
+
+		CNavArea *use = NULL;
+		if ( cached && cache.m_isExclusive && cache.m_entity.Get() == pEntity &&
+			 testPos.x > cached->m_nwCorner.x && testPos.x < cached->m_seCorner.x &&
+			 testPos.y > cached->m_nwCorner.y && testPos.y < cached->m_seCorner.y )
+		{
+			// no other area can overlap this position, apply the same tests as GetNavAreaPacked()
+			if ( !bSkipBlockedAreas || !cached->IsBlocked( team ) )
+			{
+				float z = cached->GetZ( testPos );
+				if ( z <= zAbove && z >= zBelow && z > -99999999.9f )
+				{
+					use = cached;
+				}
+			}
+		}
+		else
+		{
+			use = GetNavAreaPacked( testPos, zAbove, zBelow, bSkipBlockedAreas, team );
+
+			cache.m_entity = pEntity;
+			cache.m_area = use;
+			cache.m_isExclusive = use && IsAreaExclusive( use );
+		}
+
+		areas[i] = CheckNavAreaLOS( use, testPos, nFlags, flStepHeight );
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Batched GetNearestNavArea( CBaseEntity * ). areas[i] receives the result for entities[i].
+ */
+void CNavMesh::GetNearestNavAreas( CBaseEntity **entities, CNavArea **areas, int count, int nFlags, float maxDist ) const
+{
+	VPROF_BUDGET( "CNavMesh::GetNearestNavAreas [ent]", "NextBot" );
+
+	// quick check
+	GetNavAreas( entities, areas, count, nFlags );
+
+	if ( !m_grid.Count() )
+		return;
+
+	bool bCheckLOS = ( nFlags & GETNAVAREA_CHECK_LOS ) != 0;
+	bool bCheckGround = ( nFlags & GETNAVAREA_CHECK_GROUND ) != 0;
+
+	for( int i=0; i<count; ++i )
+	{
+		if ( areas[i] )
+			continue;
+
+		CBaseEntity *pEntity = entities[i];
+		areas[i] = GetNearestNavArea( pEntity->GetAbsOrigin(), false, maxDist, bCheckLOS, bCheckGround, pEntity->GetTeamNumber() );
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Compare the batched area queries against the single ones, and time both
+ */
+CON_COMMAND_F( nav_test_batch_queries, "Runs <count> random GetNavArea queries plus one for each entity, both singly and batched, and reports any differences.", FCVAR_GAMEDLL | FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	if ( !TheNavAreas.Count() )
+	{
+		Msg( "No navigation mesh loaded.\n" );
+		return;
+	}
+
+	int count = ( args.ArgC() > 1 ) ? MAX( atoi( args[1] ), 1 ) : 10000;
+
+	// random positions over and around random areas
+	CUtlVector< Vector > pos;
+	pos.SetCount( count );
+	FOR_EACH_VEC( pos, it )
+	{
+		CNavArea *area = TheNavAreas[ RandomInt( 0, TheNavAreas.Count()-1 ) ];
+		const Vector &lo = area->GetCorner( NORTH_WEST );
+		const Vector &hi = area->GetCorner( SOUTH_EAST );
+		pos[ it ].x = RandomFloat( lo.x - 16.0f, hi.x + 16.0f );
+		pos[ it ].y = RandomFloat( lo.y - 16.0f, hi.y + 16.0f );
+		pos[ it ].z = area->GetCenter().z + RandomFloat( -64.0f, 128.0f );
+	}
+
+	CUtlVector< CNavArea * > single, batched;
+	single.SetCount( count );
+	batched.SetCount( count );
+
+	CFastTimer singleTimer;
+	singleTimer.Start();
+	FOR_EACH_VEC( pos, it )
+	{
+		single[ it ] = TheNavMesh->GetNavArea( pos[ it ] );
+	}
+	singleTimer.End();
+
+	CFastTimer batchTimer;
+	batchTimer.Start();
+	TheNavMesh->GetNavAreas( pos.Base(), batched.Base(), count );
+	batchTimer.End();
+
+	int mismatches = 0;
+	FOR_EACH_VEC( pos, it )
+	{
+		if ( single[ it ] != batched[ it ] )
+		{
+			++mismatches;
+		}
+	}
+
+	Msg( "%d positions: single %.3f ms, batched %.3f ms, %d mismatches\n", count, singleTimer.GetDuration().GetMillisecondsF(), batchTimer.GetDuration().GetMillisecondsF(), mismatches );
+
+	// every entity, twice so the second pass can use the per-entity cache
+	CUtlVector< CBaseEntity * > entities;
+	for( CBaseEntity *entity = gEntList.FirstEnt(); entity; entity = gEntList.NextEnt( entity ) )
+	{
+		entities.AddToTail( entity );
+	}
+
+	single.SetCount( entities.Count() );
+	batched.SetCount( entities.Count() );
+
+	for( int pass=0; pass<2; ++pass )
+	{
+		singleTimer.Start();
+		FOR_EACH_VEC( entities, it )
+		{
+			single[ it ] = TheNavMesh->GetNavArea( entities[ it ], GETNAVAREA_CHECK_GROUND );
+		}
+		singleTimer.End();
+
+		batchTimer.Start();
+		TheNavMesh->GetNavAreas( entities.Base(), batched.Base(), entities.Count(), GETNAVAREA_CHECK_GROUND );
+		batchTimer.End();
+
+		mismatches = 0;
+		FOR_EACH_VEC( entities, it )
+		{
+			if ( single[ it ] != batched[ it ] )
+			{
+				++mismatches;
+			}
+		}
+
+		Msg( "%d entities, pass %d: single %.3f ms, batched %.3f ms, %d mismatches\n", entities.Count(), pass+1, singleTimer.GetDuration().GetMillisecondsF(), batchTimer.GetDuration().GetMillisecondsF(), mismatches );
+	}
+}
+
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Reference for nav_test_packed_queries: the one-area-at-a-time scan GetNavArea() used to perform
+ */
+class NavAreaScalarLookup
+{
+public:
+	NavAreaScalarLookup( const Vector &pos, float beneathLimit )
+	{
+		m_pos = pos;
+		m_testPos = pos + Vector( 0, 0, 5 );
+		m_beneathLimit = beneathLimit;
+		m_use = NULL;
+		m_useZ = -99999999.9f;
+	}
+
+	bool operator() ( CNavArea *area )
+	{
+		// check if position is within 2D boundaries of this area
+		if (area->IsOverlapping( m_testPos ))
+		{
+			// project position onto area to get Z
+			float z = area->GetZ( m_testPos );
+
+			// if area is above us, skip it
+			if (z > m_testPos.z)
+				return true;
+
+			// if area is too far below us, skip it
+			if (z < m_pos.z - m_beneathLimit)
+				return true;
+
+			// if area is higher than the one we have, use this instead
+			if (z > m_useZ)
+			{
+				m_use = area;
+				m_useZ = z;
+			}
+		}
+
+		return true;
+	}
+
+	Vector m_pos;
+	Vector m_testPos;
+	float m_beneathLimit;
+	CNavArea *m_use;
+	float m_useZ;
+};
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Compare GetNavArea() against the scalar scan
+ */
+CON_COMMAND_F( nav_test_packed_queries, "Runs <count> random GetNavArea queries, packed and scalar, and reports any differences.", FCVAR_GAMEDLL | FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	if ( !TheNavAreas.Count() )
+	{
+		Msg( "No navigation mesh loaded.\n" );
+		return;
+	}
+
+	int count = ( args.ArgC() > 1 ) ? MAX( atoi( args[1] ), 1 ) : 10000;
+
+	// random positions over and around random areas
+	CUtlVector< Vector > pos;
+	pos.SetCount( count );
+	FOR_EACH_VEC( pos, it )
+	{
+		CNavArea *area = TheNavAreas[ RandomInt( 0, TheNavAreas.Count()-1 ) ];
+		const Vector &lo = area->GetCorner( NORTH_WEST );
+		const Vector &hi = area->GetCorner( SOUTH_EAST );
+		pos[ it ].x = RandomFloat( lo.x - 16.0f, hi.x + 16.0f );
+		pos[ it ].y = RandomFloat( lo.y - 16.0f, hi.y + 16.0f );
+		pos[ it ].z = area->GetCenter().z + RandomFloat( -64.0f, 128.0f );
+	}
+
+	CUtlVector< CNavArea * > packed, scalar;
+	packed.SetCount( count );
+	scalar.SetCount( count );
+
+	FOR_EACH_VEC( pos, it )
+	{
+		packed[ it ] = TheNavMesh->GetNavArea( pos[ it ] );
+	}
+
+	FOR_EACH_VEC( pos, it )
+	{
+		// a zero-size 2D extent visits only the cell containing the position, in grid order
+		Extent extent;
+		extent.lo.Init( pos[ it ].x, pos[ it ].y, -FLT_MAX );
+		extent.hi.Init( pos[ it ].x, pos[ it ].y, FLT_MAX );
+
+		NavAreaScalarLookup lookup( pos[ it ], 120.0f );
+		TheNavMesh->ForAllAreasOverlappingExtent( lookup, extent );
+		scalar[ it ] = lookup.m_use;
+	}
+
+	int mismatches = 0;
+	FOR_EACH_VEC( pos, it )
+	{
+		if ( packed[ it ] != scalar[ it ] )
+		{
+			++mismatches;
+		}
+	}
+
+	Msg( "%d positions: %d mismatches\n", count, mismatches );
+}
+
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Given an ID, return the associated area
@@ -3129,6 +3625,8 @@ void CNavMesh::OnAreaBlocked( CNavArea *area )
 	{
 		m_blockedAreas.AddToTail( area );
 	}
+
+	TheNavAreaHierarchy.OnAreaChanged( area );
 }
 
 
@@ -3137,6 +3635,8 @@ void CNavMesh::OnAreaBlocked( CNavArea *area )
 void CNavMesh::OnAreaUnblocked( CNavArea *area )
 {
 	m_blockedAreas.FindAndRemove( area );
+
+	TheNavAreaHierarchy.OnAreaChanged( area );
 }
 
 
@@ -22,6 +22,7 @@
 #include "utlbuffer.h"
 #include "filesystem.h"
 #include "GameEventListener.h"
+#include "mathlib/ssemath.h"
 
 #include "nav.h"
 #include "nav_area.h"
@@ -323,6 +324,13 @@ public:
 	CNavArea *GetNearestNavArea( const Vector &pos, bool anyZ = false, float maxDist = 10000.0f, bool checkLOS = false, bool checkGround = true, int team = TEAM_ANY ) const;
 	CNavArea *GetNearestNavArea( CBaseEntity *pEntity, int nGetNavAreaFlags = GETNAVAREA_CHECK_GROUND, float maxDist = 10000.0f ) const;
 
+	// Batched versions of the above, resolving 'count' queries at once. Results are identical to calling the single versions.
+	// The entity versions keep a per-entity area cache and must only be called from the main thread.
+	void GetNavAreas( const Vector *pos, CNavArea **areas, int count, float beneathLimit = 120.0f ) const;
+	void GetNavAreas( CBaseEntity **entities, CNavArea **areas, int count, int nGetNavAreaFlags, float flBeneathLimit = 120.0f ) const;
+	void GetNearestNavAreas( CBaseEntity **entities, CNavArea **areas, int count, int nGetNavAreaFlags = GETNAVAREA_CHECK_GROUND, float maxDist = 10000.0f ) const;
+	void InvalidateGridExtents( void );									// invoked when area extents change, to discard the packed grid extents and per-entity caches
+
 	Place GetPlace( const Vector &pos ) const;							// return Place at given coordinate
 	const char *PlaceToName( Place place ) const;						// given a place, return its name
 	Place NameToPlace( const char *name ) const;						// given a place name, return a place ID or zero if no place is defined
@@ -1087,6 +1095,25 @@ private:
 
 	void AddNavArea( CNavArea *area );							// add an area to the grid
 
+	// packed copy of the grid's area extents, for testing four areas at a time
+	mutable CUtlVector< fltx4, CUtlMemoryAligned< fltx4, 16 > > m_gridExtents;	// per cell, groups of four areas as x mins, y mins, x maxs, y maxs
+	mutable CUtlVector< int > m_gridExtentsStart;				// first group of each cell, plus one entry past the last cell
+	mutable volatile bool m_isGridExtentsDirty;
+	mutable CThreadFastMutex m_gridExtentsMutex;				// serializes the rebuild when queries come from more than one thread
+	void UpdateGridExtents( void ) const;						// rebuild the packed extents if the grid has changed
+	CNavArea *GetNavAreaPacked( const Vector &testPos, float zAbove, float zBelow, bool skipBlockedAreas, int team ) const;	// find the highest overlapping area between the Z limits
+	CNavArea *CheckNavAreaLOS( CNavArea *use, const Vector &testPos, int nFlags, float flStepHeight ) const;
+
+	// the last area each entity was found in by GetNavAreas(), and whether no other area overlaps its interior
+	struct EntityAreaCache
+	{
+		EHANDLE m_entity;
+		CNavArea *m_area;
+		bool m_isExclusive;
+	};
+	mutable CUtlVector< EntityAreaCache > m_entityAreaCache;	// indexed by entity handle entry, main thread only
+	bool IsAreaExclusive( const CNavArea *area ) const;			// return true if no other area overlaps the interior of the given area
+
 	void DestroyNavigationMesh( bool incremental = false );		// free all resources of the mesh and reset it to empty state
 	void DestroyHidingSpots( void );
 
@@ -15,6 +15,7 @@
 #include "tier0/vprof.h"
 #include "mathlib/ssemath.h"
 #include "nav_area.h"
+#include "nav_hierarchy.h"
 
 #ifdef STAGING_ONLY
 extern int g_DebugPathfindCounter;
@@ -87,6 +88,23 @@ public:
 	}
 };
 
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * NavAreaBuildPath() can hand searches with these cost functors to the nav cluster hierarchy, which knows
+ * their costs. Functors derived from ShortestPathCost may change the costs, so they do not qualify.
+ */
+template< typename CostFunctor >
+inline bool IsHierarchicalPathCost( const CostFunctor & )
+{
+	return false;
+}
+
+inline bool IsHierarchicalPathCost( const ShortestPathCost & )
+{
+	return true;
+}
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Find path from startArea to goalArea via an A* search, using supplied cost heuristic.
@@ -131,6 +149,25 @@ bool NavAreaBuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *go
 		return true;
 	}
 
+	// shortest paths to a goal area can come from the cluster hierarchy
+	if ( goalArea && maxPathLength <= 0.0f && !ignoreNavBlockers && IsHierarchicalPathCost( costFunc ) && TheNavAreaHierarchy.IsEnabled() )
+	{
+		if ( TheNavAreaHierarchy.BuildPath( startArea, goalArea, teamID ) )
+		{
+			if ( closestArea )
+			{
+				*closestArea = goalArea;
+			}
+			return true;
+		}
+
+		// there is no path, but the caller wants the closest area the flat search would find
+		if ( closestArea == NULL )
+			return false;
+
+		startArea->SetParent( NULL );
+	}
+
 	// determine actual goal position
 	Vector actualGoalPos = (goalPos) ? *goalPos : goalArea->GetCenter();
 
@@ -0,0 +1,628 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Runs parallel-safe entity thinks on the thread pool.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "cbase.h"
+#include "parallel_think.h"
+#include "soundent.h"
+#include "gamerules.h"
+#include "collisionproperty.h"
+#include "vstdlib/jobthread.h"
+#include "tier0/vprof.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+ConVar sv_parallel_think( "sv_parallel_think", "0", FCVAR_NONE, "Run the thinks of entities that support it on the thread pool, applying their effects in the usual order afterwards." );
+
+CParallelThinkManager g_ParallelThink;
+
+//-----------------------------------------------------------------------------
+// CParallelRadiusDamage
+//-----------------------------------------------------------------------------
+CParallelRadiusDamage::CParallelRadiusDamage()
+{
+	Reset();
+}
+
+void CParallelRadiusDamage::Reset()
+{
+	m_hInflictor = NULL;
+	m_vecSrc.Init();
+	m_flRadius = 0.0f;
+	m_iClassIgnore = CLASS_NONE;
+	m_hEntityIgnore = NULL;
+	m_bGathered = false;
+	m_bValidated = false;
+	m_flSnapshotRadius = 0.0f;
+	m_nEntityCount = 0;
+	m_Targets.RemoveAll();
+	m_Entities.RemoveAll();
+}
+
+void CParallelRadiusDamage::Init( CBaseEntity *pInflictor, const Vector &vecSrc, float flRadius, int iClassIgnore, CBaseEntity *pEntityIgnore )
+{
+	Reset();
+	m_hInflictor = pInflictor;
+	m_vecSrc = vecSrc;
+	m_flRadius = flRadius;
+	m_iClassIgnore = iClassIgnore;
+	m_hEntityIgnore = pEntityIgnore;
+}
+
+void CParallelRadiusDamage::AddTarget( CBaseEntity *pEntity, const Vector &vecSpot, const trace_t &tr )
+{
+	Target_t &target = m_Targets[ m_Targets.AddToTail() ];
+	target.m_pEntity = pEntity;
+	target.m_vecSpot = vecSpot;
+	target.m_Trace = tr;
+}
+
+void CParallelRadiusDamage::EntityState_t::Init( CBaseEntity *pEntity )
+{
+	m_pEntity = pEntity;
+	m_hEntity = pEntity;
+	m_vecOrigin = pEntity->GetAbsOrigin();
+	m_angAngles = pEntity->GetAbsAngles();
+	m_vecMins = pEntity->CollisionProp()->OBBMins();
+	m_vecMaxs = pEntity->CollisionProp()->OBBMaxs();
+	m_nModelIndex = pEntity->GetModelIndex();
+	m_nSolidType = pEntity->GetSolid();
+	m_nSolidFlags = pEntity->GetSolidFlags();
+	m_nCollisionGroup = pEntity->GetCollisionGroup();
+	m_nTakeDamage = pEntity->m_takedamage;
+	m_iTeamNum = pEntity->GetTeamNumber();
+}
+
+bool CParallelRadiusDamage::EntityState_t::IsCurrent() const
+{
+	CBaseEntity *pEntity = m_hEntity.Get();
+	return ( pEntity == m_pEntity &&
+			 pEntity->GetAbsOrigin() == m_vecOrigin &&
+			 pEntity->GetAbsAngles() == m_angAngles &&
+			 pEntity->CollisionProp()->OBBMins() == m_vecMins &&
+			 pEntity->CollisionProp()->OBBMaxs() == m_vecMaxs &&
+			 pEntity->GetModelIndex() == m_nModelIndex &&
+			 pEntity->GetSolid() == m_nSolidType &&
+			 pEntity->GetSolidFlags() == m_nSolidFlags &&
+			 pEntity->GetCollisionGroup() == m_nCollisionGroup &&
+			 pEntity->m_takedamage == m_nTakeDamage &&
+			 pEntity->GetTeamNumber() == m_iTeamNum );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Records the state of everything a trace from the source out to
+//			flRadius could hit. Static props and the world never change.
+//-----------------------------------------------------------------------------
+bool CParallelRadiusDamage::Snapshot( float flRadius )
+{
+	m_flSnapshotRadius = flRadius;
+	m_Entities.RemoveAll();
+
+	CBaseEntity *pList[ MAX_SPHERE_QUERY ];
+	int nCount = UTIL_EntitiesInSphere( pList, ARRAYSIZE( pList ), m_vecSrc, flRadius, 0 );
+	if ( nCount == ARRAYSIZE( pList ) )
+		return false;
+
+	// The inflictor is skipped by the traces, and changes itself before the damage is done
+	CBaseEntity *pInflictor = m_hInflictor.Get();
+	for ( int i = 0; i < nCount; i++ )
+	{
+		CBaseEntity *pEntity = pList[i];
+		if ( pEntity == pInflictor )
+			continue;
+
+		if ( pEntity->IsEFlagSet( EFL_DIRTY_ABSTRANSFORM ) )
+			return false;
+
+		m_Entities[ m_Entities.AddToTail() ].Init( pEntity );
+	}
+
+	return true;
+}
+
+bool CParallelRadiusDamage::Matches( const CTakeDamageInfo &info, const Vector &vecSrc, float flRadius, int iClassIgnore, CBaseEntity *pEntityIgnore ) const
+{
+	CBaseEntity *pInflictor = m_hInflictor.Get();
+	return ( m_bGathered && pInflictor &&
+			 info.GetInflictor() == pInflictor &&
+			 pInflictor->m_takedamage == DAMAGE_NO &&
+			 vecSrc == m_vecSrc &&
+			 flRadius == m_flRadius &&
+			 iClassIgnore == m_iClassIgnore &&
+			 pEntityIgnore == m_hEntityIgnore.Get() );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Checks that the entities around the source are the ones the
+//			worker saw, unchanged, before the first trace is used
+//-----------------------------------------------------------------------------
+bool CParallelRadiusDamage::Validate()
+{
+	m_bValidated = false;
+
+	CBaseEntity *pList[ MAX_SPHERE_QUERY ];
+	int nCount = UTIL_EntitiesInSphere( pList, ARRAYSIZE( pList ), m_vecSrc, m_flSnapshotRadius, 0 );
+
+	CBaseEntity *pInflictor = m_hInflictor.Get();
+	int nFound = 0;
+	for ( int i = 0; i < nCount; i++ )
+	{
+		if ( pList[i] == pInflictor )
+			continue;
+
+		int j;
+		for ( j = 0; j < m_Entities.Count(); j++ )
+		{
+			if ( m_Entities[j].m_pEntity == pList[i] )
+				break;
+		}
+
+		if ( j == m_Entities.Count() || !m_Entities[j].IsCurrent() )
+			return false;
+
+		nFound++;
+	}
+
+	if ( nFound != m_Entities.Count() )
+		return false;
+
+	m_nEntityCount = gEntList.NumberOfEntities();
+	m_bValidated = true;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Damage done to earlier targets can kill, move or spawn things;
+//			once anything the traces depend on has changed, every remaining
+//			target is traced again
+//-----------------------------------------------------------------------------
+bool CParallelRadiusDamage::GetTrace( CBaseEntity *pEntity, const Vector &vecSpot, trace_t *pTrace )
+{
+	if ( !m_bValidated )
+		return false;
+
+	if ( gEntList.NumberOfEntities() != m_nEntityCount )
+	{
+		m_bValidated = false;
+		return false;
+	}
+
+	for ( int i = 0; i < m_Entities.Count(); i++ )
+	{
+		if ( !m_Entities[i].IsCurrent() )
+		{
+			m_bValidated = false;
+			return false;
+		}
+	}
+
+	for ( int i = 0; i < m_Targets.Count(); i++ )
+	{
+		const Target_t &target = m_Targets[i];
+		if ( target.m_pEntity == pEntity && target.m_vecSpot == vecSpot )
+		{
+			*pTrace = target.m_Trace;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+// CParallelThinkEffects
+//-----------------------------------------------------------------------------
+void CParallelThinkEffects::Reset()
+{
+	m_Effects.RemoveAll();
+	m_Damage.RemoveAll();
+	m_Dependencies.RemoveAll();
+	m_RadiusDamage.Reset();
+}
+
+CParallelThinkEffects::Effect_t &CParallelThinkEffects::AddEffect( EffectType_t nType )
+{
+	Effect_t &effect = m_Effects[ m_Effects.AddToTail() ];
+	effect.m_nType = nType;
+	return effect;
+}
+
+void CParallelThinkEffects::SetAbsAngles( const QAngle &angles )
+{
+	AddEffect( EFFECT_SET_ABS_ANGLES ).m_angValue = angles;
+}
+
+void CParallelThinkEffects::ScaleAbsVelocity( float flScale )
+{
+	AddEffect( EFFECT_SCALE_ABS_VELOCITY ).m_flValue = flScale;
+}
+
+void CParallelThinkEffects::SetNextThink( float flNextThinkTime )
+{
+	AddEffect( EFFECT_SET_NEXT_THINK ).m_flValue = flNextThinkTime;
+}
+
+void CParallelThinkEffects::SetThinkFunc( BASEPTR pfnThink )
+{
+	AddEffect( EFFECT_SET_THINK ).m_pfnFunc = pfnThink;
+}
+
+void CParallelThinkEffects::Call( BASEPTR pfnFunc )
+{
+	AddEffect( EFFECT_CALL ).m_pfnFunc = pfnFunc;
+}
+
+void CParallelThinkEffects::InsertSound( int iType, const Vector &vecOrigin, int iVolume, float flDuration )
+{
+	Effect_t &effect = AddEffect( EFFECT_INSERT_SOUND );
+	effect.m_nValue = iType;
+	effect.m_vecValue = vecOrigin;
+	effect.m_nVolume = iVolume;
+	effect.m_flValue = flDuration;
+}
+
+void CParallelThinkEffects::TakeDamage( CBaseEntity *pVictim, const CTakeDamageInfo &info )
+{
+	Effect_t &effect = AddEffect( EFFECT_TAKE_DAMAGE );
+	effect.m_hEntity = pVictim;
+	effect.m_nValue = m_Damage.AddToTail( info );
+}
+
+void CParallelThinkEffects::Create( const char *pszClassname, const Vector &vecOrigin, const QAngle &angles, CBaseEntity *pOwner )
+{
+	Effect_t &effect = AddEffect( EFFECT_CREATE );
+	effect.m_pszClassname = pszClassname;
+	effect.m_vecValue = vecOrigin;
+	effect.m_angValue = angles;
+	effect.m_hEntity = pOwner;
+}
+
+void CParallelThinkEffects::Remove()
+{
+	AddEffect( EFFECT_REMOVE );
+}
+
+void CParallelThinkEffects::RadiusDamage( CBaseEntity *pInflictor, const Vector &vecSrc, float flRadius, int iClassIgnore, CBaseEntity *pEntityIgnore )
+{
+	m_RadiusDamage.Init( pInflictor, vecSrc, flRadius, iClassIgnore, pEntityIgnore );
+	if ( g_pGameRules && g_pGameRules->GatherRadiusDamage( m_RadiusDamage ) )
+	{
+		m_RadiusDamage.SetGathered();
+	}
+}
+
+bool CParallelThinkEffects::DependsOn( CBaseEntity *pEntity )
+{
+	// Both are recomputed by their getters, which is only safe on the main thread
+	if ( pEntity->IsEFlagSet( EFL_DIRTY_ABSTRANSFORM | EFL_DIRTY_SURROUNDING_COLLISION_BOUNDS ) )
+		return false;
+
+	Dependency_t &dependency = m_Dependencies[ m_Dependencies.AddToTail() ];
+	dependency.m_hEntity = pEntity;
+	dependency.m_vecAbsOrigin = pEntity->GetAbsOrigin();
+	dependency.m_angAbsAngles = pEntity->GetAbsAngles();
+	pEntity->CollisionProp()->WorldSpaceSurroundingBounds( &dependency.m_vecMins, &dependency.m_vecMaxs );
+	return true;
+}
+
+bool CParallelThinkEffects::DependenciesAreCurrent() const
+{
+	for ( int i = 0; i < m_Dependencies.Count(); i++ )
+	{
+		const Dependency_t &dependency = m_Dependencies[i];
+		CBaseEntity *pEntity = dependency.m_hEntity.Get();
+		if ( !pEntity ||
+			 pEntity->GetAbsOrigin() != dependency.m_vecAbsOrigin ||
+			 pEntity->GetAbsAngles() != dependency.m_angAbsAngles )
+			return false;
+
+		Vector vecMins, vecMaxs;
+		pEntity->CollisionProp()->WorldSpaceSurroundingBounds( &vecMins, &vecMaxs );
+		if ( vecMins != dependency.m_vecMins || vecMaxs != dependency.m_vecMaxs )
+			return false;
+	}
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Replays the recorded effects on the main thread, exactly as the
+//			serial think would have made them
+//-----------------------------------------------------------------------------
+void CParallelThinkEffects::Apply( CBaseEntity *pEntity ) const
+{
+	for ( int i = 0; i < m_Effects.Count(); i++ )
+	{
+		const Effect_t &effect = m_Effects[i];
+		switch ( effect.m_nType )
+		{
+		case EFFECT_SET_ABS_ANGLES:
+			pEntity->SetAbsAngles( effect.m_angValue );
+			break;
+
+		case EFFECT_SCALE_ABS_VELOCITY:
+			pEntity->SetAbsVelocity( pEntity->GetAbsVelocity() * effect.m_flValue );
+			break;
+
+		case EFFECT_SET_NEXT_THINK:
+			pEntity->SetNextThink( effect.m_flValue );
+			break;
+
+		case EFFECT_SET_THINK:
+			pEntity->ThinkSet( effect.m_pfnFunc );
+			break;
+
+		case EFFECT_CALL:
+			(pEntity->*effect.m_pfnFunc)();
+			break;
+
+		case EFFECT_INSERT_SOUND:
+			CSoundEnt::InsertSound( effect.m_nValue, effect.m_vecValue, effect.m_nVolume, effect.m_flValue, pEntity );
+			break;
+
+		case EFFECT_TAKE_DAMAGE:
+			if ( effect.m_hEntity.Get() )
+			{
+				effect.m_hEntity->TakeDamage( m_Damage[ effect.m_nValue ] );
+			}
+			break;
+
+		case EFFECT_CREATE:
+			CBaseEntity::Create( effect.m_pszClassname, effect.m_vecValue, effect.m_angValue, effect.m_hEntity.Get() );
+			break;
+
+		case EFFECT_REMOVE:
+			UTIL_Remove( pEntity );
+			break;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// CParallelThinkManager
+//-----------------------------------------------------------------------------
+CParallelThinkManager::CParallelThinkManager()
+{
+	m_nItems = 0;
+	m_iNextItem = 0;
+	m_pCurrent = NULL;
+	m_pApplying = NULL;
+}
+
+bool CParallelThinkManager::IsEnabled() const
+{
+	return sv_parallel_think.GetBool() && g_pThreadPool && g_pThreadPool->NumThreads() > 0;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Entities whose base think will run this tick and whose state a
+//			worker can read without touching anyone else
+//-----------------------------------------------------------------------------
+bool CParallelThinkManager::IsCandidate( CBaseEntity *pEntity )
+{
+	if ( !pEntity || !pEntity->edict() || !pEntity->m_pfnThink )
+		return false;
+
+	if ( pEntity->IsEFlagSet( EFL_NO_THINK_FUNCTION ) || pEntity->IsMarkedForDeletion() )
+		return false;
+
+#if !defined( NO_ENTITY_PREDICTION )
+	// Physics_SimulateEntity may skip these entirely
+	if ( pEntity->IsPlayerSimulated() )
+		return false;
+#endif
+
+	// Absolute state of a parented entity depends on its parent
+	if ( pEntity->GetMoveParent() )
+		return false;
+
+	int nThinkTick = pEntity->GetNextThinkTick();
+	return ( nThinkTick > 0 && nThinkTick <= gpGlobals->tickcount );
+}
+
+void CParallelThinkManager::ProcessItem( ThinkItem_t &item )
+{
+	item.m_bHandled = item.m_pEntity->ThinkParallel( item.m_Effects );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Workers read other entities' absolute state and query the spatial
+//			partition, both of which are otherwise brought up to date lazily by
+//			whoever reads them first
+//-----------------------------------------------------------------------------
+void CParallelThinkManager::SettleEntityState()
+{
+	UpdateDirtySpatialPartitionEntities();
+
+	for ( CBaseEntity *pEntity = gEntList.FirstEnt(); pEntity; pEntity = gEntList.NextEnt( pEntity ) )
+	{
+		if ( pEntity->IsEFlagSet( EFL_DIRTY_ABSTRANSFORM ) )
+		{
+			pEntity->CalcAbsolutePosition();
+		}
+
+		if ( pEntity->IsEFlagSet( EFL_DIRTY_ABSVELOCITY ) )
+		{
+			pEntity->GetAbsVelocity();
+		}
+	}
+}
+
+void CParallelThinkManager::RunParallelThinks( CBaseEntity **pList, int nCount )
+{
+	VPROF( "CParallelThinkManager::RunParallelThinks" );
+
+	m_nItems = 0;
+	m_iNextItem = 0;
+	m_pCurrent = NULL;
+
+	for ( int i = 0; i < nCount; i++ )
+	{
+		CBaseEntity *pEntity = pList[i];
+		if ( !IsCandidate( pEntity ) )
+			continue;
+
+		if ( m_nItems == m_Items.Count() )
+		{
+			m_Items.AddToTail();
+		}
+
+		ThinkItem_t &item = m_Items[ m_nItems++ ];
+		item.m_pEntity = pEntity;
+		item.m_iListIndex = i;
+		item.m_bHandled = false;
+		item.m_pfnThink = pEntity->m_pfnThink;
+
+		// Computing these here also settles any lazily updated absolute state,
+		// so the workers only ever read it
+		item.m_vecAbsOrigin = pEntity->GetAbsOrigin();
+		item.m_vecAbsVelocity = pEntity->GetAbsVelocity();
+		item.m_nWaterLevel = pEntity->GetWaterLevel();
+		item.m_Effects.Reset();
+	}
+
+	if ( m_nItems )
+	{
+		SettleEntityState();
+		ParallelProcess( "CParallelThinkManager::RunParallelThinks", m_Items.Base(), m_nItems, &ProcessItem );
+	}
+}
+
+void CParallelThinkManager::BeginEntity( int iListIndex )
+{
+	m_pCurrent = NULL;
+
+	while ( m_iNextItem < m_nItems && m_Items[ m_iNextItem ].m_iListIndex < iListIndex )
+	{
+		m_iNextItem++;
+	}
+
+	if ( m_iNextItem < m_nItems && m_Items[ m_iNextItem ].m_iListIndex == iListIndex && m_Items[ m_iNextItem ].m_bHandled )
+	{
+		m_pCurrent = &m_Items[ m_iNextItem ];
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Did something earlier in the frame change what the worker read?
+//-----------------------------------------------------------------------------
+bool CParallelThinkManager::ResultsAreCurrent( const ThinkItem_t &item )
+{
+	CBaseEntity *pEntity = item.m_pEntity;
+	return ( pEntity->m_pfnThink == item.m_pfnThink &&
+			 pEntity->GetAbsOrigin() == item.m_vecAbsOrigin &&
+			 pEntity->GetAbsVelocity() == item.m_vecAbsVelocity &&
+			 pEntity->GetWaterLevel() == item.m_nWaterLevel &&
+			 item.m_Effects.DependenciesAreCurrent() );
+}
+
+bool CParallelThinkManager::ApplyResults( CBaseEntity *pEntity )
+{
+	if ( !m_pCurrent || m_pCurrent->m_pEntity != pEntity )
+		return false;
+
+	// Results are only good for the one base think they were computed for
+	ThinkItem_t *pItem = m_pCurrent;
+	m_pCurrent = NULL;
+
+	if ( !ResultsAreCurrent( *pItem ) )
+		return false;
+
+	m_pApplying = &pItem->m_Effects;
+	pItem->m_Effects.Apply( pEntity );
+	m_pApplying = NULL;
+	return true;
+}
+
+CParallelRadiusDamage *CParallelThinkManager::FindRadiusDamage( const CTakeDamageInfo &info, const Vector &vecSrc, float flRadius, int iClassIgnore, CBaseEntity *pEntityIgnore )
+{
+	if ( !m_pApplying )
+		return NULL;
+
+	CParallelRadiusDamage &radiusDamage = m_pApplying->GetRadiusDamage();
+	if ( !radiusDamage.Matches( info, vecSrc, flRadius, iClassIgnore, pEntityIgnore ) || !radiusDamage.Validate() )
+		return NULL;
+
+	return &radiusDamage;
+}
+
+void CParallelThinkManager::Finish()
+{
+	m_nItems = 0;
+	m_iNextItem = 0;
+	m_pCurrent = NULL;
+	m_pApplying = NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Times the worker side of explosions around every live player, once
+//			on the main thread and once on the thread pool
+//-----------------------------------------------------------------------------
+static void GatherBenchmarkRadiusDamage( CParallelRadiusDamage &radiusDamage )
+{
+	if ( g_pGameRules->GatherRadiusDamage( radiusDamage ) )
+	{
+		radiusDamage.SetGathered();
+	}
+}
+
+CON_COMMAND_F( sv_parallel_think_benchmark, "Times the line of sight traces of <count> explosions of <radius> around the players, serially and on the thread pool.", FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() || !g_pGameRules )
+		return;
+
+	int nExplosions = ( args.ArgC() > 1 ) ? atoi( args[1] ) : 256;
+	float flRadius = ( args.ArgC() > 2 ) ? atof( args[2] ) : 146.0f;
+	if ( nExplosions <= 0 )
+		return;
+
+	CUtlVector< Vector > centers;
+	for ( int i = 1; i <= gpGlobals->maxClients; i++ )
+	{
+		CBasePlayer *pPlayer = UTIL_PlayerByIndex( i );
+		if ( pPlayer && pPlayer->IsAlive() )
+		{
+			centers.AddToTail( pPlayer->GetAbsOrigin() + Vector( 0, 0, 8 ) );
+		}
+	}
+
+	if ( !centers.Count() )
+	{
+		Msg( "sv_parallel_think_benchmark: no live players to explode around\n" );
+		return;
+	}
+
+	CUtlVector< CParallelRadiusDamage > explosions;
+	explosions.SetCount( nExplosions );
+	for ( int i = 0; i < nExplosions; i++ )
+	{
+		explosions[i].Init( NULL, centers[ i % centers.Count() ], flRadius, CLASS_NONE, NULL );
+	}
+
+	CParallelThinkManager::SettleEntityState();
+
+	double flStart = Plat_FloatTime();
+	for ( int i = 0; i < nExplosions; i++ )
+	{
+		GatherBenchmarkRadiusDamage( explosions[i] );
+	}
+	double flSerial = Plat_FloatTime() - flStart;
+
+	int nGathered = 0, nTargets = 0;
+	for ( int i = 0; i < nExplosions; i++ )
+	{
+		nGathered += explosions[i].IsGathered() ? 1 : 0;
+		nTargets += explosions[i].GetTargetCount();
+		explosions[i].Init( NULL, centers[ i % centers.Count() ], flRadius, CLASS_NONE, NULL );
+	}
+
+	flStart = Plat_FloatTime();
+	ParallelProcess( "sv_parallel_think_benchmark", explosions.Base(), nExplosions, &GatherBenchmarkRadiusDamage );
+	double flParallel = Plat_FloatTime() - flStart;
+
+	Msg( "sv_parallel_think_benchmark: %d explosions (%d gathered, %d targets): serial %.3f ms, %d pool threads %.3f ms\n",
+		nExplosions, nGathered, nTargets, flSerial * 1000.0, g_pThreadPool ? g_pThreadPool->NumThreads() : 0, flParallel * 1000.0 );
+}
@@ -0,0 +1,264 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Runs parallel-safe entity thinks on the thread pool. Their side
+//			effects are recorded and applied on the main thread at the point in
+//			the SimThink list where the entity would have thought serially.
+//
+//			A class opts in by overriding CBaseEntity::ThinkParallel(). That
+//			runs on a worker thread, so it may only read the entity's own
+//			state and must not write anything; every change goes through the
+//			CParallelThinkEffects it is handed. Before the effects are applied
+//			the entity's think function, origin, velocity and water level are
+//			compared with what the worker saw; if another entity changed any of
+//			them earlier in the frame the effects are thrown away and the
+//			normal think runs instead. Anything else ThinkParallel() reads must
+//			either only ever be written by the entity itself, or be registered
+//			with DependsOn() so it is checked the same way.
+//
+//			Explosions can have their line of sight traces made on the worker
+//			with RadiusDamage(). The game rules use them when the deferred
+//			detonation makes the matching RadiusDamage() call, as long as
+//			nothing the traces could have hit has changed in the meantime.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef PARALLEL_THINK_H
+#define PARALLEL_THINK_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "utlvector.h"
+#include "mathlib/vector.h"
+#include "takedamageinfo.h"
+#include "gametrace.h"
+
+class CBaseEntity;
+typedef void (CBaseEntity::*BASEPTR)(void);
+
+
+//-----------------------------------------------------------------------------
+// The line of sight traces of one radius damage call, made on a worker thread
+//-----------------------------------------------------------------------------
+class CParallelRadiusDamage
+{
+public:
+	CParallelRadiusDamage();
+
+	void	Reset();
+	void	Init( CBaseEntity *pInflictor, const Vector &vecSrc, float flRadius, int iClassIgnore, CBaseEntity *pEntityIgnore );
+
+	CBaseEntity		*GetInflictor() const	{ return m_hInflictor.Get(); }
+	const Vector	&GetSource() const		{ return m_vecSrc; }
+	float			GetRadius() const		{ return m_flRadius; }
+	int				GetClassIgnore() const	{ return m_iClassIgnore; }
+	CBaseEntity		*GetEntityIgnore() const	{ return m_hEntityIgnore.Get(); }
+
+	// Worker side, called by CGameRules::GatherRadiusDamage(). The inflictor
+	// is assumed to have made itself DAMAGE_NO before the damage is done.
+	void	AddTarget( CBaseEntity *pEntity, const Vector &vecSpot, const trace_t &tr );
+
+	// Records every entity within flRadius of the source, which must cover
+	// all the traces. Returns false if one of them can't be read safely.
+	bool	Snapshot( float flRadius );
+
+	void	SetGathered()			{ m_bGathered = true; }
+	bool	IsGathered() const		{ return m_bGathered; }
+
+	// Main thread. Is this the call that was gathered, with nothing the
+	// traces depend on changed since?
+	bool	Matches( const CTakeDamageInfo &info, const Vector &vecSrc, float flRadius, int iClassIgnore, CBaseEntity *pEntityIgnore ) const;
+	bool	Validate();
+
+	// Fills in the trace gathered for pEntity towards vecSpot. Returns false
+	// if there isn't one or the damage done so far has invalidated it.
+	bool	GetTrace( CBaseEntity *pEntity, const Vector &vecSpot, trace_t *pTrace );
+
+	int		GetTargetCount() const	{ return m_Targets.Count(); }
+
+private:
+	struct Target_t
+	{
+		CBaseEntity		*m_pEntity;
+		Vector			m_vecSpot;
+		trace_t			m_Trace;
+	};
+
+	// Everything about an entity that a trace against it depends on
+	struct EntityState_t
+	{
+		CBaseEntity		*m_pEntity;
+		EHANDLE			m_hEntity;
+		Vector			m_vecOrigin;
+		QAngle			m_angAngles;
+		Vector			m_vecMins;
+		Vector			m_vecMaxs;
+		int				m_nModelIndex;
+		int				m_nSolidType;
+		int				m_nSolidFlags;
+		int				m_nCollisionGroup;
+		int				m_nTakeDamage;
+		int				m_iTeamNum;
+
+		void	Init( CBaseEntity *pEntity );
+		bool	IsCurrent() const;
+	};
+
+	EHANDLE		m_hInflictor;
+	Vector		m_vecSrc;
+	float		m_flRadius;
+	int			m_iClassIgnore;
+	EHANDLE		m_hEntityIgnore;
+	bool		m_bGathered;
+	bool		m_bValidated;
+
+	float		m_flSnapshotRadius;
+	int			m_nEntityCount;			// gEntList count when validated; any spawn invalidates the traces
+
+	CUtlVector< Target_t >		m_Targets;
+	CUtlVector< EntityState_t >	m_Entities;
+};
+
+
+//-----------------------------------------------------------------------------
+// Side effects of one parallel think, replayed in the order they were recorded
+//-----------------------------------------------------------------------------
+class CParallelThinkEffects
+{
+public:
+	void	Reset();
+
+	void	SetAbsAngles( const QAngle &angles );
+	void	ScaleAbsVelocity( float flScale );
+	void	SetNextThink( float flNextThinkTime );
+	void	SetThinkFunc( BASEPTR pfnThink );
+
+	// Calls a member of the thinking entity on the main thread
+	void	Call( BASEPTR pfnFunc );
+
+	void	InsertSound( int iType, const Vector &vecOrigin, int iVolume, float flDuration );
+	void	TakeDamage( CBaseEntity *pVictim, const CTakeDamageInfo &info );
+
+	// pszClassname must outlive the frame (a string literal or pooled string)
+	void	Create( const char *pszClassname, const Vector &vecOrigin, const QAngle &angles, CBaseEntity *pOwner );
+	void	Remove();
+
+	// Makes the traces for a RadiusDamage() call the deferred effects will make
+	void	RadiusDamage( CBaseEntity *pInflictor, const Vector &vecSrc, float flRadius, int iClassIgnore, CBaseEntity *pEntityIgnore );
+	CParallelRadiusDamage &GetRadiusDamage()	{ return m_RadiusDamage; }
+
+	// The effects are only valid if pEntity's position and surrounding bounds are
+	// unchanged. Returns false if the bounds are dirty and can't be read off the
+	// main thread; the think must then run serially.
+	bool	DependsOn( CBaseEntity *pEntity );
+	bool	DependenciesAreCurrent() const;
+
+	void	Apply( CBaseEntity *pEntity ) const;
+
+private:
+	enum EffectType_t
+	{
+		EFFECT_SET_ABS_ANGLES = 0,
+		EFFECT_SCALE_ABS_VELOCITY,
+		EFFECT_SET_NEXT_THINK,
+		EFFECT_SET_THINK,
+		EFFECT_CALL,
+		EFFECT_INSERT_SOUND,
+		EFFECT_TAKE_DAMAGE,
+		EFFECT_CREATE,
+		EFFECT_REMOVE,
+	};
+
+	struct Effect_t
+	{
+		EffectType_t	m_nType;
+		int				m_nValue;		// sound type, damage index
+		int				m_nVolume;
+		float			m_flValue;		// scale, think time, sound duration
+		Vector			m_vecValue;
+		QAngle			m_angValue;
+		BASEPTR			m_pfnFunc;
+		const char		*m_pszClassname;
+		EHANDLE			m_hEntity;		// damage victim, created entity owner
+	};
+
+	struct Dependency_t
+	{
+		EHANDLE			m_hEntity;
+		Vector			m_vecAbsOrigin;
+		QAngle			m_angAbsAngles;
+		Vector			m_vecMins;		// world space surrounding bounds
+		Vector			m_vecMaxs;
+	};
+
+	Effect_t &AddEffect( EffectType_t nType );
+
+	CUtlVector< Effect_t > m_Effects;
+	CUtlVector< CTakeDamageInfo > m_Damage;
+	CUtlVector< Dependency_t > m_Dependencies;
+	CParallelRadiusDamage m_RadiusDamage;
+};
+
+
+//-----------------------------------------------------------------------------
+// Owns the per-frame parallel pass for Physics_RunThinkFunctions
+//-----------------------------------------------------------------------------
+class CParallelThinkManager
+{
+public:
+	CParallelThinkManager();
+
+	bool	IsEnabled() const;
+
+	// Runs ThinkParallel() for every entity in the list whose base think is due
+	void	RunParallelThinks( CBaseEntity **pList, int nCount );
+
+	// Called before simulating list entry i, in list order
+	void	BeginEntity( int iListIndex );
+
+	// Called in place of the base think; returns false if the entity has no
+	// valid parallel results and should think normally
+	bool	ApplyResults( CBaseEntity *pEntity );
+
+	// The traces gathered for this RadiusDamage() call by the think whose
+	// effects are being applied, or NULL
+	CParallelRadiusDamage *FindRadiusDamage( const CTakeDamageInfo &info, const Vector &vecSrc, float flRadius, int iClassIgnore, CBaseEntity *pEntityIgnore );
+
+	// Drops any results that were never applied
+	void	Finish();
+
+	// Works out lazily updated state on the main thread so the workers only read it
+	static void SettleEntityState();
+
+private:
+	struct ThinkItem_t
+	{
+		CBaseEntity				*m_pEntity;
+		int						m_iListIndex;
+		bool					m_bHandled;
+
+		// What the worker saw
+		BASEPTR					m_pfnThink;
+		Vector					m_vecAbsOrigin;
+		Vector					m_vecAbsVelocity;
+		int						m_nWaterLevel;
+
+		CParallelThinkEffects	m_Effects;
+	};
+
+	static bool IsCandidate( CBaseEntity *pEntity );
+	static void ProcessItem( ThinkItem_t &item );
+	static bool ResultsAreCurrent( const ThinkItem_t &item );
+
+	// Items stay allocated between frames so their effect lists keep their memory
+	CUtlVector< ThinkItem_t >	m_Items;
+	int							m_nItems;
+	int							m_iNextItem;
+	ThinkItem_t					*m_pCurrent;
+	CParallelThinkEffects		*m_pApplying;
+};
+
+extern CParallelThinkManager g_ParallelThink;
+
+#endif // PARALLEL_THINK_H
@@ -75,7 +75,7 @@ void CPathCorner::Spawn( void )
 //-----------------------------------------------------------------------------
 void CPathCorner::InputSetNextPathCorner( inputdata_t &inputdata )
 {
-	m_target = inputdata.value.StringID();
+	SetTargetEntityName( inputdata.value.StringID() );
 }
 
 
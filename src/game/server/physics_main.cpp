@@ -33,6 +33,7 @@
 #include "vphysicsupdateai.h"
 #include "tier0/vcrmode.h"
 #include "pushentity.h"
+#include "parallel_think.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -938,7 +939,11 @@ void CBaseEntity::PhysicsDispatchThink( BASEPTR thinkFunc )
 	if ( thinkFunc )
 	{
 		MDLCACHE_CRITICAL_SECTION();
-		(this->*thinkFunc)();
+		// A base think that already ran in parallel only has its effects applied
+		if ( thinkFunc != &CBaseEntity::Think || !g_ParallelThink.ApplyResults( this ) )
+		{
+			(this->*thinkFunc)();
+		}
 	}
 
 	if ( thinkLimit )
@@ -2060,6 +2065,14 @@ void Physics_RunThinkFunctions( bool simulating )
 		// Do we really need UTIL_RemoveImmediate()?
 		int count = SimThink_ListCopy( list, listMax );
 
+		// Parallel-safe thinks are computed up front; their effects are applied
+		// in list order as each entity's think comes up below
+		bool bParallelThink = g_ParallelThink.IsEnabled();
+		if ( bParallelThink )
+		{
+			g_ParallelThink.RunParallelThinks( list, count );
+		}
+
 		//DevMsg(1, "Count: %d\n", count );
 		for ( int i = 0; i < count; i++ )
 		{
@@ -2067,9 +2080,18 @@ void Physics_RunThinkFunctions( bool simulating )
 				continue;
 			// Always reset clock to real sv.time
 			gpGlobals->curtime = starttime;
+			if ( bParallelThink )
+			{
+				g_ParallelThink.BeginEntity( i );
+			}
 			Physics_SimulateEntity( list[i] );
 		}
 
+		if ( bParallelThink )
+		{
+			g_ParallelThink.Finish();
+		}
+
 		stackfree( list );
 		UTIL_EnableRemoveImmediate();
 	}
@@ -13,6 +13,7 @@
 #include "utllinkedlist.h"
 #include "BaseAnimatingOverlay.h"
 #include "tier0/vprof.h"
+#include "tier0/fasttimer.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -36,6 +37,7 @@ ConVar sv_lagflushbonecache( "sv_lagflushbonecache", "1", FCVAR_DEVELOPMENTONLY,
 ConVar sv_showlagcompensation( "sv_showlagcompensation", "0", FCVAR_CHEAT, "Show lag compensated hitboxes whenever a player is lag compensated." );
 
 ConVar sv_unlag_fixstuck( "sv_unlag_fixstuck", "0", FCVAR_DEVELOPMENTONLY, "Disallow backtracking a player for lag compensation if it will cause them to become stuck" );
+ConVar sv_unlag_setupbones( "sv_unlag_setupbones", "0", FCVAR_DEVELOPMENTONLY, "Sets up the bones of all lag compensated players together on the thread pool, rather than as hitbox traces first reach each of them" );
 
 //-----------------------------------------------------------------------------
 // Purpose: 
@@ -114,6 +116,127 @@ public:
 	float					m_masterCycle;
 };
 
+// Must be a power of two. Covers sv_maxunlag (plus the 200ms of cmd tick slop)
+// at any sane tickrate; if it ever fills up the oldest record is dropped.
+#define LAG_RECORD_HISTORY		256
+#define LAG_RECORD_HISTORY_MASK	( LAG_RECORD_HISTORY - 1 )
+
+//-----------------------------------------------------------------------------
+// Purpose: Everything in a lag record that isn't needed to find and validate
+//			the records to backtrack to.
+//-----------------------------------------------------------------------------
+struct LagAnimRecord
+{
+	Vector					m_vecMinsPreScaled;
+	Vector					m_vecMaxsPreScaled;
+
+	LayerRecord				m_layerRecords[MAX_LAYER_RECORDS];
+	int						m_masterSequence;
+	float					m_masterCycle;
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: Fixed size ring buffer of a player's lag records. Records are
+//			addressed by age, 0 being the newest. The fields that every
+//			backtrack searches are stored in separate arrays so a lookup
+//			only touches a handful of cache lines.
+//-----------------------------------------------------------------------------
+class CLagRecordTrack
+{
+public:
+	CLagRecordTrack()
+	{
+		RemoveAll();
+	}
+
+	int		Count() const		{ return m_nCount; }
+	void	RemoveAll()			{ m_iHead = LAG_RECORD_HISTORY_MASK; m_nCount = 0; }
+	void	RemoveTail()		{ Assert( m_nCount > 0 ); --m_nCount; }
+
+	// Maps a record age to its slot in the arrays
+	int		Slot( int iAge ) const	{ Assert( iAge >= 0 && iAge < m_nCount ); return ( m_iHead - iAge ) & LAG_RECORD_HISTORY_MASK; }
+
+	// Returns the slot for a new head record, dropping the oldest record if full
+	int AddToHead()
+	{
+		m_iHead = ( m_iHead + 1 ) & LAG_RECORD_HISTORY_MASK;
+		if ( m_nCount < LAG_RECORD_HISTORY )
+		{
+			++m_nCount;
+		}
+		return m_iHead;
+	}
+
+	// Returns the age of the newest record at or before flTime, or the oldest
+	// record if they're all newer. Simulation times strictly decrease with age.
+	int FindRecordAtOrBefore( float flTime ) const
+	{
+		Assert( m_nCount > 0 );
+
+		int lo = 0;
+		int hi = m_nCount - 1;
+		while ( lo < hi )
+		{
+			int mid = ( lo + hi ) >> 1;
+			if ( m_flSimulationTime[ Slot( mid ) ] <= flTime )
+			{
+				hi = mid;
+			}
+			else
+			{
+				lo = mid + 1;
+			}
+		}
+		return lo;
+	}
+
+	// Finds the record to backtrack to and checks that the player didn't die or
+	// teleport anywhere between it and vecCurOrigin.
+	// Output : false if we lost track of the player on the way back
+	bool FindBacktrackRecord( float flTargetTime, const Vector &vecCurOrigin, float flTeleportDistanceSqr, int &iAge ) const
+	{
+		if ( m_nCount <= 0 )
+			return false;
+
+		iAge = FindRecordAtOrBefore( flTargetTime );
+
+		Vector prevOrg = vecCurOrigin;
+
+		// Walk context looking for any invalidating event
+		for ( int i = 0; i <= iAge; i++ )
+		{
+			int slot = Slot( i );
+
+			if ( !(m_fFlags[ slot ] & LC_ALIVE) )
+			{
+				// player most be alive, lost track
+				return false;
+			}
+
+			Vector delta = m_vecOrigin[ slot ] - prevOrg;
+			if ( delta.Length2DSqr() > flTeleportDistanceSqr )
+			{
+				// lost track, too much difference
+				return false;
+			}
+
+			prevOrg = m_vecOrigin[ slot ];
+		}
+
+		return true;
+	}
+
+	float					m_flSimulationTime[ LAG_RECORD_HISTORY ];
+	Vector					m_vecOrigin[ LAG_RECORD_HISTORY ];
+	QAngle					m_vecAngles[ LAG_RECORD_HISTORY ];
+	int						m_fFlags[ LAG_RECORD_HISTORY ];
+	LagAnimRecord			m_Anim[ LAG_RECORD_HISTORY ];
+
+private:
+	int						m_iHead;
+	int						m_nCount;
+};
+
 
 //
 // Try to take the player from his current origin to vWantedPos.
@@ -173,6 +296,7 @@ public:
 	CLagCompensationManager( char const *name ) : CAutoGameSystemPerFrame( name ), m_flTeleportDistanceSqr( 64 *64 )
 	{
 		m_isCurrentlyDoingCompensation = false;
+		Q_memset( m_PlayerTrack, 0, sizeof( m_PlayerTrack ) );
 	}
 
 	// IServerSystem stuff
@@ -199,15 +323,29 @@ public:
 
 private:
 	void			BacktrackPlayer( CBasePlayer *player, float flTargetTime );
+	bool			FindBacktrackRecords( CBasePlayer *pPlayer, float flTargetTime, int &iRecord, int &iPrevRecord );
+	void			ApplyBacktrack( CBasePlayer *pPlayer, float flTargetTime, int iRecord, int iPrevRecord );
 
 	void ClearHistory()
 	{
 		for ( int i=0; i<MAX_PLAYERS; i++ )
-			m_PlayerTrack[i].Purge();
+		{
+			delete m_PlayerTrack[i];
+			m_PlayerTrack[i] = NULL;
+		}
 	}
 
-	// keep a list of lag records for each player
-	CUtlFixedLinkedList< LagRecord >	m_PlayerTrack[ MAX_PLAYERS ];
+	CLagRecordTrack *GetTrack( int pl_index, bool bCreate )
+	{
+		if ( !m_PlayerTrack[pl_index] && bCreate )
+		{
+			m_PlayerTrack[pl_index] = new CLagRecordTrack;
+		}
+		return m_PlayerTrack[pl_index];
+	}
+
+	// keep a history of lag records for each player, allocated on first use
+	CLagRecordTrack			*m_PlayerTrack[ MAX_PLAYERS ];
 
 	// Scratchpad for determining what needs to be restored
 	CBitVec<MAX_PLAYERS>	m_RestorePlayer;
@@ -250,11 +388,11 @@ void CLagCompensationManager::FrameUpdatePostEntityThink()
 	{
 		CBasePlayer *pPlayer = UTIL_PlayerByIndex( i );
 
-		CUtlFixedLinkedList< LagRecord > *track = &m_PlayerTrack[i-1];
+		CLagRecordTrack *track = GetTrack( i-1, pPlayer != NULL );
 
 		if ( !pPlayer )
 		{
-			if ( track->Count() > 0 )
+			if ( track && track->Count() > 0 )
 			{
 				track->RemoveAll();
 			}
@@ -262,47 +400,40 @@ void CLagCompensationManager::FrameUpdatePostEntityThink()
 			continue;
 		}
 
-		Assert( track->Count() < 1000 ); // insanity check
-
 		// remove tail records that are too old
-		int tailIndex = track->Tail();
-		while ( track->IsValidIndex( tailIndex ) )
+		while ( track->Count() > 0 )
 		{
-			LagRecord &tail = track->Element( tailIndex );
-
 			// if tail is within limits, stop
-			if ( tail.m_flSimulationTime >= flDeadtime )
+			if ( track->m_flSimulationTime[ track->Slot( track->Count() - 1 ) ] >= flDeadtime )
 				break;
 			
 			// remove tail, get new tail
-			track->Remove( tailIndex );
-			tailIndex = track->Tail();
+			track->RemoveTail();
 		}
 
 		// check if head has same simulation time
 		if ( track->Count() > 0 )
 		{
-			LagRecord &head = track->Element( track->Head() );
-
 			// check if player changed simulation time since last time updated
-			if ( head.m_flSimulationTime >= pPlayer->GetSimulationTime() )
+			if ( track->m_flSimulationTime[ track->Slot( 0 ) ] >= pPlayer->GetSimulationTime() )
 				continue; // don't add new entry for same or older time
 		}
 
 		// add new record to player track
-		LagRecord &record = track->Element( track->AddToHead() );
+		int slot = track->AddToHead();
+		LagAnimRecord &anim = track->m_Anim[ slot ];
 
-		record.m_fFlags = 0;
+		track->m_fFlags[ slot ] = 0;
 		if ( pPlayer->IsAlive() )
 		{
-			record.m_fFlags |= LC_ALIVE;
+			track->m_fFlags[ slot ] |= LC_ALIVE;
 		}
 
-		record.m_flSimulationTime	= pPlayer->GetSimulationTime();
-		record.m_vecAngles			= pPlayer->GetLocalAngles();
-		record.m_vecOrigin			= pPlayer->GetLocalOrigin();
-		record.m_vecMinsPreScaled	= pPlayer->CollisionProp()->OBBMinsPreScaled();
-		record.m_vecMaxsPreScaled	= pPlayer->CollisionProp()->OBBMaxsPreScaled();
+		track->m_flSimulationTime[ slot ]	= pPlayer->GetSimulationTime();
+		track->m_vecAngles[ slot ]			= pPlayer->GetLocalAngles();
+		track->m_vecOrigin[ slot ]			= pPlayer->GetLocalOrigin();
+		anim.m_vecMinsPreScaled				= pPlayer->CollisionProp()->OBBMinsPreScaled();
+		anim.m_vecMaxsPreScaled				= pPlayer->CollisionProp()->OBBMaxsPreScaled();
 
 		int layerCount = pPlayer->GetNumAnimOverlays();
 		for( int layerIndex = 0; layerIndex < layerCount; ++layerIndex )
@@ -310,14 +441,14 @@ void CLagCompensationManager::FrameUpdatePostEntityThink()
 			CAnimationLayer *currentLayer = pPlayer->GetAnimOverlay(layerIndex);
 			if( currentLayer )
 			{
-				record.m_layerRecords[layerIndex].m_cycle = currentLayer->m_flCycle;
-				record.m_layerRecords[layerIndex].m_order = currentLayer->m_nOrder;
-				record.m_layerRecords[layerIndex].m_sequence = currentLayer->m_nSequence;
-				record.m_layerRecords[layerIndex].m_weight = currentLayer->m_flWeight;
+				anim.m_layerRecords[layerIndex].m_cycle = currentLayer->m_flCycle;
+				anim.m_layerRecords[layerIndex].m_order = currentLayer->m_nOrder;
+				anim.m_layerRecords[layerIndex].m_sequence = currentLayer->m_nSequence;
+				anim.m_layerRecords[layerIndex].m_weight = currentLayer->m_flWeight;
 			}
 		}
-		record.m_masterSequence = pPlayer->GetSequence();
-		record.m_masterCycle = pPlayer->GetCycle();
+		anim.m_masterSequence = pPlayer->GetSequence();
+		anim.m_masterCycle = pPlayer->GetCycle();
 	}
 
 	//Clear the current player.
@@ -394,6 +525,17 @@ void CLagCompensationManager::StartLagCompensation( CBasePlayer *player, CUserCm
 		targettick = gpGlobals->tickcount - TIME_TO_TICKS( correct );
 	}
 	
+	float flTargetTime = TICKS_TO_TIME( targettick );
+
+	// Gather the players to move back first. The record lookups don't depend on
+	// each other, so they're done in one pass over the tracks before any player
+	// is moved. sv_unlag_fixstuck can backtrack other players from inside a
+	// backtrack, so it has to look up and apply one player at a time.
+	bool bBatched = !sv_unlag_fixstuck.GetBool();
+
+	CBasePlayer *pCandidates[ MAX_PLAYERS ];
+	int nCandidates = 0;
+
 	// Iterate all active players
 	const CBitVec<MAX_EDICTS> *pEntityTransmitBits = engine->GetEntityTransmitBitsForClient( player->entindex() - 1 );
 	for ( int i = 1; i <= gpGlobals->maxClients; i++ )
@@ -415,98 +557,123 @@ void CLagCompensationManager::StartLagCompensation( CBasePlayer *player, CUserCm
 		if ( !player->WantsLagCompensationOnEntity( pPlayer, cmd, pEntityTransmitBits ) )
 			continue;
 
-		// Move other player back in time
-		BacktrackPlayer( pPlayer, TICKS_TO_TIME( targettick ) );
-	}
-}
-
-void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTargetTime )
-{
-	Vector org;
-	Vector minsPreScaled;
-	Vector maxsPreScaled;
-	QAngle ang;
-
-	VPROF_BUDGET( "BacktrackPlayer", "CLagCompensationManager" );
-	int pl_index = pPlayer->entindex() - 1;
+		if ( !bBatched )
+		{
+			// Move other player back in time
+			BacktrackPlayer( pPlayer, flTargetTime );
+			continue;
+		}
 
-	// get track history of this player
-	CUtlFixedLinkedList< LagRecord > *track = &m_PlayerTrack[ pl_index ];
+		pCandidates[ nCandidates++ ] = pPlayer;
+	}
 
-	// check if we have at leat one entry
-	if ( track->Count() <= 0 )
+	if ( !nCandidates )
 		return;
 
-	int curr = track->Head();
-
-	LagRecord *prevRecord = NULL;
-	LagRecord *record = NULL;
-
-	Vector prevOrg = pPlayer->GetLocalOrigin();
-	
-	// Walk context looking for any invalidating event
-	while( track->IsValidIndex(curr) )
+	int iRecords[ MAX_PLAYERS ];
+	int iPrevRecords[ MAX_PLAYERS ];
+	bool bFound[ MAX_PLAYERS ];
+	for ( int i = 0; i < nCandidates; i++ )
 	{
-		// remember last record
-		prevRecord = record;
-
-		// get next record
-		record = &track->Element( curr );
+		bFound[ i ] = FindBacktrackRecords( pCandidates[ i ], flTargetTime, iRecords[ i ], iPrevRecords[ i ] );
+	}
 
-		if ( !(record->m_fFlags & LC_ALIVE) )
+	// Move other players back in time
+	for ( int i = 0; i < nCandidates; i++ )
+	{
+		if ( bFound[ i ] )
 		{
-			// player most be alive, lost track
-			return;
+			ApplyBacktrack( pCandidates[ i ], flTargetTime, iRecords[ i ], iPrevRecords[ i ] );
 		}
+	}
 
-		Vector delta = record->m_vecOrigin - prevOrg;
-		if ( delta.Length2DSqr() > m_flTeleportDistanceSqr )
+	if ( sv_unlag_setupbones.GetBool() )
+	{
+		CBaseAnimating *pMoved[ MAX_PLAYERS ];
+		int nMoved = 0;
+		for ( int i = 0; i < nCandidates; i++ )
 		{
-			// lost track, too much difference
-			return; 
+			if ( m_RestorePlayer.Get( pCandidates[ i ]->entindex() - 1 ) )
+			{
+				pMoved[ nMoved++ ] = pCandidates[ i ];
+			}
 		}
 
-		// did we find a context smaller than target time ?
-		if ( record->m_flSimulationTime <= flTargetTime )
-			break; // hurra, stop
+		CBaseAnimating::SetupBoneCaches( pMoved, nMoved );
+	}
+}
 
-		prevOrg = record->m_vecOrigin;
+//-----------------------------------------------------------------------------
+// Purpose: Finds the records bracketing flTargetTime in the player's history.
+//			iPrevRecord is the next newer record, or -1 if iRecord is the newest.
+// Output : false if we lost track of the player on the way back
+//-----------------------------------------------------------------------------
+bool CLagCompensationManager::FindBacktrackRecords( CBasePlayer *pPlayer, float flTargetTime, int &iRecord, int &iPrevRecord )
+{
+	// get track history of this player
+	CLagRecordTrack *track = GetTrack( pPlayer->entindex() - 1, false );
 
-		// go one step back
-		curr = track->Next( curr );
-	}
+	// check if we have at leat one entry
+	if ( !track )
+		return false;
 
-	Assert( record );
+	int iAge;
+	if ( !track->FindBacktrackRecord( flTargetTime, pPlayer->GetLocalOrigin(), m_flTeleportDistanceSqr, iAge ) )
+		return false;
 
-	if ( !record )
-	{
-		if ( sv_unlag_debug.GetBool() )
-		{
-			DevMsg( "No valid positions in history for BacktrackPlayer client ( %s )\n", pPlayer->GetPlayerName() );
-		}
+	iRecord = track->Slot( iAge );
+	iPrevRecord = ( iAge > 0 ) ? track->Slot( iAge - 1 ) : -1;
+	return true;
+}
+
+void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTargetTime )
+{
+	VPROF_BUDGET( "BacktrackPlayer", "CLagCompensationManager" );
 
-		return; // that should never happen
+	int iRecord, iPrevRecord;
+	if ( FindBacktrackRecords( pPlayer, flTargetTime, iRecord, iPrevRecord ) )
+	{
+		ApplyBacktrack( pPlayer, flTargetTime, iRecord, iPrevRecord );
 	}
+}
+
+void CLagCompensationManager::ApplyBacktrack( CBasePlayer *pPlayer, float flTargetTime, int iRecord, int iPrevRecord )
+{
+	Vector org;
+	Vector minsPreScaled;
+	Vector maxsPreScaled;
+	QAngle ang;
+
+	VPROF_BUDGET( "ApplyBacktrack", "CLagCompensationManager" );
+	int pl_index = pPlayer->entindex() - 1;
+
+	CLagRecordTrack *track = GetTrack( pl_index, false );
+	Assert( track );
+
+	const LagAnimRecord *record = &track->m_Anim[ iRecord ];
+	const LagAnimRecord *prevRecord = ( iPrevRecord != -1 ) ? &track->m_Anim[ iPrevRecord ] : NULL;
+	float flRecordTime = track->m_flSimulationTime[ iRecord ];
 
 	float frac = 0.0f;
 	if ( prevRecord && 
-		 (record->m_flSimulationTime < flTargetTime) &&
-		 (record->m_flSimulationTime < prevRecord->m_flSimulationTime) )
+		 (flRecordTime < flTargetTime) &&
+		 (flRecordTime < track->m_flSimulationTime[ iPrevRecord ]) )
 	{
 		// we didn't find the exact time but have a valid previous record
 		// so interpolate between these two records;
+		float flPrevRecordTime = track->m_flSimulationTime[ iPrevRecord ];
 
-		Assert( prevRecord->m_flSimulationTime > record->m_flSimulationTime );
-		Assert( flTargetTime < prevRecord->m_flSimulationTime );
+		Assert( flPrevRecordTime > flRecordTime );
+		Assert( flTargetTime < flPrevRecordTime );
 
 		// calc fraction between both records
-		frac = ( flTargetTime - record->m_flSimulationTime ) / 
-			( prevRecord->m_flSimulationTime - record->m_flSimulationTime );
+		frac = ( flTargetTime - flRecordTime ) / 
+			( flPrevRecordTime - flRecordTime );
 
 		Assert( frac > 0 && frac < 1 ); // should never extrapolate
 
-		ang				= Lerp( frac, record->m_vecAngles, prevRecord->m_vecAngles );
-		org				= Lerp( frac, record->m_vecOrigin, prevRecord->m_vecOrigin );
+		ang				= Lerp( frac, track->m_vecAngles[ iRecord ], track->m_vecAngles[ iPrevRecord ] );
+		org				= Lerp( frac, track->m_vecOrigin[ iRecord ], track->m_vecOrigin[ iPrevRecord ] );
 		minsPreScaled	= Lerp( frac, record->m_vecMinsPreScaled, prevRecord->m_vecMinsPreScaled );
 		maxsPreScaled	= Lerp( frac, record->m_vecMaxsPreScaled, prevRecord->m_vecMaxsPreScaled );
 	}
@@ -514,8 +681,8 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 	{
 		// we found the exact record or no other record to interpolate with
 		// just copy these values since they are the best we have
-		org				= record->m_vecOrigin;
-		ang				= record->m_vecAngles;
+		org				= track->m_vecOrigin[ iRecord ];
+		ang				= track->m_vecAngles[ iRecord ];
 		minsPreScaled	= record->m_vecMinsPreScaled;
 		maxsPreScaled	= record->m_vecMaxsPreScaled;
 	}
@@ -678,8 +845,8 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 			bool interpolated = false;
 			if( (frac > 0.0f)  &&  interpolationAllowed )
 			{
-				LayerRecord &recordsLayerRecord = record->m_layerRecords[layerIndex];
-				LayerRecord &prevRecordsLayerRecord = prevRecord->m_layerRecords[layerIndex];
+				const LayerRecord &recordsLayerRecord = record->m_layerRecords[layerIndex];
+				const LayerRecord &prevRecordsLayerRecord = prevRecord->m_layerRecords[layerIndex];
 				if( (recordsLayerRecord.m_order == prevRecordsLayerRecord.m_order)
 					&& (recordsLayerRecord.m_sequence == prevRecordsLayerRecord.m_sequence)
 					)
@@ -845,3 +1012,148 @@ void CLagCompensationManager::FinishLagCompensation( CBasePlayer *player )
 }
 
 
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Times backtrack record lookups in the lag record ring buffers
+//			against the linked list walk they replaced
+//-----------------------------------------------------------------------------
+static bool FindBacktrackRecordLinkedList( CUtlFixedLinkedList< LagRecord > *track, float flTargetTime, const Vector &vecCurOrigin, float flTeleportDistanceSqr, float &flFoundTime )
+{
+	LagRecord *record = NULL;
+	Vector prevOrg = vecCurOrigin;
+
+	for ( int curr = track->Head(); track->IsValidIndex( curr ); curr = track->Next( curr ) )
+	{
+		record = &track->Element( curr );
+
+		if ( !(record->m_fFlags & LC_ALIVE) )
+			return false;
+
+		Vector delta = record->m_vecOrigin - prevOrg;
+		if ( delta.Length2DSqr() > flTeleportDistanceSqr )
+			return false;
+
+		if ( record->m_flSimulationTime <= flTargetTime )
+			break;
+
+		prevOrg = record->m_vecOrigin;
+	}
+
+	if ( !record )
+		return false;
+
+	flFoundTime = record->m_flSimulationTime;
+	return true;
+}
+
+CON_COMMAND_F( sv_lagcompensation_benchmark, "Times lag compensation history lookups for 32, 64 and 100 players with a 1 second history.", FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	const float flMaxUnlag = 1.0f;
+	const float flTeleportDistanceSqr = 64.0f * 64.0f;
+	const int nRecords = (int)( flMaxUnlag / gpGlobals->interval_per_tick ) + 1;
+	const int nLookups = ( args.ArgC() > 1 ) ? max( atoi( args[1] ), 1 ) : 1000;
+	static const int s_PlayerCounts[] = { 32, 64, 100 };
+
+	Msg( "Lag compensation lookups: %d records per player, %d lookups per player\n", nRecords, nLookups );
+
+	for ( int iTest = 0; iTest < ARRAYSIZE( s_PlayerCounts ); iTest++ )
+	{
+		int nPlayers = s_PlayerCounts[ iTest ];
+
+		CLagRecordTrack *pTracks = new CLagRecordTrack[ nPlayers ];
+		CUtlFixedLinkedList< LagRecord > *pLists = new CUtlFixedLinkedList< LagRecord >[ nPlayers ];
+
+		// Players running around at about 300 units/sec
+		for ( int i = 0; i < nPlayers; i++ )
+		{
+			Vector vecOrigin( i * 128.0f, 0, 0 );
+			for ( int r = 0; r < nRecords; r++ )
+			{
+				vecOrigin.y += 5.0f;
+
+				int slot = pTracks[ i ].AddToHead();
+				pTracks[ i ].m_flSimulationTime[ slot ] = r * gpGlobals->interval_per_tick;
+				pTracks[ i ].m_vecOrigin[ slot ] = vecOrigin;
+				pTracks[ i ].m_fFlags[ slot ] = LC_ALIVE;
+
+				LagRecord &record = pLists[ i ].Element( pLists[ i ].AddToHead() );
+				record.m_flSimulationTime = r * gpGlobals->interval_per_tick;
+				record.m_vecOrigin = vecOrigin;
+				record.m_fFlags = LC_ALIVE;
+			}
+		}
+
+		float *pTargetTimes = new float[ nLookups ];
+		for ( int i = 0; i < nLookups; i++ )
+		{
+			pTargetTimes[ i ] = RandomFloat( 0.0f, flMaxUnlag );
+		}
+
+		int nMismatches = 0;
+		float flListChecksum = 0.0f;
+		float flTrackChecksum = 0.0f;
+
+		CFastTimer listTimer;
+		listTimer.Start();
+		for ( int l = 0; l < nLookups; l++ )
+		{
+			for ( int i = 0; i < nPlayers; i++ )
+			{
+				CLagRecordTrack *track = &pTracks[ i ];
+				float flFoundTime;
+				if ( FindBacktrackRecordLinkedList( &pLists[ i ], pTargetTimes[ l ], track->m_vecOrigin[ track->Slot( 0 ) ], flTeleportDistanceSqr, flFoundTime ) )
+				{
+					flListChecksum += flFoundTime;
+				}
+			}
+		}
+		listTimer.End();
+
+		CFastTimer trackTimer;
+		trackTimer.Start();
+		for ( int l = 0; l < nLookups; l++ )
+		{
+			for ( int i = 0; i < nPlayers; i++ )
+			{
+				CLagRecordTrack *track = &pTracks[ i ];
+				int iAge;
+				if ( track->FindBacktrackRecord( pTargetTimes[ l ], track->m_vecOrigin[ track->Slot( 0 ) ], flTeleportDistanceSqr, iAge ) )
+				{
+					flTrackChecksum += track->m_flSimulationTime[ track->Slot( iAge ) ];
+				}
+			}
+		}
+		trackTimer.End();
+
+		// Check the two agree on every lookup
+		for ( int i = 0; i < nPlayers; i++ )
+		{
+			for ( int l = 0; l < nLookups; l++ )
+			{
+				CLagRecordTrack *track = &pTracks[ i ];
+				const Vector &vecCurOrigin = track->m_vecOrigin[ track->Slot( 0 ) ];
+				float flFoundTime = -1.0f;
+				int iAge = -1;
+				bool bList = FindBacktrackRecordLinkedList( &pLists[ i ], pTargetTimes[ l ], vecCurOrigin, flTeleportDistanceSqr, flFoundTime );
+				bool bTrack = track->FindBacktrackRecord( pTargetTimes[ l ], vecCurOrigin, flTeleportDistanceSqr, iAge );
+				if ( bList != bTrack || ( bList && flFoundTime != track->m_flSimulationTime[ track->Slot( iAge ) ] ) )
+				{
+					++nMismatches;
+				}
+			}
+		}
+
+		float flListMS = listTimer.GetDuration().GetMillisecondsF();
+		float flTrackMS = trackTimer.GetDuration().GetMillisecondsF();
+		Msg( "  %3d players: linked list %.3f ms, ring buffer %.3f ms (%.1fx), %d mismatches\n",
+			nPlayers, flListMS, flTrackMS, ( flTrackMS > 0.0f ) ? flListMS / flTrackMS : 0.0f, nMismatches );
+
+		delete[] pTargetTimes;
+		delete[] pLists;
+		delete[] pTracks;
+	}
+}
@@ -287,13 +287,13 @@ void CPointAngleSensor::InputSetTargetEntity(inputdata_t &inputdata)
 {
 	if ((inputdata.value.String() == NULL) || (inputdata.value.StringID() == NULL_STRING) || (inputdata.value.String()[0] == '\0'))
 	{
-		m_target = NULL_STRING;
+		SetTargetEntityName( NULL_STRING );
 		m_hTargetEntity = NULL;
 		SetNextThink( TICK_NEVER_THINK );
 	}
 	else
 	{
-		m_target = AllocPooledString(inputdata.value.String());
+		SetTargetEntityName( AllocPooledString(inputdata.value.String()) );
 		m_hTargetEntity = gEntList.FindEntityByName( NULL, m_target, NULL, inputdata.pActivator, inputdata.pCaller );
 		if (!m_bDisabled && m_hTargetEntity)
 		{
@@ -469,13 +469,13 @@ void CPointProximitySensor::InputSetTargetEntity(inputdata_t &inputdata)
 {
 	if ((inputdata.value.String() == NULL) || (inputdata.value.StringID() == NULL_STRING) || (inputdata.value.String()[0] == '\0'))
 	{
-		m_target = NULL_STRING;
+		SetTargetEntityName( NULL_STRING );
 		m_hTargetEntity = NULL;
 		SetNextThink( TICK_NEVER_THINK );
 	}
 	else
 	{
-		m_target = AllocPooledString(inputdata.value.String());
+		SetTargetEntityName( AllocPooledString(inputdata.value.String()) );
 		m_hTargetEntity = gEntList.FindEntityByName( NULL, m_target, NULL, inputdata.pActivator, inputdata.pCaller );
 		if (!m_bDisabled && m_hTargetEntity)
 		{
@@ -10,6 +10,8 @@
 #include "tier0/dbg.h"
 #include "player.h"
 #include "world.h"
+#include "mempool.h"
+#include "tier0/tslist.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -82,7 +84,188 @@ void Test_RandomPlayerPosition()
 }
 
 
+//-----------------------------------------------------------------------------
+// Memory pool stress test. Every thread churns a batch of blocks on its own,
+// then hands one block per round to a shared list and frees whichever block it
+// takes off that list, so frees often land on a different thread than the
+// allocation. CMemoryPoolMT is compared against a pool behind a single lock.
+//-----------------------------------------------------------------------------
+class CLockedMemoryPool : public CUtlMemoryPool
+{
+public:
+	CLockedMemoryPool( int blockSize, int numElements ) : CUtlMemoryPool( blockSize, numElements, UTLMEMORYPOOL_GROW_FAST, "Test_MemoryPoolMT", TSLIST_NODE_ALIGNMENT ) {}
+
+	void *Alloc()				{ AUTO_LOCK( m_mutex ); return CUtlMemoryPool::Alloc(); }
+	void Free( void *pMem )		{ AUTO_LOCK( m_mutex ); CUtlMemoryPool::Free( pMem ); }
+
+private:
+	CThreadFastMutex m_mutex;
+};
+
+enum
+{
+	MEMPOOL_TEST_BLOCK_SIZE = 64,
+	MEMPOOL_TEST_BATCH = 16,
+	MEMPOOL_TEST_MAX_THREADS = 32,
+};
+
+template < class POOL >
+struct MemoryPoolTest_t
+{
+	POOL *m_pPool;
+	CTSListBase *m_pHandoff;
+	CInterlockedInt m_nReady;
+	volatile bool m_bGo;
+	int m_nRounds;
+};
+
+template < class POOL >
+static unsigned MemoryPoolTestThread( void *pParam )
+{
+	MemoryPoolTest_t< POOL > *pTest = (MemoryPoolTest_t< POOL > *)pParam;
+
+	++pTest->m_nReady;
+	while ( !pTest->m_bGo )
+	{
+		ThreadPause();
+	}
+
+	void *pBlocks[ MEMPOOL_TEST_BATCH ];
+	for ( int i = 0; i < pTest->m_nRounds; i++ )
+	{
+		for ( int j = 0; j < MEMPOOL_TEST_BATCH; j++ )
+		{
+			pBlocks[ j ] = pTest->m_pPool->Alloc();
+		}
+		for ( int j = MEMPOOL_TEST_BATCH - 1; j >= 0; j-- )
+		{
+			pTest->m_pPool->Free( pBlocks[ j ] );
+		}
+
+		pTest->m_pHandoff->Push( (TSLNodeBase_t *)pTest->m_pPool->Alloc() );
+		TSLNodeBase_t *pNode = pTest->m_pHandoff->Pop();
+		if ( pNode )
+		{
+			pTest->m_pPool->Free( pNode );
+		}
+	}
+
+	return 0;
+}
+
+// Returns the wall clock time for all threads to finish their rounds
+template < class POOL >
+static double RunMemoryPoolTest( POOL *pPool, int nThreads, int nRounds )
+{
+	MemoryPoolTest_t< POOL > test;
+	test.m_pPool = pPool;
+	test.m_pHandoff = new CTSListBase;
+	test.m_nReady = 0;
+	test.m_bGo = false;
+	test.m_nRounds = nRounds;
+
+	ThreadHandle_t hThreads[ MEMPOOL_TEST_MAX_THREADS ];
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		hThreads[ i ] = CreateSimpleThread( MemoryPoolTestThread< POOL >, &test );
+	}
+
+	while ( test.m_nReady < nThreads )
+	{
+		ThreadSleep( 0 );
+	}
+
+	double flStart = Plat_FloatTime();
+	test.m_bGo = true;
+
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		ThreadJoin( hThreads[ i ] );
+		ReleaseThreadHandle( hThreads[ i ] );
+	}
+
+	double flElapsed = Plat_FloatTime() - flStart;
+
+	while ( TSLNodeBase_t *pNode = test.m_pHandoff->Pop() )
+	{
+		pPool->Free( pNode );
+	}
+	delete test.m_pHandoff;
+
+	return flElapsed;
+}
+
+void Test_MemoryPoolMT( const CCommand &args )
+{
+	// A destroyed pool gives its per-thread cache slot back, so making more
+	// pools than there are slots, one at a time, must never run out
+	for ( int i = 0; i <= CMemoryPoolMT::MAX_THREAD_CACHED_POOLS; i++ )
+	{
+		CMemoryPoolMT pool( MEMPOOL_TEST_BLOCK_SIZE, 16, UTLMEMORYPOOL_GROW_FAST, "Test_MemoryPoolMT" );
+		if ( !pool.HasThreadCache() )
+		{
+			if ( i == 0 )
+			{
+				Warning( "Test_MemoryPoolMT: every thread cache slot is held by a live pool.\n" );
+			}
+			else
+			{
+				Warning( "Test_MemoryPoolMT: pool %d got no thread cache slot, destroyed pools aren't giving theirs back.\n", i );
+			}
+			return;
+		}
+		pool.Free( pool.Alloc() );
+		if ( pool.Count() != 0 )
+		{
+			Warning( "Test_MemoryPoolMT: pool %d counts %d blocks after freeing everything.\n", i, pool.Count() );
+		}
+	}
+
+	CMemoryPoolMT cachedPool( MEMPOOL_TEST_BLOCK_SIZE, 1024, UTLMEMORYPOOL_GROW_FAST, "Test_MemoryPoolMT" );
+
+	int nRounds = ( args.ArgC() > 1 ) ? MAX( atoi( args[ 1 ] ), 1 ) : 20000;
+
+	Msg( "%d rounds per thread, %d byte blocks\n", nRounds, MEMPOOL_TEST_BLOCK_SIZE );
+	Msg( "threads  locked Mops/s  cached Mops/s  locks  refills  returns\n" );
+
+	for ( int nThreads = 1; nThreads <= MEMPOOL_TEST_MAX_THREADS; nThreads *= 2 )
+	{
+		// Each round is one alloc and one free per batch block plus the handoff
+		double flOps = 2.0 * ( MEMPOOL_TEST_BATCH + 1 ) * nRounds * nThreads / 1000000.0;
+
+		CLockedMemoryPool lockedPool( MEMPOOL_TEST_BLOCK_SIZE, 1024 );
+		double flLocked = RunMemoryPoolTest( &lockedPool, nThreads, nRounds );
+
+		CMemoryPoolMT::Stats_t before, after;
+		cachedPool.GetStats( before );
+		double flCached = RunMemoryPoolTest( &cachedPool, nThreads, nRounds );
+		cachedPool.GetStats( after );
+
+		// Blocks left in the finished threads' caches aren't counted as held
+		if ( cachedPool.Count() != 0 )
+		{
+			Warning( "Test_MemoryPoolMT: %d blocks still allocated after %d threads.\n", cachedPool.Count(), nThreads );
+		}
+
+		// The test threads are gone, hand their cached blocks back
+		cachedPool.FlushThreadCaches();
+
+		Msg( "%7d  %13.2f  %13.2f  %5d  %7d  %7d\n", nThreads,
+			flOps / MAX( flLocked, 1e-6 ), flOps / MAX( flCached, 1e-6 ),
+			after.m_nLocks - before.m_nLocks,
+			after.m_nQueueRefills - before.m_nQueueRefills,
+			after.m_nQueueReturns - before.m_nQueueReturns );
+	}
+
+	if ( cachedPool.Count() != 0 )
+	{
+		Warning( "Test_MemoryPoolMT: %d blocks still allocated after the test.\n", cachedPool.Count() );
+	}
+}
+
+
 ConCommand cc_Test_CreateEntity( "Test_CreateEntity", Test_CreateEntity, 0, FCVAR_CHEAT );
 ConCommand cc_Test_RandomPlayerPosition( "Test_RandomPlayerPosition", Test_RandomPlayerPosition, 0, FCVAR_CHEAT );
+ConCommand cc_Test_MemoryPoolMT( "Test_MemoryPoolMT", Test_MemoryPoolMT, 0, FCVAR_CHEAT );
 
 
@@ -15,6 +15,7 @@
 #include "te_effect_dispatch.h"
 #include "tf_gamerules.h"
 #include "ammodef.h"
+#include "querycache.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -619,6 +620,67 @@ int CObjectSentrygun::Range( CBaseEntity *pTarget )
 	return RANGE_FAR;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: The players and objects on a team, in the team's order, shared by
+//			every sentry on the other teams. Only rebuilt when someone has
+//			joined or left the team. Whether they're alive, targetable or in
+//			range can change between two sentry thinks in the same tick, so
+//			that's left to FindTarget.
+//-----------------------------------------------------------------------------
+struct CSentryTargetList
+{
+	CSentryTargetList() : m_nMembershipSerial( 0 ) {}
+
+	int										m_nMembershipSerial;
+	CUtlVector< CTFPlayer* >				m_Players;
+	CUtlVector< CHandle<CBaseObject> >		m_Objects;
+};
+
+static CSentryTargetList s_SentryTargetLists[TF_TEAM_COUNT];
+
+static const CSentryTargetList &GetSentryTargetList( CTFTeam *pTeam )
+{
+	CSentryTargetList &targets = s_SentryTargetLists[ pTeam->GetTeamNumber() ];
+	if ( targets.m_nMembershipSerial != pTeam->GetMembershipSerial() )
+	{
+		targets.m_nMembershipSerial = pTeam->GetMembershipSerial();
+
+		targets.m_Players.RemoveAll();
+		for ( int i = 0; i < pTeam->GetNumPlayers(); ++i )
+		{
+			targets.m_Players.AddToTail( static_cast<CTFPlayer*>( pTeam->GetPlayer( i ) ) );
+		}
+
+		targets.m_Objects.RemoveAll();
+		for ( int i = 0; i < pTeam->GetNumObjects(); ++i )
+		{
+			targets.m_Objects.AddToTail( pTeam->GetObject( i ) );
+		}
+	}
+
+	return targets;
+}
+
+struct SentryTargetCandidate_t
+{
+	CBaseEntity	*m_pTarget;
+	Vector		m_vecCenter;
+	float		m_flDist2;
+	int			m_iIndex;
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: Closest first; among equally close targets the one later in the
+//			team's list goes first, which is the one the old linear search kept.
+//-----------------------------------------------------------------------------
+static int __cdecl SentryTargetCandidateLessFunc( const SentryTargetCandidate_t *pLeft, const SentryTargetCandidate_t *pRight )
+{
+	if ( pLeft->m_flDist2 != pRight->m_flDist2 )
+		return ( pLeft->m_flDist2 < pRight->m_flDist2 ) ? -1 : 1;
+
+	return pRight->m_iIndex - pLeft->m_iIndex;
+}
+
 //-----------------------------------------------------------------------------
 // Look for a target
 //-----------------------------------------------------------------------------
@@ -655,12 +717,18 @@ bool CObjectSentrygun::FindTarget()
 	CBaseEntity *pTargetOld = m_hEnemy.Get();
 	float flOldTargetDist2 = FLT_MAX;
 
+	// The closest valid target wins, and the last one in the team's list on a tie.
+	// Candidates are tested closest first so we can stop at the first valid one
+	// instead of tracing to everything that's closer than the best so far.
+	const CSentryTargetList &targets = GetSentryTargetList( pTeam );
+	CUtlVectorFixedGrowable< SentryTargetCandidate_t, MAX_PLAYERS > candidates;
+
 	// Sentries will try to target players first, then objects.  However, if the enemy held was an object it will continue
 	// to try and attack it first.
-	int nTeamCount = pTeam->GetNumPlayers();
+	int nTeamCount = targets.m_Players.Count();
 	for ( int iPlayer = 0; iPlayer < nTeamCount; ++iPlayer )
 	{
-		CTFPlayer *pTargetPlayer = static_cast<CTFPlayer*>( pTeam->GetPlayer( iPlayer ) );
+		CTFPlayer *pTargetPlayer = targets.m_Players[iPlayer];
 		if ( pTargetPlayer == NULL )
 			continue;
 
@@ -682,25 +750,38 @@ bool CObjectSentrygun::FindTarget()
 			flOldTargetDist2 = flDist2;
 		}
 
-		// Check to see if the target is closer than the already validated target.
+		// Out of range.
 		if ( flDist2 > flMinDist2 )
 			continue;
 
-		// It is closer, check to see if the target is valid.
-		if ( ValidTargetPlayer( pTargetPlayer, vecSentryOrigin, vecTargetCenter ) )
+		int iCandidate = candidates.AddToTail();
+		candidates[iCandidate].m_pTarget = pTargetPlayer;
+		candidates[iCandidate].m_vecCenter = vecTargetCenter;
+		candidates[iCandidate].m_flDist2 = flDist2;
+		candidates[iCandidate].m_iIndex = iPlayer;
+	}
+
+	candidates.Sort( SentryTargetCandidateLessFunc );
+	for ( int iCandidate = 0; iCandidate < candidates.Count(); ++iCandidate )
+	{
+		const SentryTargetCandidate_t &candidate = candidates[iCandidate];
+		if ( ValidTargetPlayer( static_cast<CTFPlayer*>( candidate.m_pTarget ), vecSentryOrigin, candidate.m_vecCenter ) )
 		{
-			flMinDist2 = flDist2;
-			pTargetCurrent = pTargetPlayer;
+			flMinDist2 = candidate.m_flDist2;
+			pTargetCurrent = candidate.m_pTarget;
+			break;
 		}
 	}
 
 	// If we already have a target, don't check objects.
 	if ( pTargetCurrent == NULL )
 	{
-		int nTeamObjectCount = pTeam->GetNumObjects();
+		candidates.RemoveAll();
+
+		int nTeamObjectCount = targets.m_Objects.Count();
 		for ( int iObject = 0; iObject < nTeamObjectCount; ++iObject )
 		{
-			CBaseObject *pTargetObject = pTeam->GetObject( iObject );
+			CBaseObject *pTargetObject = targets.m_Objects[iObject];
 			if ( !pTargetObject )
 				continue;
 
@@ -715,15 +796,26 @@ bool CObjectSentrygun::FindTarget()
 				flOldTargetDist2 = flDist2;
 			}
 
-			// Check to see if the target is closer than the already validated target.
+			// Out of range.
 			if ( flDist2 > flMinDist2 )
 				continue;
 
-			// It is closer, check to see if the target is valid.
-			if ( ValidTargetObject( pTargetObject, vecSentryOrigin, vecTargetCenter ) )
+			int iCandidate = candidates.AddToTail();
+			candidates[iCandidate].m_pTarget = pTargetObject;
+			candidates[iCandidate].m_vecCenter = vecTargetCenter;
+			candidates[iCandidate].m_flDist2 = flDist2;
+			candidates[iCandidate].m_iIndex = iObject;
+		}
+
+		candidates.Sort( SentryTargetCandidateLessFunc );
+		for ( int iCandidate = 0; iCandidate < candidates.Count(); ++iCandidate )
+		{
+			const SentryTargetCandidate_t &candidate = candidates[iCandidate];
+			if ( ValidTargetObject( static_cast<CBaseObject*>( candidate.m_pTarget ), vecSentryOrigin, candidate.m_vecCenter ) )
 			{
-				flMinDist2 = flDist2;
-				pTargetCurrent = pTargetObject;
+				flMinDist2 = candidate.m_flDist2;
+				pTargetCurrent = candidate.m_pTarget;
+				break;
 			}
 		}
 	}
@@ -764,8 +856,8 @@ bool CObjectSentrygun::ValidTargetPlayer( CTFPlayer *pPlayer, const Vector &vecS
 	if ( ( GetWaterLevel() == 0 && pPlayer->GetWaterLevel() >= 3 ) || ( GetWaterLevel() == 3 && pPlayer->GetWaterLevel() <= 0 ) )
 		return false;
 
-	// Ray trace!!!
-	return FVisible( pPlayer, MASK_SHOT | CONTENTS_GRATE );
+	// Ray trace!!! Shared with any other check of this pair in the same tick.
+	return IsEntityVisibleCached( this, pPlayer, MASK_SHOT | CONTENTS_GRATE );
 }
 
 //-----------------------------------------------------------------------------
@@ -785,8 +877,8 @@ bool CObjectSentrygun::ValidTargetObject( CBaseObject *pObject, const Vector &ve
 	if ( ( GetWaterLevel() == 0 && pObject->GetWaterLevel() >= 3 ) || ( GetWaterLevel() == 3 && pObject->GetWaterLevel() <= 0 ) )
 		return false;
 
-	// Ray trace.
-	return FVisible( pObject, MASK_SHOT | CONTENTS_GRATE );
+	// Ray trace. Shared with any other check of this pair in the same tick.
+	return IsEntityVisibleCached( this, pObject, MASK_SHOT | CONTENTS_GRATE );
 }
 
 //-----------------------------------------------------------------------------
@@ -264,6 +264,8 @@ void CTFTeamManager::PlayerTeamCenterPrint( CBasePlayer *pPlayer, const char *ms
 // TF Team Functions.
 //
 
+static int s_nNextMembershipSerial = 0;
+
 //-----------------------------------------------------------------------------
 // Purpose: Constructor.
 //-----------------------------------------------------------------------------
@@ -275,6 +277,26 @@ CTFTeam::CTFTeam()
 	m_TeamColor.a = 0;
 
 	m_nFlagCaptures = 0;
+
+	m_nMembershipSerial = ++s_nNextMembershipSerial;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose:
+//-----------------------------------------------------------------------------
+void CTFTeam::AddPlayer( CBasePlayer *pPlayer )
+{
+	BaseClass::AddPlayer( pPlayer );
+	m_nMembershipSerial = ++s_nNextMembershipSerial;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose:
+//-----------------------------------------------------------------------------
+void CTFTeam::RemovePlayer( CBasePlayer *pPlayer )
+{
+	BaseClass::RemovePlayer( pPlayer );
+	m_nMembershipSerial = ++s_nNextMembershipSerial;
 }
 
 //-----------------------------------------------------------------------------
@@ -326,6 +348,7 @@ void CTFTeam::AddObject( CBaseObject *pObject )
 	if ( !alreadyInList )
 	{
 		m_aObjects.AddToTail( pObject );
+		m_nMembershipSerial = ++s_nNextMembershipSerial;
 	}
 
 	NetworkStateChanged();
@@ -354,6 +377,7 @@ void CTFTeam::RemoveObject( CBaseObject *pObject )
 			pObject, pObject->GetClassname(), GetName() ) );
 
 		m_aObjects.FindAndRemove( pObject );
+		m_nMembershipSerial = ++s_nNextMembershipSerial;
 	}
 	else
 	{
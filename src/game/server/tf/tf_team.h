@@ -36,6 +36,15 @@ public:
 	// Score.
 	void			ShowScore( CBasePlayer *pPlayer );
 
+	// Players.
+	virtual void	AddPlayer( CBasePlayer *pPlayer );
+	virtual void	RemovePlayer( CBasePlayer *pPlayer );
+
+	// Changes whenever a player or object joins or leaves the team, and is
+	// never reused by another team, so lists built from the team can tell when
+	// they're stale.
+	int				GetMembershipSerial( void ) const { return m_nMembershipSerial; }
+
 	// Objects.
 	void			AddObject( CBaseObject *pObject );
 	void			RemoveObject( CBaseObject *pObject );
@@ -56,6 +65,7 @@ private:
 	
 	color32						m_TeamColor;
 	CUtlVector< CHandle<CBaseObject> >	m_aObjects;			// List of team objects.
+	int							m_nMembershipSerial;
 
 	CNetworkVar( int, m_nFlagCaptures );
 	CNetworkVar( int, m_iRole );
@@ -816,7 +816,7 @@ void CFuncTrain::Use( CBaseEntity *pActivator, CBaseEntity *pCaller, USE_TYPE us
 		// Pop back to last target if it's available
 		if ( m_hEnemy )
 		{
-			m_target = m_hEnemy->GetEntityName();
+			SetTargetEntityName( m_hEnemy->GetEntityName() );
 		}
 
 		SetNextThink( TICK_NEVER_THINK );
@@ -933,7 +933,7 @@ void CFuncTrain::Next( void )
 	// Save last target in case we need to find it again
 	m_iszLastTarget = m_target;
 
-	m_target = pTarg->m_target;
+	SetTargetEntityName( pTarg->m_target );
 	m_flWait = pTarg->GetDelay();
 
 	// If our target has a speed, take it
@@ -1028,7 +1028,7 @@ void CFuncTrain::SetupTarget( void )
 		}
 		
 		// Keep track of this since path corners change our target for us
-		m_target = pTarg->m_target;
+		SetTargetEntityName( pTarg->m_target );
 		m_hCurrentTarget = pTarg;
 	}
 }
@@ -1086,7 +1086,7 @@ void CFuncTrain::OnRestore( void )
 	if ( IsMoving() )
 	{
 		// Continue moving to the same target
-		m_target = m_iszLastTarget;
+		SetTargetEntityName( m_iszLastTarget );
 	}
 
 	SetupTarget();
@@ -1141,7 +1141,7 @@ void CFuncTrain::Stop( void )
 		// Pop back to last target if it's available
 		if ( m_hEnemy )
 		{
-			m_target = m_hEnemy->GetEntityName();
+			SetTargetEntityName( m_hEnemy->GetEntityName() );
 		}
 
 		SetNextThink( TICK_NEVER_THINK );
@@ -36,6 +36,7 @@
 #include "datacache/imdlcache.h"
 #include "util.h"
 #include "cdll_int.h"
+#include "entityspatialhash.h"
 
 #ifdef PORTAL
 #include "PortalSimulation.h"
@@ -284,7 +285,10 @@ float UTIL_GetSimulationInterval()
 //-----------------------------------------------------------------------------
 int UTIL_EntitiesInBox( const Vector &mins, const Vector &maxs, CFlaggedEntitiesEnum *pEnum )
 {
-	partition->EnumerateElementsInBox( PARTITION_ENGINE_NON_STATIC_EDICTS, mins, maxs, false, pEnum );
+	if ( !g_EntitySpatialHash.IsEnabled() || !g_EntitySpatialHash.EnumerateElementsInBox( mins, maxs, pEnum ) )
+	{
+		partition->EnumerateElementsInBox( PARTITION_ENGINE_NON_STATIC_EDICTS, mins, maxs, false, pEnum );
+	}
 	return pEnum->GetCount();
 }
 
@@ -296,10 +300,44 @@ int UTIL_EntitiesAlongRay( const Ray_t &ray, CFlaggedEntitiesEnum *pEnum )
 
 int UTIL_EntitiesInSphere( const Vector &center, float radius, CFlaggedEntitiesEnum *pEnum )
 {
-	partition->EnumerateElementsInSphere( PARTITION_ENGINE_NON_STATIC_EDICTS, center, radius, false, pEnum );
+	if ( !g_EntitySpatialHash.IsEnabled() || !g_EntitySpatialHash.EnumerateElementsInSphere( center, radius, pEnum ) )
+	{
+		partition->EnumerateElementsInSphere( PARTITION_ENGINE_NON_STATIC_EDICTS, center, radius, false, pEnum );
+	}
 	return pEnum->GetCount();
 }
 
+int UTIL_EntitiesInSpheres( CBaseEntity **pList, int listMax, int *pFirst, int *pCount, const Vector *pCenters, const float *pRadii, int nSpheres, int flagMask )
+{
+	// The grid does all the spheres in one walk
+	CUtlVector< CBaseEntity * > hits;
+	int *pHitFirst = (int *)stackalloc( nSpheres * sizeof(int) );
+	int *pHitCount = (int *)stackalloc( nSpheres * sizeof(int) );
+	bool bBatched = g_EntitySpatialHash.GetElementsInSpheres( pCenters, pRadii, nSpheres, hits, pHitFirst, pHitCount );
+
+	int nTotal = 0;
+	for ( int i = 0; i < nSpheres; i++ )
+	{
+		CFlaggedEntitiesEnum sphereEnum( pList + nTotal, listMax - nTotal, flagMask );
+		pFirst[i] = nTotal;
+		if ( bBatched )
+		{
+			for ( int j = 0; j < pHitCount[i]; j++ )
+			{
+				if ( sphereEnum.EnumElement( hits[ pHitFirst[i] + j ] ) == ITERATION_STOP )
+					break;
+			}
+			pCount[i] = sphereEnum.GetCount();
+		}
+		else
+		{
+			pCount[i] = UTIL_EntitiesInSphere( pCenters[i], pRadii[i], &sphereEnum );
+		}
+		nTotal += pCount[i];
+	}
+	return nTotal;
+}
+
 CEntitySphereQuery::CEntitySphereQuery( const Vector &center, float radius, int flagMask )
 {
 	m_listIndex = 0;
@@ -3318,5 +3356,94 @@ void CC_CollisionTest( const CCommand &args )
 static ConCommand collision_test("collision_test", CC_CollisionTest, "Tests collision system", FCVAR_CHEAT );
 
 
+//-----------------------------------------------------------------------------
+// KeyValues parse benchmark: loads every .txt and .res file in the game search
+// path with the regular parser, then in place into a CKeyValuesArena, and
+// compares the wall time.
+//-----------------------------------------------------------------------------
+static void KVBenchmark_FindFiles( const char *pszDir, CUtlVector< CUtlString > &files )
+{
+	char szWildcard[MAX_PATH];
+	Q_snprintf( szWildcard, sizeof( szWildcard ), "%s*", pszDir );
+
+	FileFindHandle_t hFind;
+	for ( const char *pszName = filesystem->FindFirstEx( szWildcard, "GAME", &hFind ); pszName; pszName = filesystem->FindNext( hFind ) )
+	{
+		if ( pszName[0] == '.' )
+			continue;
+
+		char szPath[MAX_PATH];
+		Q_snprintf( szPath, sizeof( szPath ), "%s%s", pszDir, pszName );
+
+		if ( filesystem->FindIsDirectory( hFind ) )
+		{
+			Q_strncat( szPath, "/", sizeof( szPath ), COPY_ALL_CHARACTERS );
+			KVBenchmark_FindFiles( szPath, files );
+		}
+		else
+		{
+			const char *pszExt = Q_GetFileExtension( szPath );
+			if ( pszExt && ( !Q_stricmp( pszExt, "txt" ) || !Q_stricmp( pszExt, "res" ) ) )
+			{
+				files.AddToTail( szPath );
+			}
+		}
+	}
+	filesystem->FindClose( hFind );
+}
+
+void CC_KVBenchmark( const CCommand &args )
+{
+	CUtlVector< CUtlString > files;
+	KVBenchmark_FindFiles( "", files );
+	int nFiles = files.Count();
+
+	CUtlVector< KeyValuesFileLoad_t > loads;
+	loads.SetCount( nFiles );
+	for ( int i = 0; i < nFiles; i++ )
+	{
+		loads[i].m_pKeyValues = new KeyValues( "kv_benchmark" );
+		loads[i].m_pszFilename = files[i].Get();
+		loads[i].m_pszPathID = "GAME";
+	}
+
+	// Regular parse. The first pass only warms the file cache.
+	float flLegacyTime = 0.0f;
+	for ( int nPass = 0; nPass < 2; nPass++ )
+	{
+		double flStart = Plat_FloatTime();
+		for ( int i = 0; i < nFiles; i++ )
+		{
+			loads[i].m_bLoaded = loads[i].m_pKeyValues->LoadFromFile( filesystem, loads[i].m_pszFilename, loads[i].m_pszPathID );
+		}
+		flLegacyTime = Plat_FloatTime() - flStart;
+
+		for ( int i = 0; i < nFiles; i++ )
+		{
+			loads[i].m_pKeyValues->deleteThis();
+			loads[i].m_pKeyValues = new KeyValues( "kv_benchmark" );
+		}
+	}
+
+	// In place parse
+	CKeyValuesArena arena;
+	double flStart = Plat_FloatTime();
+	KeyValues::LoadFilesInArena( &arena, filesystem, loads.Base(), nFiles );
+	float flArenaTime = Plat_FloatTime() - flStart;
+
+	int nLoaded = 0;
+	for ( int i = 0; i < nFiles; i++ )
+	{
+		nLoaded += loads[i].m_bLoaded;
+		loads[i].m_pKeyValues->deleteThis();
+	}
+
+	Msg( "%d files (%d loaded)\n", nFiles, nLoaded );
+	Msg( "  regular:  %.2f ms\n", flLegacyTime * 1000.0f );
+	Msg( "  in place: %.2f ms (%d arena blocks, %d KB)\n", flArenaTime * 1000.0f, arena.GetBlockCount(), arena.GetBytesUsed() / 1024 );
+}
+static ConCommand kv_benchmark( "kv_benchmark", CC_KVBenchmark, "Times loading every .txt and .res file with the regular and the in place KeyValues parsers", FCVAR_CHEAT );
+
+
 
 
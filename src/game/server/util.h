@@ -300,6 +300,12 @@ inline int UTIL_EntitiesInSphere( CBaseEntity **pList, int listMax, const Vector
 	return UTIL_EntitiesInSphere( center, radius, &sphereEnum );
 }
 
+// Runs several sphere queries into one array, in one walk of the entity grid
+// when it can. Sphere i's entities are pList[pFirst[i]] to
+// pList[pFirst[i] + pCount[i] - 1], in entity index order when the grid
+// answered. Returns the total.
+int			UTIL_EntitiesInSpheres( CBaseEntity **pList, int listMax, int *pFirst, int *pCount, const Vector *pCenters, const float *pRadii, int nSpheres, int flagMask );
+
 // marks the entity for deletion so it will get removed next frame
 void UTIL_Remove( IServerNetworkable *oldObj );
 void UTIL_Remove( CBaseEntity *oldObj );
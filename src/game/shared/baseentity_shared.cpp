@@ -440,7 +440,19 @@ bool CBaseEntity::KeyValue( const char *szKeyName, const char *szValue )
 	
 	if ( FStrEq( szKeyName, "targetname" ) )
 	{
-		m_iName = AllocPooledString( szValue );
+		SetName( AllocPooledString( szValue ) );
+		return true;
+	}
+
+	if ( FStrEq( szKeyName, "classname" ) )
+	{
+		SetClassname( szValue );
+		return true;
+	}
+
+	if ( FStrEq( szKeyName, "target" ) )
+	{
+		SetTargetEntityName( AllocPooledString( szValue ) );
 		return true;
 	}
 
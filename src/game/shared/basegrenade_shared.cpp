@@ -15,6 +15,7 @@
 #include "soundent.h"
 #include "entitylist.h"
 #include "gamestats.h"
+#include "parallel_think.h"
 
 #endif
 
@@ -348,6 +349,55 @@ void CBaseGrenade::DangerSoundThink( void )
 	}
 }
 
+#if !defined( CLIENT_DLL )
+//-----------------------------------------------------------------------------
+// Purpose: DangerSoundThink and Detonate for sv_parallel_think. Detonating is
+//			deferred to the main thread, with its radius damage traces made
+//			here from where Detonate() and Explode() will put the explosion.
+//-----------------------------------------------------------------------------
+bool CBaseGrenade::ThinkParallel( CParallelThinkEffects &effects )
+{
+	if ( m_pfnThink == static_cast< BASEPTR >( &CBaseGrenade::DangerSoundThink ) )
+	{
+		if (!IsInWorld())
+		{
+			effects.Remove();
+			return true;
+		}
+
+		effects.InsertSound( SOUND_DANGER, GetAbsOrigin() + GetAbsVelocity() * 0.5, GetAbsVelocity().Length( ), 0.2 );
+
+		effects.SetNextThink( gpGlobals->curtime + 0.2 );
+
+		if (GetWaterLevel() != 0)
+		{
+			effects.ScaleAbsVelocity( 0.5 );
+		}
+		return true;
+	}
+
+	if ( m_pfnThink == static_cast< BASEPTR >( &CBaseGrenade::Detonate ) )
+	{
+		trace_t		tr;
+		Vector		vecSpot = GetAbsOrigin() + Vector ( 0 , 0 , 8 );
+		UTIL_TraceLine ( vecSpot, vecSpot + Vector ( 0, 0, -32 ), MASK_SHOT_HULL, this, COLLISION_GROUP_NONE, & tr);
+
+		if( tr.startsolid )
+		{
+			UTIL_TraceLine( GetAbsOrigin(), GetAbsOrigin() + Vector( 0, 0, -32), MASK_SHOT_HULL, this, COLLISION_GROUP_NONE, &tr );
+		}
+
+		Vector vecOrigin = ( tr.fraction != 1.0 ) ? tr.endpos + (tr.plane.normal * 0.6) : GetAbsOrigin();
+
+		effects.Call( static_cast< BASEPTR >( &CBaseGrenade::Detonate ) );
+		effects.RadiusDamage( this, vecOrigin, m_DmgRadius, CLASS_NONE, NULL );
+		return true;
+	}
+
+	return BaseClass::ThinkParallel( effects );
+}
+#endif
+
 
 void CBaseGrenade::BounceTouch( CBaseEntity *pOther )
 {
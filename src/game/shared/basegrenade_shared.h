@@ -111,6 +111,8 @@ public:
 	}
 
 	void				Use( CBaseEntity *pActivator, CBaseEntity *pCaller, USE_TYPE useType, float value );
+
+	virtual bool		ThinkParallel( CParallelThinkEffects &effects );
 #endif
 
 public:
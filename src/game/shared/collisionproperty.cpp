@@ -24,6 +24,7 @@
 #include "baseanimating.h"
 #include "sendproxy.h"
 #include "hierarchy.h"
+#include "entityspatialhash.h"
 #endif
 
 #include "predictable_entity.h"
@@ -1315,6 +1316,7 @@ void CCollisionProperty::UpdateServerPartitionMask( )
 	// Remove it from whatever lists it may be in at the moment
 	// We'll re-add it below if we need to.
 	partition->Remove( handle );
+	g_EntitySpatialHash.SetInPartition( m_pOuter, false );
 
 	// Don't bother with deleted things
 	if ( !m_pOuter->edict() )
@@ -1329,6 +1331,7 @@ void CCollisionProperty::UpdateServerPartitionMask( )
 	if ( bIsSolid || m_pOuter->IsEFlagSet(EFL_USE_PARTITION_WHEN_NOT_SOLID) )
 	{
 		partition->Insert( PARTITION_ENGINE_NON_STATIC_EDICTS, handle );
+		g_EntitySpatialHash.SetInPartition( m_pOuter, true );
 	}
 
 	if ( !bIsSolid )
@@ -1364,6 +1367,9 @@ void CCollisionProperty::MarkPartitionHandleDirty()
 	{
 		m_pOuter->AddEFlags( EFL_DIRTY_SPATIAL_PARTITION );
 		s_DirtyKDTree.AddEntity( m_pOuter );
+#ifndef CLIENT_DLL
+		g_EntitySpatialHash.MarkDirty( m_pOuter );
+#endif
 	}
 
 #ifdef CLIENT_DLL
@@ -1385,6 +1391,8 @@ void CCollisionProperty::UpdatePartition( )
 #ifndef CLIENT_DLL
 		Assert( m_pOuter->entindex() != 0 );
 
+		g_EntitySpatialHash.UpdateEntity( m_pOuter );
+
 		// Don't bother with deleted things
 		if ( !m_pOuter->edict() )
 			return;
@@ -1410,10 +1418,16 @@ void CCollisionProperty::UpdatePartition( )
 				vecSurroundMins -= Vector( 1, 1, 1 );
 				vecSurroundMaxs += Vector( 1, 1, 1 );
 				partition->ElementMoved( GetPartitionHandle(), vecSurroundMins,  vecSurroundMaxs );
+#ifndef CLIENT_DLL
+				g_EntitySpatialHash.SetPartitionBounds( m_pOuter, vecSurroundMins, vecSurroundMaxs );
+#endif
 			}
 			else
 			{
 				partition->ElementMoved( GetPartitionHandle(), GetCollisionOrigin(),  GetCollisionOrigin() );
+#ifndef CLIENT_DLL
+				g_EntitySpatialHash.SetPartitionBounds( m_pOuter, GetCollisionOrigin(), GetCollisionOrigin() );
+#endif
 			}
 		}
 	}
@@ -39,6 +39,7 @@ class CBasePlayer;
 class CItem;
 class CAmmoDef;
 class CTacticalMissionManager;
+class CParallelRadiusDamage;
 
 extern ConVar sk_autoaim_mode;
 
@@ -280,6 +281,9 @@ public:
 
 	virtual bool ShouldUseRobustRadiusDamage(CBaseEntity *pEntity) { return false; }
 	virtual void  RadiusDamage( const CTakeDamageInfo &info, const Vector &vecSrc, float flRadius, int iClassIgnore, CBaseEntity *pEntityIgnore );
+	// Makes RadiusDamage()'s line of sight traces for a parallel think (see parallel_think.h).
+	// Runs on a worker thread; returns false if these rules can't.
+	virtual bool  GatherRadiusDamage( CParallelRadiusDamage &radiusDamage ) { return false; }
 	// Let the game rules specify if fall death should fade screen to black
 	virtual bool  FlPlayerFallDeathDoesScreenFade( CBasePlayer *pl ) { return TRUE; }
 
@@ -21,6 +21,8 @@
 #include "predictioncopy.h"
 #include "engine/ivmodelinfo.h"
 #include "tier1/fmtstr.h"
+#include "tier1/utlmap.h"
+#include "mathlib/ssemath.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -61,6 +63,8 @@ static const char *g_FieldTypes[ FIELD_TYPECOUNT ] =
 	"FIELD_MODELINDEX"		// FIELD_MODELINDEX
 };
 
+static ConVar pcopyplan( "pcopyplan", "1", FCVAR_CHEAT, "Use flattened copy plans for prediction copies and error checks that don't report fields." );
+
 CPredictionCopy::CPredictionCopy( int type, void *dest, bool dest_packed, void const *src, bool src_packed, 
 	bool counterrors /*= false*/, bool reporterrors /*= false*/, bool performcopy /*= true*/,
 	bool describefields /*= false*/, FN_FIELD_COMPARE func /*= NULL*/ )
@@ -74,6 +78,7 @@ CPredictionCopy::CPredictionCopy( int type, void *dest, bool dest_packed, void c
 	m_bReportErrors		= reporterrors;
 	m_bPerformCopy		= performcopy;
 	m_bDescribeFields	= describefields;
+	m_bUseCopyPlan		= pcopyplan.GetBool();
 
 	m_pCurrentField		= NULL;
 	m_pCurrentMap		= NULL;
@@ -1238,6 +1243,499 @@ void CPredictionCopy::TransferData_R( int chaincount, datamap_t *dmap )
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Copy plans
+//
+// CopyFields walks the datamap and dispatches on every field, every time. For
+// the common cases -- a straight copy, or an error check that only needs to
+// know whether anything differs -- the set of bytes it touches depends only on
+// the datamap, the copy type and which sides are packed, so it's compiled once
+// into a flat list of runs. Fields are visited in the same order with the same
+// filtering as CopyFields, then adjacent fields are merged into single runs.
+//-----------------------------------------------------------------------------
+enum
+{
+	PLAN_OP_COPY = 0,			// memcpy m_nSize bytes
+	PLAN_OP_COMPARE_FLOATS,		// compare m_nSize bytes of floats by value
+	PLAN_OP_COMPARE_BYTES,		// memcmp m_nSize bytes
+	PLAN_OP_COPY_STRING,		// copy a null-terminated string
+	PLAN_OP_COMPARE_STRING,		// strcmp a null-terminated string
+	PLAN_OP_EMBEDDED_PTR,		// the next m_nSize ops are relative to an embedded object, found through a pointer
+};
+
+struct PredictionCopyOp_t
+{
+	unsigned char	m_nOp;
+	bool			m_bDerefDest;
+	bool			m_bDerefSrc;
+	int				m_nDestOffset;
+	int				m_nSrcOffset;
+	int				m_nSize;
+};
+
+class CPredictionCopyPlan
+{
+public:
+	CPredictionCopyPlan( datamap_t *dmap, int type, int destOffsetIndex, int srcOffsetIndex, bool compare );
+
+	// false if the datamap has fields that only CopyFields knows how to handle
+	bool	IsValid( void ) const { return m_bValid; }
+
+	void	Copy( void *dest, void const *src ) const;
+	// Returns true if all the error checked fields are identical
+	bool	Compare( void const *dest, void const *src ) const;
+
+private:
+	void	Build_R( typedescription_t *pFields, int fieldCount, int destBase, int srcBase, CUtlVector< typedescription_t * > &overridden );
+	int		AddOp( int op, int destOffset, int srcOffset, int size );
+	void	FinishRuns( void );
+
+	static void	Copy_R( const PredictionCopyOp_t *pOps, int nOps, char *pDest, const char *pSrc );
+	static bool	Compare_R( const PredictionCopyOp_t *pOps, int nOps, const char *pDest, const char *pSrc );
+
+	int		m_nType;
+	int		m_nDestOffsetIndex;
+	int		m_nSrcOffsetIndex;
+	bool	m_bCompare;
+	bool	m_bValid;
+
+	// first op that FinishRuns can reorder
+	int		m_iFirstRun;
+
+	CUtlVector< PredictionCopyOp_t > m_Ops;
+};
+
+CPredictionCopyPlan::CPredictionCopyPlan( datamap_t *dmap, int type, int destOffsetIndex, int srcOffsetIndex, bool compare )
+{
+	m_nType = type;
+	m_nDestOffsetIndex = destOffsetIndex;
+	m_nSrcOffsetIndex = srcOffsetIndex;
+	m_bCompare = compare;
+	m_bValid = true;
+	m_iFirstRun = 0;
+
+	// Fields overridden further down the chain are skipped, as CopyFields does with override_count
+	CUtlVector< typedescription_t * > overridden;
+	for ( datamap_t *pMap = dmap; pMap && m_bValid; pMap = pMap->baseMap )
+	{
+		Build_R( pMap->dataDesc, pMap->dataNumFields, 0, 0, overridden );
+	}
+	FinishRuns();
+}
+
+void CPredictionCopyPlan::Build_R( typedescription_t *pFields, int fieldCount, int destBase, int srcBase, CUtlVector< typedescription_t * > &overridden )
+{
+	for ( int i = 0; i < fieldCount && m_bValid; i++ )
+	{
+		typedescription_t *pField = &pFields[ i ];
+		int flags = pField->flags;
+
+		if ( pField->override_field != NULL )
+		{
+			overridden.AddToTail( pField->override_field );
+		}
+
+		if ( overridden.HasElement( pField ) )
+			continue;
+
+		if ( pField->fieldType != FIELD_EMBEDDED )
+		{
+			if ( flags & FTYPEDESC_PRIVATE )
+				continue;
+
+			if ( m_nType == PC_NON_NETWORKED_ONLY && ( flags & FTYPEDESC_INSENDTABLE ) )
+				continue;
+
+			if ( m_nType == PC_NETWORKED_ONLY && !( flags & FTYPEDESC_INSENDTABLE ) )
+				continue;
+		}
+
+		int destOffset = destBase + pField->fieldOffset[ m_nDestOffsetIndex ];
+		int srcOffset = srcBase + pField->fieldOffset[ m_nSrcOffsetIndex ];
+		int count = pField->fieldSize;
+
+		int op;
+		int size;
+		switch ( pField->fieldType )
+		{
+		case FIELD_EMBEDDED:
+			{
+				datamap_t *td = pField->td;
+				bool bDerefSrc = ( flags & FTYPEDESC_PTR ) && ( m_nSrcOffsetIndex == PC_DATA_NORMAL );
+				bool bDerefDest = ( flags & FTYPEDESC_PTR ) && ( m_nDestOffsetIndex == PC_DATA_NORMAL );
+				if ( !bDerefSrc && !bDerefDest )
+				{
+					Build_R( td->dataDesc, td->dataNumFields, destOffset, srcOffset, overridden );
+					continue;
+				}
+
+				// Where the embedded object lives isn't known until we copy, so its
+				// fields get their own block of ops relative to it
+				FinishRuns();
+				int iOp = AddOp( PLAN_OP_EMBEDDED_PTR, destOffset, srcOffset, 0 );
+				m_Ops[ iOp ].m_bDerefDest = bDerefDest;
+				m_Ops[ iOp ].m_bDerefSrc = bDerefSrc;
+				m_iFirstRun = m_Ops.Count();
+
+				Build_R( td->dataDesc, td->dataNumFields, 0, 0, overridden );
+
+				FinishRuns();
+				m_Ops[ iOp ].m_nSize = m_Ops.Count() - iOp - 1;
+				m_iFirstRun = m_Ops.Count();
+			}
+			continue;
+
+		case FIELD_VOID:
+			continue;
+
+		case FIELD_STRING:
+			// Only copies up to the terminator, so it can't be merged with anything
+			if ( m_bCompare && ( flags & FTYPEDESC_NOERRORCHECK ) )
+				continue;
+
+			FinishRuns();
+			AddOp( m_bCompare ? PLAN_OP_COMPARE_STRING : PLAN_OP_COPY_STRING, destOffset, srcOffset, 0 );
+			m_iFirstRun = m_Ops.Count();
+			continue;
+
+		case FIELD_FLOAT:
+			op = PLAN_OP_COMPARE_FLOATS;
+			size = sizeof( float ) * count;
+			break;
+		case FIELD_VECTOR:
+			op = PLAN_OP_COMPARE_FLOATS;
+			size = sizeof( Vector ) * count;
+			break;
+		case FIELD_QUATERNION:
+			op = PLAN_OP_COMPARE_FLOATS;
+			size = sizeof( Quaternion ) * count;
+			break;
+		case FIELD_COLOR32:
+			op = PLAN_OP_COMPARE_BYTES;
+			size = 4 * count;
+			break;
+		case FIELD_BOOLEAN:
+			op = PLAN_OP_COMPARE_BYTES;
+			size = sizeof( bool ) * count;
+			break;
+		case FIELD_INTEGER:
+			op = PLAN_OP_COMPARE_BYTES;
+			size = sizeof( int ) * count;
+			break;
+		case FIELD_SHORT:
+			op = PLAN_OP_COMPARE_BYTES;
+			size = sizeof( short ) * count;
+			break;
+		case FIELD_CHARACTER:
+			op = PLAN_OP_COMPARE_BYTES;
+			size = count;
+			break;
+		case FIELD_EHANDLE:
+			// Handles compare by what they point to, but equal bytes always point to the same thing
+			op = PLAN_OP_COMPARE_BYTES;
+			size = sizeof( EHANDLE ) * count;
+			break;
+
+		default:
+			// Asserts or warnings in CopyFields, so leave it to do them
+			m_bValid = false;
+			return;
+		}
+
+		if ( !m_bCompare )
+		{
+			op = PLAN_OP_COPY;
+		}
+		else if ( flags & FTYPEDESC_NOERRORCHECK )
+		{
+			// Never differs, and so is never copied either
+			continue;
+		}
+
+		AddOp( op, destOffset, srcOffset, size );
+	}
+}
+
+int CPredictionCopyPlan::AddOp( int op, int destOffset, int srcOffset, int size )
+{
+	int i = m_Ops.AddToTail();
+	PredictionCopyOp_t &newOp = m_Ops[ i ];
+	newOp.m_nOp = op;
+	newOp.m_bDerefDest = false;
+	newOp.m_bDerefSrc = false;
+	newOp.m_nDestOffset = destOffset;
+	newOp.m_nSrcOffset = srcOffset;
+	newOp.m_nSize = size;
+	return i;
+}
+
+static int __cdecl PredictionCopyOpLessFunc( const void *pLeft, const void *pRight )
+{
+	const PredictionCopyOp_t *pLhs = (const PredictionCopyOp_t *)pLeft;
+	const PredictionCopyOp_t *pRhs = (const PredictionCopyOp_t *)pRight;
+	if ( pLhs->m_nOp != pRhs->m_nOp )
+		return pLhs->m_nOp - pRhs->m_nOp;
+
+	return pLhs->m_nDestOffset - pRhs->m_nDestOffset;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Puts the runs added since m_iFirstRun in memory order and merges the
+//			ones that touch. Copies to disjoint bytes can happen in any order, so
+//			this only leaves the declared order alone if some fields overlap.
+//-----------------------------------------------------------------------------
+void CPredictionCopyPlan::FinishRuns( void )
+{
+	int nRuns = m_Ops.Count() - m_iFirstRun;
+	if ( nRuns <= 0 )
+		return;
+
+	PredictionCopyOp_t *pRuns = m_Ops.Base() + m_iFirstRun;
+
+	CUtlVector< PredictionCopyOp_t > declared;
+	declared.CopyArray( pRuns, nRuns );
+
+	qsort( pRuns, nRuns, sizeof( PredictionCopyOp_t ), PredictionCopyOpLessFunc );
+
+	for ( int i = 1; i < nRuns; i++ )
+	{
+		if ( pRuns[ i ].m_nOp == pRuns[ i - 1 ].m_nOp &&
+			 pRuns[ i - 1 ].m_nDestOffset + pRuns[ i - 1 ].m_nSize > pRuns[ i ].m_nDestOffset )
+		{
+			memcpy( pRuns, declared.Base(), nRuns * sizeof( PredictionCopyOp_t ) );
+			break;
+		}
+	}
+
+	int nMerged = 0;
+	for ( int i = 0; i < nRuns; i++ )
+	{
+		if ( nMerged > 0 )
+		{
+			PredictionCopyOp_t &last = pRuns[ nMerged - 1 ];
+			if ( last.m_nOp == pRuns[ i ].m_nOp &&
+				 last.m_nDestOffset + last.m_nSize == pRuns[ i ].m_nDestOffset &&
+				 last.m_nSrcOffset + last.m_nSize == pRuns[ i ].m_nSrcOffset )
+			{
+				last.m_nSize += pRuns[ i ].m_nSize;
+				continue;
+			}
+		}
+
+		pRuns[ nMerged++ ] = pRuns[ i ];
+	}
+
+	m_Ops.RemoveMultipleFromTail( nRuns - nMerged );
+	m_iFirstRun = m_Ops.Count();
+}
+
+static FORCEINLINE const char *PredictionCopyEmbedded( const char *pBase, const PredictionCopyOp_t &op, bool bDest )
+{
+	const char *pEmbedded = pBase + ( bDest ? op.m_nDestOffset : op.m_nSrcOffset );
+	if ( bDest ? op.m_bDerefDest : op.m_bDerefSrc )
+	{
+		pEmbedded = *( (const char **)pEmbedded );
+	}
+	return pEmbedded;
+}
+
+void CPredictionCopyPlan::Copy_R( const PredictionCopyOp_t *pOps, int nOps, char *pDest, const char *pSrc )
+{
+	for ( int i = 0; i < nOps; i++ )
+	{
+		const PredictionCopyOp_t &op = pOps[ i ];
+		switch ( op.m_nOp )
+		{
+		case PLAN_OP_COPY:
+			memcpy( pDest + op.m_nDestOffset, pSrc + op.m_nSrcOffset, op.m_nSize );
+			break;
+
+		case PLAN_OP_COPY_STRING:
+			{
+				const char *pString = pSrc + op.m_nSrcOffset;
+				memcpy( pDest + op.m_nDestOffset, pString, Q_strlen( pString ) + 1 );
+			}
+			break;
+
+		case PLAN_OP_EMBEDDED_PTR:
+			Copy_R( pOps + i + 1, op.m_nSize, (char *)PredictionCopyEmbedded( pDest, op, true ), PredictionCopyEmbedded( pSrc, op, false ) );
+			i += op.m_nSize;
+			break;
+
+		default:
+			Assert( 0 );
+			break;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Compares floats by value, as CompareFloat and CompareVector do, so
+//			0 and -0 are the same and NaNs always differ.
+//-----------------------------------------------------------------------------
+static bool PredictionFloatsEqual( const float *pDest, const float *pSrc, int count )
+{
+	int i = 0;
+	for ( ; i + 4 <= count; i += 4 )
+	{
+		if ( !IsAllEqual( LoadUnalignedSIMD( pDest + i ), LoadUnalignedSIMD( pSrc + i ) ) )
+			return false;
+	}
+
+	for ( ; i < count; i++ )
+	{
+		if ( pDest[ i ] != pSrc[ i ] )
+			return false;
+	}
+
+	return true;
+}
+
+bool CPredictionCopyPlan::Compare_R( const PredictionCopyOp_t *pOps, int nOps, const char *pDest, const char *pSrc )
+{
+	for ( int i = 0; i < nOps; i++ )
+	{
+		const PredictionCopyOp_t &op = pOps[ i ];
+		switch ( op.m_nOp )
+		{
+		case PLAN_OP_COMPARE_FLOATS:
+			if ( !PredictionFloatsEqual( (const float *)( pDest + op.m_nDestOffset ), (const float *)( pSrc + op.m_nSrcOffset ), op.m_nSize / sizeof( float ) ) )
+				return false;
+			break;
+
+		case PLAN_OP_COMPARE_BYTES:
+			if ( memcmp( pDest + op.m_nDestOffset, pSrc + op.m_nSrcOffset, op.m_nSize ) )
+				return false;
+			break;
+
+		case PLAN_OP_COMPARE_STRING:
+			if ( Q_strcmp( pDest + op.m_nDestOffset, pSrc + op.m_nSrcOffset ) )
+				return false;
+			break;
+
+		case PLAN_OP_EMBEDDED_PTR:
+			if ( !Compare_R( pOps + i + 1, op.m_nSize, PredictionCopyEmbedded( pDest, op, true ), PredictionCopyEmbedded( pSrc, op, false ) ) )
+				return false;
+			i += op.m_nSize;
+			break;
+
+		default:
+			Assert( 0 );
+			break;
+		}
+	}
+
+	return true;
+}
+
+void CPredictionCopyPlan::Copy( void *dest, void const *src ) const
+{
+	Assert( m_bValid && !m_bCompare );
+	Copy_R( m_Ops.Base(), m_Ops.Count(), (char *)dest, (const char *)src );
+}
+
+bool CPredictionCopyPlan::Compare( void const *dest, void const *src ) const
+{
+	Assert( m_bValid && m_bCompare );
+	return Compare_R( m_Ops.Base(), m_Ops.Count(), (const char *)dest, (const char *)src );
+}
+
+//-----------------------------------------------------------------------------
+// Plans are built the first time each kind of transfer is done on a datamap
+//-----------------------------------------------------------------------------
+struct PredictionCopyPlanKey_t
+{
+	datamap_t	*m_pMap;
+	int			m_nType;
+	int			m_nDestOffsetIndex;
+	int			m_nSrcOffsetIndex;
+	bool		m_bCompare;
+};
+
+static bool PredictionCopyPlanKeyLessFunc( const PredictionCopyPlanKey_t &lhs, const PredictionCopyPlanKey_t &rhs )
+{
+	if ( lhs.m_pMap != rhs.m_pMap )
+		return lhs.m_pMap < rhs.m_pMap;
+	if ( lhs.m_nType != rhs.m_nType )
+		return lhs.m_nType < rhs.m_nType;
+	if ( lhs.m_nDestOffsetIndex != rhs.m_nDestOffsetIndex )
+		return lhs.m_nDestOffsetIndex < rhs.m_nDestOffsetIndex;
+	if ( lhs.m_nSrcOffsetIndex != rhs.m_nSrcOffsetIndex )
+		return lhs.m_nSrcOffsetIndex < rhs.m_nSrcOffsetIndex;
+	return lhs.m_bCompare < rhs.m_bCompare;
+}
+
+class CPredictionCopyPlanCache
+{
+public:
+	CPredictionCopyPlanCache() : m_Plans( 0, 0, PredictionCopyPlanKeyLessFunc )
+	{
+	}
+
+	~CPredictionCopyPlanCache()
+	{
+		m_Plans.PurgeAndDeleteElements();
+	}
+
+	const CPredictionCopyPlan *GetPlan( datamap_t *dmap, int type, int destOffsetIndex, int srcOffsetIndex, bool compare )
+	{
+		PredictionCopyPlanKey_t key;
+		key.m_pMap = dmap;
+		key.m_nType = type;
+		key.m_nDestOffsetIndex = destOffsetIndex;
+		key.m_nSrcOffsetIndex = srcOffsetIndex;
+		key.m_bCompare = compare;
+
+		unsigned short i = m_Plans.Find( key );
+		if ( i == m_Plans.InvalidIndex() )
+		{
+			i = m_Plans.Insert( key, new CPredictionCopyPlan( dmap, type, destOffsetIndex, srcOffsetIndex, compare ) );
+		}
+
+		return m_Plans[ i ]->IsValid() ? m_Plans[ i ] : NULL;
+	}
+
+private:
+	CUtlMap< PredictionCopyPlanKey_t, CPredictionCopyPlan * > m_Plans;
+};
+
+static CPredictionCopyPlanCache g_PredictionCopyPlans;
+
+//-----------------------------------------------------------------------------
+// Purpose: Does the transfer with a copy plan if nothing needs to see the
+//			individual fields. Returns false if it has to be done by CopyFields.
+//-----------------------------------------------------------------------------
+bool CPredictionCopy::TransferDataFromPlan( datamap_t *dmap )
+{
+	if ( !m_bUseCopyPlan || m_pWatchField )
+		return false;
+
+	if ( !m_bErrorCheck )
+	{
+		if ( !m_bPerformCopy )
+			return true;
+
+		const CPredictionCopyPlan *pPlan = g_PredictionCopyPlans.GetPlan( dmap, m_nType, m_nDestOffsetIndex, m_nSrcOffsetIndex, false );
+		if ( !pPlan )
+			return false;
+
+		pPlan->Copy( m_pDest, m_pSrc );
+		return true;
+	}
+
+	// Every field is described to the callback, differing or not
+	if ( m_FieldCompareFunc )
+		return false;
+
+	const CPredictionCopyPlan *pPlan = g_PredictionCopyPlans.GetPlan( dmap, m_nType, m_nDestOffsetIndex, m_nSrcOffsetIndex, true );
+	if ( !pPlan )
+		return false;
+
+	// Nothing differs, so there's nothing to report or copy. Otherwise CopyFields
+	// works out what differs, by how much and what to say about it.
+	return pPlan->Compare( m_pDest, m_pSrc );
+}
+
 static int g_nChainCount = 1;
 
 static typedescription_t *FindFieldByName_R( const char *fieldname, datamap_t *dmap )
@@ -1391,6 +1889,9 @@ int CPredictionCopy::TransferData( const char *operation, int entindex, datamap_
 	
 	DetermineWatchField( operation, entindex, dmap );
 
+	if ( TransferDataFromPlan( dmap ) )
+		return m_nErrorCount;
+
 	TransferData_R( g_nChainCount, dmap );
 
 	return m_nErrorCount;
@@ -2020,6 +2521,75 @@ CON_COMMAND_F( cl_pred_track, "<entindex> <fieldname>:  Track changes to entity
 	g_pChangeTracker->SetupTracking( ent, args[2] );
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Runs one transfer into a packed buffer both by walking the datamap
+//			and with the copy plan, and checks they leave the same bytes behind
+//			and count the same errors.
+//-----------------------------------------------------------------------------
+static bool VerifyCopyPlanTransfer( C_BaseEntity *ent, int type, const void *src, bool src_packed, const void *initial, bool errorcheck, bool copydata )
+{
+	datamap_t *dmap = ent->GetPredDescMap();
+	int size = dmap->packed_size;
+
+	CUtlVector< byte > walked;
+	CUtlVector< byte > planned;
+	walked.CopyArray( (const byte *)initial, size );
+	planned.CopyArray( (const byte *)initial, size );
+
+	CPredictionCopy walkHelper( type, walked.Base(), PC_DATA_PACKED, src, src_packed, errorcheck, false, copydata );
+	walkHelper.SetUseCopyPlan( false );
+	int walkErrors = walkHelper.TransferData( "", -1, dmap );
+
+	CPredictionCopy planHelper( type, planned.Base(), PC_DATA_PACKED, src, src_packed, errorcheck, false, copydata );
+	planHelper.SetUseCopyPlan( true );
+	int planErrors = planHelper.TransferData( "", -1, dmap );
+
+	if ( walkErrors == planErrors && !memcmp( walked.Base(), planned.Base(), size ) )
+		return true;
+
+	Msg( "cl_pred_copyplan_verify:  %s (%i) type %i %s%s differs, %i errors walked, %i planned\n",
+		dmap->dataClassName, ent->entindex(), type,
+		src_packed ? "packed" : "entity",
+		errorcheck ? ( copydata ? " check+copy" : " check" ) : " copy",
+		walkErrors, planErrors );
+	return false;
+}
+
+CON_COMMAND_F( cl_pred_copyplan_verify, "Replays each predictable's recorded frames through both the datamap walk and the copy plans, and reports where they disagree.", FCVAR_CHEAT )
+{
+	int checks = 0;
+	int failures = 0;
+
+	int c = predictables->GetPredictableCount();
+	for ( int i = 0; i < c; i++ )
+	{
+		C_BaseEntity *ent = predictables->GetPredictable( i );
+		if ( !ent || !ent->IsIntermediateDataAllocated() )
+			continue;
+
+		const void *original = ent->GetOriginalNetworkDataObject();
+
+		for ( int frame = 0; frame < MULTIPLAYER_BACKUP; frame++ )
+		{
+			const void *predicted = ent->GetPredictedFrame( frame );
+
+			for ( int type = PC_EVERYTHING; type <= PC_NETWORKED_ONLY; type++ )
+			{
+				// Restoring a frame over the networked state
+				failures += !VerifyCopyPlanTransfer( ent, type, predicted, PC_DATA_PACKED, original, false, true );
+				// Saving the entity into a frame
+				failures += !VerifyCopyPlanTransfer( ent, type, ent, PC_DATA_NORMAL, predicted, false, true );
+				// Checking a frame against the networked state for prediction errors
+				failures += !VerifyCopyPlanTransfer( ent, type, original, PC_DATA_PACKED, predicted, true, false );
+				failures += !VerifyCopyPlanTransfer( ent, type, original, PC_DATA_PACKED, predicted, true, true );
+				checks += 4;
+			}
+		}
+	}
+
+	Msg( "cl_pred_copyplan_verify:  %i transfers, %i differed\n", checks, failures );
+}
+
 #endif
 
 #if defined( CLIENT_DLL ) && defined( COPY_CHECK_STRESSTEST )
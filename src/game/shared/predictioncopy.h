@@ -82,8 +82,13 @@ public:
 
 	int		TransferData( const char *operation, int entindex, datamap_t *dmap );
 
+	// Copies and comparisons which don't need per-field reporting go through a flattened
+	// plan of each datamap instead of walking it; turn that off to compare against the walk.
+	void	SetUseCopyPlan( bool bUseCopyPlan ) { m_bUseCopyPlan = bUseCopyPlan; }
+
 private:
 	void	TransferData_R( int chaincount, datamap_t *dmap );
+	bool	TransferDataFromPlan( datamap_t *dmap );
 
 	void	DetermineWatchField( const char *operation, int entindex,  datamap_t *dmap );
 	void	DumpWatchField( typedescription_t *field );
@@ -152,6 +157,7 @@ private:
 	bool			m_bShouldDescribe;
 	int				m_nErrorCount;
 	bool			m_bPerformCopy;
+	bool			m_bUseCopyPlan;
 
 	FN_FIELD_COMPARE	m_FieldCompareFunc;
 
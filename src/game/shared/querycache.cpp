@@ -18,26 +18,29 @@
 
 
 
-#define QUERYCACHE_SIZE 1024
-
-static QueryCacheEntry_t s_QCache[QUERYCACHE_SIZE];
+ConVar	sv_disable_querycache("sv_disable_querycache", "0", FCVAR_CHEAT, "debug - disable trace query cache" );
+ConVar	sv_querycache_size( "sv_querycache_size", "1024", FCVAR_NONE, "Number of entries in the trace query cache. Takes effect on the next level.", true, 64, true, 65536 );
+ConVar	sv_querycache_move_tolerance( "sv_querycache_move_tolerance", "16", FCVAR_NONE, "Trace query cache entries are reissued early when one of their entities moves further than this. 0 disables." );
 
-#define QUERYCACHE_HASH_SIZE ( QUERYCACHE_SIZE  * 2 )
+static CUtlVector<QueryCacheEntry_t> s_QCache;
 
 // elements available for cache reuse
 static CUtlIntrusiveDList<QueryCacheEntry_t> s_VictimList;
 
 
-static CUtlIntrusiveDList<QueryCacheEntry_t> s_HashChains[QUERYCACHE_HASH_SIZE];
+static CUtlVector< CUtlIntrusiveDList<QueryCacheEntry_t> > s_HashChains;
+static unsigned int s_nHashMask = 0;
 
 
 
-static int s_nReplaceCtr = QUERYCACHE_SIZE - 1;
-static int s_nTimeStampCounter = 0 ;
+static int s_nReplaceCtr = 0;
 static int s_nNumCacheQueries = 0;
 static int s_nNumCacheMisses = 0;
+static int s_nNumMoveInvalidations = 0;
+static int s_nNumEvictions = 0;
 static int s_SuccessfulSpeculatives = 0;
-static int s_WastedSpeculativeUpdates = 0;
+static CInterlockedInt s_nNumSpeculativeUpdates;
+static CInterlockedInt s_WastedSpeculativeUpdates;
 
 void QueryCacheKey_t::ComputeHashIndex( void )
 {
@@ -45,15 +48,36 @@ void QueryCacheKey_t::ComputeHashIndex( void )
 	for( int i = 0 ; i < m_nNumValidPoints; i++ )
 	{
 		ret += ( unsigned int ) m_pEntities[i].ToInt();
-		ret += ( unsigned int ) m_nOffsetMode;
+		ret += ( unsigned int ) m_nOffsetMode[i];
 	}
 	ret += *( ( uint32 *) &m_flMinimumUpdateInterval );
 	ret += m_nTraceMask;
-	m_nHashIdx = ret % QUERYCACHE_HASH_SIZE;
+	m_nHashIdx = ret & s_nHashMask;
 }
 
 
-ConVar	sv_disable_querycache("sv_disable_querycache", "0", FCVAR_CHEAT, "debug - disable trace query cache" );
+static void AllocateQueryCache( int nEntries )
+{
+	s_QCache.Purge();
+	s_HashChains.Purge();
+
+	// twice as many chains as entries, rounded up to a power of two
+	int nChains = 1;
+	while ( nChains < nEntries * 2 )
+		nChains <<= 1;
+
+	s_QCache.SetCount( nEntries );
+	s_HashChains.SetCount( nChains );
+	s_nHashMask = nChains - 1;
+	s_nReplaceCtr = nEntries - 1;
+}
+
+static void FreeCacheEntry( QueryCacheEntry_t *pEntry )
+{
+	pEntry->m_QueryParams.m_Type = EQUERY_INVALID;
+	s_HashChains[pEntry->m_QueryParams.m_nHashIdx].RemoveNode( pEntry );
+	s_VictimList.AddToHead( pEntry );
+}
 
 static QueryCacheEntry_t *FindOrAllocateCacheEntry( QueryCacheKey_t const &entry )
 {
@@ -73,28 +97,45 @@ static QueryCacheEntry_t *FindOrAllocateCacheEntry( QueryCacheKey_t const &entry
 		if ( ! pFound )
 		{
 			// randomly replace one
-			pFound = s_QCache + s_nReplaceCtr;
+			pFound = &s_QCache[s_nReplaceCtr];
 			s_nReplaceCtr--;
 			if ( s_nReplaceCtr < 0 )
-				s_nReplaceCtr = QUERYCACHE_SIZE - 1;
+				s_nReplaceCtr = s_QCache.Count() - 1;
 			if ( pFound->m_QueryParams.m_Type != EQUERY_INVALID )
 			{
 				s_HashChains[pFound->m_QueryParams.m_nHashIdx].RemoveNode( pFound );
+				s_nNumEvictions++;
 			}
 		}
 		pFound->m_QueryParams = entry;
 		s_HashChains[pFound->m_QueryParams.m_nHashIdx].AddToHead( pFound );
 		pFound->m_bSpeculativelyDone = false;
-		pFound->IssueQuery();
+		s_nNumCacheMisses++;
+		if ( !pFound->IssueQuery() )
+		{
+			FreeCacheEntry( pFound );
+		}
 	}
 	else
 	{
-		if ( sv_disable_querycache.GetInt() || 
-			 ( gpGlobals->curtime - pFound->m_flLastUpdateTime >= 
-			   pFound->m_QueryParams.m_flMinimumUpdateInterval ) )
+		float flTolerance = sv_querycache_move_tolerance.GetFloat();
+		bool bExpired = sv_disable_querycache.GetInt() || pFound->IsExpired();
+		// a result shared within the tick has to match tracing again now
+		bool bExact = ( pFound->m_QueryParams.m_flMinimumUpdateInterval == 0.0f );
+		if ( !bExpired && ( bExact || flTolerance > 0 ) && pFound->HasMoved( bExact ? 0.0f : flTolerance * flTolerance ) )
+		{
+			bExpired = true;
+			s_nNumMoveInvalidations++;
+		}
+
+		if ( bExpired )
 		{
 			pFound->m_bSpeculativelyDone = false;
-			pFound->IssueQuery();
+			s_nNumCacheMisses++;
+			if ( !pFound->IssueQuery() )
+			{
+				FreeCacheEntry( pFound );
+			}
 		}
 		else
 		{
@@ -106,33 +147,22 @@ static QueryCacheEntry_t *FindOrAllocateCacheEntry( QueryCacheKey_t const &entry
 	return pFound;
 }
 
-static QueryCacheEntry_t *FindOrAllocateCacheEntry( EQueryType_t nType,
-													CBaseEntity *pEntity1, CBaseEntity *pEntity2,
-													EEntityOffsetMode_t nMode1, EEntityOffsetMode_t nMode2,
-													unsigned int nTraceMask )
-{
-	QueryCacheKey_t entry;
-	entry.m_Type = nType;
-	entry.m_pEntities[0] = pEntity1;
-	entry.m_pEntities[1] = pEntity2;
-	entry.m_nOffsetMode[0] = nMode1;
-	entry.m_nOffsetMode[1] = nMode2;
-	entry.m_nTraceMask = nTraceMask;
-	entry.m_nNumValidPoints = 2;
-	entry.ComputeHashIndex();
-	return FindOrAllocateCacheEntry( entry );
-}
-
 bool QueryCacheKey_t::Matches( QueryCacheKey_t const *pNode ) const
 {
 	if (
 		( pNode->m_Type != m_Type ) ||
 		( pNode->m_nTraceMask != m_nTraceMask ) ||
 		( pNode->m_pTraceFilterFunction != m_pTraceFilterFunction ) ||
+		( pNode->m_bUseFVisible != m_bUseFVisible ) ||
 		( pNode->m_nNumValidPoints != m_nNumValidPoints ) || 
 		( pNode->m_flMinimumUpdateInterval != m_flMinimumUpdateInterval )
 		)
 		return false;
+	if ( m_Type == EQUERY_TRACEHULL )
+	{
+		if ( ( pNode->m_vecHullMins != m_vecHullMins ) || ( pNode->m_vecHullMaxs != m_vecHullMaxs ) )
+			return false;
+	}
 	for( int i = 0; i < m_nNumValidPoints; i++ )
 	{
 		if (
@@ -176,20 +206,35 @@ struct QueryCacheUpdateRecord_t
 void ProcessQueryCacheUpdate( QueryCacheUpdateRecord_t &workItem )
 {
 	float flCurTime = gpGlobals->curtime;
+	float flTolerance = sv_querycache_move_tolerance.GetFloat();
 	// run through all of the cache.
 	for( int i = 0; i < workItem.m_nNumHashChainsToUpdate; i++ )
 	{
+		CUtlIntrusiveDList<QueryCacheEntry_t> &chain = s_HashChains[i + workItem.m_nStartHashChain];
 		QueryCacheEntry_t *pNext;
-		for( QueryCacheEntry_t *pEntry = s_HashChains[i + workItem.m_nStartHashChain].m_pHead ; pEntry; pEntry = pNext )
+		for( QueryCacheEntry_t *pEntry = chain.m_pHead ; pEntry; pEntry = pNext )
 		{
 			pNext = pEntry->m_pNext;
 			if ( pEntry->m_bUsedSinceUpdated )
 			{
-				if ( flCurTime - pEntry->m_flLastUpdateTime >= 
-					 pEntry->m_QueryParams.m_flMinimumUpdateInterval )
+				if ( pEntry->m_QueryParams.m_flMinimumUpdateInterval == 0.0f )
+				{
+					// only good within a tick, it'll be reissued when it's next asked for
+					pEntry->m_bUsedSinceUpdated = false;
+				}
+				else if ( ( flCurTime - pEntry->m_flLastUpdateTime >= 
+					   pEntry->m_QueryParams.m_flMinimumUpdateInterval ) ||
+					 ( flTolerance > 0 && pEntry->HasMoved( flTolerance * flTolerance ) ) )
 				{
 					// don't bother updating if we have recently
-					pEntry->IssueQuery();
+					s_nNumSpeculativeUpdates++;
+					if ( !pEntry->IssueQuery() )
+					{
+						pEntry->m_QueryParams.m_Type = EQUERY_INVALID;
+						chain.RemoveNode( pEntry );
+						workItem.m_KilledList.AddToHead( pEntry );
+						continue;
+					}
 					pEntry->m_bUsedSinceUpdated = false;
 					pEntry->m_bSpeculativelyDone = true;
 				}
@@ -203,7 +248,7 @@ void ProcessQueryCacheUpdate( QueryCacheUpdateRecord_t &workItem )
 						s_WastedSpeculativeUpdates++;
 					}
 					pEntry->m_QueryParams.m_Type = EQUERY_INVALID;
-					s_HashChains[pEntry->m_QueryParams.m_nHashIdx].RemoveNode( pEntry );
+					chain.RemoveNode( pEntry );
 					workItem.m_KilledList.AddToHead( pEntry );
 				}
 			}
@@ -212,8 +257,6 @@ void ProcessQueryCacheUpdate( QueryCacheUpdateRecord_t &workItem )
 }
 
 
-#define N_WAYS_TO_SPLIT_CACHE_UPDATE 8
-
 static void PreUpdateQueryCache()
 {
 	//mdlcache->BeginCoarseLock();			// x360 only - will need to port for this in the future
@@ -229,22 +272,33 @@ static void PostUpdateQueryCache()
 
 void UpdateQueryCache( void )
 {
-	// parallel process all hash chains
-	QueryCacheUpdateRecord_t workList[N_WAYS_TO_SPLIT_CACHE_UPDATE];
+	if ( !s_HashChains.Count() )
+		return;
+
+	// parallel process all hash chains, a couple of pieces per thread so they even out
+	int nWays = 1;
+	if ( g_pThreadPool && !sv_disable_querycache.GetBool() )
+	{
+		nWays = ( g_pThreadPool->NumThreads() + 1 ) * 2;
+	}
+	nWays = MIN( nWays, s_HashChains.Count() );
+
+	CUtlVectorFixedGrowable<QueryCacheUpdateRecord_t, 32> workList;
+	workList.SetCount( nWays );
 	int nCurEntry = 0;
-	for( int i =0 ; i < N_WAYS_TO_SPLIT_CACHE_UPDATE; i++ )
+	for( int i =0 ; i < nWays; i++ )
 	{
 		workList[i].m_nStartHashChain = nCurEntry;
-		if ( i != N_WAYS_TO_SPLIT_CACHE_UPDATE -1 )
-			workList[i].m_nNumHashChainsToUpdate = ARRAYSIZE( s_HashChains ) / N_WAYS_TO_SPLIT_CACHE_UPDATE;
+		if ( i != nWays -1 )
+			workList[i].m_nNumHashChainsToUpdate = s_HashChains.Count() / nWays;
 		else
-			workList[i].m_nNumHashChainsToUpdate = ARRAYSIZE( s_HashChains ) - nCurEntry;
-		nCurEntry += ARRAYSIZE( s_HashChains ) / N_WAYS_TO_SPLIT_CACHE_UPDATE;
+			workList[i].m_nNumHashChainsToUpdate = s_HashChains.Count() - nCurEntry;
+		nCurEntry += s_HashChains.Count() / nWays;
 	}
-	ParallelProcess( "ProcessQueryCacheUpdate", workList, N_WAYS_TO_SPLIT_CACHE_UPDATE, ProcessQueryCacheUpdate, PreUpdateQueryCache, PostUpdateQueryCache, ( sv_disable_querycache.GetBool() ) ? 0 : INT_MAX );
+	ParallelProcess( "ProcessQueryCacheUpdate", workList.Base(), nWays, ProcessQueryCacheUpdate, PreUpdateQueryCache, PostUpdateQueryCache, ( sv_disable_querycache.GetBool() ) ? 0 : INT_MAX );
 	// now, we need to take all of the obsolete cache entries each thread generated and add them to
 	// the victim cache
-	for( int i = 0 ; i < N_WAYS_TO_SPLIT_CACHE_UPDATE; i++ )
+	for( int i = 0 ; i < nWays; i++ )
 	{
 		PrependDListWithTailToDList( workList[i].m_KilledList, s_VictimList );
 	}
@@ -253,41 +307,105 @@ void UpdateQueryCache( void )
 void InvalidateQueryCache( void )
 {
 	s_VictimList.RemoveAll();
-	for( int i = 0; i < ARRAYSIZE( s_HashChains); i++ )
+	if ( s_QCache.Count() != sv_querycache_size.GetInt() )
+	{
+		AllocateQueryCache( sv_querycache_size.GetInt() );
+	}
+	for( int i = 0; i < s_HashChains.Count(); i++ )
 		s_HashChains[i].RemoveAll();
 	// now, invalidate all cache entries and add them to the victims
-	for( int i = 0; i < ARRAYSIZE( s_QCache ); i++ )
+	for( int i = 0; i < s_QCache.Count(); i++ )
 	{
 		s_QCache[i].m_QueryParams.m_Type = EQUERY_INVALID;
-		s_VictimList.AddToHead( s_QCache + i );
+		s_VictimList.AddToHead( &s_QCache[i] );
 	}
 }
 
+static QueryCacheEntry_t *LookupQuery( QueryCacheKey_t &entry )
+{
+	// Queries before the first level started
+	if ( !s_QCache.Count() )
+	{
+		InvalidateQueryCache();
+	}
 
-void QueryCacheEntry_t::IssueQuery( void )
+	entry.ComputeHashIndex();
+
+	s_nNumCacheQueries++;
+	QueryCacheEntry_t *pNode = FindOrAllocateCacheEntry( entry );
+	pNode->m_bUsedSinceUpdated = true;
+	return pNode;
+}
+
+
+bool QueryCacheEntry_t::IssueQuery( void )
 {
 	for( int i = 0 ; i < m_QueryParams.m_nNumValidPoints; i++ )
 	{
 		CBaseEntity *pEntity = m_QueryParams.m_pEntities[i];
 		if (! pEntity )
 		{
-			m_QueryParams.m_Type = EQUERY_INVALID;
-			s_HashChains[m_QueryParams.m_nHashIdx].RemoveNode( this );
-			s_VictimList.AddToHead( this );
-			return;
+			if ( m_QueryParams.m_nOffsetMode[i] == EOFFSET_MODE_NONE )
+				continue;				// an optional skip entity
+			m_bResult = false;
+			return false;
 		}
 		CalculateOffsettedPosition( pEntity, m_QueryParams.m_nOffsetMode[i],
 									&( m_QueryParams.m_Points[i] ) );
 	}
+	m_flLastUpdateTime = gpGlobals->curtime;
+	m_nLastUpdateTick = gpGlobals->tickcount;
+	if ( m_QueryParams.m_bUseFVisible )
+	{
+		m_bResult = m_QueryParams.m_pEntities[0]->FVisible( m_QueryParams.m_pEntities[1], m_QueryParams.m_nTraceMask );
+		return true;
+	}
 	CTraceFilterSimple filter( m_QueryParams.m_pEntities[2],
 							   m_QueryParams.m_nCollisionGroup,
 							   m_QueryParams.m_pTraceFilterFunction );
 	trace_t result;
-	s_nNumCacheMisses++;
-	UTIL_TraceLine( m_QueryParams.m_Points[0], m_QueryParams.m_Points[1],
-					m_QueryParams.m_nTraceMask, &filter, &result );
+	if ( m_QueryParams.m_Type == EQUERY_TRACEHULL )
+	{
+		UTIL_TraceHull( m_QueryParams.m_Points[0], m_QueryParams.m_Points[1],
+						m_QueryParams.m_vecHullMins, m_QueryParams.m_vecHullMaxs,
+						m_QueryParams.m_nTraceMask, &filter, &result );
+	}
+	else
+	{
+		UTIL_TraceLine( m_QueryParams.m_Points[0], m_QueryParams.m_Points[1],
+						m_QueryParams.m_nTraceMask, &filter, &result );
+	}
 	m_bResult = ! ( result.DidHit() );
-	m_flLastUpdateTime = gpGlobals->curtime;
+	return true;
+}
+
+
+bool QueryCacheEntry_t::IsExpired( void ) const
+{
+	if ( m_QueryParams.m_flMinimumUpdateInterval == 0.0f )
+		return m_nLastUpdateTick != gpGlobals->tickcount;
+
+	return ( gpGlobals->curtime - m_flLastUpdateTime >= m_QueryParams.m_flMinimumUpdateInterval );
+}
+
+
+bool QueryCacheEntry_t::HasMoved( float flToleranceSqr ) const
+{
+	for( int i = 0 ; i < m_QueryParams.m_nNumValidPoints; i++ )
+	{
+		if ( m_QueryParams.m_nOffsetMode[i] == EOFFSET_MODE_NONE )
+			continue;
+
+		CBaseEntity *pEntity = m_QueryParams.m_pEntities[i];
+		if ( !pEntity )
+			return true;
+
+		Vector vecPos;
+		CalculateOffsettedPosition( pEntity, m_QueryParams.m_nOffsetMode[i], &vecPos );
+		if ( vecPos.DistToSqr( m_QueryParams.m_Points[i] ) > flToleranceSqr )
+			return true;
+	}
+	return false;
 }
 
 
@@ -313,20 +431,71 @@ bool IsLineOfSightBetweenTwoEntitiesClear( CBaseEntity *pSrcEntity,
 	entry.m_nNumValidPoints = 3;
 	entry.m_nCollisionGroup = nCollisionGroup;
 	entry.m_pTraceFilterFunction = pTraceFilterCallback;
+	entry.m_bUseFVisible = false;
 	entry.m_flMinimumUpdateInterval = flMinimumUpdateInterval;
-	entry.ComputeHashIndex();
 
-	s_nNumCacheQueries++;
-	QueryCacheEntry_t *pNode = FindOrAllocateCacheEntry( entry );
-	pNode->m_bUsedSinceUpdated = true;
-	return pNode->m_bResult;
+	return LookupQuery( entry )->m_bResult;
+}
+
+
+bool IsHullBetweenTwoEntitiesClear( CBaseEntity *pSrcEntity,
+									EEntityOffsetMode_t nSrcOffsetMode,
+									CBaseEntity *pDestEntity,
+									EEntityOffsetMode_t nDestOffsetMode,
+									const Vector &vecHullMins,
+									const Vector &vecHullMaxs,
+									CBaseEntity *pSkipEntity,
+									int nCollisionGroup,
+									unsigned int nTraceMask,
+									ShouldHitFunc_t pTraceFilterCallback,
+									float flMinimumUpdateInterval )
+{
+	QueryCacheKey_t entry;
+	entry.m_Type = EQUERY_TRACEHULL;
+	entry.m_pEntities[0] = pSrcEntity;
+	entry.m_pEntities[1] = pDestEntity;
+	entry.m_pEntities[2] = pSkipEntity;
+	entry.m_nOffsetMode[0] = nSrcOffsetMode;
+	entry.m_nOffsetMode[1] = nDestOffsetMode;
+	entry.m_nOffsetMode[2] = EOFFSET_MODE_NONE;
+	entry.m_vecHullMins = vecHullMins;
+	entry.m_vecHullMaxs = vecHullMaxs;
+	entry.m_nTraceMask = nTraceMask;
+	entry.m_nNumValidPoints = 3;
+	entry.m_nCollisionGroup = nCollisionGroup;
+	entry.m_pTraceFilterFunction = pTraceFilterCallback;
+	entry.m_bUseFVisible = false;
+	entry.m_flMinimumUpdateInterval = flMinimumUpdateInterval;
+
+	return LookupQuery( entry )->m_bResult;
+}
+
+
+bool IsEntityVisibleCached( CBaseEntity *pLooker,
+							CBaseEntity *pTarget,
+							unsigned int nTraceMask )
+{
+	QueryCacheKey_t entry;
+	entry.m_Type = EQUERY_ENTITY_LOS_CHECK;
+	entry.m_pEntities[0] = pLooker;
+	entry.m_pEntities[1] = pTarget;
+	entry.m_nOffsetMode[0] = EOFFSET_MODE_EYEPOSITION;
+	entry.m_nOffsetMode[1] = EOFFSET_MODE_EYEPOSITION;
+	entry.m_nTraceMask = nTraceMask;
+	entry.m_nNumValidPoints = 2;
+	entry.m_nCollisionGroup = COLLISION_GROUP_NONE;
+	entry.m_pTraceFilterFunction = NULL;
+	entry.m_bUseFVisible = true;
+	entry.m_flMinimumUpdateInterval = 0.0f;
+
+	return LookupQuery( entry )->m_bResult;
 }
 
 
 #if defined( CLIENT_DLL )
-CON_COMMAND_F( cl_querycache_stats, "Display status of the query cache (client only)", FCVAR_CHEAT )
+CON_COMMAND_F( cl_querycache_stats, "Display status of the query cache (client only). Pass 'reset' to clear the counters.", FCVAR_CHEAT )
 #else
-CON_COMMAND( sv_querycache_stats, "Display status of the query cache (client only)" )
+CON_COMMAND( sv_querycache_stats, "Display status of the query cache. Pass 'reset' to clear the counters." )
 #endif
 {
 #ifndef CLIENT_DLL
@@ -334,9 +503,26 @@ CON_COMMAND( sv_querycache_stats, "Display status of the query cache (client onl
 		return;
 #endif
 
-	Warning( "%d queries, %d misses (%d free) suc spec = %d wasted spec=%d\n",
-			 s_nNumCacheQueries, s_nNumCacheMisses, s_VictimList.Count(),
-			 s_SuccessfulSpeculatives, s_WastedSpeculativeUpdates );
+	if ( args.ArgC() > 1 && !Q_stricmp( args[1], "reset" ) )
+	{
+		s_nNumCacheQueries = 0;
+		s_nNumCacheMisses = 0;
+		s_nNumMoveInvalidations = 0;
+		s_nNumEvictions = 0;
+		s_SuccessfulSpeculatives = 0;
+		s_nNumSpeculativeUpdates = 0;
+		s_WastedSpeculativeUpdates = 0;
+		return;
+	}
+
+	int nHits = s_nNumCacheQueries - s_nNumCacheMisses;
+	Msg( "%d entries (%d free), %d hash chains\n", s_QCache.Count(), s_VictimList.Count(), s_HashChains.Count() );
+	Msg( "%d queries: %d hits (%.1f%%), %d misses, %d of them because an entity moved\n",
+		 s_nNumCacheQueries, nHits, s_nNumCacheQueries ? 100.0f * nHits / s_nNumCacheQueries : 0.0f,
+		 s_nNumCacheMisses, s_nNumMoveInvalidations );
+	Msg( "%d speculative updates: %d used, %d wasted\n",
+		 (int)s_nNumSpeculativeUpdates, s_SuccessfulSpeculatives, (int)s_WastedSpeculativeUpdates );
+	Msg( "%d entries evicted while still live\n", s_nNumEvictions );
 }
 
 
@@ -22,12 +22,21 @@
 // b. By updating the cache entries outside of the entity think functions, the update is done in a
 // fully multi-threaded fashion
 
+// An update interval of 0 makes a result good for the tick it was traced in only. Every
+// query for it during that tick shares the one trace, and it's never updated speculatively,
+// since the entities involved may move before the next query.
+
+// c. Entries whose entities have moved more than sv_querycache_move_tolerance since they were
+// traced are reissued, however recently that was. sv_querycache_size sets the number of entries,
+// and sv_querycache_stats reports how well it's doing.
+
 
 enum EQueryType_t
 {
 	EQUERY_INVALID = 0,									// an invalid or unused entry
 	EQUERY_TRACELINE,
 	EQUERY_ENTITY_LOS_CHECK,
+	EQUERY_TRACEHULL,
 
 };
 
@@ -53,8 +62,12 @@ struct QueryCacheKey_t
 	unsigned int m_nHashIdx;
 	int m_nCollisionGroup;
 	ShouldHitFunc_t m_pTraceFilterFunction;
+	Vector m_vecHullMins;									// EQUERY_TRACEHULL only
+	Vector m_vecHullMaxs;
+	bool m_bUseFVisible;									// LOS check answered by
+															// m_pEntities[0]->FVisible( m_pEntities[1] )
 
-	float m_flMinimumUpdateInterval;
+	float m_flMinimumUpdateInterval;						// 0 = this tick only
 
 	void ComputeHashIndex( void );
 
@@ -67,11 +80,19 @@ struct QueryCacheEntry_t
 	QueryCacheEntry_t *m_pPrev;
 	QueryCacheKey_t m_QueryParams;
 	float m_flLastUpdateTime;
+	int m_nLastUpdateTick;
 	bool m_bUsedSinceUpdated;								// was this cell referenced?
 	bool m_bSpeculativelyDone;
 	bool m_bResult;											// for queries with a boolean result
 
-	void IssueQuery( void );
+	// returns false, and leaves the entry for the caller to free, if an entity is gone
+	bool IssueQuery( void );
+
+	// has an entity moved further than this from where it was when we traced?
+	bool HasMoved( float flToleranceSqr ) const;
+
+	// is the result too old to hand out now?
+	bool IsExpired( void ) const;
 
 };
 
@@ -88,6 +109,24 @@ bool IsLineOfSightBetweenTwoEntitiesClear( CBaseEntity *pSrcEntity,
 										   float flMinimumUpdateInterval = 0.2
 	);
 
+bool IsHullBetweenTwoEntitiesClear( CBaseEntity *pSrcEntity,
+									EEntityOffsetMode_t nSrcOffsetMode,
+									CBaseEntity *pDestEntity,
+									EEntityOffsetMode_t nDestOffsetMode,
+									const Vector &vecHullMins,
+									const Vector &vecHullMaxs,
+									CBaseEntity *pSkipEntity,
+									int nCollisionGroup,
+									unsigned int nTraceMask,
+									ShouldHitFunc_t pTraceFilterCallback,
+									float flMinimumUpdateInterval = 0.2
+	);
+
+// pLooker->FVisible( pTarget, nTraceMask ), traced at most once per tick for each pair
+bool IsEntityVisibleCached( CBaseEntity *pLooker,
+							CBaseEntity *pTarget,
+							unsigned int nTraceMask
+	);
 
 
 // call during main loop for threaded update of the query cache
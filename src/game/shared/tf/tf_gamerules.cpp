@@ -42,6 +42,7 @@
 	#include "AI_ResponseSystem.h"
 	#include "hl2orange.spa.h"
 	#include "hltvdirector.h"
+	#include "parallel_think.h"
 #endif
 
 // memdbgon must be the last include file in a .cpp file!!!
@@ -872,6 +873,9 @@ void CTFGameRules::RadiusDamage( const CTakeDamageInfo &info, const Vector &vecS
 		falloff = 1.0;
 
 	CBaseEntity *pInflictor = info.GetInflictor();
+
+	// Line of sight traces a parallel think made ahead of time, if any
+	CParallelRadiusDamage *pGathered = g_ParallelThink.FindRadiusDamage( info, vecSrc, flRadius, iClassIgnore, pEntityIgnore );
 	
 //	float flHalfRadiusSqr = Square( flRadius / 2.0f );
 
@@ -895,7 +899,10 @@ void CTFGameRules::RadiusDamage( const CTakeDamageInfo &info, const Vector &vecS
 
 		// Check that the explosion can 'see' this entity.
 		vecSpot = pEntity->BodyTarget( vecSrc, false );
-		UTIL_TraceLine( vecSrc, vecSpot, MASK_RADIUS_DAMAGE, info.GetInflictor(), COLLISION_GROUP_PROJECTILE, &tr );
+		if ( !pGathered || !pGathered->GetTrace( pEntity, vecSpot, &tr ) )
+		{
+			UTIL_TraceLine( vecSrc, vecSpot, MASK_RADIUS_DAMAGE, info.GetInflictor(), COLLISION_GROUP_PROJECTILE, &tr );
+		}
 
 		if ( tr.fraction != 1.0 && tr.m_pEnt != pEntity )
 			continue;
@@ -995,6 +1002,61 @@ void CTFGameRules::RadiusDamage( const CTakeDamageInfo &info, const Vector &vecS
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: The traces RadiusDamage() makes, made on a worker thread. Targets
+//			are chosen the same way, except that the inflictor is left out
+//			since it makes itself DAMAGE_NO before exploding.
+//-----------------------------------------------------------------------------
+bool CTFGameRules::GatherRadiusDamage( CParallelRadiusDamage &radiusDamage )
+{
+	const int MASK_RADIUS_DAMAGE = MASK_SHOT&(~CONTENTS_HITBOX);
+	const Vector &vecSrc = radiusDamage.GetSource();
+	float flRadius = radiusDamage.GetRadius();
+	int iClassIgnore = radiusDamage.GetClassIgnore();
+	CBaseEntity *pInflictor = radiusDamage.GetInflictor();
+	CBaseEntity *pEntityIgnore = radiusDamage.GetEntityIgnore();
+
+	CBaseEntity *pList[ MAX_SPHERE_QUERY ];
+	Vector vecSpots[ MAX_SPHERE_QUERY ];
+	int nCount = UTIL_EntitiesInSphere( pList, ARRAYSIZE( pList ), vecSrc, flRadius, 0 );
+
+	// Find where every trace goes first, so the snapshot can cover them all
+	float flReach = flRadius;
+	int nTargets = 0;
+	for ( int i = 0; i < nCount; i++ )
+	{
+		CBaseEntity *pEntity = pList[i];
+		if ( pEntity == pEntityIgnore || pEntity == pInflictor )
+			continue;
+
+		if ( pEntity->m_takedamage == DAMAGE_NO )
+			continue;
+
+		if ( iClassIgnore != CLASS_NONE && pEntity->Classify() == iClassIgnore )
+			continue;
+
+		if ( pEntity->IsEFlagSet( EFL_DIRTY_ABSTRANSFORM ) )
+			return false;
+
+		pList[nTargets] = pEntity;
+		vecSpots[nTargets] = pEntity->BodyTarget( vecSrc, false );
+		flReach = max( flReach, ( vecSpots[nTargets] - vecSrc ).Length() );
+		nTargets++;
+	}
+
+	if ( !radiusDamage.Snapshot( flReach + 1.0f ) )
+		return false;
+
+	for ( int i = 0; i < nTargets; i++ )
+	{
+		trace_t tr;
+		UTIL_TraceLine( vecSrc, vecSpots[i], MASK_RADIUS_DAMAGE, pInflictor, COLLISION_GROUP_PROJECTILE, &tr );
+		radiusDamage.AddTarget( pList[i], vecSpots[i], tr );
+	}
+
+	return true;
+}
+
 	// --------------------------------------------------------------------------------------------------- //
 	// Voice helper
 	// --------------------------------------------------------------------------------------------------- //
@@ -270,6 +270,7 @@ public:
 	virtual void ClientDisconnected( edict_t *pClient );
 
 	virtual void  RadiusDamage( const CTakeDamageInfo &info, const Vector &vecSrc, float flRadius, int iClassIgnore, CBaseEntity *pEntityIgnore );
+	virtual bool  GatherRadiusDamage( CParallelRadiusDamage &radiusDamage );
 
 	virtual float FlPlayerFallDamage( CBasePlayer *pPlayer );
 
@@ -4,6 +4,7 @@
 
 #include "cbase.h"
 #include "KeyValues.h"
+#include "filesystem.h"
 #include "tf_playerclass_shared.h"
 #include "materialsystem/imaterialsystemhardwareconfig.h"
 #include "tier2/tier2.h"
@@ -213,12 +214,44 @@ void InitPlayerClasses( void )
 	Q_strncpy( pClassData->m_szModelName, "models/player/scout.mdl", TF_NAME_LENGTH );	// Undefined players still need a model
 	Q_strncpy( pClassData->m_szLocalizableName, "undefined", TF_NAME_LENGTH );
 
-	// Initialize the classes.
+	// Load the plain text files of the classes that haven't been parsed yet in place,
+	// in parallel. Classes that only have an encrypted .ctx file fall back to the usual parse.
+	const unsigned char *pKey = g_pGameRules ? g_pGameRules->GetEncryptionKey() : NULL;
+
+	CKeyValuesArena arena;
+	KeyValuesFileLoad_t loads[TF_CLASS_COUNT_ALL];
+	int iLoadClass[TF_CLASS_COUNT_ALL];
+	char szFileNames[TF_CLASS_COUNT_ALL][MAX_PATH];
+	int nLoads = 0;
 	for ( int iClass = 1; iClass < TF_CLASS_COUNT_ALL; ++iClass )
 	{
-		TFPlayerClassData_t *pClassData = &s_aTFPlayerClassData[iClass];
+		// Have we parsed this file already?
+		if ( s_aTFPlayerClassData[iClass].m_bParsed )
+			continue;
+
+		Q_snprintf( szFileNames[nLoads], sizeof( szFileNames[nLoads] ), "%s.txt", s_aPlayerClassFiles[iClass] );
+		loads[nLoads].m_pKeyValues = new KeyValues( "PlayerClassDatafile" );
+		loads[nLoads].m_pszFilename = szFileNames[nLoads];
+		loads[nLoads].m_pszPathID = pKey ? "MOD" : "GAME";
+		iLoadClass[nLoads] = iClass;
+		nLoads++;
+	}
+	KeyValues::LoadFilesInArena( &arena, filesystem, loads, nLoads );
+
+	// Initialize the classes.
+	for ( int i = 0; i < nLoads; ++i )
+	{
+		TFPlayerClassData_t *pClassData = &s_aTFPlayerClassData[iLoadClass[i]];
 		Assert( pClassData );
-		pClassData->Parse( s_aPlayerClassFiles[iClass] );
+		if ( loads[i].m_bLoaded )
+		{
+			pClassData->ParseData( loads[i].m_pKeyValues );
+		}
+		else
+		{
+			pClassData->Parse( s_aPlayerClassFiles[iLoadClass[i]] );
+		}
+		loads[i].m_pKeyValues->deleteThis();
 	}
 }
 
@@ -65,6 +65,9 @@ struct TFPlayerClassData_t
 
 private:
 
+	// InitPlayerClasses loads the class files itself, in parallel.
+	friend void InitPlayerClasses( void );
+
 	// Parser for the class data.
 	void ParseData( KeyValues *pKeyValuesData );
 };
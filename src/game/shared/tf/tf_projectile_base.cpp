@@ -21,6 +21,7 @@
 #include "c_tf_player.h"
 #else
 #include "tf_player.h"
+#include "parallel_think.h"
 #endif
 
 IMPLEMENT_NETWORKCLASS_ALIASED( TFBaseProjectile, DT_TFBaseProjectile )
@@ -400,6 +401,24 @@ void CTFBaseProjectile::FlyThink( void )
 	SetNextThink( gpGlobals->curtime + 0.1f );
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: FlyThink for sv_parallel_think
+//-----------------------------------------------------------------------------
+bool CTFBaseProjectile::ThinkParallel( CParallelThinkEffects &effects )
+{
+	if ( m_pfnThink != static_cast< BASEPTR >( &CTFBaseProjectile::FlyThink ) )
+		return BaseClass::ThinkParallel( effects );
+
+	QAngle angles;
+
+	VectorAngles( GetAbsVelocity(), angles );
+
+	effects.SetAbsAngles( angles );
+
+	effects.SetNextThink( gpGlobals->curtime + 0.1f );
+	return true;
+}
+
 void CTFBaseProjectile::SetScorer( CBaseEntity *pScorer )
 {
 	m_Scorer = pScorer;
@@ -117,6 +117,8 @@ public:
 
 	void			SetupInitialTransmittedGrenadeVelocity( const Vector &velocity )	{ m_vInitialVelocity = velocity; }
 
+	virtual bool	ThinkParallel( CParallelThinkEffects &effects );
+
 protected:
 
 	void			FlyThink( void );
@@ -26,6 +26,7 @@
 	#include "collisionutils.h"
 	#include "tf_team.h"
 	#include "tf_obj.h"
+	#include "parallel_think.h"
 
 	ConVar	tf_debug_flamethrower("tf_debug_flamethrower", "0", FCVAR_CHEAT | FCVAR_DEVELOPMENTONLY, "Visualize the flamethrower damage." );
 	ConVar  tf_flamethrower_velocity( "tf_flamethrower_velocity", "2300.0", FCVAR_CHEAT | FCVAR_DEVELOPMENTONLY, "Initial velocity of flame damage entities." );
@@ -836,6 +837,14 @@ void CTFFlameEntity::FlameThink( void )
 		}
 	}
 
+	FlameMove();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Moves the flame on after collision detection
+//-----------------------------------------------------------------------------
+void CTFFlameEntity::FlameMove( void )
+{
 	// Calculate how long the flame has been alive for
 	float flFlameElapsedTime = tf_flamethrower_flametime.GetFloat() - ( m_flTimeRemove - gpGlobals->curtime );
 	// Calculate how much of the attacker's velocity to blend in to the flame's velocity.  The flame gets the attacker's velocity
@@ -871,6 +880,83 @@ void CTFFlameEntity::FlameThink( void )
 	m_vecPrevPos = GetAbsOrigin();
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: FlameThink() on a worker. Checks the flame's swept box against the
+//			enemy bounding boxes; if none is touched the flame just moves on,
+//			otherwise FlameThink() runs serially to test hitboxes and burn.
+//-----------------------------------------------------------------------------
+bool CTFFlameEntity::ThinkParallel( CParallelThinkEffects &effects )
+{
+	if ( m_pfnThink != static_cast< BASEPTR >( &CTFFlameEntity::FlameThink ) )
+		return false;
+
+	if ( gpGlobals->curtime >= m_flTimeRemove )
+	{
+		effects.Remove();
+		return true;
+	}
+
+	if ( GetAbsOrigin() != m_vecPrevPos )
+	{
+		CTFPlayer *pAttacker = dynamic_cast<CTFPlayer *>( (CBaseEntity *) m_hAttacker );
+		if ( !pAttacker )
+			return true;
+
+		CTFTeam *pTeam = pAttacker->GetOpposingTFTeam();
+		if ( !pTeam )
+			return true;
+
+		for ( int iPlayer = 0; iPlayer < pTeam->GetNumPlayers(); iPlayer++ )
+		{
+			CBasePlayer *pPlayer = pTeam->GetPlayer( iPlayer );
+			if ( !pPlayer )
+				continue;
+
+			// Dead players are skipped, but a respawn moves them and invalidates the results
+			if ( !pPlayer->IsConnected() || !pPlayer->IsAlive() )
+			{
+				if ( !effects.DependsOn( pPlayer ) )
+					return false;
+				continue;
+			}
+
+			if ( !IsClearOf( pPlayer, effects ) )
+				return false;
+		}
+
+		for ( int iObject = 0; iObject < pTeam->GetNumObjects(); iObject++ )
+		{
+			CBaseObject *pObject = pTeam->GetObject( iObject );
+			if ( pObject && !IsClearOf( pObject, effects ) )
+				return false;
+		}
+	}
+
+	effects.Call( static_cast< BASEPTR >( &CTFFlameEntity::FlameMove ) );
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: The bounding box test of CheckCollision(). Returns false if the flame
+//			may hit pOther, or pOther's bounds can't be read on this thread.
+//-----------------------------------------------------------------------------
+bool CTFFlameEntity::IsClearOf( CBaseEntity *pOther, CParallelThinkEffects &effects )
+{
+	if ( m_hEntitiesBurnt.Find( pOther ) != m_hEntitiesBurnt.InvalidIndex() )
+		return true;
+
+	if ( !effects.DependsOn( pOther ) )
+		return false;
+
+	Vector vecMins, vecMaxs;
+	pOther->CollisionProp()->WorldSpaceSurroundingBounds( &vecMins, &vecMaxs );
+	CBaseTrace trace;
+	Ray_t ray;
+	float flFractionLeftSolid;
+	ray.Init( m_vecPrevPos, GetAbsOrigin(), WorldAlignMins(), WorldAlignMaxs() );
+	return !IntersectRayWithBox( ray, vecMins, vecMaxs, 0.0, &trace, &flFractionLeftSolid );
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Checks collisions against other entities
 //-----------------------------------------------------------------------------
@@ -140,8 +140,13 @@ public:
 
 	void FlameThink( void );
 	void CheckCollision( CBaseEntity *pOther, bool *pbHitWorld );
+
+	// Runs the collision broad phase on a worker; a possible hit runs FlameThink serially
+	virtual bool ThinkParallel( CParallelThinkEffects &effects );
 private:
 	void OnCollide( CBaseEntity *pOther );
+	void FlameMove( void );
+	bool IsClearOf( CBaseEntity *pOther, CParallelThinkEffects &effects );
 
 	Vector					m_vecInitialPos;		// position the flame was fired from
 	Vector					m_vecPrevPos;			// position from previous frame
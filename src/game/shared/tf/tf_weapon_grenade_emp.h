@@ -72,6 +72,7 @@ public:
 	virtual void	BounceSound( void );
 	virtual void	Detonate();
 	void			DetonateThink( void );
+	virtual bool	ThinkParallel( CParallelThinkEffects &effects ) { return false; }	// DetonateThink has extra work
 
 	DECLARE_DATADESC();
 
@@ -104,6 +104,7 @@ public:
 	virtual void	BounceSound( void );
 	virtual void	Detonate();
 	virtual void	DetonateThink( void );
+	virtual bool	ThinkParallel( CParallelThinkEffects &effects ) { return false; }	// DetonateThink has extra work
 
 	void Think_Emit( void );
 	void Think_Fade( void );
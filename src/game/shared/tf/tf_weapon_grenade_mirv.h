@@ -84,6 +84,7 @@ public:
 	virtual void	Detonate();
 	virtual void	Explode( trace_t *pTrace, int bitsDamageType );
 	void			DetonateThink( void );
+	virtual bool	ThinkParallel( CParallelThinkEffects &effects ) { return false; }	// DetonateThink has extra work
 
 	DECLARE_DATADESC();
 
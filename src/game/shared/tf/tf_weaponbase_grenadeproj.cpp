@@ -19,6 +19,7 @@
 #include "func_nogrenades.h"
 #include "Sprite.h"
 #include "tf_fx.h"
+#include "parallel_think.h"
 #endif
 
 // memdbgon must be the last include file in a .cpp file!!!
@@ -362,6 +363,59 @@ void CTFWeaponBaseGrenadeProj::DetonateThink( void )
 	SetNextThink( gpGlobals->curtime + 0.2 );
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: DetonateThink and Detonate for sv_parallel_think. The fuse check
+//			runs on a worker; the detonation itself is deferred to the main
+//			thread.
+//-----------------------------------------------------------------------------
+bool CTFWeaponBaseGrenadeProj::ThinkParallel( CParallelThinkEffects &effects )
+{
+	if ( m_pfnThink == static_cast< BASEPTR >( &CTFWeaponBaseGrenadeProj::Detonate ) )
+	{
+		DetonateParallel( effects );
+		return true;
+	}
+
+	if ( m_pfnThink != static_cast< BASEPTR >( &CTFWeaponBaseGrenadeProj::DetonateThink ) )
+		return BaseClass::ThinkParallel( effects );
+
+	if ( !IsInWorld() )
+	{
+		effects.Remove();
+		return true;
+	}
+
+	if ( gpGlobals->curtime > m_flCollideWithTeammatesTime && m_bCollideWithTeammates == false )
+	{
+		effects.Call( static_cast< BASEPTR >( &CTFWeaponBaseGrenadeProj::StartCollidingWithTeammates ) );
+	}
+
+	if ( gpGlobals->curtime > m_flDetonateTime )
+	{
+		DetonateParallel( effects );
+		return true;
+	}
+
+	effects.SetNextThink( gpGlobals->curtime + 0.2 );
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Defers Detonate(), making its radius damage traces here from where
+//			Detonate() and Explode() will put the explosion
+//-----------------------------------------------------------------------------
+void CTFWeaponBaseGrenadeProj::DetonateParallel( CParallelThinkEffects &effects )
+{
+	trace_t		tr;
+	Vector		vecSpot = GetAbsOrigin() + Vector ( 0 , 0 , 8 );
+	UTIL_TraceLine ( vecSpot, vecSpot + Vector ( 0, 0, -32 ), MASK_SHOT_HULL, this, COLLISION_GROUP_NONE, & tr);
+
+	Vector vecOrigin = ( tr.fraction != 1.0 ) ? tr.endpos + ( tr.plane.normal * 1.0f ) : GetAbsOrigin();
+
+	effects.Call( static_cast< BASEPTR >( &CTFWeaponBaseGrenadeProj::Detonate ) );
+	effects.RadiusDamage( this, vecOrigin, GetDamageRadius(), CLASS_NONE, NULL );
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: 
 //-----------------------------------------------------------------------------
@@ -76,8 +76,12 @@ public:
 
 	int						OnTakeDamage( const CTakeDamageInfo &info );
 
+	// Subclasses that override DetonateThink must also override ThinkParallel,
+	// since their think pointer compares equal to ours
 	virtual void			DetonateThink( void );
 	void					Detonate( void );
+	virtual bool			ThinkParallel( CParallelThinkEffects &effects );
+	void					DetonateParallel( CParallelThinkEffects &effects );
 
 	void					SetupInitialTransmittedGrenadeVelocity( const Vector &velocity )	{ m_vInitialVelocity = velocity; }
 
@@ -117,6 +121,8 @@ private:
 	float					m_flCollideWithTeammatesTime;
 	bool					m_bCollideWithTeammates;
 
+	void					StartCollidingWithTeammates( void ) { m_bCollideWithTeammates = true; }
+
 #endif
 };
 
@@ -12,6 +12,7 @@
 #include "te_effect_dispatch.h"
 #include "tf_fx.h"
 #include "iscorer.h"
+#include "parallel_think.h"
 extern void SendProxy_Origin( const SendProp *pProp, const void *pStruct, const void *pData, DVariant *pOut, int iElement, int objectID );
 extern void SendProxy_Angles( const SendProp *pProp, const void *pStruct, const void *pData, DVariant *pOut, int iElement, int objectID );
 #endif
@@ -392,4 +393,21 @@ void CTFBaseRocket::FlyThink( void )
 	SetNextThink( gpGlobals->curtime + 0.1 );
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: FlyThink for sv_parallel_think
+//-----------------------------------------------------------------------------
+bool CTFBaseRocket::ThinkParallel( CParallelThinkEffects &effects )
+{
+	if ( m_pfnThink != static_cast< BASEPTR >( &CTFBaseRocket::FlyThink ) )
+		return BaseClass::ThinkParallel( effects );
+
+	if ( gpGlobals->curtime > m_flCollideWithTeammatesTime && m_bCollideWithTeammates == false )
+	{
+		effects.Call( static_cast< BASEPTR >( &CTFBaseRocket::StartCollidingWithTeammates ) );
+	}
+
+	effects.SetNextThink( gpGlobals->curtime + 0.1 );
+	return true;
+}
+
 #endif
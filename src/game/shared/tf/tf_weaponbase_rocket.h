@@ -99,9 +99,12 @@ public:
 
 	void			SetHomingTarget( CBaseEntity *pHomingTarget );
 
+	virtual bool	ThinkParallel( CParallelThinkEffects &effects );
+
 protected:
 
 	void			FlyThink( void );
+	void			StartCollidingWithTeammates( void ) { m_bCollideWithTeammates = true; }
 
 protected:
 
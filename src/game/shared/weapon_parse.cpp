@@ -9,6 +9,7 @@
 #include <tier0/mem.h>
 #include "filesystem.h"
 #include "utldict.h"
+#include "utlstring.h"
 #include "ammodef.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
@@ -168,26 +169,83 @@ void PrecacheFileWeaponInfoDatabase( IFileSystem *filesystem, const unsigned cha
 	KeyValues *manifest = new KeyValues( "weaponscripts" );
 	if ( manifest->LoadFromFile( filesystem, "scripts/weapon_manifest.txt", "GAME" ) )
 	{
+		CUtlVector< CUtlString > fileBases;
 		for ( KeyValues *sub = manifest->GetFirstSubKey(); sub != NULL ; sub = sub->GetNextKey() )
 		{
 			if ( !Q_stricmp( sub->GetName(), "file" ) )
 			{
 				char fileBase[512];
 				Q_FileBase( sub->GetString(), fileBase, sizeof(fileBase) );
-				WEAPON_FILE_INFO_HANDLE tmp;
-#ifdef CLIENT_DLL
-				if ( ReadWeaponDataFromFileForSlot( filesystem, fileBase, &tmp, pICEKey ) )
+				fileBases.AddToTail( fileBase );
+			}
+			else
+			{
+				Error( "Expecting 'file', got %s\n", sub->GetName() );
+			}
+		}
+
+		// Load the plain text scripts that haven't been parsed yet in place, in parallel.
+		// Anything else (already parsed, or only there as an encrypted .ctx script) goes
+		// through ReadWeaponDataFromFileForSlot.
+		CKeyValuesArena arena;
+		CUtlVector< KeyValuesFileLoad_t > loads;
+		CUtlVector< CUtlString > fileNames;
+		CUtlVector< int > loadIndex;
+		loadIndex.SetCount( fileBases.Count() );
+		for ( int i = 0; i < fileBases.Count(); i++ )
+		{
+			loadIndex[i] = -1;
+
+#if !defined( DOD_DLL )	// only reads .ctx files
+			WEAPON_FILE_INFO_HANDLE hExisting = LookupWeaponInfoSlot( fileBases[i].Get() );
+			if ( hExisting != GetInvalidWeaponInfoHandle() && GetFileWeaponInfoFromHandle( hExisting )->bParsedScript )
+				continue;
+
+			loadIndex[i] = loads.AddToTail();
+			fileNames[ fileNames.AddToTail() ].Format( "scripts/%s.txt", fileBases[i].Get() );
+#endif
+		}
+
+		for ( int i = 0; i < loads.Count(); i++ )
+		{
+			loads[i].m_pKeyValues = new KeyValues( "WeaponDatafile" );
+			loads[i].m_pszFilename = fileNames[i].Get();
+			loads[i].m_pszPathID = pICEKey ? "MOD" : "GAME";
+		}
+
+		KeyValues::LoadFilesInArena( &arena, filesystem, loads.Base(), loads.Count() );
+
+		for ( int i = 0; i < fileBases.Count(); i++ )
+		{
+			const char *fileBase = fileBases[i].Get();
+			WEAPON_FILE_INFO_HANDLE tmp;
+			bool bLoaded;
+			if ( loadIndex[i] != -1 && loads[ loadIndex[i] ].m_bLoaded )
+			{
+				tmp = FindWeaponInfoSlot( fileBase );
+				FileWeaponInfo_t *pFileInfo = GetFileWeaponInfoFromHandle( tmp );
+				if ( !pFileInfo->bParsedScript )
 				{
-					gWR.LoadWeaponSprites( tmp );
+					pFileInfo->Parse( loads[ loadIndex[i] ].m_pKeyValues, fileBase );
 				}
-#else
-				ReadWeaponDataFromFileForSlot( filesystem, fileBase, &tmp, pICEKey );
-#endif
+				bLoaded = true;
 			}
 			else
 			{
-				Error( "Expecting 'file', got %s\n", sub->GetName() );
+				bLoaded = ReadWeaponDataFromFileForSlot( filesystem, fileBase, &tmp, pICEKey );
 			}
+
+#ifdef CLIENT_DLL
+			if ( bLoaded )
+			{
+				gWR.LoadWeaponSprites( tmp );
+			}
+#endif
+		}
+
+		for ( int i = 0; i < loads.Count(); i++ )
+		{
+			loads[i].m_pKeyValues->deleteThis();
 		}
 	}
 	manifest->deleteThis();
@@ -1372,6 +1372,138 @@ void WorldSpaceSlerp(
 
 
 
+#ifndef _X360
+//-----------------------------------------------------------------------------
+// Purpose: SIMD core of SlerpBones and BlendBones. Blends q1 of the four
+//			bones in pBones with q2, a lane per bone, where fl4S2 holds each
+//			bone's weight for q2. Positions are left to the caller.
+//-----------------------------------------------------------------------------
+template< class QUATERNION >
+static FORCEINLINE void BlendFourBoneQuaternions( 
+	const CStudioHdr *pStudioHdr,
+	const int pBones[4],
+	Quaternion q1[MAXSTUDIOBONES], 
+	const QUATERNION q2[MAXSTUDIOBONES], 
+	const fltx4 &fl4S2,
+	bool bSlerp )
+{
+	FourQuaternions q1simd, q2simd;
+	q1simd.LoadAndSwizzle( q1[pBones[0]], q1[pBones[1]], q1[pBones[2]], q1[pBones[3]] );
+	q2simd.LoadAndSwizzle( q2[pBones[0]], q2[pBones[1]], q2[pBones[2]], q2[pBones[3]] );
+
+	// bones with BONE_FIXED_ALIGNMENT use the NoAlign versions
+	ALIGN16 uint32 nAlign[4] ALIGN16_POST;
+	for ( int n = 0; n < 4; n++ )
+	{
+		nAlign[n] = ( pStudioHdr->boneFlags( pBones[n] ) & BONE_FIXED_ALIGNMENT ) ? 0 : 0xFFFFFFFF;
+	}
+	fltx4 fl4Align = LoadAlignedSIMD( nAlign );
+
+	fltx4 fl4S1 = SubSIMD( Four_Ones, fl4S2 );
+	FourQuaternions result = bSlerp ? q2simd.Slerp( q1simd, fl4S1, fl4Align ) : q2simd.Blend( q1simd, fl4S1, fl4Align );
+	result.SwizzleAndStore( q1[pBones[0]], q1[pBones[1]], q1[pBones[2]], q1[pBones[3]] );
+}
+#endif
+
+
+static void RandomUnitQuaternion( IUniformRandomStream &random, Quaternion &q )
+{
+	do
+	{
+		q.Init( random.RandomFloat( -1.0f, 1.0f ), random.RandomFloat( -1.0f, 1.0f ), random.RandomFloat( -1.0f, 1.0f ), random.RandomFloat( -1.0f, 1.0f ) );
+	} while ( QuaternionNormalize( q ) < 0.01f );
+}
+
+static float QuaternionMaxDiff( const Quaternion &p, const Quaternion &q )
+{
+	float flDiff = 0.0f;
+	for ( int i = 0; i < 4; i++ )
+	{
+		flDiff = MAX( flDiff, fabs( p[i] - q[i] ) );
+	}
+	return flDiff;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Checks the FourQuaternions slerp and blend that SlerpBones and
+//			BlendBones use against QuaternionSlerp(NoAlign) and
+//			QuaternionBlend(NoAlign), on random unit quaternions with a random
+//			mix of aligned and BONE_FIXED_ALIGNMENT lanes. Some pairs are
+//			identical or negated, the edge cases for the slerp. Returns the
+//			largest difference in any component.
+//-----------------------------------------------------------------------------
+float Studio_CompareSIMDBoneBlends( int nIterations, int nSeed )
+{
+	CUniformRandomStream random;
+	random.SetSeed( nSeed );
+
+	float flMaxDiff = 0.0f;
+	for ( int iter = 0; iter < nIterations; iter++ )
+	{
+		Quaternion p[4], q[4];
+		ALIGN16 float flT[4] ALIGN16_POST;
+		ALIGN16 uint32 nAlign[4] ALIGN16_POST;
+		for ( int n = 0; n < 4; n++ )
+		{
+			RandomUnitQuaternion( random, p[n] );
+			switch ( random.RandomInt( 0, 7 ) )
+			{
+			case 0:
+				q[n] = p[n];
+				break;
+
+			case 1:
+				q[n].Init( -p[n].x, -p[n].y, -p[n].z, -p[n].w );
+				break;
+
+			default:
+				RandomUnitQuaternion( random, q[n] );
+				break;
+			}
+
+			flT[n] = random.RandomFloat( 0.0f, 1.0f );
+			nAlign[n] = random.RandomInt( 0, 1 ) ? 0xFFFFFFFF : 0;
+		}
+
+		FourQuaternions p4, q4;
+		p4.LoadAndSwizzle( p[0], p[1], p[2], p[3] );
+		q4.LoadAndSwizzle( q[0], q[1], q[2], q[3] );
+		fltx4 fl4T = LoadAlignedSIMD( flT );
+		fltx4 fl4Align = LoadAlignedSIMD( nAlign );
+
+		Quaternion slerp[4], blend[4];
+		p4.Slerp( q4, fl4T, fl4Align ).SwizzleAndStore( slerp[0], slerp[1], slerp[2], slerp[3] );
+		p4.Blend( q4, fl4T, fl4Align ).SwizzleAndStore( blend[0], blend[1], blend[2], blend[3] );
+
+		for ( int n = 0; n < 4; n++ )
+		{
+			Quaternion expected;
+			if ( nAlign[n] )
+			{
+				QuaternionSlerp( p[n], q[n], flT[n], expected );
+			}
+			else
+			{
+				QuaternionSlerpNoAlign( p[n], q[n], flT[n], expected );
+			}
+			flMaxDiff = MAX( flMaxDiff, QuaternionMaxDiff( expected, slerp[n] ) );
+
+			if ( nAlign[n] )
+			{
+				QuaternionBlend( p[n], q[n], flT[n], expected );
+			}
+			else
+			{
+				QuaternionBlendNoAlign( p[n], q[n], flT[n], expected );
+			}
+			flMaxDiff = MAX( flMaxDiff, QuaternionMaxDiff( expected, blend[n] ) );
+		}
+	}
+
+	return flMaxDiff;
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: blend together q1,pos1 with q2,pos2.  Return result in q1,pos1.  
 //			0 returns q1, pos1.  1 returns q2, pos2
@@ -1481,13 +1613,48 @@ void SlerpBones(
 		return;
 	}
 
-	QuaternionAligned q3;
+	// Collect the bones that blend at all
+	int *pBones = (int*)stackalloc( nBoneCount * sizeof(int) );
+	int nBones = 0;
 	for (i = 0; i < nBoneCount; i++)
 	{
-		s2 = pS2[i];
-		if ( s2 <= 0.0f )
-			continue;
+		if ( pS2[i] > 0.0f )
+		{
+			pBones[nBones++] = i;
+		}
+	}
+
+	int k = 0;
+#ifndef _X360
+	// Four at a time in SIMD, leaving the last few to the scalar loop
+	ALIGN16 float flS2[4] ALIGN16_POST;
+	for ( ; k + 4 <= nBones; k += 4 )
+	{
+		const int *pFour = &pBones[k];
+		for ( int n = 0; n < 4; n++ )
+		{
+			flS2[n] = pS2[pFour[n]];
+		}
+
+		BlendFourBoneQuaternions( pStudioHdr, pFour, q1, q2, LoadAlignedSIMD( flS2 ), true );
 
+		for ( int n = 0; n < 4; n++ )
+		{
+			i = pFour[n];
+			s2 = flS2[n];
+			s1 = 1.0 - s2;
+			pos1[i][0] = pos1[i][0] * s1 + pos2[i][0] * s2;
+			pos1[i][1] = pos1[i][1] * s1 + pos2[i][1] * s2;
+			pos1[i][2] = pos1[i][2] * s1 + pos2[i][2] * s2;
+		}
+	}
+#endif
+
+	QuaternionAligned q3;
+	for ( ; k < nBones; k++ )
+	{
+		i = pBones[k];
+		s2 = pS2[i];
 		s1 = 1.0 - s2;
 
 #ifdef _X360
@@ -1592,7 +1759,11 @@ void BlendBones(
 	float s2 = s;
 	float s1 = 1.0 - s2;
 
-	for (i = 0; i < pStudioHdr->numbones(); i++)
+	// Collect the bones this sequence blends
+	int nBoneCount = pStudioHdr->numbones();
+	int *pBones = (int*)stackalloc( nBoneCount * sizeof(int) );
+	int nBones = 0;
+	for (i = 0; i < nBoneCount; i++)
 	{
 		// skip unused bones
 		if (!(pStudioHdr->boneFlags(i) & boneMask))
@@ -1611,23 +1782,48 @@ void BlendBones(
 
 		if (j >= 0 && seqdesc.weight( j ) > 0.0)
 		{
-			if (pStudioHdr->boneFlags(i) & BONE_FIXED_ALIGNMENT)
-			{
-				QuaternionBlendNoAlign( q2[i], q1[i], s1, q3 );
-			}
-			else
-			{
-				QuaternionBlend( q2[i], q1[i], s1, q3 );
-			}
-			q1[i][0] = q3[0];
-			q1[i][1] = q3[1];
-			q1[i][2] = q3[2];
-			q1[i][3] = q3[3];
+			pBones[nBones++] = i;
+		}
+	}
+
+	int k = 0;
+#ifndef _X360
+	// Four at a time in SIMD, leaving the last few to the scalar loop
+	fltx4 fl4S2 = ReplicateX4( s2 );
+	for ( ; k + 4 <= nBones; k += 4 )
+	{
+		const int *pFour = &pBones[k];
+		BlendFourBoneQuaternions( pStudioHdr, pFour, q1, q2, fl4S2, false );
+
+		for ( int n = 0; n < 4; n++ )
+		{
+			i = pFour[n];
 			pos1[i][0] = pos1[i][0] * s1 + pos2[i][0] * s2;
 			pos1[i][1] = pos1[i][1] * s1 + pos2[i][1] * s2;
 			pos1[i][2] = pos1[i][2] * s1 + pos2[i][2] * s2;
 		}
 	}
+#endif
+
+	for ( ; k < nBones; k++ )
+	{
+		i = pBones[k];
+		if (pStudioHdr->boneFlags(i) & BONE_FIXED_ALIGNMENT)
+		{
+			QuaternionBlendNoAlign( q2[i], q1[i], s1, q3 );
+		}
+		else
+		{
+			QuaternionBlend( q2[i], q1[i], s1, q3 );
+		}
+		q1[i][0] = q3[0];
+		q1[i][1] = q3[1];
+		q1[i][2] = q3[2];
+		q1[i][3] = q3[3];
+		pos1[i][0] = pos1[i][0] * s1 + pos2[i][0] * s2;
+		pos1[i][1] = pos1[i][1] * s1 + pos2[i][1] * s2;
+		pos1[i][2] = pos1[i][2] * s1 + pos2[i][2] * s2;
+	}
 }
 
 
@@ -442,6 +442,10 @@ bool TraceToStudio( class IPhysicsSurfaceProps *pProps, const Ray_t& ray, CStudi
 void QuaternionSM( float s, const Quaternion &p, const Quaternion &q, Quaternion &qt );
 void QuaternionMA( const Quaternion &p, float s, const Quaternion &q, Quaternion &qt );
 
+// Largest difference between the four-wide quaternion blends SlerpBones and
+// BlendBones use and the scalar ones, over nIterations random groups of four
+float Studio_CompareSIMDBoneBlends( int nIterations, int nSeed );
+
 bool Studio_PrefetchSequence( const CStudioHdr *pStudioHdr, int iSequence );
 
 void Studio_RunBoneFlexDrivers( float *pFlexController, const CStudioHdr *pStudioHdr, const Vector *pPositions, const matrix3x4_t *pBoneToWorld, const matrix3x4_t &mRootToWorld );
@@ -363,5 +363,153 @@ FORCEINLINE fltx4 QuaternionSlerpSIMD( const fltx4 &p, const fltx4 &q, float t )
 
 #endif // ALLOW_SIMD_QUATERNION_MATH
 
+
+/// class FourQuaternions stores 4 independent quaternions for use in SIMD processing, in
+/// the format x x x x y y y y z z z z w w w w. Unlike the functions above, everything here
+/// works one lane at a time with vertical operations only, so it is fine to use on PC.
+/// The blends match the scalar mathlib versions lane for lane.
+class ALIGN16 FourQuaternions
+{
+public:
+	fltx4 x, y, z, w;
+
+	/// LoadAndSwizzle - load 4 Quaternions into a FourQuaternions, performing transpose op
+	FORCEINLINE void LoadAndSwizzle( Quaternion const &a, Quaternion const &b, Quaternion const &c, Quaternion const &d )
+	{
+		x = LoadUnalignedSIMD( a.Base() );
+		y = LoadUnalignedSIMD( b.Base() );
+		z = LoadUnalignedSIMD( c.Base() );
+		w = LoadUnalignedSIMD( d.Base() );
+		TransposeSIMD( x, y, z, w );
+	}
+
+	/// SwizzleAndStore - transpose back and write the 4 Quaternions out
+	FORCEINLINE void SwizzleAndStore( Quaternion &a, Quaternion &b, Quaternion &c, Quaternion &d ) const
+	{
+		fltx4 ta = x, tb = y, tc = z, td = w;
+		TransposeSIMD( ta, tb, tc, td );
+		StoreUnalignedSIMD( a.Base(), ta );
+		StoreUnalignedSIMD( b.Base(), tb );
+		StoreUnalignedSIMD( c.Base(), tc );
+		StoreUnalignedSIMD( d.Base(), td );
+	}
+
+	FORCEINLINE fltx4 operator*( FourQuaternions const &q ) const	//< dot product
+	{
+		fltx4 dot = MulSIMD( x, q.x );
+		dot = AddSIMD( dot, MulSIMD( y, q.y ) );
+		dot = AddSIMD( dot, MulSIMD( z, q.z ) );
+		dot = AddSIMD( dot, MulSIMD( w, q.w ) );
+		return dot;
+	}
+
+	/// Returns q with each lane that is more than 180 degrees from this one reversed, as
+	/// QuaternionAlign does. Lanes where fl4Enable is clear come back unchanged.
+	FORCEINLINE FourQuaternions Align( FourQuaternions const &q, fltx4 const &fl4Enable ) const
+	{
+		fltx4 dx = SubSIMD( x, q.x ), dy = SubSIMD( y, q.y ), dz = SubSIMD( z, q.z ), dw = SubSIMD( w, q.w );
+		fltx4 sx = AddSIMD( x, q.x ), sy = AddSIMD( y, q.y ), sz = AddSIMD( z, q.z ), sw = AddSIMD( w, q.w );
+
+		fltx4 a = MulSIMD( dx, dx );
+		a = AddSIMD( a, MulSIMD( dy, dy ) );
+		a = AddSIMD( a, MulSIMD( dz, dz ) );
+		a = AddSIMD( a, MulSIMD( dw, dw ) );
+		fltx4 b = MulSIMD( sx, sx );
+		b = AddSIMD( b, MulSIMD( sy, sy ) );
+		b = AddSIMD( b, MulSIMD( sz, sz ) );
+		b = AddSIMD( b, MulSIMD( sw, sw ) );
+
+		fltx4 fl4Flip = AndSIMD( CmpGtSIMD( a, b ), fl4Enable );
+
+		FourQuaternions result;
+		result.x = MaskedAssign( fl4Flip, NegSIMD( q.x ), q.x );
+		result.y = MaskedAssign( fl4Flip, NegSIMD( q.y ), q.y );
+		result.z = MaskedAssign( fl4Flip, NegSIMD( q.z ), q.z );
+		result.w = MaskedAssign( fl4Flip, NegSIMD( q.w ), q.w );
+		return result;
+	}
+
+	/// Normalizes each lane, leaving zero length lanes alone
+	FORCEINLINE void Normalize()
+	{
+		fltx4 radius = (*this) * (*this);
+		fltx4 iradius = DivSIMD( Four_Ones, SqrtSIMD( radius ) );
+		iradius = MaskedAssign( CmpEqSIMD( radius, Four_Zeros ), Four_Ones, iradius );
+		x = MulSIMD( x, iradius );
+		y = MulSIMD( y, iradius );
+		z = MulSIMD( z, iradius );
+		w = MulSIMD( w, iradius );
+	}
+
+	/// Per lane QuaternionBlendNoAlign. 0.0 returns this, 1.0 returns q.
+	FORCEINLINE FourQuaternions BlendNoAlign( FourQuaternions const &q, fltx4 const &t ) const
+	{
+		fltx4 sclp = SubSIMD( Four_Ones, t );
+		FourQuaternions result;
+		result.x = AddSIMD( MulSIMD( sclp, x ), MulSIMD( t, q.x ) );
+		result.y = AddSIMD( MulSIMD( sclp, y ), MulSIMD( t, q.y ) );
+		result.z = AddSIMD( MulSIMD( sclp, z ), MulSIMD( t, q.z ) );
+		result.w = AddSIMD( MulSIMD( sclp, w ), MulSIMD( t, q.w ) );
+		result.Normalize();
+		return result;
+	}
+
+	/// Per lane QuaternionSlerpNoAlign. 0.0 returns this, 1.0 returns q.
+	FORCEINLINE FourQuaternions SlerpNoAlign( FourQuaternions const &q, fltx4 const &t ) const
+	{
+		fltx4 fl4Epsilon = ReplicateX4( 0.000001f );
+		fltx4 cosom = (*this) * q;
+
+		// Lanes that aren't close to opposite blend normally; of those, lanes that
+		// aren't nearly identical need the trig weights
+		fltx4 fl4Blend = CmpGtSIMD( AddSIMD( Four_Ones, cosom ), fl4Epsilon );
+		fltx4 fl4Trig = AndSIMD( fl4Blend, CmpGtSIMD( SubSIMD( Four_Ones, cosom ), fl4Epsilon ) );
+
+		fltx4 sclp = SubSIMD( Four_Ones, t );
+		fltx4 sclq = t;
+		if ( IsAnyNegative( fl4Trig ) )
+		{
+			// Other lanes get acos(0) so nothing below goes out of range
+			fltx4 omega = ArcCosSIMD( AndSIMD( fl4Trig, cosom ) );
+			fltx4 sinom = SinSIMD( omega );
+			sclp = MaskedAssign( fl4Trig, DivSIMD( SinSIMD( MulSIMD( sclp, omega ) ), sinom ), sclp );
+			sclq = MaskedAssign( fl4Trig, DivSIMD( SinSIMD( MulSIMD( t, omega ) ), sinom ), sclq );
+		}
+
+		FourQuaternions result;
+		result.x = AddSIMD( MulSIMD( sclp, x ), MulSIMD( sclq, q.x ) );
+		result.y = AddSIMD( MulSIMD( sclp, y ), MulSIMD( sclq, q.y ) );
+		result.z = AddSIMD( MulSIMD( sclp, z ), MulSIMD( sclq, q.z ) );
+		result.w = AddSIMD( MulSIMD( sclp, w ), MulSIMD( sclq, q.w ) );
+
+		if ( TestSignSIMD( fl4Blend ) != 0xf )
+		{
+			// Nearly opposite: rotate through a perpendicular quaternion instead
+			fltx4 fl4HalfPi = ReplicateX4( 0.5f * M_PI );
+			fltx4 sclpOpp = SinSIMD( MulSIMD( SubSIMD( Four_Ones, t ), fl4HalfPi ) );
+			fltx4 sclqOpp = SinSIMD( MulSIMD( t, fl4HalfPi ) );
+			result.x = MaskedAssign( fl4Blend, result.x, AddSIMD( MulSIMD( sclpOpp, x ), MulSIMD( sclqOpp, NegSIMD( q.y ) ) ) );
+			result.y = MaskedAssign( fl4Blend, result.y, AddSIMD( MulSIMD( sclpOpp, y ), MulSIMD( sclqOpp, q.x ) ) );
+			result.z = MaskedAssign( fl4Blend, result.z, AddSIMD( MulSIMD( sclpOpp, z ), MulSIMD( sclqOpp, NegSIMD( q.w ) ) ) );
+			result.w = MaskedAssign( fl4Blend, result.w, q.z );
+		}
+
+		return result;
+	}
+
+	/// Per lane QuaternionSlerp / QuaternionSlerpNoAlign, aligning only the lanes set in fl4Align
+	FORCEINLINE FourQuaternions Slerp( FourQuaternions const &q, fltx4 const &t, fltx4 const &fl4Align ) const
+	{
+		return SlerpNoAlign( Align( q, fl4Align ), t );
+	}
+
+	/// Per lane QuaternionBlend / QuaternionBlendNoAlign, aligning only the lanes set in fl4Align
+	FORCEINLINE FourQuaternions Blend( FourQuaternions const &q, fltx4 const &t, fltx4 const &fl4Align ) const
+	{
+		return BlendNoAlign( Align( q, fl4Align ), t );
+	}
+};
+
+
 #endif // SSEQUATMATH_H
 
@@ -41,6 +41,40 @@ public:
 
 };
 
+#define RAYPACKET_MAX_GROUPS 4
+#define RAYPACKET_MAX_RAYS (4*RAYPACKET_MAX_GROUPS)
+
+/// A packet of 4, 8, 12 or 16 rays which are traced together by TraceRayPacket. Unlike FourRays,
+/// each ray has its own t extents and an active mask, so rays can be switched off. Inactive rays
+/// are not traversed and never report a hit, which allows partially filled packets and packets
+/// whose rays do not all have the same direction signs.
+class RayPacket
+{
+public:
+	FourVectors origin[RAYPACKET_MAX_GROUPS];
+	FourVectors direction[RAYPACKET_MAX_GROUPS];
+	fltx4 TMin[RAYPACKET_MAX_GROUPS];
+	fltx4 TMax[RAYPACKET_MAX_GROUPS];
+	fltx4 ActiveMask[RAYPACKET_MAX_GROUPS];					// all bits set for rays to trace
+	int nGroups;											// number of groups of 4 rays in use
+
+	// returns direction sign mask for the active rays. returns -1 if they do not all have the same
+	// signs.
+	int CalculateDirectionSignMask(void) const;
+};
+
+/// kernels available for tracing ray packets. the SSE4 kernel is Trace4Rays.
+enum RayTraceKernel_t
+{
+	RAYTRACE_KERNEL_SSE4 = 0,
+	RAYTRACE_KERNEL_SSE8,									// 8 rays, 2 SSE registers per component
+	RAYTRACE_KERNEL_SSE16,									// 16 rays, 4 SSE registers per component
+	RAYTRACE_KERNEL_AVX8,									// 8 rays, 1 AVX register per component
+	RAYTRACE_KERNEL_AVX16,									// 16 rays, 2 AVX registers per component
+
+	NUM_RAYTRACE_KERNELS
+};
+
 /// The format a triangle is stored in for intersections. size of this structure is important.
 /// This structure can be in one of two forms. Before the ray tracing environment is set up, the
 /// ProjectedEdgeEquations hold the coordinates of the 3 vertices, for facilitating bounding box
@@ -193,6 +227,61 @@ protected:
 };
 
 
+/// acceleration structures SetupAccelerationStructure can build
+enum RayTraceAccel_t
+{
+	RAYTRACE_ACCEL_KDTREE = 0,								// RefineNode's kd-tree
+	RAYTRACE_ACCEL_BVH,										// binned SAH bounding volume hierarchy
+
+	NUM_RAYTRACE_ACCELS
+};
+
+#define BVHNODE_LEAF 3										// m_nCount low bits for a leaf. 0..2 is the
+															// split axis of an interior node
+
+struct CacheOptimizedBVHNode
+{
+	// 32 bytes, so two nodes share a cache line. Nodes are stored depth first, so the first child
+	// of an interior node always follows it and only the second child's index is stored. Leaves
+	// point at a contiguous run of triangles, since the BVH builder sorts OptimizedTriangleList
+	// into leaf order.
+	float m_Mins[3];
+	int32 m_nIndex;											// second child, or first triangle of a leaf
+	float m_Maxs[3];
+	int32 m_nCount;											// triangles in a leaf << 2, or'ed with
+															// BVHNODE_LEAF or the split axis
+
+	inline bool IsLeaf(void) const
+	{
+		return ( m_nCount & 3 ) == BVHNODE_LEAF;
+	}
+
+	inline int SplitAxis(void) const
+	{
+		assert(!IsLeaf());
+		return m_nCount & 3;
+	}
+
+	inline int SecondChild(void) const
+	{
+		assert(!IsLeaf());
+		return m_nIndex;
+	}
+
+	inline int32 TriangleIndexStart(void) const
+	{
+		assert(IsLeaf());
+		return m_nIndex;
+	}
+
+	inline int NumberOfTrianglesInLeaf(void) const
+	{
+		assert(IsLeaf());
+		return m_nCount >> 2;
+	}
+};
+
+
 struct RayTracingSingleResult
 {
 	Vector surface_normal;									// surface normal at intersection
@@ -208,6 +297,13 @@ struct RayTracingResult
 	fltx4 HitDistance;										// distance to intersection
 };
 
+struct RayPacketResult
+{
+	FourVectors surface_normal[RAYPACKET_MAX_GROUPS];		// surface normal at intersection
+	fltx4 HitDistance[RAYPACKET_MAX_GROUPS];				// distance to intersection
+	ALIGN16 int32 HitIds[RAYPACKET_MAX_RAYS] ALIGN16_POST;	// -1=no hit or inactive. otherwise, triangle index
+};
+
 
 class RayTraceLight
 {
@@ -232,9 +328,9 @@ class RayStream
 {
 	friend class RayTracingEnvironment;
 
-	RayTracingSingleResult *PendingStreamOutputs[8][4];
+	RayTracingSingleResult *PendingStreamOutputs[8][RAYPACKET_MAX_RAYS];
 	int n_in_stream[8];
-	FourRays PendingRays[8];
+	RayPacket PendingRays[8];
 
 public:
 	RayStream(void)
@@ -246,7 +342,7 @@ public:
 // When transparent triangles are in the list, the caller can provide a callback that will get called at each triangle
 // allowing the callback to stop processing if desired.
 // UNDONE: This is not currently SIMD - it really only supports single rays
-// Also for efficiency FourRays really needs some kind of active mask for the cases where rays get unbundled
+// Only Trace4Rays supports the callback; RayPacket has the active mask for the cases where rays get unbundled
 class ITransparentTriangleCallback
 {
 public:
@@ -262,17 +358,42 @@ public:
 
 	FourVectors BackgroundColor;							//< color where no intersection
 	CUtlVector<CacheOptimizedKDNode> OptimizedKDTree;		//< the packed kdtree. root is 0
+	CUtlVector<CacheOptimizedBVHNode> OptimizedBVHTree;		//< the packed bvh, if m_nAccel is BVH. root is 0
 	CUtlBlockVector<CacheOptimizedTriangle> OptimizedTriangleList; //< the packed triangles
 	CUtlVector<int32> TriangleIndexList;					//< the list of triangle indices.
 	CUtlVector<LightDesc_t> LightList;						//< the list of lights
 	CUtlVector<Vector> TriangleColors;						//< color of tries
 	CUtlVector<int32> TriangleMaterials;					//< material index of tries
+	RayTraceKernel_t m_nKernel;								//< used by TraceRayPacket and ray streams
+	RayTraceAccel_t m_nAccel;								//< built by SetupAccelerationStructure
 
 public:
 	RayTracingEnvironment() : OptimizedTriangleList( 1024 )
 	{
 		BackgroundColor.DuplicateVector(Vector(1,0,0));		// red
 		Flags=0;
+		m_nKernel=RAYTRACE_KERNEL_SSE4;
+		m_nAccel=RAYTRACE_ACCEL_KDTREE;
+	}
+
+	// packet kernel selection. the 4-wide kernel is the default; the wider ones are opt-in.
+	static bool IsKernelSupported( RayTraceKernel_t kernel );
+	static const char *GetKernelName( RayTraceKernel_t kernel );
+	static RayTraceKernel_t FindKernel( const char *pName );	// NUM_RAYTRACE_KERNELS if unknown
+	static int GetKernelWidth( RayTraceKernel_t kernel );		// rays per packet
+	bool SetKernel( RayTraceKernel_t kernel );					// false if not supported
+	RayTraceKernel_t GetKernel( void ) const
+	{
+		return m_nKernel;
+	}
+
+	// acceleration structure selection. must be set before SetupAccelerationStructure.
+	static const char *GetAccelName( RayTraceAccel_t accel );
+	static RayTraceAccel_t FindAccel( const char *pName );		// NUM_RAYTRACE_ACCELS if unknown
+	void SetAccel( RayTraceAccel_t accel );
+	RayTraceAccel_t GetAccel( void ) const
+	{
+		return m_nAccel;
 	}
 
 
@@ -294,8 +415,10 @@ public:
 										const Vector &color);
 
 
-	// SetupAccelerationStructure to prepare for tracing
-	void SetupAccelerationStructure(void);
+	// SetupAccelerationStructure to prepare for tracing. When building a BVH, the triangles are
+	// reordered, so triangle indices (HitID, GetTriangle etc.) are only valid after this.
+	// nBuildThreads is how many threads may build the BVH; the kd-tree is always built serially.
+	void SetupAccelerationStructure(int nBuildThreads=1);
 
 
 	// lowest level intersection routine - fire 4 rays through the scene. all 4 rays must pass the
@@ -305,11 +428,31 @@ public:
 					RayTracingResult *rslt_out,
 					int32 skip_id=-1, ITransparentTriangleCallback *pCallback = NULL);
 
+	// Trace4Rays for the BVH. DirectionSignMask only decides which child is visited first, so the
+	// rays don't need to match in direction sign.
+	// Hits at or past TMax are never reported, and the transparency callback is never called for
+	// them. The kd-tree tests every triangle in the leaves it visits against the closest hit so far
+	// only, so it can report a hit past TMax (and call the callback for it) when such a triangle
+	// shares a leaf with the ray. Which triangles those are depends on the tree, so callers must
+	// treat HitDistance >= TMax as a miss with either structure; TestLine, TestLine_DoesHitSky,
+	// CTransferMaker and -raytracebench in vrad all do.
+	void Trace4RaysBVH(const FourRays &rays, fltx4 TMin, fltx4 TMax, int DirectionSignMask,
+					   RayTracingResult *rslt_out,
+					   int32 skip_id=-1, ITransparentTriangleCallback *pCallback = NULL);
+
 	// higher level intersection routine that handles computing the mask and handling rays which do not match in direciton sign
 	void Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 TMax,
 					RayTracingResult *rslt_out,
 					int32 skip_id=-1, ITransparentTriangleCallback *pCallback = NULL);
 
+	// trace a packet of rays with the current kernel. each active ray finds its closest
+	// intersection. rays not matching in direction sign are traced in several passes.
+	void TraceRayPacket(const RayPacket &rays, RayPacketResult *rslt_out, int32 skip_id=-1);
+
+	// same, for packets whose active rays are known to match DirectionSignMask
+	void TraceRayPacket(const RayPacket &rays, int DirectionSignMask, RayPacketResult *rslt_out,
+						int32 skip_id=-1);
+
 	// compute virtual light sources to model inter-reflection
 	void ComputeVirtualLightSources(void);
 
@@ -330,7 +473,7 @@ public:
 					 
 	/// raytracing stream - lets you trace an array of rays by feeding them to this function.
 	/// results will not be returned until FinishStream is called. This function handles sorting
-	/// the rays by direction, tracing them 4 at a time, and de-interleaving the results.
+	/// the rays by direction, tracing them a packet at a time, and de-interleaving the results.
 
 	void AddToRayStream(RayStream &s,
 						Vector const &start,Vector const &end,RayTracingSingleResult *rslt_out);
@@ -356,6 +499,9 @@ public:
 	void CalculateTriangleListBounds(int32 const *tris,int ntris,
 									 Vector &minout, Vector &maxout);
 
+	// BVH construction, in bvh.cpp
+	void BuildBVH(int nThreads);
+
 	void AddInfinitePointLight(Vector position,				// light center
 							   Vector intensity);			// rgb amount
 
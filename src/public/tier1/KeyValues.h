@@ -24,6 +24,7 @@
 
 #include "utlvector.h"
 #include "Color.h"
+#include "tier0/threadtools.h"
 
 #define FOR_EACH_SUBKEY( kvRoot, kvSubKey ) \
 	for ( KeyValues * kvSubKey = kvRoot->GetFirstSubKey(); kvSubKey != NULL; kvSubKey = kvSubKey->GetNextKey() )
@@ -39,6 +40,9 @@ class CUtlBuffer;
 class Color;
 typedef void * FileHandle_t;
 class CKeyValuesGrowableStringTable;
+class CKeyValuesArena;
+class CKeyValuesTokenReader;
+struct KeyValuesFileLoad_t;
 
 //-----------------------------------------------------------------------------
 // Purpose: Simple recursive data access class
@@ -129,6 +133,15 @@ public:
 	// Read from a utlbuffer...
 	bool LoadFromBuffer( char const *resourceName, CUtlBuffer &buf, IBaseFileSystem* pFileSystem = NULL, const char *pPathID = NULL );
 
+	// Same as above, but the text is kept in pArena and parsed in place, so string values
+	// point into it instead of each getting their own allocation. See CKeyValuesArena.
+	bool LoadFromFileInArena( CKeyValuesArena *pArena, IBaseFileSystem *filesystem, const char *resourceName, const char *pathID = NULL );
+	bool LoadFromBufferInArena( CKeyValuesArena *pArena, char const *resourceName, const char *pBuffer, IBaseFileSystem* pFileSystem = NULL, const char *pPathID = NULL );
+
+	// Loads a batch of unrelated files into pArena. The files are read, tokenized and their
+	// values typed in parallel on the thread pool, then the trees are built on the calling thread.
+	static void LoadFilesInArena( CKeyValuesArena *pArena, IBaseFileSystem *filesystem, KeyValuesFileLoad_t *pLoads, int nLoads );
+
 	// Find a keyValue, create it if it is not found.
 	// Set bCreate to true to create the key if it doesn't already exist (which ensures a valid pointer will be returned)
 	KeyValues *FindKey(const char *keyName, bool bCreate = false);
@@ -262,6 +275,8 @@ public:
 	void RecursiveMergeKeyValues( KeyValues *baseKV );
 
 private:
+	friend class CKeyValuesTokenReader;
+
 	KeyValues( KeyValues& );	// prevent copy constructor being used
 
 	// prevent delete being called except through deleteThis()
@@ -289,12 +304,13 @@ private:
 	void SaveKeyToFile( KeyValues *dat, IBaseFileSystem *filesystem, FileHandle_t f, CUtlBuffer *pBuf, int indentLevel, bool sortKeys, bool bAllowEmptyString );
 	void WriteConvertedString( IBaseFileSystem *filesystem, FileHandle_t f, CUtlBuffer *pBuf, const char *pszString );
 	
-	void RecursiveLoadFromBuffer( char const *resourceName, CUtlBuffer &buf );
+	bool LoadFromTokens( char const *resourceName, CKeyValuesTokenReader &tokens, IBaseFileSystem* pFileSystem, const char *pPathID );
+	void RecursiveLoadFromBuffer( char const *resourceName, CKeyValuesTokenReader &tokens );
 
 	// For handling #include "filename"
 	void AppendIncludedKeys( CUtlVector< KeyValues * >& includedKeys );
 	void ParseIncludedKeys( char const *resourceName, const char *filetoinclude, 
-		IBaseFileSystem* pFileSystem, const char *pPathID, CUtlVector< KeyValues * >& includedKeys );
+		IBaseFileSystem* pFileSystem, const char *pPathID, CUtlVector< KeyValues * >& includedKeys, CKeyValuesArena *pArena );
 
 	// For handling #base "filename"
 	void MergeBaseKeys( CUtlVector< KeyValues * >& baseKeys );
@@ -328,7 +344,7 @@ private:
 	char	   m_iDataType;
 	char	   m_bHasEscapeSequences; // true, if while parsing this KeyValue, Escape Sequences are used (default false)
 	char	   m_bEvaluateConditionals; // true, if while parsing this KeyValue, conditionals blocks are evaluated (default true)
-	char	   unused[1];
+	char	   m_bValueInArena; // m_sValue points into a CKeyValuesArena, so isn't ours to free
 
 	KeyValues *m_pPeer;	// pointer to next key in list
 	KeyValues *m_pSub;	// pointer to Start of a new sub key list
@@ -357,6 +373,51 @@ public:
 
 typedef KeyValues::AutoDelete KeyValuesAD;
 
+//-----------------------------------------------------------------------------
+// Purpose: Backing store for KeyValues loaded with LoadFromFileInArena and friends.
+//			The file text is copied in here once and tokens are terminated inside
+//			it, so string values are views into the text rather than a copy per
+//			key. Key names still go through the usual symbol table.
+//
+//			The arena must outlive every KeyValues loaded into it. Those trees
+//			behave like any other - values can be changed and keys copied out with
+//			MakeCopy - but don't hand them to another module to delete, as its
+//			copy of KeyValues doesn't know about arena strings.
+//-----------------------------------------------------------------------------
+class CKeyValuesArena
+{
+public:
+	CKeyValuesArena();
+	~CKeyValuesArena();
+
+	// Returns memory that lives until the arena is purged. Thread safe.
+	char *Alloc( int nSize );
+
+	// Frees everything. KeyValues loaded into the arena must be deleted first.
+	void Purge();
+
+	int GetBlockCount() const { return m_Blocks.Count(); }
+	int GetBytesUsed() const { return m_nBytesUsed; }
+
+private:
+	CKeyValuesArena( const CKeyValuesArena & ); // forbid
+
+	CThreadFastMutex m_Mutex;
+	CUtlVector< char * > m_Blocks;
+	char *m_pBlockCur;
+	int m_nBlockRemaining;
+	int m_nBytesUsed;
+};
+
+// One file for KeyValues::LoadFilesInArena
+struct KeyValuesFileLoad_t
+{
+	KeyValues *m_pKeyValues;		// allocated by the caller, loaded into
+	const char *m_pszFilename;
+	const char *m_pszPathID;		// may be NULL
+	bool m_bLoaded;					// filled in by LoadFilesInArena
+};
+
 enum KeyValuesUnpackDestinationTypes_t
 {
 	UNPACK_TYPE_FLOAT,										// dest is a float
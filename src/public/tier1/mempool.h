@@ -20,6 +20,7 @@
 
 #include "tier0/memalloc.h"
 #include "tier0/tslist.h"
+#include "tier0/threadtools.h"
 #include "tier0/platform.h"
 #include "tier1/utlvector.h"
 #include "tier1/utlrbtree.h"
@@ -106,24 +107,71 @@ protected:
 
 
 //-----------------------------------------------------------------------------
-// 
+// Thread safe pool. Each thread keeps a few free blocks of its own, so most
+// allocs and frees don't touch anything shared. When a thread's cache is full
+// it hands blocks back on a lock-free return queue, which threads with an empty
+// cache take from before they fall back to locking the pool itself.
+//
+// Count() is the number of blocks callers hold. Blocks sitting in thread
+// caches or on the return queue still count as allocated in PeakCount().
 //-----------------------------------------------------------------------------
 class CMemoryPoolMT : public CUtlMemoryPool
 {
 public:
-	CMemoryPoolMT(int blockSize, int numElements, int growMode = UTLMEMORYPOOL_GROW_FAST, const char *pszAllocOwner = NULL) : CUtlMemoryPool( blockSize, numElements, growMode, pszAllocOwner) {}
+	CMemoryPoolMT( int blockSize, int numElements, int growMode = UTLMEMORYPOOL_GROW_FAST, const char *pszAllocOwner = NULL, int nAlignment = 0 );
+	~CMemoryPoolMT();
 
+	void*		Alloc()	{ return Alloc( m_BlockSize ); }
+	void*		Alloc( size_t amount );
+	void*		AllocZero()	{ return AllocZero( m_BlockSize ); }
+	void*		AllocZero( size_t amount );
+	void		Free(void *pMem);
 
-	void*		Alloc()	{ AUTO_LOCK( m_mutex ); return CUtlMemoryPool::Alloc(); }
-	void*		Alloc( size_t amount )	{ AUTO_LOCK( m_mutex ); return CUtlMemoryPool::Alloc( amount ); }
-	void*		AllocZero()	{ AUTO_LOCK( m_mutex ); return CUtlMemoryPool::AllocZero(); }	
-	void*		AllocZero( size_t amount )	{ AUTO_LOCK( m_mutex ); return CUtlMemoryPool::AllocZero( amount ); }
-	void		Free(void *pMem) { AUTO_LOCK( m_mutex ); CUtlMemoryPool::Free( pMem ); }
+	// Blocks handed out and not yet freed
+	int			Count() const;
 
 	// Frees everything
-	void		Clear() { AUTO_LOCK( m_mutex ); return CUtlMemoryPool::Clear(); }
+	void		Clear();
+
+	// False for pools made once every per-thread cache slot was taken; those always lock
+	bool		HasThreadCache() const { return m_iThreadCache != -1; }
+
+	// Returns blocks held by thread caches and the return queue to the pool.
+	// Only safe when no other thread is using the pool.
+	void		FlushThreadCaches();
+
+	// How often the shared paths were taken. Locks and return queue traffic are
+	// also shown as vprof counters.
+	struct Stats_t
+	{
+		int		m_nLocks;			// times the underlying pool was locked
+		int		m_nQueueRefills;	// blocks threads took off the return queue
+		int		m_nQueueReturns;	// blocks threads put on the return queue
+	};
+	void		GetStats( Stats_t &stats ) const;
+
+	enum
+	{
+		MAX_THREAD_CACHED_POOLS = 32,	// later pools always lock
+		THREAD_CACHE_SIZE = 32,			// free blocks a thread keeps for each pool
+	};
+
 private:
-	CThreadFastMutex m_mutex; // @TODO: Rework to use tslist (toml 7/6/2007)
+	void*		AllocSlow();
+	void		FreeSlow( void *pMem );
+	void		UpdateVProfCounters();
+
+	int					m_iThreadCache;		// index into each thread's caches, or -1 to always lock
+	CInterlockedInt		m_nGeneration;		// bumped on Clear, to throw away cached blocks
+	int					m_nMaxReturnQueue;
+	CTSListBase			m_ReturnQueue;
+	CThreadFastMutex	m_mutex;
+
+	CInterlockedInt		m_nLocks;
+	CInterlockedInt		m_nQueueRefills;
+	CInterlockedInt		m_nQueueReturns;
+	int					*m_pVProfLocks;
+	int					*m_pVProfQueued;
 };
 
 
@@ -0,0 +1,424 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+// $Id:$
+//
+// Bounding volume hierarchy alternative to the kd-tree. The bvh is built with the surface area
+// heuristic, evaluated at a fixed number of bins per axis instead of at every triangle. The top
+// of the tree is split on the main thread until there are enough independent subtrees to keep
+// every thread busy, and the subtrees are then built in parallel. Every split only depends on the
+// triangles below it, so the tree comes out the same no matter how many threads build it.
+// The caller picks the thread count; the threads are plain tier0 threads, so the library doesn't
+// depend on the tools' thread pool.
+
+#include "raytrace.h"
+#include <tier1/strtools.h>
+#include <tier0/threadtools.h>
+
+#define BVH_NUM_BINS 16
+#define BVH_MAX_LEAF_TRIS 8									// larger leaves are split even if the
+															// sah says not to
+#define BVH_MAX_DEPTH 64									// traversal stacks rely on this
+#define BVH_MIN_SUBTREE_TRIS 4096							// don't hand smaller subtrees to a thread
+
+// same approximate costs as the kd-tree
+#define BVH_COST_OF_TRAVERSAL 75
+#define BVH_COST_OF_INTERSECTION 167
+
+
+static const char *s_pAccelNames[NUM_RAYTRACE_ACCELS] =
+{
+	"kdtree",
+	"bvh",
+};
+
+const char *RayTracingEnvironment::GetAccelName( RayTraceAccel_t accel )
+{
+	if ( ( accel < 0 ) || ( accel >= NUM_RAYTRACE_ACCELS ) )
+		return "unknown";
+	return s_pAccelNames[accel];
+}
+
+RayTraceAccel_t RayTracingEnvironment::FindAccel( const char *pName )
+{
+	for ( int a = 0; a < NUM_RAYTRACE_ACCELS; a++ )
+	{
+		if ( !V_stricmp( pName, s_pAccelNames[a] ) )
+			return (RayTraceAccel_t) a;
+	}
+	return NUM_RAYTRACE_ACCELS;
+}
+
+void RayTracingEnvironment::SetAccel( RayTraceAccel_t accel )
+{
+	assert( !OptimizedKDTree.Count() && !OptimizedBVHTree.Count() );
+	m_nAccel = accel;
+}
+
+
+struct BVHBuildTri_t
+{
+	Vector m_Mins;
+	Vector m_Maxs;
+	Vector m_Center;
+};
+
+// a subtree built by one thread. its nodes are depth first, with child indices relative to the
+// subtree's root.
+struct BVHBuildTask_t
+{
+	int m_nFirst;
+	int m_nCount;
+	int m_nDepth;
+	CUtlVector<CacheOptimizedBVHNode> m_Nodes;
+};
+
+// the top of the tree, built on the main thread
+struct BVHTopNode_t
+{
+	CacheOptimizedBVHNode m_Node;
+	int m_nLeft;
+	int m_nRight;
+	int m_nTask;											// -1 for interior nodes
+};
+
+class CBVHBuilder
+{
+public:
+	CBVHBuilder( RayTracingEnvironment &env ) : m_Env( env ), m_nNextTask( 0 ) {}
+
+	void Build( int nThreads );
+
+private:
+	int Split( CacheOptimizedBVHNode &node, int first, int count, int depth );
+	void BuildSubtree( CUtlVector<CacheOptimizedBVHNode> &nodes, int first, int count, int depth );
+	int BuildTop( int first, int count, int depth, int nSubtreeTris );
+	void Emit( int top );
+
+	void BuildTasks( void );								// build subtrees until there are none left
+	static unsigned BuildTaskThread( void *pParam );
+	static int __cdecl TaskSortFunc( BVHBuildTask_t * const *lhs, BVHBuildTask_t * const *rhs );
+
+	RayTracingEnvironment &m_Env;
+	CUtlVector<BVHBuildTri_t> m_Tris;
+	CUtlVector<int32> m_TriIndex;							// triangles, in leaf order
+	CUtlVector<BVHTopNode_t> m_Top;
+	CUtlVector<BVHBuildTask_t> m_Tasks;
+	CUtlVector<BVHBuildTask_t *> m_TaskOrder;				// biggest first
+	int volatile m_nNextTask;								// next entry of m_TaskOrder to hand out
+};
+
+
+static float BVHSurfaceArea( Vector const &boxmin, Vector const &boxmax )
+{
+	Vector boxdim = boxmax - boxmin;
+	return 2.0 * ( ( boxdim[0] * boxdim[2] ) + ( boxdim[0] * boxdim[1] ) + ( boxdim[1] * boxdim[2] ) );
+}
+
+// Fill in the bounds of 'node' for the given triangles, and decide whether and how to split them.
+// Returns the number of triangles in the first child, which have been moved to the front of the
+// range, or 0 to make a leaf.
+int CBVHBuilder::Split( CacheOptimizedBVHNode &node, int first, int count, int depth )
+{
+	int32 *tris = m_TriIndex.Base() + first;
+
+	Vector mins( 1.0e23, 1.0e23, 1.0e23 ), maxs( -1.0e23, -1.0e23, -1.0e23 );
+	Vector cmins( 1.0e23, 1.0e23, 1.0e23 ), cmaxs( -1.0e23, -1.0e23, -1.0e23 );
+	for ( int t = 0; t < count; t++ )
+	{
+		BVHBuildTri_t const &tri = m_Tris[tris[t]];
+		VectorMin( mins, tri.m_Mins, mins );
+		VectorMax( maxs, tri.m_Maxs, maxs );
+		VectorMin( cmins, tri.m_Center, cmins );
+		VectorMax( cmaxs, tri.m_Center, cmaxs );
+	}
+	for ( int c = 0; c < 3; c++ )
+	{
+		node.m_Mins[c] = mins[c];
+		node.m_Maxs[c] = maxs[c];
+	}
+
+	if ( ( count <= 2 ) || ( depth >= BVH_MAX_DEPTH ) )
+		return 0;
+
+	// bin the centroids along each axis
+	struct Bin_t
+	{
+		Vector m_Mins;
+		Vector m_Maxs;
+		int m_nCount;
+	};
+	Bin_t bins[3][BVH_NUM_BINS];
+	float binScale[3];
+	for ( int axis = 0; axis < 3; axis++ )
+	{
+		float extent = cmaxs[axis] - cmins[axis];
+		binScale[axis] = ( extent > 0 ) ? ( BVH_NUM_BINS * 0.9999f ) / extent : 0;
+		for ( int b = 0; b < BVH_NUM_BINS; b++ )
+		{
+			bins[axis][b].m_Mins.Init( 1.0e23, 1.0e23, 1.0e23 );
+			bins[axis][b].m_Maxs.Init( -1.0e23, -1.0e23, -1.0e23 );
+			bins[axis][b].m_nCount = 0;
+		}
+	}
+	for ( int t = 0; t < count; t++ )
+	{
+		BVHBuildTri_t const &tri = m_Tris[tris[t]];
+		for ( int axis = 0; axis < 3; axis++ )
+		{
+			int b = clamp( (int) ( ( tri.m_Center[axis] - cmins[axis] ) * binScale[axis] ), 0, BVH_NUM_BINS - 1 );
+			Bin_t &bin = bins[axis][b];
+			VectorMin( bin.m_Mins, tri.m_Mins, bin.m_Mins );
+			VectorMax( bin.m_Maxs, tri.m_Maxs, bin.m_Maxs );
+			bin.m_nCount++;
+		}
+	}
+
+	// sweep each axis from both ends to find the cheapest split between two bins
+	float best_cost = 1.0e30;
+	int best_axis = -1;
+	int best_bin = 0;
+	for ( int axis = 0; axis < 3; axis++ )
+	{
+		if ( binScale[axis] == 0 )
+			continue;
+
+		float right_area[BVH_NUM_BINS];
+		int right_count[BVH_NUM_BINS];
+		Vector rmins( 1.0e23, 1.0e23, 1.0e23 ), rmaxs( -1.0e23, -1.0e23, -1.0e23 );
+		int nright = 0;
+		for ( int b = BVH_NUM_BINS - 1; b > 0; b-- )
+		{
+			VectorMin( rmins, bins[axis][b].m_Mins, rmins );
+			VectorMax( rmaxs, bins[axis][b].m_Maxs, rmaxs );
+			nright += bins[axis][b].m_nCount;
+			right_area[b] = nright ? BVHSurfaceArea( rmins, rmaxs ) : 0;
+			right_count[b] = nright;
+		}
+
+		Vector lmins( 1.0e23, 1.0e23, 1.0e23 ), lmaxs( -1.0e23, -1.0e23, -1.0e23 );
+		int nleft = 0;
+		for ( int b = 0; b < BVH_NUM_BINS - 1; b++ )
+		{
+			VectorMin( lmins, bins[axis][b].m_Mins, lmins );
+			VectorMax( lmaxs, bins[axis][b].m_Maxs, lmaxs );
+			nleft += bins[axis][b].m_nCount;
+			if ( !nleft || !right_count[b + 1] )
+				continue;
+			float cost = BVHSurfaceArea( lmins, lmaxs ) * nleft + right_area[b + 1] * right_count[b + 1];
+			if ( cost < best_cost )
+			{
+				best_cost = cost;
+				best_axis = axis;
+				best_bin = b;
+			}
+		}
+	}
+
+	if ( best_axis == -1 )
+	{
+		// every centroid is in the same place. nothing to gain, unless the leaf would be huge
+		if ( count <= BVH_MAX_LEAF_TRIS )
+			return 0;
+		node.m_nCount = 0;
+		return count / 2;
+	}
+
+	float area = BVHSurfaceArea( mins, maxs );
+	float split_cost = BVH_COST_OF_TRAVERSAL + BVH_COST_OF_INTERSECTION * best_cost / MAX( area, 1.0e-6f );
+	float leaf_cost = BVH_COST_OF_INTERSECTION * count;
+	if ( ( split_cost >= leaf_cost ) && ( count <= BVH_MAX_LEAF_TRIS ) )
+		return 0;
+
+	// move the triangles in the first child to the front
+	int nleft = 0;
+	for ( int t = 0; t < count; t++ )
+	{
+		int b = clamp( (int) ( ( m_Tris[tris[t]].m_Center[best_axis] - cmins[best_axis] ) * binScale[best_axis] ), 0, BVH_NUM_BINS - 1 );
+		if ( b <= best_bin )
+		{
+			V_swap( tris[t], tris[nleft] );
+			nleft++;
+		}
+	}
+	node.m_nCount = best_axis;
+	return nleft;
+}
+
+void CBVHBuilder::BuildSubtree( CUtlVector<CacheOptimizedBVHNode> &nodes, int first, int count, int depth )
+{
+	int idx = nodes.AddToTail();
+	int nleft = Split( nodes[idx], first, count, depth );
+	if ( !nleft )
+	{
+		nodes[idx].m_nIndex = first;
+		nodes[idx].m_nCount = ( count << 2 ) | BVHNODE_LEAF;
+		return;
+	}
+
+	BuildSubtree( nodes, first, nleft, depth + 1 );
+	nodes[idx].m_nIndex = nodes.Count();
+	BuildSubtree( nodes, first + nleft, count - nleft, depth + 1 );
+}
+
+int CBVHBuilder::BuildTop( int first, int count, int depth, int nSubtreeTris )
+{
+	int top = m_Top.AddToTail();
+	m_Top[top].m_nLeft = m_Top[top].m_nRight = m_Top[top].m_nTask = -1;
+
+	int nleft = ( count > nSubtreeTris ) ? Split( m_Top[top].m_Node, first, count, depth ) : 0;
+	if ( !nleft )
+	{
+		// small enough for one thread. The task redoes the split test, with the same result.
+		int task = m_Tasks.AddToTail();
+		m_Tasks[task].m_nFirst = first;
+		m_Tasks[task].m_nCount = count;
+		m_Tasks[task].m_nDepth = depth;
+		m_Top[top].m_nTask = task;
+		return top;
+	}
+
+	int left = BuildTop( first, nleft, depth + 1, nSubtreeTris );
+	int right = BuildTop( first + nleft, count - nleft, depth + 1, nSubtreeTris );
+	m_Top[top].m_nLeft = left;
+	m_Top[top].m_nRight = right;
+	return top;
+}
+
+int __cdecl CBVHBuilder::TaskSortFunc( BVHBuildTask_t * const *lhs, BVHBuildTask_t * const *rhs )
+{
+	if ( ( *lhs )->m_nCount != ( *rhs )->m_nCount )
+		return ( *rhs )->m_nCount - ( *lhs )->m_nCount;
+	return ( *lhs )->m_nFirst - ( *rhs )->m_nFirst;
+}
+
+void CBVHBuilder::BuildTasks( void )
+{
+	for ( ;; )
+	{
+		int iTask = ThreadInterlockedIncrement( &m_nNextTask ) - 1;
+		if ( iTask >= m_TaskOrder.Count() )
+			return;
+		BVHBuildTask_t *pTask = m_TaskOrder[iTask];
+		BuildSubtree( pTask->m_Nodes, pTask->m_nFirst, pTask->m_nCount, pTask->m_nDepth );
+	}
+}
+
+unsigned CBVHBuilder::BuildTaskThread( void *pParam )
+{
+	( (CBVHBuilder *) pParam )->BuildTasks();
+	return 0;
+}
+
+// append the top node and everything below it to the tree, depth first
+void CBVHBuilder::Emit( int top )
+{
+	CUtlVector<CacheOptimizedBVHNode> &tree = m_Env.OptimizedBVHTree;
+	BVHTopNode_t const &node = m_Top[top];
+	if ( node.m_nTask != -1 )
+	{
+		CUtlVector<CacheOptimizedBVHNode> const &nodes = m_Tasks[node.m_nTask].m_Nodes;
+		int base = tree.AddMultipleToTail( nodes.Count(), nodes.Base() );
+		for ( int i = base; i < tree.Count(); i++ )
+		{
+			if ( !tree[i].IsLeaf() )
+				tree[i].m_nIndex += base;
+		}
+		return;
+	}
+
+	int idx = tree.AddToTail( node.m_Node );
+	Emit( node.m_nLeft );
+	tree[idx].m_nIndex = tree.Count();
+	Emit( node.m_nRight );
+}
+
+void CBVHBuilder::Build( int nThreads )
+{
+	int ntris = m_Env.OptimizedTriangleList.Count();
+	m_Env.OptimizedBVHTree.Purge();
+	if ( !ntris )
+	{
+		m_Env.m_MinBound.Init();
+		m_Env.m_MaxBound.Init();
+		return;
+	}
+
+	m_Tris.SetCount( ntris );
+	m_TriIndex.SetCount( ntris );
+	for ( int t = 0; t < ntris; t++ )
+	{
+		CacheOptimizedTriangle const &tri = m_Env.OptimizedTriangleList[t];
+		BVHBuildTri_t &out = m_Tris[t];
+		out.m_Mins = out.m_Maxs = tri.Vertex( 0 );
+		for ( int v = 1; v < 3; v++ )
+		{
+			VectorMin( out.m_Mins, tri.Vertex( v ), out.m_Mins );
+			VectorMax( out.m_Maxs, tri.Vertex( v ), out.m_Maxs );
+		}
+		out.m_Center = 0.5f * ( out.m_Mins + out.m_Maxs );
+		m_TriIndex[t] = t;
+	}
+
+	// split the top of the tree until there are a few subtrees per thread
+	nThreads = MAX( nThreads, 1 );
+	int nSubtreeTris = MAX( BVH_MIN_SUBTREE_TRIS, ntris / ( 4 * nThreads ) );
+	BuildTop( 0, ntris, 0, nSubtreeTris );
+
+	m_TaskOrder.SetCount( m_Tasks.Count() );
+	for ( int i = 0; i < m_Tasks.Count(); i++ )
+		m_TaskOrder[i] = &m_Tasks[i];
+	m_TaskOrder.Sort( TaskSortFunc );
+
+	// the calling thread builds too, so only nThreads - 1 extra threads are started
+	CUtlVector<ThreadHandle_t> threads;
+	for ( int i = 1; i < MIN( nThreads, m_Tasks.Count() ); i++ )
+	{
+		ThreadHandle_t hThread = CreateSimpleThread( BuildTaskThread, this );
+		if ( hThread )
+			threads.AddToTail( hThread );
+	}
+	BuildTasks();
+	for ( int i = 0; i < threads.Count(); i++ )
+	{
+		ThreadJoin( threads[i] );
+		ReleaseThreadHandle( threads[i] );
+	}
+
+	Emit( 0 );
+
+	CacheOptimizedBVHNode const &root = m_Env.OptimizedBVHTree[0];
+	m_Env.m_MinBound.Init( root.m_Mins[0], root.m_Mins[1], root.m_Mins[2] );
+	m_Env.m_MaxBound.Init( root.m_Maxs[0], root.m_Maxs[1], root.m_Maxs[2] );
+
+	// store the triangles in leaf order, so each leaf's triangles are next to each other
+	CUtlVector<CacheOptimizedTriangle> sortedTris;
+	sortedTris.SetCount( ntris );
+	for ( int t = 0; t < ntris; t++ )
+		sortedTris[t] = m_Env.OptimizedTriangleList[m_TriIndex[t]];
+	for ( int t = 0; t < ntris; t++ )
+		m_Env.OptimizedTriangleList[t] = sortedTris[t];
+	sortedTris.Purge();
+
+	if ( m_Env.TriangleColors.Count() == ntris )
+	{
+		CUtlVector<Vector> sortedColors;
+		sortedColors.SetCount( ntris );
+		for ( int t = 0; t < ntris; t++ )
+			sortedColors[t] = m_Env.TriangleColors[m_TriIndex[t]];
+		m_Env.TriangleColors.Swap( sortedColors );
+	}
+	if ( m_Env.TriangleMaterials.Count() == ntris )
+	{
+		CUtlVector<int32> sortedMaterials;
+		sortedMaterials.SetCount( ntris );
+		for ( int t = 0; t < ntris; t++ )
+			sortedMaterials[t] = m_Env.TriangleMaterials[m_TriIndex[t]];
+		m_Env.TriangleMaterials.Swap( sortedMaterials );
+	}
+}
+
+
+void RayTracingEnvironment::BuildBVH(int nThreads)
+{
+	CBVHBuilder builder( *this );
+	builder.Build( nThreads );
+}
@@ -307,25 +307,74 @@ inline void RayTracingEnvironment::FlushStreamEntry(RayStream &s,int msk)
 {
 	assert(msk>=0);
 	assert(msk<8);
-	fltx4 tmax=s.PendingRays[msk].direction.length();
-	fltx4 scl=ReciprocalSaturateSIMD(tmax);
-	s.PendingRays[msk].direction*=scl;					// normalize
-	RayTracingResult tmpresult;
-	Trace4Rays(s.PendingRays[msk],Four_Zeros,tmax,msk,&tmpresult);
-	// now, write out results
-	for(int r=0;r<4;r++)
+	RayPacket &rays=s.PendingRays[msk];
+	int cnt=s.n_in_stream[msk];
+	int width=GetKernelWidth(m_nKernel);
+	assert(cnt>0 && cnt<=width);
+	// fill in unfilled entries with dups of first
+	for(int c=cnt;c<width;c++)
 	{
-		RayTracingSingleResult *out=s.PendingStreamOutputs[msk][r];
-		out->ray_length=SubFloat( tmax, r );
-		out->surface_normal.x=tmpresult.surface_normal.X(r);
-		out->surface_normal.y=tmpresult.surface_normal.Y(r);
-		out->surface_normal.z=tmpresult.surface_normal.Z(r);
-		out->HitID=tmpresult.HitIds[r];
-		out->HitDistance=SubFloat( tmpresult.HitDistance, r );
+		rays.origin[c>>2].X(c&3) = rays.origin[0].X(0);
+		rays.origin[c>>2].Y(c&3) = rays.origin[0].Y(0);
+		rays.origin[c>>2].Z(c&3) = rays.origin[0].Z(0);
+		rays.direction[c>>2].X(c&3) = rays.direction[0].X(0);
+		rays.direction[c>>2].Y(c&3) = rays.direction[0].Y(0);
+		rays.direction[c>>2].Z(c&3) = rays.direction[0].Z(0);
+	}
+	rays.nGroups=width/4;
+	for(int g=0;g<rays.nGroups;g++)
+	{
+		rays.TMin[g]=Four_Zeros;
+		rays.TMax[g]=rays.direction[g].length();
+		fltx4 scl=ReciprocalSaturateSIMD(rays.TMax[g]);
+		rays.direction[g]*=scl;							// normalize
+	}
+	if (m_nKernel==RAYTRACE_KERNEL_SSE4)
+	{
+		FourRays tmprays;
+		tmprays.origin=rays.origin[0];
+		tmprays.direction=rays.direction[0];
+		RayTracingResult tmpresult;
+		Trace4Rays(tmprays,Four_Zeros,rays.TMax[0],msk,&tmpresult);
+		// now, write out results
+		for(int r=0;r<cnt;r++)
+		{
+			RayTracingSingleResult *out=s.PendingStreamOutputs[msk][r];
+			out->ray_length=SubFloat( rays.TMax[0], r );
+			out->surface_normal.x=tmpresult.surface_normal.X(r);
+			out->surface_normal.y=tmpresult.surface_normal.Y(r);
+			out->surface_normal.z=tmpresult.surface_normal.Z(r);
+			out->HitID=tmpresult.HitIds[r];
+			out->HitDistance=SubFloat( tmpresult.HitDistance, r );
+		}
+	}
+	else
+	{
+		// the dups are only there to keep the math well behaved. switch them off
+		ALIGN16 int32 active[RAYPACKET_MAX_RAYS] ALIGN16_POST;
+		for(int r=0;r<RAYPACKET_MAX_RAYS;r++)
+			active[r]=(r<cnt)?-1:0;
+		for(int g=0;g<rays.nGroups;g++)
+			rays.ActiveMask[g]=LoadAlignedSIMD((float *) (active+4*g));
+
+		RayPacketResult tmpresult;
+		TraceRayPacket(rays,msk,&tmpresult);
+		// now, write out results
+		for(int r=0;r<cnt;r++)
+		{
+			int g=r>>2;
+			int c=r&3;
+			RayTracingSingleResult *out=s.PendingStreamOutputs[msk][r];
+			out->ray_length=SubFloat( rays.TMax[g], c );
+			out->surface_normal.x=tmpresult.surface_normal[g].X(c);
+			out->surface_normal.y=tmpresult.surface_normal[g].Y(c);
+			out->surface_normal.z=tmpresult.surface_normal[g].Z(c);
+			out->HitID=tmpresult.HitIds[r];
+			out->HitDistance=SubFloat( tmpresult.HitDistance[g], c );
+		}
 	}
 	s.n_in_stream[msk]=0;
 }
-
 void RayTracingEnvironment::AddToRayStream(RayStream &s,
 										   Vector const &start,Vector const &end,
 										   RayTracingSingleResult *rslt_out)
@@ -336,40 +385,28 @@ void RayTracingEnvironment::AddToRayStream(RayStream &s,
 	assert(msk>=0);
 	assert(msk<8);
 	int pos=s.n_in_stream[msk];
-	assert(pos<4);
-	s.PendingRays[msk].origin.X(pos)=start.x;
-	s.PendingRays[msk].origin.Y(pos)=start.y;
-	s.PendingRays[msk].origin.Z(pos)=start.z;
-	s.PendingRays[msk].direction.X(pos)=delta.x;
-	s.PendingRays[msk].direction.Y(pos)=delta.y;
-	s.PendingRays[msk].direction.Z(pos)=delta.z;
+	assert(pos<GetKernelWidth(m_nKernel));
+	int g=pos>>2;
+	int c=pos&3;
+	s.PendingRays[msk].origin[g].X(c)=start.x;
+	s.PendingRays[msk].origin[g].Y(c)=start.y;
+	s.PendingRays[msk].origin[g].Z(c)=start.z;
+	s.PendingRays[msk].direction[g].X(c)=delta.x;
+	s.PendingRays[msk].direction[g].Y(c)=delta.y;
+	s.PendingRays[msk].direction[g].Z(c)=delta.z;
 	s.PendingStreamOutputs[msk][pos]=rslt_out;
-	if (pos==3)
+	s.n_in_stream[msk]++;
+	if (s.n_in_stream[msk]==GetKernelWidth(m_nKernel))
 	{
 		FlushStreamEntry(s,msk);
 	}
-	else
-		s.n_in_stream[msk]++;
 }
-
 void RayTracingEnvironment::FinishRayStream(RayStream &s)
 {
 	for(int msk=0;msk<8;msk++)
 	{
-		int cnt=s.n_in_stream[msk];
-		if (cnt)
+		if (s.n_in_stream[msk])
 		{
-			// fill in unfilled entries with dups of first
-			for(int c=cnt;c<4;c++)
-			{
-				s.PendingRays[msk].origin.X(c) = s.PendingRays[msk].origin.X(0);
-				s.PendingRays[msk].origin.Y(c) = s.PendingRays[msk].origin.Y(0);
-				s.PendingRays[msk].origin.Z(c) = s.PendingRays[msk].origin.Z(0);
-				s.PendingRays[msk].direction.X(c) = s.PendingRays[msk].direction.X(0);
-				s.PendingRays[msk].direction.Y(c) = s.PendingRays[msk].direction.Y(0);
-				s.PendingRays[msk].direction.Z(c) = s.PendingRays[msk].direction.Z(0);
-				s.PendingStreamOutputs[msk][c]=s.PendingStreamOutputs[msk][0];
-			}
 			FlushStreamEntry(s,msk);
 		}
 	}
@@ -0,0 +1,231 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+// $Id:$
+//
+// Wide ray packets: kernel selection, the SSE kernels, and RayTracingEnvironment::TraceRayPacket.
+
+#include "raytrace.h"
+#include "tier1/processor_detect.h"
+#include "tier1/strtools.h"
+#include "tracepacket.h"
+
+struct SSERayLanes
+{
+	typedef fltx4 Vec;
+	enum { WIDTH = 4 };
+
+	static FORCEINLINE Vec Load( const fltx4 *p, int stride ) { return p[0]; }
+	static FORCEINLINE void Store( fltx4 *p, int stride, const Vec &v ) { p[0] = v; }
+	static FORCEINLINE Vec Replicate( float f ) { return ReplicateX4( f ); }
+	static FORCEINLINE Vec ReplicateInt( int n ) { return ReplicateIX4( n ); }
+	static FORCEINLINE Vec Add( const Vec &a, const Vec &b ) { return AddSIMD( a, b ); }
+	static FORCEINLINE Vec Sub( const Vec &a, const Vec &b ) { return SubSIMD( a, b ); }
+	static FORCEINLINE Vec Mul( const Vec &a, const Vec &b ) { return MulSIMD( a, b ); }
+	static FORCEINLINE Vec Div( const Vec &a, const Vec &b ) { return DivSIMD( a, b ); }
+	static FORCEINLINE Vec Min( const Vec &a, const Vec &b ) { return MinSIMD( a, b ); }
+	static FORCEINLINE Vec Max( const Vec &a, const Vec &b ) { return MaxSIMD( a, b ); }
+	static FORCEINLINE Vec And( const Vec &a, const Vec &b ) { return AndSIMD( a, b ); }
+	static FORCEINLINE Vec AndNot( const Vec &a, const Vec &b ) { return AndNotSIMD( a, b ); }
+	static FORCEINLINE Vec Or( const Vec &a, const Vec &b ) { return OrSIMD( a, b ); }
+	static FORCEINLINE Vec CmpGt( const Vec &a, const Vec &b ) { return CmpGtSIMD( a, b ); }
+	static FORCEINLINE Vec CmpGe( const Vec &a, const Vec &b ) { return CmpGeSIMD( a, b ); }
+	static FORCEINLINE Vec CmpLt( const Vec &a, const Vec &b ) { return CmpLtSIMD( a, b ); }
+	static FORCEINLINE Vec CmpLe( const Vec &a, const Vec &b ) { return CmpLeSIMD( a, b ); }
+	static FORCEINLINE Vec ReciprocalSaturate( const Vec &a ) { return ReciprocalSaturateSIMD( a ); }
+	static FORCEINLINE bool AnyNegative( const Vec &a ) { return IsAnyNegative( a ); }
+};
+
+RayPacketKernelFn_t g_SSERayPacketKernels[RAYPACKET_MAX_GROUPS] =
+{
+	TraceRayPacketKernel< SSERayLanes, 1 >,
+	TraceRayPacketKernel< SSERayLanes, 2 >,
+	TraceRayPacketKernel< SSERayLanes, 3 >,
+	TraceRayPacketKernel< SSERayLanes, 4 >,
+};
+
+RayPacketKernelFn_t g_SSERayPacketBVHKernels[RAYPACKET_MAX_GROUPS] =
+{
+	TraceRayPacketBVHKernel< SSERayLanes, 1 >,
+	TraceRayPacketBVHKernel< SSERayLanes, 2 >,
+	TraceRayPacketBVHKernel< SSERayLanes, 3 >,
+	TraceRayPacketBVHKernel< SSERayLanes, 4 >,
+};
+
+
+static const char *s_pKernelNames[NUM_RAYTRACE_KERNELS] =
+{
+	"sse4",
+	"sse8",
+	"sse16",
+	"avx8",
+	"avx16",
+};
+
+static bool IsAVXKernel( RayTraceKernel_t kernel )
+{
+	return ( kernel == RAYTRACE_KERNEL_AVX8 ) || ( kernel == RAYTRACE_KERNEL_AVX16 );
+}
+
+bool RayTracingEnvironment::IsKernelSupported( RayTraceKernel_t kernel )
+{
+	if ( ( kernel < 0 ) || ( kernel >= NUM_RAYTRACE_KERNELS ) )
+		return false;
+	if ( IsAVXKernel( kernel ) )
+	{
+		static int s_nHasAVX = -1;
+		if ( s_nHasAVX < 0 )
+			s_nHasAVX = CheckAVXTechnology() ? 1 : 0;
+		return ( s_nHasAVX != 0 );
+	}
+	return true;
+}
+
+const char *RayTracingEnvironment::GetKernelName( RayTraceKernel_t kernel )
+{
+	if ( ( kernel < 0 ) || ( kernel >= NUM_RAYTRACE_KERNELS ) )
+		return "unknown";
+	return s_pKernelNames[kernel];
+}
+
+RayTraceKernel_t RayTracingEnvironment::FindKernel( const char *pName )
+{
+	for ( int k = 0; k < NUM_RAYTRACE_KERNELS; k++ )
+	{
+		if ( !V_stricmp( pName, s_pKernelNames[k] ) )
+			return (RayTraceKernel_t) k;
+	}
+	return NUM_RAYTRACE_KERNELS;
+}
+
+int RayTracingEnvironment::GetKernelWidth( RayTraceKernel_t kernel )
+{
+	switch ( kernel )
+	{
+	case RAYTRACE_KERNEL_SSE8:
+	case RAYTRACE_KERNEL_AVX8:
+		return 8;
+	case RAYTRACE_KERNEL_SSE16:
+	case RAYTRACE_KERNEL_AVX16:
+		return 16;
+	default:
+		return 4;
+	}
+}
+
+bool RayTracingEnvironment::SetKernel( RayTraceKernel_t kernel )
+{
+	if ( !IsKernelSupported( kernel ) )
+		return false;
+	m_nKernel = kernel;
+	return true;
+}
+
+
+int RayPacket::CalculateDirectionSignMask( void ) const
+{
+	// like FourRays, this only looks at the sign bits
+	int ret = -1;
+	for ( int g = 0; g < nGroups; g++ )
+	{
+		int32 const *active = (int32 const *) &ActiveMask[g];
+		for ( int r = 0; r < 4; r++ )
+		{
+			if ( !active[r] )
+				continue;
+			int msk = ( ( *(int32 const *) &direction[g].X( r ) ) < 0 ? 1 : 0 ) |
+				( ( *(int32 const *) &direction[g].Y( r ) ) < 0 ? 2 : 0 ) |
+				( ( *(int32 const *) &direction[g].Z( r ) ) < 0 ? 4 : 0 );
+			if ( ret == -1 )
+				ret = msk;
+			else if ( ret != msk )
+				return -1;
+		}
+	}
+	return ( ret == -1 ) ? 0 : ret;
+}
+
+
+void RayTracingEnvironment::TraceRayPacket( const RayPacket &rays, int DirectionSignMask, RayPacketResult *rslt_out,
+											int32 skip_id )
+{
+	assert( ( rays.nGroups >= 1 ) && ( rays.nGroups <= RAYPACKET_MAX_GROUPS ) );
+
+	bool bBVH = ( m_nAccel == RAYTRACE_ACCEL_BVH );
+	RayPacketKernelFn_t pfnKernel = NULL;
+	if ( IsAVXKernel( m_nKernel ) )
+		pfnKernel = ( bBVH ? g_AVXRayPacketBVHKernels : g_AVXRayPacketKernels )[rays.nGroups - 1];
+	if ( !pfnKernel )
+		pfnKernel = ( bBVH ? g_SSERayPacketBVHKernels : g_SSERayPacketKernels )[rays.nGroups - 1];
+
+	( *pfnKernel )( *this, rays, DirectionSignMask, rslt_out, skip_id );
+}
+
+void RayTracingEnvironment::TraceRayPacket( const RayPacket &rays, RayPacketResult *rslt_out, int32 skip_id )
+{
+	int msk = rays.CalculateDirectionSignMask();
+	if ( msk != -1 )
+	{
+		TraceRayPacket( rays, msk, rslt_out, skip_id );
+		return;
+	}
+	if ( m_nAccel == RAYTRACE_ACCEL_BVH )
+	{
+		// the bvh doesn't need the rays to agree in direction, the mask only orders the children
+		TraceRayPacket( rays, 0, rslt_out, skip_id );
+		return;
+	}
+
+	// the active rays point in different directions. trace the rays for each combination of
+	// direction signs in turn, with all other rays switched off.
+	ALIGN16 int32 raySignMask[RAYPACKET_MAX_RAYS] ALIGN16_POST;
+	int nRays = 4 * rays.nGroups;
+	for ( int i = 0; i < nRays; i++ )
+	{
+		int g = i >> 2, r = i & 3;
+		if ( ( (int32 const *) &rays.ActiveMask[g] )[r] )
+		{
+			raySignMask[i] = ( ( *(int32 const *) &rays.direction[g].X( r ) ) < 0 ? 1 : 0 ) |
+				( ( *(int32 const *) &rays.direction[g].Y( r ) ) < 0 ? 2 : 0 ) |
+				( ( *(int32 const *) &rays.direction[g].Z( r ) ) < 0 ? 4 : 0 );
+		}
+		else
+		{
+			raySignMask[i] = -1;
+		}
+		rslt_out->HitIds[i] = -1;
+	}
+	for ( int g = 0; g < rays.nGroups; g++ )
+	{
+		rslt_out->HitDistance[g] = ReplicateX4( 1.0e23 );
+		rslt_out->surface_normal[g].DuplicateVector( Vector( 0, 0, 0 ) );
+	}
+
+	RayPacket subset = rays;
+	RayPacketResult tmpresult;
+	for ( int trace_msk = 0; trace_msk < 8; trace_msk++ )
+	{
+		bool bAny = false;
+		for ( int i = 0; i < nRays; i++ )
+		{
+			bool bMatch = ( raySignMask[i] == trace_msk );
+			( (int32 *) &subset.ActiveMask[i >> 2] )[i & 3] = bMatch ? -1 : 0;
+			bAny |= bMatch;
+		}
+		if ( !bAny )
+			continue;
+
+		TraceRayPacket( subset, trace_msk, &tmpresult, skip_id );
+
+		// now, move results to proper place
+		for ( int i = 0; i < nRays; i++ )
+		{
+			if ( raySignMask[i] != trace_msk )
+				continue;
+			int g = i >> 2, r = i & 3;
+			rslt_out->HitIds[i] = tmpresult.HitIds[i];
+			SubFloat( rslt_out->HitDistance[g], r ) = SubFloat( tmpresult.HitDistance[g], r );
+			rslt_out->surface_normal[g].X( r ) = tmpresult.surface_normal[g].X( r );
+			rslt_out->surface_normal[g].Y( r ) = tmpresult.surface_normal[g].Y( r );
+			rslt_out->surface_normal[g].Z( r ) = tmpresult.surface_normal[g].Z( r );
+		}
+	}
+}
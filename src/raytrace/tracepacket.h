@@ -0,0 +1,378 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+// $Id:$
+//
+// The wide packet traversal kernels used by RayTracingEnvironment::TraceRayPacket. They are written
+// once against a "lanes" class which supplies the vector type and operations, and are instantiated
+// for each instruction set in its own translation unit, so that the AVX version can be compiled
+// for AVX without letting AVX instructions leak into code that runs on every processor.
+//
+// A lanes class provides:
+//   typedef ... Vec;				// WIDTH floats
+//   enum { WIDTH = 4 or 8 };
+//   Load( p, stride ), Store( p, stride, v ): move WIDTH/4 fltx4s, 'stride' fltx4s apart
+//   Replicate, ReplicateInt, Add, Sub, Mul, Div, Min, Max, And, AndNot (~a&b), Or,
+//   CmpGt, CmpGe, CmpLt, CmpLe, ReciprocalSaturate, AnyNegative
+
+#ifndef TRACEPACKET_H
+#define TRACEPACKET_H
+
+#define PACKET_MAILBOX_HASH_SIZE 256
+#define PACKET_NODE_STACK_LEN 128							// a path through the kd-tree is never
+															// longer than MAX_TREE_DEPTH+2 nodes, and
+															// the bvh is never deeper than this
+
+typedef void (*RayPacketKernelFn_t)( RayTracingEnvironment &env, const RayPacket &rays, int DirectionSignMask,
+									 RayPacketResult *rslt_out, int32 skip_id );
+
+// The rays of a packet and their closest hits so far, Lanes::WIDTH*N rays in all.
+template< class Lanes, int N >
+struct PacketRays
+{
+	typedef typename Lanes::Vec Vec;
+	enum { GROUPS_PER_VEC = Lanes::WIDTH / 4 };
+
+	Vec org[3][N], dir[3][N], invDir[3][N];
+	Vec rayTMin[N], rayTMax[N], valid[N];
+	Vec hitDistance[N], hitIds[N], normal[3][N];
+
+	FORCEINLINE void Load( const RayPacket &rays )
+	{
+		Vec zeros = Lanes::Replicate( 0.0f );
+		Vec ones = Lanes::Replicate( 1.0f );
+		for ( int n = 0; n < N; n++ )
+		{
+			int g = n * GROUPS_PER_VEC;
+			valid[n] = Lanes::Load( &rays.ActiveMask[g], 1 );
+
+			// inactive rays may hold garbage. give them something harmless
+			for ( int c = 0; c < 3; c++ )
+			{
+				org[c][n] = Lanes::And( valid[n], Lanes::Load( &rays.origin[g].x + c, 3 ) );
+				dir[c][n] = Lanes::Or( Lanes::And( valid[n], Lanes::Load( &rays.direction[g].x + c, 3 ) ),
+									   Lanes::AndNot( valid[n], ones ) );
+				invDir[c][n] = Lanes::ReciprocalSaturate( dir[c][n] );
+				normal[c][n] = zeros;
+			}
+
+			// and an empty extent, so they never take part in traversal
+			rayTMin[n] = Lanes::Or( Lanes::And( valid[n], Lanes::Load( &rays.TMin[g], 1 ) ), Lanes::AndNot( valid[n], ones ) );
+			rayTMax[n] = Lanes::And( valid[n], Lanes::Load( &rays.TMax[g], 1 ) );
+
+			hitDistance[n] = Lanes::Replicate( 1.0e23f );
+			hitIds[n] = Lanes::ReplicateInt( -1 );
+		}
+	}
+
+	// intersect one triangle with every ray, keeping the closest hit of each. Unlike Trace4Rays,
+	// hits further away than the ray's TMax are ignored.
+	FORCEINLINE void IntersectTriangle( TriIntersectData_t const *tri, int32 tnum )
+	{
+		Vec ones = Lanes::Replicate( 1.0f );
+		Vec epsilons = Lanes::Replicate( 1.0e-10f );
+		Vec negativeEpsilons = Lanes::Replicate( -1.0e-10f );
+
+		Vec Nx = Lanes::Replicate( tri->m_flNx );
+		Vec Ny = Lanes::Replicate( tri->m_flNy );
+		Vec Nz = Lanes::Replicate( tri->m_flNz );
+		Vec D = Lanes::Replicate( tri->m_flD );
+		Vec E[6];
+		for ( int e = 0; e < 6; e++ )
+		{
+			E[e] = Lanes::Replicate( tri->m_ProjectedEdgeEquations[e] );
+		}
+		Vec replicated_n = Lanes::ReplicateInt( tnum );
+
+		for ( int n = 0; n < N; n++ )
+		{
+			// compute plane intersection
+			Vec DDotN = Lanes::Add( Lanes::Add( Lanes::Mul( dir[0][n], Nx ), Lanes::Mul( dir[1][n], Ny ) ), Lanes::Mul( dir[2][n], Nz ) );
+			// mask off zero or near zero (ray parallel to surface)
+			Vec did_hit = Lanes::And( valid[n], Lanes::Or( Lanes::CmpGt( DDotN, epsilons ), Lanes::CmpLt( DDotN, negativeEpsilons ) ) );
+
+			Vec ODotN = Lanes::Add( Lanes::Add( Lanes::Mul( org[0][n], Nx ), Lanes::Mul( org[1][n], Ny ) ), Lanes::Mul( org[2][n], Nz ) );
+			Vec isect_t = Lanes::Div( Lanes::Sub( D, ODotN ), DDotN );
+
+			// now, we have the distance to the plane. lets update our mask
+			did_hit = Lanes::And( did_hit, Lanes::CmpGt( isect_t, epsilons ) );
+			did_hit = Lanes::And( did_hit, Lanes::CmpLt( isect_t, hitDistance[n] ) );
+			did_hit = Lanes::And( did_hit, Lanes::CmpLe( isect_t, rayTMax[n] ) );
+			if ( !Lanes::AnyNegative( did_hit ) )
+				continue;
+
+			// now, check 3 edges
+			Vec hitc1 = Lanes::Add( org[tri->m_nCoordSelect0][n], Lanes::Mul( isect_t, dir[tri->m_nCoordSelect0][n] ) );
+			Vec hitc2 = Lanes::Add( org[tri->m_nCoordSelect1][n], Lanes::Mul( isect_t, dir[tri->m_nCoordSelect1][n] ) );
+
+			// do barycentric coordinate check
+			Vec B0 = Lanes::Add( Lanes::Add( Lanes::Mul( E[0], hitc1 ), Lanes::Mul( E[1], hitc2 ) ), E[2] );
+			did_hit = Lanes::And( did_hit, Lanes::CmpGe( B0, epsilons ) );
+
+			Vec B1 = Lanes::Add( Lanes::Add( Lanes::Mul( E[3], hitc1 ), Lanes::Mul( E[4], hitc2 ) ), E[5] );
+			did_hit = Lanes::And( did_hit, Lanes::CmpGe( B1, epsilons ) );
+
+			Vec B2 = Lanes::Add( B1, B0 );
+			did_hit = Lanes::And( did_hit, Lanes::CmpLe( B2, ones ) );
+
+			if ( !Lanes::AnyNegative( did_hit ) )
+				continue;
+
+			// now, set the hit_id and closest_hit fields for any enabled rays
+			hitIds[n] = Lanes::Or( Lanes::And( replicated_n, did_hit ), Lanes::AndNot( did_hit, hitIds[n] ) );
+			hitDistance[n] = Lanes::Or( Lanes::And( isect_t, did_hit ), Lanes::AndNot( did_hit, hitDistance[n] ) );
+			normal[0][n] = Lanes::Or( Lanes::And( Nx, did_hit ), Lanes::AndNot( did_hit, normal[0][n] ) );
+			normal[1][n] = Lanes::Or( Lanes::And( Ny, did_hit ), Lanes::AndNot( did_hit, normal[1][n] ) );
+			normal[2][n] = Lanes::Or( Lanes::And( Nz, did_hit ), Lanes::AndNot( did_hit, normal[2][n] ) );
+		}
+	}
+
+	FORCEINLINE void Store( RayPacketResult *rslt_out ) const
+	{
+		for ( int n = 0; n < N; n++ )
+		{
+			int g = n * GROUPS_PER_VEC;
+			Lanes::Store( &rslt_out->HitDistance[g], 1, hitDistance[n] );
+			Lanes::Store( ( (fltx4 *) rslt_out->HitIds ) + g, 1, hitIds[n] );
+			for ( int c = 0; c < 3; c++ )
+			{
+				Lanes::Store( &rslt_out->surface_normal[g].x + c, 3, normal[c][n] );
+			}
+		}
+	}
+};
+
+// Trace Lanes::WIDTH*N rays through the kd-tree, starting at rays.origin[0]. Mirrors Trace4Rays,
+// except that rays which are not in rays.ActiveMask are never traversed and never report hits.
+template< class Lanes, int N >
+void TraceRayPacketKernel( RayTracingEnvironment &env, const RayPacket &rays, int DirectionSignMask,
+						   RayPacketResult *rslt_out, int32 skip_id )
+{
+	typedef typename Lanes::Vec Vec;
+
+	PacketRays< Lanes, N > R;
+	R.Load( rays );
+
+	Vec TMin[N], TMax[N];
+	bool bAnyActive = false;
+	for ( int n = 0; n < N; n++ )
+	{
+		TMin[n] = R.rayTMin[n];
+		TMax[n] = R.rayTMax[n];
+
+		// now, clip rays against bounding box
+		for ( int c = 0; c < 3; c++ )
+		{
+			Vec isect_min_t = Lanes::Mul( Lanes::Sub( Lanes::Replicate( env.m_MinBound[c] ), R.org[c][n] ), R.invDir[c][n] );
+			Vec isect_max_t = Lanes::Mul( Lanes::Sub( Lanes::Replicate( env.m_MaxBound[c] ), R.org[c][n] ), R.invDir[c][n] );
+			TMin[n] = Lanes::Max( TMin[n], Lanes::Min( isect_min_t, isect_max_t ) );
+			TMax[n] = Lanes::Min( TMax[n], Lanes::Max( isect_min_t, isect_max_t ) );
+		}
+		bAnyActive |= Lanes::AnyNegative( Lanes::CmpLe( TMin[n], TMax[n] ) );
+	}
+
+	if ( bAnyActive )
+	{
+		int32 mailboxids[PACKET_MAILBOX_HASH_SIZE];			// used to avoid redundant triangle tests
+		memset( mailboxids, 0xff, sizeof( mailboxids ) );
+
+		int front_idx[3], back_idx[3];						// based on ray direction, whether to
+															// visit left or right node first
+		for ( int c = 0; c < 3; c++ )
+		{
+			back_idx[c] = ( DirectionSignMask & ( 1 << c ) ) ? 0 : 1;
+			front_idx[c] = 1 - back_idx[c];
+		}
+
+		struct PacketNodeToVisit
+		{
+			CacheOptimizedKDNode const *node;
+			Vec TMin[N];
+			Vec TMax[N];
+		};
+
+		PacketNodeToVisit NodeQueue[PACKET_NODE_STACK_LEN];
+		PacketNodeToVisit *stack_ptr = &NodeQueue[PACKET_NODE_STACK_LEN];
+		CacheOptimizedKDNode const *CurNode = &( env.OptimizedKDTree[0] );
+
+		while ( 1 )
+		{
+			while ( CurNode->NodeType() != KDNODE_STATE_LEAF )		// traverse until next leaf
+			{
+				int split_plane_number = CurNode->NodeType();
+				CacheOptimizedKDNode const *FrontChild = &( env.OptimizedKDTree[CurNode->LeftChild()] );
+				Vec split = Lanes::Replicate( CurNode->SplittingPlaneValue );
+
+				Vec dist_to_sep_plane[N];						// dist=(split-org)/dir
+				bool bHitsFront = false, bHitsBack = false;
+				for ( int n = 0; n < N; n++ )
+				{
+					dist_to_sep_plane[n] = Lanes::Mul( Lanes::Sub( split, R.org[split_plane_number][n] ), R.invDir[split_plane_number][n] );
+					Vec active = Lanes::CmpLe( TMin[n], TMax[n] );	// mask of which rays are active
+					bHitsFront |= Lanes::AnyNegative( Lanes::And( active, Lanes::CmpGe( dist_to_sep_plane[n], TMin[n] ) ) );
+					bHitsBack |= Lanes::AnyNegative( Lanes::And( active, Lanes::CmpLe( dist_to_sep_plane[n], TMax[n] ) ) );
+				}
+
+				if ( !bHitsFront )
+				{
+					// missed the front. only traverse back
+					CurNode = FrontChild + back_idx[split_plane_number];
+					for ( int n = 0; n < N; n++ )
+					{
+						TMin[n] = Lanes::Max( TMin[n], dist_to_sep_plane[n] );
+					}
+				}
+				else if ( !bHitsBack )
+				{
+					// missed the back - only need to traverse front node
+					CurNode = FrontChild + front_idx[split_plane_number];
+					for ( int n = 0; n < N; n++ )
+					{
+						TMax[n] = Lanes::Min( TMax[n], dist_to_sep_plane[n] );
+					}
+				}
+				else
+				{
+					// at least some rays hit both nodes.
+					// must push far, traverse near
+					assert( stack_ptr > NodeQueue );
+					--stack_ptr;
+					stack_ptr->node = FrontChild + back_idx[split_plane_number];
+					for ( int n = 0; n < N; n++ )
+					{
+						stack_ptr->TMin[n] = Lanes::Max( TMin[n], dist_to_sep_plane[n] );
+						stack_ptr->TMax[n] = TMax[n];
+						TMax[n] = Lanes::Min( TMax[n], dist_to_sep_plane[n] );
+					}
+					CurNode = FrontChild + front_idx[split_plane_number];
+				}
+			}
+
+			// hit a leaf! must do intersection check
+			int ntris = CurNode->NumberOfTrianglesInLeaf();
+			if ( ntris )
+			{
+				int32 const *tlist = &( env.TriangleIndexList[CurNode->TriangleIndexStart()] );
+				do
+				{
+					int tnum = *( tlist++ );
+					// check mailbox
+					int mbox_slot = tnum & ( PACKET_MAILBOX_HASH_SIZE - 1 );
+					TriIntersectData_t const *tri = &( env.OptimizedTriangleList[tnum].m_Data.m_IntersectData );
+					if ( ( mailboxids[mbox_slot] == tnum ) || ( tri->m_nTriangleID == skip_id ) )
+						continue;
+
+					mailboxids[mbox_slot] = tnum;
+					R.IntersectTriangle( tri, tnum );
+				} while ( --ntris );
+
+				// now, check if all rays have terminated
+				bool bAnyRemaining = false;
+				for ( int n = 0; n < N; n++ )
+				{
+					bAnyRemaining |= Lanes::AnyNegative( Lanes::And( R.valid[n], Lanes::CmpLe( TMax[n], R.hitDistance[n] ) ) );
+				}
+				if ( !bAnyRemaining )
+					break;
+			}
+
+			if ( stack_ptr == &NodeQueue[PACKET_NODE_STACK_LEN] )
+				break;
+
+			// pop stack!
+			CurNode = stack_ptr->node;
+			for ( int n = 0; n < N; n++ )
+			{
+				TMin[n] = stack_ptr->TMin[n];
+				TMax[n] = stack_ptr->TMax[n];
+			}
+			stack_ptr++;
+		}
+	}
+
+	R.Store( rslt_out );
+}
+
+// Trace Lanes::WIDTH*N rays through the bvh. Same results as TraceRayPacketKernel, but
+// DirectionSignMask only picks which child is visited first, so it needn't match every ray.
+template< class Lanes, int N >
+void TraceRayPacketBVHKernel( RayTracingEnvironment &env, const RayPacket &rays, int DirectionSignMask,
+							  RayPacketResult *rslt_out, int32 skip_id )
+{
+	typedef typename Lanes::Vec Vec;
+
+	PacketRays< Lanes, N > R;
+	R.Load( rays );
+
+	// slab distances are box*(1/dir)-org*(1/dir), so only one multiply per plane is needed
+	Vec orgOverDir[3][N];
+	for ( int n = 0; n < N; n++ )
+	{
+		for ( int c = 0; c < 3; c++ )
+		{
+			orgOverDir[c][n] = Lanes::Mul( R.org[c][n], R.invDir[c][n] );
+		}
+	}
+
+	int32 NodeStack[PACKET_NODE_STACK_LEN];
+	int stack_size = 0;
+	int CurNode = env.OptimizedBVHTree.Count() ? 0 : -1;
+	while ( CurNode >= 0 )
+	{
+		CacheOptimizedBVHNode const *node = &( env.OptimizedBVHTree[CurNode] );
+
+		// clip the rays against the node. rays that already hit something closer than the node,
+		// and inactive rays, whose extent is empty, don't enter it.
+		bool bHitsNode = false;
+		for ( int n = 0; n < N; n++ )
+		{
+			Vec tnear = R.rayTMin[n];
+			Vec tfar = Lanes::Min( R.rayTMax[n], R.hitDistance[n] );
+			for ( int c = 0; c < 3; c++ )
+			{
+				Vec t0 = Lanes::Sub( Lanes::Mul( Lanes::Replicate( node->m_Mins[c] ), R.invDir[c][n] ), orgOverDir[c][n] );
+				Vec t1 = Lanes::Sub( Lanes::Mul( Lanes::Replicate( node->m_Maxs[c] ), R.invDir[c][n] ), orgOverDir[c][n] );
+				tnear = Lanes::Max( tnear, Lanes::Min( t0, t1 ) );
+				tfar = Lanes::Min( tfar, Lanes::Max( t0, t1 ) );
+			}
+			bHitsNode |= Lanes::AnyNegative( Lanes::And( R.valid[n], Lanes::CmpLe( tnear, tfar ) ) );
+		}
+
+		if ( bHitsNode )
+		{
+			if ( !node->IsLeaf() )
+			{
+				// visit the child on the near side first
+				int NearChild = CurNode + 1;
+				int FarChild = node->SecondChild();
+				if ( DirectionSignMask & ( 1 << node->SplitAxis() ) )
+					V_swap( NearChild, FarChild );
+				assert( stack_size < PACKET_NODE_STACK_LEN );
+				NodeStack[stack_size++] = FarChild;
+				CurNode = NearChild;
+				continue;
+			}
+
+			// leaf. the triangles of a leaf are stored together, so no mailbox is needed
+			int tnum = node->TriangleIndexStart();
+			int tend = tnum + node->NumberOfTrianglesInLeaf();
+			for ( ; tnum < tend; tnum++ )
+			{
+				TriIntersectData_t const *tri = &( env.OptimizedTriangleList[tnum].m_Data.m_IntersectData );
+				if ( tri->m_nTriangleID != skip_id )
+					R.IntersectTriangle( tri, tnum );
+			}
+		}
+
+		CurNode = stack_size ? NodeStack[--stack_size] : -1;
+	}
+
+	R.Store( rslt_out );
+}
+
+// The kernels for each packet size, indexed by the number of FourVectors groups minus one.
+// NULL where the instruction set has no kernel for that size.
+extern RayPacketKernelFn_t g_SSERayPacketKernels[RAYPACKET_MAX_GROUPS];
+extern RayPacketKernelFn_t g_AVXRayPacketKernels[RAYPACKET_MAX_GROUPS];
+extern RayPacketKernelFn_t g_SSERayPacketBVHKernels[RAYPACKET_MAX_GROUPS];
+extern RayPacketKernelFn_t g_AVXRayPacketBVHKernels[RAYPACKET_MAX_GROUPS];
+
+#endif // TRACEPACKET_H
@@ -0,0 +1,79 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+// $Id:$
+//
+// AVX ray packet kernels. Only called when CheckAVXTechnology() reports AVX support.
+//
+// Everything shared with the rest of the module is included before AVX code generation is turned
+// on, so only the kernels themselves are built with AVX instructions.
+
+#include "raytrace.h"
+#include <immintrin.h>
+
+#if defined( __GNUC__ )
+#pragma GCC push_options
+#pragma GCC target( "avx" )
+#endif
+
+#include "tracepacket.h"
+
+struct AVXRayLanes
+{
+	typedef __m256 Vec;
+	enum { WIDTH = 8 };
+
+	static FORCEINLINE Vec Load( const fltx4 *p, int stride )
+	{
+		return _mm256_insertf128_ps( _mm256_castps128_ps256( p[0] ), p[stride], 1 );
+	}
+	static FORCEINLINE void Store( fltx4 *p, int stride, const Vec &v )
+	{
+		p[0] = _mm256_castps256_ps128( v );
+		p[stride] = _mm256_extractf128_ps( v, 1 );
+	}
+	static FORCEINLINE Vec Replicate( float f ) { return _mm256_set1_ps( f ); }
+	static FORCEINLINE Vec ReplicateInt( int n ) { return _mm256_castsi256_ps( _mm256_set1_epi32( n ) ); }
+	static FORCEINLINE Vec Add( const Vec &a, const Vec &b ) { return _mm256_add_ps( a, b ); }
+	static FORCEINLINE Vec Sub( const Vec &a, const Vec &b ) { return _mm256_sub_ps( a, b ); }
+	static FORCEINLINE Vec Mul( const Vec &a, const Vec &b ) { return _mm256_mul_ps( a, b ); }
+	static FORCEINLINE Vec Div( const Vec &a, const Vec &b ) { return _mm256_div_ps( a, b ); }
+	static FORCEINLINE Vec Min( const Vec &a, const Vec &b ) { return _mm256_min_ps( a, b ); }
+	static FORCEINLINE Vec Max( const Vec &a, const Vec &b ) { return _mm256_max_ps( a, b ); }
+	static FORCEINLINE Vec And( const Vec &a, const Vec &b ) { return _mm256_and_ps( a, b ); }
+	static FORCEINLINE Vec AndNot( const Vec &a, const Vec &b ) { return _mm256_andnot_ps( a, b ); }
+	static FORCEINLINE Vec Or( const Vec &a, const Vec &b ) { return _mm256_or_ps( a, b ); }
+	static FORCEINLINE Vec CmpGt( const Vec &a, const Vec &b ) { return _mm256_cmp_ps( a, b, _CMP_GT_OS ); }
+	static FORCEINLINE Vec CmpGe( const Vec &a, const Vec &b ) { return _mm256_cmp_ps( a, b, _CMP_GE_OS ); }
+	static FORCEINLINE Vec CmpLt( const Vec &a, const Vec &b ) { return _mm256_cmp_ps( a, b, _CMP_LT_OS ); }
+	static FORCEINLINE Vec CmpLe( const Vec &a, const Vec &b ) { return _mm256_cmp_ps( a, b, _CMP_LE_OS ); }
+	static FORCEINLINE bool AnyNegative( const Vec &a ) { return _mm256_movemask_ps( a ) != 0; }
+
+	// same as ReciprocalSaturateSIMD: 1/0 gives a big but not infinite result, and the estimate
+	// gets one newton iteration
+	static FORCEINLINE Vec ReciprocalSaturate( const Vec &a )
+	{
+		Vec zero_mask = _mm256_cmp_ps( a, _mm256_setzero_ps(), _CMP_EQ_OQ );
+		Vec ret = _mm256_or_ps( a, _mm256_and_ps( _mm256_set1_ps( FLT_EPSILON ), zero_mask ) );
+		Vec est = _mm256_rcp_ps( ret );
+		return _mm256_sub_ps( _mm256_add_ps( est, est ), _mm256_mul_ps( ret, _mm256_mul_ps( est, est ) ) );
+	}
+};
+
+RayPacketKernelFn_t g_AVXRayPacketKernels[RAYPACKET_MAX_GROUPS] =
+{
+	NULL,
+	TraceRayPacketKernel< AVXRayLanes, 1 >,
+	NULL,
+	TraceRayPacketKernel< AVXRayLanes, 2 >,
+};
+
+RayPacketKernelFn_t g_AVXRayPacketBVHKernels[RAYPACKET_MAX_GROUPS] =
+{
+	NULL,
+	TraceRayPacketBVHKernel< AVXRayLanes, 1 >,
+	NULL,
+	TraceRayPacketBVHKernel< AVXRayLanes, 2 >,
+};
+
+#if defined( __GNUC__ )
+#pragma GCC pop_options
+#endif
@@ -30,6 +30,7 @@
 #include "utlqueue.h"
 #include "UtlSortVector.h"
 #include "convar.h"
+#include "vstdlib/jobthread.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include <tier0/memdbgon.h>
@@ -129,22 +130,22 @@ private:
 class CKeyErrorContext
 {
 public:
-	CKeyErrorContext( KeyValues *pKv )
+	CKeyErrorContext( CKeyValuesErrorStack &errorStack, KeyValues *pKv ) : m_errorStack( errorStack )
 	{
 		Init( pKv->GetNameSymbol() );
 	}
 
 	~CKeyErrorContext()
 	{
-		g_KeyValuesErrorStack.Pop();
+		m_errorStack.Pop();
 	}
-	CKeyErrorContext( int symName )
+	CKeyErrorContext( CKeyValuesErrorStack &errorStack, int symName ) : m_errorStack( errorStack )
 	{
 		Init( symName );
 	}
 	void Reset( int symName )
 	{
-		g_KeyValuesErrorStack.Reset( m_stackLevel, symName );
+		m_errorStack.Reset( m_stackLevel, symName );
 	}
 	int GetStackLevel() const
 	{
@@ -153,12 +154,458 @@ public:
 private:
 	void Init( int symName )
 	{
-		m_stackLevel = g_KeyValuesErrorStack.Push( symName );
+		m_stackLevel = m_errorStack.Push( symName );
 	}
 
+	CKeyValuesErrorStack &m_errorStack;
 	int m_stackLevel;
 };
 
+
+//-----------------------------------------------------------------------------
+// Purpose: What a value token holds, see ClassifyKeyValue
+//-----------------------------------------------------------------------------
+struct KeyValuesNumber_t
+{
+	int m_iDataType;		// TYPE_STRING, TYPE_INT, TYPE_FLOAT or TYPE_UINT64
+	union
+	{
+		int m_iValue;
+		float m_flValue;
+		uint64 m_ulValue;
+	};
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: Works out whether a value token is an int, a float, a 64 bit hex
+//			value or a string
+//-----------------------------------------------------------------------------
+static void ClassifyKeyValue( const char *value, KeyValuesNumber_t &number )
+{
+	number.m_ulValue = 0;
+
+	// nothing starting with any other letter scans as a number
+	char c = *value;
+	if ( c == 0 || ( ( ( c >= 'a' && c <= 'z' ) || ( c >= 'A' && c <= 'Z' ) ) && c != 'i' && c != 'I' && c != 'n' && c != 'N' ) )
+	{
+		number.m_iDataType = KeyValues::TYPE_STRING;
+		return;
+	}
+
+	int len = Q_strlen( value );
+
+	// Here, let's determine if we got a float or an int....
+	char* pIEnd;	// pos where int scan ended
+	char* pFEnd;	// pos where float scan ended
+	const char* pSEnd = value + len ; // pos where token ends
+
+	int ival = strtol( value, &pIEnd, 10 );
+	float fval = (float)strtod( value, &pFEnd );
+	bool bOverflow = ( ival == LONG_MAX || ival == LONG_MIN ) && errno == ERANGE;
+#ifdef POSIX
+	// strtod supports hex representation in strings under posix but we DON'T
+	// want that support in keyvalues, so undo it here if needed
+	if ( len > 1 &&  tolower(value[1]) == 'x' )
+	{
+		fval = 0.0f;
+		pFEnd = (char *)value;
+	}
+#endif
+
+	if ( ( 18 == len ) && ( value[0] == '0' ) && ( value[1] == 'x' ) )
+	{
+		// an 18-byte value prefixed with "0x" (followed by 16 hex digits) is an int64 value
+		int64 retVal = 0;
+		for( int i=2; i < 2 + 16; i++ )
+		{
+			char digit = value[i];
+			if ( digit >= 'a' ) 
+				digit -= 'a' - ( '9' + 1 );
+			else
+				if ( digit >= 'A' )
+					digit -= 'A' - ( '9' + 1 );
+			retVal = ( retVal * 16 ) + ( digit - '0' );
+		}
+		number.m_ulValue = retVal;
+		number.m_iDataType = KeyValues::TYPE_UINT64;
+	}
+	else if ( (pFEnd > pIEnd) && (pFEnd == pSEnd) )
+	{
+		number.m_flValue = fval; 
+		number.m_iDataType = KeyValues::TYPE_FLOAT;
+	}
+	else if (pIEnd == pSEnd && !bOverflow)
+	{
+		number.m_iValue = ival; 
+		number.m_iDataType = KeyValues::TYPE_INT;
+	}
+	else
+	{
+		number.m_iDataType = KeyValues::TYPE_STRING;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: A token read ahead of building the tree, see CKeyValuesTokenReader::Lex
+//-----------------------------------------------------------------------------
+struct KeyValuesToken_t
+{
+	const char *m_pToken;
+	bool m_bQuoted;
+	bool m_bConditional;
+	bool m_bValid;			// whether the reader was still valid after this token
+	KeyValuesNumber_t m_Number;	// in case the token turns out to be a value
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: Token source for the parser. Reads either from a CUtlBuffer through
+//			KeyValues::ReadToken, in place from text owned by a CKeyValuesArena,
+//			or from tokens an in place reader lexed ahead of time.
+//			The in place reader terminates tokens inside the text and reports to
+//			its own error stack, so any number of them can run at once.
+//-----------------------------------------------------------------------------
+class CKeyValuesTokenReader
+{
+public:
+	CKeyValuesTokenReader( CUtlBuffer &buf )
+	{
+		m_pBuf = &buf;
+		m_pArena = NULL;
+		m_pText = NULL;
+		m_pTokens = NULL;
+		m_pErrorStack = &g_KeyValuesErrorStack;
+		Init();
+	}
+
+	CKeyValuesTokenReader( CKeyValuesArena *pArena, char *pText )
+	{
+		m_pBuf = NULL;
+		m_pArena = pArena;
+		m_pText = pText;
+		m_pTokens = NULL;
+		m_pErrorStack = &m_localErrorStack;
+		Init();
+	}
+
+	CKeyValuesTokenReader( CKeyValuesArena *pArena, const CUtlVector< KeyValuesToken_t > &tokens )
+	{
+		m_pBuf = NULL;
+		m_pArena = pArena;
+		m_pText = NULL;
+		m_pTokens = &tokens;
+		m_pErrorStack = &m_localErrorStack;
+		Init();
+	}
+
+	// Splits the rest of the text into tokens, using pRoot's escape sequence
+	// setting. Every key in a file inherits the root's setting, so the tokens
+	// come out the same as reading them one at a time while the tree is built.
+	// Each token is also classified, so building the tree doesn't have to.
+	void Lex( KeyValues *pRoot, CUtlVector< KeyValuesToken_t > &tokens )
+	{
+		Assert( m_pText );
+		bool bEscapeSequences = ( pRoot->m_bHasEscapeSequences != 0 );
+		for ( ;; )
+		{
+			KeyValuesToken_t token;
+			token.m_pToken = ReadTokenInPlace( bEscapeSequences, token.m_bQuoted, token.m_bConditional );
+			if ( !token.m_pToken )
+				break;
+			token.m_bValid = m_bValid;
+			ClassifyKeyValue( token.m_pToken, token.m_Number );
+			tokens.AddToTail( token );
+		}
+	}
+
+	// Reads a token using pOwner's escape sequence setting
+	const char *ReadToken( KeyValues *pOwner, bool &wasQuoted, bool &wasConditional )
+	{
+		if ( m_bHasPending )
+		{
+			m_bHasPending = false;
+			wasQuoted = m_bLastQuoted;
+			wasConditional = m_bLastConditional;
+			m_bValid = m_bLastValid;
+			return m_pLast;
+		}
+
+		m_nLastGet = m_pBuf ? m_pBuf->TellGet() : 0;
+		m_bPrevValid = m_bValid;
+
+		const char *pToken;
+		if ( m_pBuf )
+		{
+			pToken = pOwner->ReadToken( *m_pBuf, wasQuoted, wasConditional );
+		}
+		else if ( m_pTokens )
+		{
+			if ( m_iNextToken < m_pTokens->Count() )
+			{
+				m_iLastToken = m_iNextToken++;
+				const KeyValuesToken_t &token = m_pTokens->Element( m_iLastToken );
+				pToken = token.m_pToken;
+				wasQuoted = token.m_bQuoted;
+				wasConditional = token.m_bConditional;
+				m_bValid = token.m_bValid;
+			}
+			else
+			{
+				// out of text, same as the in place reader
+				pToken = NULL;
+				wasQuoted = false;
+				wasConditional = false;
+				m_bValid = false;
+			}
+		}
+		else
+		{
+			pToken = ReadTokenInPlace( pOwner->m_bHasEscapeSequences != 0, wasQuoted, wasConditional );
+		}
+
+		m_pLast = pToken;
+		m_bLastQuoted = wasQuoted;
+		m_bLastConditional = wasConditional;
+		m_bLastValid = m_bValid;
+		return pToken;
+	}
+
+	// Classifies a value ReadToken just returned
+	void ClassifyValue( const char *pValue, KeyValuesNumber_t &number ) const
+	{
+		if ( m_pTokens && m_iLastToken >= 0 && m_pTokens->Element( m_iLastToken ).m_pToken == pValue )
+		{
+			number = m_pTokens->Element( m_iLastToken ).m_Number;
+		}
+		else
+		{
+			ClassifyKeyValue( pValue, number );
+		}
+	}
+
+	// Pushes the last token back, so the next ReadToken returns it again
+	void UnreadToken()
+	{
+		if ( m_pBuf )
+		{
+			m_pBuf->SeekGet( CUtlBuffer::SEEK_HEAD, m_nLastGet );
+		}
+		else
+		{
+			m_bHasPending = true;
+			m_bValid = m_bPrevValid;
+		}
+	}
+
+	bool IsValid() const { return m_pBuf ? m_pBuf->IsValid() : m_bValid; }
+
+	CKeyValuesArena *GetArena() const { return m_pArena; }
+	CKeyValuesErrorStack &GetErrorStack() { return *m_pErrorStack; }
+
+private:
+	void Init()
+	{
+		m_bValid = true;
+		m_bPrevValid = true;
+		m_bHasPending = false;
+		m_pLast = NULL;
+		m_bLastQuoted = false;
+		m_bLastConditional = false;
+		m_bLastValid = true;
+		m_nLastGet = 0;
+		m_iNextToken = 0;
+		m_iLastToken = -1;
+	}
+
+	const char *ReadTokenInPlace( bool bEscapeSequences, bool &wasQuoted, bool &wasConditional );
+
+	CUtlBuffer *m_pBuf;
+	int m_nLastGet;
+
+	CKeyValuesArena *m_pArena;
+	char *m_pText;
+	const CUtlVector< KeyValuesToken_t > *m_pTokens;
+	int m_iNextToken;
+	int m_iLastToken;
+	bool m_bValid;
+	bool m_bPrevValid;
+
+	// the last token, for UnreadToken
+	bool m_bHasPending;
+	const char *m_pLast;
+	bool m_bLastQuoted;
+	bool m_bLastConditional;
+	bool m_bLastValid;
+
+	CKeyValuesErrorStack *m_pErrorStack;
+	CKeyValuesErrorStack m_localErrorStack;
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: Same rules as KeyValues::ReadToken, but the token is terminated in
+//			the text itself. Unescaping never makes a quoted string longer, so it
+//			is done in place too.
+//-----------------------------------------------------------------------------
+const char *CKeyValuesTokenReader::ReadTokenInPlace( bool bEscapeSequences, bool &wasQuoted, bool &wasConditional )
+{
+	wasQuoted = false;
+	wasConditional = false;
+
+	// eating white spaces and remarks loop
+	char *c = m_pText;
+	while ( true )
+	{
+		while ( *c && isspace( (unsigned char)*c ) )
+			c++;
+
+		// stop if it's not a comment; a new token starts here
+		if ( c[0] != '/' || c[1] != '/' )
+			break;
+
+		while ( *c && *c != '\n' )
+			c++;
+	}
+
+	m_pText = c;
+	if ( !*c )
+	{
+		m_bValid = false;	// file ends after reading whitespaces
+		return NULL;
+	}
+
+	// read quoted strings specially
+	if ( *c == '\"' )
+	{
+		wasQuoted = true;
+
+		CUtlCharConversion *pConv = bEscapeSequences ? GetCStringCharConversion() : GetNoEscCharConversion();
+		char *pToken = ++c;
+		char *pOut = pToken;
+		while ( *c && *c != '\"' )
+		{
+			char ch = *c++;
+			if ( ch == pConv->GetEscapeChar() )
+			{
+				int nLength;
+				ch = pConv->FindConversion( c, &nLength );
+				c += nLength;
+			}
+			*pOut++ = ch;
+		}
+
+		if ( *c )
+			c++;	// closing quote
+		else
+			m_bValid = false;	// unterminated, the buffer reader overflows here too
+		*pOut = 0;
+		m_pText = c;
+		return pToken;
+	}
+
+	if ( *c == '{' || *c == '}' )
+	{
+		// it's a control char, leave it in the text as it may be all that separates two tokens
+		m_pText = c + 1;
+		return ( *c == '{' ) ? "{" : "}";
+	}
+
+	// read in the token until we hit a whitespace or a control character
+	bool bConditionalStart = false;
+	char *pToken = c;
+	for ( ; *c; c++ )
+	{
+		// break if any control character appears in non quoted tokens
+		if ( *c == '"' || *c == '{' || *c == '}' )
+			break;
+
+		if ( *c == '[' )
+			bConditionalStart = true;
+
+		if ( *c == ']' && bConditionalStart )
+		{
+			wasConditional = true;
+		}
+
+		// break on whitespace
+		if ( isspace( (unsigned char)*c ) )
+			break;
+	}
+
+	m_pText = c;
+	if ( !*c )
+		return pToken;
+
+	if ( isspace( (unsigned char)*c ) )
+	{
+		*c = 0;
+		m_pText = c + 1;
+		return pToken;
+	}
+
+	// the token runs straight into a control character we still need, so it gets a copy
+	int nLength = c - pToken;
+	char *pCopy = m_pArena->Alloc( nLength + 1 );
+	Q_memcpy( pCopy, pToken, nLength );
+	pCopy[nLength] = 0;
+	return pCopy;
+}
+
+
+//-----------------------------------------------------------------------------
+// CKeyValuesArena
+//-----------------------------------------------------------------------------
+#define KEYVALUES_ARENA_BLOCK_SIZE		( 64 * 1024 )
+
+CKeyValuesArena::CKeyValuesArena()
+{
+	m_pBlockCur = NULL;
+	m_nBlockRemaining = 0;
+	m_nBytesUsed = 0;
+}
+
+CKeyValuesArena::~CKeyValuesArena()
+{
+	Purge();
+}
+
+char *CKeyValuesArena::Alloc( int nSize )
+{
+	AUTO_LOCK( m_Mutex );
+
+	m_nBytesUsed += nSize;
+
+	// Big requests (whole files, usually) get a block to themselves
+	if ( nSize > KEYVALUES_ARENA_BLOCK_SIZE / 4 )
+	{
+		char *pBlock = new char[nSize];
+		m_Blocks.AddToTail( pBlock );
+		return pBlock;
+	}
+
+	if ( nSize > m_nBlockRemaining )
+	{
+		m_pBlockCur = new char[KEYVALUES_ARENA_BLOCK_SIZE];
+		m_nBlockRemaining = KEYVALUES_ARENA_BLOCK_SIZE;
+		m_Blocks.AddToTail( m_pBlockCur );
+	}
+
+	char *pResult = m_pBlockCur;
+	m_pBlockCur += nSize;
+	m_nBlockRemaining -= nSize;
+	return pResult;
+}
+
+void CKeyValuesArena::Purge()
+{
+	for ( int i = 0; i < m_Blocks.Count(); i++ )
+	{
+		delete [] m_Blocks[i];
+	}
+	m_Blocks.Purge();
+	m_pBlockCur = NULL;
+	m_nBlockRemaining = 0;
+	m_nBytesUsed = 0;
+}
+
 // Uncomment this line to hit the ~CLeakTrack assert to see what's looking like it's leaking
 // #define LEAKTRACK
 
@@ -461,9 +908,7 @@ void KeyValues::Init()
 	
 	m_bHasEscapeSequences = false;
 	m_bEvaluateConditionals = true;
-
-	// for future proof
-	memset( unused, 0, sizeof(unused) );
+	m_bValueInArena = false;
 }
 
 //-----------------------------------------------------------------------------
@@ -497,8 +942,21 @@ void KeyValues::RemoveEverything()
 		delete dat;
 	}
 
-	delete [] m_sValue;
+	FreeAllocatedValue();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Frees the string values. Arena strings are left to their arena.
+//-----------------------------------------------------------------------------
+void KeyValues::FreeAllocatedValue()
+{
+	if ( !m_bValueInArena )
+	{
+		delete [] m_sValue;
+	}
 	m_sValue = NULL;
+	m_bValueInArena = false;
+
 	delete [] m_wsValue;
 	m_wsValue = NULL;
 }
@@ -1592,11 +2050,8 @@ void KeyValues::SetColor( const char *keyName, Color value)
 
 void KeyValues::SetStringValue( char const *strValue )
 {
-	// delete the old value
-	delete [] m_sValue;
-	// make sure we're not storing the WSTRING  - as we're converting over to STRING
-	delete [] m_wsValue;
-	m_wsValue = NULL;
+	// delete the old value, and make sure we're not storing the WSTRING - as we're converting over to STRING
+	FreeAllocatedValue();
 
 	if (!strValue)
 	{
@@ -1626,11 +2081,8 @@ void KeyValues::SetString( const char *keyName, const char *value )
 			return;
 		}
 
-		// delete the old value
-		delete [] dat->m_sValue;
-		// make sure we're not storing the WSTRING  - as we're converting over to STRING
-		delete [] dat->m_wsValue;
-		dat->m_wsValue = NULL;
+		// delete the old value, and make sure we're not storing the WSTRING - as we're converting over to STRING
+		dat->FreeAllocatedValue();
 
 		if (!value)
 		{
@@ -1655,11 +2107,8 @@ void KeyValues::SetWString( const char *keyName, const wchar_t *value )
 	KeyValues *dat = FindKey( keyName, true );
 	if ( dat )
 	{
-		// delete the old value
-		delete [] dat->m_wsValue;
-		// make sure we're not storing the STRING  - as we're converting over to WSTRING
-		delete [] dat->m_sValue;
-		dat->m_sValue = NULL;
+		// delete the old value, and make sure we're not storing the STRING - as we're converting over to WSTRING
+		dat->FreeAllocatedValue();
 
 		if (!value)
 		{
@@ -1699,11 +2148,8 @@ void KeyValues::SetUint64( const char *keyName, uint64 value )
 
 	if ( dat )
 	{
-		// delete the old value
-		delete [] dat->m_sValue;
-		// make sure we're not storing the WSTRING  - as we're converting over to STRING
-		delete [] dat->m_wsValue;
-		dat->m_wsValue = NULL;
+		// delete the old value, and make sure we're not storing the WSTRING - as we're converting over to STRING
+		dat->FreeAllocatedValue();
 
 		dat->m_sValue = new char[sizeof(uint64)];
 		*((uint64 *)dat->m_sValue) = value;
@@ -2063,7 +2509,7 @@ void KeyValues::AppendIncludedKeys( CUtlVector< KeyValues * >& includedKeys )
 }
 
 void KeyValues::ParseIncludedKeys( char const *resourceName, const char *filetoinclude, 
-		IBaseFileSystem* pFileSystem, const char *pPathID, CUtlVector< KeyValues * >& includedKeys )
+		IBaseFileSystem* pFileSystem, const char *pPathID, CUtlVector< KeyValues * >& includedKeys, CKeyValuesArena *pArena )
 {
 	Assert( resourceName );
 	Assert( filetoinclude );
@@ -2109,7 +2555,9 @@ void KeyValues::ParseIncludedKeys( char const *resourceName, const char *filetoi
 	newKV->UsesEscapeSequences( m_bHasEscapeSequences != 0 );	// use same format as parent
 	newKV->UsesConditionals( m_bEvaluateConditionals != 0 );
 
-	if ( newKV->LoadFromFile( pFileSystem, fullpath, pPathID ) )
+	// files included from an arena parse go into the same arena
+	bool bLoaded = pArena ? newKV->LoadFromFileInArena( pArena, pFileSystem, fullpath, pPathID ) : newKV->LoadFromFile( pFileSystem, fullpath, pPathID );
+	if ( bLoaded )
 	{
 		includedKeys.AddToTail( newKV );
 	}
@@ -2218,6 +2666,15 @@ bool EvaluateConditional( const char *str )
 // Read from a buffer...
 //-----------------------------------------------------------------------------
 bool KeyValues::LoadFromBuffer( char const *resourceName, CUtlBuffer &buf, IBaseFileSystem* pFileSystem, const char *pPathID )
+{
+	CKeyValuesTokenReader tokens( buf );
+	return LoadFromTokens( resourceName, tokens, pFileSystem, pPathID );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Parses the top level keys from a token source
+//-----------------------------------------------------------------------------
+bool KeyValues::LoadFromTokens( char const *resourceName, CKeyValuesTokenReader &tokens, IBaseFileSystem* pFileSystem, const char *pPathID )
 {
 	KeyValues *pPreviousKey = NULL;
 	KeyValues *pCurrentKey = this;
@@ -2225,44 +2682,45 @@ bool KeyValues::LoadFromBuffer( char const *resourceName, CUtlBuffer &buf, IBase
 	CUtlVector< KeyValues * > baseKeys;
 	bool wasQuoted;
 	bool wasConditional;
-	g_KeyValuesErrorStack.SetFilename( resourceName );	
+	CKeyValuesErrorStack &errorStack = tokens.GetErrorStack();
+	errorStack.SetFilename( resourceName );	
 	do 
 	{
 		bool bAccepted = true;
 
 		// the first thing must be a key
-		const char *s = ReadToken( buf, wasQuoted, wasConditional );
-		if ( !buf.IsValid() || !s || *s == 0 )
+		const char *s = tokens.ReadToken( this, wasQuoted, wasConditional );
+		if ( !tokens.IsValid() || !s || *s == 0 )
 			break;
 
 		if ( !Q_stricmp( s, "#include" ) )	// special include macro (not a key name)
 		{
-			s = ReadToken( buf, wasQuoted, wasConditional );
+			s = tokens.ReadToken( this, wasQuoted, wasConditional );
 			// Name of subfile to load is now in s
 
 			if ( !s || *s == 0 )
 			{
-				g_KeyValuesErrorStack.ReportError("#include is NULL " );
+				errorStack.ReportError("#include is NULL " );
 			}
 			else
 			{
-				ParseIncludedKeys( resourceName, s, pFileSystem, pPathID, includedKeys );
+				ParseIncludedKeys( resourceName, s, pFileSystem, pPathID, includedKeys, tokens.GetArena() );
 			}
 
 			continue;
 		}
 		else if ( !Q_stricmp( s, "#base" ) )
 		{
-			s = ReadToken( buf, wasQuoted, wasConditional );
+			s = tokens.ReadToken( this, wasQuoted, wasConditional );
 			// Name of subfile to load is now in s
 
 			if ( !s || *s == 0 )
 			{
-				g_KeyValuesErrorStack.ReportError("#base is NULL " );
+				errorStack.ReportError("#base is NULL " );
 			}
 			else
 			{
-				ParseIncludedKeys( resourceName, s, pFileSystem, pPathID, baseKeys );
+				ParseIncludedKeys( resourceName, s, pFileSystem, pPathID, baseKeys, tokens.GetArena() );
 			}
 
 			continue;
@@ -2287,24 +2745,24 @@ bool KeyValues::LoadFromBuffer( char const *resourceName, CUtlBuffer &buf, IBase
 		}
 
 		// get the '{'
-		s = ReadToken( buf, wasQuoted, wasConditional );
+		s = tokens.ReadToken( this, wasQuoted, wasConditional );
 
 		if ( wasConditional )
 		{
 			bAccepted = !m_bEvaluateConditionals || EvaluateConditional( s );
 
 			// Now get the '{'
-			s = ReadToken( buf, wasQuoted, wasConditional );
+			s = tokens.ReadToken( this, wasQuoted, wasConditional );
 		}
 
 		if ( s && *s == '{' && !wasQuoted )
 		{
 			// header is valid so load the file
-			pCurrentKey->RecursiveLoadFromBuffer( resourceName, buf );
+			pCurrentKey->RecursiveLoadFromBuffer( resourceName, tokens );
 		}
 		else
 		{
-			g_KeyValuesErrorStack.ReportError("LoadFromBuffer: missing {" );
+			errorStack.ReportError("LoadFromBuffer: missing {" );
 		}
 
 		if ( !bAccepted )
@@ -2320,7 +2778,7 @@ bool KeyValues::LoadFromBuffer( char const *resourceName, CUtlBuffer &buf, IBase
 			pPreviousKey = pCurrentKey;
 			pCurrentKey = NULL;
 		}
-	} while ( buf.IsValid() );
+	} while ( tokens.IsValid() );
 
 	AppendIncludedKeys( includedKeys );
 	{
@@ -2344,7 +2802,7 @@ bool KeyValues::LoadFromBuffer( char const *resourceName, CUtlBuffer &buf, IBase
 		}
 	}
 
-	g_KeyValuesErrorStack.SetFilename( "" );	
+	errorStack.SetFilename( "" );	
 
 	return true;
 }
@@ -2379,22 +2837,179 @@ bool KeyValues::LoadFromBuffer( char const *resourceName, const char *pBuffer, I
 	return retVal;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Converts a UTF-16 file (with a byte order mark) to UTF-8 in the arena
+//-----------------------------------------------------------------------------
+static bool IsUnicodeText( const char *pText )
+{
+	return (uint8)pText[0] == 0xFF && (uint8)pText[1] == 0xFE;
+}
+
+static char *ConvertUnicodeTextToArena( CKeyValuesArena *pArena, const char *pText )
+{
+	int nUTF8Len = V_UnicodeToUTF8( (wchar_t*)(pText+2), NULL, 0 );
+	char *pUTF8Buf = pArena->Alloc( nUTF8Len );
+	V_UnicodeToUTF8( (wchar_t*)(pText+2), pUTF8Buf, nUTF8Len );
+	return pUTF8Buf;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Reads a file into the arena as null terminated UTF-8 text, ready to
+//			be parsed in place. Returns NULL if the file can't be read.
+//-----------------------------------------------------------------------------
+static char *ReadFileIntoArena( CKeyValuesArena *pArena, IBaseFileSystem *filesystem, const char *resourceName, const char *pathID )
+{
+	FileHandle_t f = filesystem->Open( resourceName, "rb", pathID );
+	if ( !f )
+		return NULL;
+
+	// load file into a null-terminated buffer, which the values will point into
+	int fileSize = filesystem->Size( f );
+	char *buffer = pArena->Alloc( fileSize + 2 );
+	bool bRetOK = ( filesystem->Read( buffer, fileSize, f ) == fileSize );
+
+	filesystem->Close( f );	// close file after reading
+
+	if ( !bRetOK )
+		return NULL;
+
+	buffer[fileSize] = 0; // null terminate file as EOF
+	buffer[fileSize+1] = 0; // double NULL terminating in case this is a unicode file
+
+	if ( IsUnicodeText( buffer ) )
+	{
+		buffer = ConvertUnicodeTextToArena( pArena, buffer );
+	}
+
+	return buffer;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Load keyValues from disk, parsing in place in the arena
+//-----------------------------------------------------------------------------
+bool KeyValues::LoadFromFileInArena( CKeyValuesArena *pArena, IBaseFileSystem *filesystem, const char *resourceName, const char *pathID )
+{
+	Assert( pArena );
+	Assert( filesystem );
+
+	char *pText = ReadFileIntoArena( pArena, filesystem, resourceName, pathID );
+	if ( !pText )
+		return false;
+
+	CKeyValuesTokenReader tokens( pArena, pText );
+	return LoadFromTokens( resourceName, tokens, filesystem, pathID );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Read from a buffer, parsing a copy of it in place in the arena
+//-----------------------------------------------------------------------------
+bool KeyValues::LoadFromBufferInArena( CKeyValuesArena *pArena, char const *resourceName, const char *pBuffer, IBaseFileSystem* pFileSystem, const char *pPathID )
+{
+	Assert( pArena );
+
+	if ( !pBuffer )
+		return true;
+
+	char *pText;
+	if ( IsUnicodeText( pBuffer ) )
+	{
+		pText = ConvertUnicodeTextToArena( pArena, pBuffer );
+	}
+	else
+	{
+		int nLen = Q_strlen( pBuffer );
+		pText = pArena->Alloc( nLen + 1 );
+		Q_memcpy( pText, pBuffer, nLen + 1 );
+	}
+
+	CKeyValuesTokenReader tokens( pArena, pText );
+	return LoadFromTokens( resourceName, tokens, pFileSystem, pPathID );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Job side of LoadFilesInArena
+//-----------------------------------------------------------------------------
+struct KeyValuesFileRead_t
+{
+	const KeyValuesFileLoad_t *m_pLoad;
+	bool m_bRead;
+	CUtlVector< KeyValuesToken_t > m_Tokens;
+};
+
+class CKeyValuesParallelReader
+{
+public:
+	CKeyValuesParallelReader( CKeyValuesArena *pArena, IBaseFileSystem *pFileSystem ) : m_pArena( pArena ), m_pFileSystem( pFileSystem ) {}
+
+	void Process( KeyValuesFileRead_t &read )
+	{
+		const KeyValuesFileLoad_t *pLoad = read.m_pLoad;
+		char *pText = ReadFileIntoArena( m_pArena, m_pFileSystem, pLoad->m_pszFilename, pLoad->m_pszPathID );
+		read.m_bRead = ( pText != NULL );
+		if ( pText )
+		{
+			CKeyValuesTokenReader lexer( m_pArena, pText );
+			lexer.Lex( pLoad->m_pKeyValues, read.m_Tokens );
+		}
+	}
+
+private:
+	CKeyValuesArena *m_pArena;
+	IBaseFileSystem *m_pFileSystem;
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: Loads independent files. Each file is read into the arena and split
+//			into typed tokens in parallel: the text decoding, comment skipping,
+//			unescaping and number parsing only touch the file's own text and the
+//			arena (locked).
+//			The trees are then built from the tokens one at a time on the calling
+//			thread, since that allocates nodes and interns key names through
+//			KeyValuesSystem(), which isn't documented as safe to call from
+//			several threads at once.
+//-----------------------------------------------------------------------------
+void KeyValues::LoadFilesInArena( CKeyValuesArena *pArena, IBaseFileSystem *filesystem, KeyValuesFileLoad_t *pLoads, int nLoads )
+{
+	CUtlVector< KeyValuesFileRead_t > reads;
+	reads.SetCount( nLoads );
+	for ( int i = 0; i < nLoads; i++ )
+	{
+		pLoads[i].m_bLoaded = false;
+		reads[i].m_pLoad = &pLoads[i];
+		reads[i].m_bRead = false;
+	}
+
+	CKeyValuesParallelReader reader( pArena, filesystem );
+	ParallelProcess( "KeyValues::LoadFilesInArena", reads.Base(), nLoads, &reader, &CKeyValuesParallelReader::Process );
+
+	for ( int i = 0; i < nLoads; i++ )
+	{
+		if ( !reads[i].m_bRead )
+			continue;
+
+		CKeyValuesTokenReader tokens( pArena, reads[i].m_Tokens );
+		pLoads[i].m_bLoaded = pLoads[i].m_pKeyValues->LoadFromTokens( pLoads[i].m_pszFilename, tokens, filesystem, pLoads[i].m_pszPathID );
+		reads[i].m_Tokens.Purge();
+	}
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: 
 //-----------------------------------------------------------------------------
-void KeyValues::RecursiveLoadFromBuffer( char const *resourceName, CUtlBuffer &buf )
+void KeyValues::RecursiveLoadFromBuffer( char const *resourceName, CKeyValuesTokenReader &tokens )
 {
-	CKeyErrorContext errorReport(this);
+	CKeyValuesErrorStack &errorStack = tokens.GetErrorStack();
+	CKeyErrorContext errorReport( errorStack, this );
 	bool wasQuoted;
 	bool wasConditional;
 	if ( errorReport.GetStackLevel() > 100 )
 	{
-		g_KeyValuesErrorStack.ReportError( "RecursiveLoadFromBuffer:  recursion overflow" );
+		errorStack.ReportError( "RecursiveLoadFromBuffer:  recursion overflow" );
 		return;
 	}
 
 	// keep this out of the stack until a key is parsed
-	CKeyErrorContext errorKey( INVALID_KEY_SYMBOL );
+	CKeyErrorContext errorKey( errorStack, INVALID_KEY_SYMBOL );
 
 	// Locate the last child.  (Almost always, we will not have any children.)
 	// We maintain the pointer to the last child here, so we don't have to re-locate
@@ -2407,17 +3022,17 @@ void KeyValues::RecursiveLoadFromBuffer( char const *resourceName, CUtlBuffer &b
 		bool bAccepted = true;
 
 		// get the key name
-		const char * name = ReadToken( buf, wasQuoted, wasConditional );
+		const char * name = tokens.ReadToken( this, wasQuoted, wasConditional );
 
 		if ( !name )	// EOF stop reading
 		{
-			g_KeyValuesErrorStack.ReportError("RecursiveLoadFromBuffer:  got EOF instead of keyname" );
+			errorStack.ReportError("RecursiveLoadFromBuffer:  got EOF instead of keyname" );
 			break;
 		}
 
 		if ( !*name ) // empty token, maybe "" or EOF
 		{
-			g_KeyValuesErrorStack.ReportError("RecursiveLoadFromBuffer:  got empty keyname" );
+			errorStack.ReportError("RecursiveLoadFromBuffer:  got empty keyname" );
 			break;
 		}
 
@@ -2431,25 +3046,25 @@ void KeyValues::RecursiveLoadFromBuffer( char const *resourceName, CUtlBuffer &b
 		errorKey.Reset( dat->GetNameSymbol() );
 
 		// get the value
-		const char * value = ReadToken( buf, wasQuoted, wasConditional );
+		const char * value = tokens.ReadToken( this, wasQuoted, wasConditional );
 
 		if ( wasConditional && value )
 		{
 			bAccepted = !m_bEvaluateConditionals || EvaluateConditional( value );
 
 			// get the real value
-			value = ReadToken( buf, wasQuoted, wasConditional );
+			value = tokens.ReadToken( this, wasQuoted, wasConditional );
 		}
 
 		if ( !value )
 		{
-			g_KeyValuesErrorStack.ReportError("RecursiveLoadFromBuffer:  got NULL key" );
+			errorStack.ReportError("RecursiveLoadFromBuffer:  got NULL key" );
 			break;
 		}
 		
 		if ( *value == '}' && !wasQuoted )
 		{
-			g_KeyValuesErrorStack.ReportError("RecursiveLoadFromBuffer:  got } in key" );
+			errorStack.ReportError("RecursiveLoadFromBuffer:  got } in key" );
 			break;
 		}
 
@@ -2458,96 +3073,61 @@ void KeyValues::RecursiveLoadFromBuffer( char const *resourceName, CUtlBuffer &b
 			// this isn't a key, it's a section
 			errorKey.Reset( INVALID_KEY_SYMBOL );
 			// sub value list
-			dat->RecursiveLoadFromBuffer( resourceName, buf );
+			dat->RecursiveLoadFromBuffer( resourceName, tokens );
 		}
 		else 
 		{
 			if ( wasConditional )
 			{
-				g_KeyValuesErrorStack.ReportError("RecursiveLoadFromBuffer:  got conditional between key and value" );
+				errorStack.ReportError("RecursiveLoadFromBuffer:  got conditional between key and value" );
 				break;
 			}
 			
-			if (dat->m_sValue)
-			{
-				delete[] dat->m_sValue;
-				dat->m_sValue = NULL;
-			}
+			dat->FreeAllocatedValue();
 
-			int len = Q_strlen( value );
-
-			// Here, let's determine if we got a float or an int....
-			char* pIEnd;	// pos where int scan ended
-			char* pFEnd;	// pos where float scan ended
-			const char* pSEnd = value + len ; // pos where token ends
-
-			int ival = strtol( value, &pIEnd, 10 );
-			float fval = (float)strtod( value, &pFEnd );
-			bool bOverflow = ( ival == LONG_MAX || ival == LONG_MIN ) && errno == ERANGE;
-#ifdef POSIX
-			// strtod supports hex representation in strings under posix but we DON'T
-			// want that support in keyvalues, so undo it here if needed
-			if ( len > 1 &&  tolower(value[1]) == 'x' )
-			{
-				fval = 0.0f;
-				pFEnd = (char *)value;
-			}
-#endif
-				
-			if ( *value == 0 )
-			{
-				dat->m_iDataType = TYPE_STRING;	
-			}
-			else if ( ( 18 == len ) && ( value[0] == '0' ) && ( value[1] == 'x' ) )
+			KeyValuesNumber_t number;
+			tokens.ClassifyValue( value, number );
+			dat->m_iDataType = number.m_iDataType;
+			if ( number.m_iDataType == TYPE_UINT64 )
 			{
-				// an 18-byte value prefixed with "0x" (followed by 16 hex digits) is an int64 value
-				int64 retVal = 0;
-				for( int i=2; i < 2 + 16; i++ )
-				{
-					char digit = value[i];
-					if ( digit >= 'a' ) 
-						digit -= 'a' - ( '9' + 1 );
-					else
-						if ( digit >= 'A' )
-							digit -= 'A' - ( '9' + 1 );
-					retVal = ( retVal * 16 ) + ( digit - '0' );
-				}
 				dat->m_sValue = new char[sizeof(uint64)];
-				*((uint64 *)dat->m_sValue) = retVal;
-				dat->m_iDataType = TYPE_UINT64;
+				*((uint64 *)dat->m_sValue) = number.m_ulValue;
 			}
-			else if ( (pFEnd > pIEnd) && (pFEnd == pSEnd) )
+			else if ( number.m_iDataType == TYPE_FLOAT )
 			{
-				dat->m_flValue = fval; 
-				dat->m_iDataType = TYPE_FLOAT;
+				dat->m_flValue = number.m_flValue;
 			}
-			else if (pIEnd == pSEnd && !bOverflow)
+			else if ( number.m_iDataType == TYPE_INT )
 			{
-				dat->m_iValue = ival; 
-				dat->m_iDataType = TYPE_INT;
-			}
-			else
-			{
-				dat->m_iDataType = TYPE_STRING;
+				dat->m_iValue = number.m_iValue;
 			}
 
 			if (dat->m_iDataType == TYPE_STRING)
 			{
-				// copy in the string information
-				dat->m_sValue = new char[len+1];
-				Q_memcpy( dat->m_sValue, value, len+1 );
+				if ( tokens.GetArena() )
+				{
+					// in place tokens stay valid for the life of the arena
+					dat->m_sValue = const_cast< char * >( value );
+					dat->m_bValueInArena = true;
+				}
+				else
+				{
+					// copy in the string information
+					int len = Q_strlen( value );
+					dat->m_sValue = new char[len+1];
+					Q_memcpy( dat->m_sValue, value, len+1 );
+				}
 			}
 
 			// Look ahead one token for a conditional tag
-			int prevPos = buf.TellGet();
-			const char *peek = ReadToken( buf, wasQuoted, wasConditional );
+			const char *peek = tokens.ReadToken( this, wasQuoted, wasConditional );
 			if ( wasConditional )
 			{
 				bAccepted = !m_bEvaluateConditionals || EvaluateConditional( peek );
 			}
 			else
 			{
-				buf.SeekGet( CUtlBuffer::SEEK_HEAD, prevPos );
+				tokens.UnreadToken();
 			}
 		}
 
@@ -11,6 +11,7 @@
 #include "tier0/dbg.h"
 #include <ctype.h>
 #include "tier1/strtools.h"
+#include "tier0/vprof.h"
 
 // Should be last include
 #include "tier0/memdbgon.h"
@@ -310,3 +311,360 @@ void CUtlMemoryPool::Free( void *memBlock )
 }
 
 
+
+
+//-----------------------------------------------------------------------------
+// Per-thread caches for CMemoryPoolMT
+//-----------------------------------------------------------------------------
+struct MemoryPoolThreadCache_t
+{
+	struct Pool_t
+	{
+		void	*m_pFree;		// linked through the first word of each block
+		int		m_nFree;
+		int		m_nGeneration;
+	};
+
+	Pool_t	m_Pools[ CMemoryPoolMT::MAX_THREAD_CACHED_POOLS ];
+	MemoryPoolThreadCache_t *m_pNext;
+};
+
+// Every thread's caches, so pools can take their blocks back when they're
+// destroyed, and which cache slots belong to a live pool. These and the thread
+// local pointer are plain data so pools made by static constructors in other
+// files can use them before this file's constructors have run.
+static MemoryPoolThreadCache_t * volatile s_pFirstThreadCache = NULL;
+static volatile int s_ThreadCacheSlotInUse[ CMemoryPoolMT::MAX_THREAD_CACHED_POOLS ];
+
+static THREAD_LOCAL MemoryPoolThreadCache_t *s_pThreadCache;
+
+static MemoryPoolThreadCache_t::Pool_t &GetThreadCache( int iPool )
+{
+	MemoryPoolThreadCache_t *pCache = s_pThreadCache;
+	if ( !pCache )
+	{
+		// Never freed, since other threads may still give blocks back to a pool
+		// through it after this one's gone
+		pCache = (MemoryPoolThreadCache_t *)calloc( 1, sizeof( MemoryPoolThreadCache_t ) );
+		s_pThreadCache = pCache;
+
+		do
+		{
+			pCache->m_pNext = s_pFirstThreadCache;
+		} while ( !ThreadInterlockedAssignPointerIf( (void * volatile *)&s_pFirstThreadCache, pCache, pCache->m_pNext ) );
+	}
+
+	return pCache->m_Pools[ iPool ];
+}
+
+static FORCEINLINE void PushThreadCache( MemoryPoolThreadCache_t::Pool_t &cache, void *pMem )
+{
+	*( (void **)pMem ) = cache.m_pFree;
+	cache.m_pFree = pMem;
+	cache.m_nFree++;
+}
+
+static FORCEINLINE void *PopThreadCache( MemoryPoolThreadCache_t::Pool_t &cache )
+{
+	void *pMem = cache.m_pFree;
+	cache.m_pFree = *( (void **)pMem );
+	cache.m_nFree--;
+	return pMem;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Constructor. Blocks double as return queue nodes, so they're
+//			aligned for CTSListBase.
+//-----------------------------------------------------------------------------
+CMemoryPoolMT::CMemoryPoolMT( int blockSize, int numElements, int growMode, const char *pszAllocOwner, int nAlignment ) :
+	CUtlMemoryPool( blockSize, numElements, growMode, pszAllocOwner, max( nAlignment, TSLIST_NODE_ALIGNMENT ) )
+{
+	// A pool that can't grow would run dry with blocks sitting in other threads' caches
+	m_iThreadCache = -1;
+	if ( growMode != UTLMEMORYPOOL_GROW_NONE )
+	{
+		for ( int iPool = 0; iPool < MAX_THREAD_CACHED_POOLS; iPool++ )
+		{
+			if ( ThreadInterlockedAssignIf( &s_ThreadCacheSlotInUse[ iPool ], 1, 0 ) )
+			{
+				m_iThreadCache = iPool;
+				break;
+			}
+		}
+	}
+
+	// The queue's depth is only 16 bits
+	m_nMaxReturnQueue = clamp( numElements, THREAD_CACHE_SIZE * 4, 16384 );
+
+	m_pVProfLocks = NULL;
+	m_pVProfQueued = NULL;
+#ifdef VPROF_ENABLED
+	if ( m_iThreadCache != -1 )
+	{
+		char szName[128];
+		Q_snprintf( szName, sizeof( szName ), "%s locks", m_pszAllocOwner );
+		m_pVProfLocks = g_VProfCurrentProfile.FindOrCreateCounter( szName, COUNTER_GROUP_NO_RESET );
+		Q_snprintf( szName, sizeof( szName ), "%s queued", m_pszAllocOwner );
+		m_pVProfQueued = g_VProfCurrentProfile.FindOrCreateCounter( szName, COUNTER_GROUP_NO_RESET );
+	}
+#endif
+}
+
+CMemoryPoolMT::~CMemoryPoolMT()
+{
+	// Give back what the caches are holding so they don't show up as leaks
+	FlushThreadCaches();
+
+	// The flush emptied this slot in every thread's cache, so the next pool
+	// can have it
+	if ( m_iThreadCache != -1 )
+	{
+		ThreadInterlockedExchange( &s_ThreadCacheSlotInUse[ m_iThreadCache ], 0 );
+	}
+}
+
+void *CMemoryPoolMT::Alloc( size_t amount )
+{
+	if ( amount > (unsigned int)m_BlockSize )
+		return NULL;
+
+	void *pMem;
+	if ( m_iThreadCache == -1 )
+	{
+		AUTO_LOCK( m_mutex );
+		++m_nLocks;
+		pMem = CUtlMemoryPool::Alloc( amount );
+	}
+	else
+	{
+		MemoryPoolThreadCache_t::Pool_t &cache = GetThreadCache( m_iThreadCache );
+		if ( cache.m_nFree && cache.m_nGeneration == m_nGeneration )
+		{
+			pMem = PopThreadCache( cache );
+		}
+		else
+		{
+			pMem = AllocSlow();
+		}
+	}
+
+	return pMem;
+}
+
+void *CMemoryPoolMT::AllocZero( size_t amount )
+{
+	void *mem = Alloc( amount );
+	if ( mem )
+	{
+		V_memset( mem, 0x00, amount );
+	}
+	return mem;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Refills this thread's empty cache, from the return queue if other
+//			threads have given blocks back, otherwise from the pool itself.
+//-----------------------------------------------------------------------------
+void *CMemoryPoolMT::AllocSlow()
+{
+	MemoryPoolThreadCache_t::Pool_t &cache = GetThreadCache( m_iThreadCache );
+	if ( cache.m_nGeneration != m_nGeneration )
+	{
+		// The pool's been cleared since these were cached
+		cache.m_pFree = NULL;
+		cache.m_nFree = 0;
+		cache.m_nGeneration = m_nGeneration;
+	}
+
+	const int nRefill = THREAD_CACHE_SIZE / 2;
+
+	int nQueued = 0;
+	while ( cache.m_nFree < nRefill )
+	{
+		TSLNodeBase_t *pNode = m_ReturnQueue.Pop();
+		if ( !pNode )
+			break;
+
+		PushThreadCache( cache, pNode );
+		nQueued++;
+	}
+
+	if ( nQueued )
+	{
+		m_nQueueRefills += nQueued;
+	}
+	else
+	{
+		AUTO_LOCK( m_mutex );
+		++m_nLocks;
+		while ( cache.m_nFree < nRefill )
+		{
+			void *pMem = CUtlMemoryPool::Alloc();
+			if ( !pMem )
+				break;
+
+			PushThreadCache( cache, pMem );
+		}
+	}
+
+	UpdateVProfCounters();
+
+	if ( !cache.m_nFree )
+		return NULL;
+
+	return PopThreadCache( cache );
+}
+
+void CMemoryPoolMT::Free( void *pMem )
+{
+	if ( !pMem )
+		return;
+
+	if ( m_iThreadCache == -1 )
+	{
+		AUTO_LOCK( m_mutex );
+		++m_nLocks;
+		CUtlMemoryPool::Free( pMem );
+		return;
+	}
+
+#ifdef _DEBUG
+	// invalidate the memory
+	memset( pMem, 0xDD, m_BlockSize );
+#endif
+
+	MemoryPoolThreadCache_t::Pool_t &cache = GetThreadCache( m_iThreadCache );
+	if ( cache.m_nFree < THREAD_CACHE_SIZE && cache.m_nGeneration == m_nGeneration )
+	{
+		PushThreadCache( cache, pMem );
+		return;
+	}
+
+	FreeSlow( pMem );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Makes room in this thread's full cache by handing half of it to the
+//			return queue, or back to the pool if the queue's full too.
+//-----------------------------------------------------------------------------
+void CMemoryPoolMT::FreeSlow( void *pMem )
+{
+	MemoryPoolThreadCache_t::Pool_t &cache = GetThreadCache( m_iThreadCache );
+	if ( cache.m_nGeneration != m_nGeneration )
+	{
+		cache.m_pFree = NULL;
+		cache.m_nFree = 0;
+		cache.m_nGeneration = m_nGeneration;
+	}
+
+	const int nSpill = THREAD_CACHE_SIZE / 2;
+	if ( cache.m_nFree >= THREAD_CACHE_SIZE )
+	{
+		if ( m_ReturnQueue.Count() + nSpill <= m_nMaxReturnQueue )
+		{
+			for ( int i = 0; i < nSpill; i++ )
+			{
+				m_ReturnQueue.Push( (TSLNodeBase_t *)PopThreadCache( cache ) );
+			}
+			m_nQueueReturns += nSpill;
+		}
+		else
+		{
+			AUTO_LOCK( m_mutex );
+			++m_nLocks;
+			for ( int i = 0; i < nSpill; i++ )
+			{
+				CUtlMemoryPool::Free( PopThreadCache( cache ) );
+			}
+		}
+
+		UpdateVProfCounters();
+	}
+
+	PushThreadCache( cache, pMem );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Blocks taken from the pool, less the ones sitting in thread caches
+//			and on the return queue. Nothing is counted on the fast paths, so
+//			while other threads are allocating this is only a snapshot.
+//-----------------------------------------------------------------------------
+int CMemoryPoolMT::Count() const
+{
+	int nCount = m_BlocksAllocated - m_ReturnQueue.Count();
+
+	if ( m_iThreadCache != -1 )
+	{
+		for ( MemoryPoolThreadCache_t *pThreadCache = s_pFirstThreadCache; pThreadCache; pThreadCache = pThreadCache->m_pNext )
+		{
+			const MemoryPoolThreadCache_t::Pool_t &cache = pThreadCache->m_Pools[ m_iThreadCache ];
+			if ( cache.m_nGeneration == m_nGeneration )
+			{
+				nCount -= cache.m_nFree;
+			}
+		}
+	}
+
+	return nCount;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns every cached block to the pool. Only safe when no other
+//			thread is using the pool.
+//-----------------------------------------------------------------------------
+void CMemoryPoolMT::FlushThreadCaches()
+{
+	AUTO_LOCK( m_mutex );
+
+	if ( m_iThreadCache != -1 )
+	{
+		for ( MemoryPoolThreadCache_t *pThreadCache = s_pFirstThreadCache; pThreadCache; pThreadCache = pThreadCache->m_pNext )
+		{
+			MemoryPoolThreadCache_t::Pool_t &cache = pThreadCache->m_Pools[ m_iThreadCache ];
+			if ( cache.m_nGeneration == m_nGeneration )
+			{
+				while ( cache.m_nFree )
+				{
+					CUtlMemoryPool::Free( PopThreadCache( cache ) );
+				}
+			}
+
+			cache.m_pFree = NULL;
+			cache.m_nFree = 0;
+		}
+	}
+
+	while ( TSLNodeBase_t *pNode = m_ReturnQueue.Pop() )
+	{
+		CUtlMemoryPool::Free( pNode );
+	}
+}
+
+void CMemoryPoolMT::Clear()
+{
+	AUTO_LOCK( m_mutex );
+
+	// Cached blocks are freed along with everything else; threads notice the
+	// new generation and drop them
+	++m_nGeneration;
+	m_ReturnQueue.Detach();
+	CUtlMemoryPool::Clear();
+}
+
+void CMemoryPoolMT::GetStats( Stats_t &stats ) const
+{
+	stats.m_nLocks = m_nLocks;
+	stats.m_nQueueRefills = m_nQueueRefills;
+	stats.m_nQueueReturns = m_nQueueReturns;
+}
+
+void CMemoryPoolMT::UpdateVProfCounters()
+{
+	// Plain stores from whichever thread got here last; they're only for display
+	if ( m_pVProfLocks )
+	{
+		*m_pVProfLocks = m_nLocks;
+		*m_pVProfQueued = (int)m_nQueueRefills + (int)m_nQueueReturns;
+	}
+}
@@ -12,9 +12,12 @@ bool CheckMMXTechnology(void) { return false; }
 bool CheckSSETechnology(void) { return false; }
 bool CheckSSE2Technology(void) { return false; }
 bool Check3DNowTechnology(void) { return false; }
+bool CheckAVXTechnology(void) { return false; }
 
 #elif defined( _WIN32 ) && !defined( _X360 )
 
+#include <intrin.h>
+
 #pragma optimize( "", off )
 #pragma warning( disable: 4800 ) //'int' : forcing value to bool 'true' or 'false' (performance warning)
 
@@ -269,6 +272,18 @@ bool Check3DNowTechnology(void)
     return retval;
 }
 
+// AVX needs both the CPU feature and an OS that saves the YMM registers on context switches
+bool CheckAVXTechnology(void)
+{
+	int CPUInfo[4];
+	__cpuid( CPUInfo, 1 );
+	if ( ( CPUInfo[2] & 0x18000000 ) != 0x18000000 )	// bit 27 is OSXSAVE, bit 28 is AVX
+		return false;
+
+	// XCR0 bits 1 and 2: the OS saves XMM and YMM state
+	return ( _xgetbv( 0 ) & 6 ) == 6;
+}
+
 #pragma optimize( "", on )
 
 #endif // _WIN32
@@ -45,3 +45,18 @@ bool Check3DNowTechnology(void)
     }
     return false;
 }
+
+bool CheckAVXTechnology(void)
+{
+    unsigned long eax,ebx,ecx,unused;
+    cpuid(1,eax,ebx,ecx,unused);
+
+    // bit 27 is OSXSAVE, bit 28 is AVX
+    if ( ( ecx & 0x18000000 ) != 0x18000000 )
+        return false;
+
+    // xgetbv: make sure the OS saves the XMM and YMM registers
+    unsigned int xcr0, xcr0hi;
+    asm(".byte 0x0f, 0x01, 0xd0" : "=a" (xcr0), "=d" (xcr0hi) : "c" (0));
+    return ( xcr0 & 6 ) == 6;
+}
@@ -30,6 +30,7 @@
 
 	#include "vmpi.h"
 	#include "vmpi_tools_shared.h"
+	#include "workdist.h"
 
 #endif
 
@@ -262,7 +263,7 @@ SpewRetval_t CmdLib_SpewOutputFunc( SpewType_t type, char const *pMsg )
 			// the exceptions and write the minidumps.
 			// Install the function after VMPI_Init with a call:
 			// SetupToolsMinidumpHandler( VMPI_ExceptionFilter );
-			if ( g_bUseMPI && !g_bMPIMaster && !Plat_IsInDebugSession() )
+			if ( g_bUseMPI && !g_bMPIMaster && !WorkDist_IsActive() && !Plat_IsInDebugSession() )
 			{
 				// Generating an exception and letting the
 				// installed handler handle it
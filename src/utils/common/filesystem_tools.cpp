@@ -24,6 +24,7 @@
 	#include "vmpi.h"
 	#include "vmpi_tools_shared.h"
 	#include "vmpi_filesystem.h"
+	#include "workdist.h"
 #endif
 
 // memdbgon must be the last include file in a .cpp file!!!
@@ -148,8 +149,9 @@ bool FileSystem_Init( const char *pBSPFilename, int maxMemoryUsage, FSInitType_t
 	Assert( CommandLine()->GetCmdLine() != NULL ); // Should have called CreateCmdLine by now.
 
 	// If this app uses VMPI, then let VMPI intercept all filesystem calls.
+	// WorkDist processes each use their own.
 #if defined( MPI )
-	if ( g_bUseMPI )
+	if ( g_bUseMPI && !WorkDist_IsActive() )
 	{
 		if ( g_bMPIMaster )
 		{
@@ -175,7 +177,7 @@ bool FileSystem_Init( const char *pBSPFilename, int maxMemoryUsage, FSInitType_t
 void FileSystem_Term()
 {
 #if defined( MPI )
-	if ( g_bUseMPI )
+	if ( g_bUseMPI && !WorkDist_IsActive() )
 	{
 		g_pFileSystem = g_pFullFileSystem = VMPI_FileSystem_Term();
 	}
@@ -199,7 +201,7 @@ void FileSystem_Term()
 CreateInterfaceFn FileSystem_GetFactory()
 {
 #if defined( MPI )
-	if ( g_bUseMPI )
+	if ( g_bUseMPI && !WorkDist_IsActive() )
 		return VMPI_FileSystem_GetFactory();
 #endif
 	return Sys_GetFactory( g_pFullFileSystemModule );
@@ -13,12 +13,13 @@
 #include "worldsize.h"
 #include "threads.h"
 #include "tier0/dbg.h"
+#include "tier0/threadtools.h"
 
 // doesn't seem to need to be here? -- in threads.h
 //extern int numthreads;
 
-// counters are only bumped when running single threaded,
-// because they are an awefull coherence problem
+// threads count into their caches and add it in here a batch at a time, so
+// with more than one thread these can be off by a few cachefuls
 int	c_active_windings;
 int	c_peak_windings;
 int	c_winding_allocs;
@@ -31,7 +32,199 @@ void pw(winding_t *w)
 		printf ("(%5.1f, %5.1f, %5.1f)\n",w->p[i][0], w->p[i][1],w->p[i][2]);
 }
 
-winding_t *winding_pool[MAX_POINTS_ON_WINDING+4];
+//-----------------------------------------------------------------------------
+// Winding allocation
+//
+// Windings come in a few sizes, with the points right after the winding_t,
+// carved out of big chunks that are never freed. Every thread keeps its own
+// free list of each size, and only goes to the shared lists, under a lock,
+// a batch at a time when its list runs dry or gets too long. A freed winding
+// goes on the list of the thread that frees it.
+//
+// RunThreads' threads only live for one batch, so when a batch ends their
+// lists go back on the shared ones and their caches get reused.
+//-----------------------------------------------------------------------------
+#define NUM_WINDING_SIZES		5
+#define WINDING_BATCH			32			// windings moved to or from the shared lists at a time
+#define WINDING_CACHE_MAX		128			// past this a thread gives half of a list back
+#define WINDING_CHUNK_SIZE		(256*1024)
+
+static const int s_nWindingSizes[NUM_WINDING_SIZES] = { 4, 8, 16, 32, MAX_POINTS_ON_WINDING+4 };
+
+struct WindingCache_t
+{
+	winding_t		*m_pFree[NUM_WINDING_SIZES];
+	int				m_nFree[NUM_WINDING_SIZES];
+
+	// not added to the counters yet
+	int				m_nAllocs;
+	int				m_nFrees;
+	int				m_nPoints;
+
+	WindingCache_t	*m_pNext;
+};
+
+static CThreadFastMutex		s_WindingMutex;
+static WindingCache_t		s_SharedWindings;
+static WindingCache_t		*s_pWindingCaches;			// the running threads'
+static WindingCache_t		*s_pSpareWindingCaches;		// from threads that have finished
+static byte					*s_pWindingChunk;
+static int					s_nWindingChunkLeft;
+static THREAD_LOCAL WindingCache_t *s_pWindingCache;
+
+// Which size holds this many points, or -1 if none do
+static int WindingSize( int points )
+{
+	for ( int i = 0; i < NUM_WINDING_SIZES; i++ )
+	{
+		if ( points <= s_nWindingSizes[i] )
+			return i;
+	}
+	return -1;
+}
+
+// Call with s_WindingMutex locked
+static void AddWindingCounts( WindingCache_t *pCache )
+{
+	c_winding_allocs += pCache->m_nAllocs;
+	c_winding_points += pCache->m_nPoints;
+	c_active_windings += pCache->m_nAllocs - pCache->m_nFrees;
+	if (c_active_windings > c_peak_windings)
+		c_peak_windings = c_active_windings;
+
+	pCache->m_nAllocs = 0;
+	pCache->m_nFrees = 0;
+	pCache->m_nPoints = 0;
+}
+
+// Call with s_WindingMutex locked
+static void MoveWindings( WindingCache_t *pFrom, WindingCache_t *pTo, int iSize, int nCount )
+{
+	for ( int i = 0; i < nCount && pFrom->m_pFree[iSize]; i++ )
+	{
+		winding_t *w = pFrom->m_pFree[iSize];
+		pFrom->m_pFree[iSize] = w->next;
+		pFrom->m_nFree[iSize]--;
+
+		w->next = pTo->m_pFree[iSize];
+		pTo->m_pFree[iSize] = w;
+		pTo->m_nFree[iSize]++;
+	}
+}
+
+static WindingCache_t *GetWindingCache( void )
+{
+	WindingCache_t *pCache = s_pWindingCache;
+	if ( !pCache )
+	{
+		s_WindingMutex.Lock();
+		pCache = s_pSpareWindingCaches;
+		if ( pCache )
+		{
+			s_pSpareWindingCaches = pCache->m_pNext;
+		}
+		else
+		{
+			pCache = (WindingCache_t *)calloc( 1, sizeof( WindingCache_t ) );
+		}
+		pCache->m_pNext = s_pWindingCaches;
+		s_pWindingCaches = pCache;
+		s_WindingMutex.Unlock();
+
+		s_pWindingCache = pCache;
+	}
+	return pCache;
+}
+
+static void RefillWindingCache( WindingCache_t *pCache, int iSize )
+{
+	s_WindingMutex.Lock();
+	AddWindingCounts( pCache );
+
+	MoveWindings( &s_SharedWindings, pCache, iSize, WINDING_BATCH );
+
+	// make new ones for the rest
+	int nBytes = ALIGN_VALUE( sizeof( winding_t ) + s_nWindingSizes[iSize] * sizeof( Vector ), 16 );
+	while ( pCache->m_nFree[iSize] < WINDING_BATCH )
+	{
+		if ( s_nWindingChunkLeft < nBytes )
+		{
+			s_pWindingChunk = (byte *)malloc( WINDING_CHUNK_SIZE );
+			if ( !s_pWindingChunk )
+				Error( "AllocWinding: out of memory" );
+			s_nWindingChunkLeft = WINDING_CHUNK_SIZE;
+		}
+
+		winding_t *w = (winding_t *)s_pWindingChunk;
+		s_pWindingChunk += nBytes;
+		s_nWindingChunkLeft -= nBytes;
+
+		w->p = (Vector *)( w + 1 );
+		w->maxpoints = s_nWindingSizes[iSize];
+		w->next = pCache->m_pFree[iSize];
+		pCache->m_pFree[iSize] = w;
+		pCache->m_nFree[iSize]++;
+	}
+	s_WindingMutex.Unlock();
+}
+
+static void SpillWindingCache( WindingCache_t *pCache, int iSize )
+{
+	s_WindingMutex.Lock();
+	AddWindingCounts( pCache );
+	MoveWindings( pCache, &s_SharedWindings, iSize, WINDING_CACHE_MAX / 2 );
+	s_WindingMutex.Unlock();
+}
+
+void FlushWindingCaches (void)
+{
+	s_WindingMutex.Lock();
+
+	WindingCache_t *pOwn = s_pWindingCache;
+	WindingCache_t *pNext;
+	for ( WindingCache_t *pCache = s_pWindingCaches; pCache; pCache = pNext )
+	{
+		pNext = pCache->m_pNext;
+
+		AddWindingCounts( pCache );
+		for ( int i = 0; i < NUM_WINDING_SIZES; i++ )
+		{
+			MoveWindings( pCache, &s_SharedWindings, i, pCache->m_nFree[i] );
+		}
+
+		if ( pCache != pOwn )
+		{
+			pCache->m_pNext = s_pSpareWindingCaches;
+			s_pSpareWindingCaches = pCache;
+		}
+	}
+
+	s_pWindingCaches = pOwn;
+	if ( pOwn )
+	{
+		pOwn->m_pNext = NULL;
+	}
+
+	s_WindingMutex.Unlock();
+}
+
+void GetWindingCounts (int &live, int &peak)
+{
+	s_WindingMutex.Lock();
+	live = c_active_windings;
+	peak = c_peak_windings;
+	s_WindingMutex.Unlock();
+}
+
+// Hand back the caches of each RunThreads batch's threads once they're gone
+static class CWindingCacheFlusher
+{
+public:
+	CWindingCacheFlusher()
+	{
+		RunThreads_AddEndCallback( FlushWindingCaches );
+	}
+} s_WindingCacheFlusher;
 
 /*
 =============
@@ -41,29 +234,32 @@ AllocWinding
 winding_t *AllocWinding (int points)
 {
 	winding_t	*w;
+	int			size;
 
-	if (numthreads == 1)
+	WindingCache_t *pCache = GetWindingCache();
+	size = WindingSize( points );
+	if ( size >= 0 )
 	{
-		c_winding_allocs++;
-		c_winding_points += points;
-		c_active_windings++;
-		if (c_active_windings > c_peak_windings)
-			c_peak_windings = c_active_windings;
-	}
-	ThreadLock();
-	if (winding_pool[points])
-	{
-		w = winding_pool[points];
-		winding_pool[points] = w->next;
+		if ( !pCache->m_pFree[size] )
+		{
+			RefillWindingCache( pCache, size );
+		}
+
+		w = pCache->m_pFree[size];
+		pCache->m_pFree[size] = w->next;
+		pCache->m_nFree[size]--;
 	}
 	else
 	{
-		w = (winding_t *)malloc(sizeof(*w));
-		w->p = (Vector *)calloc( points, sizeof(Vector) );
+		w = (winding_t *)malloc( sizeof(*w) + points * sizeof(Vector) );
+		w->p = (Vector *)( w + 1 );
+		w->maxpoints = points;
 	}
-	ThreadUnlock();
+
+	pCache->m_nAllocs++;
+	pCache->m_nPoints += points;
+
 	w->numpoints = 0; // None are occupied yet even though allocated.
-	w->maxpoints = points;
 	w->next = NULL;
 	return w;
 }
@@ -73,11 +269,24 @@ void FreeWinding (winding_t *w)
 	if (w->numpoints == 0xdeaddead)
 		Error ("FreeWinding: freed a freed winding");
 	
-	ThreadLock();
 	w->numpoints = 0xdeaddead; // flag as freed
-	w->next = winding_pool[w->maxpoints];
-	winding_pool[w->maxpoints] = w;
-	ThreadUnlock();
+
+	WindingCache_t *pCache = GetWindingCache();
+	pCache->m_nFrees++;
+
+	int size = WindingSize( w->maxpoints );
+	if ( size < 0 )
+	{
+		free( w );
+		return;
+	}
+
+	w->next = pCache->m_pFree[size];
+	pCache->m_pFree[size] = w;
+	if ( ++pCache->m_nFree[size] > WINDING_CACHE_MAX )
+	{
+		SpillWindingCache( pCache, size );
+	}
 }
 
 /*
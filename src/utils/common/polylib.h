@@ -62,6 +62,14 @@ void	WindingPlane (winding_t *w, Vector &normal, vec_t *dist);
 void	RemoveColinearPoints (winding_t *w);
 int		WindingOnPlaneSide (winding_t *w, const Vector &normal, vec_t dist);
 void	FreeWinding (winding_t *w);
+
+// Puts every thread's free windings back on the shared lists and adds up the
+// counts. RunThreads calls it at the end of each batch; only call it while no
+// other threads are using windings.
+void	FlushWindingCaches (void);
+
+// Windings allocated and not freed, now and at most
+void	GetWindingCounts (int &live, int &peak);
 void	WindingBounds (winding_t *w, Vector &mins, Vector &maxs);
 
 void	ChopWindingInPlace (winding_t **w, const Vector &normal, vec_t dist, vec_t epsilon);
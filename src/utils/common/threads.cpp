@@ -13,13 +13,22 @@
 
 #define	USED
 
+#ifdef _WIN32
 #include <windows.h>
+#elif defined( POSIX )
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
 #include "cmdlib.h"
 #define NO_THREAD_NAMES
 #include "threads.h"
 #include "pacifier.h"
+#include "tier0/threadtools.h"
 
-#define	MAX_THREADS	16
+#define	MAX_THREADS	MAX_TOOL_THREADS
 
 
 class CRunThreadsData
@@ -28,20 +37,144 @@ public:
 	int m_iThread;
 	void *m_pUserData;
 	RunThreadsFn m_Fn;
+	int m_iCPU;				// Logical processor to pin to, or -1.
+	ERunThreadsPriority m_ePriority;
 };
 
 CRunThreadsData g_RunThreadsData[MAX_THREADS];
 
 
-int		dispatch;
+//-----------------------------------------------------------------------------
+// Work dispatch.
+//
+// The work items are split into one contiguous range per thread. A thread
+// pulls chunks off the front of its own range with an interlocked add, so
+// the common case never touches shared state. When its range runs dry it
+// steals chunks from the other threads' ranges the same way. Each range sits
+// on its own cache line so the owners don't false-share.
+//
+// That's only for callers that don't care what order their items start in
+// (RunThreadsOnAnyOrder and RunThreadsOnIndividualAnyOrder). The default
+// in-order dispatch puts every item in the first range and hands them out one
+// at a time, so GetThreadWork returns increasing indices like it always has.
+//-----------------------------------------------------------------------------
+struct ALIGN128 CThreadWorkRange
+{
+	int volatile m_iNext;	// Next unclaimed item. Can run past m_iEnd.
+	int m_iEnd;
+
+	// Items claimed by this thread but not yet handed out.
+	int m_iChunkCur;
+	int m_iChunkEnd;
+} ALIGN128_POST;
+
+static CThreadWorkRange g_WorkRanges[MAX_THREADS+1];
+static int g_nWorkRanges;
+static int g_nDispatchChunk = 1;
+static bool g_bDispatchInOrder = true;
+static int volatile g_nDispatched;
+static CThreadFastMutex g_PacifierMutex;
+
+// Which entry of g_WorkRanges the calling thread owns.
+static THREAD_LOCAL int g_iWorkRange;
+
 int		workcount;
 qboolean		pacifier;
 
 qboolean	threaded;
 bool g_bLowPriorityThreads = false;
+bool g_bPinThreads = false;
+
+ThreadHandle_t g_ThreadHandles[MAX_THREADS];
+
+
+// Adds to an int and returns what it was. tier0's interlocked functions work
+// on longs, which are 64 bits on LP64.
+static inline int InterlockedAddInt( int volatile *p, int nValue )
+{
+#ifdef _WIN32
+	return ThreadInterlockedExchangeAdd( (long volatile *)p, nValue );
+#else
+	return __sync_fetch_and_add( p, nValue );
+#endif
+}
+
+
+static void SetupWorkRanges( int nWorkCount, int nThreads )
+{
+	if ( nThreads < 1 )
+		nThreads = 1;
+
+	g_nWorkRanges = nThreads;
+	g_nDispatched = 0;
+
+	// Hand out several chunks per thread so stealing can balance the tail.
+	g_nDispatchChunk = g_bDispatchInOrder ? 1 : clamp( nWorkCount / ( nThreads * 16 ), 1, 64 );
+
+	for ( int i=0; i < nThreads; i++ )
+	{
+		if ( g_bDispatchInOrder )
+		{
+			g_WorkRanges[i].m_iNext = 0;
+			g_WorkRanges[i].m_iEnd = ( i == 0 ) ? nWorkCount : 0;
+		}
+		else
+		{
+			g_WorkRanges[i].m_iNext = (int)( ( (int64)nWorkCount * i ) / nThreads );
+			g_WorkRanges[i].m_iEnd = (int)( ( (int64)nWorkCount * (i+1) ) / nThreads );
+		}
+		g_WorkRanges[i].m_iChunkCur = g_WorkRanges[i].m_iChunkEnd = 0;
+	}
+}
+
+
+// Claims a chunk from the specified range. Returns false if the range is exhausted.
+static bool ClaimChunk( CThreadWorkRange *pRange, int *pStart, int *pEnd )
+{
+	if ( pRange->m_iNext >= pRange->m_iEnd )
+		return false;
+
+	int iStart = InterlockedAddInt( &pRange->m_iNext, g_nDispatchChunk );
+	if ( iStart >= pRange->m_iEnd )
+		return false;
+
+	*pStart = iStart;
+	*pEnd = min( iStart + g_nDispatchChunk, pRange->m_iEnd );
+	return true;
+}
 
-HANDLE g_ThreadHandles[MAX_THREADS];
 
+static int GetThreadWorkForRange( int iRange )
+{
+	CThreadWorkRange *pOwn = &g_WorkRanges[iRange];
+
+	if ( pOwn->m_iChunkCur >= pOwn->m_iChunkEnd )
+	{
+		int iStart, iEnd;
+		bool bGot = ClaimChunk( pOwn, &iStart, &iEnd );
+
+		// Our own range is empty. Steal from the others, starting with our neighbour.
+		for ( int i=1; !bGot && i < g_nWorkRanges; i++ )
+		{
+			bGot = ClaimChunk( &g_WorkRanges[(iRange + i) % g_nWorkRanges], &iStart, &iEnd );
+		}
+
+		if ( !bGot )
+			return -1;
+
+		pOwn->m_iChunkCur = iStart;
+		pOwn->m_iChunkEnd = iEnd;
+
+		int nDispatched = InterlockedAddInt( &g_nDispatched, iEnd - iStart ) + ( iEnd - iStart );
+		if ( pacifier && g_PacifierMutex.TryLock() )
+		{
+			UpdatePacifier( (float)nDispatched / workcount );
+			g_PacifierMutex.Unlock();
+		}
+	}
+
+	return pOwn->m_iChunkCur++;
+}
 
 
 /*
@@ -52,23 +185,13 @@ GetThreadWork
 */
 int	GetThreadWork (void)
 {
-	int	r;
-
-	ThreadLock ();
-
-	if (dispatch == workcount)
+	if ( !threaded )
 	{
-		ThreadUnlock ();
-		return -1;
+		// Not inside RunThreadsOn; everything goes through the main thread's range.
+		return GetThreadWorkForRange( 0 );
 	}
 
-	UpdatePacifier( (float)dispatch / workcount );
-
-	r = dispatch;
-	dispatch++;
-	ThreadUnlock ();
-
-	return r;
+	return GetThreadWorkForRange( g_iWorkRange );
 }
 
 
@@ -80,10 +203,10 @@ void ThreadWorkerFunction( int iThread, void *pUserData )
 
 	while (1)
 	{
-		work = GetThreadWork ();
+		work = GetThreadWorkForRange( iThread );
 		if (work == -1)
 			break;
-		 
+
 		workfunction( iThread, work );
 	}
 }
@@ -92,54 +215,184 @@ void RunThreadsOnIndividual (int workcnt, qboolean showpacifier, ThreadWorkerFn
 {
 	if (numthreads == -1)
 		ThreadSetDefault ();
-	
+
 	workfunction = func;
 	RunThreadsOn (workcnt, showpacifier, ThreadWorkerFunction);
 }
 
+void RunThreadsOnIndividualAnyOrder (int workcnt, qboolean showpacifier, ThreadWorkerFn func)
+{
+	g_bDispatchInOrder = false;
+	RunThreadsOnIndividual (workcnt, showpacifier, func);
+	g_bDispatchInOrder = true;
+}
+
+void RunThreadsOnAnyOrder (int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pUserData)
+{
+	g_bDispatchInOrder = false;
+	RunThreadsOn (workcnt, showpacifier, fn, pUserData);
+	g_bDispatchInOrder = true;
+}
+
 
 /*
 ===================================================================
 
-WIN32
+Thread setup
 
 ===================================================================
 */
 
 int		numthreads = -1;
-CRITICAL_SECTION		crit;
+CThreadMutex			crit;
 static int enter;
 
+// Order in which threads are assigned to logical processors when pinning.
+static int g_PinOrder[MAX_THREADS];
+static int g_nPinOrder;
+
 
-class CCritInit
+void SetLowPriority()
 {
-public:
-	CCritInit()
+#ifdef _WIN32
+	SetPriorityClass( GetCurrentProcess(), IDLE_PRIORITY_CLASS );
+#elif defined( POSIX )
+	setpriority( PRIO_PROCESS, 0, 19 );
+#endif
+}
+
+
+#ifdef LINUX
+// Parses a sysfs cpulist ("0-7,16-23") into pCPUs. Returns the number of entries added.
+static int ParseCPUList( const char *pList, int *pCPUs, int nMaxCPUs )
+{
+	int nCPUs = 0;
+	const char *p = pList;
+	while ( *p && nCPUs < nMaxCPUs )
 	{
-		InitializeCriticalSection (&crit);
+		char *pEnd;
+		int iFirst = strtol( p, &pEnd, 10 );
+		if ( pEnd == p )
+			break;
+
+		int iLast = iFirst;
+		p = pEnd;
+		if ( *p == '-' )
+		{
+			iLast = strtol( p+1, &pEnd, 10 );
+			p = pEnd;
+		}
+
+		for ( int i=iFirst; i <= iLast && nCPUs < nMaxCPUs; i++ )
+			pCPUs[nCPUs++] = i;
+
+		if ( *p == ',' )
+			p++;
+		else
+			break;
 	}
-} g_CritInit;
 
+	return nCPUs;
+}
+#endif
 
 
-void SetLowPriority()
+// Builds g_PinOrder so that threads fill one NUMA node before moving to the next.
+static void SetupPinOrder( int nProcessors )
 {
-	SetPriorityClass( GetCurrentProcess(), IDLE_PRIORITY_CLASS );
+	g_nPinOrder = 0;
+
+#ifdef LINUX
+	for ( int iNode=0; g_nPinOrder < MAX_THREADS; iNode++ )
+	{
+		char szFilename[128];
+		Q_snprintf( szFilename, sizeof( szFilename ), "/sys/devices/system/node/node%d/cpulist", iNode );
+		FILE *fp = fopen( szFilename, "r" );
+		if ( !fp )
+			break;
+
+		char szList[1024];
+		if ( fgets( szList, sizeof( szList ), fp ) )
+		{
+			g_nPinOrder += ParseCPUList( szList, &g_PinOrder[g_nPinOrder], MAX_THREADS - g_nPinOrder );
+		}
+		fclose( fp );
+	}
+#endif
+
+	// No topology info; just go in processor order.
+	if ( g_nPinOrder == 0 )
+	{
+		for ( int i=0; i < nProcessors && i < MAX_THREADS; i++ )
+			g_PinOrder[g_nPinOrder++] = i;
+	}
+}
+
+
+static void PinCurrentThread( int iCPU )
+{
+#ifdef _WIN32
+	if ( iCPU < 32 )
+		SetThreadAffinityMask( GetCurrentThread(), 1 << iCPU );
+#elif defined( LINUX )
+	cpu_set_t cpuset;
+	CPU_ZERO( &cpuset );
+	CPU_SET( iCPU, &cpuset );
+	pthread_setaffinity_np( pthread_self(), sizeof( cpuset ), &cpuset );
+#endif
+}
+
+
+static void SetCurrentThreadPriority( ERunThreadsPriority ePriority )
+{
+	if ( ePriority == k_eRunThreadsPriority_UseGlobalState )
+	{
+		if ( !g_bLowPriorityThreads )
+			return;
+#ifdef _WIN32
+		SetThreadPriority( GetCurrentThread(), THREAD_PRIORITY_LOWEST );
+#elif defined( LINUX )
+		setpriority( PRIO_PROCESS, syscall( SYS_gettid ), 10 );
+#endif
+	}
+	else if ( ePriority == k_eRunThreadsPriority_Idle )
+	{
+#ifdef _WIN32
+		SetThreadPriority( GetCurrentThread(), THREAD_PRIORITY_IDLE );
+#elif defined( LINUX )
+		setpriority( PRIO_PROCESS, syscall( SYS_gettid ), 19 );
+#endif
+	}
 }
 
 
 void ThreadSetDefault (void)
 {
-	SYSTEM_INFO info;
+	const CPUInformation *pi = GetCPUInformation();
+	int nProcessors = pi ? pi->m_nLogicalProcessors : 1;
+
+#if defined( POSIX )
+	// m_nLogicalProcessors is only 8 bits wide.
+	long nOnline = sysconf( _SC_NPROCESSORS_ONLN );
+	if ( nOnline > nProcessors )
+		nProcessors = (int)nOnline;
+#endif
 
 	if (numthreads == -1)	// not set manually
 	{
-		GetSystemInfo (&info);
-		numthreads = info.dwNumberOfProcessors;
-		if (numthreads < 1 || numthreads > 32)
+		numthreads = nProcessors;
+		if (numthreads < 1)
 			numthreads = 1;
 	}
 
+	if ( numthreads > MAX_TOOL_THREADS )
+	{
+		Warning( "Clamping %i threads to %i\n", numthreads, MAX_TOOL_THREADS );
+		numthreads = MAX_TOOL_THREADS;
+	}
+
+	SetupPinOrder( nProcessors );
+
 	Msg ("%i threads\n", numthreads);
 }
 
@@ -148,7 +401,7 @@ void ThreadLock (void)
 {
 	if (!threaded)
 		return;
-	EnterCriticalSection (&crit);
+	crit.Lock();
 	if (enter)
 		Error ("Recursive ThreadLock\n");
 	enter = 1;
@@ -161,19 +414,39 @@ void ThreadUnlock (void)
 	if (!enter)
 		Error ("ThreadUnlock without lock\n");
 	enter = 0;
-	LeaveCriticalSection (&crit);
+	crit.Unlock();
 }
 
 
 // This runs in the thread and dispatches a RunThreadsFn call.
-DWORD WINAPI InternalRunThreadsFn( LPVOID pParameter )
+static unsigned InternalRunThreadsFn( void *pParameter )
 {
 	CRunThreadsData *pData = (CRunThreadsData*)pParameter;
+
+	g_iWorkRange = pData->m_iThread;
+	if ( pData->m_iCPU >= 0 )
+		PinCurrentThread( pData->m_iCPU );
+	SetCurrentThreadPriority( pData->m_ePriority );
+
 	pData->m_Fn( pData->m_iThread, pData->m_pUserData );
 	return 0;
 }
 
 
+#define MAX_RUNTHREADS_END_CALLBACKS	8
+
+static RunThreadsEndFn g_RunThreadsEndCallbacks[MAX_RUNTHREADS_END_CALLBACKS];
+static int g_nRunThreadsEndCallbacks;
+
+void RunThreads_AddEndCallback( RunThreadsEndFn fn )
+{
+	if ( g_nRunThreadsEndCallbacks >= MAX_RUNTHREADS_END_CALLBACKS )
+		Error( "RunThreads_AddEndCallback: too many callbacks\n" );
+
+	g_RunThreadsEndCallbacks[g_nRunThreadsEndCallbacks++] = fn;
+}
+
+
 void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePriority )
 {
 	Assert( numthreads > 0 );
@@ -187,38 +460,32 @@ void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePr
 		g_RunThreadsData[i].m_iThread = i;
 		g_RunThreadsData[i].m_pUserData = pUserData;
 		g_RunThreadsData[i].m_Fn = fn;
+		g_RunThreadsData[i].m_iCPU = ( g_bPinThreads && g_nPinOrder > 0 ) ? g_PinOrder[i % g_nPinOrder] : -1;
+		g_RunThreadsData[i].m_ePriority = ePriority;
 
-		DWORD dwDummy;
-		g_ThreadHandles[i] = CreateThread(
-		   NULL,	// LPSECURITY_ATTRIBUTES lpsa,
-		   0,		// DWORD cbStack,
-		   InternalRunThreadsFn,	// LPTHREAD_START_ROUTINE lpStartAddr,
-		   &g_RunThreadsData[i],	// LPVOID lpvThreadParm,
-		   0,			// DWORD fdwCreate,
-		   &dwDummy );
-
-		if ( ePriority == k_eRunThreadsPriority_UseGlobalState )
-		{
-			if( g_bLowPriorityThreads )
-				SetThreadPriority( g_ThreadHandles[i], THREAD_PRIORITY_LOWEST );
-		}
-		else if ( ePriority == k_eRunThreadsPriority_Idle )
-		{
-			SetThreadPriority( g_ThreadHandles[i], THREAD_PRIORITY_IDLE );
-		}
+		g_ThreadHandles[i] = CreateSimpleThread( InternalRunThreadsFn, &g_RunThreadsData[i] );
+		if ( !g_ThreadHandles[i] )
+			Error( "RunThreads_Start: unable to create thread %d\n", i );
 	}
 }
 
 
 void RunThreads_End()
 {
-	WaitForMultipleObjects( numthreads, g_ThreadHandles, TRUE, INFINITE );
 	for ( int i=0; i < numthreads; i++ )
-		CloseHandle( g_ThreadHandles[i] );
+	{
+		ThreadJoin( g_ThreadHandles[i] );
+		ReleaseThreadHandle( g_ThreadHandles[i] );
+	}
 
 	threaded = false;
+
+	for ( int i=0; i < g_nRunThreadsEndCallbacks; i++ )
+	{
+		g_RunThreadsEndCallbacks[i]();
+	}
 }
-	
+
 
 /*
 =============
@@ -229,9 +496,12 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 {
 	int		start, end;
 
+	if (numthreads == -1)
+		ThreadSetDefault ();
+
 	start = Plat_FloatTime();
-	dispatch = 0;
 	workcount = workcnt;
+	SetupWorkRanges( workcnt, numthreads );
 	StartPacifier("");
 	pacifier = showpacifier;
 
@@ -241,7 +511,7 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 	return;
 #endif
 
-	
+
 	RunThreads_Start( fn, pUserData );
 	RunThreads_End();
 
@@ -253,5 +523,3 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 		printf (" (%i)\n", end-start);
 	}
 }
-
-
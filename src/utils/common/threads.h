@@ -18,7 +18,7 @@
 
 // Arrays that are indexed by thread should always be MAX_TOOL_THREADS+1
 // large so THREADINDEX_MAIN can be used from the main thread.
-#define MAX_TOOL_THREADS	16
+#define MAX_TOOL_THREADS	128
 #define THREADINDEX_MAIN	(MAX_TOOL_THREADS)
 
 
@@ -27,6 +27,10 @@ extern	int		numthreads;
 // If set to true, then all the threads that are created are low priority.
 extern bool	g_bLowPriorityThreads;
 
+// If set to true, worker threads are pinned to logical processors, filling
+// one NUMA node before moving on to the next.
+extern bool	g_bPinThreads;
+
 typedef void (*ThreadWorkerFn)( int iThread, int iWorkItem );
 typedef void (*RunThreadsFn)( int iThread, void *pUserData );
 
@@ -49,10 +53,21 @@ void RunThreadsOnIndividual ( int workcnt, qboolean showpacifier, ThreadWorkerFn
 
 void RunThreadsOn ( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pUserData=NULL );
 
+// Like RunThreadsOnIndividual and RunThreadsOn, but GetThreadWork can return the items
+// in any order: each thread works through its own share and then steals from the others.
+// Only for work whose items don't depend on each other.
+void RunThreadsOnIndividualAnyOrder ( int workcnt, qboolean showpacifier, ThreadWorkerFn fn );
+void RunThreadsOnAnyOrder ( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pUserData=NULL );
+
 // This version doesn't track work items - it just runs your function and waits for it to finish.
 void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePriority=k_eRunThreadsPriority_UseGlobalState );
 void RunThreads_End();
 
+// Called by RunThreads_End once the threads are gone, for code that keeps
+// per-thread state to gather it up. Register from static constructors.
+typedef void (*RunThreadsEndFn)( void );
+void RunThreads_AddEndCallback( RunThreadsEndFn fn );
+
 void ThreadLock (void);
 void ThreadUnlock (void);
 
@@ -60,6 +75,8 @@ void ThreadUnlock (void);
 #ifndef NO_THREAD_NAMES
 #define RunThreadsOn(n,p,f) { if (p) printf("%-20s ", #f ":"); RunThreadsOn(n,p,f); }
 #define RunThreadsOnIndividual(n,p,f) { if (p) printf("%-20s ", #f ":"); RunThreadsOnIndividual(n,p,f); }
+#define RunThreadsOnIndividualAnyOrder(n,p,f) { if (p) printf("%-20s ", #f ":"); RunThreadsOnIndividualAnyOrder(n,p,f); }
+#define RunThreadsOnAnyOrder(n,p,f) { if (p) printf("%-20s ", #f ":"); RunThreadsOnAnyOrder(n,p,f); }
 #endif
 
 #endif // THREADS_H
@@ -7,8 +7,10 @@
 #include <windows.h>
 #include <dbghelp.h>
 #include "vmpi.h"
+#include "vmpi_distribute_work.h"
 #include "cmdlib.h"
 #include "vmpi_tools_shared.h"
+#include "utlbuffer.h"
 #include "tier1/strtools.h"
 #include "mpi_stats.h"
 #include "iphelpers.h"
@@ -372,3 +374,66 @@ void HandleMPIDisconnect( int procID, const char *pReason )
 }
 
 
+
+
+// ------------------------------------------------------------------------------------------------ //
+// DistributeWork for the WorkDist work unit functions.
+// ------------------------------------------------------------------------------------------------ //
+
+static WorkDistProcessFn g_VMPIProcessFn = NULL;
+static WorkDistReceiveFn g_VMPIReceiveFn = NULL;
+
+
+class CVMPIDistributeWorkCallbacks : public IWorkUnitDistributorCallbacks
+{
+public:
+	virtual bool Update()										{ return m_pCallbacks->Update(); }
+	virtual void OnWorkUnitsCompleted( uint64 numWorkUnits )	{ m_pCallbacks->OnWorkUnitsCompleted( numWorkUnits ); }
+
+	IWorkDistCallbacks *m_pCallbacks;
+};
+
+static CVMPIDistributeWorkCallbacks g_VMPIDistributeWorkCallbacks;
+
+
+static void VMPI_ProcessWorkUnit( int iThread, uint64 iWorkUnit, MessageBuffer *pBuf )
+{
+	// Local threads on the master have nowhere to send results.
+	if ( !pBuf )
+	{
+		g_VMPIProcessFn( iThread, iWorkUnit, NULL );
+		return;
+	}
+
+	CUtlBuffer buf;
+	g_VMPIProcessFn( iThread, iWorkUnit, &buf );
+	pBuf->write( buf.Base(), buf.TellPut() );
+}
+
+
+static void VMPI_ReceiveWorkUnit( uint64 iWorkUnit, MessageBuffer *pBuf, int iWorker )
+{
+	CUtlBuffer buf;
+	int nBytes = pBuf->getLen() - pBuf->getOffset();
+	if ( nBytes > 0 )
+	{
+		buf.SetExternalBuffer( pBuf->data + pBuf->getOffset(), nBytes, nBytes, CUtlBuffer::READ_ONLY );
+	}
+	g_VMPIReceiveFn( iWorkUnit, &buf, iWorker );
+}
+
+
+double VMPI_DistributeWork( uint64 nWorkUnits, char cPacketID, WorkDistProcessFn processFn, WorkDistReceiveFn receiveFn, IWorkDistCallbacks *pCallbacks )
+{
+	g_VMPIProcessFn = processFn;
+	g_VMPIReceiveFn = receiveFn;
+	g_VMPIDistributeWorkCallbacks.m_pCallbacks = pCallbacks;
+	g_pDistributeWorkCallbacks = pCallbacks ? &g_VMPIDistributeWorkCallbacks : NULL;
+
+	double flElapsed = DistributeWork( nWorkUnits, cPacketID, VMPI_ProcessWorkUnit, VMPI_ReceiveWorkUnit );
+
+	g_pDistributeWorkCallbacks = NULL;
+	g_VMPIProcessFn = NULL;
+	g_VMPIReceiveFn = NULL;
+	return flElapsed;
+}
@@ -11,6 +11,9 @@
 #endif
 
 
+#include "workdist.h"
+
+
 // Packet IDs.
 	#define VMPI_SUBPACKETID_DIRECTORIES	0	// qdir directories.
 	#define VMPI_SUBPACKETID_DBINFO			1	// MySQL database info.
@@ -41,5 +44,9 @@ void VMPI_ExceptionFilter( unsigned long uCode, void *pvExceptionInfo );
 
 void HandleMPIDisconnect( int procID, const char *pReason );
 
+// DistributeWork for the WorkDist work unit functions, so a tool can run the same
+// ones under VMPI and WorkDist. pCallbacks goes in g_pDistributeWorkCallbacks.
+double VMPI_DistributeWork( uint64 nWorkUnits, char cPacketID, WorkDistProcessFn processFn, WorkDistReceiveFn receiveFn, IWorkDistCallbacks *pCallbacks = NULL );
+
 
 #endif // VMPI_TOOLS_SHARED_H
@@ -0,0 +1,1407 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Portable work distribution for the map compile tools.
+//
+//			Every message is a DistMsgHeader_t followed by its payload. Workers
+//			drive the conversation: they ask for work units or shared data and
+//			the coordinator answers. A request the coordinator can't answer yet
+//			(a worker asking for a stage or a blob the coordinator hasn't
+//			reached) is parked on the connection and answered when it can be.
+//
+//			Stages are numbered by counting WorkDist_DistributeWork calls on
+//			each side, so a worker can tell whether a stage it asks about is
+//			finished, current, or still ahead of the coordinator.
+//
+//			The coordinator only services its sockets inside
+//			WorkDist_DistributeWork, WorkDist_ShareData and WorkDist_Shutdown.
+//			In between, connecting workers wait in the listen backlog and
+//			requests wait in the socket buffers.
+//
+//=============================================================================//
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#elif defined( POSIX )
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+#include "cmdlib.h"
+#include "threads.h"
+#include "pacifier.h"
+#include "workdist.h"
+#include "utlbuffer.h"
+#include "utlvector.h"
+#include "utlstring.h"
+#include "tier0/threadtools.h"
+#include "tier1/strtools.h"
+#include "tier1/checksum_crc.h"
+
+
+#ifdef _WIN32
+	typedef SOCKET DistSocket_t;
+	typedef WSAPOLLFD DistPollFd_t;
+	#define DIST_INVALID_SOCKET		INVALID_SOCKET
+	#define DIST_SEND_FLAGS			0
+	#define DistCloseSocket			closesocket
+	#define DistPoll				WSAPoll
+#else
+	typedef int DistSocket_t;
+	typedef struct pollfd DistPollFd_t;
+	#define DIST_INVALID_SOCKET		(-1)
+	#ifdef MSG_NOSIGNAL
+		#define DIST_SEND_FLAGS		MSG_NOSIGNAL
+	#else
+		#define DIST_SEND_FLAGS		0
+	#endif
+	#define DistCloseSocket			close
+	#define DistPoll				poll
+#endif
+
+
+#define WORKDIST_PROTOCOL_VERSION	2
+
+// Work units a worker asks for per thread, and the most handed out at once.
+#define WORKDIST_UNITS_PER_THREAD	2
+#define WORKDIST_MAX_UNITS_PER_REPLY	256
+
+// Largest results a worker may send for one work unit. Until a connection has
+// said hello the coordinator accepts nothing bigger than the hello.
+#define WORKDIST_MAX_RESULT_BYTES	( 256 * 1024 * 1024 )
+
+// Largest blob WorkDist_ShareData takes. Shared lighting data for a big map is
+// the largest thing sent; workers size the receive from the DIST_MSG_DATA_INFO
+// that comes ahead of it.
+#define WORKDIST_MAX_SHARED_BYTES	( 1024 * 1024 * 1024 )
+
+// Largest shared data name.
+#define WORKDIST_MAX_NAME_BYTES		256
+
+// How long the coordinator blocks in poll() before checking on its threads.
+#define WORKDIST_POLL_MS			50
+
+// How long a worker keeps trying to reach a coordinator that isn't up yet.
+#define WORKDIST_CONNECT_TIMEOUT	60.0
+
+// How long the coordinator waits for the worker processes it started to exit.
+#define WORKDIST_CHILD_EXIT_TIMEOUT	10.0
+
+
+enum DistMsgType_t
+{
+	DIST_MSG_HELLO = 1,		// worker -> coordinator: DistHello_t
+	DIST_MSG_WELCOME,		// coordinator -> worker: (empty)
+	DIST_MSG_GET_WORK,		// worker -> coordinator: DistGetWork_t
+	DIST_MSG_WORK,			// coordinator -> worker: uint64 work unit indices
+	DIST_MSG_STAGE_DONE,	// coordinator -> worker: nothing left to hand out in that stage
+	DIST_MSG_RESULT,		// worker -> coordinator: DistResult_t + results
+	DIST_MSG_GET_DATA,		// worker -> coordinator: blob name
+	DIST_MSG_DATA_INFO,		// coordinator -> worker: DistDataInfo_t, then DIST_MSG_DATA
+	DIST_MSG_DATA,			// coordinator -> worker: blob contents
+	DIST_MSG_QUIT			// coordinator -> worker: exit now
+};
+
+struct DistMsgHeader_t
+{
+	uint32	m_nType;
+	uint32	m_nBytes;		// Payload size, not including the header.
+};
+
+struct DistHello_t
+{
+	uint32	m_nVersion;
+	uint32	m_nJobCRC;		// Tool and map name, so workers can't join the wrong job.
+	char	m_szName[64];
+};
+
+struct DistGetWork_t
+{
+	int32	m_iStage;
+	int32	m_nMaxUnits;
+};
+
+struct DistDataInfo_t
+{
+	uint32	m_nBytes;
+	uint32	m_nCRC;
+};
+
+struct DistResult_t
+{
+	int32	m_iStage;
+	int32	m_nPad;
+	uint64	m_iWorkUnit;
+};
+
+
+enum EDistUnitState
+{
+	DIST_UNIT_PENDING = 0,
+	DIST_UNIT_LOCAL,		// Being processed by one of the coordinator's threads, or
+							// waiting in m_LocalResults for the main thread.
+	DIST_UNIT_REMOTE,		// Handed out to a worker.
+	DIST_UNIT_DONE
+};
+
+
+// The coordinator's view of a connected worker.
+class CDistConnection
+{
+public:
+	CDistConnection()
+	{
+		m_Socket = DIST_INVALID_SOCKET;
+		m_iWorker = -1;
+		m_szName[0] = 0;
+		m_nDeferredType = 0;
+		m_iDeferredStage = 0;
+		m_nDeferredMaxUnits = 0;
+	}
+
+	DistSocket_t		m_Socket;
+	int					m_iWorker;		// -1 until it has said hello.
+	char				m_szName[64];
+
+	// Bytes received but not yet parsed into messages.
+	CUtlVector<uint8>	m_Recv;
+
+	// A request that is waiting for the coordinator to catch up. 0 if none.
+	uint32				m_nDeferredType;
+	int					m_iDeferredStage;
+	int					m_nDeferredMaxUnits;
+	CUtlString			m_DeferredName;
+
+	// Work units handed out in the current stage that we don't have results for.
+	CUtlVector<uint64>	m_Assigned;
+};
+
+
+class CDistSharedData
+{
+public:
+	CUtlString			m_Name;
+	CUtlVector<uint8>	m_Data;
+	CRC32_t				m_nCRC;
+};
+
+
+// The stage the coordinator is running. The mutex guards everything the
+// coordinator's local threads touch.
+class CDistStage
+{
+public:
+	CThreadMutex		m_Mutex;
+	bool				m_bActive;
+	bool				m_bStop;		// Stopped early by m_pCallbacks.
+	bool				m_bFinished;
+	uint64				m_nWorkUnits;
+	uint64				m_iNextUnit;	// First work unit that hasn't been handed out yet.
+	uint64				m_nDone;
+	WorkDistProcessFn	m_ProcessFn;
+	WorkDistReceiveFn	m_ReceiveFn;
+	IWorkDistCallbacks	*m_pCallbacks;
+	CUtlVector<uint8>	m_UnitState;	// EDistUnitState
+	CUtlVector<uint64>	m_Requeued;		// Handed out to workers that went away.
+
+	// Results from the local threads, laid out like DIST_MSG_RESULT messages,
+	// waiting for the main thread to pass them to m_ReceiveFn.
+	CUtlVector<uint8>	m_LocalResults;
+};
+
+
+// The stage a worker is running.
+class CDistWorkerStage
+{
+public:
+	CThreadMutex		m_Mutex;		// Also serializes use of the socket.
+	WorkDistProcessFn	m_ProcessFn;
+	CUtlVector<uint64>	m_Queue;
+	bool				m_bStageDone;
+	bool				m_bQuit;
+};
+
+
+static bool g_bDistActive = false;
+static bool g_bDistCoordinator = false;
+static int g_iDistStage = 0;
+static uint32 g_nDistJobCRC = 0;
+
+// Coordinator.
+static DistSocket_t g_DistListenSocket = DIST_INVALID_SOCKET;
+static char g_szDistUnixPath[256];
+static CUtlVector<CDistConnection*> g_DistConnections;
+static CUtlVector<CDistSharedData*> g_DistSharedData;
+static CDistStage g_DistStage;
+static int g_nDistWorkersSeen = 0;
+static bool g_bDistShuttingDown = false;
+
+#ifdef _WIN32
+static CUtlVector<HANDLE> g_DistChildren;
+#else
+static CUtlVector<pid_t> g_DistChildren;
+#endif
+
+// Worker.
+static DistSocket_t g_DistCoordinatorSocket = DIST_INVALID_SOCKET;
+static CDistWorkerStage g_DistWorkerStage;
+
+
+// ------------------------------------------------------------------------------------------------ //
+// Sockets.
+// ------------------------------------------------------------------------------------------------ //
+
+static bool DistSendAll( DistSocket_t s, const void *pData, int nBytes )
+{
+	const char *p = (const char*)pData;
+	while ( nBytes > 0 )
+	{
+		int nSent = send( s, p, nBytes, DIST_SEND_FLAGS );
+		if ( nSent <= 0 )
+			return false;
+
+		p += nSent;
+		nBytes -= nSent;
+	}
+	return true;
+}
+
+
+static bool DistRecvAll( DistSocket_t s, void *pData, int nBytes )
+{
+	char *p = (char*)pData;
+	while ( nBytes > 0 )
+	{
+		int nReceived = recv( s, p, nBytes, 0 );
+		if ( nReceived <= 0 )
+			return false;
+
+		p += nReceived;
+		nBytes -= nReceived;
+	}
+	return true;
+}
+
+
+static bool DistSendMsg( DistSocket_t s, uint32 nType, const void *pData1 = NULL, int nBytes1 = 0, const void *pData2 = NULL, int nBytes2 = 0 )
+{
+	DistMsgHeader_t header;
+	header.m_nType = nType;
+	header.m_nBytes = nBytes1 + nBytes2;
+
+	return DistSendAll( s, &header, sizeof( header ) ) &&
+		DistSendAll( s, pData1, nBytes1 ) &&
+		DistSendAll( s, pData2, nBytes2 );
+}
+
+
+// Blocking receive of one whole message of at most nMaxBytes.
+static bool DistRecvMsg( DistSocket_t s, uint32 &nType, CUtlBuffer &payload, uint32 nMaxBytes )
+{
+	DistMsgHeader_t header;
+	if ( !DistRecvAll( s, &header, sizeof( header ) ) )
+		return false;
+
+	if ( header.m_nBytes > nMaxBytes )
+		return false;
+
+	payload.Purge();
+	payload.EnsureCapacity( header.m_nBytes );
+	if ( !DistRecvAll( s, payload.Base(), header.m_nBytes ) )
+		return false;
+
+	payload.SeekPut( CUtlBuffer::SEEK_HEAD, header.m_nBytes );
+	nType = header.m_nType;
+	return true;
+}
+
+
+// Opens a listening or connected socket for an address in one of the forms
+// described in workdist.h. For a listening socket, pConnectAddr receives the
+// address a worker on this machine should connect to.
+static DistSocket_t DistOpenSocket( const char *pAddr, bool bListen, char *pConnectAddr = NULL, int nConnectAddrLen = 0 )
+{
+#ifdef POSIX
+	if ( !Q_strncmp( pAddr, "unix:", 5 ) )
+	{
+		struct sockaddr_un addr;
+		memset( &addr, 0, sizeof( addr ) );
+		addr.sun_family = AF_UNIX;
+		Q_strncpy( addr.sun_path, pAddr + 5, sizeof( addr.sun_path ) );
+
+		DistSocket_t s = socket( AF_UNIX, SOCK_STREAM, 0 );
+		if ( s == DIST_INVALID_SOCKET )
+			return DIST_INVALID_SOCKET;
+
+		if ( bListen )
+		{
+			unlink( addr.sun_path );
+			if ( bind( s, (struct sockaddr*)&addr, sizeof( addr ) ) != 0 || listen( s, 64 ) != 0 )
+			{
+				DistCloseSocket( s );
+				return DIST_INVALID_SOCKET;
+			}
+
+			Q_strncpy( g_szDistUnixPath, addr.sun_path, sizeof( g_szDistUnixPath ) );
+			if ( pConnectAddr )
+				Q_strncpy( pConnectAddr, pAddr, nConnectAddrLen );
+		}
+		else if ( connect( s, (struct sockaddr*)&addr, sizeof( addr ) ) != 0 )
+		{
+			DistCloseSocket( s );
+			return DIST_INVALID_SOCKET;
+		}
+
+		return s;
+	}
+#endif
+
+	// host:port, :port or just port.
+	char szHost[256];
+	const char *pPort = strrchr( pAddr, ':' );
+	if ( pPort )
+	{
+		Q_strncpy( szHost, pAddr, MIN( (int)sizeof( szHost ), (int)( pPort - pAddr ) + 1 ) );
+		++pPort;
+	}
+	else
+	{
+		szHost[0] = 0;
+		pPort = pAddr;
+	}
+
+	if ( !bListen && !szHost[0] )
+		Q_strncpy( szHost, "127.0.0.1", sizeof( szHost ) );
+
+	struct addrinfo hints;
+	memset( &hints, 0, sizeof( hints ) );
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = bListen ? AI_PASSIVE : 0;
+
+	struct addrinfo *pResults = NULL;
+	if ( getaddrinfo( szHost[0] ? szHost : NULL, pPort, &hints, &pResults ) != 0 )
+		return DIST_INVALID_SOCKET;
+
+	DistSocket_t s = DIST_INVALID_SOCKET;
+	for ( struct addrinfo *pInfo = pResults; pInfo; pInfo = pInfo->ai_next )
+	{
+		s = socket( pInfo->ai_family, pInfo->ai_socktype, pInfo->ai_protocol );
+		if ( s == DIST_INVALID_SOCKET )
+			continue;
+
+		int one = 1;
+		bool bOK;
+		if ( bListen )
+		{
+			setsockopt( s, SOL_SOCKET, SO_REUSEADDR, (const char*)&one, sizeof( one ) );
+			bOK = ( bind( s, pInfo->ai_addr, (int)pInfo->ai_addrlen ) == 0 && listen( s, 64 ) == 0 );
+		}
+		else
+		{
+			bOK = ( connect( s, pInfo->ai_addr, (int)pInfo->ai_addrlen ) == 0 );
+		}
+
+		if ( bOK )
+		{
+			// Results are small and latency matters more than throughput.
+			setsockopt( s, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof( one ) );
+			break;
+		}
+
+		DistCloseSocket( s );
+		s = DIST_INVALID_SOCKET;
+	}
+	freeaddrinfo( pResults );
+
+	if ( s != DIST_INVALID_SOCKET && bListen && pConnectAddr )
+	{
+		struct sockaddr_in bound;
+		socklen_t boundLen = sizeof( bound );
+		getsockname( s, (struct sockaddr*)&bound, &boundLen );
+		Q_snprintf( pConnectAddr, nConnectAddrLen, "%s:%d", szHost[0] ? szHost : "127.0.0.1", ntohs( bound.sin_port ) );
+	}
+
+	return s;
+}
+
+
+// ------------------------------------------------------------------------------------------------ //
+// Command line.
+// ------------------------------------------------------------------------------------------------ //
+
+static uint32 DistComputeJobCRC( int argc, char **argv )
+{
+	char szTool[MAX_PATH], szMap[MAX_PATH];
+	Q_FileBase( argv[0], szTool, sizeof( szTool ) );
+	Q_FileBase( argc > 1 ? argv[argc-1] : "", szMap, sizeof( szMap ) );
+	Q_strlower( szTool );
+	Q_strlower( szMap );
+
+	CRC32_t crc;
+	CRC32_Init( &crc );
+	CRC32_ProcessBuffer( &crc, szTool, Q_strlen( szTool ) );
+	CRC32_ProcessBuffer( &crc, szMap, Q_strlen( szMap ) );
+	CRC32_Final( &crc );
+	return crc;
+}
+
+
+// Starts a copy of this process that connects back to us as a worker.
+static void DistStartLocalWorker( int argc, char **argv, const char *pConnectAddr )
+{
+#ifdef _WIN32
+	char szExe[MAX_PATH];
+	GetModuleFileName( NULL, szExe, sizeof( szExe ) );
+
+	CUtlString cmdLine;
+	cmdLine += "\"";
+	cmdLine += szExe;
+	cmdLine += "\" -dist_worker ";
+	cmdLine += pConnectAddr;
+	for ( int i=1; i < argc; i++ )
+	{
+		cmdLine += " \"";
+		cmdLine += argv[i];
+		cmdLine += "\"";
+	}
+
+	STARTUPINFO si;
+	memset( &si, 0, sizeof( si ) );
+	si.cb = sizeof( si );
+	PROCESS_INFORMATION pi;
+
+	// Detached, so the workers don't write over the coordinator's console.
+	if ( !CreateProcess( szExe, (char*)cmdLine.Get(), NULL, NULL, FALSE, DETACHED_PROCESS, NULL, NULL, &si, &pi ) )
+		Error( "WorkDist: can't start a local worker (%s).\n", szExe );
+
+	CloseHandle( pi.hThread );
+	g_DistChildren.AddToTail( pi.hProcess );
+#else
+	CUtlVector<char*> args;
+	args.AddToTail( argv[0] );
+	args.AddToTail( (char*)"-dist_worker" );
+	args.AddToTail( (char*)pConnectAddr );
+	for ( int i=1; i < argc; i++ )
+		args.AddToTail( argv[i] );
+	args.AddToTail( NULL );
+
+	fflush( stdout );
+	pid_t pid = fork();
+	if ( pid < 0 )
+		Error( "WorkDist: can't start a local worker (fork failed).\n" );
+
+	if ( pid == 0 )
+	{
+		// Keep stderr, but don't let the workers write over the coordinator's output.
+		int fdNull = open( "/dev/null", O_WRONLY );
+		if ( fdNull >= 0 )
+			dup2( fdNull, STDOUT_FILENO );
+
+		execv( "/proc/self/exe", args.Base() );
+		execvp( argv[0], args.Base() );
+		_exit( 127 );
+	}
+
+	g_DistChildren.AddToTail( pid );
+#endif
+}
+
+
+bool WorkDist_Init( int &argc, char **&argv )
+{
+	const char *pListenAddr = NULL;
+	const char *pWorkerAddr = NULL;
+	int nLocalWorkers = 0;
+
+	// Pull our arguments out so the tool never sees them.
+	int nArgs = 1;
+	for ( int i=1; i < argc; i++ )
+	{
+		if ( !Q_stricmp( argv[i], "-dist" ) && i+1 < argc )
+		{
+			pListenAddr = argv[++i];
+		}
+		else if ( !Q_stricmp( argv[i], "-dist_worker" ) && i+1 < argc )
+		{
+			pWorkerAddr = argv[++i];
+		}
+		else if ( !Q_stricmp( argv[i], "-dist_local" ) && i+1 < argc )
+		{
+			nLocalWorkers = MAX( 0, atoi( argv[++i] ) );
+		}
+		else
+		{
+			argv[nArgs++] = argv[i];
+		}
+	}
+	argc = nArgs;
+	argv[argc] = NULL;
+
+	if ( !pListenAddr && !pWorkerAddr && !nLocalWorkers )
+		return false;
+
+	if ( pWorkerAddr && ( pListenAddr || nLocalWorkers ) )
+		Error( "WorkDist: -dist_worker can't be used with -dist or -dist_local.\n" );
+
+#ifdef _WIN32
+	WSADATA wsaData;
+	if ( WSAStartup( MAKEWORD( 2, 2 ), &wsaData ) != 0 )
+		Error( "WorkDist: WSAStartup failed.\n" );
+#else
+	// A worker going away shouldn't take the coordinator with it.
+	signal( SIGPIPE, SIG_IGN );
+#endif
+
+	g_nDistJobCRC = DistComputeJobCRC( argc, argv );
+	g_bDistActive = true;
+	CmdLib_AtCleanup( WorkDist_Shutdown );
+
+	if ( pWorkerAddr )
+	{
+		g_bDistCoordinator = false;
+
+		// The coordinator may still be starting up.
+		double flGiveUp = Plat_FloatTime() + WORKDIST_CONNECT_TIMEOUT;
+		while ( ( g_DistCoordinatorSocket = DistOpenSocket( pWorkerAddr, false ) ) == DIST_INVALID_SOCKET )
+		{
+			if ( Plat_FloatTime() > flGiveUp )
+				Error( "WorkDist: can't connect to the coordinator at %s.\n", pWorkerAddr );
+			ThreadSleep( 1000 );
+		}
+
+		DistHello_t hello;
+		memset( &hello, 0, sizeof( hello ) );
+		hello.m_nVersion = WORKDIST_PROTOCOL_VERSION;
+		hello.m_nJobCRC = g_nDistJobCRC;
+		if ( gethostname( hello.m_szName, sizeof( hello.m_szName ) - 1 ) != 0 )
+			Q_strncpy( hello.m_szName, "unknown", sizeof( hello.m_szName ) );
+
+		uint32 nType;
+		CUtlBuffer reply;
+		if ( !DistSendMsg( g_DistCoordinatorSocket, DIST_MSG_HELLO, &hello, sizeof( hello ) ) ||
+			!DistRecvMsg( g_DistCoordinatorSocket, nType, reply, 0 ) )
+		{
+			Error( "WorkDist: lost the connection to the coordinator at %s.\n", pWorkerAddr );
+		}
+
+		if ( nType != DIST_MSG_WELCOME )
+			Error( "WorkDist: the coordinator at %s turned this worker away (different job or version, or it's shutting down).\n", pWorkerAddr );
+
+		Msg( "WorkDist: working for the coordinator at %s.\n", pWorkerAddr );
+		return true;
+	}
+
+	g_bDistCoordinator = true;
+
+	char szConnectAddr[256];
+	if ( !pListenAddr )
+		pListenAddr = "127.0.0.1:0";
+
+	g_DistListenSocket = DistOpenSocket( pListenAddr, true, szConnectAddr, sizeof( szConnectAddr ) );
+	if ( g_DistListenSocket == DIST_INVALID_SOCKET )
+		Error( "WorkDist: can't listen on %s.\n", pListenAddr );
+
+	Msg( "WorkDist: coordinator listening on %s.\n", szConnectAddr );
+
+	for ( int i=0; i < nLocalWorkers; i++ )
+	{
+		DistStartLocalWorker( argc, argv, szConnectAddr );
+	}
+
+	if ( nLocalWorkers )
+		Msg( "WorkDist: started %d local worker%s.\n", nLocalWorkers, nLocalWorkers == 1 ? "" : "s" );
+
+	return true;
+}
+
+
+bool WorkDist_IsActive()
+{
+	return g_bDistActive;
+}
+
+
+bool WorkDist_IsCoordinator()
+{
+	return g_bDistActive && g_bDistCoordinator;
+}
+
+
+// ------------------------------------------------------------------------------------------------ //
+// Coordinator.
+// ------------------------------------------------------------------------------------------------ //
+
+// Caller holds g_DistStage.m_Mutex.
+static bool DistTakeWorkUnit( uint64 &iWorkUnit, EDistUnitState eNewState )
+{
+	CDistStage &stage = g_DistStage;
+	if ( stage.m_bStop || stage.m_bFinished )
+		return false;
+
+	if ( stage.m_Requeued.Count() )
+	{
+		iWorkUnit = stage.m_Requeued.Tail();
+		stage.m_Requeued.RemoveMultipleFromTail( 1 );
+	}
+	else if ( stage.m_iNextUnit < stage.m_nWorkUnits )
+	{
+		iWorkUnit = stage.m_iNextUnit++;
+	}
+	else
+	{
+		return false;
+	}
+
+	stage.m_UnitState[iWorkUnit] = (uint8)eNewState;
+	return true;
+}
+
+
+// The coordinator's own threads pick up work units alongside the workers.
+// Their results go through m_ReceiveFn on the main thread like everyone else's.
+static void DistLocalThread( int iThread, void *pUserData )
+{
+	CDistStage &stage = g_DistStage;
+	CUtlBuffer buf;
+
+	while ( 1 )
+	{
+		uint64 iWorkUnit = 0;
+
+		stage.m_Mutex.Lock();
+		bool bGotOne = DistTakeWorkUnit( iWorkUnit, DIST_UNIT_LOCAL );
+		bool bFinished = ( stage.m_bStop || stage.m_bFinished );
+		stage.m_Mutex.Unlock();
+
+		if ( !bGotOne )
+		{
+			if ( bFinished )
+				break;
+
+			// Everything is out with the workers. Stick around in case one of them drops.
+			ThreadSleep( 10 );
+			continue;
+		}
+
+		buf.SeekPut( CUtlBuffer::SEEK_HEAD, 0 );
+		stage.m_ProcessFn( iThread, iWorkUnit, &buf );
+
+		DistMsgHeader_t header;
+		header.m_nType = DIST_MSG_RESULT;
+		header.m_nBytes = sizeof( DistResult_t ) + buf.TellPut();
+
+		DistResult_t result;
+		result.m_iStage = g_iDistStage;
+		result.m_nPad = 0;
+		result.m_iWorkUnit = iWorkUnit;
+
+		stage.m_Mutex.Lock();
+		stage.m_LocalResults.AddMultipleToTail( sizeof( header ), (const uint8*)&header );
+		stage.m_LocalResults.AddMultipleToTail( sizeof( result ), (const uint8*)&result );
+		stage.m_LocalResults.AddMultipleToTail( buf.TellPut(), (const uint8*)buf.Base() );
+		stage.m_Mutex.Unlock();
+	}
+}
+
+
+// Passes one work unit's results to m_ReceiveFn.
+static void DistReceiveWorkUnit( uint64 iWorkUnit, const uint8 *pData, int nBytes, int iWorker )
+{
+	CUtlBuffer buf;
+	if ( nBytes > 0 )
+	{
+		buf.SetExternalBuffer( (void*)pData, nBytes, nBytes, CUtlBuffer::READ_ONLY );
+	}
+	g_DistStage.m_ReceiveFn( iWorkUnit, &buf, iWorker );
+}
+
+
+// Hands the local threads' results to m_ReceiveFn. Main thread only.
+static void DistReceiveLocalResults()
+{
+	CDistStage &stage = g_DistStage;
+
+	CUtlVector<uint8> results;
+	stage.m_Mutex.Lock();
+	results.Swap( stage.m_LocalResults );
+	stage.m_Mutex.Unlock();
+
+	int iRead = 0;
+	while ( iRead < results.Count() )
+	{
+		DistMsgHeader_t header;
+		memcpy( &header, &results[iRead], sizeof( header ) );
+
+		DistResult_t result;
+		memcpy( &result, &results[iRead + sizeof( header )], sizeof( result ) );
+
+		DistReceiveWorkUnit( result.m_iWorkUnit, results.Base() + iRead + sizeof( header ) + sizeof( result ), header.m_nBytes - sizeof( result ), 0 );
+
+		stage.m_Mutex.Lock();
+		stage.m_UnitState[result.m_iWorkUnit] = DIST_UNIT_DONE;
+		++stage.m_nDone;
+		stage.m_Mutex.Unlock();
+
+		iRead += sizeof( header ) + header.m_nBytes;
+	}
+}
+
+
+static void DistDropConnection( int iConnection, const char *pReason )
+{
+	CDistConnection *pConn = g_DistConnections[iConnection];
+
+	// Give its work units to someone else.
+	int nRequeued = 0;
+	if ( g_DistStage.m_bActive )
+	{
+		g_DistStage.m_Mutex.Lock();
+		for ( int i=0; i < pConn->m_Assigned.Count(); i++ )
+		{
+			uint64 iWorkUnit = pConn->m_Assigned[i];
+			if ( g_DistStage.m_UnitState[iWorkUnit] == DIST_UNIT_REMOTE )
+			{
+				g_DistStage.m_UnitState[iWorkUnit] = DIST_UNIT_PENDING;
+				g_DistStage.m_Requeued.AddToTail( iWorkUnit );
+				++nRequeued;
+			}
+		}
+		g_DistStage.m_Mutex.Unlock();
+	}
+
+	if ( pConn->m_iWorker >= 0 && !g_bDistShuttingDown )
+	{
+		Warning( "\nWorkDist: lost worker %d (%s): %s. Requeued %d work units.\n", pConn->m_iWorker, pConn->m_szName, pReason, nRequeued );
+	}
+
+	DistCloseSocket( pConn->m_Socket );
+	delete pConn;
+	g_DistConnections.Remove( iConnection );
+}
+
+
+// Answers the connection's parked request if we can. Returns false if the
+// connection should be dropped.
+static bool DistAnswerDeferred( CDistConnection *pConn )
+{
+	if ( pConn->m_nDeferredType == DIST_MSG_GET_DATA )
+	{
+		for ( int i=0; i < g_DistSharedData.Count(); i++ )
+		{
+			CDistSharedData *pData = g_DistSharedData[i];
+			if ( pData->m_Name == pConn->m_DeferredName )
+			{
+				DistDataInfo_t info;
+				info.m_nBytes = pData->m_Data.Count();
+				info.m_nCRC = pData->m_nCRC;
+
+				pConn->m_nDeferredType = 0;
+				return DistSendMsg( pConn->m_Socket, DIST_MSG_DATA_INFO, &info, sizeof( info ) ) &&
+					DistSendMsg( pConn->m_Socket, DIST_MSG_DATA, pData->m_Data.Base(), pData->m_Data.Count() );
+			}
+		}
+
+		if ( g_bDistShuttingDown )
+		{
+			pConn->m_nDeferredType = 0;
+			return DistSendMsg( pConn->m_Socket, DIST_MSG_QUIT );
+		}
+	}
+	else if ( pConn->m_nDeferredType == DIST_MSG_GET_WORK )
+	{
+		int iStage = pConn->m_iDeferredStage;
+		bool bCurrent = ( g_DistStage.m_bActive && iStage == g_iDistStage );
+
+		if ( g_bDistShuttingDown )
+		{
+			pConn->m_nDeferredType = 0;
+			return DistSendMsg( pConn->m_Socket, DIST_MSG_QUIT );
+		}
+		else if ( bCurrent )
+		{
+			uint64 workUnits[WORKDIST_MAX_UNITS_PER_REPLY];
+			int nMaxUnits = MAX( 1, MIN( pConn->m_nDeferredMaxUnits, WORKDIST_MAX_UNITS_PER_REPLY ) );
+			int nUnits = 0;
+
+			g_DistStage.m_Mutex.Lock();
+			while ( nUnits < nMaxUnits && DistTakeWorkUnit( workUnits[nUnits], DIST_UNIT_REMOTE ) )
+			{
+				++nUnits;
+			}
+			g_DistStage.m_Mutex.Unlock();
+
+			pConn->m_nDeferredType = 0;
+			if ( !nUnits )
+				return DistSendMsg( pConn->m_Socket, DIST_MSG_STAGE_DONE );
+
+			pConn->m_Assigned.AddMultipleToTail( nUnits, workUnits );
+			return DistSendMsg( pConn->m_Socket, DIST_MSG_WORK, workUnits, nUnits * sizeof( workUnits[0] ) );
+		}
+		else if ( iStage < g_iDistStage || ( iStage == g_iDistStage && !g_DistStage.m_bActive ) )
+		{
+			pConn->m_nDeferredType = 0;
+			return DistSendMsg( pConn->m_Socket, DIST_MSG_STAGE_DONE );
+		}
+
+		// Otherwise the worker is ahead of us; it waits.
+	}
+
+	return true;
+}
+
+
+static void DistReceiveResult( CDistConnection *pConn, const uint8 *pData, int nBytes )
+{
+	DistResult_t result;
+	memcpy( &result, pData, sizeof( result ) );
+
+	CDistStage &stage = g_DistStage;
+	if ( !stage.m_bActive || result.m_iStage != g_iDistStage || result.m_iWorkUnit >= stage.m_nWorkUnits )
+		return;
+
+	if ( pConn->m_Assigned.FindAndFastRemove( result.m_iWorkUnit ) == false )
+		return;
+
+	stage.m_Mutex.Lock();
+	bool bWanted = ( stage.m_UnitState[result.m_iWorkUnit] == DIST_UNIT_REMOTE );
+	stage.m_Mutex.Unlock();
+
+	if ( !bWanted )
+		return;
+
+	DistReceiveWorkUnit( result.m_iWorkUnit, pData + sizeof( result ), nBytes - sizeof( result ), pConn->m_iWorker );
+
+	stage.m_Mutex.Lock();
+	stage.m_UnitState[result.m_iWorkUnit] = DIST_UNIT_DONE;
+	++stage.m_nDone;
+	stage.m_Mutex.Unlock();
+}
+
+
+// Returns false if the connection should be dropped.
+static bool DistHandleMessage( CDistConnection *pConn, uint32 nType, const uint8 *pData, int nBytes )
+{
+	if ( pConn->m_iWorker < 0 && nType != DIST_MSG_HELLO )
+		return false;
+
+	switch ( nType )
+	{
+		case DIST_MSG_HELLO:
+		{
+			DistHello_t hello;
+			if ( nBytes != sizeof( hello ) || pConn->m_iWorker >= 0 )
+				return false;
+
+			memcpy( &hello, pData, sizeof( hello ) );
+			hello.m_szName[sizeof( hello.m_szName ) - 1] = 0;
+			Q_strncpy( pConn->m_szName, hello.m_szName, sizeof( pConn->m_szName ) );
+
+			if ( hello.m_nVersion != WORKDIST_PROTOCOL_VERSION || hello.m_nJobCRC != g_nDistJobCRC )
+			{
+				Warning( "\nWorkDist: turned away a worker from %s running a different job or version.\n", pConn->m_szName );
+				DistSendMsg( pConn->m_Socket, DIST_MSG_QUIT );
+				return false;
+			}
+
+			pConn->m_iWorker = ++g_nDistWorkersSeen;
+			if ( !g_bDistShuttingDown )
+				Msg( "\nWorkDist: worker %d (%s) connected.\n", pConn->m_iWorker, pConn->m_szName );
+			return DistSendMsg( pConn->m_Socket, g_bDistShuttingDown ? DIST_MSG_QUIT : DIST_MSG_WELCOME );
+		}
+
+		case DIST_MSG_GET_WORK:
+		{
+			DistGetWork_t request;
+			if ( nBytes != sizeof( request ) || pConn->m_nDeferredType )
+				return false;
+
+			memcpy( &request, pData, sizeof( request ) );
+			pConn->m_nDeferredType = DIST_MSG_GET_WORK;
+			pConn->m_iDeferredStage = request.m_iStage;
+			pConn->m_nDeferredMaxUnits = request.m_nMaxUnits;
+			return DistAnswerDeferred( pConn );
+		}
+
+		case DIST_MSG_GET_DATA:
+		{
+			if ( nBytes < 1 || nBytes > WORKDIST_MAX_NAME_BYTES || pData[nBytes-1] != 0 || pConn->m_nDeferredType )
+				return false;
+
+			pConn->m_nDeferredType = DIST_MSG_GET_DATA;
+			pConn->m_DeferredName = (const char*)pData;
+			return DistAnswerDeferred( pConn );
+		}
+
+		case DIST_MSG_RESULT:
+		{
+			if ( nBytes < (int)sizeof( DistResult_t ) )
+				return false;
+
+			DistReceiveResult( pConn, pData, nBytes );
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+// Parses whatever whole messages have arrived on a connection.
+static bool DistProcessReceived( CDistConnection *pConn )
+{
+	// Nobody gets to make us buffer more than a hello before we know they're on this job.
+	uint32 nMaxBytes = ( pConn->m_iWorker < 0 ) ? sizeof( DistHello_t ) : WORKDIST_MAX_RESULT_BYTES;
+
+	int iRead = 0;
+	while ( pConn->m_Recv.Count() - iRead >= (int)sizeof( DistMsgHeader_t ) )
+	{
+		DistMsgHeader_t header;
+		memcpy( &header, &pConn->m_Recv[iRead], sizeof( header ) );
+		if ( header.m_nBytes > nMaxBytes )
+			return false;
+
+		if ( pConn->m_Recv.Count() - iRead - (int)sizeof( header ) < (int)header.m_nBytes )
+			break;
+
+		const uint8 *pPayload = pConn->m_Recv.Base() + iRead + sizeof( header );
+		if ( !DistHandleMessage( pConn, header.m_nType, pPayload, header.m_nBytes ) )
+			return false;
+
+		iRead += sizeof( header ) + header.m_nBytes;
+		nMaxBytes = ( pConn->m_iWorker < 0 ) ? sizeof( DistHello_t ) : WORKDIST_MAX_RESULT_BYTES;
+	}
+
+	pConn->m_Recv.RemoveMultipleFromHead( iRead );
+	return true;
+}
+
+
+// Accepts new workers and handles everything that has arrived, waiting up to
+// nTimeoutMS for something to happen.
+static void DistServiceConnections( int nTimeoutMS )
+{
+	CUtlVector<DistPollFd_t> fds;
+	fds.SetCount( g_DistConnections.Count() + 1 );
+	memset( fds.Base(), 0, fds.Count() * sizeof( DistPollFd_t ) );
+
+	fds[0].fd = g_DistListenSocket;
+	fds[0].events = POLLIN;
+	for ( int i=0; i < g_DistConnections.Count(); i++ )
+	{
+		fds[i+1].fd = g_DistConnections[i]->m_Socket;
+		fds[i+1].events = POLLIN;
+	}
+
+	if ( DistPoll( fds.Base(), fds.Count(), nTimeoutMS ) <= 0 )
+		return;
+
+	// Walk backwards so dropping a connection doesn't disturb the indices.
+	for ( int i=g_DistConnections.Count()-1; i >= 0; i-- )
+	{
+		if ( !( fds[i+1].revents & ( POLLIN | POLLHUP | POLLERR ) ) )
+			continue;
+
+		CDistConnection *pConn = g_DistConnections[i];
+
+		uint8 buf[64 * 1024];
+		int nReceived = recv( pConn->m_Socket, (char*)buf, sizeof( buf ), 0 );
+		if ( nReceived <= 0 )
+		{
+			DistDropConnection( i, "connection closed" );
+			continue;
+		}
+
+		pConn->m_Recv.AddMultipleToTail( nReceived, buf );
+		if ( !DistProcessReceived( pConn ) )
+		{
+			DistDropConnection( i, "protocol error" );
+		}
+	}
+
+	if ( fds[0].revents & POLLIN )
+	{
+		DistSocket_t s = accept( g_DistListenSocket, NULL, NULL );
+		if ( s != DIST_INVALID_SOCKET )
+		{
+			CDistConnection *pConn = new CDistConnection;
+			pConn->m_Socket = s;
+			g_DistConnections.AddToTail( pConn );
+		}
+	}
+}
+
+
+static void DistAnswerAllDeferred()
+{
+	for ( int i=g_DistConnections.Count()-1; i >= 0; i-- )
+	{
+		if ( !DistAnswerDeferred( g_DistConnections[i] ) )
+		{
+			DistDropConnection( i, "connection closed" );
+		}
+	}
+}
+
+
+static double DistRunCoordinatorStage( uint64 nWorkUnits, WorkDistProcessFn processFn, WorkDistReceiveFn receiveFn, IWorkDistCallbacks *pCallbacks )
+{
+	double flStart = Plat_FloatTime();
+
+	CDistStage &stage = g_DistStage;
+	stage.m_nWorkUnits = nWorkUnits;
+	stage.m_iNextUnit = 0;
+	stage.m_nDone = 0;
+	stage.m_bStop = false;
+	stage.m_bFinished = false;
+	stage.m_ProcessFn = processFn;
+	stage.m_ReceiveFn = receiveFn;
+	stage.m_pCallbacks = pCallbacks;
+	stage.m_UnitState.SetCount( (int)nWorkUnits );
+	memset( stage.m_UnitState.Base(), DIST_UNIT_PENDING, (size_t)nWorkUnits );
+	stage.m_Requeued.RemoveAll();
+	stage.m_LocalResults.RemoveAll();
+	for ( int i=0; i < g_DistConnections.Count(); i++ )
+	{
+		g_DistConnections[i]->m_Assigned.RemoveAll();
+	}
+	stage.m_bActive = true;
+
+	RunThreads_Start( DistLocalThread, NULL );
+
+	uint64 nCompletedInOrder = 0;
+	double flNextUpdate = 0;
+	while ( 1 )
+	{
+		DistServiceConnections( WORKDIST_POLL_MS );
+
+		// Workers waiting on this stage may have been parked before we got here.
+		DistAnswerAllDeferred();
+
+		DistReceiveLocalResults();
+
+		stage.m_Mutex.Lock();
+		uint64 nDone = stage.m_nDone;
+		uint64 nCompleted = nCompletedInOrder;
+		while ( nCompleted < nWorkUnits && stage.m_UnitState[nCompleted] == DIST_UNIT_DONE )
+		{
+			++nCompleted;
+		}
+		stage.m_Mutex.Unlock();
+
+		if ( pCallbacks && nCompleted != nCompletedInOrder )
+		{
+			pCallbacks->OnWorkUnitsCompleted( nCompleted );
+		}
+		nCompletedInOrder = nCompleted;
+
+		if ( nWorkUnits )
+			UpdatePacifier( (float)nDone / nWorkUnits );
+
+		if ( nDone == nWorkUnits )
+			break;
+
+		if ( pCallbacks && Plat_FloatTime() >= flNextUpdate )
+		{
+			flNextUpdate = Plat_FloatTime() + 0.2;
+			if ( pCallbacks->Update() )
+			{
+				stage.m_Mutex.Lock();
+				stage.m_bStop = true;
+				stage.m_Mutex.Unlock();
+				break;
+			}
+		}
+	}
+
+	stage.m_Mutex.Lock();
+	stage.m_bFinished = true;
+	stage.m_Mutex.Unlock();
+
+	RunThreads_End();
+
+	// Units the local threads finished after a stop.
+	DistReceiveLocalResults();
+
+	// Anyone still asking about this stage has nothing more to do in it.
+	stage.m_bActive = false;
+	DistAnswerAllDeferred();
+
+	return Plat_FloatTime() - flStart;
+}
+
+
+// ------------------------------------------------------------------------------------------------ //
+// Worker.
+// ------------------------------------------------------------------------------------------------ //
+
+// Caller holds g_DistWorkerStage.m_Mutex.
+static void DistWorkerRequestWork()
+{
+	CDistWorkerStage &stage = g_DistWorkerStage;
+
+	DistGetWork_t request;
+	request.m_iStage = g_iDistStage;
+	request.m_nMaxUnits = MAX( 1, numthreads * WORKDIST_UNITS_PER_THREAD );
+
+	uint32 nType;
+	CUtlBuffer reply;
+	if ( !DistSendMsg( g_DistCoordinatorSocket, DIST_MSG_GET_WORK, &request, sizeof( request ) ) ||
+		!DistRecvMsg( g_DistCoordinatorSocket, nType, reply, WORKDIST_MAX_UNITS_PER_REPLY * sizeof( uint64 ) ) )
+	{
+		// The coordinator is gone, so there's nobody to give results to.
+		stage.m_bStageDone = stage.m_bQuit = true;
+		return;
+	}
+
+	if ( nType == DIST_MSG_WORK )
+	{
+		int nUnits = reply.TellPut() / sizeof( uint64 );
+		stage.m_Queue.AddMultipleToTail( nUnits, (const uint64*)reply.Base() );
+	}
+	else if ( nType == DIST_MSG_STAGE_DONE )
+	{
+		stage.m_bStageDone = true;
+	}
+	else
+	{
+		stage.m_bStageDone = stage.m_bQuit = true;
+	}
+}
+
+
+static void DistWorkerThread( int iThread, void *pUserData )
+{
+	CDistWorkerStage &stage = g_DistWorkerStage;
+	CUtlBuffer buf;
+
+	while ( 1 )
+	{
+		stage.m_Mutex.Lock();
+		if ( !stage.m_Queue.Count() && !stage.m_bStageDone )
+		{
+			DistWorkerRequestWork();
+		}
+
+		if ( !stage.m_Queue.Count() )
+		{
+			stage.m_Mutex.Unlock();
+			break;
+		}
+
+		uint64 iWorkUnit = stage.m_Queue[0];
+		stage.m_Queue.Remove( 0 );
+		stage.m_Mutex.Unlock();
+
+		buf.SeekPut( CUtlBuffer::SEEK_HEAD, 0 );
+		stage.m_ProcessFn( iThread, iWorkUnit, &buf );
+
+		DistResult_t result;
+		result.m_iStage = g_iDistStage;
+		result.m_nPad = 0;
+		result.m_iWorkUnit = iWorkUnit;
+
+		stage.m_Mutex.Lock();
+		if ( !stage.m_bQuit && !DistSendMsg( g_DistCoordinatorSocket, DIST_MSG_RESULT, &result, sizeof( result ), buf.Base(), buf.TellPut() ) )
+		{
+			stage.m_bStageDone = stage.m_bQuit = true;
+			stage.m_Queue.RemoveAll();
+		}
+		stage.m_Mutex.Unlock();
+	}
+}
+
+
+static void DistWorkerQuit()
+{
+	Msg( "\nWorkDist: the coordinator is done with us. Exiting.\n" );
+	CmdLib_Exit( 0 );
+}
+
+
+static double DistRunWorkerStage( WorkDistProcessFn processFn )
+{
+	double flStart = Plat_FloatTime();
+
+	CDistWorkerStage &stage = g_DistWorkerStage;
+	stage.m_ProcessFn = processFn;
+	stage.m_Queue.RemoveAll();
+	stage.m_bStageDone = false;
+	stage.m_bQuit = false;
+
+	RunThreads_Start( DistWorkerThread, NULL );
+	RunThreads_End();
+
+	if ( stage.m_bQuit )
+		DistWorkerQuit();
+
+	return Plat_FloatTime() - flStart;
+}
+
+
+// ------------------------------------------------------------------------------------------------ //
+// Interface.
+// ------------------------------------------------------------------------------------------------ //
+
+double WorkDist_DistributeWork( uint64 nWorkUnits, WorkDistProcessFn processFn, WorkDistReceiveFn receiveFn, IWorkDistCallbacks *pCallbacks )
+{
+	Assert( g_bDistActive );
+	if ( numthreads == -1 )
+		ThreadSetDefault();
+
+	++g_iDistStage;
+	if ( g_bDistCoordinator )
+		return DistRunCoordinatorStage( nWorkUnits, processFn, receiveFn, pCallbacks );
+	else
+		return DistRunWorkerStage( processFn );
+}
+
+
+void WorkDist_ShareData( const char *pName, const void *pData, int nBytes )
+{
+	Assert( WorkDist_IsCoordinator() );
+
+	if ( nBytes < 0 || nBytes > WORKDIST_MAX_SHARED_BYTES )
+		Error( "WorkDist: shared data \"%s\" is %d bytes; the most WorkDist can send is %d.\n", pName, nBytes, WORKDIST_MAX_SHARED_BYTES );
+
+	if ( Q_strlen( pName ) + 1 > WORKDIST_MAX_NAME_BYTES )
+		Error( "WorkDist: shared data name \"%s\" is too long.\n", pName );
+
+	CDistSharedData *pShared = new CDistSharedData;
+	pShared->m_Name = pName;
+	pShared->m_Data.CopyArray( (const uint8*)pData, nBytes );
+	pShared->m_nCRC = CRC32_ProcessSingleBuffer( pData, nBytes );
+	g_DistSharedData.AddToTail( pShared );
+
+	// Workers may already be waiting for it.
+	DistServiceConnections( 0 );
+	DistAnswerAllDeferred();
+}
+
+
+void WorkDist_GetSharedData( const char *pName, CUtlBuffer &buf )
+{
+	Assert( g_bDistActive && !g_bDistCoordinator );
+
+	// The size comes first so we never take the coordinator's word for more than the blob.
+	uint32 nType;
+	CUtlBuffer infoBuf;
+	if ( !DistSendMsg( g_DistCoordinatorSocket, DIST_MSG_GET_DATA, pName, Q_strlen( pName ) + 1 ) ||
+		!DistRecvMsg( g_DistCoordinatorSocket, nType, infoBuf, sizeof( DistDataInfo_t ) ) ||
+		nType != DIST_MSG_DATA_INFO ||
+		infoBuf.TellPut() != sizeof( DistDataInfo_t ) )
+	{
+		DistWorkerQuit();
+	}
+
+	DistDataInfo_t info;
+	memcpy( &info, infoBuf.Base(), sizeof( info ) );
+	if ( info.m_nBytes > WORKDIST_MAX_SHARED_BYTES ||
+		!DistRecvMsg( g_DistCoordinatorSocket, nType, buf, info.m_nBytes ) ||
+		nType != DIST_MSG_DATA ||
+		(uint32)buf.TellPut() != info.m_nBytes )
+	{
+		DistWorkerQuit();
+	}
+
+	if ( CRC32_ProcessSingleBuffer( buf.Base(), info.m_nBytes ) != info.m_nCRC )
+		Error( "WorkDist: shared data \"%s\" from the coordinator is corrupt.\n", pName );
+}
+
+
+static bool DistWaitForChildren( double flTimeout )
+{
+	double flGiveUp = Plat_FloatTime() + flTimeout;
+	while ( g_DistChildren.Count() )
+	{
+#ifdef _WIN32
+		if ( WaitForSingleObject( g_DistChildren.Tail(), 100 ) == WAIT_OBJECT_0 )
+		{
+			CloseHandle( g_DistChildren.Tail() );
+			g_DistChildren.RemoveMultipleFromTail( 1 );
+			continue;
+		}
+#else
+		int status;
+		if ( waitpid( g_DistChildren.Tail(), &status, WNOHANG ) != 0 )
+		{
+			g_DistChildren.RemoveMultipleFromTail( 1 );
+			continue;
+		}
+		ThreadSleep( 100 );
+#endif
+		// Keep answering them so they can get to the point of exiting.
+		DistServiceConnections( 0 );
+		DistAnswerAllDeferred();
+
+		if ( Plat_FloatTime() > flGiveUp )
+			return false;
+	}
+	return true;
+}
+
+
+void WorkDist_Shutdown()
+{
+	if ( !g_bDistActive )
+		return;
+
+	if ( !g_bDistCoordinator )
+	{
+		DistCloseSocket( g_DistCoordinatorSocket );
+		g_DistCoordinatorSocket = DIST_INVALID_SOCKET;
+		g_bDistActive = false;
+		return;
+	}
+
+	// Tell everyone waiting on us to go home, and anyone who asks from now on.
+	g_bDistShuttingDown = true;
+	DistServiceConnections( 0 );
+	DistAnswerAllDeferred();
+
+	if ( !DistWaitForChildren( WORKDIST_CHILD_EXIT_TIMEOUT ) )
+	{
+		Warning( "WorkDist: %d local worker%s didn't exit; killing them.\n", g_DistChildren.Count(), g_DistChildren.Count() == 1 ? "" : "s" );
+		for ( int i=0; i < g_DistChildren.Count(); i++ )
+		{
+#ifdef _WIN32
+			TerminateProcess( g_DistChildren[i], 1 );
+			CloseHandle( g_DistChildren[i] );
+#else
+			kill( g_DistChildren[i], SIGKILL );
+			waitpid( g_DistChildren[i], NULL, 0 );
+#endif
+		}
+		g_DistChildren.RemoveAll();
+	}
+
+	while ( g_DistConnections.Count() )
+	{
+		DistDropConnection( g_DistConnections.Count() - 1, "shutting down" );
+	}
+
+	DistCloseSocket( g_DistListenSocket );
+	g_DistListenSocket = DIST_INVALID_SOCKET;
+
+#ifdef POSIX
+	if ( g_szDistUnixPath[0] )
+		unlink( g_szDistUnixPath );
+#endif
+
+	g_DistSharedData.PurgeAndDeleteElements();
+	g_bDistActive = false;
+
+#ifdef _WIN32
+	WSACleanup();
+#endif
+}
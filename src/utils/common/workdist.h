@@ -0,0 +1,80 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Portable work distribution for the map compile tools.
+//
+//			A coordinator process listens on a TCP port (or a Unix domain
+//			socket on POSIX) and hands out the same work units DistributeWork
+//			does to worker processes on this machine or others. Workers run
+//			the tool with the same arguments plus -dist_worker, so they load
+//			the map themselves and stay in step with the coordinator by calling
+//			WorkDist_DistributeWork the same number of times in the same order.
+//
+//			Command line (stripped by WorkDist_Init):
+//				-dist <addr>			Be the coordinator and listen on <addr>.
+//				-dist_local <n>			Be the coordinator and start <n> worker
+//										processes on this machine. Listens on an
+//										ephemeral loopback port unless -dist is
+//										also given.
+//				-dist_worker <addr>		Be a worker for the coordinator at <addr>.
+//
+//			<addr> is "host:port", ":port" (all interfaces, coordinator only)
+//			or, on POSIX, "unix:/path/to/socket".
+//
+//=============================================================================//
+
+#ifndef WORKDIST_H
+#define WORKDIST_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+
+#include "tier0/platform.h"
+
+class CUtlBuffer;
+
+
+// The work unit functions. They're the same as DistributeWork's, but pass the
+// results in a CUtlBuffer so WorkDist doesn't need the VMPI library.
+//
+// processFn appends the work unit's results to pBuf.
+typedef void (*WorkDistProcessFn)( int iThread, uint64 iWorkUnit, CUtlBuffer *pBuf );
+
+// receiveFn reads back the results processFn wrote to pBuf.
+typedef void (*WorkDistReceiveFn)( uint64 iWorkUnit, CUtlBuffer *pBuf, int iWorker );
+
+// The coordinator calls these on its main thread while a stage runs.
+class IWorkDistCallbacks
+{
+public:
+	// Return true to stop handing out work units and finish the stage early.
+	virtual bool Update() { return false; }
+
+	// The first numWorkUnits work units are all done.
+	virtual void OnWorkUnitsCompleted( uint64 numWorkUnits ) {}
+};
+
+
+// Called first thing in the exe. Returns true if this process is part of a
+// distributed session. Registers WorkDist_Shutdown with CmdLib_AtCleanup.
+bool	WorkDist_Init( int &argc, char **&argv );
+
+bool	WorkDist_IsActive();
+bool	WorkDist_IsCoordinator();
+
+// Same contract as DistributeWork. The coordinator processes work units on
+// its own threads too while the workers are busy, and calls receiveFn on the
+// main thread for every work unit, its own included (with iWorker 0). Workers return once every work unit
+// has been handed out. Returns the time it took.
+double	WorkDist_DistributeWork( uint64 nWorkUnits, WorkDistProcessFn processFn, WorkDistReceiveFn receiveFn, IWorkDistCallbacks *pCallbacks = NULL );
+
+// The coordinator publishes a named blob; workers block in
+// WorkDist_GetSharedData until it's available.
+void	WorkDist_ShareData( const char *pName, const void *pData, int nBytes );
+void	WorkDist_GetSharedData( const char *pName, CUtlBuffer &buf );
+
+// The coordinator tells its workers to exit and waits for any it started.
+void	WorkDist_Shutdown();
+
+
+#endif // WORKDIST_H
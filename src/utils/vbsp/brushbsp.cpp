@@ -7,12 +7,47 @@
 //=============================================================================//
 
 #include "vbsp.h"
+#include "tier1/mempool.h"
 
 
 int		c_nodes;
 int		c_nonvis;
 int		c_active_brushes;
 
+static CInterlockedInt	s_nNodeCount;
+static CInterlockedInt	s_nBrushId;
+
+//-----------------------------------------------------------------------------
+// Nodes and brushes come out of pools that keep a free list per thread, so the
+// threads building a tree don't fight over the heap. Brushes are pooled by
+// side count, and each one sits behind a header saying which pool it's from.
+//-----------------------------------------------------------------------------
+#define BRUSH_SIZE( numsides )		( offsetof( bspbrush_t, sides ) + (numsides) * sizeof( side_t ) )
+
+struct BrushHeader_t
+{
+	int		m_iPool;		// -1 if it came from malloc
+	int		m_nPad[3];		// keeps the brush 16 byte aligned
+};
+
+static CMemoryPoolMT s_NodePool( sizeof( node_t ), 1024, UTLMEMORYPOOL_GROW_FAST, "vbsp nodes" );
+static CMemoryPoolMT s_BrushPool8( sizeof( BrushHeader_t ) + BRUSH_SIZE( 8 ), 1024, UTLMEMORYPOOL_GROW_FAST, "vbsp brushes" );
+static CMemoryPoolMT s_BrushPool16( sizeof( BrushHeader_t ) + BRUSH_SIZE( 16 ), 512, UTLMEMORYPOOL_GROW_FAST, "vbsp brushes" );
+static CMemoryPoolMT s_BrushPool32( sizeof( BrushHeader_t ) + BRUSH_SIZE( 32 ), 256, UTLMEMORYPOOL_GROW_FAST, "vbsp brushes" );
+
+static CMemoryPoolMT *s_pBrushPools[] = { &s_BrushPool8, &s_BrushPool16, &s_BrushPool32 };
+static const int s_nBrushPoolSides[] = { 8, 16, 32 };
+
+// RunThreads' threads only live for one batch; take back what they had cached
+static void FlushThreadPools( void )
+{
+	s_NodePool.FlushThreadCaches();
+	for ( int i = 0; i < ARRAYSIZE( s_pBrushPools ); i++ )
+	{
+		s_pBrushPools[i]->FlushThreadCaches();
+	}
+}
+
 // if a brush just barely pokes onto the other side,
 // let it slide by without chopping
 #define	PLANESIDE_EPSILON	0.001
@@ -310,20 +345,26 @@ AllocNode
 */
 node_t *AllocNode (void)
 {
-	static int s_NodeCount = 0;
-
 	node_t	*node;
 
-	node = (node_t*)malloc(sizeof(*node));
+	node = (node_t*)s_NodePool.Alloc();
 	memset (node, 0, sizeof(*node));
-	node->id = s_NodeCount;
+	node->id = s_nNodeCount++;
 	node->diskId = -1;
 
-	s_NodeCount++;
-
 	return node;
 }
 
+/*
+================
+FreeNode
+================
+*/
+void FreeNode (node_t *node)
+{
+	s_NodePool.Free (node);
+}
+
 
 /*
 ================
@@ -332,15 +373,32 @@ AllocBrush
 */
 bspbrush_t *AllocBrush (int numsides)
 {
-	static int s_BrushId = 0;
-
 	bspbrush_t	*bb;
+	BrushHeader_t	*header;
 	int			c;
+	int			pool;
 
-	c = (int)&(((bspbrush_t *)0)->sides[numsides]);
-	bb = (bspbrush_t*)malloc(c);
+	c = BRUSH_SIZE( numsides );
+	for (pool = 0 ; pool < ARRAYSIZE( s_pBrushPools ) ; pool++)
+	{
+		if (numsides <= s_nBrushPoolSides[pool])
+			break;
+	}
+
+	if (pool < ARRAYSIZE( s_pBrushPools ))
+	{
+		header = (BrushHeader_t*)s_pBrushPools[pool]->Alloc();
+	}
+	else
+	{
+		header = (BrushHeader_t*)malloc(sizeof(BrushHeader_t) + c);
+		pool = -1;
+	}
+	header->m_iPool = pool;
+
+	bb = (bspbrush_t*)(header + 1);
 	memset (bb, 0, c);
-	bb->id = s_BrushId++;
+	bb->id = s_nBrushId++;
 	if (numthreads == 1)
 		c_active_brushes++;
 	return bb;
@@ -358,7 +416,12 @@ void FreeBrush (bspbrush_t *brushes)
 	for (i=0 ; i<brushes->numsides ; i++)
 		if (brushes->sides[i].winding)
 			FreeWinding(brushes->sides[i].winding);
-	free (brushes);
+
+	BrushHeader_t *header = (BrushHeader_t*)brushes - 1;
+	if (header->m_iPool >= 0)
+		s_pBrushPools[header->m_iPool]->Free (header);
+	else
+		free (header);
 	if (numthreads == 1)
 		c_active_brushes--;
 }
@@ -839,6 +902,179 @@ qboolean CheckPlaneAgainstVolume (int pnum, node_t *node)
 	return good;
 }
 
+//-----------------------------------------------------------------------------
+// Building trees on several threads.
+//
+// The subtrees on either side of a split don't share any brushes, and
+// building them never adds planes, so once a node has been split both
+// children can be built at the same time and the tree comes out the same as
+// it does on one thread. A node with enough brushes puts its back child on a
+// shared stack for any idle thread and carries on with the front one itself.
+// The children are hooked into the tree before that, so it doesn't matter
+// which thread gets to them or when.
+//
+// Big nodes also put the scoring of their split planes on the stack; see
+// SelectSplitSideParallel.
+//-----------------------------------------------------------------------------
+#define BSP_TASK_MIN_BRUSHES		32		// smaller subtrees are built by the thread that split them
+#define BSP_PARALLEL_SPLIT_BRUSHES	256		// nodes with this many brushes score their planes in parallel
+#define BSP_PLANES_PER_TASK			8
+
+typedef void (*BSPTaskFn)( void *pContext, void *pData, int iItem );
+
+struct BSPTask_t
+{
+	BSPTaskFn		m_pFn;
+	void			*m_pContext;
+	void			*m_pData;
+	int				m_iItem;
+	CInterlockedInt	*m_pPending;		// group the task belongs to, or NULL
+};
+
+static CUtlVector<BSPTask_t>	s_BSPTasks;
+static CThreadFastMutex			s_BSPTaskMutex;
+static CInterlockedInt			s_nBSPTasksOutstanding;		// queued or running
+static bool						s_bBSPThreaded;
+
+static void PushBSPTask( BSPTaskFn pFn, void *pContext, void *pData, int iItem, CInterlockedInt *pPending )
+{
+	BSPTask_t task;
+	task.m_pFn = pFn;
+	task.m_pContext = pContext;
+	task.m_pData = pData;
+	task.m_iItem = iItem;
+	task.m_pPending = pPending;
+
+	if ( pPending )
+	{
+		++(*pPending);
+	}
+	++s_nBSPTasksOutstanding;
+
+	s_BSPTaskMutex.Lock();
+	s_BSPTasks.AddToTail( task );
+	s_BSPTaskMutex.Unlock();
+}
+
+// Takes the newest task, or the newest one in pPending's group
+static bool PopBSPTask( BSPTask_t &task, CInterlockedInt *pPending )
+{
+	s_BSPTaskMutex.Lock();
+	for ( int i = s_BSPTasks.Count() - 1; i >= 0; i-- )
+	{
+		if ( !pPending || s_BSPTasks[i].m_pPending == pPending )
+		{
+			task = s_BSPTasks[i];
+			s_BSPTasks.Remove( i );
+			s_BSPTaskMutex.Unlock();
+			return true;
+		}
+	}
+	s_BSPTaskMutex.Unlock();
+	return false;
+}
+
+static void RunBSPTask( const BSPTask_t &task )
+{
+	task.m_pFn( task.m_pContext, task.m_pData, task.m_iItem );
+
+	// Anything the task pushed is already counted, so this can't hit zero early
+	if ( task.m_pPending )
+	{
+		--(*task.m_pPending);
+	}
+	--s_nBSPTasksOutstanding;
+}
+
+// Helps with a group's tasks until they're all done. Only takes tasks from the
+// group, so a thread waiting on small tasks doesn't wander off into a subtree.
+static void WaitForBSPTasks( CInterlockedInt *pPending )
+{
+	BSPTask_t task;
+	while ( *pPending > 0 )
+	{
+		if ( PopBSPTask( task, pPending ) )
+		{
+			RunBSPTask( task );
+		}
+		else
+		{
+			ThreadPause();
+		}
+	}
+}
+
+static void BSPTaskThread( int iThread, void *pUserData )
+{
+	BSPTask_t task;
+	int nIdle = 0;
+	while ( s_nBSPTasksOutstanding > 0 )
+	{
+		if ( PopBSPTask( task, NULL ) )
+		{
+			RunBSPTask( task );
+			nIdle = 0;
+		}
+		else if ( ++nIdle < 64 )
+		{
+			ThreadPause();
+		}
+		else
+		{
+			ThreadSleep( 0 );
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Split plane selection
+//-----------------------------------------------------------------------------
+static bool IsSplitCandidate( side_t *side, int pass )
+{
+	if (side->bevel)
+		return false;	// never use a bevel as a spliter
+	if (!side->winding)
+		return false;	// nothing visible, so it can't split
+	if (side->texinfo == TEXINFO_NODE)
+		return false;	// allready a node splitter
+	if (side->surf & SURF_SKIP)
+		return false;	// skip surfaces are never chosen
+	if ( side->visible ^ (pass<1) )
+		return false;	// only check visible faces on first pass
+	return true;
+}
+
+// Value estimate for splitting on side's plane, given how the brushes fall on it
+static int SplitSideValue( side_t *side, int pnum, int front, int back, int facing, int splits,
+	qboolean hintsplit, int epsilonbrush )
+{
+	int		value;
+
+	value =  5*facing - 5*splits - abs(front-back);
+//		value =  -5*splits;
+//		value =  5*facing - 5*splits;
+	if (g_MainMap->mapplanes[pnum].type < 3)
+		value+=5;		// axial is better
+	value -= epsilonbrush*1000;	// avoid!
+
+	// trans should split last
+	if ( side->surf & SURF_TRANS )
+	{
+		value -= 500;
+	}
+
+	// never split a hint side except with another hint
+	if (hintsplit && !(side->surf & SURF_HINT) )
+		value = -9999999;
+
+	// water should split first
+	if (side->contents & (CONTENTS_WATER | CONTENTS_SLIME))
+		value = 9999999;
+
+	return value;
+}
+
 /*
 ================
 SelectSplitSide
@@ -879,18 +1115,10 @@ side_t *SelectSplitSide (bspbrush_t *brushes, node_t *node)
 			{
 				side = brush->sides + i;
 
-				if (side->bevel)
-					continue;	// never use a bevel as a spliter
-				if (!side->winding)
-					continue;	// nothing visible, so it can't split
-				if (side->texinfo == TEXINFO_NODE)
-					continue;	// allready a node splitter
 				if (side->tested)
 					continue;	// we allready have metrics for this plane
-				if (side->surf & SURF_SKIP)
-					continue;	// skip surfaces are never chosen
-				if ( side->visible ^ (pass<1) )
-					continue;	// only check visible faces on first pass
+				if (!IsSplitCandidate (side, pass))
+					continue;
 				
 				pnum = side->planenum;
 				pnum &= ~1;	// allways use positive facing plane
@@ -936,26 +1164,7 @@ side_t *SelectSplitSide (bspbrush_t *brushes, node_t *node)
 				}
 
 				// give a value estimate for using this plane
-				value =  5*facing - 5*splits - abs(front-back);
-//					value =  -5*splits;
-//					value =  5*facing - 5*splits;
-				if (g_MainMap->mapplanes[pnum].type < 3)
-					value+=5;		// axial is better
-				value -= epsilonbrush*1000;	// avoid!
-
-				// trans should split last
-				if ( side->surf & SURF_TRANS )
-				{
-					value -= 500;
-				}
-
-				// never split a hint side except with another hint
-				if (hintsplit && !(side->surf & SURF_HINT) )
-					value = -9999999;
-
-				// water should split first
-				if (side->contents & (CONTENTS_WATER | CONTENTS_SLIME))
-					value = 9999999;
+				value = SplitSideValue (side, pnum, front, back, facing, splits, hintsplit, epsilonbrush);
 
 				// save off the side test so we don't need
 				// to recalculate it when we actually seperate
@@ -997,6 +1206,220 @@ side_t *SelectSplitSide (bspbrush_t *brushes, node_t *node)
 }
 
 
+//-----------------------------------------------------------------------------
+// SelectSplitSide for nodes with a lot of brushes. How the brushes fall on a
+// plane doesn't depend on which side it came from, and once SelectSplitSide
+// has scored a plane it marks every side on it as tested, so only the first
+// candidate side on each plane ever gets a value. This scores each plane
+// once, in parallel, and then replays SelectSplitSide's loop against the
+// scores, so the same side wins.
+//-----------------------------------------------------------------------------
+struct SplitPlaneScore_t
+{
+	int			m_nPlane;
+	bool		m_bGoodVolume;		// CheckPlaneAgainstVolume
+	bool		m_bTested;			// replay has used it, so its sides count as tested
+	int			m_nFront;
+	int			m_nBack;
+	int			m_nFacing;
+	int			m_nSplits;
+	int			m_nEpsilonBrushes;
+	qboolean	m_bHintSplit;		// as TestBrushToPlanenum left it for the last brush
+};
+
+struct SplitPlaneScores_t
+{
+	bspbrush_t		*m_pBrushes;
+	node_t			*m_pNode;
+	CUtlVector<SplitPlaneScore_t>	m_Scores;	// sorted by plane
+};
+
+static int SplitPlaneScoreCompare( const SplitPlaneScore_t *pLeft, const SplitPlaneScore_t *pRight )
+{
+	return pLeft->m_nPlane - pRight->m_nPlane;
+}
+
+static void ScoreSplitPlane( bspbrush_t *brushes, node_t *node, SplitPlaneScore_t &score )
+{
+	bspbrush_t	*test;
+	int			s, bsplits;
+
+	score.m_bGoodVolume = ( CheckPlaneAgainstVolume (score.m_nPlane, node) != false );
+	if (!score.m_bGoodVolume)
+		return;
+
+	for (test = brushes ; test ; test=test->next)
+	{
+		s = TestBrushToPlanenum (test, score.m_nPlane, &bsplits, &score.m_bHintSplit, &score.m_nEpsilonBrushes);
+
+		score.m_nSplits += bsplits;
+		if (bsplits && (s&PSIDE_FACING) )
+			Error ("PSIDE_FACING with splits");
+
+		if (s & PSIDE_FACING)
+			score.m_nFacing++;
+		if (s & PSIDE_FRONT)
+			score.m_nFront++;
+		if (s & PSIDE_BACK)
+			score.m_nBack++;
+	}
+}
+
+static void ScoreSplitPlanesTask( void *pContext, void *pData, int iItem )
+{
+	SplitPlaneScores_t *pScores = (SplitPlaneScores_t *)pContext;
+	int iLast = MIN( iItem + BSP_PLANES_PER_TASK, pScores->m_Scores.Count() );
+	for ( int i = iItem; i < iLast; i++ )
+	{
+		ScoreSplitPlane( pScores->m_pBrushes, pScores->m_pNode, pScores->m_Scores[i] );
+	}
+}
+
+static int PlaneNumCompare( const int *pLeft, const int *pRight )
+{
+	return *pLeft - *pRight;
+}
+
+// Looks through the first nScores scores
+static SplitPlaneScore_t *FindSplitPlaneScore( SplitPlaneScores_t &scores, int pnum, int nScores )
+{
+	int iLow = 0, iHigh = nScores - 1;
+	while ( iLow <= iHigh )
+	{
+		int iMid = ( iLow + iHigh ) / 2;
+		if ( scores.m_Scores[iMid].m_nPlane < pnum )
+			iLow = iMid + 1;
+		else if ( scores.m_Scores[iMid].m_nPlane > pnum )
+			iHigh = iMid - 1;
+		else
+			return &scores.m_Scores[iMid];
+	}
+	return NULL;
+}
+
+// Scores every plane the pass can look at that isn't scored yet
+static void ScoreSplitPlanes( SplitPlaneScores_t &scores, int pass )
+{
+	bspbrush_t	*brush;
+	int			i;
+
+	CUtlVector<int> planes;
+	for (brush = scores.m_pBrushes ; brush ; brush=brush->next)
+	{
+		for (i=0 ; i<brush->numsides ; i++)
+		{
+			side_t *side = brush->sides + i;
+			if (IsSplitCandidate (side, pass))
+			{
+				planes.AddToTail( side->planenum & ~1 );
+			}
+		}
+	}
+	planes.Sort( PlaneNumCompare );
+
+	int nOldScores = scores.m_Scores.Count();
+	for ( i = 0; i < planes.Count(); i++ )
+	{
+		if ( i > 0 && planes[i] == planes[i-1] )
+			continue;
+		if ( FindSplitPlaneScore( scores, planes[i], nOldScores ) )
+			continue;
+
+		SplitPlaneScore_t &score = scores.m_Scores[ scores.m_Scores.AddToTail() ];
+		memset( &score, 0, sizeof( score ) );
+		score.m_nPlane = planes[i];
+	}
+
+	CInterlockedInt nPending;
+	for ( i = nOldScores; i < scores.m_Scores.Count(); i += BSP_PLANES_PER_TASK )
+	{
+		PushBSPTask( ScoreSplitPlanesTask, &scores, NULL, i, &nPending );
+	}
+	WaitForBSPTasks( &nPending );
+
+	scores.m_Scores.Sort( SplitPlaneScoreCompare );
+}
+
+side_t *SelectSplitSideParallel (bspbrush_t *brushes, node_t *node)
+{
+	int			value, bestvalue;
+	bspbrush_t	*brush, *test;
+	side_t		*side, *bestside;
+	int			i, pass, numpasses;
+	int			pnum, bestpnum;
+	int			bsplits, epsilonbrush;
+	qboolean	hintsplit;
+
+	SplitPlaneScores_t scores;
+	scores.m_pBrushes = brushes;
+	scores.m_pNode = node;
+
+	bestside = NULL;
+	bestvalue = -99999;
+	bestpnum = -1;
+
+	numpasses = 2;
+	for (pass = 0 ; pass < numpasses ; pass++)
+	{
+		ScoreSplitPlanes (scores, pass);
+
+		for (brush = brushes ; brush ; brush=brush->next)
+		{
+			for (i=0 ; i<brush->numsides ; i++)
+			{
+				side = brush->sides + i;
+
+				if (!IsSplitCandidate (side, pass))
+					continue;
+
+				pnum = side->planenum & ~1;
+				SplitPlaneScore_t *score = FindSplitPlaneScore (scores, pnum, scores.m_Scores.Count());
+				if (score->m_bTested)
+					continue;	// we allready have metrics for this plane
+
+				CheckPlaneAgainstParents (pnum, node);
+
+				if (!score->m_bGoodVolume)
+					continue;	// would produce a tiny volume
+
+				score->m_bTested = true;
+
+				value = SplitSideValue (side, pnum, score->m_nFront, score->m_nBack, score->m_nFacing,
+					score->m_nSplits, score->m_bHintSplit, score->m_nEpsilonBrushes);
+				if (value > bestvalue)
+				{
+					bestvalue = value;
+					bestside = side;
+					bestpnum = pnum;
+				}
+			}
+		}
+
+		if (bestside)
+		{
+			if (pass > 0)
+			{
+				if (numthreads == 1)
+					c_nonvis++;
+			}
+			break;
+		}
+	}
+
+	// leave the brushes marked with how they fall on the winner
+	if (bestside)
+	{
+		epsilonbrush = 0;
+		for (test = brushes ; test ; test=test->next)
+		{
+			test->testside = test->side = TestBrushToPlanenum (test, bestpnum, &bsplits, &hintsplit, &epsilonbrush);
+		}
+	}
+
+	return bestside;
+}
+
+
 /*
 ==================
 BrushMostlyOnSide
@@ -1331,6 +1754,8 @@ BuildTree_r
 */
 
 
+static void BuildTreeTask( void *pContext, void *pData, int iItem );
+
 node_t *BuildTree_r (node_t *node, bspbrush_t *brushes)
 {
 	node_t		*newnode;
@@ -1342,7 +1767,10 @@ node_t *BuildTree_r (node_t *node, bspbrush_t *brushes)
 		c_nodes++;
 
 	// find the best plane to use as a splitter
-	bestside = SelectSplitSide (brushes, node);
+	if (s_bBSPThreaded && CountBrushList (brushes) >= BSP_PARALLEL_SPLIT_BRUSHES)
+		bestside = SelectSplitSideParallel (brushes, node);
+	else
+		bestside = SelectSplitSide (brushes, node);
 
 	if (!bestside)
 	{
@@ -1372,25 +1800,40 @@ node_t *BuildTree_r (node_t *node, bspbrush_t *brushes)
 		&node->children[1]->volume);
 
 	// recursively process children
-	for (i=0 ; i<2 ; i++)
+	if (s_bBSPThreaded && CountBrushList (children[1]) >= BSP_TASK_MIN_BRUSHES)
 	{
-		node->children[i] = BuildTree_r (node->children[i], children[i]);
+		PushBSPTask (BuildTreeTask, node->children[1], children[1], 0, NULL);
+		node->children[0] = BuildTree_r (node->children[0], children[0]);
+	}
+	else
+	{
+		for (i=0 ; i<2 ; i++)
+		{
+			node->children[i] = BuildTree_r (node->children[i], children[i]);
+		}
 	}
 
 	return node;
 }
+
+static void BuildTreeTask( void *pContext, void *pData, int iItem )
+{
+	BuildTree_r ((node_t *)pContext, (bspbrush_t *)pData);
+}
 	  
 
 //===========================================================
 
 /*
 =================
-BrushBSP
+SetupBrushBSP
 
-The incoming list will be freed before exiting
+Makes the tree's head node and its volume, which can add planes, so trees
+that are built together should be set up in a fixed order. The brush list
+is parked on the head node until BuildBrushBSPs.
 =================
 */
-tree_t *BrushBSP (bspbrush_t *brushlist, Vector& mins, Vector& maxs)
+tree_t *SetupBrushBSP (bspbrush_t *brushlist, Vector& mins, Vector& maxs)
 {
 	node_t		*node;
 	bspbrush_t	*b;
@@ -1439,18 +1882,248 @@ tree_t *BrushBSP (bspbrush_t *brushlist, Vector& mins, Vector& maxs)
 	qprintf ("%5i visible faces\n", c_faces);
 	qprintf ("%5i nonvisible faces\n", c_nonvisfaces);
 
-	c_nodes = 0;
-	c_nonvis = 0;
 	node = AllocNode ();
 
 	node->volume = BrushFromBounds (mins, maxs);
+	node->brushlist = brushlist;
 
 	tree->headnode = node;
 
-	node = BuildTree_r (node, brushlist);
-	qprintf ("%5i visible nodes\n", c_nodes/2 - c_nonvis);
-	qprintf ("%5i nonvis nodes\n", c_nonvis);
-	qprintf ("%5i leafs\n", (c_nodes+1)/2);
+	return tree;
+}
+
+/*
+=================
+RenumberTree_r
+
+Threads take node ids in whatever order they get to the nodes. This gives
+them the ids one thread would have: both children of a node, then
+everything under the front child, then everything under the back.
+=================
+*/
+static void RenumberTree_r (node_t *node, int &nextid)
+{
+	if (node->planenum == PLANENUM_LEAF)
+		return;
+
+	node->children[0]->id = nextid++;
+	node->children[1]->id = nextid++;
+	RenumberTree_r (node->children[0], nextid);
+	RenumberTree_r (node->children[1], nextid);
+}
+
+/*
+=================
+CopyTreeSetup
+
+A second tree fresh from SetupBrushBSP, with copies of the brushes
+=================
+*/
+static tree_t *CopyTreeSetup (tree_t *tree)
+{
+	tree_t		*copy;
+	node_t		*node;
+	bspbrush_t	*b, *newb, **tail;
+
+	copy = AllocTree ();
+	*copy = *tree;
+
+	node = AllocNode ();
+	node->id = tree->headnode->id;
+	node->volume = CopyBrush (tree->headnode->volume);
+	tail = &node->brushlist;
+	for (b=tree->headnode->brushlist ; b ; b=b->next)
+	{
+		newb = CopyBrush (b);
+		newb->next = NULL;
+		*tail = newb;
+		tail = &newb->next;
+	}
+	copy->headnode = node;
+
+	return copy;
+}
+
+/*
+=================
+CompareBrushLists / CompareTrees_r
+
+Brush ids aren't compared; they are only ever printed for the map
+brushes, which the build doesn't number.
+=================
+*/
+static bool CompareWindings (winding_t *a, winding_t *b)
+{
+	if (!a || !b)
+		return a == b;
+	if (a->numpoints != b->numpoints)
+		return false;
+	return !memcmp (a->p, b->p, a->numpoints * sizeof(a->p[0]));
+}
+
+static bool CompareBrushLists (bspbrush_t *a, bspbrush_t *b)
+{
+	for ( ; a && b ; a=a->next, b=b->next)
+	{
+		if (a->original != b->original || a->numsides != b->numsides)
+			return false;
+		if (a->mins != b->mins || a->maxs != b->maxs)
+			return false;
+		for (int i=0 ; i<a->numsides ; i++)
+		{
+			side_t *sa = &a->sides[i];
+			side_t *sb = &b->sides[i];
+			if (sa->planenum != sb->planenum || sa->texinfo != sb->texinfo || sa->original != sb->original ||
+				sa->contents != sb->contents || sa->visible != sb->visible || sa->bevel != sb->bevel)
+				return false;
+			if (!CompareWindings (sa->winding, sb->winding))
+				return false;
+		}
+	}
+	return !a && !b;
+}
+
+static node_t *CompareTrees_r (node_t *a, node_t *b)
+{
+	if (a->id != b->id || a->planenum != b->planenum || a->contents != b->contents)
+		return a;
+	if (!CompareBrushLists (a->volume, b->volume))
+		return a;
+
+	if (a->planenum == PLANENUM_LEAF)
+		return CompareBrushLists (a->brushlist, b->brushlist) ? NULL : a;
+
+	if (a->side->planenum != b->side->planenum || a->side->original != b->side->original)
+		return a;
+
+	node_t *mismatch = CompareTrees_r (a->children[0], b->children[0]);
+	if (!mismatch)
+	{
+		mismatch = CompareTrees_r (a->children[1], b->children[1]);
+	}
+	return mismatch;
+}
+
+/*
+=================
+BuildBrushBSPs
+
+Builds trees made by SetupBrushBSP. With more than one thread the
+trees, and the subtrees within them, are built at the same time; the
+result is the same as building them one after the other. With
+-checkdeterministic that is checked: copies of the trees are built on
+this thread first, and any difference is an error.
+=================
+*/
+void BuildBrushBSPs (int numtrees, tree_t **trees)
+{
+	node_t		*node;
+	bspbrush_t	*brushlist;
+	int			i;
+
+	// not worth starting threads for a handful of brushes
+	int numbrushes = 0;
+	for (i=0 ; i<numtrees ; i++)
+	{
+		numbrushes += CountBrushList (trees[i]->headnode->brushlist);
+	}
+
+	if (numthreads > 1 && numbrushes >= BSP_TASK_MIN_BRUSHES * 2)
+	{
+		int firstid = s_nNodeCount;
+		int nextid;
+
+		CUtlVector<tree_t *> serialtrees;
+		if (g_bCheckDeterministicBSP)
+		{
+			for (i=0 ; i<numtrees ; i++)
+			{
+				serialtrees.AddToTail (CopyTreeSetup (trees[i]));
+			}
+			for (i=0 ; i<numtrees ; i++)
+			{
+				node = serialtrees[i]->headnode;
+				brushlist = node->brushlist;
+				node->brushlist = NULL;
+				BuildTree_r (node, brushlist);
+			}
+
+			nextid = firstid;
+			for (i=0 ; i<numtrees ; i++)
+			{
+				RenumberTree_r (serialtrees[i]->headnode, nextid);
+			}
+			s_nNodeCount = firstid;
+		}
+
+		for (i=numtrees-1 ; i>=0 ; i--)
+		{
+			node = trees[i]->headnode;
+			brushlist = node->brushlist;
+			node->brushlist = NULL;
+			PushBSPTask (BuildTreeTask, node, brushlist, 0, NULL);
+		}
+
+		s_bBSPThreaded = true;
+		RunThreads_Start (BSPTaskThread, NULL);
+		RunThreads_End ();
+		s_bBSPThreaded = false;
+
+		FlushThreadPools ();
+
+		nextid = firstid;
+		for (i=0 ; i<numtrees ; i++)
+		{
+			RenumberTree_r (trees[i]->headnode, nextid);
+		}
+		s_nNodeCount = nextid;
+
+		for (i=0 ; i<serialtrees.Count() ; i++)
+		{
+			node_t *mismatch = CompareTrees_r (trees[i]->headnode, serialtrees[i]->headnode);
+			if (mismatch)
+			{
+				Error ("-checkdeterministic: tree %i differs from a single threaded build at node %i\n", i, mismatch->id);
+			}
+			FreeTree (serialtrees[i]);
+		}
+		if (serialtrees.Count())
+		{
+			qprintf ("%5i trees match a single threaded build\n", serialtrees.Count());
+		}
+		return;
+	}
+
+	for (i=0 ; i<numtrees ; i++)
+	{
+		node = trees[i]->headnode;
+		brushlist = node->brushlist;
+		node->brushlist = NULL;
+
+		c_nodes = 0;
+		c_nonvis = 0;
+
+		BuildTree_r (node, brushlist);
+		qprintf ("%5i visible nodes\n", c_nodes/2 - c_nonvis);
+		qprintf ("%5i nonvis nodes\n", c_nonvis);
+		qprintf ("%5i leafs\n", (c_nodes+1)/2);
+	}
+}
+
+/*
+=================
+BrushBSP
+
+The incoming list will be freed before exiting
+=================
+*/
+tree_t *BrushBSP (bspbrush_t *brushlist, Vector& mins, Vector& maxs)
+{
+	tree_t		*tree;
+
+	tree = SetupBrushBSP (brushlist, mins, maxs);
+	BuildBrushBSPs (1, &tree);
+
 #if 0
 {	// debug code
 static node_t	*tnode;
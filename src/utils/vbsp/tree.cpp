@@ -92,7 +92,7 @@ void FreeTree_r (node_t *node)
 
 	if (numthreads == 1)
 		c_nodes--;
-	free (node);
+	FreeNode (node);
 }
 
 
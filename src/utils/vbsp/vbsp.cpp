@@ -56,6 +56,8 @@ bool		g_NodrawTriggers = false;
 bool		g_DisableWaterLighting = false;
 bool		g_bAllowDetailCracks = false;
 bool		g_bNoVirtualMesh = false;
+bool		g_bDeterministicBSP = false;
+bool		g_bCheckDeterministicBSP = false;
 
 float		g_defaultLuxelSize = DEFAULT_LUXEL_SIZE;
 float		g_luxelScale = 1.0f;
@@ -150,9 +152,11 @@ node_t	*BlockTree (int xl, int yl, int xh, int yh)
 ============
 ProcessBlock_Thread
 
+Sets up the block's tree; BuildBrushBSPs builds them all at once
 ============
 */
 int			brush_start, brush_end;
+CUtlVector<tree_t *> g_BlockTrees;
 void ProcessBlock_Thread (int threadnum, int blocknum)
 {
 	int		xblock, yblock;
@@ -181,6 +185,7 @@ void ProcessBlock_Thread (int threadnum, int blocknum)
 		node->planenum = PLANENUM_LEAF;
 		node->contents = CONTENTS_SOLID;
 		block_nodes[xblock+BLOCKX_OFFSET][yblock+BLOCKY_OFFSET] = node;
+		g_BlockTrees[blocknum] = NULL;
 		return;
 	}    
 
@@ -188,12 +193,23 @@ void ProcessBlock_Thread (int threadnum, int blocknum)
 	if (!nocsg)
 		brushes = ChopBrushes (brushes);
 
-	tree = BrushBSP (brushes, mins, maxs);
+	tree = SetupBrushBSP (brushes, mins, maxs);
 	
 	block_nodes[xblock+BLOCKX_OFFSET][yblock+BLOCKY_OFFSET] = tree->headnode;
+	g_BlockTrees[blocknum] = tree;
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Reports how many windings are live after a phase
+//-----------------------------------------------------------------------------
+static void PrintWindingCounts( const char *pPhase )
+{
+	int nLive, nPeak;
+	GetWindingCounts( nLive, nPeak );
+	qprintf( "%-20s %7i live windings, %7i peak\n", pPhase, nLive, nPeak );
+}
+
 /*
 ============
 ProcessWorldModel
@@ -257,8 +273,39 @@ void ProcessWorldModel (void)
 	{
 		qprintf ("--------------------------------------------\n");
 
-		RunThreadsOnIndividual ((block_xh-block_xl+1)*(block_yh-block_yl+1),
-			!verbose, ProcessBlock_Thread);
+		int numblocks = (block_xh-block_xl+1)*(block_yh-block_yl+1);
+		g_BlockTrees.SetCount( numblocks );
+		if ( g_bDeterministicBSP )
+		{
+			// The blocks add planes, so take them in order to number the planes
+			// the same way every time
+			for ( int i = 0; i < numblocks; i++ )
+			{
+				ProcessBlock_Thread( THREADINDEX_MAIN, i );
+			}
+		}
+		else
+		{
+			RunThreadsOnIndividual (numblocks, !verbose, ProcessBlock_Thread);
+		}
+
+		// build the blocks' trees
+		CUtlVector<tree_t *> blocktrees;
+		for ( int i = 0; i < numblocks; i++ )
+		{
+			if ( g_BlockTrees[i] )
+			{
+				blocktrees.AddToTail( g_BlockTrees[i] );
+			}
+		}
+		BuildBrushBSPs( blocktrees.Count(), blocktrees.Base() );
+
+		// block_nodes has the head nodes
+		for ( int i = 0; i < blocktrees.Count(); i++ )
+		{
+			free( blocktrees[i] );
+		}
+		g_BlockTrees.Purge();
 
 		//
 		// build the division tree
@@ -285,9 +332,12 @@ void ProcessWorldModel (void)
 
 		// make the portals/faces by traversing down to each empty leaf
 		MakeTreePortals (tree);
+		PrintWindingCounts ("MakeTreePortals");
 
 		if (FloodEntities (tree))
 		{
+			PrintWindingCounts ("FloodEntities");
+
 			// turns everthing outside into solid
 			FillOutside (tree->headnode);
 		}
@@ -915,6 +965,15 @@ int RunVBSP( int argc, char **argv )
 			numthreads = atoi (argv[i+1]);
 			i++;
 		}
+		else if (!Q_stricmp(argv[i],"-deterministic"))
+		{
+			g_bDeterministicBSP = true;
+		}
+		else if (!Q_stricmp(argv[i],"-checkdeterministic"))
+		{
+			g_bDeterministicBSP = true;
+			g_bCheckDeterministicBSP = true;
+		}
 		else if (!Q_stricmp(argv[i],"-glview"))
 		{
 			glview = true;
@@ -1092,6 +1151,10 @@ int RunVBSP( int argc, char **argv )
 		{
 			g_bLowPriority = true;
 		}
+		else if( !Q_stricmp( argv[i], "-pinthreads" ) )
+		{
+			g_bPinThreads = true;
+		}
 		else if( !Q_stricmp( argv[i], "-lightifmissing" ) )
 		{
 			g_bLightIfMissing = true;
@@ -1183,6 +1246,7 @@ int RunVBSP( int argc, char **argv )
 			"                what affects visibility.\n"
 			"  -nowater    : Get rid of water brushes.\n"
 			"  -low        : Run as an idle-priority process.\n"
+			"  -pinthreads : Pin worker threads to processors (NUMA node by node).\n"
 			"  -embed <directory>  : Use <directory> as an additional search path for assets\n"
 			"                        and embed all assets in this directory into the compiled\n"
 			"                        map\n"
@@ -1196,8 +1260,12 @@ int RunVBSP( int argc, char **argv )
 			Warning(
 				"Other options  :\n"
 				"  -novconfig   : Don't bring up graphical UI on vproject errors.\n"
-				"  -threads     : Control the number of threads vbsp uses (defaults to the # of\n"
-				"                 processors on your machine).\n"
+				"  -threads     : Control the number of threads vbsp uses (defaults to 1).\n"
+				"  -deterministic: With -threads, chop the world blocks in order so the .bsp\n"
+				"                 matches a single threaded compile. The trees are still\n"
+				"                 built on every thread.\n"
+				"  -checkdeterministic: -deterministic, and with -threads also build every\n"
+				"                 tree on one thread and stop with an error if the two differ.\n"
 				"  -verboseentities: If -v is on, this disables verbose output for submodels.\n"
 				"  -noweld      : Don't join face vertices together.\n"
 				"  -nocsg       : Don't chop out intersecting brush areas.\n"
@@ -1276,8 +1344,12 @@ int RunVBSP( int argc, char **argv )
 		}
 	}
 
+	// One thread unless -threads asks for more
+	if ( numthreads == -1 )
+	{
+		numthreads = 1;
+	}
 	ThreadSetDefault ();
-	numthreads = 1;		// multiple threads aren't helping...
 
 	// Setup the logfile.
 	char logFile[512];
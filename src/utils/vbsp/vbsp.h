@@ -365,6 +365,8 @@ extern	bool		g_NodrawTriggers;
 extern	bool		g_DisableWaterLighting;
 extern	bool		g_bAllowDetailCracks;
 extern	bool		g_bNoVirtualMesh;
+extern	bool		g_bDeterministicBSP;
+extern	bool		g_bCheckDeterministicBSP;
 extern	char		outbase[32];
 
 extern	char	source[1024];
@@ -471,6 +473,7 @@ void SplitBrush (bspbrush_t *brush, int planenum,
 
 tree_t *AllocTree (void);
 node_t *AllocNode (void);
+void FreeNode (node_t *node);
 bspbrush_t *AllocBrush (int numsides);
 int	CountBrushList (bspbrush_t *brushes);
 void FreeBrush (bspbrush_t *brushes);
@@ -483,6 +486,10 @@ node_t	*PointInLeaf (node_t *node, Vector& point);
 
 tree_t *BrushBSP (bspbrush_t *brushlist, Vector& mins, Vector& maxs);
 
+// BrushBSP in two halves, so a batch of trees can be built together
+tree_t *SetupBrushBSP (bspbrush_t *brushlist, Vector& mins, Vector& maxs);
+void BuildBrushBSPs (int numtrees, tree_t **trees);
+
 #define	PSIDE_FRONT			1
 #define	PSIDE_BACK			2
 #define	PSIDE_BOTH			(PSIDE_FRONT|PSIDE_BACK)
@@ -13,6 +13,7 @@
 #include "coordsize.h"
 #include "vstdlib/random.h"
 #include "bsptreedata.h"
+#include "utlbuffer.h"
 #include "messbuf.h"
 #include "vmpi.h"
 #include "vmpi_distribute_work.h"
@@ -27,6 +28,21 @@ static TableVector g_BoxDirections[6] =
 	{  0,  0, -1 }, 
 };
 
+// The ambient cube lights each cluster can see, in light order. Leaves outside
+// any cluster, or in a map without vis, use all of them.
+static CUtlVector< CUtlVector<int> > s_ClusterEmitters;
+static CUtlVector<int> s_AllEmitters;
+
+// candidate samples in the non-solid leaves, and how many of them were traced
+static CInterlockedInt s_nAmbientCandidates;
+static CInterlockedInt s_nAmbientTraced;
+
+// -ambientdiff: how far the adaptive samples are from the full ones
+static int s_nDiffLeaves;
+static int s_nDiffLeavesOver;
+static int s_nDiffMax;
+static int s_nDiffSum;
+static int s_nDiffCount;
 
 
 static void ComputeAmbientFromSurface( dface_t *surfID, dworldlight_t* pSkylight, 
@@ -89,54 +105,119 @@ float Engine_WorldLightDistanceFalloff( const dworldlight_t *wl, const Vector& d
 }
 
 
-void AddEmitSurfaceLights( const Vector &vStart, Vector lightBoxColor[6] )
+//-----------------------------------------------------------------------------
+// Finds the ambient cube lights each cluster can see. Lights whose origin isn't
+// in a cluster go in every list.
+//-----------------------------------------------------------------------------
+static void BuildClusterEmitters()
 {
-	fltx4 fractionVisible;
-
-	FourVectors vStart4, wlOrigin4;
-	vStart4.DuplicateVector ( vStart );
+	s_AllEmitters.RemoveAll();
+	s_ClusterEmitters.RemoveAll();
+	s_ClusterEmitters.SetCount( visdatasize ? dvis->numclusters : 0 );
 
+	byte pvs[(MAX_MAP_CLUSTERS+7)/8];
+	int nVisible = 0;
 	for ( int iLight=0; iLight < *pNumworldlights; iLight++ )
 	{
 		dworldlight_t *wl = &dworldlights[iLight];
-
-		// Should this light even go in the ambient cubes?
 		if ( !( wl->flags & DWL_FLAGS_INAMBIENTCUBE ) )
 			continue;
 
-		Assert( wl->type == emit_surface );
+		s_AllEmitters.AddToTail( iLight );
+
+		bool bUsePVS = s_ClusterEmitters.Count() && ( ClusterFromPoint( wl->origin ) >= 0 );
+		if ( bUsePVS )
+		{
+			PvsForOrigin( wl->origin, pvs );
+		}
+
+		for ( int iCluster = 0; iCluster < s_ClusterEmitters.Count(); iCluster++ )
+		{
+			if ( !bUsePVS || PVSCheck( pvs, iCluster ) )
+			{
+				s_ClusterEmitters[iCluster].AddToTail( iLight );
+				nVisible++;
+			}
+		}
+	}
+
+	if ( s_ClusterEmitters.Count() )
+	{
+		qprintf( "Leaf ambient clusters see %.1f of %d ambient cube lights on average.\n",
+			(float)nVisible / s_ClusterEmitters.Count(), s_AllEmitters.Count() );
+	}
+}
+
+static const CUtlVector<int> &GetClusterEmitters( int iCluster )
+{
+	if ( iCluster < 0 || iCluster >= s_ClusterEmitters.Count() )
+		return s_AllEmitters;
+	return s_ClusterEmitters[iCluster];
+}
+
+
+//-----------------------------------------------------------------------------
+// Adds the ambient cube lights in the list that can see vStart, testing four
+// lights per trace.
+//-----------------------------------------------------------------------------
+void AddEmitSurfaceLights( const Vector &vStart, const CUtlVector<int> &emitters, Vector lightBoxColor[6] )
+{
+	fltx4 fractionVisible;
+
+	FourVectors vStart4, wlOrigin4;
+	vStart4.DuplicateVector ( vStart );
 
-		// Can this light see the point?
-		wlOrigin4.DuplicateVector ( wl->origin );
+	for ( int iFirst=0; iFirst < emitters.Count(); iFirst += 4 )
+	{
+		// pad the last group out with copies of its last light
+		int nLights = MIN( 4, emitters.Count() - iFirst );
+		dworldlight_t *pLights[4];
+		for ( int j=0; j < 4; j++ )
+		{
+			pLights[j] = &dworldlights[ emitters[ iFirst + MIN( j, nLights - 1 ) ] ];
+		}
+
+		// Can these lights see the point?
+		wlOrigin4.LoadAndSwizzle( pLights[0]->origin, pLights[1]->origin, pLights[2]->origin, pLights[3]->origin );
 		TestLine ( vStart4, wlOrigin4, &fractionVisible );
 		if ( !TestSignSIMD ( CmpGtSIMD ( fractionVisible, Four_Zeros ) ) )
 			continue;
 
-		// Add this light's contribution.
-		Vector vDelta = wl->origin - vStart;
-		float flDistanceScale = Engine_WorldLightDistanceFalloff( wl, vDelta );
+		for ( int j=0; j < nLights; j++ )
+		{
+			dworldlight_t *wl = pLights[j];
+			Assert( wl->type == emit_surface );
 
-		Vector vDeltaNorm = vDelta;
-		VectorNormalize( vDeltaNorm );
-		float flAngleScale = Engine_WorldLightAngle( wl, wl->normal, vDeltaNorm, vDeltaNorm );
+			float flVisible = SubFloat ( fractionVisible, j );
+			if ( flVisible <= 0 )
+				continue;
 
-		float ratio = flDistanceScale * flAngleScale * SubFloat ( fractionVisible, 0 );
-		if ( ratio == 0 )
-			continue;
+			// Add this light's contribution.
+			Vector vDelta = wl->origin - vStart;
+			float flDistanceScale = Engine_WorldLightDistanceFalloff( wl, vDelta );
 
-		for ( int i=0; i < 6; i++ )
-		{
-			float t = DotProduct( g_BoxDirections[i], vDeltaNorm );
-			if ( t > 0 )
+			Vector vDeltaNorm = vDelta;
+			VectorNormalize( vDeltaNorm );
+			float flAngleScale = Engine_WorldLightAngle( wl, wl->normal, vDeltaNorm, vDeltaNorm );
+
+			float ratio = flDistanceScale * flAngleScale * flVisible;
+			if ( ratio == 0 )
+				continue;
+
+			for ( int i=0; i < 6; i++ )
 			{
-				lightBoxColor[i] += wl->intensity * (t * ratio);
+				float t = DotProduct( g_BoxDirections[i], vDeltaNorm );
+				if ( t > 0 )
+				{
+					lightBoxColor[i] += wl->intensity * (t * ratio);
+				}
 			}
 		}
 	}	
 }
 
 
-void ComputeAmbientFromSphericalSamples( int iThread, const Vector &vStart, Vector lightBoxColor[6] )
+void ComputeAmbientFromSphericalSamples( int iThread, const Vector &vStart, const CUtlVector<int> &emitters, Vector lightBoxColor[6] )
 {
 	// Figure out the color that rays hit when shot out from this position.
 	Vector radcolor[NUMVERTEXNORMALS];
@@ -176,7 +257,7 @@ void ComputeAmbientFromSphericalSamples( int iThread, const Vector &vStart, Vect
 
 	// Now add direct light from the emit_surface lights. These go in the ambient cube because
 	// there are a ton of them and they are often so dim that they get filtered out by r_worldlightmin.
-	AddEmitSurfaceLights( vStart, lightBoxColor );
+	AddEmitSurfaceLights( vStart, emitters, lightBoxColor );
 }
 
 
@@ -522,7 +603,42 @@ static byte Fixed8Fraction( float t, float tMin, float tMax )
 
 CUtlVector< CUtlVector<ambientsample_t> > g_LeafAmbientSamples;
 
-void ComputeAmbientForLeaf( int iThread, int leafID, CUtlVector<ambientsample_t> &list )
+// candidates always traced before adaptive sampling starts skipping any
+#define AMBIENT_COARSE_SAMPLES		8
+
+// gamma space units of difference that are worth a sample; CompressAmbientSampleList
+// drops samples that come within this of their reconstruction
+#define AMBIENT_SAMPLE_TOLERANCE	3
+
+// Is the lighting changing around this position? Compares the two samples nearest it.
+static bool AmbientNeedsRefinement( CUtlVector<ambientsample_t> &list, const Vector &samplePosition )
+{
+	if ( list.Count() < 2 )
+		return true;
+
+	int nearest[2] = { -1, -1 };
+	float nearestDist[2] = { FLT_MAX, FLT_MAX };
+	for ( int i = 0; i < list.Count(); i++ )
+	{
+		float dist = (list[i].pos - samplePosition).LengthSqr();
+		if ( dist < nearestDist[0] )
+		{
+			nearest[1] = nearest[0];
+			nearestDist[1] = nearestDist[0];
+			nearest[0] = i;
+			nearestDist[0] = dist;
+		}
+		else if ( dist < nearestDist[1] )
+		{
+			nearest[1] = i;
+			nearestDist[1] = dist;
+		}
+	}
+
+	return CubeDeltaGammaSpace( list[nearest[0]].cube, list[nearest[1]].cube ) >= AMBIENT_SAMPLE_TOLERANCE;
+}
+
+void ComputeAmbientForLeaf( int iThread, int leafID, CUtlVector<ambientsample_t> &list, bool bAdaptive )
 {
 	CUtlVector<dplane_t> leafPlanes;
 	CLeafSampler sampler( iThread );
@@ -550,21 +666,66 @@ void ComputeAmbientForLeaf( int iThread, int leafID, CUtlVector<ambientsample_t>
 		// NOTE: We copy the nearest non-solid leaf sample pointers into this leaf at the end
 		return;
 	}
+	const CUtlVector<int> &emitters = GetClusterEmitters( dleafs[leafID].cluster );
+	int nTraced = 0;
 	Vector cube[6];
 	for ( int i = 0; i < sampleCount; i++ )
 	{
 		// compute each candidate sample and add to the list
 		Vector samplePosition;
 		sampler.GenerateLeafSamplePosition( leafID, leafPlanes, samplePosition );
-		ComputeAmbientFromSphericalSamples( iThread, samplePosition, cube );
+
+		// once the leaf is roughly covered, only sample where the lighting changes
+		if ( bAdaptive && i >= AMBIENT_COARSE_SAMPLES && !AmbientNeedsRefinement( list, samplePosition ) )
+			continue;
+
+		ComputeAmbientFromSphericalSamples( iThread, samplePosition, emitters, cube );
+		nTraced++;
 		// note this will remove the least valuable sample once the limit is reached
 		AddSampleToList( list, samplePosition, cube );
 	}
+	s_nAmbientCandidates += sampleCount;
+	s_nAmbientTraced += nTraced;
 
 	// remove any samples that can be reconstructed with the remaining data
 	CompressAmbientSampleList( list );
 }
 
+//-----------------------------------------------------------------------------
+// -ambientdiff: lights the leaf with every candidate sample as well, and compares
+// the two reconstructions at the full set's samples.
+//-----------------------------------------------------------------------------
+static void DiffAmbientForLeaf( int iThread, int leafID, CUtlVector<ambientsample_t> &list )
+{
+	CUtlVector<ambientsample_t> fullList;
+	ComputeAmbientForLeaf( iThread, leafID, fullList, false );
+	if ( !fullList.Count() || !list.Count() )
+		return;
+
+	int nMax = 0;
+	int nSum = 0;
+	Vector fullCube[6], cube[6];
+	for ( int i = 0; i < fullList.Count(); i++ )
+	{
+		Mod_LeafAmbientColorAtPos( fullCube, fullList[i].pos, fullList, -1 );
+		Mod_LeafAmbientColorAtPos( cube, fullList[i].pos, list, -1 );
+		int nDelta = CubeDeltaGammaSpace( fullCube, cube );
+		nMax = max( nMax, nDelta );
+		nSum += nDelta;
+	}
+
+	ThreadLock();
+	s_nDiffLeaves++;
+	if ( nMax >= AMBIENT_SAMPLE_TOLERANCE )
+	{
+		s_nDiffLeavesOver++;
+	}
+	s_nDiffMax = max( s_nDiffMax, nMax );
+	s_nDiffSum += nSum;
+	s_nDiffCount += fullList.Count();
+	ThreadUnlock();
+}
+
 static void ThreadComputeLeafAmbient( int iThread, void *pUserData )
 {
 	CUtlVector<ambientsample_t> list;
@@ -574,7 +735,11 @@ static void ThreadComputeLeafAmbient( int iThread, void *pUserData )
 		if (leafID == -1)
 			break;
 		list.RemoveAll();
-		ComputeAmbientForLeaf(iThread, leafID, list);
+		ComputeAmbientForLeaf(iThread, leafID, list, g_bAdaptiveAmbient);
+		if ( g_bAmbientDiff )
+		{
+			DiffAmbientForLeaf(iThread, leafID, list);
+		}
 		// copy to the output array
 		g_LeafAmbientSamples[leafID].SetCount( list.Count() );
 		for ( int i = 0; i < list.Count(); i++ )
@@ -584,35 +749,35 @@ static void ThreadComputeLeafAmbient( int iThread, void *pUserData )
 	}
 }
 
-void VMPI_ProcessLeafAmbient( int iThread, uint64 iLeaf, MessageBuffer *pBuf )
+void VMPI_ProcessLeafAmbient( int iThread, uint64 iLeaf, CUtlBuffer *pBuf )
 {
 	CUtlVector<ambientsample_t> list;
-	ComputeAmbientForLeaf(iThread, (int)iLeaf, list);
+	ComputeAmbientForLeaf(iThread, (int)iLeaf, list, g_bAdaptiveAmbient);
 
 	VMPI_SetCurrentStage( "EncodeLeafAmbientResults" );
 
 	// Encode the results.
 	int nSamples = list.Count();
-	pBuf->write( &nSamples, sizeof( nSamples ) );
+	pBuf->Put( &nSamples, sizeof( nSamples ) );
 	if ( nSamples )
 	{
-		pBuf->write( list.Base(), list.Count() * sizeof( ambientsample_t ) );
+		pBuf->Put( list.Base(), list.Count() * sizeof( ambientsample_t ) );
 	}
 }
 
 //-----------------------------------------------------------------------------
 // Called on the master when a worker finishes processing a static prop.
 //-----------------------------------------------------------------------------
-void VMPI_ReceiveLeafAmbientResults( uint64 leafID, MessageBuffer *pBuf, int iWorker )
+void VMPI_ReceiveLeafAmbientResults( uint64 leafID, CUtlBuffer *pBuf, int iWorker )
 {
 	// Decode the results.
 	int nSamples;
-	pBuf->read( &nSamples, sizeof( nSamples ) );
+	pBuf->Get( &nSamples, sizeof( nSamples ) );
 
 	g_LeafAmbientSamples[leafID].SetCount( nSamples );
 	if ( nSamples )
 	{
-		pBuf->read(g_LeafAmbientSamples[leafID].Base(), nSamples * sizeof(ambientsample_t) );
+		pBuf->Get(g_LeafAmbientSamples[leafID].Base(), nSamples * sizeof(ambientsample_t) );
 	}
 }
 
@@ -640,17 +805,48 @@ void ComputePerLeafAmbientLighting()
 
 	Msg( "%d of %d (%d%% of) surface lights went in leaf ambient cubes.\n", nInAmbientCube, nSurfaceLights, nSurfaceLights ? ((nInAmbientCube*100) / nSurfaceLights) : 0 );
 
+	BuildClusterEmitters();
+
 	g_LeafAmbientSamples.SetCount(numleafs);
 
+	s_nAmbientCandidates = 0;
+	s_nAmbientTraced = 0;
+	s_nDiffLeaves = s_nDiffLeavesOver = 0;
+	s_nDiffMax = s_nDiffSum = s_nDiffCount = 0;
+
 	if ( g_bUseMPI )
 	{
+		if ( g_bAmbientDiff )
+		{
+			Warning( "-ambientdiff doesn't work with -mpi, ignoring it.\n" );
+		}
+
 		// Distribute the work among the workers.
 		VMPI_SetCurrentStage( "ComputeLeafAmbientLighting" );
-		DistributeWork( numleafs, VMPI_DISTRIBUTEWORK_PACKETID, VMPI_ProcessLeafAmbient, VMPI_ReceiveLeafAmbientResults );
+		VRAD_DistributeWork( numleafs, VMPI_ProcessLeafAmbient, VMPI_ReceiveLeafAmbientResults );
 	}
 	else
 	{
-		RunThreadsOn(numleafs, true, ThreadComputeLeafAmbient);
+		RunThreadsOnAnyOrder(numleafs, true, ThreadComputeLeafAmbient);
+
+		if ( g_bAdaptiveAmbient )
+		{
+			int nCandidates = s_nAmbientCandidates;
+			int nTraced = s_nAmbientTraced;
+			if ( g_bAmbientDiff )
+			{
+				// the full sampling counted too
+				nCandidates /= 2;
+				nTraced -= nCandidates;
+			}
+			Msg( "Adaptive leaf ambient traced %d of %d candidate samples.\n", nTraced, nCandidates );
+		}
+
+		if ( g_bAmbientDiff && s_nDiffCount )
+		{
+			Msg( "Leaf ambient diff against full sampling: max %d, mean %.2f gamma units; %d of %d leaves off by %d or more.\n",
+				s_nDiffMax, (float)s_nDiffSum / s_nDiffCount, s_nDiffLeavesOver, s_nDiffLeaves, AMBIENT_SAMPLE_TOLERANCE );
+		}
 	}
 
 	// now write out the data
@@ -0,0 +1,517 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Persistent cache of per-face direct lighting. See lightcache.h.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "vrad.h"
+#include "lightmap.h"
+#include "lightcache.h"
+#include "tier1/utlmap.h"
+#include "tier1/utlbuffer.h"
+#include "tier1/strtools.h"
+
+#define LIGHTCACHE_ID		(('H'<<24)+('C'<<16)+('L'<<8)+'V')
+#define LIGHTCACHE_VERSION	1
+
+// world faces lie on the planes between solid and empty leaves, so triangle bounds
+// are pushed out a little to make sure they land in the empty leaf next to them
+#define LIGHTCACHE_BOUNDS_EPSILON	1.0f
+
+bool g_bLightCache = false;
+
+int GetVisCache( int lastoffset, int cluster, byte *pvs );
+
+struct LightCacheEntry_t
+{
+	int				m_nSize;
+	unsigned char	*m_pData;		// points into s_LoadedData, or allocated by StoreFace
+	bool			m_bUsed;
+};
+
+// order-independent sum of the hashes of the triangles touching a cluster, so that
+// cluster renumbering doesn't change anything
+struct ClusterHash_t
+{
+	uint64			m_nSum[2];
+};
+
+static char s_szCacheFile[MAX_PATH];
+static CUtlBuffer s_LoadedData;
+static CUtlMap<MD5Value_t, LightCacheEntry_t, int> s_Entries;
+static CUtlVector<ClusterHash_t> s_ClusterHashes;
+static CUtlVector<MD5Value_t> s_LightHashes;		// parallel to activelights
+static MD5Value_t s_SettingsHash;
+static int s_nHits;
+static int s_nMisses;
+
+
+static bool KeyLessFunc( MD5Value_t const &a, MD5Value_t const &b )
+{
+	return memcmp( a.bits, b.bits, MD5_DIGEST_LENGTH ) < 0;
+}
+
+template< class T >
+static inline void HashValue( MD5Context_t &ctx, T const &val )
+{
+	MD5Update( &ctx, (unsigned char const *) &val, sizeof( val ) );
+}
+
+static inline void HashVector( MD5Context_t &ctx, Vector const &v )
+{
+	HashValue( ctx, v.x );
+	HashValue( ctx, v.y );
+	HashValue( ctx, v.z );
+}
+
+static inline void AddToSum( ClusterHash_t &sum, ClusterHash_t const &add )
+{
+	sum.m_nSum[0] += add.m_nSum[0];
+	sum.m_nSum[1] += add.m_nSum[1];
+}
+
+
+//-----------------------------------------------------------------------------
+// Loading and saving
+//-----------------------------------------------------------------------------
+void LightCache_Init( char const *pFilename )
+{
+	Q_strncpy( s_szCacheFile, pFilename, sizeof( s_szCacheFile ) );
+	s_Entries.SetLessFunc( KeyLessFunc );
+	s_Entries.RemoveAll();
+	s_LoadedData.Purge();
+
+	if ( !g_pFileSystem->ReadFile( s_szCacheFile, NULL, s_LoadedData ) )
+	{
+		Msg( "Light cache: %s not found, all faces will be lit.\n", s_szCacheFile );
+		return;
+	}
+
+	bool bValid = ( s_LoadedData.GetInt() == LIGHTCACHE_ID ) &&
+		( s_LoadedData.GetInt() == LIGHTCACHE_VERSION );
+	int nEntries = bValid ? s_LoadedData.GetInt() : 0;
+	for ( int i = 0; bValid && ( i < nEntries ); i++ )
+	{
+		MD5Value_t key;
+		s_LoadedData.Get( key.bits, MD5_DIGEST_LENGTH );
+
+		LightCacheEntry_t entry;
+		entry.m_nSize = s_LoadedData.GetInt();
+		entry.m_pData = (unsigned char *) s_LoadedData.PeekGet();
+		entry.m_bUsed = false;
+		if ( !s_LoadedData.IsValid() || ( entry.m_nSize < 0 ) ||
+			( entry.m_nSize > s_LoadedData.TellPut() - s_LoadedData.TellGet() ) )
+		{
+			bValid = false;
+			break;
+		}
+		s_LoadedData.SeekGet( CUtlBuffer::SEEK_CURRENT, entry.m_nSize );
+
+		if ( s_Entries.Find( key ) == s_Entries.InvalidIndex() )
+		{
+			s_Entries.Insert( key, entry );
+		}
+	}
+
+	if ( !bValid )
+	{
+		Warning( "Light cache: %s is out of date or damaged, all faces will be lit.\n", s_szCacheFile );
+		s_Entries.RemoveAll();
+		s_LoadedData.Purge();
+		return;
+	}
+
+	Msg( "Light cache: loaded %d faces from %s\n", s_Entries.Count(), s_szCacheFile );
+}
+
+void LightCache_Save( void )
+{
+	int nUsed = 0;
+	int nSize = 3 * sizeof( int );
+	for ( int i = s_Entries.FirstInorder(); i != s_Entries.InvalidIndex(); i = s_Entries.NextInorder( i ) )
+	{
+		if ( s_Entries[i].m_bUsed )
+		{
+			++nUsed;
+			nSize += MD5_DIGEST_LENGTH + sizeof( int ) + s_Entries[i].m_nSize;
+		}
+	}
+
+	CUtlBuffer buf;
+	buf.EnsureCapacity( nSize );
+	buf.PutInt( LIGHTCACHE_ID );
+	buf.PutInt( LIGHTCACHE_VERSION );
+	buf.PutInt( nUsed );
+	for ( int i = s_Entries.FirstInorder(); i != s_Entries.InvalidIndex(); i = s_Entries.NextInorder( i ) )
+	{
+		LightCacheEntry_t const &entry = s_Entries[i];
+		if ( !entry.m_bUsed )
+			continue;
+		buf.Put( s_Entries.Key( i ).bits, MD5_DIGEST_LENGTH );
+		buf.PutInt( entry.m_nSize );
+		buf.Put( entry.m_pData, entry.m_nSize );
+	}
+
+	Msg( "Light cache: %d faces reused, %d lit, %d stale entries dropped\n",
+		s_nHits, s_nMisses, s_Entries.Count() - nUsed );
+
+	if ( !g_pFileSystem->WriteFile( s_szCacheFile, NULL, buf ) )
+	{
+		Warning( "Light cache: couldn't write %s\n", s_szCacheFile );
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Geometry hashing. Every triangle in the ray tracer is added to the hash of each
+// cluster its bounds touch.
+//-----------------------------------------------------------------------------
+static void FindClustersInBox_r( int node, Vector const &mins, Vector const &maxs, CUtlVector<int> &clusters )
+{
+	while ( node >= 0 )
+	{
+		dnode_t const *pNode = &dnodes[node];
+		dplane_t const *pPlane = &dplanes[pNode->planenum];
+
+		// distance of the box corners nearest and farthest along the plane normal
+		float flNear = -pPlane->dist;
+		float flFar = -pPlane->dist;
+		for ( int i = 0; i < 3; i++ )
+		{
+			float n = pPlane->normal[i];
+			flNear += n * ( ( n >= 0 ) ? mins[i] : maxs[i] );
+			flFar += n * ( ( n >= 0 ) ? maxs[i] : mins[i] );
+		}
+
+		if ( flNear >= 0 )
+		{
+			node = pNode->children[0];
+		}
+		else if ( flFar < 0 )
+		{
+			node = pNode->children[1];
+		}
+		else
+		{
+			FindClustersInBox_r( pNode->children[0], mins, maxs, clusters );
+			node = pNode->children[1];
+		}
+	}
+
+	int cluster = dleafs[-1 - node].cluster;
+	if ( ( cluster >= 0 ) && ( clusters.Find( cluster ) == -1 ) )
+	{
+		clusters.AddToTail( cluster );
+	}
+}
+
+void LightCache_HashGeometry( void )
+{
+	s_ClusterHashes.SetCount( dvis->numclusters );
+	memset( s_ClusterHashes.Base(), 0, s_ClusterHashes.Count() * sizeof( ClusterHash_t ) );
+
+	int nTriangles = g_RtEnv.OptimizedTriangleList.Count();
+	bool bColors = ( g_RtEnv.TriangleColors.Count() == nTriangles );
+	bool bMaterials = ( g_RtEnv.TriangleMaterials.Count() == nTriangles );
+
+	CUtlVector<int> clusters;
+	for ( int i = 0; i < nTriangles; i++ )
+	{
+		TriGeometryData_t const &tri = g_RtEnv.OptimizedTriangleList[i].m_Data.m_GeometryData;
+
+		MD5Context_t ctx;
+		MD5Init( &ctx );
+		Vector mins( FLT_MAX, FLT_MAX, FLT_MAX );
+		Vector maxs( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+		for ( int v = 0; v < 3; v++ )
+		{
+			Vector const &vert = tri.Vertex( v );
+			HashVector( ctx, vert );
+			VectorMin( mins, vert, mins );
+			VectorMax( maxs, vert, maxs );
+		}
+
+		// the low bits of static prop ids are the prop index, which only matters for self shadowing
+		HashValue( ctx, tri.m_nTriangleID & 0xff000000 );
+		HashValue( ctx, tri.m_nFlags );
+		if ( bColors )
+		{
+			HashVector( ctx, g_RtEnv.TriangleColors[i] );
+		}
+		if ( bMaterials )
+		{
+			HashValue( ctx, g_RtEnv.TriangleMaterials[i] );
+		}
+
+		ClusterHash_t triHash;
+		MD5Final( (unsigned char *) triHash.m_nSum, &ctx );
+
+		mins -= Vector( LIGHTCACHE_BOUNDS_EPSILON, LIGHTCACHE_BOUNDS_EPSILON, LIGHTCACHE_BOUNDS_EPSILON );
+		maxs += Vector( LIGHTCACHE_BOUNDS_EPSILON, LIGHTCACHE_BOUNDS_EPSILON, LIGHTCACHE_BOUNDS_EPSILON );
+
+		clusters.RemoveAll();
+		FindClustersInBox_r( dmodels[0].headnode, mins, maxs, clusters );
+		for ( int c = 0; c < clusters.Count(); c++ )
+		{
+			AddToSum( s_ClusterHashes[clusters[c]], triHash );
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Light hashing. Anything that can shadow a light is visible from the light's
+// cluster, so each light's hash covers the geometry in its pvs. Sky lights have
+// the pvs of every cluster that can see sky, plus whatever the 3d skybox cameras
+// can see if rays recurse into the skybox.
+//-----------------------------------------------------------------------------
+static void HashSettings( void )
+{
+	MD5Context_t ctx;
+	MD5Init( &ctx );
+	HashValue( ctx, (int) LIGHTCACHE_VERSION );
+	HashValue( ctx, g_bHDR );
+	HashValue( ctx, do_extra );
+	HashValue( ctx, do_fast );
+	HashValue( ctx, do_centersamples );
+	HashValue( ctx, debug_extra );
+	HashValue( ctx, extrapasses );
+	HashValue( ctx, smoothing_threshold );
+	HashValue( ctx, g_SunAngularExtent );
+	HashValue( ctx, g_flSkySampleScale );
+	HashValue( ctx, g_flMaxDispSampleSize );
+	HashValue( ctx, g_bLargeDispSampleRadius );
+	HashValue( ctx, g_bFastAmbient );
+	HashValue( ctx, g_bNoSkyRecurse );
+	HashValue( ctx, g_bStaticPropPolys );
+	HashValue( ctx, g_bTextureShadows );
+	MD5Final( s_SettingsHash.bits, &ctx );
+}
+
+static void AddVisibleClusters( byte const *pvs, ClusterHash_t &sum )
+{
+	for ( int c = 0; c < s_ClusterHashes.Count(); c++ )
+	{
+		if ( !pvs || PVSCheck( pvs, c ) )
+		{
+			AddToSum( sum, s_ClusterHashes[c] );
+		}
+	}
+}
+
+void LightCache_HashLights( void )
+{
+	HashSettings();
+
+	// what the 3d skybox cameras can see, for the sky lights
+	ClusterHash_t skyCameraSum;
+	memset( &skyCameraSum, 0, sizeof( skyCameraSum ) );
+	if ( !g_bNoSkyRecurse )
+	{
+		byte pvs[MAX_MAP_CLUSTERS / 8];
+		for ( int i = 0; i < num_sky_cameras; i++ )
+		{
+			GetVisCache( -1, ClusterFromPoint( sky_cameras[i].origin ), pvs );
+			AddVisibleClusters( pvs, skyCameraSum );
+		}
+	}
+
+	s_LightHashes.RemoveAll();
+	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
+	{
+		MD5Context_t ctx;
+		MD5Init( &ctx );
+
+		// everything but the cluster, texinfo and owner, which are indices that can change
+		// without the light changing
+		dworldlight_t const &light = dl->light;
+		HashVector( ctx, light.origin );
+		HashVector( ctx, light.intensity );
+		HashVector( ctx, light.normal );
+		HashValue( ctx, light.type );
+		HashValue( ctx, light.style );
+		HashValue( ctx, light.stopdot );
+		HashValue( ctx, light.stopdot2 );
+		HashValue( ctx, light.exponent );
+		HashValue( ctx, light.radius );
+		HashValue( ctx, light.constant_attn );
+		HashValue( ctx, light.linear_attn );
+		HashValue( ctx, light.quadratic_attn );
+		HashValue( ctx, light.flags );
+		HashValue( ctx, dl->m_flStartFadeDistance );
+		HashValue( ctx, dl->m_flEndFadeDistance );
+		HashValue( ctx, dl->m_flCapDist );
+
+		ClusterHash_t geometry;
+		memset( &geometry, 0, sizeof( geometry ) );
+		AddVisibleClusters( dl->pvs, geometry );
+		if ( ( light.type == emit_skylight ) || ( light.type == emit_skyambient ) )
+		{
+			AddToSum( geometry, skyCameraSum );
+		}
+		HashValue( ctx, geometry );
+
+		MD5Final( s_LightHashes[s_LightHashes.AddToTail()].bits, &ctx );
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Faces
+//-----------------------------------------------------------------------------
+void LightCache_GetFaceKey( lightinfo_t const &l, facelight_t const *fl, int nNormals, MD5Value_t &key )
+{
+	dface_t const *f = l.face;
+	texinfo_t const *tex = &texinfo[f->texinfo];
+
+	MD5Context_t ctx;
+	MD5Init( &ctx );
+	HashValue( ctx, s_SettingsHash );
+
+	// the surface
+	HashValue( ctx, nNormals );
+	HashValue( ctx, l.isflat );
+	HashVector( ctx, l.facenormal );
+	HashValue( ctx, l.facedist );
+	HashVector( ctx, l.modelorg );
+	HashValue( ctx, f->dispinfo != -1 );
+	HashValue( ctx, f->m_LightmapTextureMinsInLuxels );
+	HashValue( ctx, f->m_LightmapTextureSizeInLuxels );
+	HashValue( ctx, tex->flags );
+	HashValue( ctx, tex->textureVecsTexelsPerWorldUnits );
+	HashValue( ctx, tex->lightmapVecsLuxelsPerWorldUnits );
+
+	faceneighbor_t const *fn = &faceneighbor[l.facenum];
+	for ( int j = 0; j < f->numedges; j++ )
+	{
+		int edge = dsurfedges[f->firstedge + j];
+		int v = ( edge < 0 ) ? dedges[-edge].v[1] : dedges[edge].v[0];
+		HashVector( ctx, dvertexes[v].point );
+		if ( fn->normal )
+		{
+			HashVector( ctx, fn->normal[j] );
+		}
+	}
+
+	// the samples, and the clusters they're in
+	CUtlVector<int> clusters;
+	HashValue( ctx, fl->numsamples );
+	for ( int i = 0; i < fl->numsamples; i++ )
+	{
+		sample_t const &s = fl->sample[i];
+		HashValue( ctx, s.s );
+		HashValue( ctx, s.t );
+		HashValue( ctx, s.coord );
+		HashValue( ctx, s.mins );
+		HashValue( ctx, s.maxs );
+		HashVector( ctx, s.pos );
+		HashVector( ctx, s.normal );
+		HashValue( ctx, s.area );
+
+		int cluster = ClusterFromPoint( s.pos );
+		if ( clusters.Find( cluster ) == -1 )
+		{
+			clusters.AddToTail( cluster );
+		}
+	}
+
+	// the lights that can reach them, in the order they're gathered
+	int nLight = 0;
+	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next, nLight++ )
+	{
+		for ( int c = 0; c < clusters.Count(); c++ )
+		{
+			if ( PVSCheck( dl->pvs, clusters[c] ) )
+			{
+				HashValue( ctx, s_LightHashes[nLight] );
+				break;
+			}
+		}
+	}
+
+	MD5Final( key.bits, &ctx );
+}
+
+//-----------------------------------------------------------------------------
+// An entry is the face's lightstyles, its sample normals (which lighting smooths),
+// then the samples for each lightstyle and normal.
+//-----------------------------------------------------------------------------
+bool LightCache_RestoreFace( MD5Value_t const &key, dface_t *f, facelight_t *fl, int nNormals )
+{
+	LightCacheEntry_t entry;
+	ThreadLock();
+	int i = s_Entries.Find( key );
+	if ( i != s_Entries.InvalidIndex() )
+	{
+		s_Entries[i].m_bUsed = true;
+		entry = s_Entries[i];
+		++s_nHits;
+	}
+	else
+	{
+		++s_nMisses;
+	}
+	ThreadUnlock();
+
+	if ( i == s_Entries.InvalidIndex() )
+		return false;
+
+	CUtlBuffer buf( entry.m_pData, entry.m_nSize, CUtlBuffer::READ_ONLY );
+	buf.Get( f->styles, MAXLIGHTMAPS );
+	for ( int s = 0; s < fl->numsamples; s++ )
+	{
+		buf.Get( &fl->sample[s].normal, sizeof( Vector ) );
+	}
+	for ( int k = 0; k < MAXLIGHTMAPS; k++ )
+	{
+		if ( f->styles[k] == 255 )
+			continue;
+
+		for ( int n = 0; n < nNormals; n++ )
+		{
+			fl->light[k][n] = (LightingValue_t *) calloc( fl->numsamples, sizeof( LightingValue_t ) );
+			buf.Get( fl->light[k][n], fl->numsamples * sizeof( LightingValue_t ) );
+		}
+	}
+
+	Assert( buf.IsValid() && ( buf.TellGet() == entry.m_nSize ) );
+	return true;
+}
+
+void LightCache_StoreFace( MD5Value_t const &key, dface_t const *f, facelight_t const *fl, int nNormals )
+{
+	CUtlBuffer buf;
+	buf.Put( f->styles, MAXLIGHTMAPS );
+	for ( int s = 0; s < fl->numsamples; s++ )
+	{
+		buf.Put( &fl->sample[s].normal, sizeof( Vector ) );
+	}
+	for ( int k = 0; k < MAXLIGHTMAPS; k++ )
+	{
+		if ( f->styles[k] == 255 )
+			continue;
+
+		for ( int n = 0; n < nNormals; n++ )
+		{
+			buf.Put( fl->light[k][n], fl->numsamples * sizeof( LightingValue_t ) );
+		}
+	}
+
+	LightCacheEntry_t entry;
+	entry.m_nSize = buf.TellPut();
+	entry.m_pData = (unsigned char *) malloc( entry.m_nSize );
+	entry.m_bUsed = true;
+	memcpy( entry.m_pData, buf.Base(), entry.m_nSize );
+
+	ThreadLock();
+	if ( s_Entries.Find( key ) == s_Entries.InvalidIndex() )
+	{
+		s_Entries.Insert( key, entry );
+		entry.m_pData = NULL;
+	}
+	ThreadUnlock();
+
+	// two faces with identical keys light identically, so the first one wins
+	free( entry.m_pData );
+}
@@ -0,0 +1,54 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Persistent cache of per-face direct lighting, shared between compiles.
+//
+//			Each face's direct lighting is stored under an MD5 of everything that
+//			went into it: the face's samples and surface, the parameters of every
+//			light that can see it, and the ray tracing geometry in the clusters
+//			each of those lights can see. A face whose key is found in the cache
+//			from the previous compile gets its lighting copied back instead of
+//			gathered, so an edit only relights the faces it can affect.
+//
+//			Keys never contain face, cluster or entity indices, so entries survive
+//			vbsp renumbering everything. Bounced light is global and is always
+//			recomputed.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef LIGHTCACHE_H
+#define LIGHTCACHE_H
+#pragma once
+
+#include "tier1/checksum_md5.h"
+
+struct lightinfo_t;
+struct facelight_t;
+
+extern bool g_bLightCache;
+
+// Loads the cache file, if there is one. Call once the map name is known.
+void LightCache_Init( char const *pFilename );
+
+// Hashes the geometry of each cluster. Must be called after everything has been
+// added to g_RtEnv, but before SetupAccelerationStructure.
+void LightCache_HashGeometry( void );
+
+// Hashes each light in activelights. Call before BuildFacelights, once the
+// light list is final.
+void LightCache_HashLights( void );
+
+// Computes a face's key. The face's samples must have been built.
+void LightCache_GetFaceKey( lightinfo_t const &l, facelight_t const *fl, int nNormals, MD5Value_t &key );
+
+// Fills in the face's lightstyles and direct lighting from the cache. Returns
+// false if the key isn't in the cache.
+bool LightCache_RestoreFace( MD5Value_t const &key, dface_t *f, facelight_t *fl, int nNormals );
+
+// Adds a face's finished direct lighting to the cache. Thread safe.
+void LightCache_StoreFace( MD5Value_t const &key, dface_t const *f, facelight_t const *fl, int nNormals );
+
+// Writes every entry used by this compile back out, dropping stale ones.
+void LightCache_Save( void );
+
+#endif // LIGHTCACHE_H
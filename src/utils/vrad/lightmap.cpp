@@ -9,6 +9,7 @@
 #include "vrad.h"
 #include "lightmap.h"
 #include "radial.h"
+#include "lightcache.h"
 #include "mathlib/bumpvects.h"
 #include "tier1/utlvector.h"
 #include "vmpi.h"
@@ -3109,40 +3110,52 @@ void BuildFacelights (int iThread, int facenum)
 	// Allocate sample positions/normals to SSE
 	int numGroups = ( fl->numsamples & 0x3) ? ( fl->numsamples / 4 ) + 1 : ( fl->numsamples / 4 );
 
-	// always allocate style 0 lightmap
-	f->styles[0] = 0;
-	AllocateLightstyleSamples( fl, 0, sampleInfo.m_NormalCount );
+	// faces whose inputs haven't changed since the last compile get their lighting from the cache
+	MD5Value_t cacheKey;
+	bool bCached = false;
+	if ( g_bLightCache )
+	{
+		LightCache_GetFaceKey( l, fl, sampleInfo.m_NormalCount, cacheKey );
+		bCached = LightCache_RestoreFace( cacheKey, f, fl, sampleInfo.m_NormalCount );
+	}
 
-	// sample the lights at each sample location
-	for ( int grp = 0; grp < numGroups; ++grp )
+	if ( !bCached )
 	{
-		int nSample = 4 * grp;
+		// always allocate style 0 lightmap
+		f->styles[0] = 0;
+		AllocateLightstyleSamples( fl, 0, sampleInfo.m_NormalCount );
 
-		sample_t *sample = sampleInfo.m_pFaceLight->sample + nSample;
-		int numSamples = min ( 4, sampleInfo.m_pFaceLight->numsamples - nSample );
+		// sample the lights at each sample location
+		for ( int grp = 0; grp < numGroups; ++grp )
+		{
+			int nSample = 4 * grp;
 
-		FourVectors positions;
-		FourVectors normals;
+			sample_t *sample = sampleInfo.m_pFaceLight->sample + nSample;
+			int numSamples = min ( 4, sampleInfo.m_pFaceLight->numsamples - nSample );
 
-		for ( int i = 0; i < 4; i++ )
-		{
-			v[i] = ( i < numSamples ) ? sample[i].pos : sample[numSamples - 1].pos;
-			n[i] = ( i < numSamples ) ? sample[i].normal : sample[numSamples - 1].normal;
-		}
-		positions.LoadAndSwizzle( v[0], v[1], v[2], v[3] );
-		normals.LoadAndSwizzle( n[0], n[1], n[2], n[3] );
+			FourVectors positions;
+			FourVectors normals;
 
-		ComputeIlluminationPointAndNormalsSSE( l, positions, normals, &sampleInfo, numSamples );
+			for ( int i = 0; i < 4; i++ )
+			{
+				v[i] = ( i < numSamples ) ? sample[i].pos : sample[numSamples - 1].pos;
+				n[i] = ( i < numSamples ) ? sample[i].normal : sample[numSamples - 1].normal;
+			}
+			positions.LoadAndSwizzle( v[0], v[1], v[2], v[3] );
+			normals.LoadAndSwizzle( n[0], n[1], n[2], n[3] );
 
-		// Fixup sample normals in case of smooth faces
-		if ( !l.isflat )
-		{
-			for ( int i = 0; i < numSamples; i++ )
-				sample[i].normal = sampleInfo.m_PointNormals[0].Vec( i );
-		}
+			ComputeIlluminationPointAndNormalsSSE( l, positions, normals, &sampleInfo, numSamples );
+
+			// Fixup sample normals in case of smooth faces
+			if ( !l.isflat )
+			{
+				for ( int i = 0; i < numSamples; i++ )
+					sample[i].normal = sampleInfo.m_PointNormals[0].Vec( i );
+			}
 
-		// Iterate over all the lights and add their contribution to this group of spots
-		GatherSampleLightAt4Points( sampleInfo, nSample, numSamples );
+			// Iterate over all the lights and add their contribution to this group of spots
+			GatherSampleLightAt4Points( sampleInfo, nSample, numSamples );
+		}
 	}
 	
 	// Tell the incremental light manager that we're done with this face.
@@ -3161,7 +3174,7 @@ void BuildFacelights (int iThread, int facenum)
 	}
 
 	// get rid of the -extra functionality on displacement surfaces
-	if (do_extra && !sampleInfo.m_IsDispFace)
+	if (do_extra && !sampleInfo.m_IsDispFace && !bCached)
 	{
 		// For each lightstyle, perform a supersampling pass
 		for ( i = 0; i < MAXLIGHTMAPS; ++i )
@@ -3174,6 +3187,11 @@ void BuildFacelights (int iThread, int facenum)
 		}
 	}
 
+	if ( g_bLightCache && !bCached )
+	{
+		LightCache_StoreFace( cacheKey, f, fl, sampleInfo.m_NormalCount );
+	}
+
 	if (!g_bUseMPI) 
 	{
 		//
@@ -22,6 +22,7 @@
 #include "bsplib.h"
 #include "consolewnd.h"
 #include "vismat.h"
+#include "transfermatrix.h"
 #include "vmpi_filesystem.h"
 #include "vmpi_dispatch.h"
 #include "utllinkedlist.h"
@@ -29,6 +30,7 @@
 #include "mpi_stats.h"
 #include "vmpi_distribute_work.h"
 #include "vmpi_tools_shared.h"
+#include "workdist.h"
 
 
 
@@ -68,6 +70,15 @@ void VRAD_SetupMPI( int &argc, char **&argv )
 {
 	CmdLib_AtCleanup( VMPI_Stats_Term );
 
+	// Distributing over WorkDist instead? The master/worker split is the same,
+	// but each process loads the map from its own file system.
+	if ( WorkDist_Init( argc, argv ) )
+	{
+		g_bUseMPI = true;
+		g_bMPIMaster = WorkDist_IsCoordinator();
+		return;
+	}
+
 	//
 	// Preliminary check -mpi flag
 	//
@@ -102,6 +113,27 @@ void VRAD_SetupMPI( int &argc, char **&argv )
 }
 
 
+double VRAD_DistributeWork( uint64 nWorkUnits, WorkDistProcessFn processFn, WorkDistReceiveFn receiveFn )
+{
+	if ( WorkDist_IsActive() )
+		return WorkDist_DistributeWork( nWorkUnits, processFn, receiveFn );
+
+	return VMPI_DistributeWork( nWorkUnits, VMPI_DISTRIBUTEWORK_PACKETID, processFn, receiveFn );
+}
+
+
+// Who sent a work unit, for error messages.
+static const char *GetWorkerName( int iWorker )
+{
+	if ( !WorkDist_IsActive() )
+		return VMPI_GetMachineName( iWorker );
+
+	static char szName[32];
+	Q_snprintf( szName, sizeof( szName ), "worker %d", iWorker );
+	return szName;
+}
+
+
 //-----------------------------------------
 //
 // Run BuildFaceLights across all available processing nodes
@@ -111,30 +143,31 @@ void VRAD_SetupMPI( int &argc, char **&argv )
 CCycleCount g_CPUTime;
 
 
-template<class T> void WriteValues( MessageBuffer *pmb, T const *pSrc, int nNumValues)
+template<class T> void WriteValues( CUtlBuffer *pBuf, T const *pSrc, int nNumValues)
 {
-	pmb->write(pSrc, sizeof( pSrc[0]) * nNumValues );
+	pBuf->Put(pSrc, sizeof( pSrc[0]) * nNumValues );
 }
 
-template<class T> int ReadValues( MessageBuffer *pmb, T *pDest, int nNumValues)
+template<class T> bool ReadValues( CUtlBuffer *pBuf, T *pDest, int nNumValues)
 {
-	return pmb->read( pDest, sizeof( pDest[0]) * nNumValues );
+	pBuf->Get( pDest, sizeof( pDest[0]) * nNumValues );
+	return pBuf->IsValid();
 }
 
 
 //--------------------------------------------------
 // Serialize face data
-void SerializeFace( MessageBuffer * pmb, int facenum )
+void SerializeFace( CUtlBuffer * pBuf, int facenum )
 {
 	int i, n;
 
 	dface_t     * f  = &g_pFaces[facenum];
 	facelight_t * fl = &facelight[facenum];
 
-	pmb->write(f, sizeof(dface_t));
-	pmb->write(fl, sizeof(facelight_t));
+	pBuf->Put(f, sizeof(dface_t));
+	pBuf->Put(fl, sizeof(facelight_t));
 
-	WriteValues( pmb, fl->sample, fl->numsamples);
+	WriteValues( pBuf, fl->sample, fl->numsamples);
 
 	//
 	// Write the light information
@@ -143,37 +176,37 @@ void SerializeFace( MessageBuffer * pmb, int facenum )
 		for (n=0; n<NUM_BUMP_VECTS+1; ++n) {
 			if (fl->light[i][n])
 			{
-				WriteValues( pmb, fl->light[i][n], fl->numsamples);
+				WriteValues( pBuf, fl->light[i][n], fl->numsamples);
 			}
 		}
 	}
 
 	if (fl->luxel)
-		WriteValues( pmb, fl->luxel, fl->numluxels);
+		WriteValues( pBuf, fl->luxel, fl->numluxels);
 	
 	if (fl->luxelNormals) 
-		WriteValues( pmb, fl->luxelNormals, fl->numluxels);
+		WriteValues( pBuf, fl->luxelNormals, fl->numluxels);
 }
 
 //--------------------------------------------------
 // UnSerialize face data
 //
-void UnSerializeFace( MessageBuffer * pmb, int facenum, int iSource )
+void UnSerializeFace( CUtlBuffer * pBuf, int facenum, int iSource )
 {
 	int i, n;
 
 	dface_t     * f  = &g_pFaces[facenum];
 	facelight_t * fl = &facelight[facenum];
 
-	if (pmb->read(f, sizeof(dface_t)) < 0) 
-		Error("UnSerializeFace - invalid dface_t from %s (mb len: %d, offset: %d)", VMPI_GetMachineName( iSource ), pmb->getLen(), pmb->getOffset() );
+	if (!ReadValues( pBuf, f, 1 )) 
+		Error("UnSerializeFace - invalid dface_t from %s (buf len: %d, offset: %d)", GetWorkerName( iSource ), pBuf->TellMaxPut(), pBuf->TellGet() );
 
-	if (pmb->read(fl, sizeof(facelight_t)) < 0) 
-		Error("UnSerializeFace - invalid facelight_t from %s (mb len: %d, offset: %d)", VMPI_GetMachineName( iSource ), pmb->getLen(), pmb->getOffset() );
+	if (!ReadValues( pBuf, fl, 1 )) 
+		Error("UnSerializeFace - invalid facelight_t from %s (buf len: %d, offset: %d)", GetWorkerName( iSource ), pBuf->TellMaxPut(), pBuf->TellGet() );
 
 	fl->sample = (sample_t *) calloc(fl->numsamples, sizeof(sample_t));
-	if (pmb->read(fl->sample, sizeof(sample_t) * fl->numsamples) < 0) 
-		Error("UnSerializeFace - invalid sample_t from %s (mb len: %d, offset: %d, fl->numsamples: %d)", VMPI_GetMachineName( iSource ), pmb->getLen(), pmb->getOffset(), fl->numsamples );
+	if (!ReadValues( pBuf, fl->sample, fl->numsamples )) 
+		Error("UnSerializeFace - invalid sample_t from %s (buf len: %d, offset: %d, fl->numsamples: %d)", GetWorkerName( iSource ), pBuf->TellMaxPut(), pBuf->TellGet(), fl->numsamples );
 
 	//
 	// Read the light information
@@ -183,34 +216,34 @@ void UnSerializeFace( MessageBuffer * pmb, int facenum, int iSource )
 			if (fl->light[i][n])
 			{
 				fl->light[i][n] = (LightingValue_t *) calloc( fl->numsamples, sizeof(LightingValue_t ) );
-				if ( ReadValues( pmb, fl->light[i][n], fl->numsamples) < 0)
-					Error("UnSerializeFace - invalid fl->light from %s (mb len: %d, offset: %d)", VMPI_GetMachineName( iSource ), pmb->getLen(), pmb->getOffset() );
+				if ( !ReadValues( pBuf, fl->light[i][n], fl->numsamples) )
+					Error("UnSerializeFace - invalid fl->light from %s (buf len: %d, offset: %d)", GetWorkerName( iSource ), pBuf->TellMaxPut(), pBuf->TellGet() );
 			}
 		}
 	}
 
 	if (fl->luxel) {
 		fl->luxel = (Vector *) calloc(fl->numluxels, sizeof(Vector));
-		if (ReadValues( pmb, fl->luxel, fl->numluxels) < 0)
-			Error("UnSerializeFace - invalid fl->luxel from %s (mb len: %d, offset: %d)", VMPI_GetMachineName( iSource ), pmb->getLen(), pmb->getOffset() );
+		if (!ReadValues( pBuf, fl->luxel, fl->numluxels))
+			Error("UnSerializeFace - invalid fl->luxel from %s (buf len: %d, offset: %d)", GetWorkerName( iSource ), pBuf->TellMaxPut(), pBuf->TellGet() );
 	}
 
 	if (fl->luxelNormals) {
 		fl->luxelNormals = (Vector *) calloc(fl->numluxels, sizeof( Vector ));
-		if ( ReadValues( pmb, fl->luxelNormals, fl->numluxels) < 0)
-			Error("UnSerializeFace - invalid fl->luxelNormals from %s (mb len: %d, offset: %d)", VMPI_GetMachineName( iSource ), pmb->getLen(), pmb->getOffset() );
+		if ( !ReadValues( pBuf, fl->luxelNormals, fl->numluxels) )
+			Error("UnSerializeFace - invalid fl->luxelNormals from %s (buf len: %d, offset: %d)", GetWorkerName( iSource ), pBuf->TellMaxPut(), pBuf->TellGet() );
 	}
 
 }
 
 
-void MPI_ReceiveFaceResults( uint64 iWorkUnit, MessageBuffer *pBuf, int iWorker )
+void MPI_ReceiveFaceResults( uint64 iWorkUnit, CUtlBuffer *pBuf, int iWorker )
 {
 	UnSerializeFace( pBuf, iWorkUnit, iWorker );
 }
 
 
-void MPI_ProcessFaces( int iThread, uint64 iWorkUnit, MessageBuffer *pBuf )
+void MPI_ProcessFaces( int iThread, uint64 iWorkUnit, CUtlBuffer *pBuf )
 {
 	// Do BuildFacelights on the face.
 	CTimeAdder adder( &g_CPUTime );
@@ -236,9 +269,8 @@ void RunMPIBuildFacelights()
 	}
 
 	VMPI_SetCurrentStage( "RunMPIBuildFaceLights" );
-	double elapsed = DistributeWork( 
+	double elapsed = VRAD_DistributeWork( 
 		numfaces, 
-		VMPI_DISTRIBUTEWORK_PACKETID,
 		MPI_ProcessFaces, 
 		MPI_ReceiveFaceResults );
 
@@ -277,25 +309,37 @@ void RunMPIBuildFacelights()
 //
 
 // This function is called when the master receives results back from a worker.
-void MPI_ReceiveVisLeafsResults( uint64 iWorkUnit, MessageBuffer *pBuf, int iWorker )
+void MPI_ReceiveVisLeafsResults( uint64 iWorkUnit, CUtlBuffer *pBuf, int iWorker )
 {
 	int patchesInCluster = 0;
 	
-	pBuf->read(&patchesInCluster, sizeof(patchesInCluster));
+	pBuf->Get(&patchesInCluster, sizeof(patchesInCluster));
 	
 	for ( int k=0; k < patchesInCluster; ++k )
 	{
 		int patchnum = 0;
-		pBuf->read(&patchnum, sizeof(patchnum));
+		pBuf->Get(&patchnum, sizeof(patchnum));
+		if ( !pBuf->IsValid() || patchnum < 0 || patchnum >= g_Patches.Count() )
+			Error( "MPI_ReceiveVisLeafsResults - invalid patch from %s", GetWorkerName( iWorker ) );
 		
 		CPatch * patch = &g_Patches[patchnum];
-		int numtransfers;
-		pBuf->read( &numtransfers, sizeof(numtransfers) );
+		int numtransfers = 0;
+		pBuf->Get( &numtransfers, sizeof(numtransfers) );
+		if ( !pBuf->IsValid() || numtransfers < 0 || numtransfers * (int)sizeof(transfer_t) > pBuf->GetBytesRemaining() )
+			Error( "MPI_ReceiveVisLeafsResults - invalid transfers from %s", GetWorkerName( iWorker ) );
 		patch->numtransfers = numtransfers;
-		if (numtransfers) 
+		if (numtransfers && TransferMatrix_IsCompressing()) 
+		{
+			// the worker already scaled them
+			transfer_t *pTransfers = new transfer_t[numtransfers];
+			pBuf->Get(pTransfers, numtransfers * sizeof(transfer_t));
+			CompressTransferRow( patchnum, pTransfers, numtransfers, 1.0f );
+			delete [] pTransfers;
+		}
+		else if (numtransfers) 
 		{
 			patch->transfers = new transfer_t[numtransfers];
-			pBuf->read(patch->transfers, numtransfers * sizeof(transfer_t));
+			pBuf->Get(patch->transfers, numtransfers * sizeof(transfer_t));
 		}
 		
 		total_transfer += numtransfers;
@@ -310,7 +354,7 @@ void MPI_ReceiveVisLeafsResults( uint64 iWorkUnit, MessageBuffer *pBuf, int iWor
 class CVMPIVisLeafsData
 {
 public:
-	MessageBuffer *m_pVisLeafsMB;
+	CUtlBuffer *m_pVisLeafsBuf;
 	int m_nPatchesInCluster;
 	transfer_t *m_pBuildVisLeafsTransfers;
 };
@@ -324,20 +368,20 @@ CVMPIVisLeafsData g_VMPIVisLeafsData[MAX_TOOL_THREADS+1];
 void MPI_AddPatchData( int iThread, int patchnum, CPatch *patch )
 {
 	CVMPIVisLeafsData *pData = &g_VMPIVisLeafsData[iThread];
-	if ( pData->m_pVisLeafsMB )
+	if ( pData->m_pVisLeafsBuf )
 	{
 		// Add in results for this patch
 		++pData->m_nPatchesInCluster;
-		pData->m_pVisLeafsMB->write(&patchnum, sizeof(patchnum));
-		pData->m_pVisLeafsMB->write(&patch->numtransfers, sizeof(patch->numtransfers));
-		pData->m_pVisLeafsMB->write( patch->transfers, patch->numtransfers * sizeof(transfer_t) );
+		pData->m_pVisLeafsBuf->Put(&patchnum, sizeof(patchnum));
+		pData->m_pVisLeafsBuf->Put(&patch->numtransfers, sizeof(patch->numtransfers));
+		pData->m_pVisLeafsBuf->Put( patch->transfers, patch->numtransfers * sizeof(transfer_t) );
 	}
 }
 
 
 // This handles a work unit sent by the master. Each work unit here is a 
 // list of clusters.
-void MPI_ProcessVisLeafs( int iThread, uint64 iWorkUnit, MessageBuffer *pBuf )
+void MPI_ProcessVisLeafs( int iThread, uint64 iWorkUnit, CUtlBuffer *pBuf )
 {
 	CTimeAdder adder( &g_CPUTime );
 
@@ -346,14 +390,14 @@ void MPI_ProcessVisLeafs( int iThread, uint64 iWorkUnit, MessageBuffer *pBuf )
 
 	// Start this cluster.
 	pData->m_nPatchesInCluster = 0;
-	pData->m_pVisLeafsMB = pBuf;
+	pData->m_pVisLeafsBuf = pBuf;
 
 	// Write a temp value in there. We overwrite it later.
 	int iSavePos = 0;
 	if ( pBuf )
 	{
-		iSavePos = pBuf->getLen();
-		pBuf->write( &pData->m_nPatchesInCluster, sizeof(pData->m_nPatchesInCluster) );
+		iSavePos = pBuf->TellPut();
+		pBuf->Put( &pData->m_nPatchesInCluster, sizeof(pData->m_nPatchesInCluster) );
 	}
 
 	// Collect the results in MPI_AddPatchData.
@@ -362,8 +406,8 @@ void MPI_ProcessVisLeafs( int iThread, uint64 iWorkUnit, MessageBuffer *pBuf )
 	// Now send the results back..
 	if ( pBuf )
 	{
-		pBuf->update( iSavePos, &pData->m_nPatchesInCluster, sizeof(pData->m_nPatchesInCluster) );
-		pData->m_pVisLeafsMB = NULL;
+		memcpy( (char*)pBuf->Base() + iSavePos, &pData->m_nPatchesInCluster, sizeof(pData->m_nPatchesInCluster) );
+		pData->m_pVisLeafsBuf = NULL;
 	}
 }
 
@@ -379,7 +423,7 @@ void RunMPIBuildVisLeafs()
 	}
 
 	memset( g_VMPIVisLeafsData, 0, sizeof( g_VMPIVisLeafsData ) );
-	if ( !g_bMPIMaster || VMPI_GetActiveWorkUnitDistributor() == k_eWorkUnitDistributor_SDK )
+	if ( !g_bMPIMaster || WorkDist_IsActive() || VMPI_GetActiveWorkUnitDistributor() == k_eWorkUnitDistributor_SDK )
 	{
 		// Allocate space for the transfers for each thread.
 		for ( int i=0; i < numthreads; i++ )
@@ -394,9 +438,8 @@ void RunMPIBuildVisLeafs()
 	//
 	VMPI_SetCurrentStage( "RunMPIBuildVisLeafs" );
 	
-	double elapsed = DistributeWork( 
+	double elapsed = VRAD_DistributeWork( 
 		dvis->numclusters, 
-		VMPI_DISTRIBUTEWORK_PACKETID,
 		MPI_ProcessVisLeafs, 
 		MPI_ReceiveVisLeafsResults );
 
@@ -419,31 +462,73 @@ void RunMPIBuildVisLeafs()
 	}
 }
 
+// The light data followed by each face's styles and light offset.
+static void PackLightData( CUtlBuffer &lightFaceData )
+{
+	// write out the light data
+	lightFaceData.EnsureCapacity( pdlightdata->Count() + (numfaces * (MAXLIGHTMAPS+sizeof(int))) );
+	Q_memcpy( lightFaceData.PeekPut(), pdlightdata->Base(), pdlightdata->Count() );
+	lightFaceData.SeekPut( CUtlBuffer::SEEK_HEAD, pdlightdata->Count() );
+
+	// write out the relevant face info into the stream
+	for ( int i = 0; i < numfaces; i++ )
+	{
+		for ( int j = 0; j < MAXLIGHTMAPS; j++ )
+		{
+			lightFaceData.PutChar(g_pFaces[i].styles[j]);
+		}
+		lightFaceData.PutInt(g_pFaces[i].lightofs);
+	}
+}
+
+static void UnpackLightData( CUtlBuffer &lightFaceData )
+{
+	int size = lightFaceData.TellPut();
+	int faceSize = (numfaces*(MAXLIGHTMAPS+sizeof(int)));
+	if ( size <= faceSize )
+		return;
+
+	int lightSize = size - faceSize;
+	pdlightdata->EnsureCount( lightSize );
+	lightFaceData.Get( pdlightdata->Base(), lightSize );
+
+	for ( int i = 0; i < numfaces; i++ )
+	{
+		for ( int j = 0; j < MAXLIGHTMAPS; j++ )
+		{
+			g_pFaces[i].styles[j] = lightFaceData.GetChar();
+		}
+		g_pFaces[i].lightofs = lightFaceData.GetInt();
+	}
+}
+
 void VMPI_DistributeLightData()
 {
 	if ( !g_bUseMPI )
 		return;
 
+	if ( WorkDist_IsActive() )
+	{
+		CUtlBuffer lightFaceData;
+		if ( g_bMPIMaster )
+		{
+			PackLightData( lightFaceData );
+			WorkDist_ShareData( "plightdata", lightFaceData.Base(), lightFaceData.TellMaxPut() );
+		}
+		else
+		{
+			WorkDist_GetSharedData( "plightdata", lightFaceData );
+			UnpackLightData( lightFaceData );
+		}
+		return;
+	}
+
 	if ( g_bMPIMaster )
 	{
 		const char *pVirtualFilename = "--plightdata--";
 		
 		CUtlBuffer lightFaceData;
-
-		// write out the light data
-		lightFaceData.EnsureCapacity( pdlightdata->Count() + (numfaces * (MAXLIGHTMAPS+sizeof(int))) );
-		Q_memcpy( lightFaceData.PeekPut(), pdlightdata->Base(), pdlightdata->Count() );
-		lightFaceData.SeekPut( CUtlBuffer::SEEK_HEAD, pdlightdata->Count() );
-
-		// write out the relevant face info into the stream
-		for ( int i = 0; i < numfaces; i++ )
-		{
-			for ( int j = 0; j < MAXLIGHTMAPS; j++ )
-			{
-				lightFaceData.PutChar(g_pFaces[i].styles[j]);
-			}
-			lightFaceData.PutInt(g_pFaces[i].lightofs);
-		}
+		PackLightData( lightFaceData );
 		VMPI_FileSystem_CreateVirtualFile( pVirtualFilename, lightFaceData.Base(), lightFaceData.TellMaxPut() );
 
 		char cPacketID[2] = { VMPI_VRAD_PACKET_ID, VMPI_SUBPACKETID_PLIGHTDATA_RESULTS };
@@ -12,6 +12,9 @@
 #endif
 
 
+#include "workdist.h"
+
+
 #define VMPI_VRAD_PACKET_ID						1
 	// Sub packet IDs.
 	#define VMPI_SUBPACKETID_VIS_LEAFS			0
@@ -25,6 +28,9 @@
 // Called first thing in the exe.
 void		VRAD_SetupMPI( int &argc, char **&argv );
 
+// Runs DistributeWork through VMPI or WorkDist, whichever this process is using.
+double		VRAD_DistributeWork( uint64 nWorkUnits, WorkDistProcessFn processFn, WorkDistReceiveFn receiveFn );
+
 void		RunMPIBuildFacelights(void);
 void		RunMPIBuildVisLeafs(void);
 void		VMPI_DistributeLightData();
@@ -0,0 +1,155 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: -raytracebench. Replays the direct lighting shadow rays of the
+//			loaded map through every ray packet kernel and reports the
+//			throughput of each, checking the results against the 4-wide path.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "vrad.h"
+#include "lightmap.h"
+#include "radial.h"
+#include "tier0/fasttimer.h"
+
+#define RAYTRACEBENCH_MAX_RAYS	( 4 * 1024 * 1024 )
+#define RAYTRACEBENCH_PASSES	3
+
+struct BenchRay_t
+{
+	Vector m_Start;
+	Vector m_End;
+};
+
+static void AddFaceShadowRays( int facenum, CUtlVector<BenchRay_t> &rays )
+{
+	dface_t *f = &g_pFaces[facenum];
+	if ( ( f->dispinfo != -1 ) || ( texinfo[f->texinfo].flags & TEX_SPECIAL ) )
+		return;
+
+	lightinfo_t l;
+	InitLightinfo( &l, facenum );
+
+	// one sample per luxel corner, pushed off the surface like the real samples are
+	for ( int t = 0; t <= f->m_LightmapTextureSizeInLuxels[1]; t++ )
+	{
+		for ( int s = 0; s <= f->m_LightmapTextureSizeInLuxels[0]; s++ )
+		{
+			Vector pos;
+			LuxelSpaceToWorld( &l, s, t, pos );
+			pos += l.facenormal;
+
+			for ( directlight_t *dl = activelights; dl; dl = dl->next )
+			{
+				if ( rays.Count() >= RAYTRACEBENCH_MAX_RAYS )
+					return;
+
+				Vector end;
+				switch ( dl->light.type )
+				{
+				case emit_skylight:
+					if ( DotProduct( dl->light.normal, l.facenormal ) >= 0 )
+						continue;
+					VectorMA( pos, -MAX_TRACE_LENGTH, dl->light.normal, end );
+					break;
+
+				case emit_point:
+				case emit_spotlight:
+				case emit_surface:
+					if ( DotProduct( dl->light.origin - pos, l.facenormal ) <= 0 )
+						continue;
+					end = dl->light.origin;
+					break;
+
+				default:
+					continue;
+				}
+
+				int i = rays.AddToTail();
+				rays[i].m_Start = pos;
+				rays[i].m_End = end;
+			}
+		}
+	}
+}
+
+static bool IsOccluded( RayTracingSingleResult const &rslt )
+{
+	return ( rslt.HitID != -1 ) && ( rslt.HitDistance < rslt.ray_length );
+}
+
+void RayTraceBenchmark( void )
+{
+	CUtlVector<BenchRay_t> rays;
+	for ( int i = 0; i < numfaces; i++ )
+	{
+		AddFaceShadowRays( i, rays );
+	}
+	if ( !rays.Count() )
+	{
+		Warning( "-raytracebench: no lit faces with lights in front of them, nothing to trace.\n" );
+		return;
+	}
+
+	Msg( "Ray trace benchmark: %d rays, %d passes per kernel, %s\n", rays.Count(), RAYTRACEBENCH_PASSES,
+		RayTracingEnvironment::GetAccelName( g_RtEnv.GetAccel() ) );
+
+	RayTraceKernel_t oldKernel = g_RtEnv.GetKernel();
+
+	CUtlVector<RayTracingSingleResult> reference;
+	CUtlVector<RayTracingSingleResult> results;
+	reference.SetCount( rays.Count() );
+	results.SetCount( rays.Count() );
+
+	for ( int k = 0; k < NUM_RAYTRACE_KERNELS; k++ )
+	{
+		RayTraceKernel_t kernel = (RayTraceKernel_t) k;
+		if ( !g_RtEnv.SetKernel( kernel ) )
+		{
+			Msg( "  %-6s : not supported on this CPU\n", RayTracingEnvironment::GetKernelName( kernel ) );
+			continue;
+		}
+
+		// kernel 0 is the 4-wide tracer everything is checked against
+		CUtlVector<RayTracingSingleResult> &out = ( k == RAYTRACE_KERNEL_SSE4 ) ? reference : results;
+
+		double flBest = 0;
+		for ( int pass = 0; pass < RAYTRACEBENCH_PASSES; pass++ )
+		{
+			CFastTimer timer;
+			timer.Start();
+			RayStream stream;
+			for ( int i = 0; i < rays.Count(); i++ )
+			{
+				g_RtEnv.AddToRayStream( stream, rays[i].m_Start, rays[i].m_End, &out[i] );
+			}
+			g_RtEnv.FinishRayStream( stream );
+			timer.End();
+
+			double flSeconds = timer.GetDuration().GetSeconds();
+			if ( ( pass == 0 ) || ( flSeconds < flBest ) )
+				flBest = flSeconds;
+		}
+
+		int nOcclusionMismatches = 0;
+		int nHitMismatches = 0;
+		if ( k != RAYTRACE_KERNEL_SSE4 )
+		{
+			for ( int i = 0; i < rays.Count(); i++ )
+			{
+				bool bOccluded = IsOccluded( out[i] );
+				if ( bOccluded != IsOccluded( reference[i] ) )
+					++nOcclusionMismatches;
+				else if ( bOccluded && ( out[i].HitID != reference[i].HitID ) )
+					++nHitMismatches;		// same answer, different face. happens on shared edges.
+			}
+		}
+
+		Msg( "  %-6s : %7.3f seconds, %7.2f Mrays/s, %d occlusion mismatches, %d hit face mismatches\n",
+			RayTracingEnvironment::GetKernelName( kernel ), flBest,
+			( flBest > 0 ) ? ( rays.Count() / flBest ) * 1.0e-6 : 0.0,
+			nOcclusionMismatches, nHitMismatches );
+	}
+
+	g_RtEnv.SetKernel( oldKernel );
+}
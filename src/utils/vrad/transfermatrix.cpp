@@ -0,0 +1,417 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Compressed patch-to-patch transfer matrix. See transfermatrix.h.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "vrad.h"
+#include "transfermatrix.h"
+#include "vmpi.h"
+#include "mathlib/ssemath.h"
+#include "tier0/memalloc.h"
+
+#ifdef _WIN32
+#define PSAPI_VERSION 2		// GetProcessMemoryInfo from kernel32, no psapi.lib
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+extern CUtlVector<Vector> emitlight;
+
+bool g_bCompressTransfers = true;
+float g_flTransferErrorBound = 0.001f;
+
+struct TransferRow_t
+{
+	void	*m_pData;			// indices, then the coefficients
+	int		m_nCount;
+	int		m_nFirst;			// matrix index the deltas start from
+	float	m_flScale;			// coefficient = quantized * m_flScale
+	bool	m_bWideIndices;		// absolute 32-bit matrix indices instead of 16-bit deltas
+	bool	m_bFloatCoefficients;	// quantizing was over the error bound, floats instead
+};
+
+static CUtlVector<TransferRow_t> s_Rows;			// by patch
+static CUtlVector<int> s_MatrixToPatch;
+static CUtlVector<int> s_PatchToMatrix;
+static fltx4 *s_pShooters;							// emitted light by matrix index
+
+static uint64 s_nCompressedBytes;
+static uint64 s_nUncompressedBytes;
+static int s_nRows;
+static int s_nFloatRows;
+static float s_flMaxError;
+
+
+//-----------------------------------------------------------------------------
+// Morton order
+//-----------------------------------------------------------------------------
+struct MortonPatch_t
+{
+	uint64	m_nCode;
+	int		m_ndxPatch;
+};
+
+static int MortonPatchCompare( const MortonPatch_t *pLeft, const MortonPatch_t *pRight )
+{
+	if ( pLeft->m_nCode != pRight->m_nCode )
+		return ( pLeft->m_nCode < pRight->m_nCode ) ? -1 : 1;
+	return pLeft->m_ndxPatch - pRight->m_ndxPatch;
+}
+
+// Spreads the low 21 bits of n out to every third bit
+static uint64 SpreadBits3( uint64 n )
+{
+	n &= 0x1fffff;
+	n = ( n | ( n << 32 ) ) & 0x001f00000000ffffULL;
+	n = ( n | ( n << 16 ) ) & 0x001f0000ff0000ffULL;
+	n = ( n | ( n << 8 ) )  & 0x100f00f00f00f00fULL;
+	n = ( n | ( n << 4 ) )  & 0x10c30c30c30c30c3ULL;
+	n = ( n | ( n << 2 ) )  & 0x1249249249249249ULL;
+	return n;
+}
+
+void TransferMatrix_Init( void )
+{
+	TransferMatrix_Shutdown();
+
+	int nPatches = g_Patches.Count();
+	s_Rows.SetCount( nPatches );
+	memset( s_Rows.Base(), 0, nPatches * sizeof( TransferRow_t ) );
+
+	Vector vecMins( FLT_MAX, FLT_MAX, FLT_MAX ), vecMaxs( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		VectorMin( g_Patches[i].origin, vecMins, vecMins );
+		VectorMax( g_Patches[i].origin, vecMaxs, vecMaxs );
+	}
+
+	Vector vecScale;
+	for ( int i = 0; i < 3; i++ )
+	{
+		float flSize = vecMaxs[i] - vecMins[i];
+		vecScale[i] = ( flSize > 0 ) ? 0x1fffff / flSize : 0;
+	}
+
+	CUtlVector<MortonPatch_t> order;
+	order.SetCount( nPatches );
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		Vector vecCell = ( g_Patches[i].origin - vecMins ) * vecScale;
+		order[i].m_nCode = SpreadBits3( (uint64)vecCell.x ) | ( SpreadBits3( (uint64)vecCell.y ) << 1 ) | ( SpreadBits3( (uint64)vecCell.z ) << 2 );
+		order[i].m_ndxPatch = i;
+	}
+	order.Sort( MortonPatchCompare );
+
+	s_MatrixToPatch.SetCount( nPatches );
+	s_PatchToMatrix.SetCount( nPatches );
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		s_MatrixToPatch[i] = order[i].m_ndxPatch;
+		s_PatchToMatrix[ order[i].m_ndxPatch ] = i;
+	}
+
+	s_pShooters = (fltx4 *)MemAlloc_AllocAligned( MAX( nPatches, 1 ) * sizeof( fltx4 ), 16 );
+	s_nCompressedBytes = 0;
+	s_nUncompressedBytes = 0;
+	s_nRows = 0;
+	s_nFloatRows = 0;
+	s_flMaxError = 0;
+}
+
+void TransferMatrix_Shutdown( void )
+{
+	for ( int i = 0; i < s_Rows.Count(); i++ )
+	{
+		free( s_Rows[i].m_pData );
+	}
+	s_Rows.Purge();
+	s_MatrixToPatch.Purge();
+	s_PatchToMatrix.Purge();
+
+	if ( s_pShooters )
+	{
+		MemAlloc_FreeAligned( s_pShooters );
+		s_pShooters = NULL;
+	}
+}
+
+bool TransferMatrix_IsCompressing( void )
+{
+	return g_bCompressTransfers && ( !g_bUseMPI || g_bMPIMaster ) && s_Rows.Count();
+}
+
+int TransferMatrix_GetPatch( int iWorkIndex )
+{
+	return TransferMatrix_IsCompressing() ? s_MatrixToPatch[iWorkIndex] : iWorkIndex;
+}
+
+
+//-----------------------------------------------------------------------------
+// Rows
+//-----------------------------------------------------------------------------
+struct SortedTransfer_t
+{
+	int		m_iMatrix;
+	float	m_flTransfer;
+};
+
+static int SortedTransferCompare( const SortedTransfer_t *pLeft, const SortedTransfer_t *pRight )
+{
+	return pLeft->m_iMatrix - pRight->m_iMatrix;
+}
+
+void CompressTransferRow( int ndxPatch, const transfer_t *pTransfers, int nTransfers, float flScale )
+{
+	TransferRow_t &row = s_Rows[ndxPatch];
+	Assert( !row.m_pData );
+	if ( !nTransfers )
+		return;
+
+	CUtlVector<SortedTransfer_t> sorted;
+	sorted.SetCount( nTransfers );
+	float flMax = 0, flTotal = 0;
+	for ( int i = 0; i < nTransfers; i++ )
+	{
+		sorted[i].m_iMatrix = s_PatchToMatrix[ pTransfers[i].patch ];
+		sorted[i].m_flTransfer = pTransfers[i].transfer * flScale;
+		flMax = MAX( flMax, sorted[i].m_flTransfer );
+		flTotal += sorted[i].m_flTransfer;
+	}
+	sorted.Sort( SortedTransferCompare );
+
+	row.m_nCount = nTransfers;
+	row.m_nFirst = sorted[0].m_iMatrix;
+	row.m_flScale = flMax / 65535.0f;
+	row.m_bWideIndices = false;
+
+	// Would 16 bits lose too much of the light this row carries?
+	float flError = 0;
+	float flInvScale = ( row.m_flScale > 0 ) ? 1.0f / row.m_flScale : 0;
+	for ( int i = 0; i < nTransfers; i++ )
+	{
+		int nQuantized = MIN( (int)( sorted[i].m_flTransfer * flInvScale + 0.5f ), 0xffff );
+		flError += fabs( sorted[i].m_flTransfer - nQuantized * row.m_flScale );
+	}
+	flError = ( flTotal > 0 ) ? flError / flTotal : 0;
+	row.m_bFloatCoefficients = ( flError > g_flTransferErrorBound );
+
+	for ( int i = 1; i < nTransfers; i++ )
+	{
+		if ( sorted[i].m_iMatrix - sorted[i-1].m_iMatrix > 0xffff )
+		{
+			row.m_bWideIndices = true;
+			break;
+		}
+	}
+
+	int nIndexBytes = nTransfers * ( row.m_bWideIndices ? sizeof( uint32 ) : sizeof( uint16 ) );
+	int nBytes = nIndexBytes + nTransfers * ( row.m_bFloatCoefficients ? sizeof( float ) : sizeof( uint16 ) );
+	row.m_pData = malloc( nBytes );
+	if ( !row.m_pData )
+		Error( "Memory allocation failure" );
+
+	if ( row.m_bWideIndices )
+	{
+		uint32 *pIndices = (uint32 *)row.m_pData;
+		for ( int i = 0; i < nTransfers; i++ )
+		{
+			pIndices[i] = sorted[i].m_iMatrix;
+		}
+	}
+	else
+	{
+		uint16 *pDeltas = (uint16 *)row.m_pData;
+		int iPrev = row.m_nFirst;
+		for ( int i = 0; i < nTransfers; i++ )
+		{
+			pDeltas[i] = sorted[i].m_iMatrix - iPrev;
+			iPrev = sorted[i].m_iMatrix;
+		}
+	}
+
+	if ( row.m_bFloatCoefficients )
+	{
+		float *pCoefficients = (float *)( (byte *)row.m_pData + nIndexBytes );
+		for ( int i = 0; i < nTransfers; i++ )
+		{
+			pCoefficients[i] = sorted[i].m_flTransfer;
+		}
+	}
+	else
+	{
+		uint16 *pCoefficients = (uint16 *)( (byte *)row.m_pData + nIndexBytes );
+		for ( int i = 0; i < nTransfers; i++ )
+		{
+			pCoefficients[i] = (uint16)MIN( (int)( sorted[i].m_flTransfer * flInvScale + 0.5f ), 0xffff );
+		}
+	}
+
+	ThreadLock();
+	s_nCompressedBytes += nBytes;
+	s_nUncompressedBytes += nTransfers * sizeof( transfer_t );
+	s_nRows++;
+	if ( row.m_bFloatCoefficients )
+	{
+		s_nFloatRows++;
+	}
+	else
+	{
+		s_flMaxError = MAX( s_flMaxError, flError );
+	}
+	ThreadUnlock();
+}
+
+int DecompressTransferRow( int ndxPatch, transfer_t *pTransfers )
+{
+	const TransferRow_t &row = s_Rows[ndxPatch];
+	int nIndexBytes = row.m_nCount * ( row.m_bWideIndices ? sizeof( uint32 ) : sizeof( uint16 ) );
+	const void *pCoefficients = (const byte *)row.m_pData + nIndexBytes;
+
+	int iMatrix = row.m_nFirst;
+	for ( int i = 0; i < row.m_nCount; i++ )
+	{
+		if ( row.m_bWideIndices )
+		{
+			iMatrix = ( (const uint32 *)row.m_pData )[i];
+		}
+		else
+		{
+			iMatrix += ( (const uint16 *)row.m_pData )[i];
+		}
+		pTransfers[i].patch = s_MatrixToPatch[iMatrix];
+		if ( row.m_bFloatCoefficients )
+		{
+			pTransfers[i].transfer = ( (const float *)pCoefficients )[i];
+		}
+		else
+		{
+			pTransfers[i].transfer = ( (const uint16 *)pCoefficients )[i] * row.m_flScale;
+		}
+	}
+	return row.m_nCount;
+}
+
+
+//-----------------------------------------------------------------------------
+// Gathering
+//-----------------------------------------------------------------------------
+void TransferMatrix_PrepareBounce( void )
+{
+	for ( int i = 0; i < s_MatrixToPatch.Count(); i++ )
+	{
+		int ndxPatch = s_MatrixToPatch[i];
+		const Vector &vecEmit = emitlight[ndxPatch];
+		const Vector &vecReflectivity = g_Patches[ndxPatch].reflectivity;
+		fltx4 &fl4Shooter = s_pShooters[i];
+		SubFloat( fl4Shooter, 0 ) = vecEmit.x * vecReflectivity.x;
+		SubFloat( fl4Shooter, 1 ) = vecEmit.y * vecReflectivity.y;
+		SubFloat( fl4Shooter, 2 ) = vecEmit.z * vecReflectivity.z;
+		SubFloat( fl4Shooter, 3 ) = 0;
+	}
+}
+
+// Sum of a row's shooters times its stored coefficients, T being uint16 or float
+template< typename T >
+static fltx4 GatherRow( const TransferRow_t &row, const T *pCoefficients )
+{
+	int nCount = row.m_nCount;
+
+	// Four sums so the adds don't wait on each other
+	fltx4 fl4Sum0 = Four_Zeros, fl4Sum1 = Four_Zeros, fl4Sum2 = Four_Zeros, fl4Sum3 = Four_Zeros;
+	int i = 0;
+	if ( row.m_bWideIndices )
+	{
+		const uint32 *pIndices = (const uint32 *)row.m_pData;
+		for ( ; i + 4 <= nCount; i += 4 )
+		{
+			fl4Sum0 = MaddSIMD( s_pShooters[ pIndices[i] ], ReplicateX4( (float)pCoefficients[i] ), fl4Sum0 );
+			fl4Sum1 = MaddSIMD( s_pShooters[ pIndices[i+1] ], ReplicateX4( (float)pCoefficients[i+1] ), fl4Sum1 );
+			fl4Sum2 = MaddSIMD( s_pShooters[ pIndices[i+2] ], ReplicateX4( (float)pCoefficients[i+2] ), fl4Sum2 );
+			fl4Sum3 = MaddSIMD( s_pShooters[ pIndices[i+3] ], ReplicateX4( (float)pCoefficients[i+3] ), fl4Sum3 );
+		}
+		for ( ; i < nCount; i++ )
+		{
+			fl4Sum0 = MaddSIMD( s_pShooters[ pIndices[i] ], ReplicateX4( (float)pCoefficients[i] ), fl4Sum0 );
+		}
+	}
+	else
+	{
+		const uint16 *pDeltas = (const uint16 *)row.m_pData;
+		const fltx4 *pShooter = s_pShooters + row.m_nFirst;
+		for ( ; i + 4 <= nCount; i += 4 )
+		{
+			pShooter += pDeltas[i];
+			fl4Sum0 = MaddSIMD( *pShooter, ReplicateX4( (float)pCoefficients[i] ), fl4Sum0 );
+			pShooter += pDeltas[i+1];
+			fl4Sum1 = MaddSIMD( *pShooter, ReplicateX4( (float)pCoefficients[i+1] ), fl4Sum1 );
+			pShooter += pDeltas[i+2];
+			fl4Sum2 = MaddSIMD( *pShooter, ReplicateX4( (float)pCoefficients[i+2] ), fl4Sum2 );
+			pShooter += pDeltas[i+3];
+			fl4Sum3 = MaddSIMD( *pShooter, ReplicateX4( (float)pCoefficients[i+3] ), fl4Sum3 );
+		}
+		for ( ; i < nCount; i++ )
+		{
+			pShooter += pDeltas[i];
+			fl4Sum0 = MaddSIMD( *pShooter, ReplicateX4( (float)pCoefficients[i] ), fl4Sum0 );
+		}
+	}
+
+	return AddSIMD( AddSIMD( fl4Sum0, fl4Sum1 ), AddSIMD( fl4Sum2, fl4Sum3 ) );
+}
+
+void GatherTransferLight( int ndxPatch, Vector &sum )
+{
+	const TransferRow_t &row = s_Rows[ndxPatch];
+	int nIndexBytes = row.m_nCount * ( row.m_bWideIndices ? sizeof( uint32 ) : sizeof( uint16 ) );
+	const void *pCoefficients = (const byte *)row.m_pData + nIndexBytes;
+
+	fltx4 fl4Sum;
+	if ( row.m_bFloatCoefficients )
+	{
+		fl4Sum = GatherRow( row, (const float *)pCoefficients );
+	}
+	else
+	{
+		fl4Sum = MulSIMD( GatherRow( row, (const uint16 *)pCoefficients ), ReplicateX4( row.m_flScale ) );
+	}
+	sum.Init( SubFloat( fl4Sum, 0 ), SubFloat( fl4Sum, 1 ), SubFloat( fl4Sum, 2 ) );
+}
+
+
+//-----------------------------------------------------------------------------
+// Stats
+//-----------------------------------------------------------------------------
+void TransferMatrix_GetMemoryUsage( uint64 &nCompressed, uint64 &nUncompressed )
+{
+	nCompressed = s_nCompressedBytes;
+	nUncompressed = s_nUncompressedBytes;
+}
+
+void TransferMatrix_GetRowCounts( int &nRows, int &nFloatRows )
+{
+	nRows = s_nRows;
+	nFloatRows = s_nFloatRows;
+}
+
+float TransferMatrix_GetMaxError( void )
+{
+	return s_flMaxError;
+}
+
+uint64 GetPeakMemoryUsage( void )
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if ( GetProcessMemoryInfo( GetCurrentProcess(), &counters, sizeof( counters ) ) )
+		return counters.PeakWorkingSetSize;
+	return 0;
+#else
+	struct rusage usage;
+	if ( getrusage( RUSAGE_SELF, &usage ) == 0 )
+		return (uint64)usage.ru_maxrss * 1024;		// kilobytes on Linux
+	return 0;
+#endif
+}
@@ -0,0 +1,74 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Compressed patch-to-patch transfer matrix for the bounce passes.
+//
+//			MakeScales leaves each patch with a row of transfer_t { int patch;
+//			float transfer; }, 8 bytes a transfer, and on big maps the rows add
+//			up to gigabytes that every bounce streams through. With compression
+//			on, each row is packed as soon as MakeScales (or the VMPI master)
+//			has it, so the uncompressed matrix never exists in full:
+//
+//			- Patches are numbered in Morton order of their origins, so patches
+//			  that are close in the world are close in memory.
+//			- A row's sources are sorted and stored as 16-bit deltas from the
+//			  previous one (32-bit indices if a gap doesn't fit).
+//			- Coefficients are quantized to 16 bits against the row's largest.
+//			  A row whose total quantization error, relative to the light it
+//			  transfers, is over g_flTransferErrorBound keeps float coefficients.
+//
+//			GatherTransferLight then sums a row with SIMD, one patch's RGB per
+//			register, from a copy of every patch's emitted light made in matrix
+//			order at the start of each bounce.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef TRANSFERMATRIX_H
+#define TRANSFERMATRIX_H
+#pragma once
+
+struct transfer_t;
+
+extern bool g_bCompressTransfers;
+extern float g_flTransferErrorBound;
+
+// Numbers the patches and sets up the rows. Call once the patches are final,
+// before BuildVisMatrix.
+void TransferMatrix_Init( void );
+void TransferMatrix_Shutdown( void );
+
+// Is this process keeping its transfers compressed? VMPI workers send theirs
+// to the master uncompressed.
+bool TransferMatrix_IsCompressing( void );
+
+// Packs a patch's transfers, multiplying each coefficient by flScale. Thread safe
+// as long as each patch is only compressed once.
+void CompressTransferRow( int ndxPatch, const transfer_t *pTransfers, int nTransfers, float flScale );
+
+// Unpacks a row into pTransfers, which must have room for max_transfer. Returns
+// the number of transfers.
+int DecompressTransferRow( int ndxPatch, transfer_t *pTransfers );
+
+// GatherLight visits patches in matrix order; this maps a work index to a patch.
+int TransferMatrix_GetPatch( int iWorkIndex );
+
+// Copies emitlight * reflectivity of every patch into matrix order. Call before
+// each bounce's GatherLight.
+void TransferMatrix_PrepareBounce( void );
+
+// Sum of the light gathered over ndxPatch's transfers.
+void GatherTransferLight( int ndxPatch, Vector &sum );
+
+// Compressed bytes, and what the same transfers take as transfer_t
+void TransferMatrix_GetMemoryUsage( uint64 &nCompressed, uint64 &nUncompressed );
+
+// Rows packed, and how many of them kept float coefficients
+void TransferMatrix_GetRowCounts( int &nRows, int &nFloatRows );
+
+// Largest quantization error relative to the total transfer out of a 16-bit row
+float TransferMatrix_GetMaxError( void );
+
+// Peak resident memory of the process so far, in bytes (0 if unknown)
+uint64 GetPeakMemoryUsage( void );
+
+#endif // TRANSFERMATRIX_H
@@ -473,7 +473,7 @@ void BuildVisMatrix (void)
 	}
 	else 
 	{
-		RunThreadsOn (dvis->numclusters, true, BuildVisLeafs);
+		RunThreadsOnAnyOrder (dvis->numclusters, true, BuildVisLeafs);
 	}
 }
 
@@ -11,14 +11,17 @@
 #include "vrad.h"
 #include "physdll.h"
 #include "lightmap.h"
+#include "lightcache.h"
 #include "tier1/strtools.h"
 #include "vmpi.h"
 #include "macro_texture.h"
 #include "vmpi_tools_shared.h"
+#include "workdist.h"
 #include "leaf_ambient_lighting.h"
 #include "tools_minidump.h"
 #include "loadcmdline.h"
 #include "byteswap.h"
+#include "transfermatrix.h"
 
 #define ALLOWDEBUGOPTIONS (0 || _DEBUG)
 
@@ -49,6 +52,7 @@ Vector		face_offset[MAX_MAP_FACES];		// for rotating bmodels
 int			fakeplanes;
 
 unsigned	numbounce = 100; // 25; /* Originally this was 8 */
+float		g_flBounceConvergence = 0;	// stop once a bounce adds less than this fraction of the first one
 
 float		maxchop = 4; // coarsest allowed number of luxel widths for a patch
 float		minchop = 4; // "-chop" tightest number of luxel widths for a patch, used on edges
@@ -59,6 +63,8 @@ bool	    bDumpNormals = false;
 bool		g_bDumpRtEnv = false;
 bool		bRed2Black = true;
 bool		g_bFastAmbient = false;
+bool		g_bAdaptiveAmbient = false;
+bool		g_bAmbientDiff = false;
 bool        g_bNoSkyRecurse = false;
 bool		g_bDumpPropLightmaps = false;
 
@@ -80,6 +86,7 @@ char		level_lights[MAX_PATH] = "";
 
 char		vismatfile[_MAX_PATH] = "";
 char		incrementfile[_MAX_PATH] = "";
+char		lightcachefile[_MAX_PATH] = "";
 
 IIncremental *g_pIncremental = 0;
 bool		g_bInterrupt = false;	// Wsed with background lighting in WC. Tells VRAD
@@ -119,6 +126,7 @@ bool		g_bStaticPropLighting = false;
 bool        g_bStaticPropPolys = false;
 bool        g_bTextureShadows = false;
 bool        g_bDisablePropSelfShadowing = false;
+bool		g_bRayTraceBench = false;
 
 
 CUtlVector<byte> g_FacesVisibleToLights;
@@ -1218,11 +1226,6 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 			max_transfer = patch->numtransfers;
 		}
 
-
-		patch->transfers = ( transfer_t* )calloc (1, patch->numtransfers * sizeof(transfer_t));
-		if (!patch->transfers)
-			Error ("Memory allocation failure");
-
 		// get total transfer energy
 		t2 = all_transfers;
 
@@ -1238,6 +1241,20 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 		else	
 			total = 1.0f/M_PI;
 
+		if ( TransferMatrix_IsCompressing() )
+		{
+			CompressTransferRow( ndxPatch, all_transfers, patch->numtransfers, total );
+
+			ThreadLock ();
+			total_transfer += patch->numtransfers;
+			ThreadUnlock ();
+			return;
+		}
+
+		patch->transfers = ( transfer_t* )calloc (1, patch->numtransfers * sizeof(transfer_t));
+		if (!patch->transfers)
+			Error ("Memory allocation failure");
+
 		t = patch->transfers;
 		t2 = all_transfers;
 		for (j=0 ; j<patch->numtransfers ; j++, t++, t2++)
@@ -1532,6 +1549,8 @@ void PreGetBumpNormalsForDisp( texinfo_t *pTexinfo, Vector &vecU, Vector &vecV,
 	vecV = vecTexV;
 }
 
+static CUtlVector<transfer_t> s_GatherTransfers[MAX_TOOL_THREADS+1];
+
 void GatherLight (int threadnum, void *pUserData)
 {
 	int			i, j, k;
@@ -1539,6 +1558,7 @@ void GatherLight (int threadnum, void *pUserData)
 	int			num;
 	CPatch		*patch;
 	Vector		sum, v;
+	bool		bCompressed = TransferMatrix_IsCompressing();
 
 	while (1)
 	{
@@ -1546,12 +1566,22 @@ void GatherLight (int threadnum, void *pUserData)
 		if (j == -1)
 			break;
 
+		// compressed, patches that are close together go together
+		j = TransferMatrix_GetPatch( j );
 		patch = &g_Patches[j];
 
 		trans = patch->transfers;
 		num = patch->numtransfers;
 		if ( patch->needsBumpmap )
 		{
+			if ( bCompressed && num )
+			{
+				CUtlVector<transfer_t> &transfers = s_GatherTransfers[threadnum];
+				transfers.EnsureCount( max_transfer );
+				trans = transfers.Base();
+				num = DecompressTransferRow( j, trans );
+			}
+
 			Vector delta;
 			Vector bumpSum[NUM_BUMP_VECTS+1];
 			Vector normals[NUM_BUMP_VECTS+1];
@@ -1623,6 +1653,18 @@ void GatherLight (int threadnum, void *pUserData)
 				VectorCopy( bumpSum[i], addlight[j].light[i] );
 			}
 		}
+		else if ( bCompressed )
+		{
+			if ( num )
+			{
+				GatherTransferLight( j, sum );
+			}
+			else
+			{
+				VectorFill( sum, 0 );
+			}
+			VectorCopy( sum, addlight[j].light[0] );
+		}
 		else
 		{
 			VectorFill( sum, 0 );
@@ -1700,13 +1742,20 @@ void BounceLight (void)
 	}
 #endif
 
+	double flStart = Plat_FloatTime();
+	float flFirstAdded = 0;
+
 	i = 0;
 	while ( bouncing )
 	{
 		// transfer light from to the leaf patches from other patches via transfers
 		// this moves shooter->emitlight to receiver->addlight
 		unsigned int uiPatchCount = g_Patches.Size();
-		RunThreadsOn (uiPatchCount, true, GatherLight);
+		if ( TransferMatrix_IsCompressing() )
+		{
+			TransferMatrix_PrepareBounce();
+		}
+		RunThreadsOnAnyOrder (uiPatchCount, true, GatherLight);
 		// move newly received light (addlight) to light to be sent out (emitlight)
 		// start at children and pull light up to parents
 		// light is always received to leaf patches
@@ -1717,6 +1766,17 @@ void BounceLight (void)
 		if ( i+1 == numbounce || (added[0] < 1.0 && added[1] < 1.0 && added[2] < 1.0) )
 			bouncing = false;
 
+		// converged?
+		float flAdded = MAX( added[0], MAX( added[1], added[2] ) );
+		if ( i == 0 )
+		{
+			flFirstAdded = flAdded;
+		}
+		else if ( flAdded < g_flBounceConvergence * flFirstAdded )
+		{
+			bouncing = false;
+		}
+
 		i++;
 		if ( g_bDumpPatches && !bouncing && i != 1)
 		{
@@ -1724,6 +1784,8 @@ void BounceLight (void)
 			WriteWorld (name, 0);
 		}
 	}
+
+	qprintf ("%i bounces in %.1f seconds, peak memory %5.1f megs\n", i, Plat_FloatTime() - flStart, (float)GetPeakMemoryUsage() / (1024*1024));
 }
 
 
@@ -1924,6 +1986,8 @@ void BuildFacesVisibleToLights( bool bAllVisible )
 
 void MakeAllScales (void)
 {
+	TransferMatrix_Init ();
+
 	// determine visibility between patches
 	BuildVisMatrix ();
 	
@@ -1932,8 +1996,21 @@ void MakeAllScales (void)
 
 	Msg("transfers %d, max %d\n", total_transfer, max_transfer );
 
-	qprintf ("transfer lists: %5.1f megs\n"
-		, (float)total_transfer * sizeof(transfer_t) / (1024*1024));
+	if ( TransferMatrix_IsCompressing() )
+	{
+		uint64 nCompressed, nUncompressed;
+		int nRows, nFloatRows;
+		TransferMatrix_GetMemoryUsage( nCompressed, nUncompressed );
+		TransferMatrix_GetRowCounts( nRows, nFloatRows );
+		qprintf ("transfer lists: %5.1f megs compressed from %5.1f megs, %d of %d rows kept as floats, max error %.4f%%\n"
+			, (float)nCompressed / (1024*1024), (float)nUncompressed / (1024*1024), nFloatRows, nRows, TransferMatrix_GetMaxError() * 100.0f );
+	}
+	else
+	{
+		qprintf ("transfer lists: %5.1f megs\n"
+			, (float)total_transfer * sizeof(transfer_t) / (1024*1024));
+	}
+	qprintf ("peak memory: %5.1f megs\n", (float)GetPeakMemoryUsage() / (1024*1024));
 }
 
 
@@ -2019,6 +2096,11 @@ bool RadWorld_Go()
 		BuildFacesVisibleToLights( true );
 	}
 
+	if ( g_bLightCache )
+	{
+		LightCache_HashLights();
+	}
+
 	// build initial facelights
 	if (g_bUseMPI) 
 	{
@@ -2027,13 +2109,18 @@ bool RadWorld_Go()
 	}
 	else 
 	{
-		RunThreadsOnIndividual (numfaces, true, BuildFacelights);
+		RunThreadsOnIndividualAnyOrder (numfaces, true, BuildFacelights);
 	}
 
 	// Was the process interrupted?
 	if( g_pIncremental && (g_iCurFace != numfaces) )
 		return false;
 
+	if ( g_bLightCache )
+	{
+		LightCache_Save();
+	}
+
 	// Figure out the offset into lightmap data for each face.
 	PrecompLightmapOffsets();
 	
@@ -2069,6 +2156,8 @@ bool RadWorld_Go()
 
 			// spread light around
 			BounceLight ();
+
+			TransferMatrix_Shutdown ();
 		}
 
 		//
@@ -2082,7 +2171,7 @@ bool RadWorld_Go()
 		// blend bounced light into direct light and save
 		VMPI_SetCurrentStage( "FinalLightFace" );
 		if ( !g_bUseMPI || g_bMPIMaster )
-			RunThreadsOnIndividual (numfaces, true, FinalLightFace);
+			RunThreadsOnIndividualAnyOrder (numfaces, true, FinalLightFace);
 		
 		// Distribute the lighting data to workers.
 		VMPI_DistributeLightData();
@@ -2143,7 +2232,7 @@ void VRAD_LoadBSP( char const *pFilename )
 	// so we prepend qdir here.
 	strcpy( source, ExpandPath( source ) );
 
-	if ( !g_bUseMPI )
+	if ( !g_bUseMPI || WorkDist_IsCoordinator() )
 	{
 		// Setup the logfile.
 		char logFile[512];
@@ -2178,6 +2267,19 @@ void VRAD_LoadBSP( char const *pFilename )
 
 	strcpy(incrementfile, source);
 	Q_DefaultExtension(incrementfile, ".r0", sizeof(incrementfile));
+
+	// the light cache can't be shared between MPI workers, and incremental lighting gathers
+	// each light separately
+	if ( g_bLightCache && ( g_bUseMPI || g_pIncremental ) )
+	{
+		Warning( "-lightcache doesn't work with MPI or incremental lighting, ignoring it.\n" );
+		g_bLightCache = false;
+	}
+	if ( g_bLightCache && !lightcachefile[0] )
+	{
+		Q_StripExtension( source, lightcachefile, sizeof( lightcachefile ) );
+		Q_strncat( lightcachefile, ".lightcache", sizeof( lightcachefile ), COPY_ALL_CHARACTERS );
+	}
 	Q_DefaultExtension(source, ".bsp", sizeof( source ));
 
 	Msg( "Loading %s\n", source );
@@ -2185,15 +2287,15 @@ void VRAD_LoadBSP( char const *pFilename )
 	LoadBSPFile (source);
 
 	// Add this bsp to our search path so embedded resources can be found
-	if ( g_bUseMPI && g_bMPIMaster )
+	if ( g_bUseMPI && g_bMPIMaster && !WorkDist_IsActive() )
 	{
 		// MPI Master, MPI workers don't need to do anything
 		g_pOriginalPassThruFileSystem->AddSearchPath(source, "GAME", PATH_ADD_TO_HEAD);
 		g_pOriginalPassThruFileSystem->AddSearchPath(source, "MOD", PATH_ADD_TO_HEAD);
 	}
-	else if ( !g_bUseMPI )
+	else if ( !g_bUseMPI || WorkDist_IsActive() )
 	{
-		// Non-MPI
+		// Non-MPI, or WorkDist where everyone has their own file system
 		g_pFullFileSystem->AddSearchPath(source, "GAME", PATH_ADD_TO_HEAD);
 		g_pFullFileSystem->AddSearchPath(source, "MOD", PATH_ADD_TO_HEAD);
 	}
@@ -2268,10 +2370,17 @@ void VRAD_LoadBSP( char const *pFilename )
 	if ( g_bDumpRtEnv )
 		WriteRTEnv("trace.txt");
 
+	// Hash the geometry for the light cache while the triangles still have their vertices
+	if ( g_bLightCache )
+	{
+		LightCache_Init( lightcachefile );
+		LightCache_HashGeometry();
+	}
+
 	// Build acceleration structure
 	printf ( "Setting up ray-trace acceleration structure... ");
 	float start = Plat_FloatTime();
-	g_RtEnv.SetupAccelerationStructure();
+	g_RtEnv.SetupAccelerationStructure( numthreads );
 	float end = Plat_FloatTime();
 	printf ( "Done (%.2f seconds)\n", end-start );
 
@@ -2314,6 +2423,13 @@ extern void CloseDispLuxels();
 
 void VRAD_Finish()
 {
+	// WorkDist workers only have the pieces they computed; the coordinator writes the bsp.
+	if ( WorkDist_IsActive() && !WorkDist_IsCoordinator() )
+	{
+		Msg( "VRAD worker finished. Over and out.\n" );
+		CmdLib_Exit( 0 );
+	}
+
 	Msg( "Ready to Finish\n" ); 
 	fflush( stdout );
 
@@ -2442,6 +2558,44 @@ int ParseCommandLine( int argc, char **argv, bool *onlydetail )
 				return -1;
 			}
 		}
+		else if (!Q_stricmp(argv[i],"-bounceconverge"))
+		{
+			if ( ++i < argc )
+			{
+				g_flBounceConvergence = (float)atof (argv[i]);
+				if ( g_flBounceConvergence < 0 )
+				{
+					Warning("Error: expected non-negative value after '-bounceconverge'\n" );
+					return -1;
+				}
+			}
+			else
+			{
+				Warning("Error: expected a value after '-bounceconverge'\n" );
+				return -1;
+			}
+		}
+		else if (!Q_stricmp(argv[i],"-nocompresstransfers"))
+		{
+			g_bCompressTransfers = false;
+		}
+		else if (!Q_stricmp(argv[i],"-transfererror"))
+		{
+			if ( ++i < argc )
+			{
+				g_flTransferErrorBound = (float)atof (argv[i]);
+				if ( g_flTransferErrorBound < 0 )
+				{
+					Warning("Error: expected non-negative value after '-transfererror'\n" );
+					return -1;
+				}
+			}
+			else
+			{
+				Warning("Error: expected a value after '-transfererror'\n" );
+				return -1;
+			}
+		}
 		else if (!Q_stricmp(argv[i],"-verbose") || !Q_stricmp(argv[i],"-v"))
 		{
 			verbose = true;
@@ -2487,6 +2641,15 @@ int ParseCommandLine( int argc, char **argv, bool *onlydetail )
 		{
 			g_bFastAmbient = true;
 		}
+		else if ( !Q_stricmp(argv[i], "-adaptiveambient") )
+		{
+			g_bAdaptiveAmbient = true;
+		}
+		else if ( !Q_stricmp(argv[i], "-ambientdiff") )
+		{
+			g_bAdaptiveAmbient = true;
+			g_bAmbientDiff = true;
+		}
 		else if (!Q_stricmp(argv[i],"-fast"))
 		{
 			do_fast = true;
@@ -2549,6 +2712,71 @@ int ParseCommandLine( int argc, char **argv, bool *onlydetail )
 		{
 			g_bLowPriority = true;
 		}
+		else if( !Q_stricmp( argv[i], "-pinthreads" ) )
+		{
+			g_bPinThreads = true;
+		}
+		else if( !Q_stricmp( argv[i], "-raytracekernel" ) )
+		{
+			if ( ++i < argc )
+			{
+				RayTraceKernel_t kernel = RayTracingEnvironment::FindKernel( argv[i] );
+				if ( kernel == NUM_RAYTRACE_KERNELS )
+				{
+					Warning( "Error: unknown ray trace kernel '%s' (sse4, sse8, sse16, avx8 or avx16)\n", argv[i] );
+					return -1;
+				}
+				if ( !g_RtEnv.SetKernel( kernel ) )
+				{
+					Warning( "Ray trace kernel '%s' isn't supported on this CPU, using '%s'.\n",
+						argv[i], RayTracingEnvironment::GetKernelName( g_RtEnv.GetKernel() ) );
+				}
+			}
+			else
+			{
+				Warning( "Error: expected a kernel name after '-raytracekernel'\n" );
+				return -1;
+			}
+		}
+		else if( !Q_stricmp( argv[i], "-raytraceaccel" ) )
+		{
+			if ( ++i < argc )
+			{
+				RayTraceAccel_t accel = RayTracingEnvironment::FindAccel( argv[i] );
+				if ( accel == NUM_RAYTRACE_ACCELS )
+				{
+					Warning( "Error: unknown ray trace acceleration structure '%s' (kdtree or bvh)\n", argv[i] );
+					return -1;
+				}
+				g_RtEnv.SetAccel( accel );
+			}
+			else
+			{
+				Warning( "Error: expected kdtree or bvh after '-raytraceaccel'\n" );
+				return -1;
+			}
+		}
+		else if( !Q_stricmp( argv[i], "-lightcache" ) )
+		{
+			g_bLightCache = true;
+		}
+		else if( !Q_stricmp( argv[i], "-lightcachefile" ) )
+		{
+			if ( ++i < argc )
+			{
+				g_bLightCache = true;
+				Q_strncpy( lightcachefile, argv[i], sizeof( lightcachefile ) );
+			}
+			else
+			{
+				Warning( "Error: expected a path after '-lightcachefile'\n" );
+				return -1;
+			}
+		}
+		else if( !Q_stricmp( argv[i], "-raytracebench" ) )
+		{
+			g_bRayTraceBench = true;
+		}
 		else if( !Q_stricmp( argv[i], "-loghash" ) )
 		{
 			g_bLogHashData = true;
@@ -2800,11 +3028,18 @@ void PrintUsage( int argc, char **argv )
 		"\n"
 		"  -v (or -verbose): Turn on verbose output (also shows more command\n"
 		"  -bounce #       : Set max number of bounces (default: 100).\n"
+		"  -bounceconverge # : Stop bouncing once a bounce adds less than this fraction\n"
+		"                    of the light the first bounce added (default: 0, off).\n"
 		"  -fast           : Quick and dirty lighting.\n"
 		"  -fastambient    : Per-leaf ambient sampling is lower quality to save compute time.\n"
+		"  -adaptiveambient : Only take extra per-leaf ambient samples where the nearby\n"
+		"                    samples differ.\n"
+		"  -ambientdiff    : Compute per-leaf ambient both ways, keep the adaptive one and\n"
+		"                    report how far it is from the full sampling.\n"
 		"  -final          : High quality processing. equivalent to -extrasky 16.\n"
 		"  -extrasky n     : trace N times as many rays for indirect light and sky ambient.\n"
 		"  -low            : Run as an idle-priority process.\n"
+		"  -pinthreads     : Pin worker threads to processors (NUMA node by node).\n"
 		"  -mpi            : Use VMPI to distribute computations.\n"
 		"  -rederror       : Show errors in red.\n"
 		"\n"
@@ -2854,6 +3089,22 @@ void PrintUsage( int argc, char **argv )
 		"  -textureshadows : Allows texture alpha channels to block light - rays intersecting alpha surfaces will sample the texture\n"
 		"  -noskyboxrecurse : Turn off recursion into 3d skybox (skybox shadows on world)\n"
 		"  -nossprops      : Globally disable self-shadowing on static props\n"
+		"  -raytracekernel <name> : Ray packet kernel: sse4, sse8, sse16, avx8 or avx16\n"
+		"                    (default: sse4).\n"
+		"  -raytraceaccel <name> : Ray trace acceleration structure: kdtree (default)\n"
+		"                    or bvh.\n"
+		"  -lightcache     : Reuse the direct lighting of faces whose geometry, lights\n"
+		"                    and visible surroundings haven't changed since the last\n"
+		"                    -lightcache compile. Bounced light is always recomputed.\n"
+		"  -lightcachefile <path> : Use <path> as the light cache (implies -lightcache;\n"
+		"                    default: <mapname>.lightcache next to the bsp).\n"
+		"  -nocompresstransfers : Keep the radiosity transfers as full precision lists.\n"
+		"                    Takes about twice the memory.\n"
+		"  -transfererror # : Keep a compressed transfer row's coefficients as floats if\n"
+		"                    16 bits would be off by more than this fraction of the\n"
+		"                    light it transfers (default: 0.001). 0 keeps every row exact.\n"
+		"  -raytracebench  : Time every ray trace kernel on the map's direct lighting\n"
+		"                    rays, then exit without lighting.\n"
 		"\n"
 #if 1 // Disabled for the initial SDK release with VMPI so we can get feedback from selected users.
 		);
@@ -2913,6 +3164,14 @@ int RunVRAD( int argc, char **argv )
 
 	VRAD_LoadBSP( argv[i] );
 
+	if ( g_bRayTraceBench )
+	{
+		RayTraceBenchmark();
+		DeleteCmdLine( argc, argv );
+		CmdLib_Cleanup();
+		return 0;
+	}
+
 	if ( (! onlydetail) && (! g_bOnlyStaticProps ) )
 	{
 		RadWorld_Go();
@@ -2940,7 +3199,7 @@ int VRAD_Main(int argc, char **argv)
 	VRAD_SetupMPI( argc, argv );
 
 #if !defined( _DEBUG )
-	if ( g_bUseMPI && !g_bMPIMaster )
+	if ( g_bUseMPI && !g_bMPIMaster && !WorkDist_IsActive() )
 	{
 		SetupToolsMinidumpHandler( VMPI_ExceptionFilter );
 	}
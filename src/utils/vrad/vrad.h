@@ -275,6 +275,8 @@ extern bool			bRed2Black;
 extern bool         g_bNoSkyRecurse;
 extern bool			bDumpNormals;
 extern bool			g_bFastAmbient;
+extern bool			g_bAdaptiveAmbient;
+extern bool			g_bAmbientDiff;
 extern float		maxchop;
 extern FileHandle_t	pFileSamples[4][4];
 extern qboolean		g_bLowPriority;
@@ -302,6 +304,8 @@ extern bool IsModelTextureShadowsForced( const char *pModelName );
 #define TRACE_ID_STATICPROP    0x04000000  // static prop - lower bits are prop ID
 extern RayTracingEnvironment g_RtEnv;
 
+void RayTraceBenchmark( void );	// -raytracebench, in raytracebench.cpp
+
 #include "mpivrad.h"
 
 void MakeShadowSplits (void);
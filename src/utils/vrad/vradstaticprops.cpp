@@ -260,15 +260,19 @@ public:
 
 private:
 	// VMPI stuff.
-	static void VMPI_ProcessStaticProp_Static( int iThread, uint64 iStaticProp, MessageBuffer *pBuf );
-	static void VMPI_ReceiveStaticPropResults_Static( uint64 iStaticProp, MessageBuffer *pBuf, int iWorker );
-	void VMPI_ProcessStaticProp( int iThread, int iStaticProp, MessageBuffer *pBuf );
-	void VMPI_ReceiveStaticPropResults( int iStaticProp, MessageBuffer *pBuf, int iWorker );
+	static void VMPI_ProcessStaticProp_Static( int iThread, uint64 iWorkUnit, CUtlBuffer *pBuf );
+	static void VMPI_ReceiveStaticPropResults_Static( uint64 iWorkUnit, CUtlBuffer *pBuf, int iWorker );
+	void VMPI_ProcessStaticProp( int iThread, int iWorkUnit, CUtlBuffer *pBuf );
+	void VMPI_ReceiveStaticPropResults( int iWorkUnit, CUtlBuffer *pBuf, int iWorker );
 	
 	// local thread version
 	static void ThreadComputeStaticPropLighting( int iThread, void *pUserData );
 	void ComputeLightingForProp( int iThread, int iStaticProp );
 
+	// Props placed exactly on top of an identical one get its lighting
+	void FindIdenticalProps();
+	void ApplyLightingToInstances( int iStaticProp, const CComputeStaticPropLightingResults *pResults );
+
 	// Methods associated with unserializing static props
 	void UnserializeModelDict( CUtlBuffer& buf );
 	void UnserializeModels( CUtlBuffer& buf );
@@ -333,6 +337,10 @@ private:
 	CUtlVector <StaticPropDict_t>	m_StaticPropDict;
 	CUtlVector <CStaticProp>		m_StaticProps;
 
+	// The props that get lit; for each prop, the next one that's identical to it or -1
+	CUtlVector <int>				m_LitProps;
+	CUtlVector <int>				m_NextInstance;
+
 	bool m_bIgnoreStaticPropTrace;
 
 	void ComputeLighting( CStaticProp &prop, int iThread, int prop_index, CComputeStaticPropLightingResults *pResults );
@@ -1145,17 +1153,71 @@ bool PositionInSolid( Vector &position )
 }
 
 //-----------------------------------------------------------------------------
-// Trace from a vertex to each direct light source, accumulating its contribution.
+// Direct lighting for a batch of points
+//
+// The points are put in Morton order of their positions and lit four at a time,
+// so each GatherSampleLightSSE call traces one bundle of nearby rays instead of
+// four separate calls tracing a ray each. Every lane still gets exactly the
+// light it would on its own: lanes whose cluster can't see a light are masked
+// out, and lights that none of the points' clusters can see are dropped first.
 //-----------------------------------------------------------------------------
-void ComputeDirectLightingAtPoint( Vector &position, Vector &normal, Vector &outColor, int iThread,
-								   int static_prop_id_to_skip=-1, int nLFlags = 0)
+#define MAX_CULL_CLUSTERS 64
+
+struct MortonSample_t
 {
-	SSE_sampleLightOutput_t	sampleOutput;
+	uint32	m_nCode;
+	int		m_nIndex;
+};
+
+static int MortonSampleCompare( const MortonSample_t *pLeft, const MortonSample_t *pRight )
+{
+	if ( pLeft->m_nCode != pRight->m_nCode )
+		return ( pLeft->m_nCode < pRight->m_nCode ) ? -1 : 1;
+	return pLeft->m_nIndex - pRight->m_nIndex;
+}
+
+// Spreads the low 10 bits of n out to every third bit
+static uint32 SpreadBits3( uint32 n )
+{
+	n &= 0x3ff;
+	n = ( n | ( n << 16 ) ) & 0x030000ff;
+	n = ( n | ( n << 8 ) )  & 0x0300f00f;
+	n = ( n | ( n << 4 ) )  & 0x030c30c3;
+	n = ( n | ( n << 2 ) )  & 0x09249249;
+	return n;
+}
 
-	outColor.Init();
+static void ComputeDirectLightingAtPoints( int nPoints, const Vector *pPositions, const Vector *pNormals, Vector *pOutColors, int iThread,
+										   int static_prop_id_to_skip=-1, int nLFlags = 0 )
+{
+	if ( nPoints <= 0 )
+		return;
+
+	CUtlVector<int> clusters;
+	clusters.SetCount( nPoints );
 
-	// Iterate over all direct lights and accumulate their contribution
-	int cluster = ClusterFromPoint( position );
+	Vector vecMins( FLT_MAX, FLT_MAX, FLT_MAX );
+	Vector vecMaxs( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+	for ( int i = 0; i < nPoints; i++ )
+	{
+		pOutColors[i].Init();
+		clusters[i] = ClusterFromPoint( pPositions[i] );
+		VectorMin( vecMins, pPositions[i], vecMins );
+		VectorMax( vecMaxs, pPositions[i], vecMaxs );
+	}
+
+	// Only the lights some point can see. Past MAX_CULL_CLUSTERS it's cheaper to let the
+	// per packet checks do it.
+	CUtlVectorFixedGrowable<int, MAX_CULL_CLUSTERS> uniqueClusters;
+	for ( int i = 0; i < nPoints && uniqueClusters.Count() <= MAX_CULL_CLUSTERS; i++ )
+	{
+		if ( uniqueClusters.Find( clusters[i] ) == -1 )
+		{
+			uniqueClusters.AddToTail( clusters[i] );
+		}
+	}
+
+	CUtlVectorFixedGrowable<directlight_t *, 64> lights;
 	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
 	{
 		if ( dl->light.style )
@@ -1164,47 +1226,129 @@ void ComputeDirectLightingAtPoint( Vector &position, Vector &normal, Vector &out
 			continue;
 		}
 
-		// is this lights cluster visible?
-		if ( !PVSCheck( dl->pvs, cluster ) )
-			continue;
-
-		// push the vertex towards the light to avoid surface acne
-		Vector adjusted_pos = position;
-		float flEpsilon = 0.0;
+		bool bVisible = uniqueClusters.Count() > MAX_CULL_CLUSTERS;
+		for ( int i = 0; i < uniqueClusters.Count() && !bVisible; i++ )
+		{
+			bVisible = PVSCheck( dl->pvs, uniqueClusters[i] ) != 0;
+		}
 
-		if  (dl->light.type != emit_skyambient)
+		if ( bVisible )
 		{
-			// push towards the light
-			Vector fudge;
-			if ( dl->light.type == emit_skylight )
-				fudge = -( dl->light.normal);
-			else
-			{
-				fudge = dl->light.origin-position;
-				VectorNormalize( fudge );
-			}
-			fudge *= 4.0;
-			adjusted_pos += fudge;
+			lights.AddToTail( dl );
 		}
-		else 
+	}
+
+	if ( !lights.Count() )
+		return;
+
+	// Put neighbours next to each other
+	CUtlVector<MortonSample_t> order;
+	order.SetCount( nPoints );
+
+	Vector vecSize = vecMaxs - vecMins;
+	Vector vecScale;
+	for ( int i = 0; i < 3; i++ )
+	{
+		vecScale[i] = ( vecSize[i] > 0.0f ) ? 1023.0f / vecSize[i] : 0.0f;
+	}
+
+	for ( int i = 0; i < nPoints; i++ )
+	{
+		Vector vecCell = ( pPositions[i] - vecMins ) * vecScale;
+		order[i].m_nCode = SpreadBits3( (uint32)vecCell.x ) | ( SpreadBits3( (uint32)vecCell.y ) << 1 ) | ( SpreadBits3( (uint32)vecCell.z ) << 2 );
+		order[i].m_nIndex = i;
+	}
+	if ( nPoints > 4 )
+	{
+		order.Sort( MortonSampleCompare );
+	}
+
+	SSE_sampleLightOutput_t	sampleOutput;
+	for ( int nFirst = 0; nFirst < nPoints; nFirst += 4 )
+	{
+		// pad the last packet out with copies of its last point
+		int nLanes = MIN( 4, nPoints - nFirst );
+		int index[4];
+		for ( int j = 0; j < 4; j++ )
 		{
-			// push out along normal
-			adjusted_pos += 4.0 * normal;
-//			flEpsilon = 1.0;
+			index[j] = order[ nFirst + MIN( j, nLanes - 1 ) ].m_nIndex;
 		}
 
-		FourVectors adjusted_pos4;
 		FourVectors normal4;
-		adjusted_pos4.DuplicateVector( adjusted_pos );
-		normal4.DuplicateVector( normal );
+		normal4.LoadAndSwizzle( pNormals[index[0]], pNormals[index[1]], pNormals[index[2]], pNormals[index[3]] );
 
-		GatherSampleLightSSE( sampleOutput, dl, -1, adjusted_pos4, &normal4, 1, iThread, nLFlags | GATHERLFLAGS_FORCE_FAST,
-		                      static_prop_id_to_skip, flEpsilon );
-		
-		VectorMA( outColor, sampleOutput.m_flFalloff.m128_f32[0] * sampleOutput.m_flDot[0].m128_f32[0], dl->light.intensity, outColor );
+		for ( int iLight = 0; iLight < lights.Count(); iLight++ )
+		{
+			directlight_t *dl = lights[iLight];
+
+			// is this lights cluster visible?
+			bool bLaneVisible[4];
+			bool bAnyVisible = false;
+			for ( int j = 0; j < nLanes; j++ )
+			{
+				bLaneVisible[j] = PVSCheck( dl->pvs, clusters[index[j]] ) != 0;
+				bAnyVisible |= bLaneVisible[j];
+			}
+			if ( !bAnyVisible )
+				continue;
+
+			// push each point towards the light to avoid surface acne
+			Vector adjusted_pos[4];
+			float flEpsilon = 0.0;
+			for ( int j = 0; j < 4; j++ )
+			{
+				const Vector &position = pPositions[index[j]];
+				adjusted_pos[j] = position;
+
+				if  (dl->light.type != emit_skyambient)
+				{
+					// push towards the light
+					Vector fudge;
+					if ( dl->light.type == emit_skylight )
+						fudge = -( dl->light.normal);
+					else
+					{
+						fudge = dl->light.origin-position;
+						VectorNormalize( fudge );
+					}
+					fudge *= 4.0;
+					adjusted_pos[j] += fudge;
+				}
+				else 
+				{
+					// push out along normal
+					adjusted_pos[j] += 4.0 * pNormals[index[j]];
+//					flEpsilon = 1.0;
+				}
+			}
+
+			FourVectors adjusted_pos4;
+			adjusted_pos4.LoadAndSwizzle( adjusted_pos[0], adjusted_pos[1], adjusted_pos[2], adjusted_pos[3] );
+
+			GatherSampleLightSSE( sampleOutput, dl, -1, adjusted_pos4, &normal4, 1, iThread, nLFlags | GATHERLFLAGS_FORCE_FAST,
+								  static_prop_id_to_skip, flEpsilon );
+
+			for ( int j = 0; j < nLanes; j++ )
+			{
+				if ( !bLaneVisible[j] )
+					continue;
+
+				Vector &outColor = pOutColors[index[j]];
+				VectorMA( outColor, SubFloat( sampleOutput.m_flFalloff, j ) * SubFloat( sampleOutput.m_flDot[0], j ), dl->light.intensity, outColor );
+			}
+		}
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Trace from a vertex to each direct light source, accumulating its contribution.
+//-----------------------------------------------------------------------------
+void ComputeDirectLightingAtPoint( Vector &position, Vector &normal, Vector &outColor, int iThread,
+								   int static_prop_id_to_skip=-1, int nLFlags = 0)
+{
+	ComputeDirectLightingAtPoints( 1, &position, &normal, &outColor, iThread, static_prop_id_to_skip, nLFlags );
+}
+
 //-----------------------------------------------------------------------------
 // Takes the results from a ComputeLighting call and applies it to the static prop in question.
 //-----------------------------------------------------------------------------
@@ -1309,6 +1453,10 @@ void CVradStaticPropMgr::ApplyLightingToStaticProp( int iStaticProp, CStaticProp
 void CVradStaticPropMgr::ComputeLighting( CStaticProp &prop, int iThread, int prop_index, CComputeStaticPropLightingResults *pResults )
 {
 	CUtlVector<badVertex_t>		badVerts;
+	CUtlVector<int>				goodVerts;
+	CUtlVector<Vector>			goodPositions;
+	CUtlVector<Vector>			goodNormals;
+	CUtlVector<Vector>			directColors;
 
 	StaticPropDict_t &dict = m_StaticPropDict[prop.m_ModelIdx];
 	studiohdr_t	*pStudioHdr = dict.m_pStudioHdr;
@@ -1393,39 +1541,47 @@ void CVradStaticPropMgr::ComputeLighting( CStaticProp &prop, int iThread, int pr
 					}
 					else
 					{
-						Vector direct_pos=samplePosition;
-							
-						
-
-						Vector directColor(0,0,0);
-						ComputeDirectLightingAtPoint( direct_pos,
-														sampleNormal, directColor, iThread,
-														skip_prop, nFlags );
-						Vector indirectColor(0,0,0);
-
-						if (g_bShowStaticPropNormals)
-						{
-							directColor= sampleNormal;
-							directColor += Vector(1.0,1.0,1.0);
-							directColor *= 50.0;
-						}
-						else
-						{
-							if (numbounce >= 1)
-								ComputeIndirectLightingAtPoint( 
-									samplePosition, sampleNormal, 
-									indirectColor, iThread, true,
-									( prop.m_Flags & STATIC_PROP_IGNORE_NORMALS) != 0 );
-						}
-						
+						// lit below, all together
 						colorVerts[numVertexes].m_bValid = true;
 						colorVerts[numVertexes].m_Position = samplePosition;
-						VectorAdd( directColor, indirectColor, colorVerts[numVertexes].m_Color );
+
+						goodVerts.AddToTail( numVertexes );
+						goodPositions.AddToTail( samplePosition );
+						goodNormals.AddToTail( sampleNormal );
 					}
 					
 					numVertexes++;
 				}
 			}
+
+			directColors.SetCount( goodVerts.Count() );
+			ComputeDirectLightingAtPoints( goodVerts.Count(), goodPositions.Base(), goodNormals.Base(), directColors.Base(), iThread,
+										   skip_prop, nFlags );
+
+			for ( int nGoodVertex = 0; nGoodVertex < goodVerts.Count(); nGoodVertex++ )
+			{
+				Vector &samplePosition = goodPositions[nGoodVertex];
+				Vector &sampleNormal = goodNormals[nGoodVertex];
+				Vector directColor = directColors[nGoodVertex];
+				Vector indirectColor(0,0,0);
+
+				if (g_bShowStaticPropNormals)
+				{
+					directColor= sampleNormal;
+					directColor += Vector(1.0,1.0,1.0);
+					directColor *= 50.0;
+				}
+				else
+				{
+					if (numbounce >= 1)
+						ComputeIndirectLightingAtPoint( 
+							samplePosition, sampleNormal, 
+							indirectColor, iThread, true,
+							( prop.m_Flags & STATIC_PROP_IGNORE_NORMALS) != 0 );
+				}
+
+				VectorAdd( directColor, indirectColor, colorVerts[goodVerts[nGoodVertex]].m_Color );
+			}
 			
 			// color in the bad vertexes
 			// when entire model has no lighting origin and no valid neighbors
@@ -1496,6 +1652,9 @@ void CVradStaticPropMgr::ComputeLighting( CStaticProp &prop, int iThread, int pr
 			
 			// discard bad verts
 			badVerts.Purge();
+			goodVerts.RemoveAll();
+			goodPositions.RemoveAll();
+			goodNormals.RemoveAll();
 		}
 	}
 }
@@ -1655,22 +1814,24 @@ void CVradStaticPropMgr::SerializeLighting()
 	}
 }
 
-void CVradStaticPropMgr::VMPI_ProcessStaticProp_Static( int iThread, uint64 iStaticProp, MessageBuffer *pBuf )
+void CVradStaticPropMgr::VMPI_ProcessStaticProp_Static( int iThread, uint64 iWorkUnit, CUtlBuffer *pBuf )
 {
-	g_StaticPropMgr.VMPI_ProcessStaticProp( iThread, iStaticProp, pBuf );
+	g_StaticPropMgr.VMPI_ProcessStaticProp( iThread, iWorkUnit, pBuf );
 }
 
-void CVradStaticPropMgr::VMPI_ReceiveStaticPropResults_Static( uint64 iStaticProp, MessageBuffer *pBuf, int iWorker )
+void CVradStaticPropMgr::VMPI_ReceiveStaticPropResults_Static( uint64 iWorkUnit, CUtlBuffer *pBuf, int iWorker )
 {
-	g_StaticPropMgr.VMPI_ReceiveStaticPropResults( iStaticProp, pBuf, iWorker );
+	g_StaticPropMgr.VMPI_ReceiveStaticPropResults( iWorkUnit, pBuf, iWorker );
 }
 	
 //-----------------------------------------------------------------------------
 // Called on workers to do the computation for a static prop and send
 // it to the master.
 //-----------------------------------------------------------------------------
-void CVradStaticPropMgr::VMPI_ProcessStaticProp( int iThread, int iStaticProp, MessageBuffer *pBuf )
+void CVradStaticPropMgr::VMPI_ProcessStaticProp( int iThread, int iWorkUnit, CUtlBuffer *pBuf )
 {
+	int iStaticProp = m_LitProps[iWorkUnit];
+
 	// Compute the lighting.
 	CComputeStaticPropLightingResults results;
 	ComputeLighting( m_StaticProps[iStaticProp], iThread, iStaticProp, &results );
@@ -1679,38 +1840,40 @@ void CVradStaticPropMgr::VMPI_ProcessStaticProp( int iThread, int iStaticProp, M
 	
 	// Encode the results.
 	int nLists = results.m_ColorVertsArrays.Count();
-	pBuf->write( &nLists, sizeof( nLists ) );
+	pBuf->Put( &nLists, sizeof( nLists ) );
 	
 	for ( int i=0; i < nLists; i++ )
 	{
 		CUtlVector<colorVertex_t> &curList = *results.m_ColorVertsArrays[i];
 		int count = curList.Count();
-		pBuf->write( &count, sizeof( count ) );
-		pBuf->write( curList.Base(), curList.Count() * sizeof( colorVertex_t ) );
+		pBuf->Put( &count, sizeof( count ) );
+		pBuf->Put( curList.Base(), curList.Count() * sizeof( colorVertex_t ) );
 	}
 
 	nLists = results.m_ColorTexelsArrays.Count();
-	pBuf->write(&nLists, sizeof(nLists));
+	pBuf->Put(&nLists, sizeof(nLists));
 
 	for (int i = 0; i < nLists; i++)
 	{
 		CUtlVector<colorTexel_t> &curList = *results.m_ColorTexelsArrays[i];
 		int count = curList.Count();
-		pBuf->write(&count, sizeof(count));
-		pBuf->write(curList.Base(), curList.Count() * sizeof(colorTexel_t));
+		pBuf->Put(&count, sizeof(count));
+		pBuf->Put(curList.Base(), curList.Count() * sizeof(colorTexel_t));
 	}
 }
 
 //-----------------------------------------------------------------------------
 // Called on the master when a worker finishes processing a static prop.
 //-----------------------------------------------------------------------------
-void CVradStaticPropMgr::VMPI_ReceiveStaticPropResults( int iStaticProp, MessageBuffer *pBuf, int iWorker )
+void CVradStaticPropMgr::VMPI_ReceiveStaticPropResults( int iWorkUnit, CUtlBuffer *pBuf, int iWorker )
 {
+	int iStaticProp = m_LitProps[iWorkUnit];
+
 	// Read in the results.
 	CComputeStaticPropLightingResults results;
 	
 	int nLists;
-	pBuf->read( &nLists, sizeof( nLists ) );
+	pBuf->Get( &nLists, sizeof( nLists ) );
 	
 	for ( int i=0; i < nLists; i++ )
 	{
@@ -1718,12 +1881,12 @@ void CVradStaticPropMgr::VMPI_ReceiveStaticPropResults( int iStaticProp, Message
 		results.m_ColorVertsArrays.AddToTail( pList );
 		
 		int count;
-		pBuf->read( &count, sizeof( count ) );
+		pBuf->Get( &count, sizeof( count ) );
 		pList->SetSize( count );
-		pBuf->read( pList->Base(), count * sizeof( colorVertex_t ) );
+		pBuf->Get( pList->Base(), count * sizeof( colorVertex_t ) );
 	}
 
-	pBuf->read(&nLists, sizeof(nLists));
+	pBuf->Get(&nLists, sizeof(nLists));
 
 	for (int i = 0; i < nLists; i++)
 	{
@@ -1731,13 +1894,13 @@ void CVradStaticPropMgr::VMPI_ReceiveStaticPropResults( int iStaticProp, Message
 		results.m_ColorTexelsArrays.AddToTail(pList);
 
 		int count;
-		pBuf->read(&count, sizeof(count));
+		pBuf->Get(&count, sizeof(count));
 		pList->SetSize(count);
-		pBuf->read(pList->Base(), count * sizeof(colorTexel_t));
+		pBuf->Get(pList->Base(), count * sizeof(colorTexel_t));
 	}
 	
 	// Apply the results.
-	ApplyLightingToStaticProp( iStaticProp, m_StaticProps[iStaticProp], &results );
+	ApplyLightingToInstances( iStaticProp, &results );
 }
 
 
@@ -1746,7 +1909,7 @@ void CVradStaticPropMgr::ComputeLightingForProp( int iThread, int iStaticProp )
 	// Compute the lighting.
 	CComputeStaticPropLightingResults results;
 	ComputeLighting( m_StaticProps[iStaticProp], iThread, iStaticProp, &results );
-	ApplyLightingToStaticProp( iStaticProp, m_StaticProps[iStaticProp], &results );
+	ApplyLightingToInstances( iStaticProp, &results );
 }
 
 void CVradStaticPropMgr::ThreadComputeStaticPropLighting( int iThread, void *pUserData )
@@ -1756,11 +1919,104 @@ void CVradStaticPropMgr::ThreadComputeStaticPropLighting( int iThread, void *pUs
 		int j = GetThreadWork ();
 		if (j == -1)
 			break;
-		CComputeStaticPropLightingResults results;
-		g_StaticPropMgr.ComputeLightingForProp( iThread, j );
+		g_StaticPropMgr.ComputeLightingForProp( iThread, g_StaticPropMgr.m_LitProps[j] );
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Applies a prop's lighting to it and every prop identical to it
+//-----------------------------------------------------------------------------
+void CVradStaticPropMgr::ApplyLightingToInstances( int iStaticProp, const CComputeStaticPropLightingResults *pResults )
+{
+	for ( int i = iStaticProp; i != -1; i = m_NextInstance[i] )
+	{
+		ApplyLightingToStaticProp( i, m_StaticProps[i], pResults );
+	}
+}
+
+// Everything about a prop its lighting depends on. No padding, so it can be memcmp'd.
+struct PropInstanceKey_t
+{
+	int		m_ModelIdx;
+	int		m_Flags;
+	int		m_bLightingOriginValid;
+	Vector	m_Origin;
+	QAngle	m_Angles;
+	Vector	m_LightingOrigin;
+	int		m_LightmapImageFormat;
+	int		m_LightmapImageWidth;
+	int		m_LightmapImageHeight;
+	int		m_iProp;
+};
+
+static int PropIndexCompare( const int *pLeft, const int *pRight )
+{
+	return *pLeft - *pRight;
+}
+
+static int PropInstanceKeyCompare( const PropInstanceKey_t *pLeft, const PropInstanceKey_t *pRight )
+{
+	int nCompare = memcmp( pLeft, pRight, offsetof( PropInstanceKey_t, m_iProp ) );
+	if ( nCompare )
+		return nCompare;
+	return pLeft->m_iProp - pRight->m_iProp;
+}
+
+//-----------------------------------------------------------------------------
+// Maps sometimes have the same model placed twice at the same spot. The copies
+// shadow each other the same way a single prop would shadow itself, so they all
+// end up with the same lighting; only the first copy gets lit.
+//-----------------------------------------------------------------------------
+void CVradStaticPropMgr::FindIdenticalProps()
+{
+	int count = m_StaticProps.Count();
+
+	CUtlVector<PropInstanceKey_t> keys;
+	keys.SetCount( count );
+	for ( int i = 0; i < count; i++ )
+	{
+		const CStaticProp &prop = m_StaticProps[i];
+		PropInstanceKey_t &key = keys[i];
+		memset( &key, 0, sizeof( key ) );
+		key.m_ModelIdx = prop.m_ModelIdx;
+		key.m_Flags = prop.m_Flags;
+		key.m_bLightingOriginValid = prop.m_bLightingOriginValid;
+		key.m_Origin = prop.m_Origin;
+		key.m_Angles = prop.m_Angles;
+		if ( prop.m_bLightingOriginValid )
+		{
+			key.m_LightingOrigin = prop.m_LightingOrigin;
+		}
+		key.m_LightmapImageFormat = prop.m_LightmapImageFormat;
+		key.m_LightmapImageWidth = prop.m_LightmapImageWidth;
+		key.m_LightmapImageHeight = prop.m_LightmapImageHeight;
+		key.m_iProp = i;
+	}
+	keys.Sort( PropInstanceKeyCompare );
+
+	m_LitProps.RemoveAll();
+	m_NextInstance.SetCount( count );
+	for ( int i = 0; i < count; i++ )
+	{
+		m_NextInstance[i] = -1;
+	}
+
+	for ( int i = 0; i < count; i++ )
+	{
+		if ( i > 0 && !memcmp( &keys[i-1], &keys[i], offsetof( PropInstanceKey_t, m_iProp ) ) )
+		{
+			m_NextInstance[ keys[i-1].m_iProp ] = keys[i].m_iProp;
+		}
+		else
+		{
+			m_LitProps.AddToTail( keys[i].m_iProp );
+		}
+	}
+
+	// light them in map order
+	m_LitProps.Sort( PropIndexCompare );
+}
+
 //-----------------------------------------------------------------------------
 // Computes lighting for the static props.
 // Must be after all other surface lighting has been computed for the indirect sampling.
@@ -1775,6 +2031,12 @@ void CVradStaticPropMgr::ComputeLighting( int iThread )
 		return;
 	}
 
+	FindIdenticalProps();
+	if ( m_LitProps.Count() < count )
+	{
+		qprintf( "%d static props share the lighting of an identical prop\n", count - m_LitProps.Count() );
+	}
+
 	StartPacifier( "Computing static prop lighting : " );
 
 	// ensure any traces against us are ignored because we have no inherit lighting contribution
@@ -1785,15 +2047,14 @@ void CVradStaticPropMgr::ComputeLighting( int iThread )
 		// Distribute the work among the workers.
 		VMPI_SetCurrentStage( "CVradStaticPropMgr::ComputeLighting" );
 		
-		DistributeWork( 
-			count, 
-			VMPI_DISTRIBUTEWORK_PACKETID,
+		VRAD_DistributeWork( 
+			m_LitProps.Count(), 
 			&CVradStaticPropMgr::VMPI_ProcessStaticProp_Static, 
 			&CVradStaticPropMgr::VMPI_ReceiveStaticPropResults_Static );
 	}
 	else
 	{
-		RunThreadsOn(count, true, ThreadComputeStaticPropLighting);
+		RunThreadsOnAnyOrder(m_LitProps.Count(), true, ThreadComputeStaticPropLighting);
 	}
 
 	// restore default
@@ -2398,6 +2659,10 @@ static void GenerateLightmapSamplesForMesh( const matrix3x4_t& _matPos, const ma
 	// on the other side.
 	// First attempt: Just pretend the triangle was larger and cast a ray from this new world pos 
 	// as above.
+	CUtlVector<int> litTexels;
+	CUtlVector<Vector> litPositions;
+	CUtlVector<Vector> litNormals;
+
 	int linearPos = 0;
 	for ( int j = 0; j < _lightmapResY; ++j )
 	{
@@ -2423,21 +2688,29 @@ static void GenerateLightmapSamplesForMesh( const matrix3x4_t& _matPos, const ma
 
 			if (shouldProcess)
 			{
-				Vector directColor(0, 0, 0),
-					   indirectColor(0, 0, 0);
-
+				litTexels.AddToTail( linearPos );
+				litPositions.AddToTail( colorTexels[linearPos].m_WorldPosition );
+				litNormals.AddToTail( colorTexels[linearPos].m_WorldNormal );
+			}
 
-				ComputeDirectLightingAtPoint( colorTexels[linearPos].m_WorldPosition, colorTexels[linearPos].m_WorldNormal, directColor, _iThread, _skipProp, _flags);
+			++linearPos;
+		}
+	}
 
-				if (numbounce >= 1) {
-					ComputeIndirectLightingAtPoint( colorTexels[linearPos].m_WorldPosition, colorTexels[linearPos].m_WorldNormal, indirectColor, _iThread, true, (_flags & GATHERLFLAGS_IGNORE_NORMALS) != 0 );
-				}
+	CUtlVector<Vector> directColors;
+	directColors.SetCount( litTexels.Count() );
+	ComputeDirectLightingAtPoints( litTexels.Count(), litPositions.Base(), litNormals.Base(), directColors.Base(), _iThread, _skipProp, _flags );
 
-				VectorAdd(directColor, indirectColor, colorTexels[linearPos].m_Color);
-			}
+	for ( int i = 0; i < litTexels.Count(); ++i )
+	{
+		colorTexel_t &texel = colorTexels[litTexels[i]];
+		Vector indirectColor(0, 0, 0);
 
-			++linearPos;
+		if (numbounce >= 1) {
+			ComputeIndirectLightingAtPoint( texel.m_WorldPosition, texel.m_WorldNormal, indirectColor, _iThread, true, (_flags & GATHERLFLAGS_IGNORE_NORMALS) != 0 );
 		}
+
+		VectorAdd(directColors[i], indirectColor, texel.m_Color);
 	}
 }
 
@@ -34,8 +34,24 @@ int CountBits (byte *bits, int numbits)
 	int		i;
 	int		c;
 
-	c = 0;
-	for (i=0 ; i<numbits ; i++)
+	// popcount 128 bits at a time: sum bit pairs, then nibbles, then bytes, then
+	// add the bytes of each half with a sum of absolute differences against zero
+	const __m128i m1 = _mm_set1_epi8( 0x55 );
+	const __m128i m2 = _mm_set1_epi8( 0x33 );
+	const __m128i m4 = _mm_set1_epi8( 0x0f );
+	__m128i sum = _mm_setzero_si128();
+	int nBlocks = numbits >> 7;
+	for (i=0 ; i<nBlocks ; i++)
+	{
+		__m128i v = _mm_loadu_si128( (const __m128i *)( bits + i*16 ) );
+		v = _mm_sub_epi8( v, _mm_and_si128( _mm_srli_epi64( v, 1 ), m1 ) );
+		v = _mm_add_epi8( _mm_and_si128( v, m2 ), _mm_and_si128( _mm_srli_epi64( v, 2 ), m2 ) );
+		v = _mm_and_si128( _mm_add_epi8( v, _mm_srli_epi64( v, 4 ) ), m4 );
+		sum = _mm_add_epi64( sum, _mm_sad_epu8( v, _mm_setzero_si128() ) );
+	}
+	c = _mm_cvtsi128_si32( sum ) + _mm_cvtsi128_si32( _mm_unpackhi_epi64( sum, sum ) );
+
+	for (i=nBlocks<<7 ; i<numbits ; i++)
 		if ( CheckBit( bits, i ) )
 			c++;
 
@@ -481,8 +497,8 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 	portal_t	*p;
 	plane_t		backplane;
 	leaf_t 		*leaf;
-	int			i, j;
-	long		*test, *might, *vis, more;
+	int			i;
+	byte		*test;
 	int			pnum;
 
 	// Early-out if we're a VMPI worker that's told to exit. If we don't do this here, then the
@@ -506,9 +522,6 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 	stack.leaf = leaf;
 	stack.portal = NULL;
 
-	might = (long *)stack.mightsee;
-	vis = (long *)thread->base->portalvis;
-	
 	// check all portals for flowing into other leafs	
 	for (i=0 ; i<leaf->portals.Count() ; i++)
 	{
@@ -524,19 +537,14 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 		// if the portal can't see anything we haven't allready seen, skip it
 		if (p->status == stat_done)
 		{
-			test = (long *)p->portalvis;
+			test = p->portalvis;
 		}
 		else
 		{
-			test = (long *)p->portalflood;
+			test = p->portalflood;
 		}
 
-		more = 0;
-		for (j=0 ; j<portallongs ; j++)
-		{
-			might[j] = ((long *)prevstack->mightsee)[j] & test[j];
-			more |= (might[j] & ~vis[j]);
-		}
+		bool more = PortalBitsAndTestNew( stack.mightsee, prevstack->mightsee, test, thread->base->portalvis );
 		
 		if ( !more && CheckBit( thread->base->portalvis, pnum ) )
 		{	// can't see anything new
@@ -642,8 +650,7 @@ void PortalFlow (int iThread, int portalnum)
 	data.pstack_head.portal = p;
 	data.pstack_head.source = p->winding;
 	data.pstack_head.portalplane = p->plane;
-	for (i=0 ; i<portallongs ; i++)
-		((long *)data.pstack_head.mightsee)[i] = ((long *)p->portalflood)[i];
+	memcpy (data.pstack_head.mightsee, p->portalflood, portalbytes);
 
 	RecursiveLeafFlow (p->leaf, &data, &data.pstack_head);
 
@@ -825,8 +832,7 @@ void RecursiveLeafBitFlow (int leafnum, byte *mightsee, byte *cansee)
 {
 	portal_t	*p;
 	leaf_t 		*leaf;
-	int			i, j;
-	long		more;
+	int			i;
 	int			pnum;
 	byte		newmight[MAX_PORTALS/8];
 
@@ -843,15 +849,7 @@ void RecursiveLeafBitFlow (int leafnum, byte *mightsee, byte *cansee)
 			continue;
 
 		// if this portal can see some portals we mightsee, recurse
-		more = 0;
-		for (j=0 ; j<portallongs ; j++)
-		{
-			((long *)newmight)[j] = ((long *)mightsee)[j] 
-				& ((long *)p->portalflood)[j];
-			more |= ((long *)newmight)[j] & ~((long *)cansee)[j];
-		}
-
-		if (!more)
+		if ( !PortalBitsAndTestNew( newmight, mightsee, p->portalflood, cansee ) )
 			continue;	// can't see anything new
 
 		SetBit( cansee, pnum );
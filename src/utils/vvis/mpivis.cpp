@@ -18,8 +18,10 @@
 #include "vmpi_distribute_work.h"
 #include "iphelpers.h"
 #include "threadhelpers.h"
+#include "utlbuffer.h"
 #include "vstdlib/random.h"
 #include "vmpi_tools_shared.h"
+#include "workdist.h"
 #include <conio.h>
 #include "scratchpad_helpers.h"
 
@@ -132,6 +134,15 @@ void VMPI_DeletePortalMCSocket()
 
 void VVIS_SetupMPI( int &argc, char **&argv )
 {
+	// Distributing over WorkDist instead? The master/worker split is the same,
+	// but each process loads the map and portals from its own file system.
+	if ( WorkDist_Init( argc, argv ) )
+	{
+		g_bUseMPI = true;
+		g_bMPIMaster = WorkDist_IsCoordinator();
+		return;
+	}
+
 	if ( !VMPI_FindArg( argc, argv, "-mpi", "" ) && !VMPI_FindArg( argc, argv, VMPI_GetParamString( mpi_Worker ), "" ) )
 		return;
 
@@ -160,7 +171,16 @@ void VVIS_SetupMPI( int &argc, char **&argv )
 }
 
 
-void ProcessBasePortalVis( int iThread, uint64 iPortal, MessageBuffer *pBuf )
+static double VVIS_DistributeWork( uint64 nWorkUnits, WorkDistProcessFn processFn, WorkDistReceiveFn receiveFn, IWorkDistCallbacks *pCallbacks = NULL )
+{
+	if ( WorkDist_IsActive() )
+		return WorkDist_DistributeWork( nWorkUnits, processFn, receiveFn, pCallbacks );
+
+	return VMPI_DistributeWork( nWorkUnits, VMPI_DISTRIBUTEWORK_PACKETID, processFn, receiveFn, pCallbacks );
+}
+
+
+void ProcessBasePortalVis( int iThread, uint64 iPortal, CUtlBuffer *pBuf )
 {
 	CTimeAdder adder( &g_CPUTime );
 
@@ -170,13 +190,13 @@ void ProcessBasePortalVis( int iThread, uint64 iPortal, MessageBuffer *pBuf )
 	if ( pBuf )
 	{
 		portal_t * p = &portals[iPortal];
-		pBuf->write( p->portalfront, portalbytes );
-		pBuf->write( p->portalflood, portalbytes );
+		pBuf->Put( p->portalfront, portalbytes );
+		pBuf->Put( p->portalflood, portalbytes );
 	}
 }
 
 
-void ReceiveBasePortalVis( uint64 iWorkUnit, MessageBuffer *pBuf, int iWorker )
+void ReceiveBasePortalVis( uint64 iWorkUnit, CUtlBuffer *pBuf, int iWorker )
 {
 	portal_t * p = &portals[iWorkUnit];
 	if ( p->portalflood != 0 || p->portalfront != 0 || p->portalvis != 0) 
@@ -184,17 +204,17 @@ void ReceiveBasePortalVis( uint64 iWorkUnit, MessageBuffer *pBuf, int iWorker )
 		Msg("Duplicate portal %llu\n", iWorkUnit);
 	}
 	
-	if ( pBuf->getLen() - pBuf->getOffset() != portalbytes*2 )
+	if ( pBuf->GetBytesRemaining() != portalbytes*2 )
 		Error( "Invalid packet in ReceiveBasePortalVis." );
 
 	//
 	// allocate memory for bitwise vis solutions for this portal
 	//
 	p->portalfront = (byte*)malloc (portalbytes);
-	pBuf->read( p->portalfront, portalbytes );
+	pBuf->Get( p->portalfront, portalbytes );
 	
 	p->portalflood = (byte*)malloc (portalbytes);
-	pBuf->read( p->portalflood, portalbytes );
+	pBuf->Get( p->portalflood, portalbytes );
 
 	p->portalvis = (byte*)malloc (portalbytes);
 	memset (p->portalvis, 0, portalbytes);
@@ -222,9 +242,8 @@ void RunMPIBasePortalVis()
 
 	// Note: we're aiming for about 1500 portals in a map, so about 3000 work units.
 	g_CPUTime.Init();
-	double elapsed = DistributeWork( 
+	double elapsed = VVIS_DistributeWork( 
 		g_numportals * 2,		// # work units
-		VMPI_DISTRIBUTEWORK_PACKETID,	// packet ID
 		ProcessBasePortalVis,	// Worker function to process work units
 		ReceiveBasePortalVis	// Master function to receive work results
 		);
@@ -238,7 +257,55 @@ void RunMPIBasePortalVis()
 	//
 	// Distribute the results to all the workers.
 	//
-	if ( g_bMPIMaster )
+	if ( WorkDist_IsActive() )
+	{
+		if ( g_bMPIMaster )
+		{
+			if ( !fastvis )
+			{
+				CUtlBuffer allPortalData;
+				allPortalData.EnsureCapacity( g_numportals * 2 * portalbytes * 2 );
+				for ( i=0; i < g_numportals * 2; i++ )
+				{
+					allPortalData.Put( portals[i].portalfront, portalbytes );
+					allPortalData.Put( portals[i].portalflood, portalbytes );
+				}
+
+				WorkDist_ShareData( "portal-results", allPortalData.Base(), allPortalData.TellPut() );
+			}
+		}
+		else
+		{
+			// With fastvis there's no PortalFlow to help with.
+			if ( fastvis )
+			{
+				Msg( "VVIS worker finished. Over and out.\n" );
+				CmdLib_Exit( 0 );
+			}
+
+			CUtlBuffer allPortalData;
+			WorkDist_GetSharedData( "portal-results", allPortalData );
+			if ( allPortalData.TellPut() != g_numportals * 2 * portalbytes * 2 )
+				Error( "Invalid portal results from the WorkDist coordinator." );
+
+			for ( i=0; i < g_numportals * 2; i++ )
+			{
+				portal_t *p = &portals[i];
+
+				p->portalfront = (byte*)malloc (portalbytes);
+				allPortalData.Get( p->portalfront, portalbytes );
+
+				p->portalflood = (byte*)malloc (portalbytes);
+				allPortalData.Get( p->portalflood, portalbytes );
+
+				p->portalvis = (byte*)malloc (portalbytes);
+				memset (p->portalvis, 0, portalbytes);
+
+				p->nummightsee = CountBits (p->portalflood, g_numportals*2);
+			}
+		}
+	}
+	else if ( g_bMPIMaster )
 	{
 		if ( !fastvis )
 		{
@@ -311,7 +378,7 @@ void RunMPIBasePortalVis()
 
 
 
-void ProcessPortalFlow( int iThread, uint64 iPortal, MessageBuffer *pBuf )
+void ProcessPortalFlow( int iThread, uint64 iPortal, CUtlBuffer *pBuf )
 {
 	// Process Portal and distribute results
 	CTimeAdder adder( &g_CPUTime );
@@ -324,18 +391,18 @@ void ProcessPortalFlow( int iThread, uint64 iPortal, MessageBuffer *pBuf )
 	if ( pBuf )
 	{
 		portal_t * p = sorted_portals[iPortal];
-		pBuf->write( p->portalvis, portalbytes );
+		pBuf->Put( p->portalvis, portalbytes );
 	}
 }
 
 
-void ReceivePortalFlow( uint64 iWorkUnit, MessageBuffer *pBuf, int iWorker )
+void ReceivePortalFlow( uint64 iWorkUnit, CUtlBuffer *pBuf, int iWorker )
 {
 	portal_t *p = sorted_portals[iWorkUnit];
 
 	if ( p->status != stat_done )
 	{
-		pBuf->read( p->portalvis, portalbytes );
+		pBuf->Get( p->portalvis, portalbytes );
 		p->status = stat_done;
 
 		
@@ -409,7 +476,7 @@ void MCThreadCleanupFn()
 // been done so far.
 // --------------------------------------------------------------------------------- //
 
-class CVisDistributeWorkCallbacks : public IWorkUnitDistributorCallbacks
+class CVisDistributeWorkCallbacks : public IWorkDistCallbacks
 {
 public:
 	CVisDistributeWorkCallbacks()
@@ -530,7 +597,11 @@ void RunMPIPortalFlow()
 
 	// Workers wait until we get the MC socket address.
 	g_PortalMCThreadUniqueID = StatsDB_GetUniqueJobID();
-	if ( g_bMPIMaster )
+	if ( WorkDist_IsActive() )
+	{
+		// No multicast; WorkDist workers only see the results they computed themselves.
+	}
+	else if ( g_bMPIMaster )
 	{
 		CCycleCount cnt;
 		cnt.Sample();
@@ -600,17 +671,13 @@ void RunMPIPortalFlow()
 	VMPI_SetCurrentStage( "RunMPIBasePortalFlow" );
 
 
-	g_pDistributeWorkCallbacks = &g_VisDistributeWorkCallbacks;
-
 	g_CPUTime.Init();
-	double elapsed = DistributeWork( 
+	double elapsed = VVIS_DistributeWork( 
 		g_numportals * 2,		// # work units
-		VMPI_DISTRIBUTEWORK_PACKETID,	// packet ID
 		ProcessPortalFlow,		// Worker function to process work units
-		ReceivePortalFlow		// Master function to receive work results
+		ReceivePortalFlow,		// Master function to receive work results
+		&g_VisDistributeWorkCallbacks
 		);
-		
-	g_pDistributeWorkCallbacks = NULL;
 
 	CheckExitedEarly();
 
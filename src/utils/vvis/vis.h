@@ -10,6 +10,7 @@
 #include "cmdlib.h"
 #include "mathlib/mathlib.h"
 #include "bsplib.h"
+#include <emmintrin.h>
 
 
 #define	MAX_PORTALS	65536
@@ -120,6 +121,32 @@ extern int g_TraceClusterStart, g_TraceClusterStop;
 
 int CountBits (byte *bits, int numbits);
 
+// Bit vector operations over portalbytes, 16 bytes at a time. portalbytes is always a
+// multiple of 16, but the vectors aren't necessarily aligned.
+
+// dest = a & b. Returns true if dest has any bits that aren't set in seen.
+inline bool PortalBitsAndTestNew( byte *dest, const byte *a, const byte *b, const byte *seen )
+{
+	__m128i more = _mm_setzero_si128();
+	for ( int i = 0; i < portalbytes; i += 16 )
+	{
+		__m128i might = _mm_and_si128( _mm_loadu_si128( (const __m128i *)( a + i ) ), _mm_loadu_si128( (const __m128i *)( b + i ) ) );
+		_mm_storeu_si128( (__m128i *)( dest + i ), might );
+		more = _mm_or_si128( more, _mm_andnot_si128( _mm_loadu_si128( (const __m128i *)( seen + i ) ), might ) );
+	}
+	return _mm_movemask_epi8( _mm_cmpeq_epi8( more, _mm_setzero_si128() ) ) != 0xffff;
+}
+
+// dest |= src
+inline void PortalBitsOr( byte *dest, const byte *src )
+{
+	for ( int i = 0; i < portalbytes; i += 16 )
+	{
+		__m128i d = _mm_loadu_si128( (const __m128i *)( dest + i ) );
+		_mm_storeu_si128( (__m128i *)( dest + i ), _mm_or_si128( d, _mm_loadu_si128( (const __m128i *)( src + i ) ) ) );
+	}
+}
+
 #define CheckBit( bitstring, bitNumber )	( (bitstring)[ ((bitNumber) >> 3) ] & ( 1 << ( (bitNumber) & 7 ) ) )
 #define SetBit( bitstring, bitNumber )	( (bitstring)[ ((bitNumber) >> 3) ] |= ( 1 << ( (bitNumber) & 7 ) ) )
 #define ClearBit( bitstring, bitNumber )	( (bitstring)[ ((bitNumber) >> 3) ] &= ~( 1 << ( (bitNumber) & 7 ) ) )
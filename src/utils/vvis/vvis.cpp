@@ -18,6 +18,7 @@
 #include "collisionutils.h"
 #include "tier0/icommandline.h"
 #include "vmpi_tools_shared.h"
+#include "workdist.h"
 #include "ilaunchabledll.h"
 #include "tools_minidump.h"
 #include "loadcmdline.h"
@@ -55,6 +56,7 @@ bool		g_bUseRadius = false;
 double		g_VisRadius = 4096.0f * 4096.0f;
 
 bool		g_bLowPriority = false;
+bool		g_bBench = false;
 
 //=============================================================================
 
@@ -199,7 +201,7 @@ void ClusterMerge (int clusternum)
 //	byte		portalvector[MAX_PORTALS/8];
 	byte		portalvector[MAX_PORTALS/4];      // 4 because portal bytes is * 2
 	byte		uncompressed[MAX_MAP_LEAFS/8];
-	int			i, j;
+	int			i;
 	int			numvis;
 	portal_t	*p;
 	int			pnum;
@@ -213,8 +215,7 @@ void ClusterMerge (int clusternum)
 		p = leaf->portals[i];
 		if (p->status != stat_done)
 			Error ("portal not done %d %p %p\n", i, p, portals);
-		for (j=0 ; j<portallongs ; j++)
-			((long *)portalvector)[j] |= ((long *)p->portalvis)[j];
+		PortalBitsOr (portalvector, p->portalvis);
 		pnum = p - portals;
 		SetBit( portalvector, pnum );
 	}
@@ -308,6 +309,8 @@ void CalcPortalVis (void)
 	}
 	else 
 	{
+		// Flow in sorted order so that each portal can reuse the finished
+		// portalvis of the less visible portals ahead of it
 		RunThreadsOnIndividual (g_numportals*2, true, PortalFlow);
 	}
 }
@@ -315,7 +318,7 @@ void CalcPortalVis (void)
 
 void CalcVisTrace (void)
 {
-    RunThreadsOnIndividual (g_numportals*2, true, BasePortalVis);
+    RunThreadsOnIndividualAnyOrder (g_numportals*2, true, BasePortalVis);
 	BuildTracePortals( g_TraceClusterStart );
 	// NOTE: We only schedule the one-way portals out of the start cluster here
 	// so don't run g_numportals*2 in this case
@@ -330,16 +333,19 @@ CalcVis
 void CalcVis (void)
 {
 	int		i;
+	double	flBaseTime, flFlowTime, flMergeTime, flCompressTime;
 
+	flBaseTime = Plat_FloatTime();
 	if (g_bUseMPI) 
 	{
 		RunMPIBasePortalVis();
 	}
 	else 
 	{
-	    RunThreadsOnIndividual (g_numportals*2, true, BasePortalVis);
+	    RunThreadsOnIndividualAnyOrder (g_numportals*2, true, BasePortalVis);
 	}
 
+	flFlowTime = Plat_FloatTime();
 	SortPortals ();
 
 	CalcPortalVis ();
@@ -347,6 +353,7 @@ void CalcVis (void)
 	//
 	// assemble the leaf vis lists by oring the portal lists
 	//
+	flMergeTime = Plat_FloatTime();
 	for ( i = 0; i < portalclusters; i++ )
 	{
 		ClusterMerge( i );
@@ -354,11 +361,21 @@ void CalcVis (void)
 
 	int count = 0;
 	// Now crosscheck each leaf's vis and compress
+	flCompressTime = Plat_FloatTime();
 	for ( i = 0; i < portalclusters; i++ )
 	{
 		count += CompressAndCrosscheckClusterVis( i );
 	}
 
+	if ( g_bBench )
+	{
+		double flEndTime = Plat_FloatTime();
+		Msg ("BasePortalVis:   %.3f seconds\n", flFlowTime - flBaseTime);
+		Msg ("PortalFlow:      %.3f seconds\n", flMergeTime - flFlowTime);
+		Msg ("ClusterMerge:    %.3f seconds\n", flCompressTime - flMergeTime);
+		Msg ("CompressAndCrosscheckClusterVis: %.3f seconds\n", flEndTime - flCompressTime);
+	}
+
 		
 	Msg ("Optimized: %d visible clusters (%.2f%%)\n", count, count*100.0/totalvis);
 	Msg ("Total clusters visible: %i\n", totalvis);
@@ -414,7 +431,7 @@ void LoadPortals (char *name)
 	FILE *f;
 
 	// Open the portal file.
-	if ( g_bUseMPI )
+	if ( g_bUseMPI && !WorkDist_IsActive() )
 	{
 		// If we're using MPI, copy off the file to a temporary first. This will download the file
 		// from the MPI master, then we get to use nice functions like fscanf on it.
@@ -472,7 +489,8 @@ void LoadPortals (char *name)
 	leafbytes = ((portalclusters+63)&~63)>>3;
 	leaflongs = leafbytes/sizeof(long);
 	
-	portalbytes = ((g_numportals*2+63)&~63)>>3;
+	// padded to 128 bits for the SSE2 bit vector loops in vis.h
+	portalbytes = ((g_numportals*2+127)&~127)>>3;
 	portallongs = portalbytes/sizeof(long);
 
 // each file portal is split into two memory portals
@@ -953,6 +971,14 @@ int ParseCommandLine( int argc, char **argv )
 		{
 			g_bLowPriority = true;
 		}
+		else if( !Q_stricmp( argv[i], "-bench" ) )
+		{
+			g_bBench = true;
+		}
+		else if( !Q_stricmp( argv[i], "-pinthreads" ) )
+		{
+			g_bPinThreads = true;
+		}
 		else if ( !Q_stricmp( argv[i], "-FullMinidumps" ) )
 		{
 			EnableFullMinidumps( true );
@@ -1018,6 +1044,7 @@ void PrintUsage( int argc, char **argv )
 		"  -fast           : Only do first quick pass on vis calculations.\n"
 		"  -mpi            : Use VMPI to distribute computations.\n"
 		"  -low            : Run as an idle-priority process.\n"
+		"  -pinthreads     : Pin worker threads to processors (NUMA node by node).\n"
 		"                    env_fog_controller specifies one.\n"
 		"\n"
 		"  -vproject <directory> : Override the VPROJECT environment variable.\n"
@@ -1034,6 +1061,7 @@ void PrintUsage( int argc, char **argv )
 		"  -tmpout         : Make portals come from \\tmp\\<mapname>.\n"
 		"  -trace <start cluster> <end cluster> : Writes a linefile that traces the vis from one cluster to another for debugging map vis.\n"
 		"  -FullMinidumps  : Write large minidumps on crash.\n"
+		"  -bench          : Print the time spent in each vis phase.\n"
 		"  -x360		   : Generate Xbox360 version of vsp\n"
 		"  -nox360		   : Disable generation Xbox360 version of vsp (default)\n"
 		"\n"
@@ -1110,7 +1138,7 @@ int RunVVis( int argc, char **argv )
 	start = Plat_FloatTime();
 
 
-	if (!g_bUseMPI)
+	if ( !g_bUseMPI || WorkDist_IsCoordinator() )
 	{
 		// Setup the logfile.
 		char logFile[512];
@@ -1224,7 +1252,7 @@ int main (int argc, char **argv)
 	VVIS_SetupMPI( argc, argv );
 
 	// Install an exception handler.
-	if ( g_bUseMPI && !g_bMPIMaster )
+	if ( g_bUseMPI && !g_bMPIMaster && !WorkDist_IsActive() )
 		SetupToolsMinidumpHandler( VMPI_ExceptionFilter );
 	else
 		SetupDefaultToolsMinidumpHandler();